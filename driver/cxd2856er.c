@@ -36,19 +36,30 @@ int cxd2856er_read_regs(struct cxd2856er_demod *demod,
 	req[1].data = buf;
 	req[1].len = len;
 
-	return i2c_comm_master_request(demod->i2c, req, 2);
+	return i2c_comm_master_request_stats(demod->i2c, &demod->i2c_stats, req, 2);
 }
 
+/*
+ * Register 0x00 of both slaves selects the bank. Writes to it are skipped when
+ * the bank is already selected, and the values written to the other registers
+ * are kept in the cache so that cxd2856er_write_reg_mask() doesn't need to read
+ * them back.
+ */
 int cxd2856er_write_regs(struct cxd2856er_demod *demod,
 			 enum cxd2856er_i2c_target target,
 			 u8 reg, u8 *buf, int len)
 {
+	int ret = 0;
 	u8 b[255], addr;
 	struct i2c_comm_request req[1];
+	struct reg_cache *cache = &demod->cache[target];
 
 	if (!buf || !len || len > 254)
 		return -EINVAL;
 
+	if (!reg && len == 1 && cache->current_bank == buf[0])
+		return 0;
+
 	b[0] = reg;
 	memcpy(&b[1], buf, len);
 
@@ -60,7 +71,30 @@ int cxd2856er_write_regs(struct cxd2856er_demod *demod,
 	req[0].data = b;
 	req[0].len = 1 + len;
 
-	return i2c_comm_master_request(demod->i2c, req, 1);
+	ret = i2c_comm_master_request_stats(demod->i2c, &demod->i2c_stats, req, 1);
+	if (ret) {
+		/* the state of the device is unknown */
+		reg_cache_invalidate(cache);
+		return ret;
+	}
+
+	if (target == CXD2856ER_I2C_SLVT && reg == 0xfe) {
+		/* soft reset */
+		reg_cache_invalidate(cache);
+		return 0;
+	}
+
+	if (!reg) {
+		cache->current_bank = buf[0];
+		reg++;
+		buf++;
+		len--;
+	}
+
+	if (len)
+		reg_cache_write(cache, cache->current_bank, reg, buf, len);
+
+	return 0;
 }
 
 int cxd2856er_write_reg_mask(struct cxd2856er_demod *demod,
@@ -69,14 +103,17 @@ int cxd2856er_write_reg_mask(struct cxd2856er_demod *demod,
 {
 	int ret = 0;
 	u8 tmp;
+	struct reg_cache *cache = &demod->cache[target];
 
 	if (!mask)
 		return -EINVAL;
 
 	if (mask != 0xff) {
-		ret = cxd2856er_read_regs(demod, target, reg, &tmp, 1);
-		if (ret)
-			return ret;
+		if (!reg_cache_read(cache, cache->current_bank, reg, &tmp)) {
+			ret = cxd2856er_read_regs(demod, target, reg, &tmp, 1);
+			if (ret)
+				return ret;
+		}
 
 		tmp &= ~mask;
 		tmp |= (val & mask);
@@ -101,7 +138,7 @@ static int cxd2856er_i2c_master_request(void *i2c_priv,
 	struct cxd2856er_demod *demod = i2c_priv;
 
 	/* through */
-	return i2c_comm_master_request(demod->i2c, req, num);
+	return i2c_comm_master_request_stats(demod->i2c, &demod->i2c_stats, req, num);
 }
 
 int cxd2856er_init(struct cxd2856er_demod *demod)
@@ -121,8 +158,16 @@ int cxd2856er_init(struct cxd2856er_demod *demod)
 	demod->i2c_master.request = cxd2856er_i2c_master_request;
 	demod->i2c_master.priv = demod;
 
+	reg_cache_init(&demod->cache[CXD2856ER_I2C_SLVX],
+		       demod->cache_bank[CXD2856ER_I2C_SLVX],
+		       ARRAY_SIZE(demod->cache_bank[CXD2856ER_I2C_SLVX]));
+	reg_cache_init(&demod->cache[CXD2856ER_I2C_SLVT],
+		       demod->cache_bank[CXD2856ER_I2C_SLVT],
+		       ARRAY_SIZE(demod->cache_bank[CXD2856ER_I2C_SLVT]));
+
 	demod->state = CXD2856ER_UNKNOWN_STATE;
 	demod->system = CXD2856ER_UNSPECIFIED_SYSTEM;
+	demod->isdbt_powered = false;
 
 	ret = cxd2856er_write_slvx_reg(demod, 0x00, 0x00);
 	if (ret)
@@ -310,27 +355,12 @@ static int cxd2856er_set_ts_pin_state(struct cxd2856er_demod *demod,
 	return 0;
 }
 
-static int cxd2856er_sleep_isdbt(struct cxd2856er_demod *demod)
+/* powers down the blocks used by ISDB-T only */
+static int cxd2856er_power_down_isdbt(struct cxd2856er_demod *demod)
 {
 	int ret = 0;
 	u8 data[2];
 
-	ret = cxd2856er_write_slvt_reg(demod, 0x00, 0x00);
-	if (ret)
-		return ret;
-
-	ret = cxd2856er_write_slvt_reg(demod, 0xc3, 0x01);
-	if (ret)
-		return ret;
-
-	ret = cxd2856er_write_slvt_reg_mask(demod, 0x80, 0x1f, 0x1f);
-	if (ret)
-		return ret;
-
-	ret = cxd2856er_set_ts_pin_state(demod, false);
-	if (ret)
-		return ret;
-
 	ret = cxd2856er_write_slvt_reg(demod, 0x00, 0x10);
 	if (ret)
 		return ret;
@@ -402,6 +432,44 @@ static int cxd2856er_sleep_isdbt(struct cxd2856er_demod *demod)
 	if (ret)
 		return ret;
 
+	demod->isdbt_powered = false;
+
+	return 0;
+}
+
+/*
+ * A switch to ISDB-S (warm) leaves the ISDB-T blocks powered, they are not
+ * used by the ISDB-S demodulator and are programmed again by
+ * cxd2856er_wakeup_isdbt() anyway. They are powered down on the next sleep.
+ */
+static int cxd2856er_sleep_isdbt(struct cxd2856er_demod *demod, bool warm)
+{
+	int ret = 0;
+
+	ret = cxd2856er_write_slvt_reg(demod, 0x00, 0x00);
+	if (ret)
+		return ret;
+
+	ret = cxd2856er_write_slvt_reg(demod, 0xc3, 0x01);
+	if (ret)
+		return ret;
+
+	ret = cxd2856er_write_slvt_reg_mask(demod, 0x80, 0x1f, 0x1f);
+	if (ret)
+		return ret;
+
+	ret = cxd2856er_set_ts_pin_state(demod, false);
+	if (ret)
+		return ret;
+
+	if (warm) {
+		demod->isdbt_powered = true;
+	} else {
+		ret = cxd2856er_power_down_isdbt(demod);
+		if (ret)
+			return ret;
+	}
+
 	ret = cxd2856er_write_slvx_reg(demod, 0x00, 0x00);
 	if (ret)
 		return ret;
@@ -516,14 +584,11 @@ static int cxd2856er_sleep_isdbs(struct cxd2856er_demod *demod)
 	return 0;
 }
 
-int cxd2856er_sleep(struct cxd2856er_demod *demod)
+static void cxd2856er_sleep_system(struct cxd2856er_demod *demod, bool warm)
 {
-	if (demod->state == CXD2856ER_SLEEP_STATE)
-		return -EALREADY;
-
 	switch (demod->system) {
 	case CXD2856ER_ISDB_T_SYSTEM:
-		cxd2856er_sleep_isdbt(demod);
+		cxd2856er_sleep_isdbt(demod, warm);
 		break;
 
 	case CXD2856ER_ISDB_S_SYSTEM:
@@ -536,6 +601,17 @@ int cxd2856er_sleep(struct cxd2856er_demod *demod)
 
 	demod->state = CXD2856ER_SLEEP_STATE;
 	demod->system = CXD2856ER_UNSPECIFIED_SYSTEM;
+}
+
+int cxd2856er_sleep(struct cxd2856er_demod *demod)
+{
+	if (demod->state == CXD2856ER_SLEEP_STATE)
+		return -EALREADY;
+
+	cxd2856er_sleep_system(demod, false);
+
+	if (demod->isdbt_powered)
+		cxd2856er_power_down_isdbt(demod);
 
 	return 0;
 }
@@ -967,12 +1043,15 @@ int cxd2856er_wakeup(struct cxd2856er_demod *demod,
 			return ret;
 		}
 
-		cxd2856er_sleep(demod);
+		/* switching between the systems */
+		cxd2856er_sleep_system(demod, true);
 	}
 
 	switch (system) {
 	case CXD2856ER_ISDB_T_SYSTEM:
 		ret = cxd2856er_wakeup_isdbt(demod, params);
+		if (!ret)
+			demod->isdbt_powered = false;
 		break;
 
 	case CXD2856ER_ISDB_S_SYSTEM:
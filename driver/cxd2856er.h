@@ -17,6 +17,7 @@
 #endif
 
 #include "i2c_comm.h"
+#include "reg_cache.h"
 
 struct cxd2856er_config {
 	u32 xtal;
@@ -52,9 +53,13 @@ struct cxd2856er_demod {
 		u8 slvx;	// system
 		u8 slvt;	// demod
 	} i2c_addr;
+	struct i2c_comm_stats i2c_stats;
 	struct cxd2856er_config config;
 	enum cxd2856er_state state;
 	enum cxd2856er_system system;
+	bool isdbt_powered;	// ISDB-T blocks left on by a system switch
+	struct reg_cache cache[2];	// indexed by enum cxd2856er_i2c_target
+	struct reg_cache_bank cache_bank[2][4];
 };
 
 #ifdef __cplusplus
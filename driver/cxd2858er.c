@@ -36,7 +36,7 @@ static int cxd2858er_read_regs(struct cxd2858er_tuner *tuner,
 	req[1].data = buf;
 	req[1].len = len;
 
-	return i2c_comm_master_request(tuner->i2c, req, 2);
+	return i2c_comm_master_request_stats(tuner->i2c, &tuner->i2c_stats, req, 2);
 }
 
 static int cxd2858er_read_reg(struct cxd2858er_tuner *tuner,
@@ -62,7 +62,7 @@ static int cxd2858er_write_regs(struct cxd2858er_tuner *tuner,
 	req[0].data = b;
 	req[0].len = 1 + len;
 
-	return i2c_comm_master_request(tuner->i2c, req, 1);
+	return i2c_comm_master_request_stats(tuner->i2c, &tuner->i2c_stats, req, 1);
 }
 
 static int cxd2858er_write_reg(struct cxd2858er_tuner *tuner,
@@ -37,6 +37,7 @@ struct cxd2858er_tuner {
 	const struct device *dev;
 	const struct i2c_comm_master *i2c;
 	u8 i2c_addr;
+	struct i2c_comm_stats i2c_stats;
 	struct cxd2858er_config config;
 	enum cxd2858er_system system;
 };
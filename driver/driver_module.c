@@ -12,8 +12,16 @@
 #include <linux/module.h>
 
 #include "revision.h"
+#include "itedtv_bus.h"
 #include "px4_usb.h"
 #include "firmware.h"
+#include "r850_cache.h"
+#include "ringbuffer.h"
+#include "hotpath_prof.h"
+#include "px4_debugfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "px4_trace.h"
 
 int init_module(void)
 {
@@ -40,9 +48,14 @@ int init_module(void)
 #endif
 		"\n");
 
+	px4_debugfs_init();
+	px4_prof_init();
+
 	ret = px4_usb_register();
-	if (ret)
+	if (ret) {
+		px4_debugfs_cleanup();
 		return ret;
+	}
 
 	return 0;
 }
@@ -50,6 +63,10 @@ int init_module(void)
 void cleanup_module(void)
 {
 	px4_usb_unregister();
+	px4_debugfs_cleanup();
+	itedtv_bus_cleanup();
+	r850_cache_cleanup();
+	ringbuffer_pool_cleanup();
 }
 
 MODULE_VERSION(PX4_DRV_VERSION);
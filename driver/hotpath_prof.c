@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Profiling counters of the stream hot path (hotpath_prof.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "print_format.h"
+#include "hotpath_prof.h"
+#include "px4_debugfs.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+
+DEFINE_PER_CPU(struct px4_prof_stats, px4_prof_pcpu);
+u32 px4_prof_sample_interval = 64;	// 0: no timing
+
+static void px4_prof_sum(struct px4_prof_stats *sum)
+{
+	int cpu, i, j;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		const struct px4_prof_stats *s = per_cpu_ptr(&px4_prof_pcpu, cpu);
+
+		for (i = 0; i < PX4_PROF_COUNTER_NUM; i++)
+			sum->counter[i] += READ_ONCE(s->counter[i]);
+
+		for (i = 0; i < PX4_PROF_HIST_NUM; i++) {
+			for (j = 0; j < PX4_PROF_HIST_BUCKETS; j++)
+				sum->hist[i][j] += READ_ONCE(s->hist[i][j]);
+		}
+	}
+}
+
+static void px4_prof_show_hist(struct seq_file *m, const char *name,
+			       const u64 *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:", name);
+
+	for (i = 0; i < PX4_PROF_HIST_BUCKETS; i++)
+		seq_printf(m, " %llu", (unsigned long long)hist[i]);
+
+	seq_putc(m, '\n');
+}
+
+static int px4_prof_show(struct seq_file *m, void *v)
+{
+	struct px4_prof_stats *s;
+	const u64 *c;
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	px4_prof_sum(s);
+	c = s->counter;
+
+	seq_printf(m, "sample_interval: %u\n",
+		   READ_ONCE(px4_prof_sample_interval));
+	seq_printf(m, "stream_handler: calls=%llu bytes=%llu samples=%llu avg_ns=%llu ns_per_kib=%llu\n",
+		   c[PX4_PROF_STREAM_CALLS], c[PX4_PROF_STREAM_BYTES],
+		   c[PX4_PROF_STREAM_SAMPLES],
+		   (c[PX4_PROF_STREAM_SAMPLES]) ? div64_u64(c[PX4_PROF_STREAM_SAMPLED_NS],
+							    c[PX4_PROF_STREAM_SAMPLES])
+						: 0,
+		   (c[PX4_PROF_STREAM_SAMPLED_BYTES]) ? div64_u64(c[PX4_PROF_STREAM_SAMPLED_NS] * 1024,
+								  c[PX4_PROF_STREAM_SAMPLED_BYTES])
+						      : 0);
+	px4_prof_show_hist(m, "stream_handler_ns", s->hist[PX4_PROF_HIST_STREAM_NS]);
+	seq_printf(m, "remain_buf: joined=%llu short=%llu saved=%llu\n",
+		   c[PX4_PROF_REMAIN_JOINED], c[PX4_PROF_REMAIN_SHORT],
+		   c[PX4_PROF_REMAIN_SAVED]);
+	seq_printf(m, "resync: count=%llu bytes=%llu\n",
+		   c[PX4_PROF_RESYNCS], c[PX4_PROF_RESYNC_BYTES]);
+	px4_prof_show_hist(m, "resync_len", s->hist[PX4_PROF_HIST_RESYNC_LEN]);
+	seq_printf(m, "ringbuffer_write: calls=%llu partial=%llu nothing=%llu lost_bytes=%llu\n",
+		   c[PX4_PROF_RB_WRITES], c[PX4_PROF_RB_PARTIAL],
+		   c[PX4_PROF_RB_NOTHING], c[PX4_PROF_RB_LOST_BYTES]);
+	px4_prof_show_hist(m, "ringbuffer_lost", s->hist[PX4_PROF_HIST_RB_LOST]);
+
+	kfree(s);
+
+	return 0;
+}
+
+static int px4_prof_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, px4_prof_show, NULL);
+}
+
+/* any write clears the counters */
+static ssize_t px4_prof_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&px4_prof_pcpu, cpu), 0,
+		       sizeof(struct px4_prof_stats));
+
+	return count;
+}
+
+static const struct file_operations px4_prof_fops = {
+	.owner = THIS_MODULE,
+	.open = px4_prof_open,
+	.read = seq_read,
+	.write = px4_prof_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * debugfs is optional, nothing to do if it fails. The files are removed with
+ * the directory in px4_debugfs_cleanup().
+ */
+void px4_prof_init(void)
+{
+	debugfs_create_file("hotpath", 0600, px4_debugfs_root(), NULL,
+			    &px4_prof_fops);
+	debugfs_create_u32("sample_interval", 0600, px4_debugfs_root(),
+			   &px4_prof_sample_interval);
+}
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Profiling counters of the stream hot path (hotpath_prof.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __HOTPATH_PROF_H__
+#define __HOTPATH_PROF_H__
+
+#ifdef __linux__
+#include <linux/types.h>
+#elif defined(_WIN32) || defined(_WIN64)
+#include "misc_win.h"
+#endif
+
+/*
+ * Built with HOTPATH_PROF=1 only, otherwise all of it compiles to nothing.
+ * The counters are per CPU and summed up when read through debugfs
+ * (/sys/kernel/debug/px4_drv/hotpath). Only the timing is sampled, one of
+ * every sample_interval calls, the other counters count every event.
+ */
+
+enum px4_prof_counter {
+	PX4_PROF_STREAM_CALLS = 0,	// stream handler
+	PX4_PROF_STREAM_BYTES,
+	PX4_PROF_STREAM_SAMPLES,
+	PX4_PROF_STREAM_SAMPLED_NS,
+	PX4_PROF_STREAM_SAMPLED_BYTES,
+	PX4_PROF_REMAIN_JOINED,		// remain_buf completed with the new buffer
+	PX4_PROF_REMAIN_SHORT,		// still too short, appended to remain_buf
+	PX4_PROF_REMAIN_SAVED,		// the end of a buffer saved in remain_buf
+	PX4_PROF_RESYNCS,		// sync found after skipping some bytes
+	PX4_PROF_RESYNC_BYTES,
+	PX4_PROF_RB_WRITES,		// ringbuffer_write_atomic()
+	PX4_PROF_RB_PARTIAL,		// written partly
+	PX4_PROF_RB_NOTHING,		// nothing written
+	PX4_PROF_RB_LOST_BYTES,
+	PX4_PROF_COUNTER_NUM
+};
+
+enum px4_prof_hist_id {
+	PX4_PROF_HIST_STREAM_NS = 0,	// time in the stream handler
+	PX4_PROF_HIST_RESYNC_LEN,	// bytes skipped to find the sync
+	PX4_PROF_HIST_RB_LOST,		// bytes not written by a partial write
+	PX4_PROF_HIST_NUM
+};
+
+/* bucket 0: 0, bucket n: [2^(n-1), 2^n) */
+#define PX4_PROF_HIST_BUCKETS	32
+
+#ifdef PX4_HOTPATH_PROF
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+
+struct px4_prof_stats {
+	u64 counter[PX4_PROF_COUNTER_NUM];
+	u64 hist[PX4_PROF_HIST_NUM][PX4_PROF_HIST_BUCKETS];
+	u32 tick;
+};
+
+DECLARE_PER_CPU(struct px4_prof_stats, px4_prof_pcpu);
+extern u32 px4_prof_sample_interval;
+
+static inline void px4_prof_add(enum px4_prof_counter c, u64 val)
+{
+	this_cpu_add(px4_prof_pcpu.counter[c], val);
+}
+
+static inline void px4_prof_hist(enum px4_prof_hist_id h, u64 val)
+{
+	unsigned int n = (val) ? min_t(unsigned int, ilog2(val) + 1,
+				       PX4_PROF_HIST_BUCKETS - 1)
+			       : 0;
+
+	this_cpu_inc(px4_prof_pcpu.hist[h][n]);
+}
+
+/* returns 0 if the call is not sampled */
+static inline u64 px4_prof_sample_start(void)
+{
+	u32 interval = READ_ONCE(px4_prof_sample_interval);
+
+	if (!interval || this_cpu_inc_return(px4_prof_pcpu.tick) % interval)
+		return 0;
+
+	return ktime_get_ns();
+}
+
+static inline void px4_prof_stream_end(u64 start, u32 len)
+{
+	u64 ns;
+
+	px4_prof_add(PX4_PROF_STREAM_CALLS, 1);
+	px4_prof_add(PX4_PROF_STREAM_BYTES, len);
+
+	if (likely(!start))
+		return;
+
+	ns = ktime_get_ns() - start;
+	px4_prof_add(PX4_PROF_STREAM_SAMPLES, 1);
+	px4_prof_add(PX4_PROF_STREAM_SAMPLED_NS, ns);
+	px4_prof_add(PX4_PROF_STREAM_SAMPLED_BYTES, len);
+	px4_prof_hist(PX4_PROF_HIST_STREAM_NS, ns);
+}
+
+void px4_prof_init(void);
+#else
+static inline void px4_prof_add(enum px4_prof_counter c, u64 val) {}
+static inline void px4_prof_hist(enum px4_prof_hist_id h, u64 val) {}
+static inline u64 px4_prof_sample_start(void) { return 0; }
+static inline void px4_prof_stream_end(u64 start, u32 len) {}
+static inline void px4_prof_init(void) {}
+#endif
+
+#endif
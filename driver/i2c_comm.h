@@ -46,6 +46,107 @@ static inline int i2c_comm_master_request(const struct i2c_comm_master *m,
 	return ((m && m->request) ? m->request(m->priv, req, num) : -EFAULT);
 }
 
+/* traffic of a chip driver, updated without any lock */
+struct i2c_comm_stats {
+	u64 requests;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 errors;
+};
+
+/* i2c_comm_master_request() accounted to the chip, stats may be NULL */
+static inline int i2c_comm_master_request_stats(const struct i2c_comm_master *m,
+						struct i2c_comm_stats *stats,
+						const struct i2c_comm_request *req,
+						int num)
+{
+	int ret, i;
+
+	ret = i2c_comm_master_request(m, req, num);
+	if (!stats)
+		return ret;
+
+	stats->requests++;
+
+	for (i = 0; i < num; i++) {
+		if (req[i].req == I2C_READ_REQUEST)
+			stats->read_bytes += req[i].len;
+		else
+			stats->write_bytes += req[i].len;
+	}
+
+	if (ret)
+		stats->errors++;
+
+	return ret;
+}
+
+#define I2C_COMM_WRITE_BATCH_SIZE	128
+
+/*
+ * Accumulates writes to adjacent registers of a device with register address
+ * auto-increment, and sends each run as a single write request.
+ */
+struct i2c_comm_write_batch {
+	const struct i2c_comm_master *m;
+	struct i2c_comm_stats *stats;
+	u16 addr;
+	int len;	// including the register address, 0: empty
+	u8 buf[1 + I2C_COMM_WRITE_BATCH_SIZE];
+};
+
+static inline void i2c_comm_write_batch_init(struct i2c_comm_write_batch *b,
+					     const struct i2c_comm_master *m,
+					     struct i2c_comm_stats *stats,
+					     u16 addr)
+{
+	b->m = m;
+	b->stats = stats;
+	b->addr = addr;
+	b->len = 0;
+}
+
+static inline int i2c_comm_write_batch_flush(struct i2c_comm_write_batch *b)
+{
+	struct i2c_comm_request req[1];
+
+	if (!b->len)
+		return 0;
+
+	req[0].req = I2C_WRITE_REQUEST;
+	req[0].addr = b->addr;
+	req[0].data = b->buf;
+	req[0].len = b->len;
+
+	b->len = 0;
+
+	return i2c_comm_master_request_stats(b->m, b->stats, req, 1);
+}
+
+static inline int i2c_comm_write_batch_add(struct i2c_comm_write_batch *b,
+					   u8 reg, const u8 *data, int len)
+{
+	int ret = 0, i;
+
+	if (!data || !len || len > I2C_COMM_WRITE_BATCH_SIZE)
+		return -EINVAL;
+
+	if (b->len && (b->buf[0] + b->len - 1 != reg ||
+		       b->len - 1 + len > I2C_COMM_WRITE_BATCH_SIZE)) {
+		ret = i2c_comm_write_batch_flush(b);
+		if (ret)
+			return ret;
+	}
+
+	if (!b->len)
+		b->buf[b->len++] = reg;
+
+	for (i = 0; i < len; i++)
+		b->buf[b->len++] = data[i];
+
+	return 0;
+}
+
 #if 0
 static inline int i2c_comm_master_read(const struct i2c_comm_master *m,
 				       u8 addr, u8 *data, int len)
@@ -11,18 +11,14 @@
 #include <linux/kernel.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "px4_device_params.h"
 #include "firmware.h"
+#include "ts_demux.h"
+#include "r850_cache.h"
 
-#define ISDB2056_DEVICE_TS_SYNC_COUNT	4
-#define ISDB2056_DEVICE_TS_SYNC_SIZE	(188 * ISDB2056_DEVICE_TS_SYNC_COUNT)
-
-struct isdb2056_stream_context {
-	struct ptx_chrdev *chrdev;
-	u8 remain_buf[ISDB2056_DEVICE_TS_SYNC_SIZE];
-	size_t remain_len;
-};
+static const struct ts_demux_config isdb2056_demux_config = TS_DEMUX_SINGLE_CONFIG;
 
 static void isdb2056_device_release(struct kref *kref);
 
@@ -58,10 +54,27 @@ static int isdb2056_backend_set_power(struct isdb2056_device *isdb2056,
 	return 0;
 }
 
+struct isdb2056_rt710_init_work {
+	struct work_struct work;
+	struct rt710_tuner *rt710;
+	int ret;
+};
+
+static void isdb2056_rt710_init_work(struct work_struct *work)
+{
+	struct isdb2056_rt710_init_work *w = container_of(work,
+							  struct isdb2056_rt710_init_work,
+							  work);
+
+	w->ret = rt710_init(w->rt710);
+}
+
 static int isdb2056_backend_init(struct isdb2056_device *isdb2056)
 {
 	int ret = 0;
 	struct isdb2056_chrdev *chrdev2056 = &isdb2056->chrdev2056;
+	struct isdb2056_rt710_init_work w;
+	bool parallel = px4_device_params.parallel_tuner_init;
 
 	ret = tc90522_init(&chrdev2056->tc90522_t);
 	if (ret) {
@@ -79,15 +92,46 @@ static int isdb2056_backend_init(struct isdb2056_device *isdb2056)
 		return ret;
 	}
 
+	/*
+	 * The tuners are behind different demodulators, the rt710 is set up
+	 * while r850_init() sleeps.
+	 */
+	if (parallel) {
+		INIT_WORK_ONSTACK(&w.work, isdb2056_rt710_init_work);
+		w.rt710 = &chrdev2056->rt710;
+		w.ret = 0;
+
+		queue_work(system_unbound_wq, &w.work);
+	}
+
 	ret = r850_init(&chrdev2056->r850);
 	if (ret) {
 		dev_err(isdb2056->dev,
 			"isdb2056_backend_init: r850_init() failed. (ret: %d)\n",
 			ret);
-		return ret;
+	} else {
+		r850_cache_load(&isdb2056->it930x, 0, &chrdev2056->r850);
+	}
+
+	if (parallel) {
+		flush_work(&w.work);
+		destroy_work_on_stack(&w.work);
+
+		if (ret) {
+			if (!w.ret)
+				rt710_term(&chrdev2056->rt710);
+
+			return ret;
+		}
+
+		ret = w.ret;
+	} else {
+		if (ret)
+			return ret;
+
+		ret = rt710_init(&chrdev2056->rt710);
 	}
 
-	ret = rt710_init(&chrdev2056->rt710);
 	if (ret) {
 		dev_err(isdb2056->dev,
 			"isdb2056_backend_init: rt710_init() failed. (ret: %d)\n",
@@ -102,6 +146,7 @@ static int isdb2056_backend_term(struct isdb2056_device *isdb2056)
 {
 	struct isdb2056_chrdev *chrdev2056 = &isdb2056->chrdev2056;
 
+	r850_cache_store(&isdb2056->it930x, 0, &chrdev2056->r850);
 	r850_term(&chrdev2056->r850);
 	rt710_term(&chrdev2056->rt710);
 
@@ -111,90 +156,6 @@ static int isdb2056_backend_term(struct isdb2056_device *isdb2056)
 	return 0;
 }
 
-static void isdb2056_device_stream_process(struct ptx_chrdev *chrdev,
-					   u8 **buf, u32 *len)
-{
-	u8 *p = *buf;
-	u32 remain = *len;
-
-	while (likely(remain)) {
-		u32 i = 0;
-		bool sync_remain = false;
-
-		while (true) {
-			if (likely(((i + 1) * 188) <= remain)) {
-				if (unlikely(p[i * 188] != 0x47))
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-			i++;
-		}
-
-		if (unlikely(i < ISDB2056_DEVICE_TS_SYNC_COUNT)) {
-			p++;
-			remain--;
-			continue;
-		}
-
-		ptx_chrdev_put_stream(chrdev, p, 188 * i);
-
-		p += 188 * i;
-		remain -= 188 * i;
-
-		if (unlikely(sync_remain))
-			break;
-	}
-
-	*buf = p;
-	*len = remain;
-
-	return;
-}
-
-static int isdb2056_device_stream_handler(void *context, void *buf, u32 len)
-{
-	struct isdb2056_stream_context *stream_ctx = context;
-	u8 *ctx_remain_buf = stream_ctx->remain_buf;
-	u32 ctx_remain_len = stream_ctx->remain_len;
-	u8 *p = buf;
-	u32 remain = len;
-
-	if (unlikely(ctx_remain_len)) {
-		if (likely((ctx_remain_len + len) >= ISDB2056_DEVICE_TS_SYNC_SIZE)) {
-			u32 t = ISDB2056_DEVICE_TS_SYNC_SIZE - ctx_remain_len;
-
-			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
-			ctx_remain_len = ISDB2056_DEVICE_TS_SYNC_SIZE;
-
-			isdb2056_device_stream_process(stream_ctx->chrdev,
-						  &ctx_remain_buf,
-						  &ctx_remain_len);
-			if (likely(!ctx_remain_len)) {
-				p += t;
-				remain -= t;
-			}
-
-			stream_ctx->remain_len = 0;
-		} else {
-			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
-			stream_ctx->remain_len += len;
-
-			return 0;
-		}
-	}
-
-	isdb2056_device_stream_process(stream_ctx->chrdev, &p, &remain);
-
-	if (unlikely(remain)) {
-		memcpy(stream_ctx->remain_buf, p, remain);
-		stream_ctx->remain_len = remain;
-	}
-
-	return 0;
-}
-
 static int isdb2056_chrdev_init(struct ptx_chrdev *chrdev)
 {
 	dev_dbg(chrdev->parent->dev, "isdb2056_chrdev_init\n");
@@ -465,6 +426,8 @@ static int isdb2056_chrdev_tune(struct ptx_chrdev *chrdev,
 			"isdb2056_chrdev_tune %u: PLL is locked. count: %d\n",
 			chrdev_group->id, i);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_t(&chrdev2056->tc90522_t, true);
 		if (ret) {
 			dev_err(isdb2056->dev,
@@ -580,6 +543,8 @@ static int isdb2056_chrdev_tune(struct ptx_chrdev *chrdev,
 			"isdb2056_chrdev_tune %u: PLL is locked. count: %d, signal strength: %d.%03ddBm\n",
 			chrdev_group->id, i, ss / 1000, -ss % 1000);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_s(&chrdev2056->tc90522_s, true);
 		if (ret) {
 			dev_err(isdb2056->dev,
@@ -622,6 +587,59 @@ static int isdb2056_chrdev_check_lock(struct ptx_chrdev *chrdev, bool *locked)
 	return ret;
 }
 
+static int isdb2056_chrdev_get_lock_state(struct ptx_chrdev *chrdev,
+					  enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct isdb2056_chrdev *chrdev2056 = chrdev->priv;
+	bool locked = false;
+	u8 v;
+
+	switch (chrdev->current_system) {
+	case PTX_ISDB_T_SYSTEM:
+		ret = tc90522_is_signal_locked_t(&chrdev2056->tc90522_t, &locked);
+		if (ret)
+			return ret;
+
+		if (locked) {
+			*state = PTX_CHRDEV_LOCK_LOCKED;
+			return 0;
+		}
+
+		ret = tc90522_get_sync_state_t(&chrdev2056->tc90522_t, &v);
+		if (ret)
+			return ret;
+
+		if (v >= 8)
+			*state = PTX_CHRDEV_LOCK_TMCC;
+		else if (v >= 2)
+			*state = PTX_CHRDEV_LOCK_CARRIER;
+		else
+			*state = PTX_CHRDEV_LOCK_AGC;
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		ret = tc90522_get_status_s(&chrdev2056->tc90522_s, &v);
+		if (ret)
+			return ret;
+
+		if (!(v & 0x10))
+			*state = PTX_CHRDEV_LOCK_LOCKED;
+		else if (!(v & 0x60))
+			*state = PTX_CHRDEV_LOCK_CARRIER;
+		else if (!(v & 0x80))
+			*state = PTX_CHRDEV_LOCK_AGC;
+		else
+			*state = PTX_CHRDEV_LOCK_SEARCHING;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int isdb2056_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 					 u16 stream_id)
 {
@@ -685,8 +703,11 @@ static int isdb2056_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 		msleep(10);
 	}
 
-	if (tsid2 != tsid)
+	if (tsid2 != tsid) {
+		/* resolve the slot from the TMCC again next time */
+		tc90522_tmcc_invalidate_s(tc90522_s);
 		ret = -EAGAIN;
+	}
 
 	return ret;
 }
@@ -699,14 +720,14 @@ static int isdb2056_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	struct isdb2056_device *isdb2056 = container_of(chrdev2056,
 							struct isdb2056_device,
 							chrdev2056);
-	struct isdb2056_stream_context *stream_ctx = isdb2056->stream_ctx;
+	struct ts_demux *stream_ctx = isdb2056->stream_ctx;
 
 
 	dev_dbg(isdb2056->dev,
 		"isdb2056_chrdev_start_capture %u\n", chrdev_group->id);
 
 	ret = it930x_purge_psb(&isdb2056->it930x,
-			       px4_device_params.psb_purge_timeout);
+			       px4_device_psb_purge_timeout(&isdb2056->it930x));
 	if (ret) {
 		dev_err(isdb2056->dev,
 			"isdb2056_chrdev_start_capture %u: it930x_purge_psb() failed. (ret: %d)\n",
@@ -740,10 +761,14 @@ static int isdb2056_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	if (ret)
 		goto fail_tc;
 
-	stream_ctx->remain_len = 0;
+	ts_demux_reset(stream_ctx);
+
+	/* a single stream, its weight in the URB budget */
+	itedtv_bus_set_stream_weight(&isdb2056->it930x.bus,
+				     ptx_system_bitrate(chrdev->params.system));
 
 	ret = itedtv_bus_start_streaming(&isdb2056->it930x.bus,
-					 isdb2056_device_stream_handler,
+					 ts_demux_stream_handler,
 					 stream_ctx);
 	if (ret) {
 		dev_err(isdb2056->dev,
@@ -834,6 +859,33 @@ static int isdb2056_chrdev_read_cnr_raw(struct ptx_chrdev *chrdev, u32 *value)
 	return ret;
 }
 
+/* C/N in 0.01 dB units */
+static int isdb2056_chrdev_read_cnr(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0;
+	u32 raw = 0;
+
+	ret = isdb2056_chrdev_read_cnr_raw(chrdev, &raw);
+	if (ret)
+		return ret;
+
+	*value = (chrdev->current_system == PTX_ISDB_T_SYSTEM) ? tc90522_cndat_to_cnr_t(raw)
+							       : tc90522_cn_to_cnr_s(raw);
+
+	return 0;
+}
+
+static int isdb2056_chrdev_read_tsid(struct ptx_chrdev *chrdev,
+				     u16 *tsid, int num)
+{
+	struct isdb2056_chrdev *chrdev2056 = chrdev->priv;
+
+	if (chrdev->current_system != PTX_ISDB_S_SYSTEM)
+		return -EINVAL;
+
+	return tc90522_tmcc_get_tsid_list_s(&chrdev2056->tc90522_s, tsid, num);
+}
+
 static struct ptx_chrdev_operations isdb2056_chrdev_ops = {
 	.init = isdb2056_chrdev_init,
 	.term = isdb2056_chrdev_term,
@@ -841,12 +893,17 @@ static struct ptx_chrdev_operations isdb2056_chrdev_ops = {
 	.release = isdb2056_chrdev_release,
 	.tune = isdb2056_chrdev_tune,
 	.check_lock = isdb2056_chrdev_check_lock,
+	.get_lock_state = isdb2056_chrdev_get_lock_state,
 	.set_stream_id = isdb2056_chrdev_set_stream_id,
 	.set_lnb_voltage = NULL,
 	.set_capture = isdb2056_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = isdb2056_chrdev_read_cnr_raw
+	.read_cnr = isdb2056_chrdev_read_cnr,
+	.read_cnr_raw = isdb2056_chrdev_read_cnr_raw,
+	.set_pid_filter = NULL,
+	.set_pid_filter_entry = NULL,
+	.read_tsid = isdb2056_chrdev_read_tsid,
+	.read_stats = NULL
 };
 
 static int isdb2056_device_load_config(struct isdb2056_device *isdb2056,
@@ -898,6 +955,7 @@ static int isdb2056_device_load_config(struct isdb2056_device *isdb2056,
 	chrdev2056->r850.config.clock_out = false;
 	chrdev2056->r850.config.no_imr_calibration = true;
 	chrdev2056->r850.config.no_lpf_calibration = true;
+	chrdev2056->r850.config.light_standby = px4_device_params.t_tuner_light_standby;
 
 	chrdev2056->rt710.dev = dev;
 	chrdev2056->rt710.i2c = &chrdev2056->tc90522_s.i2c_master;
@@ -929,7 +987,7 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 	struct ptx_chrdev_config chrdev_config;
 	struct ptx_chrdev_group_config chrdev_group_config;
 	struct ptx_chrdev_group *chrdev_group;
-	struct isdb2056_stream_context *stream_ctx;
+	struct ts_demux *stream_ctx;
 
 	if (!isdb2056 || !dev || !chrdev_ctx || !quit_completion)
 		return -EINVAL;
@@ -941,6 +999,7 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 	kref_init(&isdb2056->kref);
 	isdb2056->dev = dev;
 	isdb2056->quit_completion = quit_completion;
+	isdb2056->debugfs = NULL;
 
 	stream_ctx = kzalloc(sizeof(*stream_ctx), GFP_KERNEL);
 	if (!stream_ctx) {
@@ -950,6 +1009,8 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 		goto fail;
 	}
 	isdb2056->stream_ctx = stream_ctx;
+	ts_demux_init(stream_ctx, &isdb2056_demux_config);
+	ts_demux_set_clock(stream_ctx, &isdb2056->it930x.bus.stream_time);
 
 	it930x = &isdb2056->it930x;
 	bus = &it930x->bus;
@@ -970,10 +1031,23 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 	if (ret)
 		goto fail_device;
 
+	isdb2056->debugfs = px4_debugfs_create(dev, it930x);
+	px4_debugfs_add_chip(isdb2056->debugfs, "tc90522_t", 0,
+			     &isdb2056->chrdev2056.tc90522_t.i2c_stats);
+	px4_debugfs_add_chip(isdb2056->debugfs, "tc90522_s", 0,
+			     &isdb2056->chrdev2056.tc90522_s.i2c_stats);
+	px4_debugfs_add_chip(isdb2056->debugfs, "r850", 0,
+			     &isdb2056->chrdev2056.r850.i2c_stats);
+	px4_debugfs_add_chip(isdb2056->debugfs, "rt710", 0,
+			     &isdb2056->chrdev2056.rt710.i2c_stats);
+
 	chrdev_config.ops = &isdb2056_chrdev_ops;
 	chrdev_config.options = PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T;
 	chrdev_config.ringbuf_size = 188 * px4_device_params.tsdev_max_packets;
+	chrdev_config.ringbuf_time_t = px4_device_params.tsdev_buffer_time_t;
+	chrdev_config.ringbuf_time_s = px4_device_params.tsdev_buffer_time_s;
 	chrdev_config.ringbuf_threshold_size = chrdev_config.ringbuf_size / 10;
+	chrdev_config.max_readers = px4_device_params.tsdev_max_readers;
 	chrdev_config.priv = &isdb2056->chrdev2056;
 
 	ret = it930x_load_firmware(it930x, IT930X_FIRMWARE_FILENAME);
@@ -1026,6 +1100,8 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 
 	chrdev_group_config.owner_kref = &isdb2056->kref;
 	chrdev_group_config.owner_kref_release = isdb2056_device_release;
+	chrdev_group_config.bus_stats = &it930x->bus.stats;
+	chrdev_group_config.bus = &it930x->bus;
 	chrdev_group_config.reserved = false;
 	chrdev_group_config.minor_base = 0;	/* unused */
 	chrdev_group_config.chrdev_num = 1;
@@ -1038,7 +1114,7 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 
 	isdb2056->chrdev_group = chrdev_group;
 	isdb2056->chrdev2056.chrdev = &chrdev_group->chrdev[0];
-	stream_ctx->chrdev = &chrdev_group->chrdev[0];
+	stream_ctx->chrdev[0] = &chrdev_group->chrdev[0];
 
 	atomic_set(&isdb2056->available, 1);
 	return 0;
@@ -1046,6 +1122,7 @@ int isdb2056_device_init(struct isdb2056_device *isdb2056, struct device *dev,
 fail_chrdev:
 
 fail_device:
+	px4_debugfs_remove(isdb2056->debugfs);
 	it930x_term(it930x);
 
 fail_bridge:
@@ -1067,6 +1144,7 @@ static void isdb2056_device_release(struct kref *kref)
 
 	dev_dbg(isdb2056->dev, "isdb2056_device_release\n");
 
+	px4_debugfs_remove(isdb2056->debugfs);
 	it930x_term(&isdb2056->it930x);
 	itedtv_bus_term(&isdb2056->it930x.bus);
 
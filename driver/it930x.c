@@ -14,24 +14,85 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/firmware.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
 #endif
 
+#define IT930X_CTRL_BUF_SIZE	256
+#define IT930X_FW_PIPELINE_MAX	16
+#define IT930X_PSB_SIZE		512
+#define IT930X_PSB_PROBE_TIMEOUT	20
+
+/*
+ * Each I2C bus of the bridge has its own lock, so the requests to the devices
+ * on different buses are interleaved and, with ctrl_pipeline, in flight at the
+ * same time. The lock keeps the messages of a request together on its bus.
+ */
 struct it930x_i2c_master_info {
 	struct it930x_bridge *it930x;
+	struct mutex lock;
 	u8 bus;
 };
 
 struct it930x_gpio_state {
 	bool enable;
 	enum it930x_gpio_mode mode;
+	bool out_valid;		// the output level below has been written
+	bool out_high;
+};
+
+struct it930x_fw_block {
+	u32 ofs;
+	u8 len;
+};
+
+/*
+ * Firmware image split into scatter-write blocks. On Linux the images are
+ * cached at module level and shared by every bridge which loaded them, so
+ * the file is read and parsed only once however many devices are attached.
+ */
+struct it930x_fw_image {
+#ifdef __linux__
+	struct list_head list;
+	struct kref kref;
+#endif
+	char name[64];
+	const struct firmware *fw;
+	size_t num;
+	struct it930x_fw_block block[];
+};
+
+#ifdef __linux__
+static DEFINE_MUTEX(it930x_fw_cache_lock);
+static LIST_HEAD(it930x_fw_cache);
+
+struct it930x_ctrl_waiter {
+	struct list_head list;
+	u8 seq;
+	u8 *buf;
+	int rlen;
+	bool done;
 };
+#endif
 
 struct it930x_priv {
 	struct mutex ctrl_lock;
-	struct mutex i2c_lock;
+#ifdef __linux__
+	struct mutex rx_lock;
+	spinlock_t waiter_lock;
+	struct list_head waiter_list;
+	spinlock_t stats_lock;
+	struct it930x_ctrl_stats ctrl_stats[IT930X_CTRL_STAT_NUM];
+#endif
 	struct mutex gpio_lock;
+	struct mutex pid_filter_lock;
 	u8 *buf;
 	u8 seq;
+	struct it930x_fw_image *fw_image;
+	bool fw_running;	// found running by it930x_load_firmware()
 	struct it930x_i2c_master_info i2c[3];
 	struct it930x_gpio_state status[16];
 };
@@ -75,28 +136,15 @@ static u16 it930x_calc_checksum(void *buf, size_t len)
 	return ~c;
 }
 
-static int it930x_ctrl_msg(struct it930x_bridge *it930x,
-			   u16 cmd,
-			   struct it930x_ctrl_buf *wbuf,
-			   struct it930x_ctrl_buf *rbuf,
-			   u8 *result, bool no_rx)
+static u8 it930x_ctrl_build(u8 *buf, u16 cmd, u8 seq,
+			    struct it930x_ctrl_buf *wbuf)
 {
-	int ret;
-	struct it930x_priv *priv = it930x->priv;
-	u8 *buf, len, seq;
-	u16 csum, csum2;
-	int rlen = 256;
-
-	if (wbuf && wbuf->len > (255 - 3 - 2))
-		return -EINVAL;
-
-	mutex_lock(&priv->ctrl_lock);
+	u8 len;
+	u16 csum;
 
-	buf = priv->buf;
 	len = 4 + 2;
 	if (wbuf)
 		len += wbuf->len;
-	seq = priv->seq++;
 
 	buf[0] = len - 1;
 	buf[1] = ((cmd >> 8) & 0xff);
@@ -109,23 +157,21 @@ static int it930x_ctrl_msg(struct it930x_bridge *it930x,
 	buf[len - 2] = ((csum >> 8) & 0xff);
 	buf[len - 1] = (csum & 0xff);
 
-	ret = itedtv_bus_ctrl_tx(&it930x->bus, buf, len);
-	if (ret)
-		goto exit;
-
-	if (no_rx)
-		goto exit;
+	return len;
+}
 
-	ret = itedtv_bus_ctrl_rx(&it930x->bus, buf, &rlen);
-	if (ret)
-		goto exit;
+static int it930x_ctrl_parse(struct it930x_bridge *it930x,
+			     u8 *buf, int rlen, u8 seq,
+			     struct it930x_ctrl_buf *rbuf, u8 *result)
+{
+	int ret = 0;
+	u16 csum, csum2;
 
 	if (rlen < 5) {
 		dev_err(it930x->dev,
 			"it930x_ctrl_msg: no enough response length. (rlen: %d)\n",
 			rlen);
-		ret = -EBADMSG;
-		goto exit;
+		return -EBADMSG;
 	}
 
 	csum = it930x_calc_checksum(&buf[1], (size_t)rlen - 1 - 2);
@@ -134,16 +180,14 @@ static int it930x_ctrl_msg(struct it930x_bridge *it930x,
 		dev_err(it930x->dev,
 			"it930x_ctrl_msg: checksum is incorrect. (0x%04x, 0x%04x)\n",
 			csum, csum2);
-		ret = -EBADMSG;
-		goto exit;
+		return -EBADMSG;
 	}
 
 	if (buf[1] != seq) {
 		dev_err(it930x->dev,
 			"it930x_ctrl_msg: sequence number is incorrect. (tx: 0x%02x, rx: 0x%02x, csum: 0x%04x)\n",
 			seq, buf[1], csum);
-		ret = -EBADMSG;
-		goto exit;
+		return -EBADMSG;
 	}
 
 	if (buf[2]) {
@@ -164,6 +208,233 @@ static int it930x_ctrl_msg(struct it930x_bridge *it930x,
 	if (result)
 		*result = buf[2];
 
+	return ret;
+}
+
+#ifdef __linux__
+/*
+ * Pipelined control messages: the requests are sent under ctrl_lock only,
+ * and whoever holds rx_lock reads the responses and hands each of them to
+ * the waiter with the matching sequence number, until its own has arrived.
+ */
+static int it930x_ctrl_msg_pipelined(struct it930x_bridge *it930x,
+				     u16 cmd,
+				     struct it930x_ctrl_buf *wbuf,
+				     struct it930x_ctrl_buf *rbuf,
+				     u8 *result)
+{
+	int ret = 0;
+	struct it930x_priv *priv = it930x->priv;
+	struct it930x_ctrl_waiter w;
+	u8 *buf, len;
+
+	/* the buffers are handed to the USB core, they must not be on stack */
+	buf = kmalloc(IT930X_CTRL_BUF_SIZE * 2, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	w.buf = buf + IT930X_CTRL_BUF_SIZE;
+	w.rlen = 0;
+	w.done = false;
+
+	mutex_lock(&priv->ctrl_lock);
+
+	w.seq = priv->seq++;
+	len = it930x_ctrl_build(buf, cmd, w.seq, wbuf);
+
+	spin_lock(&priv->waiter_lock);
+	list_add_tail(&w.list, &priv->waiter_list);
+	spin_unlock(&priv->waiter_lock);
+
+	ret = itedtv_bus_ctrl_tx(&it930x->bus, buf, len);
+
+	mutex_unlock(&priv->ctrl_lock);
+
+	if (ret)
+		goto exit;
+
+	mutex_lock(&priv->rx_lock);
+
+	while (!w.done) {
+		struct it930x_ctrl_waiter *t;
+		int rlen = IT930X_CTRL_BUF_SIZE;
+		bool found = false;
+
+		ret = itedtv_bus_ctrl_rx(&it930x->bus, w.buf, &rlen);
+		if (ret)
+			break;
+
+		if (rlen < 5) {
+			w.rlen = rlen;
+			break;
+		}
+
+		spin_lock(&priv->waiter_lock);
+
+		list_for_each_entry(t, &priv->waiter_list, list) {
+			if (t->done || t->seq != w.buf[1])
+				continue;
+
+			if (t != &w)
+				memcpy(t->buf, w.buf, rlen);
+
+			t->rlen = rlen;
+			t->done = true;
+			found = true;
+			break;
+		}
+
+		spin_unlock(&priv->waiter_lock);
+
+		if (!found)
+			dev_dbg(it930x->dev,
+				"it930x_ctrl_msg_pipelined: no waiter. (seq: 0x%02x)\n",
+				w.buf[1]);
+	}
+
+	mutex_unlock(&priv->rx_lock);
+
+	if (!ret)
+		ret = it930x_ctrl_parse(it930x, w.buf, w.rlen, w.seq,
+					rbuf, result);
+
+exit:
+	spin_lock(&priv->waiter_lock);
+	list_del(&w.list);
+	spin_unlock(&priv->waiter_lock);
+
+	if (ret)
+		dev_err(it930x->dev,
+			"it930x_ctrl_msg: operation failed. (cmd: 0x%04x, ret: %d)\n",
+			cmd, ret);
+
+	kfree(buf);
+
+	return ret;
+}
+#endif
+
+#ifdef __linux__
+static void it930x_ctrl_account(struct it930x_bridge *it930x, u16 cmd,
+				u32 bytes, u64 start, int ret)
+{
+	struct it930x_priv *priv = it930x->priv;
+	struct it930x_ctrl_stats *s;
+	u64 ns = ktime_get_ns() - start;
+
+	switch (cmd) {
+	case IT930X_CMD_REG_READ:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_REG_READ];
+		break;
+
+	case IT930X_CMD_REG_WRITE:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_REG_WRITE];
+		break;
+
+	case IT930X_CMD_I2C_READ:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_I2C_READ];
+		break;
+
+	case IT930X_CMD_I2C_WRITE:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_I2C_WRITE];
+		break;
+
+	case IT930X_CMD_FW_SCATTER_WRITE:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_FW_SCATTER_WRITE];
+		break;
+
+	default:
+		s = &priv->ctrl_stats[IT930X_CTRL_STAT_OTHER];
+		break;
+	}
+
+	spin_lock(&priv->stats_lock);
+
+	s->count++;
+	if (ret)
+		s->errors++;
+	else
+		s->bytes += bytes;
+	s->total_ns += ns;
+	latency_hist_add(&s->latency, ns);
+
+	spin_unlock(&priv->stats_lock);
+}
+
+static inline u32 it930x_ctrl_bytes(struct it930x_ctrl_buf *wbuf,
+				    struct it930x_ctrl_buf *rbuf)
+{
+	return ((wbuf) ? wbuf->len : 0) + ((rbuf) ? rbuf->len : 0);
+}
+
+void it930x_get_ctrl_stats(struct it930x_bridge *it930x,
+			   struct it930x_ctrl_stats *stats)
+{
+	struct it930x_priv *priv = it930x->priv;
+
+	spin_lock(&priv->stats_lock);
+	memcpy(stats, priv->ctrl_stats, sizeof(priv->ctrl_stats));
+	spin_unlock(&priv->stats_lock);
+}
+
+void it930x_clear_ctrl_stats(struct it930x_bridge *it930x)
+{
+	struct it930x_priv *priv = it930x->priv;
+
+	spin_lock(&priv->stats_lock);
+	memset(priv->ctrl_stats, 0, sizeof(priv->ctrl_stats));
+	spin_unlock(&priv->stats_lock);
+}
+#endif
+
+static int it930x_ctrl_msg(struct it930x_bridge *it930x,
+			   u16 cmd,
+			   struct it930x_ctrl_buf *wbuf,
+			   struct it930x_ctrl_buf *rbuf,
+			   u8 *result, bool no_rx)
+{
+	int ret;
+	struct it930x_priv *priv = it930x->priv;
+	u8 *buf, len, seq;
+	int rlen = IT930X_CTRL_BUF_SIZE;
+#ifdef __linux__
+	u64 start;
+#endif
+
+	if (wbuf && wbuf->len > (255 - 3 - 2))
+		return -EINVAL;
+
+#ifdef __linux__
+	start = ktime_get_ns();
+
+	if (it930x->config.ctrl_pipeline && !no_rx) {
+		ret = it930x_ctrl_msg_pipelined(it930x, cmd, wbuf, rbuf,
+						result);
+		it930x_ctrl_account(it930x, cmd, it930x_ctrl_bytes(wbuf, rbuf),
+				    start, ret);
+		return ret;
+	}
+#endif
+
+	mutex_lock(&priv->ctrl_lock);
+
+	buf = priv->buf;
+	seq = priv->seq++;
+	len = it930x_ctrl_build(buf, cmd, seq, wbuf);
+
+	ret = itedtv_bus_ctrl_tx(&it930x->bus, buf, len);
+	if (ret)
+		goto exit;
+
+	if (no_rx)
+		goto exit;
+
+	ret = itedtv_bus_ctrl_rx(&it930x->bus, buf, &rlen);
+	if (ret)
+		goto exit;
+
+	ret = it930x_ctrl_parse(it930x, buf, rlen, seq, rbuf, result);
+
 exit:
 	if (ret)
 		dev_err(it930x->dev,
@@ -172,6 +443,12 @@ exit:
 
 	mutex_unlock(&priv->ctrl_lock);
 
+#ifdef __linux__
+	it930x_ctrl_account(it930x, cmd,
+			    it930x_ctrl_bytes(wbuf, (no_rx) ? NULL : rbuf),
+			    start, ret);
+#endif
+
 	return ret;
 }
 
@@ -261,15 +538,48 @@ int it930x_write_reg_mask(struct it930x_bridge *it930x,
 	return it930x_write_reg(it930x, reg, tmp);
 }
 
+/*
+ * Consecutive entries with adjacent addresses are sent as a single
+ * IT930X_CMD_REG_WRITE, other entries are written in the given order.
+ */
+int it930x_write_multiple_regs(struct it930x_bridge *it930x,
+			       const struct it930x_regbuf *regbuf, int num)
+{
+	int ret = 0, i, n;
+	u8 buf[244];
+
+	if (!regbuf || !num)
+		return -EINVAL;
+
+	for (i = 0; i < num; i += n) {
+		u32 reg = regbuf[i].reg;
+
+		buf[0] = regbuf[i].val;
+
+		for (n = 1; i + n < num && n < sizeof(buf); n++) {
+			if (regbuf[i + n].reg != reg + n ||
+			    it930x_reg_length(reg + n) != it930x_reg_length(reg))
+				break;
+
+			buf[n] = regbuf[i + n].val;
+		}
+
+		ret = it930x_write_regs(it930x, reg, buf, n);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
 static int it930x_i2c_master_request(void *i2c_priv,
 				     const struct i2c_comm_request *req,
 				     int num)
 {
 	int ret = 0, i;
 	struct it930x_i2c_master_info *i2c = i2c_priv;
-	struct it930x_priv *priv = i2c->it930x->priv;
 
-	mutex_lock(&priv->i2c_lock);
+	mutex_lock(&i2c->lock);
 
 	for (i = 0; i < num; i++) {
 		u16 addr;
@@ -346,7 +656,7 @@ static int it930x_i2c_master_request(void *i2c_priv,
 			break;
 	}
 
-	mutex_unlock(&priv->i2c_lock);
+	mutex_unlock(&i2c->lock);
 
 	return ret;
 }
@@ -539,49 +849,219 @@ exit:
 	return (ret) ? ret : ret2;
 }
 
-int it930x_init(struct it930x_bridge *it930x)
+static int it930x_fw_image_parse(struct it930x_bridge *it930x,
+				 const char *filename,
+				 const struct firmware *fw,
+				 struct it930x_fw_image **image)
 {
-	int ret = 0;
-	struct it930x_priv *priv;
-	u8 *buf = NULL;
-	int i;
+	struct it930x_fw_image *img;
+	size_t i, n = fw->size, len = 0, num = 0;
+	bool count = true;
 
-	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
-	if (!priv) {
-		ret = -ENOMEM;
-		goto fail;
-	}
+	img = NULL;
 
-	buf = kmalloc(sizeof(u8) * 256, GFP_KERNEL);
-	if (!buf) {
-		ret = -ENOMEM;
-		goto fail;
-	}
+again:
+	for (i = 0; i < n; i += len) {
+		const u8 *p = &fw->data[i];
+		unsigned j, m;
 
-	mutex_init(&priv->ctrl_lock);
-	mutex_init(&priv->i2c_lock);
-	mutex_init(&priv->gpio_lock);
+		len = 0;
 
-	priv->buf = buf;
+		if (n - i < 4 || p[0] != 0x03) {
+			dev_err(it930x->dev,
+				"it930x_load_firmware: Invalid firmware block was found. Abort. (ofs: %zx)\n",
+				i);
+			goto fail;
+		}
 
-	/* setup the i2c operator */
+		m = p[3];
 
-	for (i = 0; i < 3; i++) {
-		priv->i2c[i].it930x = it930x;
-		priv->i2c[i].bus = i + 1;
+		if (n - i < 4 + ((size_t)m * 3)) {
+			dev_err(it930x->dev,
+				"it930x_load_firmware: Truncated firmware block was found. Abort. (ofs: %zx)\n",
+				i);
+			goto fail;
+		}
 
-		it930x->i2c_master[i].gate_ctrl = NULL;
-		it930x->i2c_master[i].request = it930x_i2c_master_request;
-		it930x->i2c_master[i].priv = &priv->i2c[i];
-	}
+		for(j = 0; j < m; j++)
+			len += p[6 + (j * 3)];
 
-	it930x->priv = priv;
+		if (!len) {
+			if (count)
+				dev_warn(it930x->dev,
+					 "it930x_load_firmware: No data in the block. (ofs: %zx)\n",
+					 i);
+			len = 4 + ((size_t)m * 3);
+			continue;
+		}
 
-	return 0;
+		len += 4 + ((size_t)m * 3);
 
-fail:
-	if (buf)
-		kfree(buf);
+		if (len > (255 - 3 - 2) || len > n - i) {
+			dev_err(it930x->dev,
+				"it930x_load_firmware: Invalid firmware block length. Abort. (ofs: %zx, len: %zu)\n",
+				i, len);
+			goto fail;
+		}
+
+		if (!count) {
+			img->block[num].ofs = (u32)i;
+			img->block[num].len = (u8)len;
+		}
+		num++;
+	}
+
+	if (count) {
+		img = kzalloc(sizeof(*img) + (sizeof(img->block[0]) * num),
+			      GFP_KERNEL);
+		if (!img)
+			return -ENOMEM;
+
+		count = false;
+		num = 0;
+		goto again;
+	}
+
+	snprintf(img->name, sizeof(img->name), "%s", filename);
+	img->fw = fw;
+	img->num = num;
+
+	*image = img;
+
+	return 0;
+
+fail:
+	if (img)
+		kfree(img);
+
+	return -ECANCELED;
+}
+
+static int it930x_fw_image_get(struct it930x_bridge *it930x,
+			       const char *filename,
+			       struct it930x_fw_image **image)
+{
+	int ret = 0;
+	const struct firmware *fw;
+
+#ifdef __linux__
+	struct it930x_fw_image *img;
+
+	mutex_lock(&it930x_fw_cache_lock);
+
+	list_for_each_entry(img, &it930x_fw_cache, list) {
+		if (strcmp(img->name, filename))
+			continue;
+
+		kref_get(&img->kref);
+		*image = img;
+		goto exit;
+	}
+#endif
+
+	ret = request_firmware(&fw, filename, it930x->dev);
+	if (ret) {
+		dev_err(it930x->dev,
+			"it930x_load_firmware: request_firmware() failed. (ret: %d)\n",
+			ret);
+		dev_err(it930x->dev,
+			"Couldn't load firmware from the file.\n");
+		goto exit;
+	}
+
+	ret = it930x_fw_image_parse(it930x, filename, fw, image);
+	if (ret) {
+		release_firmware(fw);
+		goto exit;
+	}
+
+#ifdef __linux__
+	kref_init(&(*image)->kref);
+	list_add_tail(&(*image)->list, &it930x_fw_cache);
+#endif
+
+exit:
+#ifdef __linux__
+	mutex_unlock(&it930x_fw_cache_lock);
+#endif
+	return ret;
+}
+
+#ifdef __linux__
+static void it930x_fw_image_release(struct kref *kref)
+{
+	struct it930x_fw_image *image = container_of(kref,
+						     struct it930x_fw_image,
+						     kref);
+
+	list_del(&image->list);
+	release_firmware(image->fw);
+	kfree(image);
+}
+#endif
+
+static void it930x_fw_image_put(struct it930x_fw_image *image)
+{
+#ifdef __linux__
+	mutex_lock(&it930x_fw_cache_lock);
+	kref_put(&image->kref, it930x_fw_image_release);
+	mutex_unlock(&it930x_fw_cache_lock);
+#else
+	release_firmware(image->fw);
+	kfree(image);
+#endif
+}
+
+int it930x_init(struct it930x_bridge *it930x)
+{
+	int ret = 0;
+	struct it930x_priv *priv;
+	u8 *buf = NULL;
+	int i;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	buf = kmalloc(sizeof(u8) * IT930X_CTRL_BUF_SIZE, GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	mutex_init(&priv->ctrl_lock);
+#ifdef __linux__
+	mutex_init(&priv->rx_lock);
+	spin_lock_init(&priv->waiter_lock);
+	INIT_LIST_HEAD(&priv->waiter_list);
+	spin_lock_init(&priv->stats_lock);
+#endif
+	mutex_init(&priv->gpio_lock);
+	mutex_init(&priv->pid_filter_lock);
+
+	priv->buf = buf;
+
+	/* setup the i2c operator */
+
+	for (i = 0; i < 3; i++) {
+		priv->i2c[i].it930x = it930x;
+		mutex_init(&priv->i2c[i].lock);
+		priv->i2c[i].bus = i + 1;
+
+		it930x->i2c_master[i].gate_ctrl = NULL;
+		it930x->i2c_master[i].request = it930x_i2c_master_request;
+		it930x->i2c_master[i].priv = &priv->i2c[i];
+	}
+
+	it930x->priv = priv;
+
+	return 0;
+
+fail:
+	if (buf)
+		kfree(buf);
 
 	if (priv)
 		kfree(priv);
@@ -597,17 +1077,25 @@ int it930x_term(struct it930x_bridge *it930x)
 	if (priv->buf)
 		kfree(priv->buf);
 
+	if (priv->fw_image)
+		it930x_fw_image_put(priv->fw_image);
+
 	/* clear the i2c operator */
 
 	for (i = 0; i < 3; i++) {
 		it930x->i2c_master[i].gate_ctrl = NULL;
 		it930x->i2c_master[i].request = NULL;
 		it930x->i2c_master[i].priv = NULL;
+
+		mutex_destroy(&priv->i2c[i].lock);
 	}
 
 	mutex_destroy(&priv->ctrl_lock);
-	mutex_destroy(&priv->i2c_lock);
+#ifdef __linux__
+	mutex_destroy(&priv->rx_lock);
+#endif
 	mutex_destroy(&priv->gpio_lock);
+	mutex_destroy(&priv->pid_filter_lock);
 
 	kfree(priv);
 
@@ -629,13 +1117,121 @@ int it930x_raise(struct it930x_bridge *it930x)
 	return ret;
 }
 
+/*
+ * Firmware upload with up to 'depth' scatter-write blocks in flight.
+ * ctrl_lock (and rx_lock on Linux) is held for the whole upload, so the
+ * responses arrive in the order the blocks were sent and are checked
+ * against the sequence numbers recorded in a small ring.
+ */
+struct it930x_fw_pipe {
+	unsigned int depth;
+	unsigned int head;
+	unsigned int num;
+	u8 seq[IT930X_FW_PIPELINE_MAX];
+	size_t ofs[IT930X_FW_PIPELINE_MAX];
+#ifdef __linux__
+	u8 len[IT930X_FW_PIPELINE_MAX];
+	u64 start[IT930X_FW_PIPELINE_MAX];	// accounted when the response is read
+#endif
+};
+
+static int it930x_fw_pipe_collect(struct it930x_bridge *it930x,
+				  struct it930x_fw_pipe *pipe)
+{
+	int ret;
+	struct it930x_priv *priv = it930x->priv;
+	int rlen = IT930X_CTRL_BUF_SIZE;
+	unsigned int idx = pipe->head;
+
+	pipe->head = (pipe->head + 1) % IT930X_FW_PIPELINE_MAX;
+	pipe->num--;
+
+	ret = itedtv_bus_ctrl_rx(&it930x->bus, priv->buf, &rlen);
+	if (!ret)
+		ret = it930x_ctrl_parse(it930x, priv->buf, rlen,
+					pipe->seq[idx], NULL, NULL);
+
+#ifdef __linux__
+	it930x_ctrl_account(it930x, IT930X_CMD_FW_SCATTER_WRITE,
+			    pipe->len[idx], pipe->start[idx], ret);
+#endif
+
+	if (ret)
+		dev_err(it930x->dev,
+			"it930x_load_firmware: IT930X_CMD_FW_SCATTER_WRITE failed. (ofs: %zx, ret: %d)\n",
+			pipe->ofs[idx], ret);
+
+	return ret;
+}
+
+static int it930x_fw_pipe_submit(struct it930x_bridge *it930x,
+				 struct it930x_fw_pipe *pipe,
+				 struct it930x_ctrl_buf *wbuf, size_t ofs)
+{
+	int ret;
+	struct it930x_priv *priv = it930x->priv;
+	unsigned int idx;
+	u8 len;
+
+	if (pipe->num >= pipe->depth) {
+		ret = it930x_fw_pipe_collect(it930x, pipe);
+		if (ret)
+			return ret;
+	}
+
+	idx = (pipe->head + pipe->num) % IT930X_FW_PIPELINE_MAX;
+	pipe->seq[idx] = priv->seq++;
+	pipe->ofs[idx] = ofs;
+#ifdef __linux__
+	pipe->len[idx] = wbuf->len;
+	pipe->start[idx] = ktime_get_ns();
+#endif
+
+	len = it930x_ctrl_build(priv->buf, IT930X_CMD_FW_SCATTER_WRITE,
+				pipe->seq[idx], wbuf);
+
+	ret = itedtv_bus_ctrl_tx(&it930x->bus, priv->buf, len);
+	if (ret) {
+#ifdef __linux__
+		it930x_ctrl_account(it930x, IT930X_CMD_FW_SCATTER_WRITE,
+				    wbuf->len, pipe->start[idx], ret);
+#endif
+		dev_err(it930x->dev,
+			"it930x_load_firmware: itedtv_bus_ctrl_tx() failed. (ofs: %zx, ret: %d)\n",
+			ofs, ret);
+		return ret;
+	}
+
+	pipe->num++;
+
+	return 0;
+}
+
+static int it930x_fw_pipe_drain(struct it930x_bridge *it930x,
+				struct it930x_fw_pipe *pipe)
+{
+	int ret = 0;
+
+	while (pipe->num) {
+		int r = it930x_fw_pipe_collect(it930x, pipe);
+
+		/* keep reading so that no stale response is left behind */
+		if (r && !ret)
+			ret = r;
+	}
+
+	return ret;
+}
+
 int it930x_load_firmware(struct it930x_bridge *it930x, const char *filename)
 {
 	int ret = 0;
 	u32 fw_version;
-	const struct firmware *fw;
-	size_t i, n, len = 0;
+	struct it930x_fw_image *image;
+	size_t i;
 	struct it930x_ctrl_buf wb;
+	struct it930x_priv *priv = it930x->priv;
+	struct it930x_fw_pipe pipe;
 
 	if (!filename)
 		return -EINVAL;
@@ -653,9 +1249,12 @@ int it930x_load_firmware(struct it930x_bridge *it930x, const char *filename)
 			 "Firmware is already loaded. version: %d.%d.%d.%d\n",
 			 (fw_version >> 24) & 0xff, (fw_version >> 16) & 0xff,
 			 (fw_version >> 8) & 0xff, fw_version & 0xff);
+		priv->fw_running = true;
 		return ret;
 	}
 
+	priv->fw_running = false;
+
 	ret = it930x_write_reg(it930x, 0xf103, it930x->config.i2c_speed);
 	if (ret) {
 		dev_err(it930x->dev,
@@ -664,48 +1263,49 @@ int it930x_load_firmware(struct it930x_bridge *it930x, const char *filename)
 		return ret;
 	}
 
-	ret = request_firmware(&fw, filename, it930x->dev);
-	if (ret) {
-		dev_err(it930x->dev,
-			"it930x_load_firmware: request_firmware() failed. (ret: %d)\n",
-			ret);
-		dev_err(it930x->dev,
-			"Couldn't load firmware from the file.\n");
-		return ret;
-	}
+	image = priv->fw_image;
+	if (!image || strcmp(image->name, filename)) {
+		if (image) {
+			priv->fw_image = NULL;
+			it930x_fw_image_put(image);
+		}
 
-	n = fw->size;
+		ret = it930x_fw_image_get(it930x, filename, &image);
+		if (ret)
+			return ret;
 
-	for (i = 0; i < n; i += len) {
-		const u8 *p = &fw->data[i];
-		unsigned j, m = p[3];
+		/* keep the reference until it930x_term() */
+		priv->fw_image = image;
+	}
 
-		len = 0;
+	pipe.depth = it930x->config.fw_pipeline_depth;
+	if (pipe.depth > IT930X_FW_PIPELINE_MAX)
+		pipe.depth = IT930X_FW_PIPELINE_MAX;
+	pipe.head = 0;
+	pipe.num = 0;
 
-		if (p[0] != 0x03) {
-			dev_err(it930x->dev,
-				"it930x_load_firmware: Invalid firmware block was found. Abort. (ofs: %zx)\n",
-				i);
-			ret = -ECANCELED;
-			goto exit;
-		}
+	if (pipe.depth > 1) {
+		mutex_lock(&priv->ctrl_lock);
+#ifdef __linux__
+		mutex_lock(&priv->rx_lock);
+#endif
+	}
 
-		for(j = 0; j < m; j++)
-			len += p[6 + (j * 3)];
+	for (i = 0; i < image->num; i++) {
+		const struct it930x_fw_block *b = &image->block[i];
 
-		if (!len) {
-			dev_warn(it930x->dev,
-				 "it930x_load_firmware: No data in the block. (ofs: %zx)\n",
-				 i);
-			continue;
-		}
+		/* send firmware block */
 
-		len += 4 + ((size_t)m * 3);
+		wb.buf = (u8 *)&image->fw->data[b->ofs];
+		wb.len = b->len;
 
-		/* send firmware block */
+		if (pipe.depth > 1) {
+			ret = it930x_fw_pipe_submit(it930x, &pipe, &wb, b->ofs);
+			if (ret)
+				break;
 
-		wb.buf = (u8 *)p;
-		wb.len = (u8)len;
+			continue;
+		}
 
 		ret = it930x_ctrl_msg(it930x,
 				      IT930X_CMD_FW_SCATTER_WRITE,
@@ -713,18 +1313,33 @@ int it930x_load_firmware(struct it930x_bridge *it930x, const char *filename)
 				      NULL, false);
 		if (ret) {
 			dev_err(it930x->dev,
-				"it930x_load_firmware: it930x_ctrl_msg(IT930X_CMD_FW_SCATTER_WRITE) failed. (ofs: %zx, ret: %d)\n",
-				i, ret);
-			goto exit;
+				"it930x_load_firmware: it930x_ctrl_msg(IT930X_CMD_FW_SCATTER_WRITE) failed. (ofs: %x, ret: %d)\n",
+				b->ofs, ret);
+			return ret;
 		}
 	}
 
+	if (pipe.depth > 1) {
+		int r = it930x_fw_pipe_drain(it930x, &pipe);
+
+		if (!ret)
+			ret = r;
+
+#ifdef __linux__
+		mutex_unlock(&priv->rx_lock);
+#endif
+		mutex_unlock(&priv->ctrl_lock);
+
+		if (ret)
+			return ret;
+	}
+
 	ret = it930x_ctrl_msg(it930x, IT930X_CMD_BOOT, NULL, NULL, NULL, false);
 	if (ret) {
 		dev_err(it930x->dev,
 			"it930x_load_firmware: it930x_ctrl_msg(IT930X_CMD_BOOT) failed. (ret: %d)\n",
 			ret);
-		goto exit;
+		return ret;
 	}
 
 	ret = it930x_read_firmware_version(it930x, &fw_version);
@@ -732,53 +1347,156 @@ int it930x_load_firmware(struct it930x_bridge *it930x, const char *filename)
 		dev_err(it930x->dev,
 			"it930x_load_firmware: it930x_read_firmware_version() failed. 2 (ret: %d)\n",
 			ret);
-		goto exit;
+		return ret;
 	}
 
-	if (!fw_version) {
-		ret = -EIO;
-		goto exit;
-	}
+	if (!fw_version)
+		return -EIO;
 
 	dev_info(it930x->dev,
 		 "Firmware loaded. version: %d.%d.%d.%d\n",
 		 (fw_version >> 24) & 0xff, (fw_version >> 16) & 0xff,
 		 (fw_version >> 8) & 0xff, fw_version & 0xff);
 
-exit:
-	release_firmware(fw);
-
-	return ret;
+	return 0;
 }
 
-int it930x_init_warm(struct it930x_bridge *it930x)
+static const struct it930x_regbuf init_warm_regs[] = {
+	{ 0x4976, 0 },
+	{ 0x4bfb, 0 },
+	{ 0x4978, 0 },
+	{ 0x4977, 0 },
+	/* ignore sync byte: no */
+	{ 0xda1a, 0 }
+};
+
+/* power config ? */
+static const struct it930x_regbuf power_config_regs[] = {
+	{ 0xd833, 1 },
+	{ 0xd830, 0 },
+	{ 0xd831, 1 },
+	{ 0xd832, 0 }
+};
+
+/*
+ * The bridge keeps its registers while the firmware is running, so after the
+ * driver is loaded again they still hold what it930x_config_stream_output(),
+ * it930x_config_i2c() and it930x_config_stream_input() wrote last time.
+ * Reading them back is the signature of the configuration: only when all of
+ * them match the current one can the writes be skipped.
+ */
+static int it930x_check_configured(struct it930x_bridge *it930x,
+				   bool *configured)
 {
-	int ret = 0;
+	u32 i2c_regs[5][2] = {
+		{ 0x4975, 0x4971 },
+		{ 0x4974, 0x4970 },
+		{ 0x4973, 0x496f },
+		{ 0x4972, 0x496e },
+		{ 0x4964, 0x4963 }
+	};
+	int ret = 0, i;
+	u8 ep[8], xfer[2], out[2], rev, speed[2], i2c[19], port[49];
+	u16 x;
 
-	if (it930x->bus.type != ITEDTV_BUS_USB) {
-		dev_dbg(it930x->dev,
-			"it930x_init_warm: This driver only supports USB.\n");
-		return -EINVAL;
-	}
+	*configured = false;
 
-	ret = it930x_write_reg(it930x, 0x4976, 0);
+	ret = it930x_read_regs(it930x, 0xdd0c, ep, 8);
 	if (ret)
 		return ret;
 
-	ret = it930x_write_reg(it930x, 0x4bfb, 0);
+	ret = it930x_read_regs(it930x, 0xdd88, xfer, 2);
 	if (ret)
 		return ret;
 
-	ret = it930x_write_reg(it930x, 0x4978, 0);
+	ret = it930x_read_regs(it930x, 0xda05, out, 2);
 	if (ret)
 		return ret;
 
-	ret = it930x_write_reg(it930x, 0x4977, 0);
+	ret = it930x_read_reg(it930x, 0xd920, &rev);
 	if (ret)
 		return ret;
 
-	/* ignore sync byte: no */
-	ret = it930x_write_reg(it930x, 0xda1a, 0);
+	ret = it930x_read_reg(it930x, 0xf6a7, &speed[0]);
+	if (ret)
+		return ret;
+
+	ret = it930x_read_reg(it930x, 0xf103, &speed[1]);
+	if (ret)
+		return ret;
+
+	/* 0x4963 - 0x4975 */
+	ret = it930x_read_regs(it930x, 0x4963, i2c, 19);
+	if (ret)
+		return ret;
+
+	/* 0xda4c - 0xda7c */
+	ret = it930x_read_regs(it930x, 0xda4c, port, 49);
+	if (ret)
+		return ret;
+
+	x = ((it930x->config.xfer_size / 4) & 0xffff);
+
+	/* ep4 enabled without nak, transfer sizes */
+	if (!(ep[0xdd11 - 0xdd0c] & 0x20) || (ep[0xdd13 - 0xdd0c] & 0x20) ||
+	    ep[0] != ((it930x->bus.usb.max_bulk_size / 4) & 0xff) ||
+	    xfer[0] != (x & 0xff) || xfer[1] != ((x >> 8) & 0xff))
+		return 0;
+
+	if ((out[0] & 0x01) || (out[1] & 0x01) || rev)
+		return 0;
+
+	if (speed[0] != it930x->config.i2c_speed ||
+	    speed[1] != it930x->config.i2c_speed)
+		return 0;
+
+	for (i = 0; i < 5; i++) {
+		struct it930x_stream_input *input = &it930x->config.input[i];
+		u8 n = input->port_number;
+
+		if (!input->enable) {
+			if (port[n])
+				return 0;
+
+			continue;
+		}
+
+		if (port[n] != 1)
+			return 0;
+
+		if (n < 2 &&
+		    port[0xda58 - 0xda4c + n] != ((input->is_parallel) ? 1 : 0))
+			return 0;
+
+		/* aggregation mode: sync byte, the pid filter is off */
+		if (port[0xda73 - 0xda4c + n] != 1 ||
+		    port[0xda78 - 0xda4c + n] != input->sync_byte)
+			return 0;
+
+		if (i2c[i2c_regs[input->slave_number][0] - 0x4963] != (u8)(input->i2c_addr << 1) ||
+		    i2c[i2c_regs[input->slave_number][1] - 0x4963] != input->i2c_bus)
+			return 0;
+	}
+
+	*configured = true;
+
+	return 0;
+}
+
+int it930x_init_warm(struct it930x_bridge *it930x)
+{
+	int ret = 0;
+	struct it930x_priv *priv = it930x->priv;
+	bool configured = false;
+
+	if (it930x->bus.type != ITEDTV_BUS_USB) {
+		dev_dbg(it930x->dev,
+			"it930x_init_warm: This driver only supports USB.\n");
+		return -EINVAL;
+	}
+
+	ret = it930x_write_multiple_regs(it930x, init_warm_regs,
+					 ARRAY_SIZE(init_warm_regs));
 	if (ret)
 		return ret;
 
@@ -797,6 +1515,24 @@ int it930x_init_warm(struct it930x_bridge *it930x)
 	if (ret)
 		return ret;
 
+	if (it930x->config.warm_reattach && priv->fw_running) {
+		ret = it930x_check_configured(it930x, &configured);
+		if (ret) {
+			dev_err(it930x->dev,
+				"it930x_init_warm: it930x_check_configured() failed. (ret: %d)\n",
+				ret);
+			return ret;
+		}
+	}
+
+	if (configured) {
+		dev_info(it930x->dev,
+			 "The bridge is already configured, keeping it.\n");
+
+		return it930x_write_multiple_regs(it930x, power_config_regs,
+						  ARRAY_SIZE(power_config_regs));
+	}
+
 	ret = it930x_config_stream_output(it930x);
 	if (ret) {
 		dev_err(it930x->dev,
@@ -805,21 +1541,8 @@ int it930x_init_warm(struct it930x_bridge *it930x)
 		return ret;
 	}
 
-	/* power config ? */
-
-	ret = it930x_write_reg(it930x, 0xd833, 1);
-	if (ret)
-		return ret;
-
-	ret = it930x_write_reg(it930x, 0xd830, 0);
-	if (ret)
-		return ret;
-
-	ret = it930x_write_reg(it930x, 0xd831, 1);
-	if (ret)
-		return ret;
-
-	ret = it930x_write_reg(it930x, 0xd832, 0);
+	ret = it930x_write_multiple_regs(it930x, power_config_regs,
+					 ARRAY_SIZE(power_config_regs));
 	if (ret)
 		return ret;
 
@@ -894,6 +1617,7 @@ int it930x_set_gpio_mode(struct it930x_bridge *it930x,
 		goto exit;
 
 	priv->status[gpio].mode = mode;
+	priv->status[gpio].out_valid = false;
 
 	ret = it930x_write_reg(it930x, gpio_en_regs[gpio], val);
 	if (ret)
@@ -1033,34 +1757,72 @@ int it930x_write_gpio(struct it930x_bridge *it930x, int gpio, bool high)
 
 	mutex_lock(&priv->gpio_lock);
 
-	if (priv->status[gpio].mode == IT930X_GPIO_OUT)
-		ret = it930x_write_reg(it930x,
-				       gpio_o_regs[gpio], (high) ? 1 : 0);
-	else
+	if (priv->status[gpio].mode != IT930X_GPIO_OUT) {
 		ret = -EINVAL;
+		goto exit;
+	}
+
+	/* e.g. the LNB power, which is requested by each tuner */
+	if (priv->status[gpio].out_valid &&
+	    priv->status[gpio].out_high == high)
+		goto exit;
+
+	ret = it930x_write_reg(it930x, gpio_o_regs[gpio], (high) ? 1 : 0);
 
+	priv->status[gpio].out_valid = !ret;
+	priv->status[gpio].out_high = high;
+
+exit:
 	mutex_unlock(&priv->gpio_lock);
 
 	return ret;
 }
 
+static const u32 it930x_pid_remap_mode_regs[5] = {
+	0xda13,
+	0xda25,
+	0xda29,
+	0xda2d,
+	0xda7f
+};
+
+static const u32 it930x_pid_index_regs[5] = {
+	0xda15,
+	0xda26,
+	0xda2a,
+	0xda2e,
+	0xda80
+};
+
+/* must be called with priv->pid_filter_lock held */
+static int it930x_write_pid_filter_entry(struct it930x_bridge *it930x,
+					 u8 port, int index,
+					 u16 pid, bool enable)
+{
+	int ret = 0;
+	u8 data[2];
+
+	data[0] = pid & 0xff;
+	data[1] = (pid >> 8) & 0xff;
+
+	/* target pid */
+	ret = it930x_write_regs(it930x, 0xda16, data, 2);
+	if (ret)
+		return ret;
+
+	/* enable */
+	ret = it930x_write_reg(it930x, 0xda14, (enable) ? 1 : 0);
+	if (ret)
+		return ret;
+
+	/* index */
+	return it930x_write_reg(it930x, it930x_pid_index_regs[port], index);
+}
+
 int it930x_set_pid_filter(struct it930x_bridge *it930x, int input_idx,
 			  struct it930x_pid_filter *filter)
 {
-	u32 remap_mode_regs[5] = {
-		0xda13,
-		0xda25,
-		0xda29,
-		0xda2d,
-		0xda7f
-	};
-	u32 pid_index_regs[5] = {
-		0xda15,
-		0xda26,
-		0xda2a,
-		0xda2e,
-		0xda80
-	};
+	struct it930x_priv *priv = it930x->priv;
 	int ret = 0, i;
 	u8 port, data[2];
 
@@ -1069,68 +1831,79 @@ int it930x_set_pid_filter(struct it930x_bridge *it930x, int input_idx,
 
 	port = it930x->config.input[input_idx].port_number;
 
+	mutex_lock(&priv->pid_filter_lock);
+
 	if (!filter || !filter->num) {
 		/* disable pid filter */
 
-		ret = it930x_write_reg(it930x, remap_mode_regs[port], 0);
+		ret = it930x_write_reg(it930x, it930x_pid_remap_mode_regs[port], 0);
 		if (ret)
-			return ret;
+			goto exit;
 
 		/* sync_byte only */
 		ret = it930x_write_reg(it930x, 0xda73 + port, 1);
-		if (ret)
-			return ret;
-
-		return 0;
+		goto exit;
 	}
 
 	for (i = 0; i < filter->num; i++) {
-		data[0] = filter->pid[i] & 0xff;
-		data[1] = (filter->pid[i] >> 8) & 0xff;
-
-		/* target pid */
-		ret = it930x_write_regs(it930x, 0xda16, data, 2);
+		ret = it930x_write_pid_filter_entry(it930x, port, i,
+						    filter->pid[i], true);
 		if (ret)
-			return ret;
-
-		/* enable */
-		ret = it930x_write_reg(it930x, 0xda14, 1);
-		if (ret)
-			return ret;
-
-		/* index */
-		ret = it930x_write_reg(it930x, pid_index_regs[port], i);
-		if (ret)
-			return ret;
+			goto exit;
 	}
 
 	/* block or pass */
-	ret = it930x_write_reg(it930x, remap_mode_regs[port],
+	ret = it930x_write_reg(it930x, it930x_pid_remap_mode_regs[port],
 			       (filter->block) ? 0 : 2);
 	if (ret)
-		return ret;
+		goto exit;
 
 	/* sync_byte and remap */
 	ret = it930x_write_reg(it930x, 0xda73 + port, 3);
 	if (ret)
-		return ret;
+		goto exit;
 
 	data[0] = 0;
 	data[1] = 0;
 
 	/* pid offset */
 	ret = it930x_write_regs(it930x, 0xda81 + (port * 2), data, 2);
-	if (ret)
-		return ret;
 
-	return 0;
+exit:
+	mutex_unlock(&priv->pid_filter_lock);
+	return ret;
+}
+
+/*
+ * Change a single entry of the table written by it930x_set_pid_filter(),
+ * the other entries and the mode are kept. It can be used while streaming.
+ */
+int it930x_set_pid_filter_entry(struct it930x_bridge *it930x, int input_idx,
+				int index, u16 pid, bool enable)
+{
+	struct it930x_priv *priv = it930x->priv;
+	int ret = 0;
+
+	if (input_idx < 0 || input_idx > 4)
+		return -EINVAL;
+
+	if (index < 0 || index >= IT930X_PID_FILTER_MAX)
+		return -EINVAL;
+
+	mutex_lock(&priv->pid_filter_lock);
+	ret = it930x_write_pid_filter_entry(it930x,
+					    it930x->config.input[input_idx].port_number,
+					    index, pid, enable);
+	mutex_unlock(&priv->pid_filter_lock);
+
+	return ret;
 }
 
 int it930x_purge_psb(struct it930x_bridge *it930x, int timeout)
 {
 	int ret = 0;
 	void *p;
-	int len;
+	int len, probe = it930x->config.psb_purge_probe;
 
 	if (it930x->bus.type != ITEDTV_BUS_USB)
 		return -EINVAL;
@@ -1139,13 +1912,39 @@ int it930x_purge_psb(struct it930x_bridge *it930x, int timeout)
 	if (ret)
 		return ret;
 
-	len = 1024;
+	len = IT930X_PSB_SIZE * 2;
 
 	p = kmalloc(len, GFP_KERNEL);
 	if (!p)
 		return -ENOMEM;
 
-	ret = itedtv_bus_stream_rx(&it930x->bus, p, &len, timeout);
+	if (probe < 0) {
+		/* a full packet does not end the transfer, wait for the timeout */
+		ret = itedtv_bus_stream_rx(&it930x->bus, p, &len, timeout);
+	} else {
+		int rlen;
+
+		if (!probe)
+			probe = IT930X_PSB_PROBE_TIMEOUT;
+
+		if (timeout && probe > timeout)
+			probe = timeout;
+
+		/*
+		 * Read just the buffer size, so that the transfer completes as
+		 * soon as the data has arrived, then check with a short timeout
+		 * that nothing follows it.
+		 */
+		len = IT930X_PSB_SIZE;
+		ret = itedtv_bus_stream_rx(&it930x->bus, p, &len, timeout);
+		if (!ret && len == IT930X_PSB_SIZE) {
+			rlen = IT930X_PSB_SIZE;
+			ret = itedtv_bus_stream_rx(&it930x->bus, p, &rlen,
+						   probe);
+			len += rlen;
+		}
+	}
+
 	kfree(p);
 
 	it930x_write_reg_mask(it930x, 0xda1d, 0x00, 0x01);
@@ -1157,7 +1956,7 @@ int it930x_purge_psb(struct it930x_bridge *it930x, int timeout)
 
 	dev_dbg(it930x->dev, "it930x_purge_psb: len: %d\n", len);
 
-	if (len == 512)
+	if (len == IT930X_PSB_SIZE)
 		ret = 0;
 
 	return ret;
@@ -26,6 +26,8 @@
 #define IT930X_CMD_I2C_READ		0x2a
 #define IT930X_CMD_I2C_WRITE		0x2b
 
+#define IT930X_PID_FILTER_MAX		64
+
 enum it930x_gpio_mode {
 	IT930X_GPIO_UNDEFINED = 0,
 	IT930X_GPIO_IN,
@@ -35,7 +37,7 @@ enum it930x_gpio_mode {
 struct it930x_pid_filter {
 	bool block;
 	int num;
-	u16 pid[64];
+	u16 pid[IT930X_PID_FILTER_MAX];
 };
 
 struct it930x_stream_input {
@@ -52,6 +54,11 @@ struct it930x_stream_input {
 struct it930x_config {
 	u32 xfer_size;
 	u8 i2c_speed;
+	int psb_purge_timeout;	// for Linux, negative: use the module parameter
+	int psb_purge_probe;	// ms, 0: default, negative: wait for the whole timeout
+	bool ctrl_pipeline;	// for Linux
+	u8 fw_pipeline_depth;	// 0 or 1: wait for each firmware block
+	bool warm_reattach;	// keep the configuration left by a previous load of the driver
 	struct it930x_stream_input input[5];
 };
 
@@ -63,6 +70,32 @@ struct it930x_bridge {
 	void *priv;
 };
 
+struct it930x_regbuf {
+	u32 reg;
+	u8 val;
+};
+
+/* control messages by command, Linux only */
+enum it930x_ctrl_stat_type {
+	IT930X_CTRL_STAT_REG_READ = 0,
+	IT930X_CTRL_STAT_REG_WRITE,
+	IT930X_CTRL_STAT_I2C_READ,
+	IT930X_CTRL_STAT_I2C_WRITE,
+	IT930X_CTRL_STAT_FW_SCATTER_WRITE,
+	IT930X_CTRL_STAT_OTHER,
+	IT930X_CTRL_STAT_NUM
+};
+
+#ifdef __linux__
+struct it930x_ctrl_stats {
+	u64 count;
+	u64 errors;
+	u64 bytes;	// payload sent and received
+	u64 total_ns;	// including the wait for the control pipe
+	struct latency_hist latency;
+};
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -77,6 +110,8 @@ int it930x_write_reg(struct it930x_bridge *it930x, u32 reg, u8 val);
 int it930x_write_reg_mask(struct it930x_bridge *it930x,
 			  u32 reg,
 			  u8 val, u8 mask);
+int it930x_write_multiple_regs(struct it930x_bridge *it930x,
+			       const struct it930x_regbuf *regbuf, int num);
 
 int it930x_init(struct it930x_bridge *it930x);
 int it930x_term(struct it930x_bridge *it930x);
@@ -93,7 +128,14 @@ int it930x_read_gpio(struct it930x_bridge *it930x, int gpio, bool *high);
 int it930x_write_gpio(struct it930x_bridge *it930x, int gpio, bool high);
 int it930x_set_pid_filter(struct it930x_bridge *it930x, int input_idx,
 			  struct it930x_pid_filter *filter);
+int it930x_set_pid_filter_entry(struct it930x_bridge *it930x, int input_idx,
+				int index, u16 pid, bool enable);
 int it930x_purge_psb(struct it930x_bridge *it930x, int timeout);
+#ifdef __linux__
+void it930x_get_ctrl_stats(struct it930x_bridge *it930x,
+			   struct it930x_ctrl_stats *stats);
+void it930x_clear_ctrl_stats(struct it930x_bridge *it930x);
+#endif
 #ifdef __cplusplus
 }
 #endif
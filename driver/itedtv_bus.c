@@ -13,8 +13,36 @@
 #include <linux/kernel.h>
 #include <linux/atomic.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>
+#include <linux/llist.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/dma-mapping.h>
+#include <linux/version.h>
+
+#include "px4_trace.h"
 #endif
 
+/* interval and hysteresis of the adaptive URB pool */
+#define ITEDTV_USB_ADAPT_INTERVAL	500	// msecs
+#define ITEDTV_USB_ADAPT_SHRINK_PERIODS	8
+
+/* URBs failed in a row before the resubmission is deferred */
+#define ITEDTV_USB_MAX_ERROR_RUN	32
+#define ITEDTV_USB_RECOVER_DELAY	100	// msecs
+
+/* the watchdog waits up to this many timeouts while the stream stays dead */
+#define ITEDTV_USB_WATCHDOG_MAX_BACKOFF	8
+
+/* upper bound of the URBs of a bus while the URB budget is enabled */
+#define ITEDTV_USB_BUDGET_MAX_URBS	32
+
 #if defined(ITEDTV_BUS_USE_WORKQUEUE) && !defined(__linux__)
 #undef ITEDTV_BUS_USE_WORKQUEUE
 #endif
@@ -24,8 +52,25 @@ struct itedtv_usb_context;
 struct itedtv_usb_work {
 	struct itedtv_usb_context *ctx;
 	struct urb *urb;
+	u32 index;
+	atomic_t queued;
+	u64 timestamp;	// for Linux
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 	struct work_struct work;
+#elif defined(__linux__)
+	struct llist_node done_node;
+#endif
+#ifdef __linux__
+	/* double buffered mode */
+	void *spare;
+	u32 spare_size;
+	bool spare_no_dma;
+	dma_addr_t spare_dma;
+	/* scatter-gather mode */
+	struct page **sg_pages;
+	struct scatterlist *sgl;
+	u32 sg_num;
+	void *sg_vaddr;		// contiguous mapping for the stream handler
 #endif
 };
 
@@ -36,12 +81,43 @@ struct itedtv_usb_context {
 	void *ctx;
 	u32 num_urb;
 	bool no_dma;
+	bool use_sg;
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 	struct workqueue_struct *wq;
 #endif
 	u32 num_works;
 	struct itedtv_usb_work *works;
 	atomic_t streaming;
+	atomic_t in_flight;
+	/* adaptive mode */
+	bool adaptive;
+	u32 min_urb;
+	atomic_t active_urb;	// URBs with an index below this are resubmitted
+	atomic_t low_water;	// fewest URBs left in flight on completion
+	unsigned int idle_periods;
+	u32 buf_size;
+	struct delayed_work adapt_work;
+	bool double_buffer;
+	/* error recovery */
+	atomic_t error_run;	// URBs failed in a row
+	atomic_t halted;	// the pipe has to be cleared
+	struct delayed_work recover_work;
+	/* stream watchdog */
+	u32 watchdog_timeout;	// msecs, 0: disabled
+	unsigned int watchdog_backoff;
+	u64 watchdog_since;	// ns, a stall is counted from here at the earliest
+	struct delayed_work watchdog_work;
+	/* URB budget */
+	struct list_head budget_node;	// in itedtv_usb_budget_list while streaming
+	u32 budget_weight;
+	u32 budget_urb;		// URBs granted by the budget, 0: not limited
+#if !defined(ITEDTV_BUS_USE_WORKQUEUE) && defined(__linux__)
+	/* shared workqueue mode */
+	struct workqueue_struct *done_wq;
+	int done_cpu;
+	struct llist_head done_list;
+	struct work_struct done_work;
+#endif
 };
 
 static int itedtv_usb_ctrl_tx(struct itedtv_bus *bus, void *buf, int len)
@@ -64,7 +140,10 @@ static int itedtv_usb_ctrl_tx(struct itedtv_bus *bus, void *buf, int len)
 			 ret);
 	}
 
-	mdelay(1);
+	/*
+	 * No delay here, every request is followed by itedtv_usb_ctrl_rx()
+	 * which blocks until the device has processed it.
+	 */
 
 	return ret;
 }
@@ -117,271 +196,1367 @@ static int itedtv_usb_stream_rx(struct itedtv_bus *bus,
 	return ret;
 }
 
-#ifdef ITEDTV_BUS_USE_WORKQUEUE
-static void itedtv_usb_workqueue_handler(struct work_struct *work)
+static void *itedtv_usb_urb_data(struct itedtv_usb_work *w)
+{
+#ifdef __linux__
+	if (w->sg_vaddr) {
+		/* the pages were written through the linear mapping */
+		invalidate_kernel_vmap_range(w->sg_vaddr, w->urb->actual_length);
+		return w->sg_vaddr;
+	}
+#endif
+	return w->urb->transfer_buffer;
+}
+
+static bool itedtv_usb_has_buffer(struct itedtv_usb_work *w)
+{
+#ifdef __linux__
+	if (w->sg_vaddr)
+		return true;
+#endif
+	return !!w->urb->transfer_buffer;
+}
+
+static int itedtv_usb_submit_urb(struct itedtv_usb_context *ctx,
+				 struct itedtv_usb_work *w, gfp_t mem_flags)
 {
 	int ret = 0;
-	struct itedtv_usb_work *w = container_of(work,
-						 struct itedtv_usb_work, work);
-	struct itedtv_usb_context *ctx = w->ctx;
-	struct urb *urb = w->urb;
 
-	if (likely(urb->actual_length))
-		ret = ctx->stream_handler(ctx->ctx,
-					  urb->transfer_buffer,
-					  urb->actual_length);
+	atomic_set(&w->queued, 1);
+	atomic_inc(&ctx->in_flight);
+
+	ret = usb_submit_urb(w->urb, mem_flags);
+	if (unlikely(ret)) {
+		atomic_dec(&ctx->in_flight);
+		atomic_set_release(&w->queued, 0);
+	}
+
+	return ret;
+}
+
+static bool itedtv_usb_keep_urb(struct itedtv_usb_context *ctx,
+				struct itedtv_usb_work *w)
+{
+	if (likely(w->index < (u32)atomic_read(&ctx->active_urb)))
+		return true;
+
+	/* retired by the adaptive pool */
+	atomic_set_release(&w->queued, 0);
+	return false;
+}
+
+#ifdef __linux__
+/* the URBs not queued are resubmitted by itedtv_usb_recover_work() */
+static void itedtv_usb_schedule_recover(struct itedtv_usb_context *ctx,
+					unsigned int delay)
+{
+	if (!delay)
+		mod_delayed_work(system_wq, &ctx->recover_work, 0);
 	else
-		dev_dbg(ctx->bus->dev,
-			"itedtv_usb_workqueue_handler: !urb->actual_length\n");
+		schedule_delayed_work(&ctx->recover_work,
+				      msecs_to_jiffies(delay));
+
+	return;
+}
+
+/*
+ * Clears a stall of the pipe if there is one, then resubmits every active
+ * URB which is not queued, so that the pool stays at its full depth.
+ */
+static void itedtv_usb_recover_work(struct work_struct *work)
+{
+	struct itedtv_usb_context *ctx = container_of(to_delayed_work(work),
+						      struct itedtv_usb_context,
+						      recover_work);
+	struct itedtv_bus *bus = ctx->bus;
+	u32 i, active;
 
-	if (unlikely(ret || (atomic_read_acquire(&ctx->streaming) < 1)))
+	if (atomic_read_acquire(&ctx->streaming) < 1)
 		return;
 
-	ret = usb_submit_urb(urb, GFP_KERNEL);
-	if (unlikely(ret))
-		dev_err(ctx->bus->dev,
-			"itedtv_usb_workqueue_handler: usb_submit_urb() failed. (ret: %d)\n",
-			ret);
+	if (atomic_xchg(&ctx->halted, 0)) {
+		int ret = usb_clear_halt(bus->usb.dev,
+					 usb_rcvbulkpipe(bus->usb.dev, 0x84));
+
+		if (ret)
+			dev_err(bus->dev,
+				"itedtv_usb_recover_work: usb_clear_halt() failed. (ret: %d)\n",
+				ret);
+		else
+			bus->stats.urb_halt_clears++;
+	}
+
+	atomic_set(&ctx->error_run, 0);
+	active = atomic_read(&ctx->active_urb);
+
+	for (i = 0; i < active && i < ctx->num_works; i++) {
+		struct itedtv_usb_work *w = &ctx->works[i];
+
+		if (!w->urb || !itedtv_usb_has_buffer(w) ||
+		    atomic_cmpxchg(&w->queued, 0, 1))
+			continue;
+
+		if (itedtv_usb_submit_urb(ctx, w, GFP_KERNEL)) {
+			bus->stats.urb_submit_errors++;
+			itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		} else {
+			bus->stats.urb_resubmitted++;
+		}
+	}
 
 	return;
 }
+#else
+static inline void itedtv_usb_schedule_recover(struct itedtv_usb_context *ctx,
+					       unsigned int delay)
+{
+	return;
+}
 #endif
 
-static void itedtv_usb_complete(struct urb *urb)
+#if !defined(ITEDTV_BUS_USE_WORKQUEUE) && defined(__linux__)
+/*
+ * Workqueue shared by all buses which process the completed URBs in process
+ * context. Each bus has a single work item bound to one CPU, so the URBs of
+ * a bus are handled in completion order while the buses are spread across
+ * the CPUs.
+ */
+static DEFINE_MUTEX(itedtv_usb_wq_lock);
+static struct workqueue_struct *itedtv_usb_wq = NULL;
+static atomic_t itedtv_usb_wq_cpu = ATOMIC_INIT(0);
+
+static struct workqueue_struct *itedtv_usb_get_workqueue(int max_active)
+{
+	struct workqueue_struct *wq;
+
+	mutex_lock(&itedtv_usb_wq_lock);
+
+	/* max_active is taken from the bus which created the workqueue */
+	if (!itedtv_usb_wq)
+		itedtv_usb_wq = alloc_workqueue("itedtv_usb", WQ_HIGHPRI,
+						max(max_active, 0));
+
+	wq = itedtv_usb_wq;
+
+	mutex_unlock(&itedtv_usb_wq_lock);
+
+	return wq;
+}
+
+static int itedtv_usb_select_cpu(struct itedtv_usb_context *ctx)
 {
+	unsigned int i = atomic_inc_return(&itedtv_usb_wq_cpu) - 1;
+
+	return cpumask_local_spread(i, dev_to_node(&ctx->bus->usb.dev->dev));
+}
+#endif
+
 #ifndef ITEDTV_BUS_USE_WORKQUEUE
+#ifdef __linux__
+/*
+ * Double buffered mode: swap the spare buffer into the URB and resubmit it
+ * before the filled buffer is handed to the stream handler, so that the URB
+ * is not missing from the host controller queue while demuxing.
+ * Completions of a bus are never handled concurrently, so the spare buffer
+ * is not touched by the device until this returns.
+ * The return value of the stream handler can't cancel the resubmission.
+ */
+static void itedtv_usb_handle_urb_early(struct itedtv_usb_context *ctx,
+					struct itedtv_usb_work *w,
+					gfp_t mem_flags)
+{
 	int ret = 0;
-#endif
-	struct itedtv_usb_work *w = urb->context;
-	struct itedtv_usb_context *ctx = w->ctx;
+	struct urb *urb = w->urb;
+	void *buf = urb->transfer_buffer;
+	u32 len = urb->actual_length;
+	u64 timestamp = w->timestamp;
+	bool resubmitted = false;
+
+	if (likely(atomic_read_acquire(&ctx->streaming) > 0 &&
+		   w->index < (u32)atomic_read(&ctx->active_urb))) {
+		dma_addr_t dma = urb->transfer_dma;
+
+		urb->transfer_buffer = w->spare;
+		urb->transfer_dma = w->spare_dma;
+		urb->actual_length = 0;
+		w->spare = buf;
+		w->spare_dma = dma;
+
+		ret = itedtv_usb_submit_urb(ctx, w, mem_flags);
+		if (unlikely(ret)) {
+			ctx->bus->stats.urb_submit_errors++;
+			dev_err(ctx->bus->dev,
+				"itedtv_usb_handle_urb_early: usb_submit_urb() failed. (ret: %d)\n",
+				ret);
+			itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		} else {
+			resubmitted = true;
+		}
+	}
 
-	if (unlikely(urb->status)) {
+	ctx->bus->stream_time = timestamp;
+	trace_px4_urb_complete(ctx->bus, w->index, len,
+			       ktime_get_ns() - timestamp);
+
+	if (likely(len))
+		ctx->stream_handler(ctx->ctx, buf, len);
+	else
 		dev_dbg(ctx->bus->dev,
-			"itedtv_usb_complete: status: %d\n",
-			urb->status);
+			"itedtv_usb_handle_urb_early: !urb->actual_length\n");
+
+	/* not resubmitted, the buffers may be released from now on */
+	if (!resubmitted)
+		atomic_set_release(&w->queued, 0);
+
+	return;
+}
+#endif
+
+static void itedtv_usb_handle_urb(struct itedtv_usb_context *ctx,
+				  struct itedtv_usb_work *w, gfp_t mem_flags)
+{
+	int ret = 0;
+	struct urb *urb = w->urb;
+
+#ifdef __linux__
+	if (ctx->double_buffer && w->spare) {
+		itedtv_usb_handle_urb_early(ctx, w, mem_flags);
 		return;
 	}
 
-#ifdef ITEDTV_BUS_USE_WORKQUEUE
-	if (unlikely(!queue_work(ctx->wq, &w->work)))
-		dev_err(ctx->bus->dev,
-			"itedtv_usb_complete: queue_work() failed.\n");
-#else
+	ctx->bus->stream_time = w->timestamp;
+	trace_px4_urb_complete(ctx->bus, w->index, urb->actual_length,
+			       ktime_get_ns() - w->timestamp);
+#endif
+
 	if (likely(urb->actual_length))
 		ret = ctx->stream_handler(ctx->ctx,
-					  urb->transfer_buffer,
+					  itedtv_usb_urb_data(w),
 					  urb->actual_length);
 	else
 		dev_dbg(ctx->bus->dev,
-			"itedtv_usb_complete: !urb->actual_length\n");
+			"itedtv_usb_handle_urb: !urb->actual_length\n");
+
+	if (unlikely(atomic_read_acquire(&ctx->streaming) < 1))
+		return;
+
+	/* not resubmitted here, itedtv_usb_recover_work() takes it again */
+	if (unlikely(ret)) {
+		atomic_set_release(&w->queued, 0);
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		return;
+	}
 
-	if (unlikely(ret || (atomic_read_acquire(&ctx->streaming) < 1)))
+	if (unlikely(!itedtv_usb_keep_urb(ctx, w)))
 		return;
 
-	ret = usb_submit_urb(urb, GFP_ATOMIC);
-	if (unlikely(ret))
+	ret = itedtv_usb_submit_urb(ctx, w, mem_flags);
+	if (unlikely(ret)) {
+		ctx->bus->stats.urb_submit_errors++;
 		dev_err(ctx->bus->dev,
-			"itedtv_usb_complete: usb_submit_urb() failed. (ret: %d)\n",
+			"itedtv_usb_handle_urb: usb_submit_urb() failed. (ret: %d)\n",
 			ret);
-#endif
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+	}
 
 	return;
 }
 
-static int itedtv_usb_alloc_urb_buffers(struct itedtv_usb_context *ctx,
-					u32 buf_size)
+#ifdef __linux__
+static void itedtv_usb_done_work(struct work_struct *work)
 {
-	u32 i;
-	struct itedtv_bus *bus = ctx->bus;
-	struct usb_device *dev = bus->usb.dev;
-	u32 num = ctx->num_works;
-	bool no_dma = ctx->no_dma;
-	struct itedtv_usb_work *works = ctx->works;
+	struct itedtv_usb_context *ctx = container_of(work,
+						      struct itedtv_usb_context,
+						      done_work);
+	struct llist_node *list;
+	struct itedtv_usb_work *w, *tmp;
 
-	if (!works)
-		return -EINVAL;
+	/* llist is LIFO, restore the completion order */
+	list = llist_reverse_order(llist_del_all(&ctx->done_list));
 
-	for (i = 0; i < num; i++) {
-		struct urb *urb;
-		void *p;
-#ifdef __linux__
-		dma_addr_t dma;
+	llist_for_each_entry_safe(w, tmp, list, done_node)
+		itedtv_usb_handle_urb(ctx, w, GFP_KERNEL);
+
+	return;
+}
+#endif
 #endif
 
-		if (works[i].urb) {
-			urb = works[i].urb;
+#ifdef ITEDTV_BUS_USE_WORKQUEUE
+static void itedtv_usb_workqueue_handler(struct work_struct *work)
+{
+	int ret = 0;
+	struct itedtv_usb_work *w = container_of(work,
+						 struct itedtv_usb_work, work);
+	struct itedtv_usb_context *ctx = w->ctx;
+	struct urb *urb = w->urb;
 
-			if (urb->transfer_buffer) {
-#ifdef __linux__
-				if ((urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP) &&
-				    (no_dma || urb->transfer_buffer_length != buf_size)) {
-					usb_free_coherent(dev,
-							  urb->transfer_buffer_length,
-							  urb->transfer_buffer,
-							  urb->transfer_dma);
-					urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
-					urb->transfer_dma = 0;
+	ctx->bus->stream_time = w->timestamp;
 
-					urb->transfer_buffer = NULL;
-					urb->transfer_buffer_length = 0;
-					urb->actual_length = 0;
-				} else if (!(urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP) &&
-					   (!no_dma || urb->transfer_buffer_length != buf_size)) {
-					kfree(urb->transfer_buffer);
+	if (likely(urb->actual_length))
+		ret = ctx->stream_handler(ctx->ctx,
+					  itedtv_usb_urb_data(w),
+					  urb->actual_length);
+	else
+		dev_dbg(ctx->bus->dev,
+			"itedtv_usb_workqueue_handler: !urb->actual_length\n");
 
-					urb->transfer_buffer = NULL;
-					urb->transfer_buffer_length = 0;
-					urb->actual_length = 0;
-				}
-#else
-				kfree(urb->transfer_buffer);
+	if (unlikely(atomic_read_acquire(&ctx->streaming) < 1))
+		return;
 
-				urb->transfer_buffer = NULL;
-				urb->transfer_buffer_length = 0;
-				urb->actual_length = 0;
-#endif
-			}
-		} else {
-			urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!urb) {
-				dev_err(bus->dev,
-					"itedtv_usb_alloc_urb_buffers: usb_alloc_urb() failed. (i: %u)\n",
-					i);
-				break;
-			}
+	/* not resubmitted here, itedtv_usb_recover_work() takes it again */
+	if (unlikely(ret)) {
+		atomic_set_release(&w->queued, 0);
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		return;
+	}
 
-			works[i].urb = urb;
-		}
+	if (unlikely(!itedtv_usb_keep_urb(ctx, w)))
+		return;
 
-		works[i].ctx = ctx;
+	ret = itedtv_usb_submit_urb(ctx, w, GFP_KERNEL);
+	if (unlikely(ret)) {
+		ctx->bus->stats.urb_submit_errors++;
+		dev_err(ctx->bus->dev,
+			"itedtv_usb_workqueue_handler: usb_submit_urb() failed. (ret: %d)\n",
+			ret);
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+	}
 
-		if (!urb->transfer_buffer) {
-#ifdef __linux__
-#ifdef __GFP_RETRY_MAYFAIL
-			if (!no_dma)
-				p = usb_alloc_coherent(dev, buf_size,
-						       GFP_KERNEL | __GFP_RETRY_MAYFAIL, &dma);
-			else
-				p = kmalloc(buf_size, GFP_KERNEL | __GFP_RETRY_MAYFAIL);
-#else
-			if (!no_dma)
-				p = usb_alloc_coherent(dev, buf_size,
-						       GFP_KERNEL | __GFP_REPEAT, &dma);
-			else
-				p = kmalloc(buf_size, GFP_KERNEL | __GFP_REPEAT);
-#endif
-#else
-			p = kmalloc(buf_size, GFP_KERNEL);
+	return;
+}
 #endif
 
-			if (!p) {
-#ifdef __linux__
-				if (!no_dma)
-					dev_err(bus->dev,
-						"itedtv_usb_alloc_urb_buffers: usb_alloc_coherent() failed. (i: %u)\n",
-						i);
-				else
-					dev_err(bus->dev,
-						"itedtv_usb_alloc_urb_buffers: kmalloc() failed. (i: %u)\n",
-						i);
-#else
-				dev_err(bus->dev,
-					"itedtv_usb_alloc_urb_buffers: kmalloc() failed. (i: %u)\n",
-					i);
-#endif
+static void itedtv_usb_count_urb_error(struct itedtv_bus *bus, int status)
+{
+	enum itedtv_bus_urb_error e;
 
-				usb_free_urb(urb);
-				works[i].urb = NULL;
+	switch (status) {
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		/* unlinked by us or the device is gone */
+		return;
 
-				break;
-			}
+	case -EPROTO:
+		e = ITEDTV_BUS_URB_ERROR_EPROTO;
+		break;
 
-#ifdef __linux__
-			dev_dbg(bus->dev,
-				"itedtv_usb_alloc_urb_buffers: p: %p, buf_size: %u, dma: %pad\n",
-				p, buf_size, &dma);
-#else
-			dev_dbg(bus->dev,
-				"itedtv_usb_alloc_urb_buffers: p: %p, buf_size: %u\n",
-				p, buf_size);
-#endif
+	case -EILSEQ:
+		e = ITEDTV_BUS_URB_ERROR_EILSEQ;
+		break;
 
-			usb_fill_bulk_urb(urb, dev,
-					  usb_rcvbulkpipe(dev, 0x84),
-					  p, buf_size,
-					  itedtv_usb_complete, &works[i]);
+	case -EPIPE:
+		e = ITEDTV_BUS_URB_ERROR_EPIPE;
+		break;
 
-#ifdef __linux__
-			if (!no_dma) {
-				urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-				urb->transfer_dma = dma;
-			}
-#endif
-		}
+	case -EOVERFLOW:
+		e = ITEDTV_BUS_URB_ERROR_EOVERFLOW;
+		break;
 
-#ifdef ITEDTV_BUS_USE_WORKQUEUE
-		INIT_WORK(&works[i].work, itedtv_usb_workqueue_handler);
-#endif
-	}
+	case -ETIME:
+	case -ETIMEDOUT:
+		e = ITEDTV_BUS_URB_ERROR_TIMEOUT;
+		break;
 
-	ctx->num_urb = i;
+	default:
+		e = ITEDTV_BUS_URB_ERROR_OTHER;
+		break;
+	}
 
-	if (!i)
-		return -ENOMEM;
+	bus->stats.urb_errors[e]++;
 
-	return 0;
+	return;
 }
 
-static void itedtv_usb_free_urb_buffers(struct itedtv_usb_context *ctx,
-					bool free_urb)
+static void itedtv_bus_count_rx(struct itedtv_bus *bus, u32 len, u64 now)
 {
-	u32 i;
-	struct usb_device *dev = ctx->bus->usb.dev;
-	u32 num = ctx->num_works;
-	bool no_dma = ctx->no_dma;
-	struct itedtv_usb_work *works = ctx->works;
+	struct itedtv_bus_stats *stats = &bus->stats;
+	u64 elapsed = now - stats->rx_window_start;
 
-	if (!works)
-		return;
+	stats->rx_bytes += len;
 
-	for (i = 0; i < num; i++) {
-		struct urb *urb = works[i].urb;
+	if (elapsed >= NSEC_PER_SEC) {
+		u32 rate = 0;
 
-		if (!urb)
-			continue;
+		/* a window followed by a gap of a second or more counts as idle */
+		if (elapsed < 2 * NSEC_PER_SEC)
+			rate = div64_u64((u64)stats->rx_window_bytes * NSEC_PER_SEC,
+					 elapsed);
+
+		WRITE_ONCE(stats->rx_rate, rate);
+		WRITE_ONCE(stats->rx_window_start, now);
+		stats->rx_window_bytes = 0;
+	}
+
+	stats->rx_window_bytes += len;
+}
 
-		if (urb->transfer_buffer) {
 #ifdef __linux__
-			if (!no_dma) {
-				usb_free_coherent(dev,
-						  urb->transfer_buffer_length,
-						  urb->transfer_buffer,
-						  urb->transfer_dma);
-				urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
-				urb->transfer_dma = 0;
-			} else {
-				kfree(urb->transfer_buffer);
-			}
-#else
-			kfree(urb->transfer_buffer);
-#endif
+/*
+ * A failed URB is put back into the queue right away, unless the pipe is
+ * stalled (-EPIPE) or the errors go on for too long. Those are left to
+ * itedtv_usb_recover_work(), which can sleep.
+ */
+static void itedtv_usb_recover_urb(struct itedtv_usb_context *ctx,
+				   struct itedtv_usb_work *w, int status)
+{
+	switch (status) {
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		/* unlinked by us or the device is gone */
+		return;
 
-			urb->transfer_buffer = NULL;
-			urb->transfer_buffer_length = 0;
-			urb->actual_length = 0;
-		}
+	default:
+		break;
+	}
+
+	if (atomic_read_acquire(&ctx->streaming) < 1) {
+		atomic_set_release(&w->queued, 0);
+		return;
+	}
+
+	if (!itedtv_usb_keep_urb(ctx, w))
+		return;
+
+	if (status == -EPIPE) {
+		atomic_set_release(&w->queued, 0);
+		atomic_set(&ctx->halted, 1);
+		itedtv_usb_schedule_recover(ctx, 0);
+		return;
+	}
+
+	/* give the device some time if it keeps failing */
+	if (atomic_inc_return(&ctx->error_run) > ITEDTV_USB_MAX_ERROR_RUN) {
+		atomic_set_release(&w->queued, 0);
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		return;
+	}
+
+	if (itedtv_usb_submit_urb(ctx, w, GFP_ATOMIC)) {
+		ctx->bus->stats.urb_submit_errors++;
+		itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+	} else {
+		ctx->bus->stats.urb_resubmitted++;
+	}
+
+	return;
+}
+#endif
+
+static void itedtv_usb_complete(struct urb *urb)
+{
+	struct itedtv_usb_work *w = urb->context;
+	struct itedtv_usb_context *ctx = w->ctx;
+	int in_flight;
+
+#ifdef __linux__
+	w->timestamp = ktime_get_ns();
+#endif
+
+	in_flight = atomic_dec_return(&ctx->in_flight);
+	if (unlikely(in_flight < atomic_read(&ctx->low_water)))
+		atomic_set(&ctx->low_water, in_flight);
+
+	if (unlikely(urb->status)) {
+		itedtv_usb_count_urb_error(ctx->bus, urb->status);
+		dev_dbg(ctx->bus->dev,
+			"itedtv_usb_complete: status: %d\n",
+			urb->status);
+#ifdef __linux__
+		itedtv_usb_recover_urb(ctx, w, urb->status);
+#endif
+		return;
+	}
+
+	if (unlikely(atomic_read(&ctx->error_run)))
+		atomic_set(&ctx->error_run, 0);
+
+	ctx->bus->stats.urb_completed++;
+	itedtv_bus_count_rx(ctx->bus, urb->actual_length, w->timestamp);
+
+#ifdef __linux__
+	if (likely(ctx->bus->stats.urb_last_complete))
+		latency_hist_add(&ctx->bus->stats.urb_interval,
+				 w->timestamp - ctx->bus->stats.urb_last_complete);
+
+	ctx->bus->stats.urb_last_complete = w->timestamp;
+#endif
+
+#ifdef ITEDTV_BUS_USE_WORKQUEUE
+	if (unlikely(!queue_work(ctx->wq, &w->work)))
+		dev_err(ctx->bus->dev,
+			"itedtv_usb_complete: queue_work() failed.\n");
+#else
+#ifdef __linux__
+	if (ctx->done_wq) {
+		llist_add(&w->done_node, &ctx->done_list);
+		queue_work_on(ctx->done_cpu, ctx->done_wq, &ctx->done_work);
+		return;
+	}
+#endif
+	itedtv_usb_handle_urb(ctx, w, GFP_ATOMIC);
+#endif
+
+	return;
+}
+
+#ifdef __linux__
+static void itedtv_usb_free_spare_buffer(struct itedtv_usb_context *ctx,
+					 struct itedtv_usb_work *w)
+{
+	if (!w->spare)
+		return;
+
+	if (!w->spare_no_dma)
+		usb_free_coherent(ctx->bus->usb.dev,
+				  w->spare_size, w->spare, w->spare_dma);
+	else
+		kfree(w->spare);
+
+	w->spare = NULL;
+	w->spare_size = 0;
+	w->spare_dma = 0;
+
+	return;
+}
+
+static void itedtv_usb_alloc_spare_buffer(struct itedtv_usb_context *ctx,
+					  struct itedtv_usb_work *w,
+					  u32 buf_size)
+{
+	bool no_dma = !(w->urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP);
+
+	if (w->spare &&
+	    (!ctx->double_buffer ||
+	     w->spare_size != buf_size || w->spare_no_dma != no_dma))
+		itedtv_usb_free_spare_buffer(ctx, w);
+
+	if (!ctx->double_buffer || w->spare)
+		return;
+
+	if (!no_dma)
+		w->spare = usb_alloc_coherent(ctx->bus->usb.dev, buf_size,
+					      GFP_KERNEL, &w->spare_dma);
+	else
+		w->spare = kmalloc_node(buf_size, GFP_KERNEL,
+					itedtv_bus_node(ctx->bus));
+
+	if (!w->spare) {
+		/* this URB falls back to the normal mode */
+		dev_dbg(ctx->bus->dev,
+			"itedtv_usb_alloc_spare_buffer: allocation failed. (i: %u)\n",
+			w->index);
+		return;
+	}
+
+	w->spare_size = buf_size;
+	w->spare_no_dma = no_dma;
+
+	return;
+}
+#endif
+
+static void itedtv_usb_free_urb_buffer(struct itedtv_usb_context *ctx,
+				       u32 i, bool free_urb);
+
+#ifdef __linux__
+/*
+ * Scatter-gather mode: the buffer is built from order-0 pages, so large
+ * transfer sizes don't need high-order allocations. The pages are also
+ * mapped contiguously for the stream handler.
+ */
+static int itedtv_usb_alloc_urb_sg_buffer(struct itedtv_usb_context *ctx,
+					  u32 i, u32 buf_size)
+{
+	struct itedtv_bus *bus = ctx->bus;
+	struct usb_device *dev = bus->usb.dev;
+	struct itedtv_usb_work *w = &ctx->works[i];
+	struct urb *urb;
+	u32 j, num = DIV_ROUND_UP(buf_size, PAGE_SIZE);
+
+	if (w->urb) {
+		urb = w->urb;
+
+		if (w->sg_vaddr && urb->transfer_buffer_length == buf_size)
+			goto exit;
+
+		itedtv_usb_free_urb_buffer(ctx, i, false);
+		itedtv_usb_free_spare_buffer(ctx, w);
+	} else {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			dev_err(bus->dev,
+				"itedtv_usb_alloc_urb_sg_buffer: usb_alloc_urb() failed. (i: %u)\n",
+				i);
+			return -ENOMEM;
+		}
+
+		w->urb = urb;
+	}
+
+	w->sg_pages = kcalloc(num, sizeof(*w->sg_pages), GFP_KERNEL);
+	w->sgl = kcalloc(num, sizeof(*w->sgl), GFP_KERNEL);
+	if (!w->sg_pages || !w->sgl)
+		goto fail;
+
+	sg_init_table(w->sgl, num);
+
+	for (j = 0; j < num; j++) {
+		w->sg_pages[j] = alloc_pages_node(itedtv_bus_node(bus),
+						  GFP_KERNEL, 0);
+		if (!w->sg_pages[j])
+			goto fail_page;
+
+		sg_set_page(&w->sgl[j], w->sg_pages[j],
+			    min_t(u32, PAGE_SIZE, buf_size - (j * PAGE_SIZE)), 0);
+	}
+
+	w->sg_vaddr = vmap(w->sg_pages, num, VM_MAP, PAGE_KERNEL);
+	if (!w->sg_vaddr)
+		goto fail_page;
+
+	w->sg_num = num;
+
+	dev_dbg(bus->dev,
+		"itedtv_usb_alloc_urb_sg_buffer: p: %p, buf_size: %u, num: %u\n",
+		w->sg_vaddr, buf_size, num);
+
+	usb_fill_bulk_urb(urb, dev,
+			  usb_rcvbulkpipe(dev, 0x84),
+			  NULL, buf_size,
+			  itedtv_usb_complete, w);
+
+	urb->sg = w->sgl;
+	urb->num_sgs = num;
+
+exit:
+	w->ctx = ctx;
+	w->index = i;
+
+#ifdef ITEDTV_BUS_USE_WORKQUEUE
+	INIT_WORK(&w->work, itedtv_usb_workqueue_handler);
+#endif
+
+	return 0;
+
+fail_page:
+	dev_err(bus->dev,
+		"itedtv_usb_alloc_urb_sg_buffer: page allocation failed. (i: %u)\n",
+		i);
+
+	while (j--)
+		__free_page(w->sg_pages[j]);
+
+fail:
+	kfree(w->sgl);
+	kfree(w->sg_pages);
+	w->sgl = NULL;
+	w->sg_pages = NULL;
+
+	usb_free_urb(urb);
+	w->urb = NULL;
+
+	return -ENOMEM;
+}
+#endif
+
+static int itedtv_usb_alloc_urb_buffer(struct itedtv_usb_context *ctx,
+				       u32 i, u32 buf_size)
+{
+	struct itedtv_bus *bus = ctx->bus;
+	struct usb_device *dev = bus->usb.dev;
+	bool no_dma = ctx->no_dma;
+	struct itedtv_usb_work *works = ctx->works;
+	struct urb *urb;
+	void *p;
+#ifdef __linux__
+	dma_addr_t dma;
+
+	if (ctx->use_sg)
+		return itedtv_usb_alloc_urb_sg_buffer(ctx, i, buf_size);
+
+	if (works[i].sg_vaddr)
+		itedtv_usb_free_urb_buffer(ctx, i, false);
+#endif
+
+	if (works[i].urb) {
+		urb = works[i].urb;
+
+		if (urb->transfer_buffer) {
+#ifdef __linux__
+			if ((urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP) &&
+			    (no_dma || urb->transfer_buffer_length != buf_size)) {
+				usb_free_coherent(dev,
+						  urb->transfer_buffer_length,
+						  urb->transfer_buffer,
+						  urb->transfer_dma);
+				urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+				urb->transfer_dma = 0;
+
+				urb->transfer_buffer = NULL;
+				urb->transfer_buffer_length = 0;
+				urb->actual_length = 0;
+			} else if (!(urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP) &&
+				   (!no_dma || urb->transfer_buffer_length != buf_size)) {
+				kfree(urb->transfer_buffer);
+
+				urb->transfer_buffer = NULL;
+				urb->transfer_buffer_length = 0;
+				urb->actual_length = 0;
+			}
+#else
+			kfree(urb->transfer_buffer);
+
+			urb->transfer_buffer = NULL;
+			urb->transfer_buffer_length = 0;
+			urb->actual_length = 0;
+#endif
+		}
+	} else {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			dev_err(bus->dev,
+				"itedtv_usb_alloc_urb_buffer: usb_alloc_urb() failed. (i: %u)\n",
+				i);
+			return -ENOMEM;
+		}
+
+		works[i].urb = urb;
+	}
+
+	works[i].ctx = ctx;
+	works[i].index = i;
+
+	if (!urb->transfer_buffer) {
+#ifdef __linux__
+#ifdef __GFP_RETRY_MAYFAIL
+		/* the coherent buffers come from the node of the host controller */
+		if (!no_dma)
+			p = usb_alloc_coherent(dev, buf_size,
+					       GFP_KERNEL | __GFP_RETRY_MAYFAIL, &dma);
+		else
+			p = kmalloc_node(buf_size, GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+					 itedtv_bus_node(bus));
+#else
+		if (!no_dma)
+			p = usb_alloc_coherent(dev, buf_size,
+					       GFP_KERNEL | __GFP_REPEAT, &dma);
+		else
+			p = kmalloc_node(buf_size, GFP_KERNEL | __GFP_REPEAT,
+					 itedtv_bus_node(bus));
+#endif
+#else
+		p = kmalloc(buf_size, GFP_KERNEL);
+#endif
+
+		if (!p) {
+#ifdef __linux__
+			if (!no_dma)
+				dev_err(bus->dev,
+					"itedtv_usb_alloc_urb_buffer: usb_alloc_coherent() failed. (i: %u)\n",
+					i);
+			else
+				dev_err(bus->dev,
+					"itedtv_usb_alloc_urb_buffer: kmalloc() failed. (i: %u)\n",
+					i);
+#else
+			dev_err(bus->dev,
+				"itedtv_usb_alloc_urb_buffer: kmalloc() failed. (i: %u)\n",
+				i);
+#endif
 
-		if (free_urb) {
 			usb_free_urb(urb);
 			works[i].urb = NULL;
+
+			return -ENOMEM;
+		}
+
+#ifdef __linux__
+		dev_dbg(bus->dev,
+			"itedtv_usb_alloc_urb_buffer: p: %p, buf_size: %u, dma: %pad\n",
+			p, buf_size, &dma);
+#else
+		dev_dbg(bus->dev,
+			"itedtv_usb_alloc_urb_buffer: p: %p, buf_size: %u\n",
+			p, buf_size);
+#endif
+
+		usb_fill_bulk_urb(urb, dev,
+				  usb_rcvbulkpipe(dev, 0x84),
+				  p, buf_size,
+				  itedtv_usb_complete, &works[i]);
+
+#ifdef __linux__
+		if (!no_dma) {
+			urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+			urb->transfer_dma = dma;
 		}
+#endif
+	}
+
+#ifdef __linux__
+	itedtv_usb_alloc_spare_buffer(ctx, &works[i], buf_size);
+#endif
+
+#ifdef ITEDTV_BUS_USE_WORKQUEUE
+	INIT_WORK(&works[i].work, itedtv_usb_workqueue_handler);
+#endif
+
+	return 0;
+}
+
+static int itedtv_usb_alloc_urb_buffers(struct itedtv_usb_context *ctx,
+					u32 buf_size, u32 num)
+{
+	u32 i;
+
+	if (!ctx->works)
+		return -EINVAL;
+
+	for (i = 0; i < num; i++) {
+		if (itedtv_usb_alloc_urb_buffer(ctx, i, buf_size))
+			break;
+	}
+
+	ctx->num_urb = i;
+
+	if (!i)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void itedtv_usb_free_urb_buffer(struct itedtv_usb_context *ctx,
+				       u32 i, bool free_urb)
+{
+	struct urb *urb = ctx->works[i].urb;
+
+	if (!urb)
+		return;
+
+#ifdef __linux__
+	if (ctx->works[i].sg_vaddr) {
+		struct itedtv_usb_work *w = &ctx->works[i];
+		u32 j;
+
+		vunmap(w->sg_vaddr);
+		for (j = 0; j < w->sg_num; j++)
+			__free_page(w->sg_pages[j]);
+
+		kfree(w->sgl);
+		kfree(w->sg_pages);
+
+		w->sg_pages = NULL;
+		w->sgl = NULL;
+		w->sg_num = 0;
+		w->sg_vaddr = NULL;
+
+		urb->sg = NULL;
+		urb->num_sgs = 0;
+		urb->transfer_buffer_length = 0;
+		urb->actual_length = 0;
+	}
+#endif
+
+	if (urb->transfer_buffer) {
+#ifdef __linux__
+		if (urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP) {
+			usb_free_coherent(ctx->bus->usb.dev,
+					  urb->transfer_buffer_length,
+					  urb->transfer_buffer,
+					  urb->transfer_dma);
+			urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+			urb->transfer_dma = 0;
+		} else {
+			kfree(urb->transfer_buffer);
+		}
+#else
+		kfree(urb->transfer_buffer);
+#endif
+
+		urb->transfer_buffer = NULL;
+		urb->transfer_buffer_length = 0;
+		urb->actual_length = 0;
+	}
+
+	if (free_urb) {
+#ifdef __linux__
+		/* kept while retired by the adaptive pool */
+		itedtv_usb_free_spare_buffer(ctx, &ctx->works[i]);
+#endif
+		usb_free_urb(urb);
+		ctx->works[i].urb = NULL;
+	}
+
+	return;
+}
+
+static void itedtv_usb_free_urb_buffers(struct itedtv_usb_context *ctx,
+					bool free_urb)
+{
+	u32 i;
+
+	if (!ctx->works)
+		return;
+
+	for (i = 0; i < ctx->num_works; i++)
+		itedtv_usb_free_urb_buffer(ctx, i, free_urb);
+
+	if (free_urb)
+		ctx->num_urb = 0;
+
+	return;
+}
+
+#ifdef __linux__
+/*
+ * Module-wide budget of the URB buffers. The buses streaming share it in
+ * proportion to their weights (the bitrates of the streams being captured),
+ * and the shares are redistributed whenever a bus starts or stops streaming
+ * or its weight changes. A bus gets at least one URB.
+ */
+static DEFINE_MUTEX(itedtv_usb_budget_lock);
+static LIST_HEAD(itedtv_usb_budget_list);
+static u32 itedtv_usb_budget_size = 0;	// MiB, 0: disabled
+
+/* must be called with itedtv_usb_budget_lock held */
+static void itedtv_usb_budget_rebalance(void)
+{
+	struct itedtv_usb_context *ctx;
+	u64 total = 0;
+
+	list_for_each_entry(ctx, &itedtv_usb_budget_list, budget_node)
+		total += max(ctx->budget_weight, 1U);
+
+	list_for_each_entry(ctx, &itedtv_usb_budget_list, budget_node) {
+		u32 num = 0;
+
+		if (itedtv_usb_budget_size) {
+			u64 share = div64_u64(((u64)itedtv_usb_budget_size << 20) *
+					      max(ctx->budget_weight, 1U),
+					      total);
+
+			num = clamp_t(u64, div_u64(share, ctx->buf_size),
+				      1, ctx->num_works);
+		}
+
+		if (num == READ_ONCE(ctx->budget_urb))
+			continue;
+
+		dev_dbg(ctx->bus->dev,
+			"itedtv_usb_budget_rebalance: num: %u, weight: %u/%llu\n",
+			num, ctx->budget_weight, total);
+
+		/* applied by itedtv_usb_adapt_work() */
+		WRITE_ONCE(ctx->budget_urb, num);
+		mod_delayed_work(system_wq, &ctx->adapt_work, 0);
+	}
+
+	return;
+}
+
+static void itedtv_usb_budget_join(struct itedtv_usb_context *ctx)
+{
+	mutex_lock(&itedtv_usb_budget_lock);
+
+	if (list_empty(&ctx->budget_node))
+		list_add_tail(&ctx->budget_node, &itedtv_usb_budget_list);
+
+	itedtv_usb_budget_rebalance();
+
+	mutex_unlock(&itedtv_usb_budget_lock);
+
+	return;
+}
+
+static void itedtv_usb_budget_leave(struct itedtv_usb_context *ctx)
+{
+	mutex_lock(&itedtv_usb_budget_lock);
+
+	if (!list_empty(&ctx->budget_node)) {
+		list_del_init(&ctx->budget_node);
+		itedtv_usb_budget_rebalance();
+	}
+
+	WRITE_ONCE(ctx->budget_urb, 0);
+
+	mutex_unlock(&itedtv_usb_budget_lock);
+
+	return;
+}
+
+/* number of URBs the bus may use at most, urb_num unless the budget decides */
+static u32 itedtv_usb_urb_limit(struct itedtv_usb_context *ctx)
+{
+	u32 num = READ_ONCE(ctx->budget_urb);
+
+	if (!num)
+		num = max_t(u32, READ_ONCE(ctx->bus->usb.streaming.urb_num), 1);
+
+	return min(num, ctx->num_works);
+}
+
+/*
+ * Automatic choice of the URB buffers. The coherent buffers are uncached on
+ * the platforms without coherent DMA, where the stream handler reading them
+ * is slower than a kmalloc'd buffer mapped for each transfer. So on the first
+ * start of streaming on a host controller, a read like the TS demux (headers
+ * and a copy of each packet) is timed on both kinds of buffers, the mapping
+ * and unmapping of the kmalloc'd one included, and the result is kept for
+ * the other devices on the host controller.
+ */
+#define ITEDTV_USB_DMA_PROBE_ROUNDS	4
+
+struct itedtv_usb_dma_probe {
+	struct list_head list;
+	int busnum;
+	bool no_dma;
+};
+
+static DEFINE_MUTEX(itedtv_usb_dma_probe_lock);
+static LIST_HEAD(itedtv_usb_dma_probe_list);
+static u32 itedtv_usb_dma_probe_sink;	// keeps the reads
+
+static u32 itedtv_usb_dma_probe_read(const u8 *p, u32 size)
+{
+	u8 pkt[188];
+	u32 i, sum = 0;
+
+	for (i = 0; i + 188 <= size; i += 188) {
+		sum += p[i] + p[i + 1] + p[i + 2] + p[i + 3];
+		memcpy(pkt, &p[i], 188);
+		sum += pkt[187];
+	}
+
+	return sum;
+}
+
+/* nsecs of the fastest round, 0: could not be measured */
+static u64 itedtv_usb_dma_probe_time(struct itedtv_bus *bus, void *p,
+				     u32 size, bool map)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+	struct device *dma_dev = bus->usb.dev->bus->sysdev;
+#else
+	struct device *dma_dev = bus->usb.dev->bus->controller;
+#endif
+	u64 best = 0;
+	int i;
+
+	for (i = 0; i < ITEDTV_USB_DMA_PROBE_ROUNDS; i++) {
+		dma_addr_t dma = 0;
+		u64 t;
+
+		t = ktime_get_ns();
+
+		if (map) {
+			dma = dma_map_single(dma_dev, p, size, DMA_FROM_DEVICE);
+			if (dma_mapping_error(dma_dev, dma))
+				return 0;
+
+			dma_unmap_single(dma_dev, dma, size, DMA_FROM_DEVICE);
+		}
+
+		WRITE_ONCE(itedtv_usb_dma_probe_sink,
+			   itedtv_usb_dma_probe_read(p, size));
+
+		t = ktime_get_ns() - t;
+		if (!best || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+/* whether kmalloc'd buffers are to be used on the host controller of the bus */
+static bool itedtv_usb_dma_probe(struct itedtv_bus *bus, u32 buf_size)
+{
+	struct usb_device *dev = bus->usb.dev;
+	struct itedtv_usb_dma_probe *probe;
+	bool no_dma = false;
+	void *coherent = NULL, *p = NULL;
+	dma_addr_t dma;
+	u64 t_coherent, t_kmalloc;
+
+	mutex_lock(&itedtv_usb_dma_probe_lock);
+
+	list_for_each_entry(probe, &itedtv_usb_dma_probe_list, list) {
+		if (probe->busnum == dev->bus->busnum) {
+			no_dma = probe->no_dma;
+			goto exit;
+		}
+	}
+
+	coherent = usb_alloc_coherent(dev, buf_size, GFP_KERNEL, &dma);
+	p = kmalloc_node(buf_size, GFP_KERNEL, itedtv_bus_node(bus));
+	if (!coherent || !p)
+		goto exit;
+
+	/* the stream handler reads data the device has just written */
+	memset(coherent, 0x47, buf_size);
+	memset(p, 0x47, buf_size);
+
+	t_coherent = itedtv_usb_dma_probe_time(bus, coherent, buf_size, false);
+	t_kmalloc = itedtv_usb_dma_probe_time(bus, p, buf_size, true);
+	if (!t_coherent || !t_kmalloc)
+		goto exit;
+
+	/* the coherent buffers are kept unless clearly slower */
+	no_dma = (t_kmalloc + (t_kmalloc >> 3) < t_coherent);
+
+	dev_info(bus->dev,
+		 "itedtv_usb_dma_probe: bus %d: coherent: %llu ns, kmalloc: %llu ns, using %s buffers.\n",
+		 dev->bus->busnum, t_coherent, t_kmalloc,
+		 (no_dma) ? "kmalloc'd" : "coherent");
+
+	probe = kzalloc(sizeof(*probe), GFP_KERNEL);
+	if (probe) {
+		probe->busnum = dev->bus->busnum;
+		probe->no_dma = no_dma;
+		list_add_tail(&probe->list, &itedtv_usb_dma_probe_list);
+	}
+
+exit:
+	mutex_unlock(&itedtv_usb_dma_probe_lock);
+
+	kfree(p);
+	if (coherent)
+		usb_free_coherent(dev, buf_size, coherent, dma);
+
+	return no_dma;
+}
+
+/*
+ * Grows the pool by one URB when the host controller was left with no
+ * URB queued, and shrinks it by one after it kept at least two spare URBs
+ * for ITEDTV_USB_ADAPT_SHRINK_PERIODS intervals in a row.
+ * Without the adaptive mode, the pool is only fitted to the URB budget.
+ */
+static void itedtv_usb_adapt_work(struct work_struct *work)
+{
+	struct itedtv_usb_context *ctx = container_of(to_delayed_work(work),
+						      struct itedtv_usb_context,
+						      adapt_work);
+	struct itedtv_bus *bus = ctx->bus;
+	int low_water;
+	u32 i, active, limit;
+
+	if (atomic_read_acquire(&ctx->streaming) < 1)
+		return;
+
+	low_water = atomic_xchg(&ctx->low_water, INT_MAX);
+	active = atomic_read(&ctx->active_urb);
+	limit = itedtv_usb_urb_limit(ctx);
+
+	if (active > limit) {
+		active = limit;
+		ctx->idle_periods = 0;
+		atomic_set(&ctx->active_urb, active);
+		dev_dbg(bus->dev,
+			"itedtv_usb_adapt_work: budget (num: %u)\n",
+			active);
+	} else if (!ctx->adaptive) {
+		/* the budget has grown */
+		while (active < limit &&
+		       !itedtv_usb_alloc_urb_buffer(ctx, active, ctx->buf_size)) {
+			if (ctx->num_urb <= active)
+				ctx->num_urb = active + 1;
+
+			active++;
+		}
+
+		if (active != atomic_read(&ctx->active_urb)) {
+			atomic_set(&ctx->active_urb, active);
+			dev_dbg(bus->dev,
+				"itedtv_usb_adapt_work: budget (num: %u)\n",
+				active);
+		}
+	} else if (!low_water && active < limit) {
+		if (!itedtv_usb_alloc_urb_buffer(ctx, active, ctx->buf_size)) {
+			if (ctx->num_urb <= active)
+				ctx->num_urb = active + 1;
+
+			atomic_set(&ctx->active_urb, ++active);
+			dev_dbg(bus->dev,
+				"itedtv_usb_adapt_work: grow (num: %u)\n",
+				active);
+		}
+
+		ctx->idle_periods = 0;
+	} else if (low_water >= 2 && low_water != INT_MAX) {
+		if (++ctx->idle_periods >= ITEDTV_USB_ADAPT_SHRINK_PERIODS &&
+		    active > ctx->min_urb) {
+			atomic_set(&ctx->active_urb, --active);
+			ctx->idle_periods = 0;
+			dev_dbg(bus->dev,
+				"itedtv_usb_adapt_work: shrink (num: %u)\n",
+				active);
+		}
+	} else {
+		ctx->idle_periods = 0;
+	}
+
+	for (i = 0; i < ctx->num_works; i++) {
+		struct itedtv_usb_work *w = &ctx->works[i];
+
+		/* claimed, itedtv_usb_recover_work() may look at it as well */
+		if (!w->urb || atomic_cmpxchg(&w->queued, 0, 1))
+			continue;
+
+		if (i < active) {
+			/* newly activated, or revived before it was retired */
+			if (itedtv_usb_submit_urb(ctx, w, GFP_KERNEL))
+				bus->stats.urb_submit_errors++;
+		} else {
+			/* retired, give the buffer back */
+			if (itedtv_usb_has_buffer(w))
+				itedtv_usb_free_urb_buffer(ctx, i, false);
+
+			atomic_set_release(&w->queued, 0);
+		}
+	}
+
+	if (ctx->adaptive)
+		schedule_delayed_work(&ctx->adapt_work,
+				      msecs_to_jiffies(ITEDTV_USB_ADAPT_INTERVAL));
+
+	return;
+}
+
+/*
+ * Restarts the bulk pipe in place: the URBs are killed, the device side
+ * buffer is purged by the restart handler, then the URBs go back into the
+ * queue. The tuners stay tuned.
+ */
+static void itedtv_usb_restart_pipe(struct itedtv_usb_context *ctx)
+{
+	struct itedtv_bus *bus = ctx->bus;
+	u32 i, active;
+
+	mutex_lock(&ctx->lock);
+
+	if (atomic_xchg(&ctx->streaming, 0) < 1)
+		goto exit;
+
+	/* also kicked by the URB budget */
+	cancel_delayed_work_sync(&ctx->adapt_work);
+	cancel_delayed_work_sync(&ctx->recover_work);
+
+#ifdef ITEDTV_BUS_USE_WORKQUEUE
+	if (ctx->wq)
+		flush_workqueue(ctx->wq);
+#else
+	if (ctx->done_wq)
+		flush_work(&ctx->done_work);
+#endif
+
+	for (i = 0; i < ctx->num_works; i++) {
+		if (ctx->works[i].urb)
+			usb_kill_urb(ctx->works[i].urb);
+	}
+
+#ifndef ITEDTV_BUS_USE_WORKQUEUE
+	if (ctx->done_wq) {
+		cancel_work_sync(&ctx->done_work);
+		llist_del_all(&ctx->done_list);
+	}
+#endif
+
+	if (bus->usb.streaming.restart_handler)
+		bus->usb.streaming.restart_handler(bus->usb.streaming.restart_context);
+
+	usb_reset_endpoint(bus->usb.dev, 0x84);
+
+	bus->stats.stream_restarts++;
+	bus->stats.urb_last_complete = 0;
+
+	for (i = 0; i < ctx->num_works; i++)
+		atomic_set(&ctx->works[i].queued, 0);
+
+	atomic_set(&ctx->in_flight, 0);
+	atomic_set(&ctx->low_water, INT_MAX);
+	atomic_set(&ctx->error_run, 0);
+	atomic_set(&ctx->halted, 0);
+	atomic_xchg(&ctx->streaming, 1);
+
+	active = atomic_read(&ctx->active_urb);
+
+	for (i = 0; i < active && i < ctx->num_works; i++) {
+		struct itedtv_usb_work *w = &ctx->works[i];
+
+		/*
+		 * claimed, the URB budget may have queued itedtv_usb_adapt_work()
+		 * again since it was cancelled, and it runs once streaming is set
+		 */
+		if (!w->urb || !itedtv_usb_has_buffer(w) ||
+		    atomic_cmpxchg(&w->queued, 0, 1))
+			continue;
+
+		if (itedtv_usb_submit_urb(ctx, w, GFP_KERNEL)) {
+			bus->stats.urb_submit_errors++;
+			itedtv_usb_schedule_recover(ctx, ITEDTV_USB_RECOVER_DELAY);
+		}
+	}
+
+	if (ctx->adaptive)
+		schedule_delayed_work(&ctx->adapt_work,
+				      msecs_to_jiffies(ITEDTV_USB_ADAPT_INTERVAL));
+	else if (READ_ONCE(ctx->budget_urb))
+		mod_delayed_work(system_wq, &ctx->adapt_work, 0);
+
+exit:
+	mutex_unlock(&ctx->lock);
+
+	return;
+}
+
+/*
+ * Restarts the pipe once no URB has completed for watchdog_timeout msecs.
+ * While the stream stays dead (e.g. no signal at all), the time to the next
+ * restart is doubled up to ITEDTV_USB_WATCHDOG_MAX_BACKOFF timeouts.
+ */
+static void itedtv_usb_watchdog_work(struct work_struct *work)
+{
+	struct itedtv_usb_context *ctx = container_of(to_delayed_work(work),
+						      struct itedtv_usb_context,
+						      watchdog_work);
+	struct itedtv_bus *bus = ctx->bus;
+	u64 timeout = (u64)ctx->watchdog_timeout * NSEC_PER_MSEC;
+	u64 now = ktime_get_ns(), last;
+
+	if (atomic_read_acquire(&ctx->streaming) < 1)
+		return;
+
+	last = max(READ_ONCE(bus->stats.urb_last_complete), ctx->watchdog_since);
+
+	if (last > ctx->watchdog_since) {
+		/* the stream is alive */
+		ctx->watchdog_backoff = 1;
+		ctx->watchdog_since = last;
+	} else if (now > last && now - last >= timeout) {
+		if (ctx->watchdog_backoff == 1)
+			dev_info(bus->dev,
+				 "itedtv_usb_watchdog_work: no data for %u msecs, restarting the stream.\n",
+				 ctx->watchdog_timeout);
+
+		itedtv_usb_restart_pipe(ctx);
+
+		now = ktime_get_ns();
+		ctx->watchdog_since = now + (ctx->watchdog_backoff - 1) * timeout;
+
+		if (ctx->watchdog_backoff < ITEDTV_USB_WATCHDOG_MAX_BACKOFF)
+			ctx->watchdog_backoff *= 2;
 	}
 
-	if (free_urb)
-		ctx->num_urb = 0;
+	/* a stall is seen within a quarter of the timeout */
+	schedule_delayed_work(&ctx->watchdog_work,
+			      max(msecs_to_jiffies(ctx->watchdog_timeout) / 4, 1UL));
 
 	return;
 }
+#endif
 
 static void itedtv_usb_clean_context(struct itedtv_usb_context *ctx, bool free_works)
 {
@@ -401,8 +1576,13 @@ static void itedtv_usb_clean_context(struct itedtv_usb_context *ctx, bool free_w
 	ctx->stream_handler = NULL;
 	ctx->ctx = NULL;
 	ctx->no_dma = false;
+	ctx->adaptive = false;
+	ctx->double_buffer = false;
+	ctx->use_sg = false;
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 	ctx->wq = NULL;
+#elif defined(__linux__)
+	ctx->done_wq = NULL;
 #endif
 
 	return;
@@ -426,10 +1606,22 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 
 	ctx->stream_handler = stream_handler;
 	ctx->ctx = context;
+#ifdef __linux__
+	/* the time not streaming is not an interval */
+	bus->stats.urb_last_complete = 0;
+#endif
 
 	buf_size = bus->usb.streaming.urb_buffer_size;
 	num = bus->usb.streaming.urb_num;
 	ctx->no_dma = bus->usb.streaming.no_dma;
+#ifdef __linux__
+	if (bus->usb.streaming.dma_probe)
+		ctx->no_dma = itedtv_usb_dma_probe(bus, buf_size);
+
+	/* the budget decides how many of them are used */
+	if (READ_ONCE(itedtv_usb_budget_size))
+		num = max_t(u32, num, ITEDTV_USB_BUDGET_MAX_URBS);
+#endif
 
 	if (ctx->works && num != ctx->num_works) {
 		itedtv_usb_free_urb_buffers(ctx, true);
@@ -448,7 +1640,36 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 		}
 	}
 
-	ret = itedtv_usb_alloc_urb_buffers(ctx, buf_size);
+	for (i = 0; i < num; i++)
+		atomic_set(&ctx->works[i].queued, 0);
+
+#ifdef __linux__
+	ctx->adaptive = bus->usb.streaming.adaptive;
+	ctx->double_buffer = bus->usb.streaming.double_buffer;
+	ctx->use_sg = false;
+	if (bus->usb.streaming.sg) {
+		/* each page but the last is a multiple of the max packet size */
+		if (bus->usb.dev->bus->sg_tablesize >= DIV_ROUND_UP(buf_size, PAGE_SIZE))
+			ctx->use_sg = true;
+		else
+			dev_info(bus->dev,
+				 "itedtv_usb_start_streaming: scatter-gather is not available. (sg_tablesize: %u)\n",
+				 bus->usb.dev->bus->sg_tablesize);
+	}
+#endif
+	ctx->buf_size = buf_size;
+
+#ifdef __linux__
+	itedtv_usb_budget_join(ctx);
+	num = itedtv_usb_urb_limit(ctx);
+#endif
+	if (ctx->adaptive) {
+		ctx->min_urb = clamp_t(u32, bus->usb.streaming.urb_min_num,
+				       1, num);
+		num = ctx->min_urb;
+	}
+
+	ret = itedtv_usb_alloc_urb_buffers(ctx, buf_size, num);
 	if (ret)
 		goto fail;
 
@@ -460,16 +1681,33 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 			goto fail;
 		}
 	}
+#elif defined(__linux__)
+	if (bus->usb.streaming.workqueue) {
+		ctx->done_wq = itedtv_usb_get_workqueue(bus->usb.streaming.wq_max_active);
+		if (!ctx->done_wq) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		ctx->done_cpu = itedtv_usb_select_cpu(ctx);
+	}
 #endif
 
 	usb_reset_endpoint(bus->usb.dev, 0x84);
-	atomic_xchg(&ctx->streaming, 1);
 
 	num = ctx->num_urb;
 	works = ctx->works;
 
+	atomic_set(&ctx->in_flight, 0);
+	atomic_set(&ctx->low_water, INT_MAX);
+	atomic_set(&ctx->active_urb, num);
+	atomic_set(&ctx->error_run, 0);
+	atomic_set(&ctx->halted, 0);
+	ctx->idle_periods = 0;
+	atomic_xchg(&ctx->streaming, 1);
+
 	for (i = 0; i < num; i++) {
-		ret = usb_submit_urb(works[i].urb, GFP_KERNEL);
+		ret = itedtv_usb_submit_urb(ctx, &works[i], GFP_KERNEL);
 		if (ret) {
 			u32 j;
 
@@ -478,7 +1716,7 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 				i, ret);
 
 			for (j = 0; j < i; j++)
-				usb_kill_urb(works[i].urb);
+				usb_kill_urb(works[j].urb);
 
 			break;
 		}
@@ -487,6 +1725,23 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 	if (ret)
 		goto fail;
 
+#ifdef __linux__
+	if (ctx->adaptive)
+		schedule_delayed_work(&ctx->adapt_work,
+				      msecs_to_jiffies(ITEDTV_USB_ADAPT_INTERVAL));
+	else if (READ_ONCE(ctx->budget_urb))
+		/* the share may have changed since it was allocated */
+		mod_delayed_work(system_wq, &ctx->adapt_work, 0);
+
+	ctx->watchdog_timeout = READ_ONCE(bus->usb.streaming.watchdog_timeout);
+	if (ctx->watchdog_timeout) {
+		ctx->watchdog_backoff = 1;
+		ctx->watchdog_since = ktime_get_ns();
+		schedule_delayed_work(&ctx->watchdog_work,
+				      msecs_to_jiffies(ctx->watchdog_timeout));
+	}
+#endif
+
 	dev_dbg(bus->dev, "itedtv_usb_start_streaming: num: %u\n", num);
 
 	mutex_unlock(&ctx->lock);
@@ -496,9 +1751,19 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus,
 fail:
 	atomic_xchg(&ctx->streaming, 0);
 
+#ifdef __linux__
+	itedtv_usb_budget_leave(ctx);
+	cancel_delayed_work_sync(&ctx->adapt_work);
+#endif
+
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 	if (ctx->wq)
 		flush_workqueue(ctx->wq);
+#elif defined(__linux__)
+	if (ctx->done_wq) {
+		cancel_work_sync(&ctx->done_work);
+		llist_del_all(&ctx->done_list);
+	}
 #endif
 
 	itedtv_usb_clean_context(ctx, true);
@@ -515,22 +1780,49 @@ static int itedtv_usb_stop_streaming(struct itedtv_bus *bus)
 
 	dev_dbg(bus->dev, "itedtv_usb_stop_streaming\n");
 
+#ifdef __linux__
+	/* before the lock, the watchdog takes it to restart the pipe */
+	cancel_delayed_work_sync(&ctx->watchdog_work);
+#endif
+
 	mutex_lock(&ctx->lock);
 
 	atomic_xchg(&ctx->streaming, 0);
 
+#ifdef __linux__
+	/* the others get its share, it is not kicked by the budget any more */
+	itedtv_usb_budget_leave(ctx);
+	cancel_delayed_work_sync(&ctx->adapt_work);
+
+	/* nothing is resubmitted from now on, the URBs can be killed */
+	cancel_delayed_work_sync(&ctx->recover_work);
+#endif
+
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 	if (ctx->wq)
 		flush_workqueue(ctx->wq);
+#elif defined(__linux__)
+	if (ctx->done_wq)
+		flush_work(&ctx->done_work);
 #endif
 
 	if (ctx->works) {
-		u32 num = ctx->num_urb;
+		u32 num = ctx->num_works;
 		struct itedtv_usb_work *works = ctx->works;
 
-		for (i = 0; i < num; i++)
-			usb_kill_urb(works[i].urb);
+		for (i = 0; i < num; i++) {
+			if (works[i].urb)
+				usb_kill_urb(works[i].urb);
+		}
+	}
+
+#if !defined(ITEDTV_BUS_USE_WORKQUEUE) && defined(__linux__)
+	/* drop the URBs completed while they were being killed */
+	if (ctx->done_wq) {
+		cancel_work_sync(&ctx->done_work);
+		llist_del_all(&ctx->done_list);
 	}
+#endif
 
 	itedtv_usb_clean_context(ctx, false);
 
@@ -539,6 +1831,300 @@ static int itedtv_usb_stop_streaming(struct itedtv_bus *bus)
 	return 0;
 }
 
+#ifdef __linux__
+/*
+ * Loopback bus
+ *
+ * Emulates an IT930x without hardware. Control messages are answered with
+ * well-formed success responses (reads return zeros), and streaming feeds
+ * generated TS packets into the stream handler at the configured bitrates,
+ * so ts_demux, ptx_chrdev and the ringbuffer can be exercised at line rate.
+ */
+
+#define ITEDTV_LOOPBACK_CTRL_QUEUE_SIZE	16
+#define ITEDTV_LOOPBACK_INTERVAL	2	// msecs
+#define ITEDTV_LOOPBACK_MAX_BACKLOG	100	// msecs
+
+#define ITEDTV_LOOPBACK_CMD_REG_READ	0x00
+#define ITEDTV_LOOPBACK_CMD_I2C_READ	0x2a
+
+struct itedtv_loopback_response {
+	u8 seq;
+	u8 len;
+};
+
+struct itedtv_loopback_context {
+	struct mutex lock;
+	struct itedtv_bus *bus;
+	spinlock_t ctrl_lock;
+	unsigned int ctrl_head;
+	unsigned int ctrl_num;
+	struct itedtv_loopback_response ctrl_queue[ITEDTV_LOOPBACK_CTRL_QUEUE_SIZE];
+	itedtv_bus_stream_handler_t stream_handler;
+	void *ctx;
+	u8 *buf;
+	u32 buf_size;
+	u64 start_time;
+	u64 sent[ITEDTV_BUS_LOOPBACK_MAX_INPUT];
+	u8 cc[ITEDTV_BUS_LOOPBACK_MAX_INPUT];
+	struct delayed_work work;
+	atomic_t streaming;
+};
+
+static u16 itedtv_loopback_checksum(const u8 *buf, size_t len)
+{
+	u16 c = 0;
+
+	while (len >= 2) {
+		c += ((buf[0] << 8) | buf[1]);
+		buf += 2;
+		len -= 2;
+	}
+
+	if (len)
+		c += (buf[0] << 8);
+
+	return ~c;
+}
+
+static int itedtv_loopback_ctrl_tx(struct itedtv_bus *bus, void *buf, int len)
+{
+	int ret = 0;
+	struct itedtv_loopback_context *ctx = bus->loopback.priv;
+	u8 *b = buf;
+	u16 cmd;
+	struct itedtv_loopback_response *res;
+
+	if (unlikely(!buf || len < 6))
+		return -EINVAL;
+
+	spin_lock(&ctx->ctrl_lock);
+
+	if (ctx->ctrl_num >= ITEDTV_LOOPBACK_CTRL_QUEUE_SIZE) {
+		ret = -EBUSY;
+		goto exit;
+	}
+
+	res = &ctx->ctrl_queue[(ctx->ctrl_head + ctx->ctrl_num) % ITEDTV_LOOPBACK_CTRL_QUEUE_SIZE];
+	cmd = (b[1] << 8) | b[2];
+
+	res->seq = b[3];
+	res->len = 0;
+
+	/* both requests carry the length to read as the first data byte */
+	if ((cmd == ITEDTV_LOOPBACK_CMD_REG_READ ||
+	     cmd == ITEDTV_LOOPBACK_CMD_I2C_READ) && len > 6)
+		res->len = min_t(u8, b[4], 255 - 3 - 2);
+
+	ctx->ctrl_num++;
+
+exit:
+	spin_unlock(&ctx->ctrl_lock);
+
+	return ret;
+}
+
+static int itedtv_loopback_ctrl_rx(struct itedtv_bus *bus, void *buf, int *len)
+{
+	struct itedtv_loopback_context *ctx = bus->loopback.priv;
+	struct itedtv_loopback_response res;
+	u8 *b = buf;
+	int rlen;
+	u16 csum;
+
+	if (unlikely(!buf || !len || !*len))
+		return -EINVAL;
+
+	spin_lock(&ctx->ctrl_lock);
+
+	if (!ctx->ctrl_num) {
+		spin_unlock(&ctx->ctrl_lock);
+		return -ETIMEDOUT;
+	}
+
+	res = ctx->ctrl_queue[ctx->ctrl_head];
+	ctx->ctrl_head = (ctx->ctrl_head + 1) % ITEDTV_LOOPBACK_CTRL_QUEUE_SIZE;
+	ctx->ctrl_num--;
+
+	spin_unlock(&ctx->ctrl_lock);
+
+	rlen = 3 + res.len + 2;
+	if (rlen > *len)
+		return -EOVERFLOW;
+
+	b[0] = rlen - 1;
+	b[1] = res.seq;
+	b[2] = 0;
+	memset(&b[3], 0, res.len);
+
+	csum = itedtv_loopback_checksum(&b[1], rlen - 1 - 2);
+	b[rlen - 2] = (csum >> 8) & 0xff;
+	b[rlen - 1] = csum & 0xff;
+
+	*len = rlen;
+
+	return 0;
+}
+
+static int itedtv_loopback_stream_rx(struct itedtv_bus *bus,
+				     void *buf, int *len,
+				     int timeout)
+{
+	if (unlikely(!buf || !len || !*len))
+		return -EINVAL;
+
+	/* nothing is left in the emulated stream buffer */
+	*len = 0;
+
+	return 0;
+}
+
+static void itedtv_loopback_fill_packet(struct itedtv_loopback_context *ctx,
+					u8 *p, int id)
+{
+	u16 pid = 0x0100 + id;
+
+	p[0] = (ctx->bus->loopback.tagged) ? (((id + 1) << 4) | 0x07) : 0x47;
+	p[1] = 0x40 | ((pid >> 8) & 0x1f);
+	p[2] = pid & 0xff;
+	p[3] = 0x10 | (ctx->cc[id]++ & 0x0f);
+	memset(&p[4], 0xff, 188 - 4);
+}
+
+static void itedtv_loopback_work(struct work_struct *work)
+{
+	struct itedtv_loopback_context *ctx = container_of(to_delayed_work(work),
+							   struct itedtv_loopback_context,
+							   work);
+	struct itedtv_bus *bus = ctx->bus;
+	u64 now, elapsed;
+	u64 pending[ITEDTV_BUS_LOOPBACK_MAX_INPUT] = { 0 }, total = 0;
+	int i, num = bus->loopback.input_num;
+
+	now = ktime_get_ns();
+	elapsed = div_u64(now - ctx->start_time, NSEC_PER_USEC);
+
+	for (i = 0; i < num; i++) {
+		u32 rate = bus->loopback.bitrate[i];
+		u64 due, max;
+
+		/* number of packets the input should have produced by now */
+		due = mul_u64_u32_div(elapsed, rate, 188 * 8 * USEC_PER_SEC);
+
+		/* don't try to catch up after a long stall */
+		max = div_u64((u64)rate * ITEDTV_LOOPBACK_MAX_BACKLOG,
+			      188 * 8 * MSEC_PER_SEC) + 1;
+		if (due - ctx->sent[i] > max)
+			ctx->sent[i] = due - max;
+
+		pending[i] = due - ctx->sent[i];
+		ctx->sent[i] = due;
+		total += pending[i];
+	}
+
+	while (total && atomic_read(&ctx->streaming)) {
+		u8 *p = ctx->buf;
+		u32 len = 0;
+
+		/* interleave the inputs as the bridge does */
+		while (total && len + 188 <= ctx->buf_size) {
+			for (i = 0; i < num && len + 188 <= ctx->buf_size; i++) {
+				if (!pending[i])
+					continue;
+
+				itedtv_loopback_fill_packet(ctx, p, i);
+				p += 188;
+				len += 188;
+				pending[i]--;
+				total--;
+			}
+		}
+
+		bus->stream_time = now;
+		bus->stats.urb_completed++;
+		itedtv_bus_count_rx(bus, len, now);
+		ctx->stream_handler(ctx->ctx, ctx->buf, len);
+	}
+
+	if (atomic_read(&ctx->streaming))
+		queue_delayed_work(system_highpri_wq, &ctx->work,
+				   msecs_to_jiffies(ITEDTV_LOOPBACK_INTERVAL));
+
+	return;
+}
+
+static int itedtv_loopback_start_streaming(struct itedtv_bus *bus,
+					   itedtv_bus_stream_handler_t stream_handler,
+					   void *context)
+{
+	int ret = 0, i;
+	struct itedtv_loopback_context *ctx = bus->loopback.priv;
+
+	if (!stream_handler)
+		return -EINVAL;
+
+	dev_dbg(bus->dev, "itedtv_loopback_start_streaming\n");
+
+	mutex_lock(&ctx->lock);
+
+	if (atomic_read(&ctx->streaming)) {
+		ret = -EALREADY;
+		goto exit;
+	}
+
+	ctx->buf_size = rounddown(bus->loopback.buffer_size, 188);
+	if (!ctx->buf_size)
+		ctx->buf_size = 188 * 816;
+
+	ctx->buf = vmalloc(ctx->buf_size);
+	if (!ctx->buf) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	ctx->stream_handler = stream_handler;
+	ctx->ctx = context;
+
+	for (i = 0; i < ITEDTV_BUS_LOOPBACK_MAX_INPUT; i++) {
+		ctx->sent[i] = 0;
+		ctx->cc[i] = 0;
+	}
+
+	ctx->start_time = ktime_get_ns();
+	atomic_set(&ctx->streaming, 1);
+
+	queue_delayed_work(system_highpri_wq, &ctx->work,
+			   msecs_to_jiffies(ITEDTV_LOOPBACK_INTERVAL));
+
+exit:
+	mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+static int itedtv_loopback_stop_streaming(struct itedtv_bus *bus)
+{
+	struct itedtv_loopback_context *ctx = bus->loopback.priv;
+
+	dev_dbg(bus->dev, "itedtv_loopback_stop_streaming\n");
+
+	mutex_lock(&ctx->lock);
+
+	if (atomic_xchg(&ctx->streaming, 0)) {
+		cancel_delayed_work_sync(&ctx->work);
+
+		vfree(ctx->buf);
+		ctx->buf = NULL;
+		ctx->stream_handler = NULL;
+		ctx->ctx = NULL;
+	}
+
+	mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+#endif
+
 int itedtv_bus_init(struct itedtv_bus *bus)
 {
 	int ret = 0;
@@ -546,6 +2132,8 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 	if (!bus)
 		return -EINVAL;
 
+	memset(&bus->stats, 0, sizeof(bus->stats));
+
 	switch (bus->type) {
 	case ITEDTV_BUS_USB:
 	{
@@ -577,9 +2165,27 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 		ctx->no_dma = false;
 #ifdef ITEDTV_BUS_USE_WORKQUEUE
 		ctx->wq = NULL;
+#elif defined(__linux__)
+		ctx->done_wq = NULL;
+		init_llist_head(&ctx->done_list);
+		INIT_WORK(&ctx->done_work, itedtv_usb_done_work);
 #endif
 		ctx->num_works = 0;
 		ctx->works = NULL;
+		ctx->adaptive = false;
+		ctx->double_buffer = false;
+		ctx->use_sg = false;
+#ifdef __linux__
+		INIT_DELAYED_WORK(&ctx->adapt_work, itedtv_usb_adapt_work);
+		INIT_DELAYED_WORK(&ctx->recover_work, itedtv_usb_recover_work);
+		INIT_DELAYED_WORK(&ctx->watchdog_work, itedtv_usb_watchdog_work);
+		ctx->watchdog_timeout = 0;
+		INIT_LIST_HEAD(&ctx->budget_node);
+		ctx->budget_weight = 0;
+		ctx->budget_urb = 0;
+		atomic_set(&ctx->error_run, 0);
+		atomic_set(&ctx->halted, 0);
+#endif
 		atomic_set(&ctx->streaming, 0);
 
 		bus->usb.priv = ctx;
@@ -597,6 +2203,41 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 		break;
 	}
 
+#ifdef __linux__
+	case ITEDTV_BUS_LOOPBACK:
+	{
+		struct itedtv_loopback_context *ctx;
+
+		if (!bus->loopback.input_num ||
+		    bus->loopback.input_num > ITEDTV_BUS_LOOPBACK_MAX_INPUT) {
+			ret = -EINVAL;
+			break;
+		}
+
+		ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+		if (!ctx) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		mutex_init(&ctx->lock);
+		spin_lock_init(&ctx->ctrl_lock);
+		ctx->bus = bus;
+		INIT_DELAYED_WORK(&ctx->work, itedtv_loopback_work);
+		atomic_set(&ctx->streaming, 0);
+
+		bus->loopback.priv = ctx;
+
+		bus->ops.ctrl_tx = itedtv_loopback_ctrl_tx;
+		bus->ops.ctrl_rx = itedtv_loopback_ctrl_rx;
+		bus->ops.stream_rx = itedtv_loopback_stream_rx;
+		bus->ops.start_streaming = itedtv_loopback_start_streaming;
+		bus->ops.stop_streaming = itedtv_loopback_stop_streaming;
+
+		break;
+	}
+#endif
+
 	default:
 		ret = -EINVAL;
 		break;
@@ -634,6 +2275,21 @@ int itedtv_bus_term(struct itedtv_bus *bus)
 		break;
 	}
 
+#ifdef __linux__
+	case ITEDTV_BUS_LOOPBACK:
+	{
+		struct itedtv_loopback_context *ctx = bus->loopback.priv;
+
+		if (ctx) {
+			itedtv_loopback_stop_streaming(bus);
+			mutex_destroy(&ctx->lock);
+			kfree(ctx);
+		}
+
+		break;
+	}
+#endif
+
 	default:
 		break;
 	}
@@ -643,3 +2299,72 @@ int itedtv_bus_term(struct itedtv_bus *bus)
 exit:
 	return ret;
 }
+
+#ifdef __linux__
+/* size of the module-wide URB budget in MiB, 0: disabled */
+void itedtv_bus_set_urb_budget(u32 size)
+{
+	mutex_lock(&itedtv_usb_budget_lock);
+
+	if (itedtv_usb_budget_size != size) {
+		WRITE_ONCE(itedtv_usb_budget_size, size);
+		itedtv_usb_budget_rebalance();
+	}
+
+	mutex_unlock(&itedtv_usb_budget_lock);
+
+	return;
+}
+
+/* weight of the bus in the URB budget, the sum of the bitrates (Mbps) of its streams */
+void itedtv_bus_set_stream_weight(struct itedtv_bus *bus, u32 weight)
+{
+	struct itedtv_usb_context *ctx;
+
+	if (bus->type != ITEDTV_BUS_USB || !bus->usb.priv)
+		return;
+
+	ctx = bus->usb.priv;
+
+	mutex_lock(&itedtv_usb_budget_lock);
+
+	if (ctx->budget_weight != weight) {
+		ctx->budget_weight = weight;
+
+		if (!list_empty(&ctx->budget_node))
+			itedtv_usb_budget_rebalance();
+	}
+
+	mutex_unlock(&itedtv_usb_budget_lock);
+
+	return;
+}
+
+void itedtv_bus_cleanup(void)
+{
+#ifndef ITEDTV_BUS_USE_WORKQUEUE
+	mutex_lock(&itedtv_usb_wq_lock);
+
+	if (itedtv_usb_wq) {
+		destroy_workqueue(itedtv_usb_wq);
+		itedtv_usb_wq = NULL;
+	}
+
+	mutex_unlock(&itedtv_usb_wq_lock);
+#endif
+	mutex_lock(&itedtv_usb_dma_probe_lock);
+
+	while (!list_empty(&itedtv_usb_dma_probe_list)) {
+		struct itedtv_usb_dma_probe *probe;
+
+		probe = list_first_entry(&itedtv_usb_dma_probe_list,
+					 struct itedtv_usb_dma_probe, list);
+		list_del(&probe->list);
+		kfree(probe);
+	}
+
+	mutex_unlock(&itedtv_usb_dma_probe_lock);
+
+	return;
+}
+#endif
@@ -10,7 +10,10 @@
 
 #ifdef __linux__
 #include <linux/device.h>
+#include <linux/ktime.h>
 #include <linux/usb.h>
+
+#include "latency_hist.h"
 #elif defined(_WIN32) || defined(_WIN64)
 #include "misc_win.h"
 #include "winusb_compat.h"
@@ -19,12 +22,44 @@
 enum itedtv_bus_type {
 	ITEDTV_BUS_NONE = 0,
 	ITEDTV_BUS_USB,
+	ITEDTV_BUS_LOOPBACK,	// for Linux, synthetic device without hardware
 };
 
+#define ITEDTV_BUS_LOOPBACK_MAX_INPUT	5
+
 typedef int (*itedtv_bus_stream_handler_t)(void *context, void *buf, u32 len);
+typedef void (*itedtv_bus_restart_handler_t)(void *context);
 
 struct itedtv_bus;
 
+enum itedtv_bus_urb_error {
+	ITEDTV_BUS_URB_ERROR_EPROTO = 0,
+	ITEDTV_BUS_URB_ERROR_EILSEQ,
+	ITEDTV_BUS_URB_ERROR_EPIPE,
+	ITEDTV_BUS_URB_ERROR_EOVERFLOW,
+	ITEDTV_BUS_URB_ERROR_TIMEOUT,
+	ITEDTV_BUS_URB_ERROR_OTHER,
+	ITEDTV_BUS_URB_ERROR_NUM
+};
+
+/* updated by the streaming completion path only */
+struct itedtv_bus_stats {
+	u64 urb_completed;
+	u64 urb_errors[ITEDTV_BUS_URB_ERROR_NUM];
+	u64 urb_submit_errors;
+	u64 urb_resubmitted;	// resubmitted after an error
+	u64 urb_halt_clears;	// stalls of the pipe cleared
+	u64 stream_restarts;	// by the stream watchdog
+	u64 rx_bytes;
+	u64 rx_window_start;	// ns, of the current one second window
+	u32 rx_window_bytes;
+	u32 rx_rate;		// bytes per second, of the last complete window
+#ifdef __linux__
+	u64 urb_last_complete;	// ns, 0: none since streaming started
+	struct latency_hist urb_interval;	// between the URB completions
+#endif
+};
+
 struct itedtv_bus_operations {
 	int (*ctrl_tx)(struct itedtv_bus *bus, void *buf, int len);
 	int (*ctrl_rx)(struct itedtv_bus *bus, void *buf, int *len);
@@ -49,12 +84,33 @@ struct itedtv_bus {
 				u32 urb_buffer_size;
 				u32 urb_num;
 				bool no_dma;	// for Linux
+				bool dma_probe;	// for Linux, no_dma is decided by measuring on the first start
 				bool no_raw_io;	// for Windows(WinUSB)
+				bool large_pages;	// for Windows(WinUSB)
+				bool adaptive;	// for Linux
+				u32 urb_min_num;	// lower bound in adaptive mode
+				bool workqueue;	// for Linux
+				bool double_buffer;	// for Linux
+				bool sg;	// for Linux
+				int wq_max_active;	// for Linux
+				u32 watchdog_timeout;	// for Linux, msecs, 0: disabled
+				/* for Linux, called by the watchdog while the pipe is stopped */
+				itedtv_bus_restart_handler_t restart_handler;
+				void *restart_context;
 			} streaming;
 			void *priv;
 		} usb;
+		struct {
+			u32 input_num;
+			u32 bitrate[ITEDTV_BUS_LOOPBACK_MAX_INPUT];	// bits per second, per input
+			u32 buffer_size;	// bytes per stream handler call
+			bool tagged;	// IT930x style tagged sync bytes
+			void *priv;
+		} loopback;
 	};
 	struct itedtv_bus_operations ops;
+	struct itedtv_bus_stats stats;
+	u64 stream_time;	// for Linux, completion time (ns) of the data being handled
 };
 
 #ifdef __cplusplus
@@ -62,10 +118,78 @@ extern "C" {
 #endif
 int itedtv_bus_init(struct itedtv_bus *bus);
 int itedtv_bus_term(struct itedtv_bus *bus);
+#ifdef __linux__
+void itedtv_bus_set_urb_budget(u32 size);
+void itedtv_bus_set_stream_weight(struct itedtv_bus *bus, u32 weight);
+void itedtv_bus_cleanup(void);
+#endif
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef __linux__
+/* number of the USB bus the device is connected to, 0: not on USB */
+static inline int itedtv_bus_number(const struct itedtv_bus *bus)
+{
+	return (bus->type == ITEDTV_BUS_USB && bus->usb.dev) ? bus->usb.dev->bus->busnum
+							      : 0;
+}
+
+/* USB port path of the device (e.g. "3-1.2"), empty if not on USB */
+static inline const char *itedtv_bus_path(const struct itedtv_bus *bus)
+{
+	return (bus->type == ITEDTV_BUS_USB && bus->usb.dev) ? dev_name(&bus->usb.dev->dev)
+							      : "";
+}
+
+/* negotiated speed in Mbit/s, 0: unknown */
+static inline u32 itedtv_bus_speed(const struct itedtv_bus *bus)
+{
+	if (bus->type != ITEDTV_BUS_USB || !bus->usb.dev)
+		return 0;
+
+	switch (bus->usb.dev->speed) {
+	case USB_SPEED_LOW:
+		return 1;
+
+	case USB_SPEED_FULL:
+		return 12;
+
+	case USB_SPEED_HIGH:
+	case USB_SPEED_WIRELESS:
+		return 480;
+
+	case USB_SPEED_SUPER:
+		return 5000;
+
+	case USB_SPEED_SUPER_PLUS:
+		return 10000;
+
+	default:
+		return 0;
+	}
+}
+
+/* NUMA node of the host controller, NUMA_NO_NODE: unknown */
+static inline int itedtv_bus_node(const struct itedtv_bus *bus)
+{
+	return (bus->type == ITEDTV_BUS_USB && bus->usb.dev) ? dev_to_node(&bus->usb.dev->dev)
+							      : dev_to_node(bus->dev);
+}
+
+/* bulk bandwidth currently used by streaming, bytes per second */
+static inline u32 itedtv_bus_rx_rate(const struct itedtv_bus_stats *stats)
+{
+	u64 start = READ_ONCE(stats->rx_window_start);
+
+	/* nothing has been received for a whole window */
+	if (!start || ktime_get_ns() - start >= 2 * NSEC_PER_SEC)
+		return 0;
+
+	return READ_ONCE(stats->rx_rate);
+}
+#endif
+
 static inline int itedtv_bus_ctrl_tx(struct itedtv_bus *bus,
 				     void *buf, int len)
 {
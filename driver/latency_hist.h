@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Log2 latency histograms for the statistics interface (latency_hist.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __LATENCY_HIST_H__
+#define __LATENCY_HIST_H__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+/*
+ * Bucket 0 counts values below 1 usec, bucket n (n >= 1) the values of
+ * [2^(n-1), 2^n) usecs, and the last bucket everything from 2^(n-1) usecs
+ * (about 0.5 secs) on.
+ * The counters are updated by a single writer at a time and read without
+ * any lock, only the counters themselves are consistent.
+ */
+
+#define LATENCY_HIST_BUCKETS	21
+
+struct latency_hist {
+	u32 count[LATENCY_HIST_BUCKETS];
+};
+
+static inline void latency_hist_add(struct latency_hist *hist, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	unsigned int n;
+
+	n = (us) ? min_t(unsigned int, ilog2(us) + 1, LATENCY_HIST_BUCKETS - 1) : 0;
+
+	WRITE_ONCE(hist->count[n], hist->count[n] + 1);
+}
+
+/* the counters in a line, separated by spaces, for sysfs */
+static inline ssize_t latency_hist_show(const struct latency_hist *hist,
+					char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%u",
+				 (i) ? " " : "", READ_ONCE(hist->count[i]));
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+#endif
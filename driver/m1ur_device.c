@@ -14,15 +14,10 @@
 
 #include "px4_device_params.h"
 #include "firmware.h"
+#include "ts_demux.h"
+#include "r850_cache.h"
 
-#define M1UR_DEVICE_TS_SYNC_COUNT	4
-#define M1UR_DEVICE_TS_SYNC_SIZE	(188 * M1UR_DEVICE_TS_SYNC_COUNT)
-
-struct m1ur_stream_context {
-	struct ptx_chrdev *chrdev;
-	u8 remain_buf[M1UR_DEVICE_TS_SYNC_SIZE];
-	size_t remain_len;
-};
+static const struct ts_demux_config m1ur_demux_config = TS_DEMUX_SINGLE_CONFIG;
 
 static void m1ur_device_release(struct kref *kref);
 
@@ -87,6 +82,8 @@ static int m1ur_backend_init(struct m1ur_device *m1ur)
 		return ret;
 	}
 
+	r850_cache_load(&m1ur->it930x, 0, &chrdevm1ur->r850);
+
 	ret = rt710_init(&chrdevm1ur->rt710);
 	if (ret) {
 		dev_err(m1ur->dev,
@@ -102,6 +99,7 @@ static int m1ur_backend_term(struct m1ur_device *m1ur)
 {
 	struct m1ur_chrdev *chrdevm1ur = &m1ur->chrdevm1ur;
 
+	r850_cache_store(&m1ur->it930x, 0, &chrdevm1ur->r850);
 	r850_term(&chrdevm1ur->r850);
 	rt710_term(&chrdevm1ur->rt710);
 	tc90522_term(&chrdevm1ur->tc90522_t);
@@ -110,90 +108,6 @@ static int m1ur_backend_term(struct m1ur_device *m1ur)
 	return 0;
 }
 
-static void m1ur_device_stream_process(struct ptx_chrdev *chrdev,
-					   u8 **buf, u32 *len)
-{
-	u8 *p = *buf;
-	u32 remain = *len;
-
-	while (likely(remain)) {
-		u32 i = 0;
-		bool sync_remain = false;
-
-		while (true) {
-			if (likely(((i + 1) * 188) <= remain)) {
-				if (unlikely(p[i * 188] != 0x47))
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-			i++;
-		}
-
-		if (unlikely(i < M1UR_DEVICE_TS_SYNC_COUNT)) {
-			p++;
-			remain--;
-			continue;
-		}
-
-		ptx_chrdev_put_stream(chrdev, p, 188 * i);
-
-		p += 188 * i;
-		remain -= 188 * i;
-
-		if (unlikely(sync_remain))
-			break;
-	}
-
-	*buf = p;
-	*len = remain;
-
-	return;
-}
-
-static int m1ur_device_stream_handler(void *context, void *buf, u32 len)
-{
-	struct m1ur_stream_context *stream_ctx = context;
-	u8 *ctx_remain_buf = stream_ctx->remain_buf;
-	u32 ctx_remain_len = stream_ctx->remain_len;
-	u8 *p = buf;
-	u32 remain = len;
-
-	if (unlikely(ctx_remain_len)) {
-		if (likely((ctx_remain_len + len) >= M1UR_DEVICE_TS_SYNC_SIZE)) {
-			u32 t = M1UR_DEVICE_TS_SYNC_SIZE - ctx_remain_len;
-
-			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
-			ctx_remain_len = M1UR_DEVICE_TS_SYNC_SIZE;
-
-			m1ur_device_stream_process(stream_ctx->chrdev,
-						  &ctx_remain_buf,
-						  &ctx_remain_len);
-			if (likely(!ctx_remain_len)) {
-				p += t;
-				remain -= t;
-			}
-
-			stream_ctx->remain_len = 0;
-		} else {
-			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
-			stream_ctx->remain_len += len;
-
-			return 0;
-		}
-	}
-
-	m1ur_device_stream_process(stream_ctx->chrdev, &p, &remain);
-
-	if (unlikely(remain)) {
-		memcpy(stream_ctx->remain_buf, p, remain);
-		stream_ctx->remain_len = remain;
-	}
-
-	return 0;
-}
-
 static int m1ur_chrdev_init(struct ptx_chrdev *chrdev)
 {
 	dev_dbg(chrdev->parent->dev, "m1ur_chrdev_init\n");
@@ -464,6 +378,8 @@ static int m1ur_chrdev_tune(struct ptx_chrdev *chrdev,
 			"m1ur_chrdev_tune %u: PLL is locked. count: %d\n",
 			chrdev_group->id, i);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_t(&chrdevm1ur->tc90522_t, true);
 		if (ret) {
 			dev_err(m1ur->dev,
@@ -579,6 +495,8 @@ static int m1ur_chrdev_tune(struct ptx_chrdev *chrdev,
 			"m1ur_chrdev_tune %u: PLL is locked. count: %d, signal strength: %d.%03ddBm\n",
 			chrdev_group->id, i, ss / 1000, -ss % 1000);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_s(&chrdevm1ur->tc90522_s, true);
 		if (ret) {
 			dev_err(m1ur->dev,
@@ -621,6 +539,59 @@ static int m1ur_chrdev_check_lock(struct ptx_chrdev *chrdev, bool *locked)
 	return ret;
 }
 
+static int m1ur_chrdev_get_lock_state(struct ptx_chrdev *chrdev,
+				      enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct m1ur_chrdev *chrdevm1ur = chrdev->priv;
+	bool locked = false;
+	u8 v;
+
+	switch (chrdev->current_system) {
+	case PTX_ISDB_T_SYSTEM:
+		ret = tc90522_is_signal_locked_t(&chrdevm1ur->tc90522_t, &locked);
+		if (ret)
+			return ret;
+
+		if (locked) {
+			*state = PTX_CHRDEV_LOCK_LOCKED;
+			return 0;
+		}
+
+		ret = tc90522_get_sync_state_t(&chrdevm1ur->tc90522_t, &v);
+		if (ret)
+			return ret;
+
+		if (v >= 8)
+			*state = PTX_CHRDEV_LOCK_TMCC;
+		else if (v >= 2)
+			*state = PTX_CHRDEV_LOCK_CARRIER;
+		else
+			*state = PTX_CHRDEV_LOCK_AGC;
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		ret = tc90522_get_status_s(&chrdevm1ur->tc90522_s, &v);
+		if (ret)
+			return ret;
+
+		if (!(v & 0x10))
+			*state = PTX_CHRDEV_LOCK_LOCKED;
+		else if (!(v & 0x60))
+			*state = PTX_CHRDEV_LOCK_CARRIER;
+		else if (!(v & 0x80))
+			*state = PTX_CHRDEV_LOCK_AGC;
+		else
+			*state = PTX_CHRDEV_LOCK_SEARCHING;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int m1ur_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 					 u16 stream_id)
 {
@@ -684,8 +655,11 @@ static int m1ur_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 		msleep(10);
 	}
 
-	if (tsid2 != tsid)
+	if (tsid2 != tsid) {
+		/* resolve the slot from the TMCC again next time */
+		tc90522_tmcc_invalidate_s(tc90522_s);
 		ret = -EAGAIN;
+	}
 
 	return ret;
 }
@@ -698,14 +672,14 @@ static int m1ur_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	struct m1ur_device *m1ur = container_of(chrdevm1ur,
 							struct m1ur_device,
 							chrdevm1ur);
-	struct m1ur_stream_context *stream_ctx = m1ur->stream_ctx;
+	struct ts_demux *stream_ctx = m1ur->stream_ctx;
 
 
 	dev_dbg(m1ur->dev,
 		"m1ur_chrdev_start_capture %u\n", chrdev_group->id);
 
 	ret = it930x_purge_psb(&m1ur->it930x,
-			       px4_device_params.psb_purge_timeout);
+			       px4_device_psb_purge_timeout(&m1ur->it930x));
 	if (ret) {
 		dev_err(m1ur->dev,
 			"m1ur_chrdev_start_capture %u: it930x_purge_psb() failed. (ret: %d)\n",
@@ -740,10 +714,14 @@ static int m1ur_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	if (ret)
 		goto fail_tc;
 
-	stream_ctx->remain_len = 0;
+	ts_demux_reset(stream_ctx);
+
+	/* a single stream, its weight in the URB budget */
+	itedtv_bus_set_stream_weight(&m1ur->it930x.bus,
+				     ptx_system_bitrate(chrdev->params.system));
 
 	ret = itedtv_bus_start_streaming(&m1ur->it930x.bus,
-					 m1ur_device_stream_handler,
+					 ts_demux_stream_handler,
 					 stream_ctx);
 	if (ret) {
 		dev_err(m1ur->dev,
@@ -834,6 +812,33 @@ static int m1ur_chrdev_read_cnr_raw(struct ptx_chrdev *chrdev, u32 *value)
 	return ret;
 }
 
+/* C/N in 0.01 dB units */
+static int m1ur_chrdev_read_cnr(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0;
+	u32 raw = 0;
+
+	ret = m1ur_chrdev_read_cnr_raw(chrdev, &raw);
+	if (ret)
+		return ret;
+
+	*value = (chrdev->current_system == PTX_ISDB_T_SYSTEM) ? tc90522_cndat_to_cnr_t(raw)
+							       : tc90522_cn_to_cnr_s(raw);
+
+	return 0;
+}
+
+static int m1ur_chrdev_read_tsid(struct ptx_chrdev *chrdev,
+				 u16 *tsid, int num)
+{
+	struct m1ur_chrdev *chrdevm1ur = chrdev->priv;
+
+	if (chrdev->current_system != PTX_ISDB_S_SYSTEM)
+		return -EINVAL;
+
+	return tc90522_tmcc_get_tsid_list_s(&chrdevm1ur->tc90522_s, tsid, num);
+}
+
 static struct ptx_chrdev_operations m1ur_chrdev_ops = {
 	.init = m1ur_chrdev_init,
 	.term = m1ur_chrdev_term,
@@ -841,12 +846,17 @@ static struct ptx_chrdev_operations m1ur_chrdev_ops = {
 	.release = m1ur_chrdev_release,
 	.tune = m1ur_chrdev_tune,
 	.check_lock = m1ur_chrdev_check_lock,
+	.get_lock_state = m1ur_chrdev_get_lock_state,
 	.set_stream_id = m1ur_chrdev_set_stream_id,
 	.set_lnb_voltage = NULL,
 	.set_capture = m1ur_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = m1ur_chrdev_read_cnr_raw
+	.read_cnr = m1ur_chrdev_read_cnr,
+	.read_cnr_raw = m1ur_chrdev_read_cnr_raw,
+	.set_pid_filter = NULL,
+	.set_pid_filter_entry = NULL,
+	.read_tsid = m1ur_chrdev_read_tsid,
+	.read_stats = NULL
 };
 
 static int m1ur_device_load_config(struct m1ur_device *m1ur,
@@ -898,6 +908,7 @@ static int m1ur_device_load_config(struct m1ur_device *m1ur,
 	chrdevm1ur->r850.config.clock_out = false;
 	chrdevm1ur->r850.config.no_imr_calibration = true;
 	chrdevm1ur->r850.config.no_lpf_calibration = true;
+	chrdevm1ur->r850.config.light_standby = px4_device_params.t_tuner_light_standby;
 
 	chrdevm1ur->rt710.dev = dev;
 	chrdevm1ur->rt710.i2c = &chrdevm1ur->tc90522_s.i2c_master;
@@ -929,7 +940,7 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 	struct ptx_chrdev_config chrdev_config;
 	struct ptx_chrdev_group_config chrdev_group_config;
 	struct ptx_chrdev_group *chrdev_group;
-	struct m1ur_stream_context *stream_ctx;
+	struct ts_demux *stream_ctx;
 
 	if (!m1ur || !dev || !chrdev_ctx || !quit_completion)
 		return -EINVAL;
@@ -941,6 +952,7 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 	kref_init(&m1ur->kref);
 	m1ur->dev = dev;
 	m1ur->quit_completion = quit_completion;
+	m1ur->debugfs = NULL;
 
 	stream_ctx = kzalloc(sizeof(*stream_ctx), GFP_KERNEL);
 	if (!stream_ctx) {
@@ -950,6 +962,8 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 		goto fail;
 	}
 	m1ur->stream_ctx = stream_ctx;
+	ts_demux_init(stream_ctx, &m1ur_demux_config);
+	ts_demux_set_clock(stream_ctx, &m1ur->it930x.bus.stream_time);
 
 	it930x = &m1ur->it930x;
 	bus = &it930x->bus;
@@ -970,10 +984,23 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 	if (ret)
 		goto fail_device;
 
+	m1ur->debugfs = px4_debugfs_create(dev, it930x);
+	px4_debugfs_add_chip(m1ur->debugfs, "tc90522_t", 0,
+			     &m1ur->chrdevm1ur.tc90522_t.i2c_stats);
+	px4_debugfs_add_chip(m1ur->debugfs, "tc90522_s", 0,
+			     &m1ur->chrdevm1ur.tc90522_s.i2c_stats);
+	px4_debugfs_add_chip(m1ur->debugfs, "r850", 0,
+			     &m1ur->chrdevm1ur.r850.i2c_stats);
+	px4_debugfs_add_chip(m1ur->debugfs, "rt710", 0,
+			     &m1ur->chrdevm1ur.rt710.i2c_stats);
+
 	chrdev_config.ops = &m1ur_chrdev_ops;
 	chrdev_config.options = PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T;
 	chrdev_config.ringbuf_size = 188 * px4_device_params.tsdev_max_packets;
+	chrdev_config.ringbuf_time_t = px4_device_params.tsdev_buffer_time_t;
+	chrdev_config.ringbuf_time_s = px4_device_params.tsdev_buffer_time_s;
 	chrdev_config.ringbuf_threshold_size = chrdev_config.ringbuf_size / 10;
+	chrdev_config.max_readers = px4_device_params.tsdev_max_readers;
 	chrdev_config.priv = &m1ur->chrdevm1ur;
 
 	ret = it930x_load_firmware(it930x, IT930X_FIRMWARE_FILENAME);
@@ -1026,6 +1053,8 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 
 	chrdev_group_config.owner_kref = &m1ur->kref;
 	chrdev_group_config.owner_kref_release = m1ur_device_release;
+	chrdev_group_config.bus_stats = &it930x->bus.stats;
+	chrdev_group_config.bus = &it930x->bus;
 	chrdev_group_config.reserved = false;
 	chrdev_group_config.minor_base = 0;	/* unused */
 	chrdev_group_config.chrdev_num = 1;
@@ -1038,7 +1067,7 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 
 	m1ur->chrdev_group = chrdev_group;
 	m1ur->chrdevm1ur.chrdev = &chrdev_group->chrdev[0];
-	stream_ctx->chrdev = &chrdev_group->chrdev[0];
+	stream_ctx->chrdev[0] = &chrdev_group->chrdev[0];
 
 	atomic_set(&m1ur->available, 1);
 	return 0;
@@ -1046,6 +1075,7 @@ int m1ur_device_init(struct m1ur_device *m1ur, struct device *dev,
 fail_chrdev:
 
 fail_device:
+	px4_debugfs_remove(m1ur->debugfs);
 	it930x_term(it930x);
 
 fail_bridge:
@@ -1067,6 +1097,7 @@ static void m1ur_device_release(struct kref *kref)
 
 	dev_dbg(m1ur->dev, "m1ur_device_release\n");
 
+	px4_debugfs_remove(m1ur->debugfs);
 	it930x_term(&m1ur->it930x);
 	itedtv_bus_term(&m1ur->it930x.bus);
 
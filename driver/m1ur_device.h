@@ -19,6 +19,7 @@
 #include "tc90522.h"
 #include "r850.h"
 #include "rt710.h"
+#include "px4_debugfs.h"
 
 #define M1UR_CHRDEV_NUM	1
 
@@ -38,6 +39,7 @@ struct m1ur_device {
 	struct ptx_chrdev_group *chrdev_group;
 	struct m1ur_chrdev chrdevm1ur;
 	struct it930x_bridge it930x;
+	struct px4_debugfs *debugfs;
 	void *stream_ctx;
 };
 
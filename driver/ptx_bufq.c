@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Queue of user buffers filled by the stream producer (ptx_bufq.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "ptx_bufq.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+void ptx_bufq_init(struct ptx_bufq *bufq)
+{
+	spin_lock_init(&bufq->lock);
+	INIT_LIST_HEAD(&bufq->queued);
+	INIT_LIST_HEAD(&bufq->done);
+	INIT_LIST_HEAD(&bufq->idle);
+	bufq->active = NULL;
+	bufq->num = 0;
+	bufq->num_idle = 0;
+	bufq->queue_seq = 0;
+	bufq->dropped = false;
+	bufq->dropped_bytes = 0;
+
+	return;
+}
+
+/* held for as long as the queue is used, not just for a transfer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+#define PTX_BUFQ_FOLL_FLAGS	(FOLL_WRITE | FOLL_LONGTERM)
+#else
+#define PTX_BUFQ_FOLL_FLAGS	FOLL_WRITE
+#endif
+
+static void ptx_bufq_put_pages(struct page **pages, unsigned int num,
+			       bool dirty)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	if (dirty)
+		unpin_user_pages_dirty_lock(pages, num, true);
+	else
+		unpin_user_pages(pages, num);
+#else
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+#endif
+
+	return;
+}
+
+static void ptx_bufq_unpin(struct ptx_bufq_buffer *b)
+{
+	if (b->map) {
+		flush_kernel_vmap_range(b->map, b->num_pages << PAGE_SHIFT);
+		vunmap(b->map);
+	}
+
+	ptx_bufq_put_pages(b->pages, b->num_pages, true);
+	kvfree(b->pages);
+	kfree(b);
+
+	return;
+}
+
+/* gives all buffers back, filled or not */
+void ptx_bufq_release(struct ptx_bufq *bufq)
+{
+	struct ptx_bufq_buffer *b, *tmp;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&bufq->lock, flags);
+
+	if (bufq->active) {
+		list_add_tail(&bufq->active->list, &list);
+		bufq->active = NULL;
+	}
+
+	list_splice_tail_init(&bufq->done, &list);
+	list_splice_tail_init(&bufq->queued, &list);
+	list_splice_tail_init(&bufq->idle, &list);
+	bufq->num = 0;
+	bufq->num_idle = 0;
+	bufq->dropped = false;
+
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	/* may sleep */
+	list_for_each_entry_safe(b, tmp, &list, list) {
+		list_del(&b->list);
+		ptx_bufq_unpin(b);
+	}
+
+	return;
+}
+
+int ptx_bufq_queue(struct ptx_bufq *bufq, const struct ptx_buffer *buf)
+{
+	int ret = 0;
+	struct ptx_bufq_buffer *b, *tmp, *found = NULL;
+	struct page **pages;
+	unsigned long start, offset, flags;
+	unsigned int num_pages;
+	LIST_HEAD(list);
+
+	/* a single packet at least, with a timestamp */
+	if (buf->length < 192 || buf->length > PTX_BUFQ_MAX_SIZE)
+		return -EINVAL;
+
+	if (READ_ONCE(bufq->num) >= PTX_BUFQ_MAX_BUFFERS)
+		return -ENOBUFS;
+
+	start = buf->addr & PAGE_MASK;
+	offset = buf->addr & ~PAGE_MASK;
+	num_pages = DIV_ROUND_UP(offset + buf->length, PAGE_SIZE);
+
+	pages = kvmalloc_array(num_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	/* every time, the application may have remapped the range */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	ret = pin_user_pages_fast(start, num_pages, PTX_BUFQ_FOLL_FLAGS, pages);
+#else
+	ret = get_user_pages_fast(start, num_pages, PTX_BUFQ_FOLL_FLAGS, pages);
+#endif
+	if (ret < 0)
+		goto fail;
+
+	if (ret != num_pages) {
+		ptx_bufq_put_pages(pages, ret, false);
+		ret = -EFAULT;
+		goto fail;
+	}
+
+	spin_lock_irqsave(&bufq->lock, flags);
+
+	bufq->queue_seq++;
+
+	list_for_each_entry_safe(b, tmp, &bufq->idle, list) {
+		if (b->addr == buf->addr && b->length == buf->length &&
+		    !found &&
+		    !memcmp(b->pages, pages, num_pages * sizeof(*pages))) {
+			found = b;
+			continue;
+		}
+
+		/* remapped, or no longer queued by the application */
+		if (b->addr == buf->addr ||
+		    bufq->queue_seq - b->idle_seq > PTX_BUFQ_MAX_IDLE_QUEUES) {
+			list_move_tail(&b->list, &list);
+			bufq->num_idle--;
+		}
+	}
+
+	if (found) {
+		/* already mapped, the application may have written to it */
+		invalidate_kernel_vmap_range(found->map,
+					     found->num_pages << PAGE_SHIFT);
+		list_move_tail(&found->list, &bufq->queued);
+		found->index = buf->index;
+		bufq->num_idle--;
+		bufq->num++;
+	} else if (bufq->num + bufq->num_idle >= PTX_BUFQ_MAX_BUFFERS &&
+		   bufq->num_idle) {
+		/* the oldest idle buffer makes room for a new one */
+		b = list_first_entry(&bufq->idle, struct ptx_bufq_buffer, list);
+		list_move_tail(&b->list, &list);
+		bufq->num_idle--;
+	}
+
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	/* may sleep */
+	list_for_each_entry_safe(b, tmp, &list, list) {
+		list_del(&b->list);
+		ptx_bufq_unpin(b);
+	}
+
+	if (found) {
+		/* the pins of the buffer still hold the same pages */
+		ptx_bufq_put_pages(pages, num_pages, false);
+		kvfree(pages);
+		return 0;
+	}
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b) {
+		ret = -ENOMEM;
+		goto fail_pages;
+	}
+
+	/* the pages of the buffer in a row for the writer, kept with the pins */
+	b->map = vmap(pages, num_pages, VM_MAP, PAGE_KERNEL);
+	if (!b->map) {
+		ret = -ENOMEM;
+		goto fail_buf;
+	}
+
+	b->pages = pages;
+	b->num_pages = num_pages;
+	b->vaddr = (u8 *)b->map + offset;
+	b->index = buf->index;
+	b->addr = buf->addr;
+	b->length = buf->length;
+
+	spin_lock_irqsave(&bufq->lock, flags);
+	list_add_tail(&b->list, &bufq->queued);
+	bufq->num++;
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	return 0;
+
+fail_buf:
+	kfree(b);
+fail_pages:
+	/* nothing has been written into them */
+	ptx_bufq_put_pages(pages, num_pages, false);
+fail:
+	kvfree(pages);
+
+	return ret;
+}
+
+/* -EAGAIN: no buffer has been completed */
+int ptx_bufq_dequeue(struct ptx_bufq *bufq, struct ptx_buffer *buf)
+{
+	struct ptx_bufq_buffer *b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bufq->lock, flags);
+
+	b = list_first_entry_or_null(&bufq->done, struct ptx_bufq_buffer, list);
+	if (b) {
+		list_del(&b->list);
+		bufq->num--;
+	}
+
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	if (!b)
+		return -EAGAIN;
+
+	buf->addr = b->addr;
+	buf->length = b->length;
+	buf->index = b->index;
+	buf->bytesused = b->used;
+	buf->flags = b->flags;
+	buf->timestamp = b->timestamp;
+
+	/* for the user mapping */
+	flush_kernel_vmap_range(b->map, b->num_pages << PAGE_SHIFT);
+
+	spin_lock_irqsave(&bufq->lock, flags);
+	b->idle_seq = bufq->queue_seq;
+	list_add_tail(&b->list, &bufq->idle);
+	bufq->num_idle++;
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	return 0;
+}
+
+bool ptx_bufq_has_done(struct ptx_bufq *bufq)
+{
+	return !list_empty_careful(&bufq->done);
+}
+
+static void ptx_bufq_complete_nolock(struct ptx_bufq *bufq)
+{
+	list_add_tail(&bufq->active->list, &bufq->done);
+	bufq->active = NULL;
+
+	return;
+}
+
+/* completes the buffer being filled, if anything is in it */
+bool ptx_bufq_flush(struct ptx_bufq *bufq)
+{
+	unsigned long flags;
+	bool completed = false;
+
+	spin_lock_irqsave(&bufq->lock, flags);
+
+	if (bufq->active && bufq->active->used) {
+		ptx_bufq_complete_nolock(bufq);
+		completed = true;
+	}
+
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	return completed;
+}
+
+/*
+ * Copies the runs into the queued buffers, in whole units, and completes a
+ * buffer as soon as the next unit doesn't fit in it. The data is dropped if
+ * no buffer is queued, the next buffer is flagged then.
+ * Returns true if a buffer has been completed.
+ */
+bool ptx_bufq_write(struct ptx_bufq *bufq, const struct ringbuffer_vec *vec,
+		    unsigned int num, u32 unit_size, u64 time)
+{
+	unsigned long flags;
+	unsigned int i;
+	bool completed = false;
+
+	spin_lock_irqsave(&bufq->lock, flags);
+
+	for (i = 0; i < num; i++) {
+		const u8 *p = vec[i].buf;
+		size_t len = vec[i].len;
+
+		while (len) {
+			struct ptx_bufq_buffer *b = bufq->active;
+			size_t n;
+
+			if (!b) {
+				b = list_first_entry_or_null(&bufq->queued,
+							     struct ptx_bufq_buffer,
+							     list);
+				if (unlikely(!b)) {
+					bufq->dropped = true;
+					bufq->dropped_bytes += len;
+					break;
+				}
+
+				list_del(&b->list);
+				b->used = 0;
+				b->flags = (bufq->dropped) ? PTX_BUF_FLAG_DROPPED : 0;
+				b->timestamp = time;
+				bufq->dropped = false;
+				bufq->active = b;
+			}
+
+			n = min_t(size_t, len,
+				  rounddown(b->length - b->used, unit_size));
+			memcpy(b->vaddr + b->used, p, n);
+			b->used += n;
+			p += n;
+			len -= n;
+
+			if (b->length - b->used < unit_size) {
+				ptx_bufq_complete_nolock(bufq);
+				completed = true;
+			}
+		}
+	}
+
+	spin_unlock_irqrestore(&bufq->lock, flags);
+
+	return completed;
+}
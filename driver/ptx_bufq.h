@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Queue of user buffers filled by the stream producer (ptx_bufq.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __PTX_BUFQ_H__
+#define __PTX_BUFQ_H__
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+#include "ptx_ioctl.h"
+#include "ringbuffer.h"
+
+#define PTX_BUFQ_MAX_BUFFERS	64
+#define PTX_BUFQ_MAX_SIZE	(16 * 1024 * 1024)
+
+struct ptx_bufq_buffer {
+	struct list_head list;
+	u32 index;		// of the application
+	unsigned long addr;
+	u32 length;
+	struct page **pages;	// pinned while the driver owns or keeps it
+	unsigned int num_pages;
+	void *map;		// of the pages
+	u8 *vaddr;		// of the buffer in the mapping
+	u32 used;
+	u32 flags;
+	u64 timestamp;		// arrival time of the first packet
+	u32 idle_seq;		// queue_seq when it was dequeued
+};
+
+/*
+ * The writer fills the buffers in the order they were queued, under the
+ * lock, so the buffers can be released at any time from process context.
+ * A dequeued buffer stays pinned and mapped on the idle list. Every
+ * PTX_QBUF pins the user range again, and the idle buffer is taken only if
+ * it still has the same pages, as with the USERPTR buffers of videobuf2. An
+ * idle buffer not queued again within PTX_BUFQ_MAX_IDLE_QUEUES queues is
+ * unpinned.
+ */
+#define PTX_BUFQ_MAX_IDLE_QUEUES	PTX_BUFQ_MAX_BUFFERS
+
+struct ptx_bufq {
+	spinlock_t lock;
+	struct list_head queued;
+	struct list_head done;
+	struct list_head idle;	// dequeued, kept for the next PTX_QBUF
+	struct ptx_bufq_buffer *active;	// being filled
+	unsigned int num;	// owned by the driver, wherever they are
+	unsigned int num_idle;
+	u32 queue_seq;		// PTX_QBUF calls
+	bool dropped;		// data lost since the previous buffer
+	u64 dropped_bytes;
+};
+
+void ptx_bufq_init(struct ptx_bufq *bufq);
+void ptx_bufq_release(struct ptx_bufq *bufq);
+int ptx_bufq_queue(struct ptx_bufq *bufq, const struct ptx_buffer *buf);
+int ptx_bufq_dequeue(struct ptx_bufq *bufq, struct ptx_buffer *buf);
+bool ptx_bufq_has_done(struct ptx_bufq *bufq);
+bool ptx_bufq_flush(struct ptx_bufq *bufq);
+bool ptx_bufq_write(struct ptx_bufq *bufq, const struct ringbuffer_vec *vec,
+		    unsigned int num, u32 unit_size, u64 time);
+
+#endif
@@ -14,7 +14,26 @@
 #include <linux/sched.h>
 #include <linux/uaccess.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
 #include <linux/version.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+
+#include "px4_trace.h"
+#ifdef PX4_DVB
+#include "ptx_dvb.h"
+#endif
+
+#define PTX_CHRDEV_M2TS_PACKET_SIZE	192
+#define PTX_CHRDEV_M2TS_BUF_PACKETS	16
+#define PTX_CHRDEV_WRITEV_RUNS		16
 
 static LIST_HEAD(ctx_list);
 static DEFINE_MUTEX(ctx_list_lock);
@@ -25,513 +44,4538 @@ static bool ptx_chrdev_context_search_group(struct ptx_chrdev_context *chrdev_ct
 					    unsigned int minor,
 					    struct ptx_chrdev_group **chrdev_group);
 static void ptx_chrdev_group_release(struct kref *kref);
+static void ptx_chrdev_resume_work(struct work_struct *work);
 static void ptx_chrdev_context_release(struct kref *kref);
 
-static int ptx_chrdev_open(struct inode *inode, struct file *file)
+/* wakes the readers for new data, the wake-up latency is measured from here */
+static void ptx_chrdev_wake_readers(struct ptx_chrdev *chrdev)
 {
-	int ret = 0;
-	unsigned int major, minor;
-	struct ptx_chrdev_context *ctx;
-	struct ptx_chrdev_group *group;
-	struct ptx_chrdev *chrdev = NULL;
-	struct kref *owner_kref = NULL;
-	void (*owner_kref_release)(struct kref *) = NULL;
+	WRITE_ONCE(chrdev->wake_time, ktime_get_ns());
+	wake_up(&chrdev->ringbuf_wait);
+}
 
-	major = imajor(inode);
-	minor = iminor(inode);
+/* the first time the reader looks at the data after each wake-up */
+static void ptx_chrdev_account_wakeup(struct ptx_chrdev_reader *reader)
+{
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	u64 wake_time = READ_ONCE(chrdev->wake_time);
 
-	mutex_lock(&ctx_list_lock);
+	if (!wake_time || wake_time == reader->wake_seen)
+		return;
 
-	if (!ptx_chrdev_search_context(major, &ctx)) {
-		mutex_unlock(&ctx_list_lock);
-		ret = -ENOENT;
-		goto fail;
-	}
+	reader->wake_seen = wake_time;
 
-	kref_get(&ctx->kref);
-	mutex_lock(&ctx->lock);
-	mutex_unlock(&ctx_list_lock);
+	spin_lock(&chrdev->wakeup_latency_lock);
+	latency_hist_add(&chrdev->wakeup_latency, ktime_get_ns() - wake_time);
+	spin_unlock(&chrdev->wakeup_latency_lock);
+}
 
-	if (!ptx_chrdev_context_search_group(ctx, minor, &group)) {
-		mutex_unlock(&ctx->lock);
-		ret = -ENOENT;
-		goto fail_ctx;
-	}
+static void ptx_chrdev_wake_timer(struct timer_list *t)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,16,0)
+	struct ptx_chrdev *chrdev = timer_container_of(chrdev, t, wake_timer);
+#else
+	struct ptx_chrdev *chrdev = from_timer(chrdev, t, wake_timer);
+#endif
 
-	owner_kref = group->owner_kref;
-	owner_kref_release = group->owner_kref_release;
+	ptx_chrdev_wake_readers(chrdev);
+}
 
-	if (owner_kref)
-		kref_get(owner_kref);
+static void ptx_chrdev_stop_wake_timer(struct ptx_chrdev *chrdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+	timer_delete_sync(&chrdev->wake_timer);
+#else
+	del_timer_sync(&chrdev->wake_timer);
+#endif
+}
 
-	kref_get(&group->kref);
-	mutex_lock(&group->lock);
-	mutex_unlock(&ctx->lock);
+static int ptx_chrdev_write_pid_filter_hw(struct ptx_chrdev *chrdev,
+					  const unsigned long *map, int num)
+{
+	int ret = 0, i = 0;
+	unsigned int pid;
+	u16 list[PTXT_PID_FILTER_MAX];
 
-	if (!atomic_read(&group->available)) {
-		mutex_unlock(&group->lock);
-		ret = -ENOENT;
-		goto fail_group;
-	}
+	for_each_set_bit(pid, map, 0x2000)
+		list[i++] = pid;
 
-	chrdev = &group->chrdev[minor - group->minor_base];
+	ret = chrdev->ops->set_pid_filter(chrdev, list, num);
+	if (ret)
+		return ret;
 
-	ret = (atomic_cmpxchg(&chrdev->open, 0, 1)) ? -EALREADY : 0;
-	if (ret) {
-		mutex_unlock(&group->lock);
-		goto fail_group;
-	}
+	for (i = 0; i < PTXT_PID_FILTER_MAX; i++)
+		chrdev->pid_filter_slot[i] = (i < num) ? list[i]
+						       : PTX_CHRDEV_PID_SLOT_FREE;
 
-	mutex_lock(&chrdev->lock);
-	mutex_unlock(&group->lock);
+	return 0;
+}
 
-	chrdev->current_system = PTX_UNSPECIFIED_SYSTEM;
+/* change only the entries of the hardware table that differ */
+static int ptx_chrdev_update_pid_filter_hw(struct ptx_chrdev *chrdev,
+					   const unsigned long *map)
+{
+	int ret = 0, i;
+	unsigned int pid;
+	u16 *slot = chrdev->pid_filter_slot;
 
-	if (chrdev->ops && chrdev->ops->open)
-		ret = chrdev->ops->open(chrdev);
+	/* remove first, so that the freed entries can be reused */
+	for (i = 0; i < PTXT_PID_FILTER_MAX; i++) {
+		if (slot[i] == PTX_CHRDEV_PID_SLOT_FREE || test_bit(slot[i], map))
+			continue;
 
-	if (!ret)
-		file->private_data = chrdev;
+		ret = chrdev->ops->set_pid_filter_entry(chrdev, i, slot[i], false);
+		if (ret)
+			return ret;
 
-	mutex_unlock(&chrdev->lock);
+		slot[i] = PTX_CHRDEV_PID_SLOT_FREE;
+	}
 
-	if (ret)
-		goto fail_chrdev;
+	for_each_set_bit(pid, map, 0x2000) {
+		int free = -1;
 
-	return 0;
+		for (i = 0; i < PTXT_PID_FILTER_MAX; i++) {
+			if (slot[i] == pid)
+				break;
 
-fail_chrdev:
-	atomic_dec_return(&chrdev->open);
+			if (free < 0 && slot[i] == PTX_CHRDEV_PID_SLOT_FREE)
+				free = i;
+		}
 
-fail_group:
-	kref_put(&group->kref, ptx_chrdev_group_release);
+		if (i < PTXT_PID_FILTER_MAX)
+			continue;
 
-	if (owner_kref)
-		kref_put(owner_kref, owner_kref_release);
+		if (free < 0)
+			return -ENOSPC;
 
-fail_ctx:
-	kref_put(&ctx->kref, ptx_chrdev_context_release);
+		ret = chrdev->ops->set_pid_filter_entry(chrdev, free, pid, true);
+		if (ret)
+			return ret;
 
-fail:
-	return ret;
+		slot[free] = pid;
+	}
+
+	return 0;
 }
 
-static ssize_t ptx_chrdev_read(struct file *file,
-			       char __user *buf, size_t count, loff_t *ppos)
+/*
+ * The stream producer runs the program under rcu_read_lock() without
+ * chrdev->lock, and may do so whenever the bus is streaming for another
+ * tuner, so the old program is freed only after a grace period.
+ * Must be called with chrdev->lock held.
+ */
+static void ptx_chrdev_set_packet_filter(struct ptx_chrdev *chrdev,
+					 struct ts_bpf *prog)
 {
-	int ret = 0;
-	struct ptx_chrdev *chrdev = file->private_data;
-	struct ptx_chrdev_group *group = chrdev->parent;
-	u8 __user *p = buf;
-	size_t remain = count;
+	struct ts_bpf *old;
 
-	if (unlikely(!atomic_read_acquire(&group->available)))
-		return -EIO;
+	old = rcu_dereference_protected(chrdev->packet_filter,
+					lockdep_is_held(&chrdev->lock));
+	rcu_assign_pointer(chrdev->packet_filter, prog);
 
-	ringbuffer_ready_read(chrdev->ringbuf);
+	if (old) {
+		synchronize_rcu();
+		ts_bpf_destroy(old);
+	}
 
-	while (likely(remain)) {
-		size_t len;
+	return;
+}
 
-		if (wait_event_interruptible(chrdev->ringbuf_wait,
-					     likely(ringbuffer_is_readable(chrdev->ringbuf)) ||
-					     unlikely(!ringbuffer_is_running(chrdev->ringbuf)) ||
-					     unlikely(!atomic_read(&group->available)))) {
-			if (unlikely(remain == count))
-				ret = -EINTR;
+/*
+ * Merge the filters of all readers of the chrdev. The readers share the
+ * ringbuffer, so each of them receives the union of the requested pids, and
+ * nothing is filtered while any of them has not set a filter.
+ * Must be called with chrdev->lock held.
+ */
+static int ptx_chrdev_update_pid_filter(struct ptx_chrdev *chrdev)
+{
+	int ret = 0, i, num;
+	unsigned long *map = chrdev->pid_filter_scratch;
+	bool all = true, hw = false;
+
+	bitmap_zero(map, 0x2000);
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		struct ptx_chrdev_reader *reader = chrdev->reader[i];
+		unsigned int j;
+
+		if (!reader)
+			continue;
 
+		if (!reader->pid_num) {
+			all = true;
 			break;
 		}
 
-		len = remain;
-		ret = ringbuffer_read_user(chrdev->ringbuf, p, &len);
-		if (unlikely(ret || !len))
-			break;
+		all = false;
 
-		p += len;
-		remain -= len;
+		for (j = 0; j < reader->pid_num; j++)
+			set_bit(reader->pid[j], map);
 	}
 
-	return likely(!ret) ? (count - remain) : ret;
-}
+	if (all) {
+		WRITE_ONCE(chrdev->pid_filter, false);
 
-static int ptx_chrdev_release(struct inode *inode, struct file *file)
-{
-	int ret = 0;
-	struct ptx_chrdev *chrdev = file->private_data;
-	struct ptx_chrdev_group *group = chrdev->parent;
-	struct ptx_chrdev_context *ctx = group->parent;
-	struct kref *owner_kref = group->owner_kref;
-	void (*owner_kref_release)(struct kref *) = group->owner_kref_release;
+		if (chrdev->pid_filter_hw) {
+			ret = chrdev->ops->set_pid_filter(chrdev, NULL, 0);
+			if (ret)
+				return ret;
 
-	mutex_lock(&chrdev->lock);
+			chrdev->pid_filter_hw = false;
+		}
 
-	if (chrdev->streaming) {
-		if (chrdev->ops && chrdev->ops->set_capture)
-			chrdev->ops->set_capture(chrdev, false);
+		return 0;
+	}
 
-		ringbuffer_stop(chrdev->ringbuf);
-		wake_up(&chrdev->ringbuf_wait);
-		chrdev->streaming = false;
+	num = bitmap_weight(map, 0x2000);
+
+	/* prefer the hardware filter, fall back to filtering in software */
+	if (num <= PTXT_PID_FILTER_MAX &&
+	    chrdev->ops && chrdev->ops->set_pid_filter) {
+		ret = -EOPNOTSUPP;
+
+		if (chrdev->pid_filter_hw && chrdev->ops->set_pid_filter_entry)
+			ret = ptx_chrdev_update_pid_filter_hw(chrdev, map);
+
+		/* rewrite the whole table, also if the update failed halfway */
+		if (ret)
+			ret = ptx_chrdev_write_pid_filter_hw(chrdev, map, num);
+
+		if (!ret)
+			hw = true;
+		else if (ret != -EOPNOTSUPP)
+			return ret;
 	}
 
-	if (chrdev->ops && chrdev->ops->release)
-		ret = chrdev->ops->release(chrdev);
+	bitmap_copy(chrdev->pid_filter_map, map, 0x2000);
 
-	mutex_unlock(&chrdev->lock);
+	if (hw) {
+		WRITE_ONCE(chrdev->pid_filter, false);
+	} else {
+		smp_wmb();
+		WRITE_ONCE(chrdev->pid_filter, true);
 
-	atomic_dec_return(&chrdev->open);
-	kref_put(&group->kref, ptx_chrdev_group_release);
+		/* too many pids for the hardware */
+		if (chrdev->pid_filter_hw)
+			chrdev->ops->set_pid_filter(chrdev, NULL, 0);
+	}
 
-	if (owner_kref)
-		kref_put(owner_kref, owner_kref_release);
+	chrdev->pid_filter_hw = hw;
 
-	kref_put(&ctx->kref, ptx_chrdev_context_release);
-	return ret;
+	return 0;
 }
 
-static long ptx_chrdev_unlocked_ioctl(struct file *file,
-				      unsigned int cmd, unsigned long arg)
+/* PTX_SET_EPG_MODE */
+static const u16 ptx_chrdev_epg_pids[] = {
+	0x0000,		// PAT
+	0x0010,		// NIT
+	0x0011,		// SDT, BAT
+	0x0012,		// EIT
+	0x0014,		// TDT, TOT
+	0x0026,		// EIT (M-EIT)
+	0x0027,		// EIT (L-EIT)
+};
+
+static int ptx_chrdev_set_reader_pid_filter(struct ptx_chrdev_reader *reader,
+					    const u16 *pid, unsigned int num)
 {
 	int ret = 0;
-	struct ptx_chrdev *chrdev = file->private_data;
-	struct ptx_chrdev_group *group = chrdev->parent;
+	unsigned int i, old_num = reader->pid_num;
+	u16 old_pid[PTXT_PID_FILTER_MAX];
 
-	if (!atomic_read_acquire(&group->available))
-		return -EIO;
+	for (i = 0; i < num; i++) {
+		if (pid[i] > 0x1fff)
+			return -EINVAL;
+	}
 
-	mutex_lock(&chrdev->lock);
+	memcpy(old_pid, reader->pid, sizeof(old_pid));
 
-	switch (cmd) {
-	case PTX_SET_CHANNEL:
-	{
-		struct ptx_freq freq;
-		enum ptx_system_type system;
+	memcpy(reader->pid, pid, sizeof(*pid) * num);
+	reader->pid_num = num;
 
-		if (!chrdev->ops || !chrdev->ops->tune) {
-			ret = -ENOSYS;
-			break;
-		}
+	ret = ptx_chrdev_update_pid_filter(reader->chrdev);
+	if (ret) {
+		memcpy(reader->pid, old_pid, sizeof(old_pid));
+		reader->pid_num = old_num;
+		ptx_chrdev_update_pid_filter(reader->chrdev);
+	}
 
-		if (copy_from_user(&freq, (void *)arg, sizeof(freq))) {
-			ret = -EFAULT;
-			break;
-		}
+	return ret;
+}
 
-		system = chrdev->params.system;
+/* the stream producer starts over on its next packets */
+static void ptx_chrdev_set_service(struct ptx_chrdev *chrdev, u32 service_id)
+{
+	WRITE_ONCE(chrdev->service_id, service_id);
+	smp_wmb();
+	WRITE_ONCE(chrdev->service_seq, chrdev->service_seq + 1);
+}
 
-		switch (chrdev->params.system) {
-		case PTX_ISDB_S_SYSTEM:
-			if (freq.freq_no < 0) {
-				ret = -EINVAL;
-				break;
-			} else if (freq.freq_no < 12) {
-				/* BS */
-				if (0 && freq.slot >= 8) {
-					ret = -EINVAL;
-					break;
-				}
-				chrdev->params.freq = 1049480 + (38360 * freq.freq_no);
-			} else if (freq.freq_no < 24) {
-				/* CS */
-				chrdev->params.freq = 1613000 + (40000 * (freq.freq_no - 12));
-			} else {
-				ret = -EINVAL;
-				break;
-			}
-			chrdev->params.bandwidth = 0;
-			chrdev->params.stream_id = freq.slot;
-			break;
+static void ptx_chrdev_update_wake_threshold(struct ptx_chrdev *chrdev)
+{
+	unsigned int i;
+	size_t threshold = 0;
+	unsigned long latency = 0;
 
-		case PTX_ISDB_T_SYSTEM:
-			if ((freq.freq_no >= 3 && freq.freq_no <= 12) ||
-			    (freq.freq_no >= 22 && freq.freq_no <= 62)) {
-				/* CATV C13-C22ch, C23-C63ch */
-				chrdev->params.freq = 93143 + freq.freq_no * 6000 + freq.slot/* addfreq */;
-
-				if (freq.freq_no == 12)
-					chrdev->params.freq += 2000;
-			} else if (freq.freq_no >= 63 && freq.freq_no <= 112) {
-				/* UHF 13-62ch */
-				chrdev->params.freq = 95143 + freq.freq_no * 6000 + freq.slot/* addfreq */;
-			} else {
-				ret = -EINVAL;
-				break;
-			}
-			chrdev->params.bandwidth = 6;
-			chrdev->params.stream_id = 0;
-			break;
+	/* the most demanding reader decides */
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		struct ptx_chrdev_reader *reader = chrdev->reader[i];
 
-		case PTX_UNSPECIFIED_SYSTEM:
-			if (chrdev->system_cap & PTX_ISDB_S_SYSTEM) {
-				if (freq.freq_no < 0) {
-					ret = -EINVAL;
-					break;
-				} else if (freq.freq_no < 12) {
-					/* BS */
-					if (0 && freq.slot >= 8) {
-						ret = -EINVAL;
-						break;
-					}
-					chrdev->params.freq = 1049480 + (38360 * freq.freq_no);
-					chrdev->params.bandwidth = 0;
-					chrdev->params.stream_id = freq.slot;
-					chrdev->params.system = PTX_ISDB_S_SYSTEM;
-					break;
-				} else if (freq.freq_no < 24) {
-					/* CS */
-					chrdev->params.freq = 1613000 + (40000 * (freq.freq_no - 12));
-					chrdev->params.bandwidth = 0;
-					chrdev->params.stream_id = freq.slot;
-					chrdev->params.system = PTX_ISDB_S_SYSTEM;
-					break;
-				}
-			}
+		if (!reader)
+			continue;
 
-			if (chrdev->system_cap & PTX_ISDB_T_SYSTEM) {
-				if (freq.freq_no >= 24 && freq.freq_no <= 62) {
-					/* CATV C25-C63ch */
-					chrdev->params.freq = 93143 + freq.freq_no * 6000 + freq.slot/* addfreq */;
-					chrdev->params.bandwidth = 6;
-					chrdev->params.stream_id = 0;
-					chrdev->params.system = PTX_ISDB_T_SYSTEM;
-					break;
-				} else if (freq.freq_no >= 63 && freq.freq_no <= 112) {
-					/* UHF 13-62ch */
-					chrdev->params.freq = 95143 + freq.freq_no * 6000 + freq.slot/* addfreq */;
-					chrdev->params.bandwidth = 6;
-					chrdev->params.stream_id = 0;
-					chrdev->params.system = PTX_ISDB_T_SYSTEM;
-					break;
-				}
-			}
+		if (!threshold || reader->threshold_size < threshold)
+			threshold = reader->threshold_size;
 
-			ret = -EINVAL;
-			break;
+		if (reader->wake_latency &&
+		    (!latency || reader->wake_latency < latency))
+			latency = reader->wake_latency;
+	}
 
-		default:
-			ret = -ENOSYS;
-			break;
-		}
+	chrdev->ringbuf_threshold_size = (threshold) ? threshold
+						     : chrdev->ringbuf_default_threshold_size;
+	WRITE_ONCE(chrdev->wake_latency, latency);
 
-		if (ret)
-			break;
+	if (!latency)
+		ptx_chrdev_stop_wake_timer(chrdev);
 
-		if (chrdev->params.system == PTX_ISDB_S_SYSTEM &&
-		    (chrdev->options & PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE) &&
-		    chrdev->ops->set_stream_id) {
-			ret = chrdev->ops->set_stream_id(chrdev,
-							 chrdev->params.stream_id);
-			if (ret)
-				break;
-		}
+	return;
+}
 
-		ret = chrdev->ops->tune(chrdev, &chrdev->params);
-		if (ret) {
-			chrdev->params.system = system;
-			break;
-		}
+static int ptx_chrdev_set_timestamp(struct ptx_chrdev *chrdev,
+				    enum ptxt_timestamp_mode mode)
+{
+	int ret = 0;
 
-		chrdev->current_system = chrdev->params.system;
-		chrdev->params.system = system;
+	if (chrdev->streaming)
+		return -EBUSY;
 
-		if (chrdev->ops->check_lock) {
-			int i;
-			bool locked = false;
+	switch (mode) {
+	case PTXT_TIMESTAMP_NONE:
+		ret = ringbuffer_set_unit_size(chrdev->ringbuf,
+					       RINGBUFFER_DEFAULT_UNIT_SIZE);
+		if (!ret)
+			chrdev->timestamp = false;
+		break;
 
-			i = 300;
-			while (i--) {
-				ret = chrdev->ops->check_lock(chrdev, &locked);
-				if ((!ret && locked) || ret == -ECANCELED)
-					break;
+	case PTXT_TIMESTAMP_M2TS:
+		if (!chrdev->timestamp_buf) {
+			chrdev->timestamp_buf = kmalloc(PTX_CHRDEV_M2TS_PACKET_SIZE * PTX_CHRDEV_M2TS_BUF_PACKETS,
+							GFP_KERNEL);
+			if (!chrdev->timestamp_buf)
+				return -ENOMEM;
+		}
 
-				msleep(10);
-			}
+		ret = ringbuffer_set_unit_size(chrdev->ringbuf,
+					       PTX_CHRDEV_M2TS_PACKET_SIZE);
+		if (!ret)
+			chrdev->timestamp = true;
+		break;
 
-			if (ret != -ECANCELED && !locked)
-				ret = -EAGAIN;
+	default:
+		ret = -EINVAL;
+		break;
+	}
 
-			if (ret)
-				break;
+	return ret;
+}
 
-			if (chrdev->current_system == PTX_ISDB_T_SYSTEM &&
-			    (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T) &&
-			    i > 265)
-				msleep((i - 265) * 10);
-		}
+static int ptx_chrdev_set_params(struct ptx_chrdev *chrdev,
+				 const struct ptxt_params __user *arg)
+{
+	int ret = 0;
+	struct ptxt_params params;
+	struct ptxt_additional_param prop[PTXT_MAX_PARAMS];
+	struct ptx_tune_params tune = chrdev->params;
+	u32 i;
 
-		if (chrdev->current_system == PTX_ISDB_S_SYSTEM &&
-		    !(chrdev->options & PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE) &&
-		    chrdev->ops->set_stream_id)
-			ret = chrdev->ops->set_stream_id(chrdev,
-							 chrdev->params.stream_id);
+	if (copy_from_user(&params, arg, sizeof(params)))
+		return -EFAULT;
+
+	if (params.num_prop > PTXT_MAX_PARAMS)
+		return -EINVAL;
 
-		if (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK)
-			msleep(200);
+	if (params.num_prop &&
+	    copy_from_user(prop, params.prop, sizeof(prop[0]) * params.num_prop))
+		return -EFAULT;
 
+	/* PTX_UNSPECIFIED_SYSTEM keeps the current tuning parameters */
+	switch (params.system) {
+	case PTX_UNSPECIFIED_SYSTEM:
 		break;
-	}
 
-	case PTX_START_STREAMING:
-		if (chrdev->streaming) {
-			ret = -EALREADY;
+	case PTX_ISDB_T_SYSTEM:
+		if (!(chrdev->system_cap & PTX_ISDB_T_SYSTEM))
+			return -EINVAL;
+
+		tune.system = PTX_ISDB_T_SYSTEM;
+		tune.freq = params.freq / 1000;
+		tune.bandwidth = 6;
+		tune.stream_id = 0;
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		if (!(chrdev->system_cap & PTX_ISDB_S_SYSTEM))
+			return -EINVAL;
+
+		tune.system = PTX_ISDB_S_SYSTEM;
+		tune.freq = params.freq;
+		tune.bandwidth = 0;
+		tune.stream_id = 0;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	/* validate everything before applying anything */
+	for (i = 0; i < params.num_prop; i++) {
+		switch (prop[i].prop) {
+		case PTXT_BANDWIDTH_PARAM:
+			if (tune.system != PTX_ISDB_T_SYSTEM || !prop[i].data)
+				return -EINVAL;
+
+			tune.bandwidth = prop[i].data;
 			break;
-		}
 
-		chrdev->ringbuf_write_size = 0;
+		case PTXT_LAYER_PARAM:
+			if (tune.system != PTX_ISDB_T_SYSTEM ||
+			    prop[i].data > PTXT_LAYER_A)
+				return -EINVAL;
+			break;
 
-		if (chrdev->ops && chrdev->ops->set_capture)
-			ret = chrdev->ops->set_capture(chrdev, true);
-		else
-			ret = -ENOSYS;
+		case PTXT_STREAM_ID_PARAM:
+			if (tune.system != PTX_ISDB_S_SYSTEM || prop[i].data > 0xffff)
+				return -EINVAL;
+
+			tune.stream_id = prop[i].data;
+			break;
+
+		case PTXT_TIMESTAMP_PARAM:
+			if (prop[i].data > PTXT_TIMESTAMP_M2TS)
+				return -EINVAL;
+			break;
 
-		if (!ret) {
-			ringbuffer_reset(chrdev->ringbuf);
-			ringbuffer_start(chrdev->ringbuf);
-			chrdev->streaming = true;
+		default:
+			return -EINVAL;
 		}
+	}
 
-		break;
+	for (i = 0; i < params.num_prop; i++) {
+		if (prop[i].prop != PTXT_TIMESTAMP_PARAM)
+			continue;
 
-	case PTX_STOP_STREAMING:
-		if (!chrdev->streaming) {
-			ret = -EALREADY;
+		ret = ptx_chrdev_set_timestamp(chrdev, prop[i].data);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < params.num_prop; i++) {
+		if (prop[i].prop != PTXT_LAYER_PARAM)
+			continue;
+
+		/* the demodulators output all the layers, extracted here */
+		if (prop[i].data == PTXT_LAYER_A)
+			ptx_chrdev_set_service(chrdev, TS_SERVICE_PARTIAL);
+		else if (chrdev->service_id == TS_SERVICE_PARTIAL)
+			ptx_chrdev_set_service(chrdev, 0);
+	}
+
+	chrdev->params = tune;
+
+	return 0;
+}
+
+static int ptx_chrdev_get_params(struct ptx_chrdev *chrdev,
+				 struct ptxt_params __user *arg)
+{
+	struct ptxt_params params;
+	struct ptxt_additional_param prop[PTXT_MAX_PARAMS];
+	const struct ptx_tune_params *tune = &chrdev->params;
+	u32 i;
+
+	if (copy_from_user(&params, arg, sizeof(params)))
+		return -EFAULT;
+
+	if (params.num_prop > PTXT_MAX_PARAMS)
+		return -EINVAL;
+
+	if (params.num_prop &&
+	    copy_from_user(prop, params.prop, sizeof(prop[0]) * params.num_prop))
+		return -EFAULT;
+
+	for (i = 0; i < params.num_prop; i++) {
+		switch (prop[i].prop) {
+		case PTXT_BANDWIDTH_PARAM:
+			prop[i].data = tune->bandwidth;
 			break;
-		}
 
-		if (chrdev->ops && chrdev->ops->set_capture)
-			ret = chrdev->ops->set_capture(chrdev, false);
-		else
-			ret = -ENOSYS;
+		case PTXT_STREAM_ID_PARAM:
+			prop[i].data = tune->stream_id;
+			break;
 
-		if (!ret) {
-			ringbuffer_stop(chrdev->ringbuf);
-			wake_up(&chrdev->ringbuf_wait);
-			chrdev->streaming = false;
+		case PTXT_LAYER_PARAM:
+			prop[i].data = (chrdev->service_id == TS_SERVICE_PARTIAL) ? PTXT_LAYER_A
+										 : PTXT_LAYER_ALL;
+			break;
+
+		case PTXT_TIMESTAMP_PARAM:
+			prop[i].data = (chrdev->timestamp) ? PTXT_TIMESTAMP_M2TS
+							   : PTXT_TIMESTAMP_NONE;
+			break;
+
+		default:
+			return -EINVAL;
 		}
+	}
 
-		break;
+	params.system = tune->system;
+	params.freq = (tune->system == PTX_ISDB_T_SYSTEM) ? tune->freq * 1000
+							  : tune->freq;
 
-	case PTX_GET_CNR:
-	{
-		u32 cn = 0;
+	if (params.num_prop &&
+	    copy_to_user(params.prop, prop, sizeof(prop[0]) * params.num_prop))
+		return -EFAULT;
 
-		if (chrdev->ops && chrdev->ops->read_cnr_raw)
-			ret = chrdev->ops->read_cnr_raw(chrdev, &cn);
-		else
-			ret = -ENOSYS;
+	if (copy_to_user(arg, &params, sizeof(params)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int ptx_chrdev_clear_params(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
 
+	if (chrdev->timestamp) {
+		ret = ptx_chrdev_set_timestamp(chrdev, PTXT_TIMESTAMP_NONE);
 		if (ret)
-			break;
+			return ret;
+	}
 
-		if (copy_to_user((void *)arg, &cn, sizeof(cn)))
-			ret = -EFAULT;
+	if (chrdev->service_id == TS_SERVICE_PARTIAL)
+		ptx_chrdev_set_service(chrdev, 0);
 
-		break;
+	memset(&chrdev->params, 0, sizeof(chrdev->params));
+
+	return 0;
+}
+
+static u32 ptx_chrdev_stat_mask(enum ptxt_stat_code code)
+{
+	switch (code) {
+	case PTXT_SIGNAL_STRENGTH_STAT:
+		return PTX_CHRDEV_STAT_SIGNAL_STRENGTH;
+
+	case PTXT_CNR_STAT:
+		return PTX_CHRDEV_STAT_CNR;
+
+	case PTXT_CNR_RAW_STAT:
+		return PTX_CHRDEV_STAT_CNR_RAW;
+
+	case PTXT_LOCK_STAT:
+		return PTX_CHRDEV_STAT_LOCK;
+
+	case PTXT_TSID_STAT:
+		return PTX_CHRDEV_STAT_TSID;
+
+	default:
+		return 0;
 	}
+}
 
-	case PTX_ENABLE_LNB_POWER:
-		if (chrdev->ops && chrdev->ops->set_lnb_voltage) {
-			int voltage;
+/* read the stats which ops->read_stats did not provide one by one */
+static void ptx_chrdev_read_stat_values(struct ptx_chrdev *chrdev, u32 mask,
+					struct ptx_chrdev_stat_values *v)
+{
+	const struct ptx_chrdev_operations *ops = chrdev->ops;
+	u32 missing;
 
-			switch (arg) {
-			case 0:
-				voltage = 0;
-				break;
+	v->valid = 0;
 
-			case 1:
-				voltage = 11;
-				break;
+	/* may have been filled partially */
+	if (ops->read_stats && ops->read_stats(chrdev, mask, v))
+		v->valid = 0;
 
-			case 2:
-				voltage = 15;
-				break;
+	missing = mask & ~v->valid;
 
-			default:
-				ret = -EINVAL;
-				break;
-			}
+	if ((missing & PTX_CHRDEV_STAT_SIGNAL_STRENGTH) && ops->read_signal_strength &&
+	    !ops->read_signal_strength(chrdev, &v->signal_strength))
+		v->valid |= PTX_CHRDEV_STAT_SIGNAL_STRENGTH;
 
-			if (ret)
-				break;
+	if ((missing & PTX_CHRDEV_STAT_CNR) && ops->read_cnr &&
+	    !ops->read_cnr(chrdev, &v->cnr))
+		v->valid |= PTX_CHRDEV_STAT_CNR;
 
-			ret = chrdev->ops->set_lnb_voltage(chrdev, voltage);
-		} else if (arg) {
-			ret = -ENOSYS;
+	if ((missing & PTX_CHRDEV_STAT_CNR_RAW) && ops->read_cnr_raw &&
+	    !ops->read_cnr_raw(chrdev, &v->cnr_raw))
+		v->valid |= PTX_CHRDEV_STAT_CNR_RAW;
+
+	if ((missing & PTX_CHRDEV_STAT_LOCK) && ops->check_lock &&
+	    !ops->check_lock(chrdev, &v->locked))
+		v->valid |= PTX_CHRDEV_STAT_LOCK;
+}
+
+/* copies the cache for the signal/ attributes, which never touch the device */
+static void ptx_chrdev_publish_stats(struct ptx_chrdev *chrdev)
+{
+	spin_lock(&chrdev->stat_snapshot_lock);
+	chrdev->stat_snapshot = chrdev->stat_cache;
+	chrdev->stat_snapshot_timestamp = chrdev->stat_cache_timestamp;
+	spin_unlock(&chrdev->stat_snapshot_lock);
+}
+
+/*
+ * All requested stats are read at once, and served from the cache while it
+ * is younger than stats_cache_time msecs and has all of them. With nowait,
+ * the lock is held by someone else, a tune most likely: the stats last
+ * published are served without touching the device or the cache,
+ * -EAGAIN if they don't have all of them.
+ */
+static int ptx_chrdev_read_stats(struct ptx_chrdev *chrdev,
+				 const struct ptxt_stats __user *arg,
+				 bool nowait)
+{
+	struct ptxt_stats stats;
+	struct ptxt_stat stat[PTXT_MAX_PARAMS];
+	struct ptx_chrdev_stat_values snapshot, *v = &chrdev->stat_cache;
+	u32 i, mask = 0;
+	u64 now, timestamp;
+
+	if (copy_from_user(&stats, arg, sizeof(stats)))
+		return -EFAULT;
+
+	if (stats.num_stat > PTXT_MAX_PARAMS)
+		return -EINVAL;
+
+	if (stats.num_stat &&
+	    copy_from_user(stat, stats.stat, sizeof(stat[0]) * stats.num_stat))
+		return -EFAULT;
+
+	for (i = 0; i < stats.num_stat; i++) {
+		u32 m = ptx_chrdev_stat_mask(stat[i].stat);
+
+		if (!m)
+			return -EINVAL;
+
+		mask |= m;
+	}
+
+	if (!mask)
+		return 0;
+
+	if (nowait) {
+		spin_lock(&chrdev->stat_snapshot_lock);
+		snapshot = chrdev->stat_snapshot;
+		timestamp = chrdev->stat_snapshot_timestamp;
+		spin_unlock(&chrdev->stat_snapshot_lock);
+
+		v = &snapshot;
+		if ((v->valid & mask) != mask)
+			return -EAGAIN;
+	} else {
+		now = ktime_get_ns();
+
+		if ((v->valid & mask) != mask ||
+		    now - chrdev->stat_cache_timestamp >= (u64)chrdev->stats_cache_time * NSEC_PER_MSEC) {
+			ptx_chrdev_read_stat_values(chrdev, mask, v);
+			chrdev->stat_cache_timestamp = now;
+			ptx_chrdev_publish_stats(chrdev);
 		}
 
-		break;
+		timestamp = chrdev->stat_cache_timestamp;
+	}
 
-	case PTX_DISABLE_LNB_POWER:
-		if (chrdev->ops && chrdev->ops->set_lnb_voltage)
-			ret = chrdev->ops->set_lnb_voltage(chrdev, 0);
+	for (i = 0; i < stats.num_stat; i++) {
+		u32 m = ptx_chrdev_stat_mask(stat[i].stat);
 
-		break;
+		if (!(v->valid & m))
+			return -ENOSYS;
 
-	case PTX_SET_SYSTEM_MODE:
-	{
-		enum ptx_system_type mode = (enum ptx_system_type)arg;
+		switch (m) {
+		case PTX_CHRDEV_STAT_SIGNAL_STRENGTH:
+			stat[i].value = v->signal_strength;
+			break;
 
-		switch (mode) {
-		case PTX_UNSPECIFIED_SYSTEM:
-		case PTX_ISDB_T_SYSTEM:
-		case PTX_ISDB_S_SYSTEM:
-			if (chrdev->system_cap & mode)
-				chrdev->params.system = mode;
-			else
-				ret = -EINVAL;
+		case PTX_CHRDEV_STAT_CNR:
+			stat[i].value = v->cnr;
 			break;
 
-		default:
-			ret = -EINVAL;
+		case PTX_CHRDEV_STAT_CNR_RAW:
+			stat[i].value = v->cnr_raw;
+			break;
+
+		case PTX_CHRDEV_STAT_LOCK:
+			stat[i].value = (v->locked) ? 1 : 0;
+			break;
+
+		case PTX_CHRDEV_STAT_TSID:
+			stat[i].value = v->tsid;
 			break;
 		}
 
-		break;
+		stat[i].timestamp = timestamp;
 	}
 
-#if 0
-	case PTXT_GET_INFO:
-		break;
+	if (copy_to_user(stats.stat, stat, sizeof(stat[0]) * stats.num_stat))
+		return -EFAULT;
 
-	case PTXT_GET_PARAMS:
+	return 0;
+}
+
+/* starts the reader preroll_time msecs in the past, as far as it is buffered */
+static void ptx_chrdev_preroll_seek(struct ptx_chrdev_reader *reader)
+{
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	u64 now = ktime_get_ns(), back = (u64)chrdev->preroll_time * NSEC_PER_MSEC;
+	u64 target = (now > back) ? (now - back) : 0;
+	u32 head = smp_load_acquire(&chrdev->preroll_mark_head);
+	u32 i, num = min_t(u32, head, PTX_CHRDEV_PREROLL_MARKS);
+	const struct ptx_chrdev_preroll_mark *mark = NULL;
+
+	/*
+	 * The oldest mark not before the target. The producer keeps adding
+	 * marks meanwhile, but only the oldest ones could be overwritten.
+	 */
+	for (i = 1; i <= num; i++) {
+		const struct ptx_chrdev_preroll_mark *m;
+
+		m = &chrdev->preroll_mark[(head - i) % PTX_CHRDEV_PREROLL_MARKS];
+		if (READ_ONCE(m->time) < target)
+			break;
+
+		mark = m;
+	}
+
+	if (mark)
+		ringbuffer_seek(chrdev->ringbuf, reader->id,
+				READ_ONCE(mark->write_count));
+
+	return;
+}
+
+/* captures without a streaming reader, so that the pre-roll is buffered */
+static int ptx_chrdev_start_preroll(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+
+	if (chrdev->streaming)
+		return 0;
+
+	chrdev->ringbuf_write_size = 0;
+
+	if (chrdev->ops && chrdev->ops->set_capture)
+		ret = chrdev->ops->set_capture(chrdev, true);
+	else
+		ret = -ENOSYS;
+
+	if (ret)
+		return ret;
+
+	ringbuffer_reset(chrdev->ringbuf);
+	ringbuffer_start(chrdev->ringbuf);
+	/* nobody reads yet, write from now on */
+	ringbuffer_ready_read(chrdev->ringbuf);
+	WRITE_ONCE(chrdev->cc_seq, chrdev->cc_seq + 1);
+	chrdev->preroll_mark_head = 0;
+	chrdev->streaming = true;
+
+	return 0;
+}
+
+static void ptx_chrdev_stop_preroll(struct ptx_chrdev *chrdev)
+{
+	if (!chrdev->streaming || chrdev->streaming_count)
+		return;
+
+	if (chrdev->ops && chrdev->ops->set_capture)
+		chrdev->ops->set_capture(chrdev, false);
+
+	ringbuffer_stop(chrdev->ringbuf);
+	ptx_chrdev_stop_wake_timer(chrdev);
+	wake_up(&chrdev->ringbuf_wait);
+	chrdev->streaming = false;
+
+	return;
+}
+
+static int ptx_chrdev_start_reader(struct ptx_chrdev_reader *reader)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	if (reader->streaming)
+		return -EALREADY;
+
+	if (!chrdev->streaming) {
+		chrdev->ringbuf_write_size = 0;
+
+		if (chrdev->ops && chrdev->ops->set_capture)
+			ret = chrdev->ops->set_capture(chrdev, true);
+		else
+			ret = -ENOSYS;
+
+		if (ret)
+			return ret;
+
+		ringbuffer_reset(chrdev->ringbuf);
+		ringbuffer_start(chrdev->ringbuf);
+		WRITE_ONCE(chrdev->cc_seq, chrdev->cc_seq + 1);
+		chrdev->preroll_mark_head = 0;
+		chrdev->streaming = true;
+	} else if (chrdev->preroll_time) {
+		ptx_chrdev_preroll_seek(reader);
+	}
+
+	reader->streaming = true;
+	chrdev->streaming_count++;
+
+	return 0;
+}
+
+static int ptx_chrdev_stop_reader(struct ptx_chrdev_reader *reader)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	if (!reader->streaming)
+		return -EALREADY;
+
+	/* the capture goes on for the pre-roll */
+	if (chrdev->streaming_count == 1 && !chrdev->preroll_time) {
+		if (chrdev->ops && chrdev->ops->set_capture)
+			ret = chrdev->ops->set_capture(chrdev, false);
+		else
+			ret = -ENOSYS;
+
+		if (ret)
+			return ret;
+
+		ringbuffer_stop(chrdev->ringbuf);
+		ptx_chrdev_stop_wake_timer(chrdev);
+		wake_up(&chrdev->ringbuf_wait);
+		chrdev->streaming = false;
+	}
+
+	reader->streaming = false;
+	chrdev->streaming_count--;
+
+	/* the owner gets what has been written so far */
+	if (chrdev->bufq_owner == reader && ptx_bufq_flush(&chrdev->bufq))
+		wake_up(&chrdev->ringbuf_wait);
+
+	return 0;
+}
+
+static int ptx_chrdev_set_freq_params(struct ptx_chrdev *chrdev,
+				      const struct ptx_freq *freq)
+{
+	int ret = 0;
+
+	switch (chrdev->params.system) {
+	case PTX_ISDB_S_SYSTEM:
+		if (freq->freq_no < 0) {
+			ret = -EINVAL;
+			break;
+		} else if (freq->freq_no < 12) {
+			/* BS */
+			if (0 && freq->slot >= 8) {
+				ret = -EINVAL;
+				break;
+			}
+			chrdev->params.freq = 1049480 + (38360 * freq->freq_no);
+		} else if (freq->freq_no < 24) {
+			/* CS */
+			chrdev->params.freq = 1613000 + (40000 * (freq->freq_no - 12));
+		} else {
+			ret = -EINVAL;
+			break;
+		}
+		chrdev->params.bandwidth = 0;
+		chrdev->params.stream_id = freq->slot;
 		break;
 
-	case PTXT_SET_PARAMS:
+	case PTX_ISDB_T_SYSTEM:
+		if ((freq->freq_no >= 3 && freq->freq_no <= 12) ||
+		    (freq->freq_no >= 22 && freq->freq_no <= 62)) {
+			/* CATV C13-C22ch, C23-C63ch */
+			chrdev->params.freq = 93143 + freq->freq_no * 6000 + freq->slot/* addfreq */;
+
+			if (freq->freq_no == 12)
+				chrdev->params.freq += 2000;
+		} else if (freq->freq_no >= 63 && freq->freq_no <= 112) {
+			/* UHF 13-62ch */
+			chrdev->params.freq = 95143 + freq->freq_no * 6000 + freq->slot/* addfreq */;
+		} else {
+			ret = -EINVAL;
+			break;
+		}
+		chrdev->params.bandwidth = 6;
+		chrdev->params.stream_id = 0;
 		break;
 
-	case PTXT_CLEAR_PARAMS:
+	case PTX_UNSPECIFIED_SYSTEM:
+		if (chrdev->system_cap & PTX_ISDB_S_SYSTEM) {
+			if (freq->freq_no < 0) {
+				ret = -EINVAL;
+				break;
+			} else if (freq->freq_no < 12) {
+				/* BS */
+				if (0 && freq->slot >= 8) {
+					ret = -EINVAL;
+					break;
+				}
+				chrdev->params.freq = 1049480 + (38360 * freq->freq_no);
+				chrdev->params.bandwidth = 0;
+				chrdev->params.stream_id = freq->slot;
+				chrdev->params.system = PTX_ISDB_S_SYSTEM;
+				break;
+			} else if (freq->freq_no < 24) {
+				/* CS */
+				chrdev->params.freq = 1613000 + (40000 * (freq->freq_no - 12));
+				chrdev->params.bandwidth = 0;
+				chrdev->params.stream_id = freq->slot;
+				chrdev->params.system = PTX_ISDB_S_SYSTEM;
+				break;
+			}
+		}
+
+		if (chrdev->system_cap & PTX_ISDB_T_SYSTEM) {
+			if (freq->freq_no >= 24 && freq->freq_no <= 62) {
+				/* CATV C25-C63ch */
+				chrdev->params.freq = 93143 + freq->freq_no * 6000 + freq->slot/* addfreq */;
+				chrdev->params.bandwidth = 6;
+				chrdev->params.stream_id = 0;
+				chrdev->params.system = PTX_ISDB_T_SYSTEM;
+				break;
+			} else if (freq->freq_no >= 63 && freq->freq_no <= 112) {
+				/* UHF 13-62ch */
+				chrdev->params.freq = 95143 + freq->freq_no * 6000 + freq->slot/* addfreq */;
+				chrdev->params.bandwidth = 6;
+				chrdev->params.stream_id = 0;
+				chrdev->params.system = PTX_ISDB_T_SYSTEM;
+				break;
+			}
+		}
+
+		ret = -EINVAL;
+		break;
+
+	default:
+		ret = -ENOSYS;
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Switching to another stream on the transponder which is already received
+ * only needs set_stream_id, as long as the demodulator is still locked.
+ */
+static bool ptx_chrdev_can_switch_stream(struct ptx_chrdev *chrdev)
+{
+	bool locked = false;
+
+	if (chrdev->params.system != PTX_ISDB_S_SYSTEM ||
+	    chrdev->current_system != PTX_ISDB_S_SYSTEM ||
+	    !chrdev->tuned_freq ||
+	    chrdev->tuned_freq != chrdev->params.freq)
+		return false;
+
+	if (!chrdev->ops->set_stream_id || !chrdev->ops->check_lock)
+		return false;
+
+	return (!chrdev->ops->check_lock(chrdev, &locked) && locked);
+}
+
+static void ptx_chrdev_trace_tune_end(struct ptx_chrdev *chrdev, int result)
+{
+	trace_px4_tune_end(chrdev->parent->id, chrdev->id,
+			   chrdev->current_system, chrdev->tuned_freq, result,
+			   chrdev->tune_polls, ktime_get_ns() - chrdev->tune_time);
+}
+
+/* also called by the drivers, for the phases only they can see */
+void ptx_chrdev_tune_phase(struct ptx_chrdev *chrdev,
+			  enum ptx_chrdev_tune_phase phase)
+{
+	u64 elapsed = ktime_get_ns() - READ_ONCE(chrdev->tune_time);
+
+	/* 0 is for the phases not reached */
+	WRITE_ONCE(chrdev->tune_phase_us[phase],
+		   max_t(u32, div_u64(elapsed, NSEC_PER_USEC), 1));
+	trace_px4_tune_phase(chrdev->parent->id, chrdev->id, phase, elapsed);
+}
+
+static void ptx_chrdev_reset_tune_phases(struct ptx_chrdev *chrdev,
+					 enum ptx_chrdev_tune_phase from)
+{
+	int i;
+
+	WRITE_ONCE(chrdev->tune_first_packet, false);
+
+	for (i = from; i < PTX_CHRDEV_TUNE_PHASE_NUM; i++)
+		WRITE_ONCE(chrdev->tune_phase_us[i], 0);
+
+	WRITE_ONCE(chrdev->tune_time, ktime_get_ns());
+}
+
+/*
+ * Tune queue: the tuners of a group program their tuner and demodulator one
+ * at a time, in the order the tunes were started. Simultaneous tunes then
+ * don't slow each other down on the bus of the bridge, and each of them
+ * starts polling for the lock as soon as it has been programmed, while the
+ * next one is being programmed.
+ */
+static void ptx_chrdev_enter_tune_queue(struct ptx_chrdev *chrdev)
+{
+	struct ptx_chrdev_group *group = chrdev->parent;
+	u32 ticket;
+
+	spin_lock(&group->tune_queue_lock);
+	ticket = group->tune_ticket++;
+	WRITE_ONCE(chrdev->tune_ticket, ticket);
+	WRITE_ONCE(chrdev->tune_queued, true);
+	spin_unlock(&group->tune_queue_lock);
+
+	/* a tune can't be interrupted halfway, neither can its turn */
+	wait_event(group->tune_queue_wait,
+		   READ_ONCE(group->tune_serving) == ticket);
+
+	chrdev->tune_queue_time = ktime_get_ns();
+}
+
+static void ptx_chrdev_leave_tune_queue(struct ptx_chrdev *chrdev)
+{
+	struct ptx_chrdev_group *group = chrdev->parent;
+	u32 msecs = div_u64(ktime_get_ns() - chrdev->tune_queue_time,
+			    NSEC_PER_MSEC);
+
+	spin_lock(&group->tune_queue_lock);
+	/* moving average of the programming time, for the estimates */
+	WRITE_ONCE(group->tune_time_avg,
+		   (group->tune_time_avg) ? (group->tune_time_avg * 3 + msecs) / 4
+					  : msecs);
+	WRITE_ONCE(chrdev->tune_queued, false);
+	WRITE_ONCE(group->tune_serving, group->tune_serving + 1);
+	spin_unlock(&group->tune_queue_lock);
+
+	wake_up_all(&group->tune_queue_wait);
+}
+
+/* 0: not queued, 1: being programmed, n: n - 1 tunes ahead */
+static u32 ptx_chrdev_tune_queue_position(struct ptx_chrdev *chrdev)
+{
+	struct ptx_chrdev_group *group = chrdev->parent;
+	u32 position = 0;
+
+	spin_lock(&group->tune_queue_lock);
+	if (chrdev->tune_queued)
+		position = chrdev->tune_ticket - group->tune_serving + 1;
+	spin_unlock(&group->tune_queue_lock);
+
+	return position;
+}
+
+/*
+ * The ringbuffer holds the same time of the stream for each system, the
+ * system is not known yet on the first open of a tuner of both systems, the
+ * larger size of ISDB-S is taken then.
+ */
+static size_t ptx_chrdev_ringbuf_size(struct ptx_chrdev *chrdev,
+				      enum ptx_system_type system)
+{
+	unsigned int time;
+	u64 size;
+
+	if (system == PTX_UNSPECIFIED_SYSTEM)
+		system = (chrdev->system_cap & PTX_ISDB_S_SYSTEM) ? PTX_ISDB_S_SYSTEM
+								  : PTX_ISDB_T_SYSTEM;
+
+	time = (system == PTX_ISDB_S_SYSTEM) ? chrdev->ringbuf_time_s
+					     : chrdev->ringbuf_time_t;
+	if (!time)
+		return chrdev->ringbuf_fixed_size;
+
+	/* 125 bytes per msec at 1 Mbps */
+	size = (u64)ptx_system_bitrate(system) * 125 * time;
+	size = (u64)div_u64(size + 187, 188) * 188;
+
+	return min_t(u64, size, rounddown(INT_MAX, 188));
+}
+
+/*
+ * Fits the ringbuffer to the system to be tuned to, before the capture starts.
+ * Must be called with chrdev->lock held.
+ */
+static int ptx_chrdev_resize_ringbuf(struct ptx_chrdev *chrdev,
+				     enum ptx_system_type system)
+{
+	int ret = 0, i;
+	struct ringbuffer *ringbuf = chrdev->ringbuf;
+	size_t size, old_size = ringbuf->size;
+
+	if (chrdev->streaming)
+		return 0;
+
+	size = ptx_chrdev_ringbuf_size(chrdev, system);
+	if (size == old_size)
+		return 0;
+
+	/* a reader reading in place keeps its mapping of the buffer */
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		if (chrdev->reader[i] &&
+		    (ringbuf->reader[i].flags & RINGBUFFER_READER_NO_DISCARD))
+			return 0;
+	}
+
+	ret = ringbuffer_set_size(ringbuf, size);
+	if (!ret)
+		ret = ringbuffer_populate(ringbuf);
+
+	if (!ret) {
+		dev_dbg(chrdev->parent->dev,
+			"ptx_chrdev_resize_ringbuf %u:%u: %zu -> %zu\n",
+			chrdev->parent->id, chrdev->id, old_size, size);
+		return 0;
+	}
+
+	dev_warn(chrdev->parent->dev,
+		 "ptx_chrdev_resize_ringbuf %u:%u: ringbuffer_populate(%zu) failed, keeping %zu bytes. (ret: %d)\n",
+		 chrdev->parent->id, chrdev->id, size, old_size, ret);
+
+	ret = ringbuffer_set_size(ringbuf, old_size);
+	if (!ret)
+		ret = ringbuffer_populate(ringbuf);
+
+	return ret;
+}
+
+static int ptx_chrdev_start_tune(struct ptx_chrdev *chrdev,
+				 enum ptx_system_type system)
+{
+	int ret = 0;
+
+	ret = ptx_chrdev_resize_ringbuf(chrdev, chrdev->params.system);
+	if (ret) {
+		chrdev->params.system = system;
+		return ret;
+	}
+
+	/* the open phase is of the open, it also tells how long ago that was */
+	ptx_chrdev_reset_tune_phases(chrdev, PTX_CHRDEV_TUNE_PHASE_QUEUE);
+	chrdev->tune_polls = 0;
+	chrdev->stat_cache.valid = 0;
+	ptx_chrdev_publish_stats(chrdev);
+
+	/* the tables and the counters of the old stream are of no use */
+	if (chrdev->service_id)
+		ptx_chrdev_set_service(chrdev, chrdev->service_id);
+
+	WRITE_ONCE(chrdev->cc_seq, chrdev->cc_seq + 1);
+
+	trace_px4_tune_start(chrdev->parent->id, chrdev->id,
+			     chrdev->params.system, chrdev->params.freq,
+			     chrdev->params.stream_id);
+
+	if (ptx_chrdev_can_switch_stream(chrdev)) {
+		dev_dbg(chrdev->parent->dev,
+			"ptx_chrdev_start_tune %u:%u: same transponder\n",
+			chrdev->parent->id, chrdev->id);
+
+		if (chrdev->options & PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE) {
+			ret = chrdev->ops->set_stream_id(chrdev,
+							 chrdev->params.stream_id);
+			if (ret) {
+				chrdev->tuned_freq = 0;
+				chrdev->params.system = system;
+				return ret;
+			}
+		}
+
+		chrdev->params.system = system;
+		return 0;
+	}
+
+	chrdev->tuned_freq = 0;
+
+	ptx_chrdev_enter_tune_queue(chrdev);
+	ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_QUEUE);
+
+	if (chrdev->params.system == PTX_ISDB_S_SYSTEM &&
+	    (chrdev->options & PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE) &&
+	    chrdev->ops->set_stream_id) {
+		ret = chrdev->ops->set_stream_id(chrdev,
+						 chrdev->params.stream_id);
+		if (ret) {
+			ptx_chrdev_leave_tune_queue(chrdev);
+			return ret;
+		}
+	}
+
+	ret = chrdev->ops->tune(chrdev, &chrdev->params);
+	ptx_chrdev_leave_tune_queue(chrdev);
+	if (ret) {
+		chrdev->params.system = system;
+		ptx_chrdev_trace_tune_end(chrdev, ret);
+		return ret;
+	}
+
+	ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PROGRAM);
+
+	chrdev->current_system = chrdev->params.system;
+	chrdev->tuned_freq = chrdev->params.freq;
+	chrdev->params.system = system;
+
+	return 0;
+}
+
+static int ptx_chrdev_finish_tune(struct ptx_chrdev *chrdev)
+{
+	if (chrdev->current_system == PTX_ISDB_S_SYSTEM &&
+	    !(chrdev->options & PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE) &&
+	    chrdev->ops->set_stream_id) {
+		int ret;
+
+		ret = chrdev->ops->set_stream_id(chrdev,
+						 chrdev->params.stream_id);
+		if (ret)
+			return ret;
+
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_STREAM_ID);
+	}
+
+	/* the stream is of the new channel from here */
+	WRITE_ONCE(chrdev->tune_first_packet, true);
+
+	return 0;
+}
+
+static void ptx_chrdev_complete_tune(struct ptx_chrdev *chrdev, int result)
+{
+	struct ptx_chrdev_reader *reader = chrdev->tune_reader;
+
+	/* PTXT_TUNE_AND_START */
+	chrdev->tune_reader = NULL;
+	if (!result && reader && !reader->streaming)
+		result = ptx_chrdev_start_reader(reader);
+
+	/* the result first, PTX_GET_TUNE_STATUS reads them without the lock */
+	chrdev->tune_result = result;
+	smp_store_release(&chrdev->tune_state, PTX_CHRDEV_TUNE_IDLE);
+	ptx_chrdev_trace_tune_end(chrdev, result);
+	WRITE_ONCE(chrdev->tune_event, true);
+	wake_up(&chrdev->ringbuf_wait);
+}
+
+/*
+ * A missing carrier is reported as -ECANCELED, just like the tuners which
+ * detect it in check_lock themselves. The demodulator does not settle down to
+ * NO_SIGNAL on a weak channel, so give up as well when it has been stuck at AGC
+ * for PTX_CHRDEV_CARRIER_TIMEOUT msecs.
+ */
+static int ptx_chrdev_check_lock(struct ptx_chrdev *chrdev,
+				 unsigned long start, bool *locked)
+{
+	int ret = 0;
+	enum ptx_chrdev_lock_state state;
+
+	chrdev->tune_polls++;
+
+	if (!chrdev->ops->get_lock_state) {
+		ret = chrdev->ops->check_lock(chrdev, locked);
+		goto exit;
+	}
+
+	ret = chrdev->ops->get_lock_state(chrdev, &state);
+	if (ret)
+		goto exit;
+
+	*locked = (state == PTX_CHRDEV_LOCK_LOCKED);
+
+	switch (state) {
+	case PTX_CHRDEV_LOCK_NO_SIGNAL:
+		ret = -ECANCELED;
+		break;
+
+	case PTX_CHRDEV_LOCK_AGC:
+		if (time_after(jiffies,
+			       start + msecs_to_jiffies(PTX_CHRDEV_CARRIER_TIMEOUT)))
+			ret = -ECANCELED;
+		break;
+
+	default:
+		break;
+	}
+
+exit:
+	trace_px4_lock_poll(chrdev->parent->id, chrdev->id,
+			    chrdev->tune_polls, *locked, ret);
+
+	if (!ret && *locked &&
+	    !READ_ONCE(chrdev->tune_phase_us[PTX_CHRDEV_TUNE_PHASE_LOCK]))
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_LOCK);
+
+	return ret;
+}
+
+/*
+ * Lock poller: a single work per group polls the lock of all tuners of the
+ * group which wait for it, one after another in each cycle, instead of one
+ * sleeper per tuner issuing its own reads at random times.
+ *
+ * Asynchronous tunes are polled by the poller itself under the lock of the
+ * tuner. ptx_chrdev_wait_tune() holds the lock of the tuner while waiting,
+ * so the poller polls on its behalf and hands the result back.
+ */
+
+/* polls an asynchronous tune, returns true if it has to be polled again */
+static bool ptx_chrdev_poll_tune(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+	bool locked = false;
+	unsigned long delay = 0;
+
+	if (time_before(jiffies, chrdev->tune_next_poll))
+		return true;
+
+	ret = ptx_chrdev_check_lock(chrdev, chrdev->tune_start, &locked);
+	if (ret == -ECANCELED)
+		goto complete;
+
+	if (ret || !locked) {
+		ret = 0;
+
+		if (time_after(jiffies,
+			       chrdev->tune_start + msecs_to_jiffies(PTX_CHRDEV_TUNE_TIMEOUT))) {
+			ret = -EAGAIN;
+			goto complete;
+		}
+
+		/* poll less often the longer it takes */
+		chrdev->tune_next_poll = jiffies + chrdev->tune_interval;
+		if (chrdev->tune_interval < msecs_to_jiffies(PTX_CHRDEV_TUNE_MAX_INTERVAL))
+			chrdev->tune_interval += msecs_to_jiffies(PTX_CHRDEV_TUNE_MIN_INTERVAL);
+
+		return true;
+	}
+
+	chrdev->tune_state = PTX_CHRDEV_TUNE_LOCKED;
+
+	if (chrdev->current_system == PTX_ISDB_T_SYSTEM &&
+	    (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T)) {
+		unsigned long settle = chrdev->tune_start + msecs_to_jiffies(350);
+
+		if (time_before(jiffies, settle))
+			delay = settle - jiffies;
+	}
+
+	/* the rest of the tune is done by the work of the tuner */
+	schedule_delayed_work(&chrdev->tune_work, delay);
+	return false;
+
+complete:
+	ptx_chrdev_complete_tune(chrdev, ret);
+	return false;
+}
+
+static void ptx_chrdev_lock_poll_work(struct work_struct *work)
+{
+	struct ptx_chrdev_group *group = container_of(to_delayed_work(work),
+						      struct ptx_chrdev_group,
+						      lock_poll_work);
+	unsigned int i;
+	bool again = false, wake = false;
+
+	for (i = 0; i < group->chrdev_num; i++) {
+		struct ptx_chrdev *chrdev = &group->chrdev[i];
+
+		if (smp_load_acquire(&chrdev->lock_poll_sync) &&
+		    !READ_ONCE(chrdev->lock_poll_done)) {
+			bool locked = false;
+
+			chrdev->lock_poll_ret = ptx_chrdev_check_lock(chrdev,
+								      chrdev->lock_poll_start,
+								      &locked);
+			chrdev->lock_poll_locked = locked;
+			smp_store_release(&chrdev->lock_poll_done, true);
+			wake = true;
+			continue;
+		}
+
+		if (READ_ONCE(chrdev->tune_state) != PTX_CHRDEV_TUNE_POLLING)
+			continue;
+
+		/* never sleep on the lock, the tune may be cancelled under it */
+		if (!mutex_trylock(&chrdev->lock)) {
+			again = true;
+			continue;
+		}
+
+		if (chrdev->tune_state == PTX_CHRDEV_TUNE_POLLING &&
+		    ptx_chrdev_poll_tune(chrdev))
+			again = true;
+
+		mutex_unlock(&chrdev->lock);
+	}
+
+	if (wake)
+		wake_up_all(&group->lock_poll_wait);
+
+	if (again)
+		schedule_delayed_work(&group->lock_poll_work,
+				      msecs_to_jiffies(PTX_CHRDEV_TUNE_MIN_INTERVAL));
+}
+
+/* one poll by the poller, in its next cycle. the caller holds chrdev->lock */
+static int ptx_chrdev_poll_lock(struct ptx_chrdev *chrdev,
+				unsigned long start, bool *locked)
+{
+	struct ptx_chrdev_group *group = chrdev->parent;
+
+	chrdev->lock_poll_start = start;
+	WRITE_ONCE(chrdev->lock_poll_done, false);
+	smp_store_release(&chrdev->lock_poll_sync, true);
+
+	schedule_delayed_work(&group->lock_poll_work,
+			      msecs_to_jiffies(PTX_CHRDEV_TUNE_MIN_INTERVAL));
+
+	wait_event(group->lock_poll_wait,
+		   smp_load_acquire(&chrdev->lock_poll_done));
+
+	WRITE_ONCE(chrdev->lock_poll_sync, false);
+
+	*locked = chrdev->lock_poll_locked;
+	return chrdev->lock_poll_ret;
+}
+
+static void ptx_chrdev_tune_work(struct work_struct *work)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = container_of(to_delayed_work(work),
+						 struct ptx_chrdev, tune_work);
+	unsigned long delay = 0;
+
+	/* never sleep on the lock, so that the work can be cancelled under it */
+	if (!mutex_trylock(&chrdev->lock)) {
+		schedule_delayed_work(&chrdev->tune_work, 1);
+		return;
+	}
+
+	switch (chrdev->tune_state) {
+	case PTX_CHRDEV_TUNE_POLLING:
+		/* polled by the lock poller of the group */
+		mutex_unlock(&chrdev->lock);
+		return;
+
+	case PTX_CHRDEV_TUNE_LOCKED:
+		ret = ptx_chrdev_finish_tune(chrdev);
+		if (ret)
+			break;
+
+		if (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK) {
+			chrdev->tune_state = PTX_CHRDEV_TUNE_SETTLING;
+			delay = msecs_to_jiffies(200);
+		}
+
+		break;
+
+	case PTX_CHRDEV_TUNE_SETTLING:
 		break;
 
-	case PTXT_TUNE:
-		break;
+	default:
+		/* cancelled */
+		mutex_unlock(&chrdev->lock);
+		return;
+	}
+
+	if (!ret && delay)
+		schedule_delayed_work(&chrdev->tune_work, delay);
+	else
+		ptx_chrdev_complete_tune(chrdev, ret);
+
+	mutex_unlock(&chrdev->lock);
+	return;
+}
+
+static int ptx_chrdev_queue_tune(struct ptx_chrdev *chrdev)
+{
+	WRITE_ONCE(chrdev->tune_event, false);
+
+	if (!chrdev->ops->check_lock) {
+		chrdev->tune_state = PTX_CHRDEV_TUNE_LOCKED;
+		schedule_delayed_work(&chrdev->tune_work, 0);
+		return 0;
+	}
+
+	chrdev->tune_state = PTX_CHRDEV_TUNE_POLLING;
+	chrdev->tune_start = jiffies;
+	chrdev->tune_interval = msecs_to_jiffies(PTX_CHRDEV_TUNE_MIN_INTERVAL);
+	chrdev->tune_next_poll = chrdev->tune_start + chrdev->tune_interval;
+	schedule_delayed_work(&chrdev->parent->lock_poll_work,
+			      chrdev->tune_interval);
+
+	return 0;
+}
+
+/* must be called with chrdev->lock held */
+static void ptx_chrdev_cancel_tune(struct ptx_chrdev *chrdev)
+{
+	if (chrdev->tune_state == PTX_CHRDEV_TUNE_IDLE)
+		return;
+
+	chrdev->tune_result = -ECANCELED;
+	smp_store_release(&chrdev->tune_state, PTX_CHRDEV_TUNE_IDLE);
+	chrdev->tune_reader = NULL;
+	cancel_delayed_work_sync(&chrdev->tune_work);
+}
+
+/* a tune of a higher priority than prio is waiting for the lock */
+static bool ptx_chrdev_tune_outranked(struct ptx_chrdev *chrdev,
+				      enum ptx_tune_priority prio)
+{
+	int p;
+
+	for (p = prio + 1; p < PTX_CHRDEV_TUNE_PRIORITY_NUM; p++) {
+		if (atomic_read(&chrdev->tune_waiting[p]))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Checked between the polls by the synchronous tunes, which hold the lock all
+ * along: PTX_CANCEL_TUNE, or a tune of a higher priority waiting for the lock.
+ */
+static bool ptx_chrdev_tune_aborted(struct ptx_chrdev *chrdev)
+{
+	return (atomic_read(&chrdev->tune_cancel_seq) != chrdev->tune_cancel_seen ||
+		ptx_chrdev_tune_outranked(chrdev, chrdev->tune_priority));
+}
+
+/* takes chrdev->lock for a tune ioctl of the reader */
+static int ptx_chrdev_lock_tune(struct ptx_chrdev_reader *reader)
+{
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	enum ptx_tune_priority prio = reader->tune_priority;
+
+	atomic_inc(&chrdev->tune_waiting[prio]);
+	mutex_lock(&chrdev->lock);
+	atomic_dec(&chrdev->tune_waiting[prio]);
+
+	/* give way to the one which has cancelled the previous tune */
+	if (ptx_chrdev_tune_outranked(chrdev, prio)) {
+		mutex_unlock(&chrdev->lock);
+		return -EBUSY;
+	}
+
+	chrdev->tune_priority = prio;
+	chrdev->tune_cancel_seen = atomic_read(&chrdev->tune_cancel_seq);
+
+	return 0;
+}
+
+/* PTX_CANCEL_TUNE, without the lock held */
+static int ptx_chrdev_abort_tune(struct ptx_chrdev *chrdev)
+{
+	/* a synchronous tune gives up at its next poll and releases the lock */
+	atomic_inc(&chrdev->tune_cancel_seq);
+
+	mutex_lock(&chrdev->lock);
+
+	if (chrdev->tune_state != PTX_CHRDEV_TUNE_IDLE) {
+		ptx_chrdev_cancel_tune(chrdev);
+		WRITE_ONCE(chrdev->tune_event, true);
+		wake_up(&chrdev->ringbuf_wait);
+	}
+
+	mutex_unlock(&chrdev->lock);
+
+	return 0;
+}
+
+/* wait for ptx_chrdev_start_tune() to complete, must be called with chrdev->lock held */
+static int ptx_chrdev_wait_tune(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+
+	if (chrdev->ops->check_lock) {
+		int i;
+		unsigned long start = jiffies;
+		bool locked = false;
+
+		/* each poll comes 10 msecs or so after the previous one */
+		i = 300;
+		while (i--) {
+			if (ptx_chrdev_tune_aborted(chrdev)) {
+				/* not known to be locked to the channel */
+				chrdev->tuned_freq = 0;
+				ret = -EINTR;
+				break;
+			}
+
+			ret = ptx_chrdev_poll_lock(chrdev, start, &locked);
+			if ((!ret && locked) || ret == -ECANCELED)
+				break;
+		}
+
+		if (ret != -ECANCELED && ret != -EINTR && !locked)
+			ret = -EAGAIN;
+
+		if (ret) {
+			ptx_chrdev_trace_tune_end(chrdev, ret);
+			return ret;
+		}
+
+		if (chrdev->current_system == PTX_ISDB_T_SYSTEM &&
+		    (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T) &&
+		    i > 265)
+			msleep((i - 265) * 10);
+	}
+
+	ret = ptx_chrdev_finish_tune(chrdev);
+
+	if (chrdev->options & PTX_CHRDEV_WAIT_AFTER_LOCK)
+		msleep(200);
+
+	ptx_chrdev_trace_tune_end(chrdev, ret);
+
+	return ret;
+}
+
+static int ptx_chrdev_wait_lock(struct ptx_chrdev *chrdev,
+				unsigned int timeout)
+{
+	int ret = 0;
+	unsigned long start = jiffies;
+	unsigned long end = start + msecs_to_jiffies(timeout);
+	bool locked = false;
+
+	while (1) {
+		if (ptx_chrdev_tune_aborted(chrdev)) {
+			chrdev->tuned_freq = 0;
+			return -EINTR;
+		}
+
+		ret = ptx_chrdev_poll_lock(chrdev, start, &locked);
+		if ((!ret && locked) || ret == -ECANCELED)
+			return ret;
+
+		if (time_after(jiffies, end))
+			return -EAGAIN;
+	}
+}
+
+static int ptx_chrdev_scan_one(struct ptx_chrdev *chrdev,
+			       struct ptxt_scan_entry *entry,
+			       unsigned int timeout)
+{
+	int ret = 0;
+	enum ptx_system_type system = chrdev->params.system;
+
+	if (!(chrdev->system_cap & entry->system))
+		return -EINVAL;
+
+	switch (entry->system) {
+	case PTX_ISDB_T_SYSTEM:
+		chrdev->params.freq = entry->freq / 1000;
+		chrdev->params.bandwidth = (entry->bandwidth) ? entry->bandwidth : 6;
+		chrdev->params.stream_id = 0;
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		chrdev->params.freq = entry->freq;
+		chrdev->params.bandwidth = 0;
+		chrdev->params.stream_id = entry->stream_id;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	chrdev->params.system = entry->system;
+
+	ret = ptx_chrdev_start_tune(chrdev, system);
+	if (ret)
+		return ret;
+
+	if (chrdev->ops->check_lock) {
+		ret = ptx_chrdev_wait_lock(chrdev, timeout);
+		ptx_chrdev_trace_tune_end(chrdev, ret);
+		if (ret)
+			return ret;
+	}
+
+	if (chrdev->ops->read_cnr_raw &&
+	    !chrdev->ops->read_cnr_raw(chrdev, &entry->cnr_raw))
+		entry->flags |= PTXT_SCAN_CNR_VALID;
+
+	if (chrdev->ops->read_signal_strength &&
+	    !chrdev->ops->read_signal_strength(chrdev, &entry->signal_strength))
+		entry->flags |= PTXT_SCAN_SIGNAL_STRENGTH_VALID;
+
+	if (entry->system == PTX_ISDB_S_SYSTEM && chrdev->ops->read_tsid) {
+		int i = 100;
+
+		/* TMCC takes a while to be decoded after lock */
+		while (i--) {
+			int j;
+
+			ret = chrdev->ops->read_tsid(chrdev, entry->tsid,
+						     PTXT_SCAN_MAX_TSID);
+			if (ret)
+				break;
+
+			for (j = 0; j < PTXT_SCAN_MAX_TSID; j++) {
+				if (entry->tsid[j])
+					break;
+			}
+
+			if (j < PTXT_SCAN_MAX_TSID) {
+				entry->num_tsid = PTXT_SCAN_MAX_TSID;
+				break;
+			}
+
+			/* locked, the entry is valid without the TSIDs */
+			if (ptx_chrdev_tune_aborted(chrdev))
+				break;
+
+			msleep(10);
+		}
+	}
+
+	return 0;
+}
+
+static int ptx_chrdev_scan(struct ptx_chrdev *chrdev,
+			   const struct ptxt_scan __user *arg)
+{
+	int ret = 0;
+	struct ptxt_scan scan;
+	struct ptxt_scan_entry entry;
+	unsigned int timeout;
+	u32 i;
+
+	if (copy_from_user(&scan, arg, sizeof(scan)))
+		return -EFAULT;
+
+	if (scan.num_entry > PTXT_SCAN_MAX_ENTRY)
+		return -EINVAL;
+
+	timeout = (scan.timeout) ? min_t(u32, scan.timeout, PTX_CHRDEV_TUNE_TIMEOUT)
+				 : PTX_CHRDEV_TUNE_TIMEOUT;
+
+	for (i = 0; i < scan.num_entry; i++) {
+		if (copy_from_user(&entry, &scan.entry[i], sizeof(entry)))
+			return -EFAULT;
+
+		entry.flags = 0;
+		entry.cnr_raw = 0;
+		entry.signal_strength = 0;
+		entry.num_tsid = 0;
+		memset(entry.tsid, 0, sizeof(entry.tsid));
+
+		entry.status = ptx_chrdev_scan_one(chrdev, &entry, timeout);
+
+		if (copy_to_user(&scan.entry[i], &entry, sizeof(entry)))
+			return -EFAULT;
+
+		if (signal_pending(current) || ptx_chrdev_tune_aborted(chrdev))
+			return -EINTR;
+	}
+
+	return ret;
+}
+
+/*
+ * Buffer queue: PTX_QBUF/PTX_DQBUF. The producer fills the buffers of the
+ * owner along with the ringbuffer, and skips the ringbuffer while nobody
+ * else could read it.
+ */
+
+static void ptx_chrdev_update_bufq(struct ptx_chrdev *chrdev)
+{
+	WRITE_ONCE(chrdev->ring_unused,
+		   chrdev->bufq_owner && atomic_read(&chrdev->open) == 1);
+
+	return;
+}
+
+static int ptx_chrdev_dqbuf(struct file *file, struct ptx_buffer __user *arg)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	struct ptx_buffer buf;
+
+	/* the owner only changes on its own close */
+	if (READ_ONCE(chrdev->bufq_owner) != reader)
+		return -EINVAL;
+
+	while ((ret = ptx_bufq_dequeue(&chrdev->bufq, &buf)) == -EAGAIN) {
+		if (!ringbuffer_is_running(chrdev->ringbuf) ||
+		    (file->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+
+		if (wait_event_interruptible(chrdev->ringbuf_wait,
+					     likely(ptx_bufq_has_done(&chrdev->bufq)) ||
+					     unlikely(!ringbuffer_is_running(chrdev->ringbuf)) ||
+					     unlikely(!atomic_read(&group->available))))
+			return -EINTR;
+
+		if (unlikely(!atomic_read_acquire(&group->available)))
+			return -EIO;
+	}
+
+	if (copy_to_user(arg, &buf, sizeof(buf)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/*
+ * The counters only grow, whatever has been read is kept as the base, so
+ * nothing counted meanwhile gets lost. Returns the ns since the last reset.
+ */
+static u64 ptx_chrdev_read_pid_stats(struct ptx_chrdev *chrdev, u64 *packets,
+				     bool reset)
+{
+	u64 now = ktime_get_ns(), elapsed = now - chrdev->pid_packets_reset_time;
+	unsigned int i;
+
+	for (i = 0; i < PTX_PID_STATS_NUM; i++) {
+		u64 val = READ_ONCE(chrdev->pid_packets[i]);
+
+		if (packets)
+			packets[i] = val - chrdev->pid_packets_base[i];
+
+		if (reset)
+			chrdev->pid_packets_base[i] = val;
+	}
+
+	if (reset)
+		chrdev->pid_packets_reset_time = now;
+
+	return elapsed;
+}
+
+/* must be called with chrdev->lock held */
+static int ptx_chrdev_attach_reader(struct ptx_chrdev *chrdev,
+				    struct ptx_chrdev_reader **reader_p)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader;
+
+	if (atomic_read(&chrdev->open) >= chrdev->max_readers)
+		return -EALREADY;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->chrdev = chrdev;
+	reader->streaming = false;
+	reader->packet_aligned = false;
+	reader->threshold_size = chrdev->ringbuf_default_threshold_size;
+	reader->wake_latency = 0;
+	reader->tune_priority = PTX_TUNE_PRIORITY_NORMAL;
+
+	reader->mmap_ctrl = (struct ptx_mmap_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (!reader->mmap_ctrl) {
+		ret = -ENOMEM;
+		goto fail_reader;
+	}
+
+	ret = ringbuffer_attach(chrdev->ringbuf,
+				(struct ringbuffer_ctrl *)reader->mmap_ctrl,
+				&reader->id);
+	if (ret)
+		goto fail_reader;
+
+	if (atomic_inc_return(&chrdev->open) == 1) {
+		/* the buffer is only held while the tuner is open */
+		ret = ringbuffer_set_size(chrdev->ringbuf,
+					  ptx_chrdev_ringbuf_size(chrdev, chrdev->params.system));
+		if (!ret)
+			ret = ringbuffer_populate(chrdev->ringbuf);
+		if (ret)
+			goto fail_open;
+
+		/* nothing of a previous user is to be restored */
+		chrdev->suspended = false;
+		chrdev->current_system = PTX_UNSPECIFIED_SYSTEM;
+		chrdev->tuned_freq = 0;
+		chrdev->tune_result = -ENOENT;
+		WRITE_ONCE(chrdev->tune_event, false);
+		ringbuffer_set_overflow_policy(chrdev->ringbuf,
+					       RINGBUFFER_DROP_OLDEST);
+		ptx_chrdev_set_timestamp(chrdev, PTXT_TIMESTAMP_NONE);
+		ptx_chrdev_set_service(chrdev, 0);
+		ptx_chrdev_reset_tune_phases(chrdev, PTX_CHRDEV_TUNE_PHASE_OPEN);
+
+		if (chrdev->ops && chrdev->ops->open)
+			ret = chrdev->ops->open(chrdev);
+
+		if (ret)
+			goto fail_open;
+
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_OPEN);
+	}
+
+	chrdev->reader[reader->id] = reader;
+	ptx_chrdev_update_wake_threshold(chrdev);
+	ptx_chrdev_update_bufq(chrdev);
+
+	/* the new reader has no filter yet */
+	ptx_chrdev_update_pid_filter(chrdev);
+
+	*reader_p = reader;
+
+	return 0;
+
+fail_open:
+	if (!atomic_dec_return(&chrdev->open))
+		ringbuffer_depopulate(chrdev->ringbuf);
+
+	ringbuffer_detach(chrdev->ringbuf, reader->id);
+
+fail_reader:
+	if (reader->mmap_ctrl)
+		free_page((unsigned long)reader->mmap_ctrl);
+
+	kfree(reader);
+
+	return ret;
+}
+
+static int ptx_chrdev_open(struct inode *inode, struct file *file)
+{
+	int ret = 0;
+	unsigned int major, minor;
+	struct ptx_chrdev_context *ctx;
+	struct ptx_chrdev_group *group;
+	struct ptx_chrdev *chrdev = NULL;
+	struct ptx_chrdev_reader *reader = NULL;
+	struct kref *owner_kref = NULL;
+	void (*owner_kref_release)(struct kref *) = NULL;
+
+	BUILD_BUG_ON(sizeof(struct ptx_mmap_ctrl) != sizeof(struct ringbuffer_ctrl));
+
+	major = imajor(inode);
+	minor = iminor(inode);
+
+	mutex_lock(&ctx_list_lock);
+
+	if (!ptx_chrdev_search_context(major, &ctx)) {
+		mutex_unlock(&ctx_list_lock);
+		ret = -ENOENT;
+		goto fail;
+	}
+
+	kref_get(&ctx->kref);
+	mutex_lock(&ctx->lock);
+	mutex_unlock(&ctx_list_lock);
+
+	if (!ptx_chrdev_context_search_group(ctx, minor, &group)) {
+		mutex_unlock(&ctx->lock);
+		ret = -ENOENT;
+		goto fail_ctx;
+	}
+
+	owner_kref = group->owner_kref;
+	owner_kref_release = group->owner_kref_release;
+
+	if (owner_kref)
+		kref_get(owner_kref);
+
+	kref_get(&group->kref);
+	mutex_lock(&group->lock);
+	mutex_unlock(&ctx->lock);
+
+	if (!atomic_read(&group->available)) {
+		mutex_unlock(&group->lock);
+		ret = -ENOENT;
+		goto fail_group;
+	}
+
+	chrdev = &group->chrdev[minor - group->minor_base];
+
+	mutex_lock(&chrdev->lock);
+	mutex_unlock(&group->lock);
+
+	ret = ptx_chrdev_attach_reader(chrdev, &reader);
+	if (ret)
+		goto fail_chrdev;
+
+	file->private_data = reader;
+
+	mutex_unlock(&chrdev->lock);
+
+	return 0;
+
+fail_chrdev:
+	mutex_unlock(&chrdev->lock);
+
+fail_group:
+	kref_put(&group->kref, ptx_chrdev_group_release);
+
+	if (owner_kref)
+		kref_put(owner_kref, owner_kref_release);
+
+fail_ctx:
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+
+fail:
+	return ret;
+}
+
+/* a packet aligned reader is only readable with a whole packet */
+static bool ptx_chrdev_is_readable(struct ptx_chrdev_reader *reader)
+{
+	struct ringbuffer *ringbuf = reader->chrdev->ringbuf;
+
+	if (!reader->packet_aligned)
+		return ringbuffer_is_readable(ringbuf, reader->id);
+
+	return ringbuffer_readable_size(ringbuf, reader->id) >=
+	       READ_ONCE(ringbuf->unit_size);
+}
+
+/*
+ * Waits until the reader has data, the capture stops or the device goes away.
+ * Returns -EAGAIN if it would block and -EINTR if interrupted by a signal.
+ */
+static int ptx_chrdev_wait_readable(struct ptx_chrdev_reader *reader,
+				    bool nonblock)
+{
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+
+	if (nonblock && !ptx_chrdev_is_readable(reader))
+		return ringbuffer_is_running(chrdev->ringbuf) ? -EAGAIN : 0;
+
+	if (wait_event_interruptible(chrdev->ringbuf_wait,
+				     likely(ptx_chrdev_is_readable(reader)) ||
+				     unlikely(!ringbuffer_is_running(chrdev->ringbuf)) ||
+				     unlikely(!atomic_read(&group->available))))
+		return -EINTR;
+
+	trace_px4_ringbuf_wakeup(group->id, chrdev->id, reader->id,
+				 ringbuffer_readable_size(chrdev->ringbuf, reader->id),
+				 chrdev->ringbuf->size);
+	ptx_chrdev_account_wakeup(reader);
+
+	return 0;
+}
+
+/*
+ * Limits the read size to the whole packets available for a packet aligned
+ * reader. The writer always writes and drops whole packets, so a reader
+ * which has never read a partial packet stays on a packet boundary.
+ */
+static size_t ptx_chrdev_aligned_read_size(struct ptx_chrdev_reader *reader,
+					   size_t len)
+{
+	struct ringbuffer *ringbuf = reader->chrdev->ringbuf;
+	u32 unit_size = READ_ONCE(ringbuf->unit_size);
+	size_t readable = ringbuffer_readable_size(ringbuf, reader->id);
+
+	if (len > readable)
+		len = readable;
+
+	return rounddown(len, unit_size);
+}
+
+static ssize_t ptx_chrdev_read(struct file *file,
+			       char __user *buf, size_t count, loff_t *ppos)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	u8 __user *p = buf;
+	size_t remain = count;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	if (reader->packet_aligned) {
+		count = rounddown(count, READ_ONCE(chrdev->ringbuf->unit_size));
+		if (!count)
+			return -EINVAL;
+
+		remain = count;
+	}
+
+	ringbuffer_ready_read(chrdev->ringbuf);
+
+	while (likely(remain)) {
+		size_t len;
+
+		ret = ptx_chrdev_wait_readable(reader,
+					       !!(file->f_flags & O_NONBLOCK));
+		if (unlikely(ret)) {
+			if (remain != count)
+				ret = 0;
+
+			break;
+		}
+
+		len = (reader->packet_aligned) ? ptx_chrdev_aligned_read_size(reader, remain)
+					       : remain;
+		ret = ringbuffer_read_user(chrdev->ringbuf, reader->id, p, &len);
+		if (unlikely(ret || !len))
+			break;
+
+		p += len;
+		remain -= len;
+	}
+
+	return likely(!ret) ? (count - remain) : ret;
+}
+
+/*
+ * splice() support
+ *
+ * The ringbuffer is shared by all readers and its pages are reused by the
+ * writer, so they can't be handed to the pipe as they are. The data is
+ * copied into freshly allocated pages instead, which are then owned by the
+ * pipe alone and can be stolen by the consumer.
+ */
+
+static const struct pipe_buf_operations ptx_chrdev_pipe_buf_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	.try_steal = generic_pipe_buf_try_steal,
+#else
+	.confirm = generic_pipe_buf_confirm,
+	.steal = generic_pipe_buf_steal,
+#endif
+	.release = generic_pipe_buf_release,
+	.get = generic_pipe_buf_get
+};
+
+static bool ptx_chrdev_pipe_full(struct pipe_inode_info *pipe)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	return pipe_full(pipe->head, pipe->tail, pipe->max_usage);
+#else
+	return pipe->nrbufs >= pipe->buffers;
+#endif
+}
+
+static ssize_t ptx_chrdev_splice_read(struct file *file, loff_t *ppos,
+				      struct pipe_inode_info *pipe,
+				      size_t count, unsigned int flags)
+{
+	ssize_t ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	size_t remain = count;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	if (reader->packet_aligned &&
+	    count < READ_ONCE(chrdev->ringbuf->unit_size))
+		return -EINVAL;
+
+	ringbuffer_ready_read(chrdev->ringbuf);
+
+	/* the pipe is locked by the caller, don't wait once it has data */
+	ret = ptx_chrdev_wait_readable(reader,
+				       (flags & SPLICE_F_NONBLOCK) ||
+				       (file->f_flags & O_NONBLOCK));
+	if (ret)
+		return ret;
+
+	while (likely(remain) && !ptx_chrdev_pipe_full(pipe)) {
+		struct pipe_buffer buf;
+		struct page *page;
+		size_t len;
+
+		if (!ptx_chrdev_is_readable(reader))
+			break;
+
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		len = (remain < PAGE_SIZE) ? remain : PAGE_SIZE;
+		if (reader->packet_aligned) {
+			len = ptx_chrdev_aligned_read_size(reader, len);
+			if (!len) {
+				put_page(page);
+				break;
+			}
+		}
+
+		ret = ringbuffer_read(chrdev->ringbuf, reader->id,
+				      page_address(page), &len);
+		if (unlikely(ret || !len)) {
+			put_page(page);
+			break;
+		}
+
+		buf.page = page;
+		buf.offset = 0;
+		buf.len = len;
+		buf.ops = &ptx_chrdev_pipe_buf_ops;
+		buf.flags = 0;
+		buf.private = 0;
+
+		/* drops the page on failure */
+		ret = add_to_pipe(pipe, &buf);
+		if (ret < 0)
+			break;
+
+		ret = 0;
+		remain -= len;
+	}
+
+	return (remain != count) ? (count - remain) : ret;
+}
+
+static __poll_t ptx_chrdev_poll(struct file *file,
+				struct poll_table_struct *wait)
+{
+	__poll_t mask = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+
+	poll_wait(file, &chrdev->ringbuf_wait, wait);
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return EPOLLERR | EPOLLHUP;
+
+	ringbuffer_ready_read(chrdev->ringbuf);
+
+	if (ptx_chrdev_is_readable(reader))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* a buffer can be dequeued, see PTX_DQBUF */
+	if (READ_ONCE(chrdev->bufq_owner) == reader &&
+	    ptx_bufq_has_done(&chrdev->bufq))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* an asynchronous tune has completed, see PTX_GET_TUNE_STATUS */
+	if (READ_ONCE(chrdev->tune_event))
+		mask |= EPOLLPRI;
+
+	/* data has been lost, see PTX_GET_OVERFLOW_COUNT */
+	if (ringbuffer_has_overflowed(chrdev->ringbuf, reader->id))
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+static int ptx_chrdev_advance_read_pointer(struct file *file,
+					   u32 __user *arg)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	u32 count;
+	size_t len;
+
+	if (get_user(count, arg))
+		return -EFAULT;
+
+	ringbuffer_ready_read(chrdev->ringbuf);
+
+	len = count;
+	ringbuffer_advance(chrdev->ringbuf, reader->id, &len);
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!ringbuffer_is_readable(chrdev->ringbuf, reader->id) &&
+		    ringbuffer_is_running(chrdev->ringbuf))
+			return -EAGAIN;
+	} else if (wait_event_interruptible(chrdev->ringbuf_wait,
+				     likely(ringbuffer_is_readable(chrdev->ringbuf, reader->id)) ||
+				     unlikely(!ringbuffer_is_running(chrdev->ringbuf)) ||
+				     unlikely(!atomic_read(&group->available))))
+		return -EINTR;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	count = ringbuffer_readable_size(chrdev->ringbuf, reader->id);
+	trace_px4_ringbuf_wakeup(group->id, chrdev->id, reader->id,
+				 count, chrdev->ringbuf->size);
+	if (count)
+		ptx_chrdev_account_wakeup(reader);
+	if (put_user(count, arg))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+static int ptx_chrdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	if (vma->vm_pgoff || (vma->vm_flags & VM_WRITE))
+		return -EINVAL;
+
+	if (size > PAGE_SIZE + PAGE_ALIGN(chrdev->ringbuf->size))
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	mutex_lock(&chrdev->lock);
+
+	/* the ringbuffer is vmalloc'ed, so the pages are inserted one by one */
+	ret = vm_insert_page(vma, vma->vm_start,
+			     virt_to_page(reader->mmap_ctrl));
+	if (!ret && size > PAGE_SIZE) {
+		ret = ringbuffer_mmap(chrdev->ringbuf, vma,
+				      vma->vm_start + PAGE_SIZE,
+				      size - PAGE_SIZE);
+
+		/* data read in place must not be overwritten under the reader */
+		if (!ret)
+			ringbuffer_set_reader_flags(chrdev->ringbuf, reader->id,
+						    RINGBUFFER_READER_NO_DISCARD);
+	}
+
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+static int ptx_chrdev_put_reader(struct ptx_chrdev_reader *reader)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	struct ptx_chrdev_context *ctx = group->parent;
+	struct kref *owner_kref = group->owner_kref;
+	void (*owner_kref_release)(struct kref *) = group->owner_kref_release;
+
+	mutex_lock(&chrdev->lock);
+
+	if (reader->streaming) {
+		if (chrdev->streaming_count == 1 && !chrdev->preroll_time) {
+			if (chrdev->ops && chrdev->ops->set_capture)
+				chrdev->ops->set_capture(chrdev, false);
+
+			ringbuffer_stop(chrdev->ringbuf);
+			wake_up(&chrdev->ringbuf_wait);
+			chrdev->streaming = false;
+		}
+
+		reader->streaming = false;
+		chrdev->streaming_count--;
+	}
+
+	if (chrdev->tune_reader == reader)
+		chrdev->tune_reader = NULL;
+
+	if (chrdev->bufq_owner == reader) {
+		/* taken from the producer under the lock of the queue */
+		WRITE_ONCE(chrdev->bufq_owner, NULL);
+		ptx_bufq_release(&chrdev->bufq);
+	}
+
+	chrdev->reader[reader->id] = NULL;
+	ringbuffer_detach(chrdev->ringbuf, reader->id);
+	ptx_chrdev_update_wake_threshold(chrdev);
+	ptx_chrdev_update_pid_filter(chrdev);
+
+	if (atomic_dec_return(&chrdev->open) == 0) {
+		ptx_chrdev_stop_preroll(chrdev);
+		chrdev->preroll_time = 0;
+		ptx_chrdev_cancel_tune(chrdev);
+		ptx_chrdev_stop_wake_timer(chrdev);
+
+		if (chrdev->ops && chrdev->ops->release)
+			ret = chrdev->ops->release(chrdev);
+
+		ptx_chrdev_set_packet_filter(chrdev, NULL);
+
+		ringbuffer_depopulate(chrdev->ringbuf);
+	}
+
+	ptx_chrdev_update_bufq(chrdev);
+
+	mutex_unlock(&chrdev->lock);
+
+	free_page((unsigned long)reader->mmap_ctrl);
+	kfree(reader);
+
+	kref_put(&group->kref, ptx_chrdev_group_release);
+
+	if (owner_kref)
+		kref_put(owner_kref, owner_kref_release);
+
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+	return ret;
+}
+
+static int ptx_chrdev_release(struct inode *inode, struct file *file)
+{
+	return ptx_chrdev_put_reader(file->private_data);
+}
+
+#ifdef PX4_DVB
+/*
+ * Readers inside the kernel, for the DVB binding (ptx_dvb.c). A reader holds
+ * the same references as an open file and is driven like one by the ioctls.
+ */
+
+int ptx_chrdev_kernel_open(struct ptx_chrdev *chrdev,
+			   struct ptx_chrdev_reader **reader)
+{
+	int ret = 0;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	struct ptx_chrdev_context *ctx = group->parent;
+	struct kref *owner_kref = group->owner_kref;
+	void (*owner_kref_release)(struct kref *) = group->owner_kref_release;
+
+	kref_get(&ctx->kref);
+
+	if (owner_kref)
+		kref_get(owner_kref);
+
+	kref_get(&group->kref);
+
+	if (!atomic_read(&group->available)) {
+		ret = -ENOENT;
+		goto fail;
+	}
+
+	mutex_lock(&chrdev->lock);
+
+	ret = ptx_chrdev_attach_reader(chrdev, reader);
+	if (!ret)
+		(*reader)->packet_aligned = true;
+
+	mutex_unlock(&chrdev->lock);
+
+	if (ret)
+		goto fail;
+
+	return 0;
+
+fail:
+	kref_put(&group->kref, ptx_chrdev_group_release);
+
+	if (owner_kref)
+		kref_put(owner_kref, owner_kref_release);
+
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+
+	return ret;
+}
+
+int ptx_chrdev_kernel_close(struct ptx_chrdev_reader *reader)
+{
+	return ptx_chrdev_put_reader(reader);
+}
+
+/* starts an asynchronous tune, ptx_chrdev_kernel_get_lock() tells the result */
+int ptx_chrdev_kernel_tune(struct ptx_chrdev_reader *reader,
+			   const struct ptx_tune_params *params)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	if (!(chrdev->system_cap & params->system) || !params->freq)
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+
+	if (!chrdev->ops || !chrdev->ops->tune) {
+		ret = -ENOSYS;
+		goto exit;
+	}
+
+	/* do not retune under other readers */
+	if (chrdev->streaming_count > ((reader->streaming) ? 1 : 0)) {
+		ret = -EBUSY;
+		goto exit;
+	}
+
+	ptx_chrdev_cancel_tune(chrdev);
+
+	chrdev->params = *params;
+
+	ret = ptx_chrdev_start_tune(chrdev, params->system);
+	if (!ret)
+		ret = ptx_chrdev_queue_tune(chrdev);
+
+exit:
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+/*
+ * Returns -EINPROGRESS while the tune is going on, and the error of the tune
+ * if it has failed. Once tuned, the lock is checked again on each call.
+ */
+int ptx_chrdev_kernel_get_lock(struct ptx_chrdev_reader *reader, bool *locked)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	*locked = false;
+
+	mutex_lock(&chrdev->lock);
+
+	if (chrdev->tune_state != PTX_CHRDEV_TUNE_IDLE)
+		ret = -EINPROGRESS;
+	else if (chrdev->tune_result)
+		ret = chrdev->tune_result;
+	else if (chrdev->ops->check_lock)
+		ret = chrdev->ops->check_lock(chrdev, locked);
+	else
+		*locked = true;
+
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+/* C/N in 0.01 dB units */
+int ptx_chrdev_kernel_read_cnr(struct ptx_chrdev_reader *reader, u32 *cnr)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	mutex_lock(&chrdev->lock);
+
+	if (chrdev->ops->read_cnr && chrdev->current_system)
+		ret = chrdev->ops->read_cnr(chrdev, cnr);
+	else
+		ret = -ENOSYS;
+
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+int ptx_chrdev_kernel_set_lnb_voltage(struct ptx_chrdev_reader *reader,
+				      int voltage)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	mutex_lock(&chrdev->lock);
+
+	if (chrdev->ops->set_lnb_voltage)
+		ret = chrdev->ops->set_lnb_voltage(chrdev, voltage);
+	else if (voltage)
+		ret = -ENOSYS;
+
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+int ptx_chrdev_kernel_set_capture(struct ptx_chrdev_reader *reader,
+				  bool capture)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	mutex_lock(&chrdev->lock);
+	ret = (capture) ? ptx_chrdev_start_reader(reader)
+			: ptx_chrdev_stop_reader(reader);
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+/* the pids go to the hardware table when the union of the readers fits in */
+int ptx_chrdev_kernel_set_pid_filter(struct ptx_chrdev_reader *reader,
+				     const u16 *pid, unsigned int num)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+
+	if (num > PTXT_PID_FILTER_MAX)
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+	ret = ptx_chrdev_set_reader_pid_filter(reader, pid, num);
+	mutex_unlock(&chrdev->lock);
+
+	return ret;
+}
+
+/*
+ * Reads whole packets, waiting for them up to timeout msecs.
+ * Returns 0 if there was nothing to read, -EIO if the device has gone.
+ */
+ssize_t ptx_chrdev_kernel_read(struct ptx_chrdev_reader *reader,
+			       void *buf, size_t count, unsigned int timeout)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	size_t len;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	ringbuffer_ready_read(chrdev->ringbuf);
+
+	/* a kernel thread gets no signals, interruptible only to keep it out of the load */
+	if (wait_event_interruptible_timeout(chrdev->ringbuf_wait,
+					     ptx_chrdev_is_readable(reader) ||
+					     !atomic_read(&group->available),
+					     msecs_to_jiffies(timeout)) <= 0)
+		return 0;
+
+	ptx_chrdev_account_wakeup(reader);
+
+	len = ptx_chrdev_aligned_read_size(reader, count);
+	if (!len)
+		return 0;
+
+	ret = ringbuffer_read(chrdev->ringbuf, reader->id, buf, &len);
+
+	return (ret) ? ret : len;
+}
+#endif
+
+/*
+ * Aggregated stream: PTX_OPEN_GROUP_STREAM reads the packets of every
+ * streaming tuner of the group through a single file descriptor, each of
+ * them tagged with the index of its tuner.
+ */
+
+static ssize_t ptx_chrdev_group_stream_read(struct file *file,
+					    char __user *buf, size_t count,
+					    loff_t *ppos)
+{
+	int ret = 0;
+	struct ptx_chrdev_group_stream *stream = file->private_data;
+	struct ptx_chrdev_group *group = stream->group;
+	size_t len;
+
+	/* only whole records */
+	count = rounddown(count, PTX_GROUP_PACKET_SIZE);
+	if (!count)
+		return -EINVAL;
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return -EIO;
+
+	if (!ringbuffer_is_readable(stream->ringbuf, stream->id)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(stream->wait,
+					     likely(ringbuffer_is_readable(stream->ringbuf, stream->id)) ||
+					     unlikely(!atomic_read(&group->available))))
+			return -EINTR;
+
+		if (unlikely(!atomic_read_acquire(&group->available)))
+			return -EIO;
+	}
+
+	len = ringbuffer_readable_size(stream->ringbuf, stream->id);
+	if (len > count)
+		len = count;
+
+	len = rounddown(len, PTX_GROUP_PACKET_SIZE);
+
+	ret = ringbuffer_read_user(stream->ringbuf, stream->id, buf, &len);
+
+	return likely(!ret) ? len : ret;
+}
+
+static __poll_t ptx_chrdev_group_stream_poll(struct file *file,
+					     struct poll_table_struct *wait)
+{
+	__poll_t mask = 0;
+	struct ptx_chrdev_group_stream *stream = file->private_data;
+	struct ptx_chrdev_group *group = stream->group;
+
+	poll_wait(file, &stream->wait, wait);
+
+	if (unlikely(!atomic_read_acquire(&group->available)))
+		return EPOLLERR | EPOLLHUP;
+
+	if (ringbuffer_is_readable(stream->ringbuf, stream->id))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+static int ptx_chrdev_group_stream_release(struct inode *inode,
+					   struct file *file)
+{
+	struct ptx_chrdev_group_stream *stream = file->private_data;
+	struct ptx_chrdev_group *group = stream->group;
+	struct ptx_chrdev_context *ctx = group->parent;
+	struct kref *owner_kref = group->owner_kref;
+	void (*owner_kref_release)(struct kref *) = group->owner_kref_release;
+
+	mutex_lock(&group->lock);
+
+	atomic_set(&group->stream_open, 0);
+	ringbuffer_stop(stream->ringbuf);
+	ringbuffer_detach(stream->ringbuf, stream->id);
+
+	mutex_unlock(&group->lock);
+
+	kref_put(&group->kref, ptx_chrdev_group_release);
+
+	if (owner_kref)
+		kref_put(owner_kref, owner_kref_release);
+
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+	return 0;
+}
+
+static const struct file_operations ptx_chrdev_group_stream_fops = {
+	.owner = THIS_MODULE,
+	.read = ptx_chrdev_group_stream_read,
+	.poll = ptx_chrdev_group_stream_poll,
+	.release = ptx_chrdev_group_stream_release,
+	.llseek = noop_llseek
+};
+
+static void ptx_chrdev_group_stream_free(struct ptx_chrdev_group_stream *stream)
+{
+	if (stream->ringbuf)
+		ringbuffer_destroy(stream->ringbuf);
+
+	kfree(stream->buf);
+	kfree(stream);
+}
+
+/* the caller must hold the lock of the group */
+static int ptx_chrdev_group_stream_alloc(struct ptx_chrdev_group *group)
+{
+	int ret = 0;
+	struct ptx_chrdev_group_stream *stream;
+	unsigned int i;
+	size_t size = 0;
+
+	stream = kzalloc_node(sizeof(*stream), GFP_KERNEL, group->node);
+	if (!stream)
+		return -ENOMEM;
+
+	stream->group = group;
+	init_waitqueue_head(&stream->wait);
+	stream->threshold_size = group->chrdev[0].ringbuf_default_threshold_size;
+
+	stream->buf = kmalloc_node(PTX_GROUP_PACKET_SIZE * PTX_CHRDEV_GROUP_STREAM_PACKETS,
+				   GFP_KERNEL, group->node);
+	if (!stream->buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	/* as much time as the buffers of the tuners hold */
+	for (i = 0; i < group->chrdev_num; i++)
+		size += group->chrdev[i].ringbuf->size;
+
+	size = roundup(div_u64((u64)size * PTX_GROUP_PACKET_SIZE, 188),
+		       PTX_GROUP_PACKET_SIZE);
+
+	ret = ringbuffer_create(&stream->ringbuf, group->node);
+	if (ret)
+		goto fail;
+
+	ret = ringbuffer_alloc(stream->ringbuf, size);
+	if (ret)
+		goto fail;
+
+	ret = ringbuffer_set_unit_size(stream->ringbuf, PTX_GROUP_PACKET_SIZE);
+	if (ret)
+		goto fail;
+
+	group->stream = stream;
+
+	return 0;
+
+fail:
+	dev_err(group->dev,
+		"ptx_chrdev_group_stream_alloc: failed. (size: %zu, ret: %d)\n",
+		size, ret);
+	ptx_chrdev_group_stream_free(stream);
+	return ret;
+}
+
+static int ptx_chrdev_open_group_stream(struct ptx_chrdev_group *group)
+{
+	int ret = 0;
+	struct ptx_chrdev_context *ctx = group->parent;
+	struct kref *owner_kref = group->owner_kref;
+	void (*owner_kref_release)(struct kref *) = group->owner_kref_release;
+	struct ptx_chrdev_group_stream *stream;
+
+	mutex_lock(&group->lock);
+
+	if (atomic_read(&group->stream_open)) {
+		ret = -EBUSY;
+		goto exit;
+	}
+
+	if (!group->stream) {
+		ret = ptx_chrdev_group_stream_alloc(group);
+		if (ret)
+			goto exit;
+	}
+
+	stream = group->stream;
+
+	ringbuffer_reset(stream->ringbuf);
+
+	ret = ringbuffer_attach(stream->ringbuf, NULL, &stream->id);
+	if (ret)
+		goto exit;
+
+	stream->write_size = 0;
+
+	kref_get(&ctx->kref);
+
+	if (owner_kref)
+		kref_get(owner_kref);
+
+	kref_get(&group->kref);
+
+	/* the release waits for the lock of the group */
+	ret = anon_inode_getfd("[ptx_chrdev_group]",
+			       &ptx_chrdev_group_stream_fops, stream,
+			       O_RDONLY | O_CLOEXEC);
+	if (ret < 0) {
+		ringbuffer_detach(stream->ringbuf, stream->id);
+
+		/* the caller holds another reference */
+		kref_put(&group->kref, ptx_chrdev_group_release);
+
+		if (owner_kref)
+			kref_put(owner_kref, owner_kref_release);
+
+		kref_put(&ctx->kref, ptx_chrdev_context_release);
+		goto exit;
+	}
+
+	ringbuffer_start(stream->ringbuf);
+	ringbuffer_ready_read(stream->ringbuf);
+
+	/* the producers may use the stream from now on */
+	atomic_set_release(&group->stream_open, 1);
+
+exit:
+	mutex_unlock(&group->lock);
+	return ret;
+}
+
+/*
+ * The ioctls which never wait for the lock: those reading what is kept
+ * up to date without it, and the stats while someone else holds it.
+ */
+static long ptx_chrdev_ioctl_nowait(struct ptx_chrdev_reader *reader,
+				    unsigned int cmd, unsigned long arg)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+
+	switch (cmd) {
+	case PTX_GET_TUNE_STATUS:
+		WRITE_ONCE(chrdev->tune_event, false);
+		ret = (smp_load_acquire(&chrdev->tune_state) != PTX_CHRDEV_TUNE_IDLE) ? -EINPROGRESS
+										       : READ_ONCE(chrdev->tune_result);
+		break;
+
+	case PTX_GET_OVERFLOW_COUNT:
+	{
+		u32 count;
+
+		count = ringbuffer_get_overflows(chrdev->ringbuf, reader->id);
+
+		if (copy_to_user((void *)arg, &count, sizeof(count)))
+			ret = -EFAULT;
+
+		break;
+	}
+
+	case PTX_GET_CNR:
+	{
+		struct ptx_chrdev_stat_values v;
+
+		spin_lock(&chrdev->stat_snapshot_lock);
+		v = chrdev->stat_snapshot;
+		spin_unlock(&chrdev->stat_snapshot_lock);
+
+		if (!(v.valid & PTX_CHRDEV_STAT_CNR_RAW)) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (copy_to_user((void *)arg, &v.cnr_raw, sizeof(v.cnr_raw)))
+			ret = -EFAULT;
+
+		break;
+	}
+
+	case PTXT_READ_STATS:
+		if (!chrdev->ops) {
+			ret = -ENOSYS;
+			break;
+		}
+
+		ret = ptx_chrdev_read_stats(chrdev,
+					    (const struct ptxt_stats __user *)arg,
+					    true);
+		break;
+
+	case PTXT_GET_INFO:
+	{
+		struct ptx_chrdev_context *ctx = group->parent;
+		struct ptxt_info info;
+
+		memset(&info, 0, sizeof(info));
+		snprintf(info.name, sizeof(info.name), "%s%u", ctx->devname,
+			 group->minor_base - MINOR(ctx->dev_base) + chrdev->id);
+		info.cap.systems = chrdev->system_cap;
+		info.cap.streams = PTX_MPEG_TRANSPORT_STREAM;
+
+		if (group->bus) {
+			snprintf(info.bus_path, sizeof(info.bus_path), "%s",
+				 itedtv_bus_path(group->bus));
+			info.bus_number = group->bus_number;
+			info.bus_speed = itedtv_bus_speed(group->bus);
+			info.bus_bandwidth = itedtv_bus_rx_rate(&group->bus->stats);
+		}
+
+		if (copy_to_user((void *)arg, &info, sizeof(info)))
+			ret = -EFAULT;
+
+		break;
+	}
+
+	default:
+		ret = -ENOSYS;
+		break;
+	}
+
+	return ret;
+}
+
+static long ptx_chrdev_unlocked_ioctl(struct file *file,
+				      unsigned int cmd, unsigned long arg)
+{
+	int ret = 0;
+	struct ptx_chrdev_reader *reader = file->private_data;
+	struct ptx_chrdev *chrdev = reader->chrdev;
+	struct ptx_chrdev_group *group = chrdev->parent;
+
+	if (!atomic_read_acquire(&group->available))
+		return -EIO;
+
+	/* does not take the lock because it may sleep until data arrives */
+	if (cmd == PTX_ADVANCE_READ_POINTER)
+		return ptx_chrdev_advance_read_pointer(file,
+						       (u32 __user *)arg);
+
+	/* takes the lock of the group, which is taken before ours */
+	if (cmd == PTX_OPEN_GROUP_STREAM)
+		return ptx_chrdev_open_group_stream(group);
+
+	/* may sleep until a buffer has been filled */
+	if (cmd == PTX_DQBUF)
+		return ptx_chrdev_dqbuf(file, (struct ptx_buffer __user *)arg);
+
+	/* the tune to be cancelled may hold the lock */
+	if (cmd == PTX_CANCEL_TUNE)
+		return ptx_chrdev_abort_tune(chrdev);
+
+	/* never wait behind a tune, which holds the lock for seconds */
+	if (cmd == PTX_GET_CNR || cmd == PTXT_READ_STATS) {
+		if (!mutex_trylock(&chrdev->lock))
+			return ptx_chrdev_ioctl_nowait(reader, cmd, arg);
+	} else if (cmd == PTX_GET_TUNE_STATUS || cmd == PTX_GET_OVERFLOW_COUNT ||
+		   cmd == PTXT_GET_INFO) {
+		return ptx_chrdev_ioctl_nowait(reader, cmd, arg);
+	} else if (cmd == PTX_SET_CHANNEL || cmd == PTX_SET_CHANNEL_ASYNC ||
+		   cmd == PTXT_TUNE || cmd == PTXT_TUNE_AND_START ||
+		   cmd == PTXT_SCAN) {
+		ret = ptx_chrdev_lock_tune(reader);
+		if (ret)
+			return ret;
+	} else {
+		mutex_lock(&chrdev->lock);
+	}
+
+	switch (cmd) {
+	case PTX_SET_CHANNEL:
+	case PTX_SET_CHANNEL_ASYNC:
+	{
+		struct ptx_freq freq;
+		enum ptx_system_type system;
+
+		if (!chrdev->ops || !chrdev->ops->tune) {
+			ret = -ENOSYS;
+			break;
+		}
+
+		if (copy_from_user(&freq, (void *)arg, sizeof(freq))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		/* do not retune under other readers */
+		if (chrdev->streaming_count > ((reader->streaming) ? 1 : 0)) {
+			ret = -EBUSY;
+			break;
+		}
+
+		ptx_chrdev_cancel_tune(chrdev);
+
+		system = chrdev->params.system;
+
+		ret = ptx_chrdev_set_freq_params(chrdev, &freq);
+		if (ret)
+			break;
+
+		ret = ptx_chrdev_start_tune(chrdev, system);
+		if (ret)
+			break;
+
+		if (cmd == PTX_SET_CHANNEL_ASYNC) {
+			ret = ptx_chrdev_queue_tune(chrdev);
+			break;
+		}
+
+		ret = ptx_chrdev_wait_tune(chrdev);
+		break;
+	}
+
+	case PTXT_TUNE:
+	case PTXT_TUNE_AND_START:
+		if (!chrdev->ops || !chrdev->ops->tune) {
+			ret = -ENOSYS;
+			break;
+		}
+
+		/* PTXT_SET_PARAMS must have selected a system and a frequency */
+		if (chrdev->params.system == PTX_UNSPECIFIED_SYSTEM ||
+		    !chrdev->params.freq) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (chrdev->streaming_count > ((reader->streaming) ? 1 : 0)) {
+			ret = -EBUSY;
+			break;
+		}
+
+		ptx_chrdev_cancel_tune(chrdev);
+
+		ret = ptx_chrdev_start_tune(chrdev, chrdev->params.system);
+		if (ret)
+			break;
+
+		if (cmd == PTXT_TUNE) {
+			ret = ptx_chrdev_wait_tune(chrdev);
+			break;
+		}
+
+		chrdev->tune_reader = reader;
+		ret = ptx_chrdev_queue_tune(chrdev);
+		break;
+
+	case PTXT_SET_PARAMS:
+		ret = ptx_chrdev_set_params(chrdev,
+					    (const struct ptxt_params __user *)arg);
+		break;
+
+	case PTXT_GET_PARAMS:
+		ret = ptx_chrdev_get_params(chrdev,
+					    (struct ptxt_params __user *)arg);
+		break;
+
+	case PTXT_CLEAR_PARAMS:
+		ret = ptx_chrdev_clear_params(chrdev);
+		break;
+
+	case PTXT_SET_LNB_VOLTAGE:
+		switch (arg) {
+		case 0:
+		case 11:
+		case 15:
+			if (chrdev->ops && chrdev->ops->set_lnb_voltage)
+				ret = chrdev->ops->set_lnb_voltage(chrdev, arg);
+			else if (arg)
+				ret = -ENOSYS;
+			break;
+
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		break;
+
+	case PTXT_SET_CAPTURE:
+		ret = (arg) ? ptx_chrdev_start_reader(reader)
+			    : ptx_chrdev_stop_reader(reader);
+		break;
+
+	case PTXT_READ_STATS:
+		if (!chrdev->ops) {
+			ret = -ENOSYS;
+			break;
+		}
+
+		ret = ptx_chrdev_read_stats(chrdev,
+					    (const struct ptxt_stats __user *)arg,
+					    false);
+		break;
+
+	case PTXT_SCAN:
+		if (!chrdev->ops || !chrdev->ops->tune) {
+			ret = -ENOSYS;
+			break;
+		}
+
+		if (chrdev->streaming_count > ((reader->streaming) ? 1 : 0)) {
+			ret = -EBUSY;
+			break;
+		}
+
+		ptx_chrdev_cancel_tune(chrdev);
+		ret = ptx_chrdev_scan(chrdev, (const struct ptxt_scan __user *)arg);
+		break;
+
+	case PTX_START_STREAMING:
+		ret = ptx_chrdev_start_reader(reader);
+		break;
+
+	case PTX_STOP_STREAMING:
+		ret = ptx_chrdev_stop_reader(reader);
+		break;
+
+	case PTX_SET_WAKE_THRESHOLD:
+	{
+		struct ptx_wake_threshold threshold;
+
+		if (copy_from_user(&threshold, (void *)arg, sizeof(threshold))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (threshold.size > chrdev->ringbuf->size) {
+			ret = -EINVAL;
+			break;
+		}
+
+		reader->threshold_size = (threshold.size) ? threshold.size
+							  : chrdev->ringbuf_default_threshold_size;
+		reader->wake_latency = (threshold.latency) ? max(msecs_to_jiffies(threshold.latency), 1UL)
+							   : 0;
+
+		ptx_chrdev_update_wake_threshold(chrdev);
+		break;
+	}
+
+	case PTX_SET_PACKET_ALIGNED:
+		if (reader->streaming) {
+			ret = -EBUSY;
+			break;
+		}
+
+		reader->packet_aligned = !!arg;
+		break;
+
+	case PTX_QBUF:
+	{
+		struct ptx_buffer buf;
+
+		if (copy_from_user(&buf, (void *)arg, sizeof(buf))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (chrdev->bufq_owner && chrdev->bufq_owner != reader) {
+			ret = -EBUSY;
+			break;
+		}
+
+		ret = ptx_bufq_queue(&chrdev->bufq, &buf);
+		if (ret)
+			break;
+
+		if (!chrdev->bufq_owner) {
+			WRITE_ONCE(chrdev->bufq_owner, reader);
+			ptx_chrdev_update_bufq(chrdev);
+		}
+
+		break;
+	}
+
+	case PTX_SET_PACKET_FILTER:
+	{
+		struct ptx_packet_filter pf;
+		struct ts_bpf *prog = NULL;
+
+		if (copy_from_user(&pf, (void *)arg, sizeof(pf))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (pf.len) {
+			ret = ts_bpf_create(&prog, pf.filter, pf.len);
+			if (ret)
+				break;
+		}
+
+		ptx_chrdev_set_packet_filter(chrdev, prog);
+		break;
+	}
+
+	case PTX_GET_PID_STATS:
+	{
+		struct ptx_pid_stats ps;
+		u64 *packets;
+
+		if (copy_from_user(&ps, (void *)arg, sizeof(ps))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (!chrdev->pid_stats) {
+			ret = -ENODATA;
+			break;
+		}
+
+		packets = kvmalloc(sizeof(*packets) * PTX_PID_STATS_NUM,
+				   GFP_KERNEL);
+		if (!packets) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ps.elapsed = ptx_chrdev_read_pid_stats(chrdev, packets,
+						       !!(ps.flags & PTX_PID_STATS_RESET));
+
+		if (copy_to_user(ps.packets, packets,
+				 sizeof(*packets) * PTX_PID_STATS_NUM) ||
+		    copy_to_user((void *)arg, &ps, sizeof(ps)))
+			ret = -EFAULT;
+
+		kvfree(packets);
+		break;
+	}
+
+	case PTX_SET_PREROLL:
+		if (arg > PTX_CHRDEV_PREROLL_MAX_TIME) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (!arg) {
+			chrdev->preroll_time = 0;
+			ptx_chrdev_stop_preroll(chrdev);
+			break;
+		}
+
+		WRITE_ONCE(chrdev->preroll_interval,
+			   div_u64((u64)arg * NSEC_PER_MSEC,
+				   PTX_CHRDEV_PREROLL_MARKS / 2));
+		ret = ptx_chrdev_start_preroll(chrdev);
+		if (!ret)
+			WRITE_ONCE(chrdev->preroll_time, arg);
+
+		break;
+
+	case PTX_SET_SERVICE:
+		if (arg > 0xffff) {
+			ret = -EINVAL;
+			break;
+		}
+
+		ptx_chrdev_set_service(chrdev, arg);
+		break;
+
+	case PTX_SET_OVERFLOW_POLICY:
+		switch ((enum ptx_overflow_policy)arg) {
+		case PTX_OVERFLOW_DROP_OLDEST:
+			ret = ringbuffer_set_overflow_policy(chrdev->ringbuf,
+							     RINGBUFFER_DROP_OLDEST);
+			break;
+
+		case PTX_OVERFLOW_DROP_NEWEST:
+			ret = ringbuffer_set_overflow_policy(chrdev->ringbuf,
+							     RINGBUFFER_DROP_NEWEST);
+			break;
+
+		case PTX_OVERFLOW_BLOCK:
+			/* the writer can't wait, so the new data is dropped */
+			ret = ringbuffer_set_overflow_policy(chrdev->ringbuf,
+							     RINGBUFFER_DROP_WRITE);
+			break;
+
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		break;
+
+	case PTX_GET_CNR:
+	{
+		u32 cn = 0;
+
+		if (chrdev->ops && chrdev->ops->read_cnr_raw)
+			ret = chrdev->ops->read_cnr_raw(chrdev, &cn);
+		else
+			ret = -ENOSYS;
+
+		if (ret)
+			break;
+
+		if (copy_to_user((void *)arg, &cn, sizeof(cn)))
+			ret = -EFAULT;
+
+		break;
+	}
+
+	case PTX_ENABLE_LNB_POWER:
+		if (chrdev->ops && chrdev->ops->set_lnb_voltage) {
+			int voltage;
+
+			switch (arg) {
+			case 0:
+				voltage = 0;
+				break;
+
+			case 1:
+				voltage = 11;
+				break;
+
+			case 2:
+				voltage = 15;
+				break;
+
+			default:
+				ret = -EINVAL;
+				break;
+			}
+
+			if (ret)
+				break;
+
+			ret = chrdev->ops->set_lnb_voltage(chrdev, voltage);
+		} else if (arg) {
+			ret = -ENOSYS;
+		}
+
+		break;
+
+	case PTX_DISABLE_LNB_POWER:
+		if (chrdev->ops && chrdev->ops->set_lnb_voltage)
+			ret = chrdev->ops->set_lnb_voltage(chrdev, 0);
+
+		break;
+
+	case PTX_SET_SYSTEM_MODE:
+	{
+		enum ptx_system_type mode = (enum ptx_system_type)arg;
+
+		switch (mode) {
+		case PTX_UNSPECIFIED_SYSTEM:
+		case PTX_ISDB_T_SYSTEM:
+		case PTX_ISDB_S_SYSTEM:
+			if (chrdev->system_cap & mode)
+				chrdev->params.system = mode;
+			else
+				ret = -EINVAL;
+			break;
+
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		break;
+	}
+
+	case PTX_SET_TUNE_PRIORITY:
+		if (arg > PTX_TUNE_PRIORITY_HIGH) {
+			ret = -EINVAL;
+			break;
+		}
+
+		reader->tune_priority = arg;
+		break;
+
+	case PTX_SET_EPG_MODE:
+		if (arg)
+			ret = ptx_chrdev_set_reader_pid_filter(reader,
+							       ptx_chrdev_epg_pids,
+							       ARRAY_SIZE(ptx_chrdev_epg_pids));
+		else
+			ret = ptx_chrdev_set_reader_pid_filter(reader, NULL, 0);
+		break;
+
+	case PTXT_SET_PID_FILTER:
+	{
+		struct ptxt_pid_filter filter;
+
+		if (copy_from_user(&filter, (void *)arg, sizeof(filter))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (filter.num > PTXT_PID_FILTER_MAX) {
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = ptx_chrdev_set_reader_pid_filter(reader, filter.pid,
+						       filter.num);
+		break;
+	}
+
+	default:
+		ret = -ENOSYS;
+		break;
+	}
+
+	mutex_unlock(&chrdev->lock);
+	return ret;
+}
+
+#define PTX_CHRDEV_STATS_ATTR(_name, _expr)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);		\
+									\
+	return sprintf(buf, "%llu\n", (unsigned long long)(_expr));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+#define PTX_CHRDEV_BUS_STATS_ATTR(_name, _field)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);		\
+	const struct itedtv_bus_stats *stats = chrdev->parent->bus_stats; \
+									\
+	return sprintf(buf, "%llu\n",					\
+		       (stats) ? (unsigned long long)READ_ONCE(stats->_field) : 0ULL); \
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PTX_CHRDEV_STATS_ATTR(delivered_bytes,
+		      READ_ONCE(chrdev->stats.delivered_bytes));
+PTX_CHRDEV_STATS_ATTR(overflow_packets,
+		      (READ_ONCE(chrdev->stats.overflow_bytes) +
+		       READ_ONCE(chrdev->ringbuf->dropped)) / 188);
+PTX_CHRDEV_STATS_ATTR(resyncs, READ_ONCE(chrdev->stats.resyncs));
+PTX_CHRDEV_STATS_ATTR(tei_errors, READ_ONCE(chrdev->stats.tei_errors));
+PTX_CHRDEV_STATS_ATTR(cc_errors, READ_ONCE(chrdev->stats.cc_errors));
+PTX_CHRDEV_STATS_ATTR(cc_lost_packets,
+		      READ_ONCE(chrdev->stats.cc_lost_packets));
+PTX_CHRDEV_STATS_ATTR(peak_fill, READ_ONCE(chrdev->ringbuf->peak_size));
+PTX_CHRDEV_BUS_STATS_ATTR(urb_completed, urb_completed);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_submit_errors, urb_submit_errors);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_resubmitted, urb_resubmitted);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_halt_clears, urb_halt_clears);
+PTX_CHRDEV_BUS_STATS_ATTR(stream_restarts, stream_restarts);
+PTX_CHRDEV_BUS_STATS_ATTR(rx_bytes, rx_bytes);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_eproto,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_EPROTO]);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_eilseq,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_EILSEQ]);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_epipe,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_EPIPE]);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_eoverflow,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_EOVERFLOW]);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_timeout,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_TIMEOUT]);
+PTX_CHRDEV_BUS_STATS_ATTR(urb_errors_other,
+			  urb_errors[ITEDTV_BUS_URB_ERROR_OTHER]);
+
+/* the buckets as in latency_hist.h: < 1 usec, then < 2^n usecs */
+static ssize_t wakeup_latency_hist_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return latency_hist_show(&chrdev->wakeup_latency, buf);
+}
+
+static DEVICE_ATTR_RO(wakeup_latency_hist);
+
+static ssize_t urb_interval_hist_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	const struct itedtv_bus_stats *stats = chrdev->parent->bus_stats;
+	struct latency_hist none = { { 0 } };
+
+	return latency_hist_show((stats) ? &stats->urb_interval : &none, buf);
+}
+
+static DEVICE_ATTR_RO(urb_interval_hist);
+
+static struct attribute *ptx_chrdev_stats_attrs[] = {
+	&dev_attr_delivered_bytes.attr,
+	&dev_attr_overflow_packets.attr,
+	&dev_attr_resyncs.attr,
+	&dev_attr_tei_errors.attr,
+	&dev_attr_cc_errors.attr,
+	&dev_attr_cc_lost_packets.attr,
+	&dev_attr_peak_fill.attr,
+	&dev_attr_urb_completed.attr,
+	&dev_attr_urb_submit_errors.attr,
+	&dev_attr_urb_resubmitted.attr,
+	&dev_attr_urb_halt_clears.attr,
+	&dev_attr_stream_restarts.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_urb_errors_eproto.attr,
+	&dev_attr_urb_errors_eilseq.attr,
+	&dev_attr_urb_errors_epipe.attr,
+	&dev_attr_urb_errors_eoverflow.attr,
+	&dev_attr_urb_errors_timeout.attr,
+	&dev_attr_urb_errors_other.attr,
+	&dev_attr_wakeup_latency_hist.attr,
+	&dev_attr_urb_interval_hist.attr,
+	NULL
+};
+
+/* /sys/class/<devname>/<devname>N/statistics/ */
+static const struct attribute_group ptx_chrdev_stats_group = {
+	.name = "statistics",
+	.attrs = ptx_chrdev_stats_attrs,
+};
+
+static ssize_t tsdev_max_packets_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", chrdev->ringbuf->size / 188);
+}
+
+static ssize_t tsdev_max_packets_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	unsigned int val;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > (INT_MAX / 188))
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+
+	/* the ringbuffer can only be replaced while nobody has it open */
+	if (atomic_read(&chrdev->open)) {
+		ret = -EBUSY;
+		goto exit;
+	}
+
+	/* allocated on the next open, for every system */
+	ret = ringbuffer_set_size(chrdev->ringbuf, 188 * val);
+	if (ret) {
+		dev_err(dev,
+			"tsdev_max_packets_store %u: ringbuffer_set_size(%u) failed. (ret: %d)\n",
+			chrdev->id, 188 * val, ret);
+		goto exit;
+	}
+
+	chrdev->ringbuf_fixed_size = 188 * val;
+	chrdev->ringbuf_time_t = 0;
+	chrdev->ringbuf_time_s = 0;
+
+exit:
+	mutex_unlock(&chrdev->lock);
+	return (ret) ? ret : count;
+}
+
+static DEVICE_ATTR_RW(tsdev_max_packets);
+
+static ssize_t tsdev_max_readers_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", chrdev->max_readers);
+}
+
+static ssize_t tsdev_max_readers_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	unsigned int val;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > RINGBUFFER_MAX_READERS)
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+
+	if (atomic_read(&chrdev->open))
+		ret = -EBUSY;
+	else
+		chrdev->max_readers = val;
+
+	mutex_unlock(&chrdev->lock);
+	return (ret) ? ret : count;
+}
+
+static DEVICE_ATTR_RW(tsdev_max_readers);
+
+static ssize_t stats_cache_time_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(chrdev->stats_cache_time));
+}
+
+static ssize_t stats_cache_time_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	unsigned int val;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(chrdev->stats_cache_time, val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(stats_cache_time);
+
+static ssize_t cc_check_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(chrdev->cc_check) ? 1 : 0);
+}
+
+static ssize_t cc_check_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	bool val;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&chrdev->lock);
+
+	/* start over, the counters seen before are stale */
+	if (val && !chrdev->cc_check)
+		WRITE_ONCE(chrdev->cc_seq, chrdev->cc_seq + 1);
+
+	WRITE_ONCE(chrdev->cc_check, val);
+
+	mutex_unlock(&chrdev->lock);
+	return count;
+}
+
+static DEVICE_ATTR_RW(cc_check);
+
+static ssize_t pid_stats_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(chrdev->pid_stats) ? 1 : 0);
+}
+
+static ssize_t pid_stats_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	int ret = 0;
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	bool val;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&chrdev->lock);
+
+	if (val && !chrdev->pid_stats) {
+		/* the producer may still be counting, the table stays */
+		if (!chrdev->pid_packets) {
+			u64 *table = kvzalloc(sizeof(*table) * PTX_PID_STATS_NUM * 2,
+					      GFP_KERNEL);
+
+			if (!table) {
+				ret = -ENOMEM;
+				goto exit;
+			}
+
+			chrdev->pid_packets_base = table + PTX_PID_STATS_NUM;
+			/* the producer sees the table zeroed */
+			smp_store_release(&chrdev->pid_packets, table);
+		}
+
+		/* start over */
+		ptx_chrdev_read_pid_stats(chrdev, NULL, true);
+		smp_wmb();
+	}
+
+	WRITE_ONCE(chrdev->pid_stats, val);
+
+exit:
+	mutex_unlock(&chrdev->lock);
+	return (ret) ? ret : count;
+}
+
+static DEVICE_ATTR_RW(pid_stats);
+
+static ssize_t tune_queue_position_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ptx_chrdev_tune_queue_position(chrdev));
+}
+
+static DEVICE_ATTR_RO(tune_queue_position);
+
+/* msecs until the tuner has been programmed, estimated */
+static ssize_t tune_queue_eta_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n",
+		       ptx_chrdev_tune_queue_position(chrdev) *
+		       READ_ONCE(chrdev->parent->tune_time_avg));
+}
+
+static DEVICE_ATTR_RO(tune_queue_eta);
+
+static struct attribute *ptx_chrdev_attrs[] = {
+	&dev_attr_tsdev_max_packets.attr,
+	&dev_attr_tsdev_max_readers.attr,
+	&dev_attr_stats_cache_time.attr,
+	&dev_attr_cc_check.attr,
+	&dev_attr_pid_stats.attr,
+	&dev_attr_tune_queue_position.attr,
+	&dev_attr_tune_queue_eta.attr,
+	NULL
+};
+
+static const struct attribute_group ptx_chrdev_group = {
+	.attrs = ptx_chrdev_attrs,
+};
+
+/*
+ * The stats last read by the user of the tuner, so that a monitor can watch
+ * them while the tuner is open, without any access to the device.
+ */
+static ssize_t ptx_chrdev_signal_show(struct device *dev, u32 m, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	struct ptx_chrdev_stat_values v;
+	u64 timestamp;
+
+	spin_lock(&chrdev->stat_snapshot_lock);
+	v = chrdev->stat_snapshot;
+	timestamp = chrdev->stat_snapshot_timestamp;
+	spin_unlock(&chrdev->stat_snapshot_lock);
+
+	if (!m) {
+		if (!v.valid)
+			return -ENODATA;
+
+		/* msecs since the stats were read */
+		return sprintf(buf, "%llu\n",
+			       div_u64(ktime_get_ns() - timestamp, NSEC_PER_MSEC));
+	}
+
+	if (!(v.valid & m))
+		return -ENODATA;
+
+	switch (m) {
+	case PTX_CHRDEV_STAT_SIGNAL_STRENGTH:
+		return sprintf(buf, "%u\n", v.signal_strength);
+
+	case PTX_CHRDEV_STAT_CNR:
+		return sprintf(buf, "%u\n", v.cnr);
+
+	case PTX_CHRDEV_STAT_CNR_RAW:
+		return sprintf(buf, "%u\n", v.cnr_raw);
+
+	case PTX_CHRDEV_STAT_LOCK:
+		return sprintf(buf, "%d\n", (v.locked) ? 1 : 0);
+
+	case PTX_CHRDEV_STAT_TSID:
+		return sprintf(buf, "0x%04x\n", v.tsid);
+	}
+
+	return -ENODATA;
+}
+
+#define PTX_CHRDEV_SIGNAL_ATTR(_name, _mask)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return ptx_chrdev_signal_show(dev, _mask, buf);			\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PTX_CHRDEV_SIGNAL_ATTR(signal_strength, PTX_CHRDEV_STAT_SIGNAL_STRENGTH);
+PTX_CHRDEV_SIGNAL_ATTR(cnr, PTX_CHRDEV_STAT_CNR);
+PTX_CHRDEV_SIGNAL_ATTR(cnr_raw, PTX_CHRDEV_STAT_CNR_RAW);
+PTX_CHRDEV_SIGNAL_ATTR(locked, PTX_CHRDEV_STAT_LOCK);
+PTX_CHRDEV_SIGNAL_ATTR(tsid, PTX_CHRDEV_STAT_TSID);
+PTX_CHRDEV_SIGNAL_ATTR(age, 0);
+
+static struct attribute *ptx_chrdev_signal_attrs[] = {
+	&dev_attr_signal_strength.attr,
+	&dev_attr_cnr.attr,
+	&dev_attr_cnr_raw.attr,
+	&dev_attr_locked.attr,
+	&dev_attr_tsid.attr,
+	&dev_attr_age.attr,
+	NULL
+};
+
+/* /sys/class/<devname>/<devname>N/signal/ */
+static const struct attribute_group ptx_chrdev_signal_group = {
+	.name = "signal",
+	.attrs = ptx_chrdev_signal_attrs,
+};
+
+/* usecs into the last tune (the open for the open phase) each phase was reached */
+static ssize_t ptx_chrdev_tune_timing_show(struct device *dev,
+					   enum ptx_chrdev_tune_phase phase,
+					   char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	u32 us = READ_ONCE(chrdev->tune_phase_us[phase]);
+
+	if (!us)
+		return -ENODATA;
+
+	return sprintf(buf, "%u\n", us);
+}
+
+#define PTX_CHRDEV_TUNE_TIMING_ATTR(_name, _phase)			\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return ptx_chrdev_tune_timing_show(dev, _phase, buf);		\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PTX_CHRDEV_TUNE_TIMING_ATTR(open, PTX_CHRDEV_TUNE_PHASE_OPEN);
+PTX_CHRDEV_TUNE_TIMING_ATTR(queue, PTX_CHRDEV_TUNE_PHASE_QUEUE);
+PTX_CHRDEV_TUNE_TIMING_ATTR(pll, PTX_CHRDEV_TUNE_PHASE_PLL);
+PTX_CHRDEV_TUNE_TIMING_ATTR(program, PTX_CHRDEV_TUNE_PHASE_PROGRAM);
+PTX_CHRDEV_TUNE_TIMING_ATTR(lock, PTX_CHRDEV_TUNE_PHASE_LOCK);
+PTX_CHRDEV_TUNE_TIMING_ATTR(stream_id, PTX_CHRDEV_TUNE_PHASE_STREAM_ID);
+PTX_CHRDEV_TUNE_TIMING_ATTR(first_packet, PTX_CHRDEV_TUNE_PHASE_FIRST_PACKET);
+
+static struct attribute *ptx_chrdev_tune_timing_attrs[] = {
+	&dev_attr_open.attr,
+	&dev_attr_queue.attr,
+	&dev_attr_pll.attr,
+	&dev_attr_program.attr,
+	&dev_attr_lock.attr,
+	&dev_attr_stream_id.attr,
+	&dev_attr_first_packet.attr,
+	NULL
+};
+
+/* /sys/class/<devname>/<devname>N/tune_timing/ */
+static const struct attribute_group ptx_chrdev_tune_timing_group = {
+	.name = "tune_timing",
+	.attrs = ptx_chrdev_tune_timing_attrs,
+};
+
+static ssize_t path_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	const struct itedtv_bus *bus = chrdev->parent->bus;
+
+	return sprintf(buf, "%s\n", (bus) ? itedtv_bus_path(bus) : "");
+}
+
+static DEVICE_ATTR_RO(path);
+
+static ssize_t number_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", chrdev->parent->bus_number);
+}
+
+static DEVICE_ATTR_RO(number);
+
+static ssize_t speed_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	const struct itedtv_bus *bus = chrdev->parent->bus;
+
+	return sprintf(buf, "%u\n", (bus) ? itedtv_bus_speed(bus) : 0);
+}
+
+static DEVICE_ATTR_RO(speed);
+
+static ssize_t bandwidth_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+	const struct itedtv_bus_stats *stats = chrdev->parent->bus_stats;
+
+	return sprintf(buf, "%u\n", (stats) ? itedtv_bus_rx_rate(stats) : 0);
+}
+
+static DEVICE_ATTR_RO(bandwidth);
+
+static ssize_t numa_node_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct ptx_chrdev *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", chrdev->parent->node);
+}
+
+static DEVICE_ATTR_RO(numa_node);
+
+static struct attribute *ptx_chrdev_bus_attrs[] = {
+	&dev_attr_path.attr,
+	&dev_attr_number.attr,
+	&dev_attr_speed.attr,
+	&dev_attr_bandwidth.attr,
+	&dev_attr_numa_node.attr,
+	NULL
+};
+
+/* /sys/class/<devname>/<devname>N/bus/, shared by the tuners of the device */
+static const struct attribute_group ptx_chrdev_bus_group = {
+	.name = "bus",
+	.attrs = ptx_chrdev_bus_attrs,
+};
+
+static const struct attribute_group *ptx_chrdev_attr_groups[] = {
+	&ptx_chrdev_group,
+	&ptx_chrdev_stats_group,
+	&ptx_chrdev_signal_group,
+	&ptx_chrdev_tune_timing_group,
+	&ptx_chrdev_bus_group,
+	NULL
+};
+
+static struct file_operations ptx_chrdev_fops = {
+	.owner = THIS_MODULE,
+	.open = ptx_chrdev_open,
+	.read = ptx_chrdev_read,
+	.splice_read = ptx_chrdev_splice_read,
+	.poll = ptx_chrdev_poll,
+	.release = ptx_chrdev_release,
+	.unlocked_ioctl = ptx_chrdev_unlocked_ioctl,
+	.mmap = ptx_chrdev_mmap
+};
+
+/*
+ * Pool node: PTX_ALLOC_TUNER picks a free tuner of the context and opens it
+ * on behalf of the caller.
+ */
+
+struct ptx_chrdev_pool_score {
+	unsigned int bus_load;		// open tuners on the same USB bus
+	bool powered;			// the device has an open tuner
+	unsigned int load;		// open tuners on the device
+};
+
+static unsigned int ptx_chrdev_group_load(struct ptx_chrdev_group *group)
+{
+	unsigned int i, load = 0;
+
+	for (i = 0; i < group->chrdev_num; i++) {
+		if (atomic_read(&group->chrdev[i].open))
+			load++;
+	}
+
+	return load;
+}
+
+/* must be called with ctx->lock held */
+static void ptx_chrdev_pool_get_score(struct ptx_chrdev_context *ctx,
+				      struct ptx_chrdev_group *group,
+				      struct ptx_chrdev_pool_score *score)
+{
+	struct ptx_chrdev_group *g;
+
+	score->load = ptx_chrdev_group_load(group);
+	score->powered = !!score->load;
+	score->bus_load = score->load;
+
+	if (!group->bus_number)
+		return;
+
+	list_for_each_entry(g, &ctx->group_list, list) {
+		if (g != group && g->bus_number == group->bus_number &&
+		    atomic_read(&g->available))
+			score->bus_load += ptx_chrdev_group_load(g);
+	}
+}
+
+static bool ptx_chrdev_pool_is_better(const struct ptx_chrdev_pool_score *a,
+				      const struct ptx_chrdev_pool_score *b)
+{
+	if (a->bus_load != b->bus_load)
+		return a->bus_load < b->bus_load;
+
+	/* avoid the power-up latency */
+	if (a->powered != b->powered)
+		return a->powered;
+
+	return a->load < b->load;
+}
+
+/* must be called with ctx->lock held */
+static struct ptx_chrdev *ptx_chrdev_pool_select(struct ptx_chrdev_context *ctx,
+						 enum ptx_system_type system,
+						 bool *capable)
+{
+	struct ptx_chrdev_group *group;
+	struct ptx_chrdev *best = NULL;
+	struct ptx_chrdev_pool_score best_score = { 0 };
+
+	*capable = false;
+
+	list_for_each_entry(group, &ctx->group_list, list) {
+		struct ptx_chrdev_pool_score score;
+		unsigned int i;
+
+		if (!atomic_read(&group->available))
+			continue;
+
+		ptx_chrdev_pool_get_score(ctx, group, &score);
+
+		for (i = 0; i < group->chrdev_num; i++) {
+			struct ptx_chrdev *chrdev = &group->chrdev[i];
+
+			if (!(chrdev->system_cap & system))
+				continue;
+
+			*capable = true;
+
+			if (atomic_read(&chrdev->open))
+				continue;
+
+			/* the first free tuner of the device is enough */
+			if (!best || ptx_chrdev_pool_is_better(&score, &best_score)) {
+				best = chrdev;
+				best_score = score;
+			}
+
+			break;
+		}
+	}
+
+	return best;
+}
+
+static int ptx_chrdev_pool_alloc(struct ptx_chrdev_context *ctx,
+				 enum ptx_system_type system,
+				 struct ptx_chrdev_reader **reader,
+				 unsigned int *minor)
+{
+	int ret = 0, retry = 4;
+	struct ptx_chrdev_group *group;
+	struct ptx_chrdev *chrdev;
+	struct kref *owner_kref;
+	void (*owner_kref_release)(struct kref *);
+	bool capable;
+
+	if (system != PTX_ISDB_T_SYSTEM && system != PTX_ISDB_S_SYSTEM)
+		return -EINVAL;
+
+again:
+	mutex_lock(&ctx->lock);
+
+	chrdev = ptx_chrdev_pool_select(ctx, system, &capable);
+	if (!chrdev) {
+		mutex_unlock(&ctx->lock);
+		return (capable) ? -EBUSY : -ENOENT;
+	}
+
+	group = chrdev->parent;
+	owner_kref = group->owner_kref;
+	owner_kref_release = group->owner_kref_release;
+
+	/* the same references as ptx_chrdev_open() takes */
+	kref_get(&ctx->kref);
+
+	if (owner_kref)
+		kref_get(owner_kref);
+
+	kref_get(&group->kref);
+	mutex_lock(&group->lock);
+	mutex_unlock(&ctx->lock);
+
+	if (!atomic_read(&group->available)) {
+		mutex_unlock(&group->lock);
+		ret = -ENOENT;
+		goto fail;
+	}
+
+	mutex_lock(&chrdev->lock);
+	mutex_unlock(&group->lock);
+
+	/* opened by someone else in the meantime */
+	if (atomic_read(&chrdev->open))
+		ret = -EALREADY;
+	else
+		ret = ptx_chrdev_attach_reader(chrdev, reader);
+
+	mutex_unlock(&chrdev->lock);
+
+	if (ret)
+		goto fail;
+
+	*minor = group->minor_base - MINOR(ctx->dev_base) +
+		 (chrdev - group->chrdev);
+
+	return 0;
+
+fail:
+	kref_put(&group->kref, ptx_chrdev_group_release);
+
+	if (owner_kref)
+		kref_put(owner_kref, owner_kref_release);
+
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+
+	if ((ret == -EALREADY || ret == -ENOENT) && retry--)
+		goto again;
+
+	return ret;
+}
+
+static int ptx_chrdev_pool_open(struct inode *inode, struct file *file)
+{
+	struct ptx_chrdev_context *ctx;
+
+	mutex_lock(&ctx_list_lock);
+
+	if (!ptx_chrdev_search_context(imajor(inode), &ctx)) {
+		mutex_unlock(&ctx_list_lock);
+		return -ENOENT;
+	}
+
+	kref_get(&ctx->kref);
+	mutex_unlock(&ctx_list_lock);
+
+	file->private_data = ctx;
+
+	return 0;
+}
+
+static int ptx_chrdev_pool_release(struct inode *inode, struct file *file)
+{
+	struct ptx_chrdev_context *ctx = file->private_data;
+
+	kref_put(&ctx->kref, ptx_chrdev_context_release);
+	return 0;
+}
+
+static long ptx_chrdev_pool_unlocked_ioctl(struct file *file,
+					   unsigned int cmd, unsigned long arg)
+{
+	int ret = 0, fd;
+	struct ptx_chrdev_context *ctx = file->private_data;
+	struct ptx_alloc_tuner alloc;
+	struct ptx_chrdev_reader *reader;
+	struct file *f;
+
+	if (cmd != PTX_ALLOC_TUNER)
+		return -ENOSYS;
+
+	if (copy_from_user(&alloc, (void __user *)arg, sizeof(alloc)))
+		return -EFAULT;
+
+	fd = get_unused_fd_flags(O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+
+	ret = ptx_chrdev_pool_alloc(ctx, alloc.system, &reader, &alloc.minor);
+	if (ret)
+		goto fail_fd;
+
+	f = anon_inode_getfile("[ptx_chrdev]", &ptx_chrdev_fops, reader,
+			       O_RDONLY);
+	if (IS_ERR(f)) {
+		ret = PTR_ERR(f);
+		ptx_chrdev_put_reader(reader);
+		goto fail_fd;
+	}
+
+	alloc.fd = fd;
+
+	if (copy_to_user((void __user *)arg, &alloc, sizeof(alloc))) {
+		/* fput() releases the tuner */
+		fput(f);
+		ret = -EFAULT;
+		goto fail_fd;
+	}
+
+	fd_install(fd, f);
+
+	return 0;
+
+fail_fd:
+	put_unused_fd(fd);
+	return ret;
+}
+
+static struct file_operations ptx_chrdev_pool_fops = {
+	.owner = THIS_MODULE,
+	.open = ptx_chrdev_pool_open,
+	.release = ptx_chrdev_pool_release,
+	.unlocked_ioctl = ptx_chrdev_pool_unlocked_ioctl
+};
+
+/*
+ * metrics: every tuner of the module in one file, in the text format of
+ * Prometheus. The values are copied under the locks of the contexts first,
+ * so that a read sees all the tuners of a device at a single point.
+ */
+
+enum ptx_chrdev_metric {
+	PTX_CHRDEV_METRIC_OPEN = 0,
+	PTX_CHRDEV_METRIC_STREAMING,
+	PTX_CHRDEV_METRIC_TUNING,
+	PTX_CHRDEV_METRIC_DELIVERED_BYTES,
+	PTX_CHRDEV_METRIC_OVERFLOW_PACKETS,
+	PTX_CHRDEV_METRIC_RESYNCS,
+	PTX_CHRDEV_METRIC_TEI_ERRORS,
+	PTX_CHRDEV_METRIC_CC_ERRORS,
+	PTX_CHRDEV_METRIC_CC_LOST_PACKETS,
+	PTX_CHRDEV_METRIC_RINGBUF_SIZE,
+	PTX_CHRDEV_METRIC_PEAK_FILL,
+	PTX_CHRDEV_METRIC_SIGNAL_LOCKED,
+	PTX_CHRDEV_METRIC_SIGNAL_STRENGTH,
+	PTX_CHRDEV_METRIC_CNR,
+	PTX_CHRDEV_METRIC_CNR_RAW,
+	PTX_CHRDEV_METRIC_SIGNAL_AGE,
+	/* of the bus, once per group */
+	PTX_CHRDEV_METRIC_RX_BYTES,
+	PTX_CHRDEV_METRIC_BANDWIDTH,
+	PTX_CHRDEV_METRIC_URB_COMPLETED,
+	PTX_CHRDEV_METRIC_URB_SUBMIT_ERRORS,
+	PTX_CHRDEV_METRIC_URB_RESUBMITTED,
+	PTX_CHRDEV_METRIC_URB_HALT_CLEARS,
+	PTX_CHRDEV_METRIC_STREAM_RESTARTS,
+	PTX_CHRDEV_METRIC_URB_ERRORS_EPROTO,
+	PTX_CHRDEV_METRIC_URB_ERRORS_EILSEQ,
+	PTX_CHRDEV_METRIC_URB_ERRORS_EPIPE,
+	PTX_CHRDEV_METRIC_URB_ERRORS_EOVERFLOW,
+	PTX_CHRDEV_METRIC_URB_ERRORS_TIMEOUT,
+	PTX_CHRDEV_METRIC_URB_ERRORS_OTHER,
+	PTX_CHRDEV_METRIC_NUM
+};
+
+#define PTX_CHRDEV_METRIC_BUS_FIRST	PTX_CHRDEV_METRIC_RX_BYTES
+
+struct ptx_chrdev_metric_desc {
+	const char *name;
+	const char *help;
+	bool counter;
+};
+
+static const struct ptx_chrdev_metric_desc ptx_chrdev_metric_desc[PTX_CHRDEV_METRIC_NUM] = {
+	[PTX_CHRDEV_METRIC_OPEN] = { "open", "Readers of the tuner", false },
+	[PTX_CHRDEV_METRIC_STREAMING] = { "streaming", "Capture of the tuner is running", false },
+	[PTX_CHRDEV_METRIC_TUNING] = { "tuning", "A tune is waiting for the lock", false },
+	[PTX_CHRDEV_METRIC_DELIVERED_BYTES] = { "delivered_bytes", "Bytes written to the ring buffer", true },
+	[PTX_CHRDEV_METRIC_OVERFLOW_PACKETS] = { "overflow_packets", "Packets lost to full readers", true },
+	[PTX_CHRDEV_METRIC_RESYNCS] = { "resyncs", "Losses of the packet sync", true },
+	[PTX_CHRDEV_METRIC_TEI_ERRORS] = { "tei_errors", "Packets with the transport error indicator", true },
+	[PTX_CHRDEV_METRIC_CC_ERRORS] = { "cc_errors", "Continuity counter discontinuities", true },
+	[PTX_CHRDEV_METRIC_CC_LOST_PACKETS] = { "cc_lost_packets", "Packets lost, estimated from the continuity counters", true },
+	[PTX_CHRDEV_METRIC_RINGBUF_SIZE] = { "ringbuf_size_bytes", "Size of the ring buffer", false },
+	[PTX_CHRDEV_METRIC_PEAK_FILL] = { "peak_fill_bytes", "Highest fill level of the ring buffer", false },
+	[PTX_CHRDEV_METRIC_SIGNAL_LOCKED] = { "signal_locked", "Demodulator locked, as last read", false },
+	[PTX_CHRDEV_METRIC_SIGNAL_STRENGTH] = { "signal_strength", "Signal strength, as last read", false },
+	[PTX_CHRDEV_METRIC_CNR] = { "cnr", "C/N, as last read", false },
+	[PTX_CHRDEV_METRIC_CNR_RAW] = { "cnr_raw", "Raw C/N of the demodulator, as last read", false },
+	[PTX_CHRDEV_METRIC_SIGNAL_AGE] = { "signal_age_ms", "Milliseconds since the signal was read", false },
+	[PTX_CHRDEV_METRIC_RX_BYTES] = { "bus_rx_bytes", "Bytes received from the bulk endpoint", true },
+	[PTX_CHRDEV_METRIC_BANDWIDTH] = { "bus_bandwidth_bytes", "Bulk bandwidth used by streaming, per second", false },
+	[PTX_CHRDEV_METRIC_URB_COMPLETED] = { "bus_urb_completed", "URBs completed", true },
+	[PTX_CHRDEV_METRIC_URB_SUBMIT_ERRORS] = { "bus_urb_submit_errors", "URBs which could not be submitted", true },
+	[PTX_CHRDEV_METRIC_URB_RESUBMITTED] = { "bus_urb_resubmitted", "URBs submitted again after an error", true },
+	[PTX_CHRDEV_METRIC_URB_HALT_CLEARS] = { "bus_urb_halt_clears", "Halts of the endpoint cleared", true },
+	[PTX_CHRDEV_METRIC_STREAM_RESTARTS] = { "bus_stream_restarts", "Restarts of the stream", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_EPROTO] = { "bus_urb_errors_eproto", "URBs completed with -EPROTO", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_EILSEQ] = { "bus_urb_errors_eilseq", "URBs completed with -EILSEQ", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_EPIPE] = { "bus_urb_errors_epipe", "URBs completed with -EPIPE", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_EOVERFLOW] = { "bus_urb_errors_eoverflow", "URBs completed with -EOVERFLOW", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_TIMEOUT] = { "bus_urb_errors_timeout", "URBs completed with a timeout", true },
+	[PTX_CHRDEV_METRIC_URB_ERRORS_OTHER] = { "bus_urb_errors_other", "URBs completed with another error", true },
+};
+
+struct ptx_chrdev_metric_sample {
+	bool bus;
+	char tuner[72];		// as PTXT_GET_INFO, empty for the bus
+	char device[48];	// of the group
+	int bus_number;
+	u64 valid;		// BIT_ULL(PTX_CHRDEV_METRIC_*)
+	u64 v[PTX_CHRDEV_METRIC_NUM];
+};
+
+static void ptx_chrdev_metrics_sample_tuner(struct ptx_chrdev_context *ctx,
+					    struct ptx_chrdev_group *group,
+					    struct ptx_chrdev *chrdev,
+					    struct ptx_chrdev_metric_sample *s,
+					    u64 now)
+{
+	struct ringbuffer *ringbuf = chrdev->ringbuf;
+	struct ptx_chrdev_stat_values v;
+	u64 timestamp;
+
+	snprintf(s->tuner, sizeof(s->tuner), "%s%u", ctx->devname,
+		 group->minor_base - MINOR(ctx->dev_base) + chrdev->id);
+
+	s->v[PTX_CHRDEV_METRIC_OPEN] = atomic_read(&chrdev->open);
+	s->v[PTX_CHRDEV_METRIC_STREAMING] = (READ_ONCE(chrdev->streaming)) ? 1 : 0;
+	s->v[PTX_CHRDEV_METRIC_TUNING] = (READ_ONCE(chrdev->tune_state) != PTX_CHRDEV_TUNE_IDLE) ? 1 : 0;
+	s->v[PTX_CHRDEV_METRIC_DELIVERED_BYTES] = READ_ONCE(chrdev->stats.delivered_bytes);
+	s->v[PTX_CHRDEV_METRIC_OVERFLOW_PACKETS] = (READ_ONCE(chrdev->stats.overflow_bytes) +
+						    READ_ONCE(ringbuf->dropped)) / 188;
+	s->v[PTX_CHRDEV_METRIC_RESYNCS] = READ_ONCE(chrdev->stats.resyncs);
+	s->v[PTX_CHRDEV_METRIC_TEI_ERRORS] = READ_ONCE(chrdev->stats.tei_errors);
+	s->v[PTX_CHRDEV_METRIC_CC_ERRORS] = READ_ONCE(chrdev->stats.cc_errors);
+	s->v[PTX_CHRDEV_METRIC_CC_LOST_PACKETS] = READ_ONCE(chrdev->stats.cc_lost_packets);
+	s->v[PTX_CHRDEV_METRIC_RINGBUF_SIZE] = READ_ONCE(ringbuf->size);
+	s->v[PTX_CHRDEV_METRIC_PEAK_FILL] = READ_ONCE(ringbuf->peak_size);
+	s->valid = GENMASK_ULL(PTX_CHRDEV_METRIC_PEAK_FILL, 0);
+
+	spin_lock(&chrdev->stat_snapshot_lock);
+	v = chrdev->stat_snapshot;
+	timestamp = chrdev->stat_snapshot_timestamp;
+	spin_unlock(&chrdev->stat_snapshot_lock);
+
+	if (!v.valid)
+		return;
+
+	if (v.valid & PTX_CHRDEV_STAT_LOCK) {
+		s->v[PTX_CHRDEV_METRIC_SIGNAL_LOCKED] = (v.locked) ? 1 : 0;
+		s->valid |= BIT_ULL(PTX_CHRDEV_METRIC_SIGNAL_LOCKED);
+	}
+
+	if (v.valid & PTX_CHRDEV_STAT_SIGNAL_STRENGTH) {
+		s->v[PTX_CHRDEV_METRIC_SIGNAL_STRENGTH] = v.signal_strength;
+		s->valid |= BIT_ULL(PTX_CHRDEV_METRIC_SIGNAL_STRENGTH);
+	}
+
+	if (v.valid & PTX_CHRDEV_STAT_CNR) {
+		s->v[PTX_CHRDEV_METRIC_CNR] = v.cnr;
+		s->valid |= BIT_ULL(PTX_CHRDEV_METRIC_CNR);
+	}
+
+	if (v.valid & PTX_CHRDEV_STAT_CNR_RAW) {
+		s->v[PTX_CHRDEV_METRIC_CNR_RAW] = v.cnr_raw;
+		s->valid |= BIT_ULL(PTX_CHRDEV_METRIC_CNR_RAW);
+	}
+
+	s->v[PTX_CHRDEV_METRIC_SIGNAL_AGE] = div_u64(now - timestamp,
+						     NSEC_PER_MSEC);
+	s->valid |= BIT_ULL(PTX_CHRDEV_METRIC_SIGNAL_AGE);
+}
+
+static void ptx_chrdev_metrics_sample_bus(struct ptx_chrdev_group *group,
+					  struct ptx_chrdev_metric_sample *s)
+{
+	const struct itedtv_bus_stats *stats = group->bus_stats;
+
+	s->bus = true;
+
+	if (!stats)
+		return;
+
+	s->v[PTX_CHRDEV_METRIC_RX_BYTES] = READ_ONCE(stats->rx_bytes);
+	s->v[PTX_CHRDEV_METRIC_BANDWIDTH] = itedtv_bus_rx_rate(stats);
+	s->v[PTX_CHRDEV_METRIC_URB_COMPLETED] = READ_ONCE(stats->urb_completed);
+	s->v[PTX_CHRDEV_METRIC_URB_SUBMIT_ERRORS] = READ_ONCE(stats->urb_submit_errors);
+	s->v[PTX_CHRDEV_METRIC_URB_RESUBMITTED] = READ_ONCE(stats->urb_resubmitted);
+	s->v[PTX_CHRDEV_METRIC_URB_HALT_CLEARS] = READ_ONCE(stats->urb_halt_clears);
+	s->v[PTX_CHRDEV_METRIC_STREAM_RESTARTS] = READ_ONCE(stats->stream_restarts);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_EPROTO] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_EPROTO]);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_EILSEQ] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_EILSEQ]);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_EPIPE] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_EPIPE]);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_EOVERFLOW] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_EOVERFLOW]);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_TIMEOUT] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_TIMEOUT]);
+	s->v[PTX_CHRDEV_METRIC_URB_ERRORS_OTHER] = READ_ONCE(stats->urb_errors[ITEDTV_BUS_URB_ERROR_OTHER]);
+	s->valid = GENMASK_ULL(PTX_CHRDEV_METRIC_NUM - 1,
+			       PTX_CHRDEV_METRIC_BUS_FIRST);
+}
+
+static int ptx_chrdev_metrics_collect(struct ptx_chrdev_metric_sample **samples,
+				      unsigned int *sample_num)
+{
+	int ret = 0;
+	struct ptx_chrdev_context *ctx;
+	struct ptx_chrdev_metric_sample *s = NULL;
+	unsigned int num = 0;
+	u64 now = ktime_get_ns();
+
+	BUILD_BUG_ON(PTX_CHRDEV_METRIC_NUM > 64);
+
+	mutex_lock(&ctx_list_lock);
+
+	list_for_each_entry(ctx, &ctx_list, list) {
+		struct ptx_chrdev_group *group;
+		struct ptx_chrdev_metric_sample *p;
+		unsigned int n = 0;
+
+		mutex_lock(&ctx->lock);
+
+		list_for_each_entry(group, &ctx->group_list, list)
+			n += 1 + group->chrdev_num;
+
+		if (!n) {
+			mutex_unlock(&ctx->lock);
+			continue;
+		}
+
+		p = krealloc(s, sizeof(*s) * (num + n), GFP_KERNEL);
+		if (!p) {
+			mutex_unlock(&ctx->lock);
+			ret = -ENOMEM;
+			break;
+		}
+
+		s = p;
+		memset(&s[num], 0, sizeof(*s) * n);
+
+		list_for_each_entry(group, &ctx->group_list, list) {
+			unsigned int i;
+
+			for (i = 0; i <= group->chrdev_num; i++) {
+				p = &s[num++];
+
+				strscpy(p->device, dev_name(group->dev),
+					sizeof(p->device));
+				p->bus_number = group->bus_number;
+
+				if (i == group->chrdev_num)
+					ptx_chrdev_metrics_sample_bus(group, p);
+				else
+					ptx_chrdev_metrics_sample_tuner(ctx,
+									group,
+									&group->chrdev[i],
+									p,
+									now);
+			}
+		}
+
+		mutex_unlock(&ctx->lock);
+	}
+
+	mutex_unlock(&ctx_list_lock);
+
+	if (ret) {
+		kfree(s);
+		return ret;
+	}
+
+	*samples = s;
+	*sample_num = num;
+
+	return 0;
+}
+
+int ptx_chrdev_metrics_show(struct seq_file *m)
+{
+	int ret = 0;
+	struct ptx_chrdev_metric_sample *s = NULL;
+	unsigned int num = 0, i, j;
 
-	case PTXT_SET_LNB_VOLTAGE:
-		break;
+	ret = ptx_chrdev_metrics_collect(&s, &num);
+	if (ret)
+		return ret;
 
-	case PTXT_SET_CAPTURE:
-		break;
+	for (i = 0; i < PTX_CHRDEV_METRIC_NUM; i++) {
+		const struct ptx_chrdev_metric_desc *desc = &ptx_chrdev_metric_desc[i];
 
-	case PTXT_READ_STATS:
-		break;
-#endif
+		seq_printf(m, "# HELP %s_%s %s\n",
+			   KBUILD_MODNAME, desc->name, desc->help);
+		seq_printf(m, "# TYPE %s_%s %s\n",
+			   KBUILD_MODNAME, desc->name,
+			   (desc->counter) ? "counter" : "gauge");
 
-	default:
-		ret = -ENOSYS;
-		break;
+		for (j = 0; j < num; j++) {
+			if (!(s[j].valid & BIT_ULL(i)))
+				continue;
+
+			if (s[j].bus)
+				seq_printf(m, "%s_%s{device=\"%s\",bus=\"%d\"} %llu\n",
+					   KBUILD_MODNAME, desc->name,
+					   s[j].device, s[j].bus_number,
+					   s[j].v[i]);
+			else
+				seq_printf(m, "%s_%s{tuner=\"%s\",device=\"%s\"} %llu\n",
+					   KBUILD_MODNAME, desc->name,
+					   s[j].tuner, s[j].device, s[j].v[i]);
+		}
 	}
 
-	mutex_unlock(&chrdev->lock);
-	return ret;
-}
+	kfree(s);
 
-static struct file_operations ptx_chrdev_fops = {
-	.owner = THIS_MODULE,
-	.open = ptx_chrdev_open,
-	.read = ptx_chrdev_read,
-	.release = ptx_chrdev_release,
-	.unlocked_ioctl = ptx_chrdev_unlocked_ioctl
-};
+	return 0;
+}
 
 static bool ptx_chrdev_search_context(unsigned int major,
 				      struct ptx_chrdev_context **chrdev_ctx)
@@ -587,7 +4631,8 @@ int ptx_chrdev_context_create(const char *name, const char *devname,
 		return PTR_ERR(ctx->class);
 	}
 
-	ret = alloc_chrdev_region(&ctx->dev_base, 0, total_num, name);
+	/* one more minor for the pool node */
+	ret = alloc_chrdev_region(&ctx->dev_base, 0, total_num + 1, name);
 	if (ret < 0) {
 		pr_err("ptx_chrdev_context_create: alloc_chrdev_region(\"%s\") failed.\n",
 		       name);
@@ -601,6 +4646,24 @@ int ptx_chrdev_context_create(const char *name, const char *devname,
 	ctx->minor_num = total_num;
 	ctx->minor_table = ((u8 *)ctx) + sizeof(*ctx);
 
+	cdev_init(&ctx->pool_cdev, &ptx_chrdev_pool_fops);
+	ctx->pool_cdev.owner = THIS_MODULE;
+
+	/* the tuners are still usable without it */
+	ret = cdev_add(&ctx->pool_cdev,
+		       MKDEV(MAJOR(ctx->dev_base),
+			     MINOR(ctx->dev_base) + total_num), 1);
+	if (ret < 0) {
+		pr_warn("ptx_chrdev_context_create: cdev_add(\"%s-any\") failed. (ret: %d)\n",
+			devname, ret);
+	} else {
+		ctx->pool = true;
+		device_create(ctx->class, NULL,
+			      MKDEV(MAJOR(ctx->dev_base),
+				    MINOR(ctx->dev_base) + total_num),
+			      NULL, "%s-any", devname);
+	}
+
 	mutex_lock(&ctx_list_lock);
 	list_add_tail(&ctx->list, &ctx_list);
 	mutex_unlock(&ctx_list_lock);
@@ -618,7 +4681,7 @@ static void ptx_chrdev_context_release(struct kref *kref)
 
 	pr_debug("ptx_chrdev_context_release\n");
 
-	unregister_chrdev_region(ctx->dev_base, ctx->minor_num);
+	unregister_chrdev_region(ctx->dev_base, ctx->minor_num + 1);
 	class_destroy(ctx->class);
 	mutex_destroy(&ctx->lock);
 	kfree(ctx);
@@ -634,6 +4697,13 @@ void ptx_chrdev_context_destroy(struct ptx_chrdev_context *chrdev_ctx)
 	list_del(&chrdev_ctx->list);
 	mutex_unlock(&ctx_list_lock);
 
+	if (chrdev_ctx->pool) {
+		device_destroy(chrdev_ctx->class,
+			       MKDEV(MAJOR(chrdev_ctx->dev_base),
+				     MINOR(chrdev_ctx->dev_base) + chrdev_ctx->minor_num));
+		cdev_del(&chrdev_ctx->pool_cdev);
+	}
+
 	mutex_lock(&chrdev_ctx->lock);
 	list_for_each_entry_safe(group, tmp_group,
 				 &chrdev_ctx->group_list, list) {
@@ -761,7 +4831,8 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 				 struct ptx_chrdev_group **chrdev_group)
 {
 	int ret = 0;
-	unsigned int i, num, base;
+	unsigned int i, j, num, base;
+	int node;
 	struct ptx_chrdev_group *group = NULL;
 
 	if (!chrdev_ctx || !dev || !config)
@@ -806,8 +4877,11 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 					    base, num,
 					    PTX_CHRDEV_MINOR_IN_USE);
 
-	group = kzalloc(sizeof(*group) + (sizeof(group->chrdev[0]) * (num - 1)),
-			GFP_KERNEL);
+	/* the stream is written on the node of the host controller */
+	node = (config->bus) ? itedtv_bus_node(config->bus) : dev_to_node(dev);
+
+	group = kzalloc_node(sizeof(*group) + (sizeof(group->chrdev[0]) * (num - 1)),
+			     GFP_KERNEL, node);
 	if (!group) {
 		ret = -ENOMEM;
 		goto fail_group;
@@ -819,6 +4893,20 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 	group->dev = dev;
 	group->owner_kref = config->owner_kref;
 	group->owner_kref_release = config->owner_kref_release;
+	group->bus_stats = config->bus_stats;
+	group->bus = config->bus;
+	group->bus_number = (config->bus) ? itedtv_bus_number(config->bus) : 0;
+	group->node = node;
+	atomic_set(&group->stream_open, 0);
+	group->stream = NULL;
+	INIT_DELAYED_WORK(&group->lock_poll_work, ptx_chrdev_lock_poll_work);
+	INIT_WORK(&group->resume_work, ptx_chrdev_resume_work);
+	init_waitqueue_head(&group->lock_poll_wait);
+	spin_lock_init(&group->tune_queue_lock);
+	init_waitqueue_head(&group->tune_queue_wait);
+	group->tune_ticket = 0;
+	group->tune_serving = 0;
+	group->tune_time_avg = 0;
 	group->minor_base = MINOR(chrdev_ctx->dev_base) + base;
 	group->chrdev_num = 0;
 
@@ -830,6 +4918,7 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 		atomic_set(&chrdev->open, 0);
 		chrdev->system_cap = chrdev_config->system_cap;
 		chrdev->current_system = PTX_UNSPECIFIED_SYSTEM;
+		chrdev->tuned_freq = 0;
 		chrdev->ops = chrdev_config->ops;
 		chrdev->parent = group;
 		memset(&chrdev->params, 0, sizeof(chrdev->params));
@@ -837,10 +4926,64 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 		chrdev->streaming = false;
 		init_waitqueue_head(&chrdev->ringbuf_wait);
 		chrdev->ringbuf_threshold_size = chrdev_config->ringbuf_threshold_size;
+		chrdev->ringbuf_default_threshold_size = chrdev_config->ringbuf_threshold_size;
 		chrdev->ringbuf_write_size = 0;
+		chrdev->max_readers = clamp_t(unsigned int,
+					      chrdev_config->max_readers,
+					      1, RINGBUFFER_MAX_READERS);
+		chrdev->streaming_count = 0;
+		memset(chrdev->reader, 0, sizeof(chrdev->reader));
+		chrdev->wake_latency = 0;
+		chrdev->pid_filter = false;
+		chrdev->pid_filter_hw = false;
+		memset(chrdev->pid_filter_slot, 0xff,
+		       sizeof(chrdev->pid_filter_slot));
+		chrdev->service_id = 0;
+		chrdev->service_seq = 0;
+		chrdev->service_seq_seen = 0;
+		ts_service_init(&chrdev->service, 0);
+		chrdev->timestamp = false;
+		chrdev->timestamp_buf = NULL;
+		chrdev->arrival_time = 0;
+		chrdev->arrival_step = 0;
+		memset(&chrdev->stats, 0, sizeof(chrdev->stats));
+		timer_setup(&chrdev->wake_timer, ptx_chrdev_wake_timer, 0);
+		INIT_DELAYED_WORK(&chrdev->tune_work, ptx_chrdev_tune_work);
+		chrdev->tune_state = PTX_CHRDEV_TUNE_IDLE;
+		chrdev->tune_result = -ENOENT;
+		chrdev->tune_event = false;
+		for (j = 0; j < PTX_CHRDEV_TUNE_PRIORITY_NUM; j++)
+			atomic_set(&chrdev->tune_waiting[j], 0);
+		atomic_set(&chrdev->tune_cancel_seq, 0);
+		chrdev->tune_cancel_seen = 0;
+		chrdev->tune_priority = PTX_TUNE_PRIORITY_NORMAL;
+		chrdev->tune_reader = NULL;
+		chrdev->suspended = false;
+		chrdev->stat_cache.valid = 0;
+		chrdev->stats_cache_time = PTX_CHRDEV_STATS_CACHE_TIME;
+		spin_lock_init(&chrdev->stat_snapshot_lock);
+		spin_lock_init(&chrdev->wakeup_latency_lock);
+		chrdev->stat_snapshot.valid = 0;
+		chrdev->cc_check = false;
+		chrdev->preroll_time = 0;
+		chrdev->preroll_interval = 0;
+		chrdev->preroll_mark_head = 0;
+		chrdev->cc_seq = 0;
+		chrdev->cc_seq_seen = 0;
+		bitmap_zero(chrdev->cc_valid, 0x2000);
+		ptx_bufq_init(&chrdev->bufq);
+		chrdev->bufq_owner = NULL;
+		chrdev->ring_unused = false;
+		RCU_INIT_POINTER(chrdev->packet_filter, NULL);
+		chrdev->pid_stats = false;
+		chrdev->pid_packets = NULL;
+		chrdev->pid_packets_base = NULL;
 		chrdev->priv = chrdev_config->priv;
+#ifdef PX4_DVB
+		chrdev->dvb = NULL;
+#endif
 
-		ret = ringbuffer_create(&chrdev->ringbuf);
+		ret = ringbuffer_create(&chrdev->ringbuf, node);
 		if (ret) {
 			mutex_destroy(&chrdev->lock);
 			dev_err(dev,
@@ -849,13 +4992,19 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 			break;
 		}
 
-		ret = ringbuffer_alloc(chrdev->ringbuf,
-				       chrdev_config->ringbuf_size);
+		chrdev->ringbuf_fixed_size = chrdev_config->ringbuf_size;
+		chrdev->ringbuf_time_t = chrdev_config->ringbuf_time_t;
+		chrdev->ringbuf_time_s = chrdev_config->ringbuf_time_s;
+
+		/* the buffer itself is allocated on the first open */
+		ret = ringbuffer_set_size(chrdev->ringbuf,
+					  ptx_chrdev_ringbuf_size(chrdev,
+								  PTX_UNSPECIFIED_SYSTEM));
 		if (ret) {
 			ringbuffer_destroy(chrdev->ringbuf);
 			mutex_destroy(&chrdev->lock);
 			dev_err(dev,
-				"ptx_chrdev_context_add: ringbuffer_alloc(%zu) failed. (ret: %d)\n",
+				"ptx_chrdev_context_add: ringbuffer_set_size(%zu) failed. (ret: %d)\n",
 				chrdev_config->ringbuf_size, ret);
 			break;
 		}
@@ -894,10 +5043,12 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 
 	for (i = 0; i < num; i++) {
 		dev_info(dev, "/dev/%s%u\n", chrdev_ctx->devname, base + i);
-		device_create(chrdev_ctx->class, dev,
-			      MKDEV(MAJOR(chrdev_ctx->dev_base),
-				    group->minor_base + i),
-			      NULL, "%s%u", chrdev_ctx->devname, base + i);
+		device_create_with_groups(chrdev_ctx->class, dev,
+					  MKDEV(MAJOR(chrdev_ctx->dev_base),
+						group->minor_base + i),
+					  &group->chrdev[i],
+					  ptx_chrdev_attr_groups,
+					  "%s%u", chrdev_ctx->devname, base + i);
 	}
 
 	kref_init(&group->kref);
@@ -906,6 +5057,12 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 	list_add_tail(&group->list, &chrdev_ctx->group_list);
 	mutex_unlock(&chrdev_ctx->lock);
 
+#ifdef PX4_DVB
+	/* the character devices work without it */
+	for (i = 0; i < num; i++)
+		ptx_dvb_register(&group->chrdev[i], dev);
+#endif
+
 	if (chrdev_group)
 		*chrdev_group = group;
 
@@ -973,6 +5130,8 @@ static void ptx_chrdev_group_release(struct kref *kref)
 	minor_base = group->minor_base;
 	num = group->chrdev_num;
 
+	cancel_delayed_work_sync(&group->lock_poll_work);
+
 	for (i = 0; i < num; i++) {
 		struct ptx_chrdev *chrdev = &group->chrdev[i];
 
@@ -980,9 +5139,14 @@ static void ptx_chrdev_group_release(struct kref *kref)
 			chrdev->ops->term(chrdev);
 
 		ringbuffer_destroy(chrdev->ringbuf);
+		kfree(chrdev->timestamp_buf);
+		kvfree(chrdev->pid_packets);
 		mutex_destroy(&chrdev->lock);
 	}
 
+	if (group->stream)
+		ptx_chrdev_group_stream_free(group->stream);
+
 	mutex_destroy(&group->lock);
 	kfree(group);
 
@@ -998,6 +5162,141 @@ static void ptx_chrdev_group_release(struct kref *kref)
 	return;
 }
 
+/*
+ * System sleep: the capture of the tuners is stopped, and the tuners which
+ * were tuned are tuned again on resume, in the background. The readers stay
+ * open and just see a gap in the stream.
+ */
+int ptx_chrdev_group_suspend(struct ptx_chrdev_group *chrdev_group)
+{
+	unsigned int i;
+
+	/* a resume which has not been finished yet is still to be done */
+	cancel_work_sync(&chrdev_group->resume_work);
+
+	for (i = 0; i < chrdev_group->chrdev_num; i++) {
+		struct ptx_chrdev *chrdev = &chrdev_group->chrdev[i];
+
+		mutex_lock(&chrdev->lock);
+
+		if (chrdev->suspended || !atomic_read(&chrdev->open)) {
+			mutex_unlock(&chrdev->lock);
+			continue;
+		}
+
+		ptx_chrdev_cancel_tune(chrdev);
+
+		chrdev->suspended = true;
+		chrdev->suspended_system = chrdev->current_system;
+		chrdev->suspended_freq = chrdev->tuned_freq;
+		chrdev->suspended_capture = chrdev->streaming;
+
+		if (chrdev->streaming && chrdev->ops->set_capture)
+			chrdev->ops->set_capture(chrdev, false);
+
+		ptx_chrdev_stop_wake_timer(chrdev);
+
+		dev_dbg(chrdev_group->dev,
+			"ptx_chrdev_group_suspend %u:%u: system: %d, freq: %u, capture: %d\n",
+			chrdev_group->id, chrdev->id, chrdev->suspended_system,
+			chrdev->suspended_freq, chrdev->suspended_capture);
+
+		mutex_unlock(&chrdev->lock);
+	}
+
+	return 0;
+}
+
+static void ptx_chrdev_resume_chrdev(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+	struct ptx_chrdev_group *group = chrdev->parent;
+	enum ptx_system_type system = chrdev->params.system;
+	u32 freq = chrdev->params.freq;
+
+	if (chrdev->suspended_system != PTX_UNSPECIFIED_SYSTEM &&
+	    chrdev->suspended_freq && chrdev->ops->tune) {
+		chrdev->params.system = chrdev->suspended_system;
+		chrdev->params.freq = chrdev->suspended_freq;
+
+		/* the same transponder is only switched to if it is still locked */
+		ret = ptx_chrdev_start_tune(chrdev, system);
+		chrdev->params.freq = freq;
+		if (ret) {
+			dev_err(group->dev,
+				"ptx_chrdev_resume_chrdev %u:%u: ptx_chrdev_start_tune() failed. (ret: %d)\n",
+				group->id, chrdev->id, ret);
+		} else {
+			ptx_chrdev_queue_tune(chrdev);
+		}
+	}
+
+	if (chrdev->suspended_capture && chrdev->streaming &&
+	    chrdev->ops->set_capture) {
+		ret = chrdev->ops->set_capture(chrdev, true);
+		if (ret)
+			dev_err(group->dev,
+				"ptx_chrdev_resume_chrdev %u:%u: set_capture(true) failed. (ret: %d)\n",
+				group->id, chrdev->id, ret);
+
+		WRITE_ONCE(chrdev->cc_seq, chrdev->cc_seq + 1);
+	}
+}
+
+static void ptx_chrdev_resume_work(struct work_struct *work)
+{
+	struct ptx_chrdev_group *group = container_of(work,
+						      struct ptx_chrdev_group,
+						      resume_work);
+	unsigned int i;
+
+	for (i = 0; i < group->chrdev_num; i++) {
+		struct ptx_chrdev *chrdev = &group->chrdev[i];
+
+		mutex_lock(&chrdev->lock);
+
+		if (chrdev->suspended) {
+			if (atomic_read(&group->available) &&
+			    atomic_read(&chrdev->open))
+				ptx_chrdev_resume_chrdev(chrdev);
+
+			chrdev->suspended = false;
+		}
+
+		mutex_unlock(&chrdev->lock);
+	}
+}
+
+/* returns at once, the tuners are restored by the resume work */
+int ptx_chrdev_group_resume(struct ptx_chrdev_group *chrdev_group)
+{
+	queue_work(system_unbound_wq, &chrdev_group->resume_work);
+	return 0;
+}
+
+/*
+ * The stream of the group has been restarted without retuning, the data
+ * lost with it is reported to the readers as an overflow (POLLPRI and
+ * PTX_GET_OVERFLOW_COUNT). Called with the stream stopped, so it takes no
+ * lock of the chrdevs, whose capture may be waiting for the restart.
+ */
+void ptx_chrdev_group_report_restart(struct ptx_chrdev_group *chrdev_group)
+{
+	unsigned int i;
+
+	for (i = 0; i < chrdev_group->chrdev_num; i++) {
+		struct ptx_chrdev *chrdev = &chrdev_group->chrdev[i];
+
+		if (!READ_ONCE(chrdev->streaming))
+			continue;
+
+		ringbuffer_report_loss(chrdev->ringbuf);
+		wake_up(&chrdev->ringbuf_wait);
+	}
+
+	return;
+}
+
 void ptx_chrdev_group_destroy(struct ptx_chrdev_group *chrdev_group)
 {
 	struct ptx_chrdev_context *ctx = chrdev_group->parent;
@@ -1009,6 +5308,8 @@ void ptx_chrdev_group_destroy(struct ptx_chrdev_group *chrdev_group)
 		"ptx_chrdev_group_destroy: kref count: %u\n",
 		kref_read(&chrdev_group->kref));
 
+	cancel_work_sync(&chrdev_group->resume_work);
+
 	mutex_lock(&ctx->lock);
 	list_del(&chrdev_group->list);
 	mutex_unlock(&ctx->lock);
@@ -1024,9 +5325,19 @@ void ptx_chrdev_group_destroy(struct ptx_chrdev_group *chrdev_group)
 				     chrdev_group->minor_base + i));
 	}
 
+	if (chrdev_group->stream)
+		wake_up(&chrdev_group->stream->wait);
+
 	cdev_del(&chrdev_group->cdev);
 
 	mutex_unlock(&chrdev_group->lock);
+
+#ifdef PX4_DVB
+	/* waits for the users of the adapters to go away */
+	for (i = 0; i < chrdev_group->chrdev_num; i++)
+		ptx_dvb_unregister(&chrdev_group->chrdev[i]);
+#endif
+
 	kref_put(&chrdev_group->kref, ptx_chrdev_group_release);
 
 	if (owner_kref)
@@ -1035,19 +5346,362 @@ void ptx_chrdev_group_destroy(struct ptx_chrdev_group *chrdev_group)
 	return;
 }
 
-int ptx_chrdev_put_stream(struct ptx_chrdev *chrdev, void *buf, size_t len)
+/* remembers where the stream is, a few times per pre-roll time */
+static void ptx_chrdev_mark_preroll(struct ptx_chrdev *chrdev)
+{
+	u32 head = chrdev->preroll_mark_head;
+	u64 time = chrdev->arrival_time;
+	struct ptx_chrdev_preroll_mark *mark;
+
+	if (head &&
+	    time - chrdev->preroll_mark[(head - 1) % PTX_CHRDEV_PREROLL_MARKS].time < READ_ONCE(chrdev->preroll_interval))
+		return;
+
+	mark = &chrdev->preroll_mark[head % PTX_CHRDEV_PREROLL_MARKS];
+	WRITE_ONCE(mark->write_count, chrdev->ringbuf->write_count);
+	WRITE_ONCE(mark->time, time);
+	smp_store_release(&chrdev->preroll_mark_head, head + 1);
+
+	return;
+}
+
+/* the runs as one write: one update of the ringbuffer and one wake decision */
+static int ptx_chrdev_write_streamv(struct ptx_chrdev *chrdev,
+				    const struct ringbuffer_vec *vec,
+				    unsigned int num)
 {
 	int ret = 0;
+	size_t buf_len = 0, len;
+	unsigned int i;
 
-	ret = ringbuffer_write_atomic(chrdev->ringbuf, buf, &len);
-	if (unlikely(ret && ret != -EOVERFLOW))
-		return ret;
+	for (i = 0; i < num; i++)
+		buf_len += vec[i].len;
+
+	if (unlikely(READ_ONCE(chrdev->preroll_time)))
+		ptx_chrdev_mark_preroll(chrdev);
+
+	if (unlikely(READ_ONCE(chrdev->tune_first_packet)) && buf_len) {
+		WRITE_ONCE(chrdev->tune_first_packet, false);
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_FIRST_PACKET);
+	}
+
+	if (unlikely(READ_ONCE(chrdev->bufq_owner))) {
+		if (ptx_bufq_write(&chrdev->bufq, vec, num,
+				   (chrdev->timestamp) ? 192 : 188,
+				   (chrdev->arrival_time) ? : ktime_get_ns()))
+			wake_up(&chrdev->ringbuf_wait);
+
+		/* the pre-roll marks point into the ringbuffer */
+		if (READ_ONCE(chrdev->ring_unused) &&
+		    !READ_ONCE(chrdev->preroll_time)) {
+			chrdev->stats.delivered_bytes += buf_len;
+			return 0;
+		}
+	}
+
+	ret = ringbuffer_writev_atomic(chrdev->ringbuf, vec, num, &len);
+	if (unlikely(ret)) {
+		if (ret != -EOVERFLOW)
+			return ret;
+
+		chrdev->stats.overflow_bytes += buf_len - len;
+		trace_px4_ringbuf_overflow(chrdev->parent->id, chrdev->id,
+					   buf_len - len);
+	}
 
+	chrdev->stats.delivered_bytes += len;
 	chrdev->ringbuf_write_size += len;
 
 	if (unlikely(chrdev->ringbuf_write_size >= chrdev->ringbuf_threshold_size)) {
-		wake_up(&chrdev->ringbuf_wait);
-		chrdev->ringbuf_write_size -= chrdev->ringbuf_threshold_size;
+		ptx_chrdev_wake_readers(chrdev);
+		chrdev->ringbuf_write_size %= chrdev->ringbuf_threshold_size;
+	} else {
+		unsigned long latency = READ_ONCE(chrdev->wake_latency);
+
+		/* make sure a reader gets woken within the requested latency */
+		if (unlikely(latency && len && !timer_pending(&chrdev->wake_timer)))
+			mod_timer(&chrdev->wake_timer, jiffies + latency);
+	}
+
+	return ret;
+}
+
+static int ptx_chrdev_write_stream(struct ptx_chrdev *chrdev,
+				   void *buf, size_t len)
+{
+	struct ringbuffer_vec vec = { buf, len };
+
+	return ptx_chrdev_write_streamv(chrdev, &vec, 1);
+}
+
+static int ptx_chrdev_write_stream_m2ts(struct ptx_chrdev *chrdev,
+					u8 *buf, size_t len)
+{
+	int ret = 0;
+
+	while (len >= 188) {
+		u32 i, num = min_t(size_t, len / 188, PTX_CHRDEV_M2TS_BUF_PACKETS);
+		u8 *q = chrdev->timestamp_buf;
+
+		for (i = 0; i < num; i++) {
+			/* copy permission indicator (0) and 30-bit ATS at 27MHz */
+			u32 ats = (u32)div_u64(chrdev->arrival_time * 27, 1000);
+
+			q[0] = (ats >> 24) & 0x3f;
+			q[1] = (ats >> 16) & 0xff;
+			q[2] = (ats >> 8) & 0xff;
+			q[3] = ats & 0xff;
+			memcpy(q + 4, buf, 188);
+
+			chrdev->arrival_time += chrdev->arrival_step;
+			q += PTX_CHRDEV_M2TS_PACKET_SIZE;
+			buf += 188;
+		}
+
+		len -= num * 188;
+
+		ret = ptx_chrdev_write_stream(chrdev, chrdev->timestamp_buf,
+					      num * PTX_CHRDEV_M2TS_PACKET_SIZE);
+		if (unlikely(ret))
+			break;
+	}
+
+	return ret;
+}
+
+static int ptx_chrdev_deliver_stream(struct ptx_chrdev *chrdev,
+				     u8 *buf, size_t len)
+{
+	if (unlikely(chrdev->timestamp))
+		return ptx_chrdev_write_stream_m2ts(chrdev, buf, len);
+
+	return ptx_chrdev_write_stream(chrdev, buf, len);
+}
+
+/*
+ * Queues a run of passing packets, the queue is committed to the ringbuffer
+ * as a single write once it is full. The timestamped stream stamps the
+ * packets as they come, so its runs are written at once.
+ */
+static int ptx_chrdev_queue_run(struct ptx_chrdev *chrdev,
+				struct ringbuffer_vec *vec, unsigned int *num,
+				u8 *buf, size_t len)
+{
+	if (unlikely(chrdev->timestamp))
+		return ptx_chrdev_write_stream_m2ts(chrdev, buf, len);
+
+	vec[*num].buf = buf;
+	vec[*num].len = len;
+
+	if (++(*num) < PTX_CHRDEV_WRITEV_RUNS)
+		return 0;
+
+	*num = 0;
+	return ptx_chrdev_write_streamv(chrdev, vec, PTX_CHRDEV_WRITEV_RUNS);
+}
+
+static int ptx_chrdev_put_stream_filtered(struct ptx_chrdev *chrdev,
+					  struct ts_bpf *prog,
+					  u8 *buf, size_t len)
+{
+	int ret = 0;
+	u8 *p = buf, *run = buf;
+	struct ringbuffer_vec vec[PTX_CHRDEV_WRITEV_RUNS];
+	unsigned int num = 0;
+	bool filter = READ_ONCE(chrdev->pid_filter);
+
+	/* pairs with the barriers of the pid filter */
+	smp_rmb();
+
+	while (likely(len >= 188)) {
+		u16 pid = ((p[1] & 0x1f) << 8) | p[2];
+
+		if (unlikely(filter && !test_bit(pid, chrdev->pid_filter_map)) ||
+		    unlikely(prog && !ts_bpf_run(prog, p, chrdev->arrival_time))) {
+			/* consecutive passing packets make a single run */
+			if (p != run) {
+				ret = ptx_chrdev_queue_run(chrdev, vec, &num,
+							   run, p - run);
+				if (unlikely(ret))
+					return ret;
+			}
+
+			/* the dropped packet still takes its arrival slot */
+			chrdev->arrival_time += chrdev->arrival_step;
+			run = p + 188;
+		}
+
+		p += 188;
+		len -= 188;
+	}
+
+	if (p != run) {
+		ret = ptx_chrdev_queue_run(chrdev, vec, &num, run, p - run);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (num)
+		ret = ptx_chrdev_write_streamv(chrdev, vec, num);
+
+	return ret;
+}
+
+static int ptx_chrdev_put_stream_service(struct ptx_chrdev *chrdev,
+					 struct ts_bpf *prog,
+					 u8 *buf, size_t len)
+{
+	int ret = 0;
+	struct ts_service *svc = &chrdev->service;
+	u32 seq = READ_ONCE(chrdev->service_seq);
+	bool filter = READ_ONCE(chrdev->pid_filter);
+	u8 *p = buf, *run = buf;
+
+	/* pairs with the barriers of ptx_chrdev_set_service() and the pid filter */
+	smp_rmb();
+
+	if (unlikely(seq != chrdev->service_seq_seen)) {
+		ts_service_init(svc, READ_ONCE(chrdev->service_id));
+		chrdev->service_seq_seen = seq;
+	}
+
+	while (likely(len >= 188)) {
+		const u8 *out = NULL;
+		enum ts_service_action action = ts_service_filter(svc, p, &out);
+
+		/* the filters of the readers still apply */
+		if (unlikely(filter) && action != TS_SERVICE_DROP &&
+		    !test_bit(((p[1] & 0x1f) << 8) | p[2], chrdev->pid_filter_map))
+			action = TS_SERVICE_DROP;
+
+		if (unlikely(prog) && action == TS_SERVICE_PASS &&
+		    !ts_bpf_run(prog, p, chrdev->arrival_time))
+			action = TS_SERVICE_DROP;
+
+		if (unlikely(action != TS_SERVICE_PASS)) {
+			if (p != run) {
+				ret = ptx_chrdev_deliver_stream(chrdev, run, p - run);
+				if (unlikely(ret))
+					return ret;
+			}
+
+			if (action == TS_SERVICE_REPLACE) {
+				ret = ptx_chrdev_deliver_stream(chrdev, (u8 *)out, 188);
+				if (unlikely(ret))
+					return ret;
+			} else {
+				chrdev->arrival_time += chrdev->arrival_step;
+			}
+
+			run = p + 188;
+		}
+
+		p += 188;
+		len -= 188;
+	}
+
+	if (p != run)
+		ret = ptx_chrdev_deliver_stream(chrdev, run, p - run);
+
+	return ret;
+}
+
+/*
+ * Tags the packets with the index of the tuner for the aggregated stream.
+ * The tuners of a group are fed by a single stream producer, which owns the
+ * tagging buffer.
+ */
+static void ptx_chrdev_put_group_stream(struct ptx_chrdev *chrdev,
+					const u8 *buf, size_t len)
+{
+	struct ptx_chrdev_group_stream *stream = chrdev->parent->stream;
+
+	if (!READ_ONCE(chrdev->streaming))
+		return;
+
+	while (len >= 188) {
+		size_t num = len / 188, size, i;
+		u8 *p = stream->buf;
+
+		if (num > PTX_CHRDEV_GROUP_STREAM_PACKETS)
+			num = PTX_CHRDEV_GROUP_STREAM_PACKETS;
+
+		for (i = 0; i < num; i++) {
+			p[0] = chrdev->id;
+			p[1] = 0;
+			p[2] = 0;
+			p[3] = 0;
+			memcpy(p + 4, buf, 188);
+
+			p += PTX_GROUP_PACKET_SIZE;
+			buf += 188;
+		}
+
+		len -= num * 188;
+		size = num * PTX_GROUP_PACKET_SIZE;
+
+		/* the ringbuffer drops the oldest records on overflow */
+		ringbuffer_write_atomic(stream->ringbuf, stream->buf, &size);
+
+		stream->write_size += size;
+		if (stream->write_size >= stream->threshold_size) {
+			stream->write_size = 0;
+			wake_up(&stream->wait);
+		}
+	}
+
+	return;
+}
+
+int ptx_chrdev_put_stream(struct ptx_chrdev *chrdev, void *buf, size_t len)
+{
+	int ret = 0;
+	struct ts_bpf *prog;
+
+	if (unlikely(atomic_read_acquire(&chrdev->parent->stream_open)))
+		ptx_chrdev_put_group_stream(chrdev, buf, len);
+
+	/* the program is freed only after a grace period */
+	rcu_read_lock();
+
+	prog = rcu_dereference(chrdev->packet_filter);
+
+	if (unlikely(READ_ONCE(chrdev->service_id)))
+		ret = ptx_chrdev_put_stream_service(chrdev, prog, buf, len);
+	else if (unlikely(READ_ONCE(chrdev->pid_filter) || prog))
+		ret = ptx_chrdev_put_stream_filtered(chrdev, prog, buf, len);
+	else
+		ret = ptx_chrdev_deliver_stream(chrdev, buf, len);
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Puts the runs of packets as a single write where nothing has to look into
+ * them. chrdev->arrival_time is that of the first packet, the packets of the
+ * runs are taken as consecutive.
+ */
+int ptx_chrdev_put_stream_vec(struct ptx_chrdev *chrdev,
+			      const struct ringbuffer_vec *vec,
+			      unsigned int num)
+{
+	int ret = 0;
+	unsigned int i;
+
+	if (likely(!atomic_read_acquire(&chrdev->parent->stream_open) &&
+		   !READ_ONCE(chrdev->service_id) &&
+		   !READ_ONCE(chrdev->pid_filter) &&
+		   !rcu_access_pointer(chrdev->packet_filter) &&
+		   !chrdev->timestamp))
+		return ptx_chrdev_write_streamv(chrdev, vec, num);
+
+	for (i = 0; i < num; i++) {
+		ret = ptx_chrdev_put_stream(chrdev, (void *)vec[i].buf,
+					    vec[i].len);
+		if (unlikely(ret))
+			break;
 	}
 
 	return ret;
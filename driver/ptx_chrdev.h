@@ -12,12 +12,21 @@
 #include <linux/atomic.h>
 #include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 
 #include "ptx_ioctl.h"
 #include "ringbuffer.h"
+#include "itedtv_bus.h"
+#include "ts_service.h"
+#include "latency_hist.h"
+#include "ptx_bufq.h"
+#include "ts_bpf.h"
 
 struct ptx_tune_params {
 	enum ptx_system_type system;
@@ -26,9 +35,55 @@ struct ptx_tune_params {
 	u16 stream_id;
 };
 
+/* bitrate (Mbps) of the TS of the system at most, the weight in the URB budget */
+static inline u32 ptx_system_bitrate(enum ptx_system_type system)
+{
+	return (system == PTX_ISDB_S_SYSTEM) ? 53 : 24;
+}
+
 struct ptx_chrdev;
 struct ptx_chrdev_group;
 struct ptx_chrdev_context;
+struct ptx_dvb;
+struct seq_file;
+
+#define PTX_CHRDEV_STAT_SIGNAL_STRENGTH	0x00000001
+#define PTX_CHRDEV_STAT_CNR		0x00000002
+#define PTX_CHRDEV_STAT_CNR_RAW		0x00000004
+#define PTX_CHRDEV_STAT_LOCK		0x00000008
+#define PTX_CHRDEV_STAT_TSID		0x00000010
+
+/* filled by read_stats, which reads as many of them as it can at once */
+struct ptx_chrdev_stat_values {
+	u32 valid;		// PTX_CHRDEV_STAT_*
+	u32 signal_strength;
+	u32 cnr;
+	u32 cnr_raw;
+	bool locked;
+	u16 tsid;		// ISDB-S, of the current stream
+};
+
+/* ordered by progress, reported by get_lock_state */
+enum ptx_chrdev_lock_state {
+	PTX_CHRDEV_LOCK_NO_SIGNAL = 0,	// definitely no carrier, give up
+	PTX_CHRDEV_LOCK_SEARCHING,	// no information yet
+	PTX_CHRDEV_LOCK_AGC,		// signal present, no carrier found yet
+	PTX_CHRDEV_LOCK_CARRIER,	// carrier found
+	PTX_CHRDEV_LOCK_TMCC,		// TMCC decoded
+	PTX_CHRDEV_LOCK_LOCKED,
+};
+
+/* reached by a tune, in this order, timed for tune_timing/ and tracing */
+enum ptx_chrdev_tune_phase {
+	PTX_CHRDEV_TUNE_PHASE_OPEN = 0,		// powered up and initialized, since the open
+	PTX_CHRDEV_TUNE_PHASE_QUEUE,		// turn in the tune queue
+	PTX_CHRDEV_TUNE_PHASE_PLL,		// PLL of the tuner locked, by the driver
+	PTX_CHRDEV_TUNE_PHASE_PROGRAM,		// tuner and demodulator programmed
+	PTX_CHRDEV_TUNE_PHASE_LOCK,		// demodulator locked
+	PTX_CHRDEV_TUNE_PHASE_STREAM_ID,	// ISDB-S, stream id set
+	PTX_CHRDEV_TUNE_PHASE_FIRST_PACKET,	// first packet of the new channel
+	PTX_CHRDEV_TUNE_PHASE_NUM
+};
 
 struct ptx_chrdev_operations {
 	int (*init)(struct ptx_chrdev *chrdev);
@@ -37,12 +92,21 @@ struct ptx_chrdev_operations {
 	int (*release)(struct ptx_chrdev *chrdev);
 	int (*tune)(struct ptx_chrdev *chrdev, struct ptx_tune_params *params);
 	int (*check_lock)(struct ptx_chrdev *chrdev, bool *locked);
+	int (*get_lock_state)(struct ptx_chrdev *chrdev,
+			      enum ptx_chrdev_lock_state *state);
 	int (*set_stream_id)(struct ptx_chrdev *chrdev, u16 stream_id);
 	int (*set_lnb_voltage)(struct ptx_chrdev *chrdev, int voltage);
 	int (*set_capture)(struct ptx_chrdev *chrdev, bool status);
 	int (*read_signal_strength)(struct ptx_chrdev *chrdev, u32 *value);
 	int (*read_cnr)(struct ptx_chrdev *chrdev, u32 *value);
 	int (*read_cnr_raw)(struct ptx_chrdev *chrdev, u32 *value);
+	int (*set_pid_filter)(struct ptx_chrdev *chrdev,
+			      const u16 *pid, int num);
+	int (*set_pid_filter_entry)(struct ptx_chrdev *chrdev,
+				    int index, u16 pid, bool enable);
+	int (*read_tsid)(struct ptx_chrdev *chrdev, u16 *tsid, int num);
+	int (*read_stats)(struct ptx_chrdev *chrdev, u32 mask,
+			  struct ptx_chrdev_stat_values *values);
 };
 
 #define PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE	0x00000010
@@ -50,43 +114,193 @@ struct ptx_chrdev_operations {
 #define PTX_CHRDEV_WAIT_AFTER_LOCK			0x00000040
 #define PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T			0x00000080
 
+#define PTX_CHRDEV_TUNE_TIMEOUT		3000	// msecs
+#define PTX_CHRDEV_TUNE_MIN_INTERVAL	10	// msecs
+#define PTX_CHRDEV_TUNE_MAX_INTERVAL	50	// msecs
+#define PTX_CHRDEV_CARRIER_TIMEOUT	1500	// msecs, stuck at PTX_CHRDEV_LOCK_AGC
+
+#define PTX_CHRDEV_PID_SLOT_FREE	0xffff
+
+#define PTX_CHRDEV_STATS_CACHE_TIME	200	// msecs, PTXT_READ_STATS
+
+#define PTX_CHRDEV_PREROLL_MAX_TIME	600000	// msecs
+#define PTX_CHRDEV_PREROLL_MARKS	128	// covering twice the pre-roll time
+
+/* where the stream was at a given time, for the pre-roll */
+struct ptx_chrdev_preroll_mark {
+	u32 write_count;	// of the ringbuffer
+	u64 time;		// ns, arrival time of the next packet
+};
+
+#define PTX_CHRDEV_TUNE_PRIORITY_NUM	(PTX_TUNE_PRIORITY_HIGH + 1)
+
+enum ptx_chrdev_tune_state {
+	PTX_CHRDEV_TUNE_IDLE = 0,
+	PTX_CHRDEV_TUNE_POLLING,	// waiting for lock
+	PTX_CHRDEV_TUNE_LOCKED,		// locked, waiting for the demod to settle
+	PTX_CHRDEV_TUNE_SETTLING,	// PTX_CHRDEV_WAIT_AFTER_LOCK
+};
+
 struct ptx_chrdev_config {
 	enum ptx_system_type system_cap;
 	const struct ptx_chrdev_operations *ops;
 	u32 options;
 	size_t ringbuf_size;
+	unsigned int ringbuf_time_t;	// msecs of an ISDB-T stream, 0: ringbuf_size
+	unsigned int ringbuf_time_s;	// msecs of an ISDB-S stream, 0: ringbuf_size
 	size_t ringbuf_threshold_size;
+	unsigned int max_readers;
 	void *priv;
 };
 
 struct ptx_chrdev_group_config {
 	struct kref *owner_kref;
 	void (*owner_kref_release)(struct kref *);
+	const struct itedtv_bus_stats *bus_stats;
+	const struct itedtv_bus *bus;	// for the topology information, optional
 	bool reserved;
 	unsigned int minor_base;
 	unsigned int chrdev_num;
 	struct ptx_chrdev_config *chrdev_config;
 };
 
+struct ptx_chrdev_reader {
+	struct ptx_chrdev *chrdev;
+	int id;
+	bool streaming;
+	bool packet_aligned;
+	size_t threshold_size;
+	unsigned long wake_latency;
+	u64 wake_seen;		// wake_time of the chrdev last accounted
+	struct ptx_mmap_ctrl *mmap_ctrl;
+	unsigned int pid_num;		// 0: no filter
+	u16 pid[PTXT_PID_FILTER_MAX];
+	enum ptx_tune_priority tune_priority;
+};
+
+/* updated by the stream producer only */
+struct ptx_chrdev_stats {
+	u64 delivered_bytes;
+	u64 overflow_bytes;	// not written because a reader was full
+	u64 resyncs;
+	u64 tei_errors;
+	u64 cc_errors;		// continuity counter discontinuities
+	u64 cc_lost_packets;	// estimated from the continuity counters
+};
+
 struct ptx_chrdev {
 	struct mutex lock;
 	unsigned int id;
 	atomic_t open;
+	unsigned int max_readers;
 	char name[64];
 	enum ptx_system_type system_cap;
 	enum ptx_system_type current_system;
 	const struct ptx_chrdev_operations *ops;
 	struct ptx_chrdev_group *parent;
 	struct ptx_tune_params params;
+	u32 tuned_freq;		// of current_system, 0: unknown
 	u32 options;
 	bool streaming;
+	unsigned int streaming_count;
+	struct ptx_chrdev_reader *reader[RINGBUFFER_MAX_READERS];
 	struct ringbuffer *ringbuf;
+	size_t ringbuf_fixed_size;
+	unsigned int ringbuf_time_t;	// msecs, 0: ringbuf_fixed_size
+	unsigned int ringbuf_time_s;
 	wait_queue_head_t ringbuf_wait;
 	size_t ringbuf_threshold_size;
+	size_t ringbuf_default_threshold_size;
 	size_t ringbuf_write_size;
+	unsigned long wake_latency;
+	struct timer_list wake_timer;
+	bool timestamp;		// M2TS style 192-byte packets
+	u8 *timestamp_buf;
+	u64 arrival_time;	// ns, of the next packet, set by the producer
+	u32 arrival_step;	// ns per packet
+	bool pid_filter;
+	bool pid_filter_hw;
+	DECLARE_BITMAP(pid_filter_map, 0x2000);	// union of the reader filters
+	DECLARE_BITMAP(pid_filter_scratch, 0x2000);
+	u16 pid_filter_slot[PTXT_PID_FILTER_MAX];	// hardware table entries
+	u32 service_id;		// program number, 0: whole stream, TS_SERVICE_PARTIAL
+	u32 service_seq;	// changed to restart the extraction
+	u32 service_seq_seen;	// by the stream producer
+	struct ts_service service;	// owned by the stream producer
+	bool cc_check;		// track the continuity counters
+	u32 cc_seq;		// changed to forget the counters
+	u32 cc_seq_seen;	// by the stream producer
+	DECLARE_BITMAP(cc_valid, 0x2000);
+	u8 cc_table[0x2000 / 2];	// last counter, 4 bits per pid
+	unsigned int preroll_time;	// msecs, 0: disabled
+	u64 preroll_interval;	// ns between the marks
+	u32 preroll_mark_head;	// total marks written
+	struct ptx_chrdev_preroll_mark preroll_mark[PTX_CHRDEV_PREROLL_MARKS];
+	struct ptx_chrdev_stats stats;
+	struct delayed_work tune_work;
+	enum ptx_chrdev_tune_state tune_state;
+	int tune_result;
+	bool tune_event;
+	struct ptx_chrdev_reader *tune_reader;	// started on lock, PTXT_TUNE_AND_START
+	unsigned long tune_start;
+	unsigned long tune_interval;
+	unsigned long tune_next_poll;	// by the lock poller
+	bool lock_poll_sync;	// ptx_chrdev_poll_lock() waits for a poll
+	bool lock_poll_done;
+	int lock_poll_ret;
+	bool lock_poll_locked;
+	unsigned long lock_poll_start;
+	atomic_t tune_waiting[PTX_CHRDEV_TUNE_PRIORITY_NUM];	// tune ioctls waiting for the lock
+	atomic_t tune_cancel_seq;	// PTX_CANCEL_TUNE
+	int tune_cancel_seen;	// by the tune ioctl holding the lock
+	enum ptx_tune_priority tune_priority;	// of the tune ioctl holding the lock
+	u32 tune_ticket;	// turn in the tune queue of the group
+	bool tune_queued;
+	u64 tune_queue_time;	// ns, programming started
+	u64 tune_time;		// ns, for tracing
+	unsigned int tune_polls;
+	u32 tune_phase_us[PTX_CHRDEV_TUNE_PHASE_NUM];	// since tune_time, 0: not reached
+	bool tune_first_packet;	// waiting for the first packet
+	struct ptx_chrdev_stat_values stat_cache;
+	u64 stat_cache_timestamp;	// ns
+	unsigned int stats_cache_time;	// msecs
+	bool suspended;		// to be restored on resume
+	bool suspended_capture;
+	enum ptx_system_type suspended_system;	// tuned before the suspend
+	u32 suspended_freq;
+	spinlock_t stat_snapshot_lock;
+	struct ptx_chrdev_stat_values stat_snapshot;	// for sysfs, without the lock
+	u64 stat_snapshot_timestamp;	// ns
+	u64 wake_time;		// ns, the readers were last woken for data
+	spinlock_t wakeup_latency_lock;
+	struct latency_hist wakeup_latency;	// until a reader looked at the data
+	struct ptx_bufq bufq;
+	struct ptx_chrdev_reader *bufq_owner;	// PTX_QBUF
+	bool ring_unused;	// the owner of the queue is the only reader
+	struct ts_bpf __rcu *packet_filter;	// PTX_SET_PACKET_FILTER, run under rcu_read_lock()
+	bool pid_stats;		// count the packets of each pid
+	u64 *pid_packets;	// counted by the stream producer, kept once allocated
+	u64 *pid_packets_base;	// at the last reset
+	u64 pid_packets_reset_time;	// ns
+#ifdef PX4_DVB
+	struct ptx_dvb *dvb;	// DVB adapter of the tuner
+#endif
 	void *priv;
 };
 
+/* PTX_OPEN_GROUP_STREAM */
+#define PTX_CHRDEV_GROUP_STREAM_PACKETS	64	// tagged per write
+
+struct ptx_chrdev_group_stream {
+	struct ptx_chrdev_group *group;
+	struct ringbuffer *ringbuf;
+	int id;			// of the reader
+	wait_queue_head_t wait;
+	size_t threshold_size;
+	size_t write_size;	// since the last wake up
+	u8 *buf;		// the tagged packets, by the stream producer
+};
+
 struct ptx_chrdev_group {
 	struct list_head list;
 	struct mutex lock;
@@ -98,6 +312,20 @@ struct ptx_chrdev_group {
 	struct cdev cdev;
 	struct kref *owner_kref;
 	void (*owner_kref_release)(struct kref *);
+	const struct itedtv_bus_stats *bus_stats;
+	const struct itedtv_bus *bus;
+	int bus_number;		// of the USB bus, 0: unknown
+	int node;		// NUMA node of the host controller
+	atomic_t stream_open;	// the aggregated stream is open
+	struct ptx_chrdev_group_stream *stream;	// kept until the release
+	struct delayed_work lock_poll_work;
+	wait_queue_head_t lock_poll_wait;
+	struct work_struct resume_work;
+	spinlock_t tune_queue_lock;
+	wait_queue_head_t tune_queue_wait;
+	u32 tune_ticket;	// next one to hand out
+	u32 tune_serving;	// being programmed
+	u32 tune_time_avg;	// msecs, programming a tuner
 	unsigned int minor_base;
 	unsigned int chrdev_num;
 	struct ptx_chrdev chrdev[1];
@@ -118,6 +346,8 @@ struct ptx_chrdev_context {
 	unsigned int minor_num;
 	u8 *minor_table;
 	struct list_head group_list;
+	struct cdev pool_cdev;		// <devname>-any, the minor after the tuners
+	bool pool;
 };
 
 int ptx_chrdev_context_create(const char *name, const char *devname,
@@ -131,6 +361,33 @@ int ptx_chrdev_context_add_group(struct ptx_chrdev_context *chrdev_ctx,
 int ptx_chrdev_context_remove_group(struct ptx_chrdev_context *chrdev_ctx,
 				    unsigned int minor_base);
 void ptx_chrdev_group_destroy(struct ptx_chrdev_group *chrdev_group);
+int ptx_chrdev_group_suspend(struct ptx_chrdev_group *chrdev_group);
+int ptx_chrdev_group_resume(struct ptx_chrdev_group *chrdev_group);
+void ptx_chrdev_group_report_restart(struct ptx_chrdev_group *chrdev_group);
+int ptx_chrdev_metrics_show(struct seq_file *m);
+void ptx_chrdev_tune_phase(struct ptx_chrdev *chrdev,
+			  enum ptx_chrdev_tune_phase phase);
 int ptx_chrdev_put_stream(struct ptx_chrdev *chrdev, void *buf, size_t len);
+int ptx_chrdev_put_stream_vec(struct ptx_chrdev *chrdev,
+			      const struct ringbuffer_vec *vec,
+			      unsigned int num);
+
+#ifdef PX4_DVB
+int ptx_chrdev_kernel_open(struct ptx_chrdev *chrdev,
+			   struct ptx_chrdev_reader **reader);
+int ptx_chrdev_kernel_close(struct ptx_chrdev_reader *reader);
+int ptx_chrdev_kernel_tune(struct ptx_chrdev_reader *reader,
+			   const struct ptx_tune_params *params);
+int ptx_chrdev_kernel_get_lock(struct ptx_chrdev_reader *reader, bool *locked);
+int ptx_chrdev_kernel_read_cnr(struct ptx_chrdev_reader *reader, u32 *cnr);
+int ptx_chrdev_kernel_set_lnb_voltage(struct ptx_chrdev_reader *reader,
+				      int voltage);
+int ptx_chrdev_kernel_set_capture(struct ptx_chrdev_reader *reader,
+				  bool capture);
+int ptx_chrdev_kernel_set_pid_filter(struct ptx_chrdev_reader *reader,
+				     const u16 *pid, unsigned int num);
+ssize_t ptx_chrdev_kernel_read(struct ptx_chrdev_reader *reader,
+			       void *buf, size_t count, unsigned int timeout);
+#endif
 
 #endif
@@ -0,0 +1,594 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * DVB adapter binding for PTX devices (ptx_dvb.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "print_format.h"
+#include "ptx_dvb.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#include <media/dvb_frontend.h>
+#include <media/dvb_demux.h>
+#include <media/dmxdev.h>
+#else
+#include "dvb_frontend.h"
+#include "dvb_demux.h"
+#include "dmxdev.h"
+#endif
+
+#define PTX_DVB_FILTER_NUM	256
+#define PTX_DVB_BUF_SIZE	(188 * 128)
+#define PTX_DVB_READ_TIMEOUT	100	// msecs
+
+DVB_DEFINE_MOD_OPT_ADAPTER_NR(adapter_nr);
+
+/*
+ * One adapter per tuner, with a frontend and a demux. The frontend and the
+ * feeds of the demux share a reader of the tuner, opened while either of
+ * them is in use, so the tuner is powered up the same way as by an open file.
+ * Each pid of the feeds is passed by the filter of the reader, the full TS
+ * (pid 0x2000) or more pids than the filter takes turn it off.
+ */
+struct ptx_dvb {
+	struct mutex lock;
+	struct ptx_chrdev *chrdev;
+	struct device *dev;
+	struct ptx_chrdev_reader *reader;
+	unsigned int users;		// of the reader
+	bool fe_open;
+	unsigned int feed_num;
+	unsigned int feed_all;		// feeds of pid 0x2000
+	u16 feed_pid[0x2000];		// feeds of each pid
+	struct task_struct *thread;
+	u8 *buf;
+	struct dvb_adapter adapter;
+	struct dvb_frontend fe;
+	struct dvb_demux demux;
+	struct dmxdev dmxdev;
+};
+
+/* must be called with dvb->lock held */
+static int ptx_dvb_get_reader(struct ptx_dvb *dvb)
+{
+	int ret = 0;
+
+	if (dvb->users) {
+		dvb->users++;
+		return 0;
+	}
+
+	ret = ptx_chrdev_kernel_open(dvb->chrdev, &dvb->reader);
+	if (ret) {
+		dev_dbg(dvb->dev,
+			"ptx_dvb_get_reader %u:%u: ptx_chrdev_kernel_open() failed. (ret: %d)\n",
+			dvb->chrdev->parent->id, dvb->chrdev->id, ret);
+		return ret;
+	}
+
+	dvb->users = 1;
+
+	return 0;
+}
+
+/* must be called with dvb->lock held */
+static void ptx_dvb_put_reader(struct ptx_dvb *dvb)
+{
+	if (--dvb->users)
+		return;
+
+	ptx_chrdev_kernel_close(dvb->reader);
+	dvb->reader = NULL;
+}
+
+static int ptx_dvb_fe_init(struct dvb_frontend *fe)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+
+	mutex_lock(&dvb->lock);
+
+	/* also called on resume */
+	if (!dvb->fe_open) {
+		ret = ptx_dvb_get_reader(dvb);
+		if (!ret)
+			dvb->fe_open = true;
+	}
+
+	mutex_unlock(&dvb->lock);
+
+	return ret;
+}
+
+static int ptx_dvb_fe_sleep(struct dvb_frontend *fe)
+{
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+
+	mutex_lock(&dvb->lock);
+
+	if (dvb->fe_open) {
+		dvb->fe_open = false;
+		ptx_dvb_put_reader(dvb);
+	}
+
+	mutex_unlock(&dvb->lock);
+
+	return 0;
+}
+
+static int ptx_dvb_fe_set_frontend(struct dvb_frontend *fe)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
+	struct ptx_tune_params params;
+
+	switch (c->delivery_system) {
+	case SYS_ISDBT:
+		params.system = PTX_ISDB_T_SYSTEM;
+		params.freq = c->frequency / 1000;	// Hz
+		params.bandwidth = (c->bandwidth_hz) ? c->bandwidth_hz / 1000000 : 6;
+		params.stream_id = 0;
+		break;
+
+	case SYS_ISDBS:
+		params.system = PTX_ISDB_S_SYSTEM;
+		params.freq = c->frequency;		// kHz
+		params.bandwidth = 0;
+		/* relative stream number (< 12) or TSID */
+		params.stream_id = (c->stream_id == NO_STREAM_ID_FILTER) ? 0 : c->stream_id;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	dev_dbg(dvb->dev,
+		"ptx_dvb_fe_set_frontend %u:%u: system: %d, freq: %u, stream_id: %u\n",
+		dvb->chrdev->parent->id, dvb->chrdev->id,
+		params.system, params.freq, params.stream_id);
+
+	mutex_lock(&dvb->lock);
+
+	if (dvb->reader)
+		ret = ptx_chrdev_kernel_tune(dvb->reader, &params);
+	else
+		ret = -ENODEV;
+
+	mutex_unlock(&dvb->lock);
+
+	return ret;
+}
+
+static int ptx_dvb_fe_read_status(struct dvb_frontend *fe,
+				  enum fe_status *status)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
+	bool locked = false;
+	u32 cnr;
+
+	*status = 0;
+
+	mutex_lock(&dvb->lock);
+
+	if (!dvb->reader) {
+		mutex_unlock(&dvb->lock);
+		return -ENODEV;
+	}
+
+	ret = ptx_chrdev_kernel_get_lock(dvb->reader, &locked);
+	if (!ret && locked &&
+	    !ptx_chrdev_kernel_read_cnr(dvb->reader, &cnr)) {
+		c->cnr.len = 1;
+		c->cnr.stat[0].scale = FE_SCALE_DECIBEL;
+		c->cnr.stat[0].svalue = (s64)cnr * 10;	// 0.001 dB
+	} else {
+		c->cnr.len = 1;
+		c->cnr.stat[0].scale = FE_SCALE_NOT_AVAILABLE;
+	}
+
+	mutex_unlock(&dvb->lock);
+
+	switch (ret) {
+	case 0:
+		if (locked)
+			*status = FE_HAS_SIGNAL | FE_HAS_CARRIER |
+				  FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK;
+		else
+			*status = FE_HAS_SIGNAL;
+		break;
+
+	case -EINPROGRESS:
+	case -ECANCELED:	// no carrier
+	case -ENOENT:		// not tuned yet
+		break;
+
+	case -EAGAIN:
+		*status = FE_TIMEDOUT;
+		break;
+
+	default:
+		return ret;
+	}
+
+	return 0;
+}
+
+static int ptx_dvb_fe_tune(struct dvb_frontend *fe, bool re_tune,
+			   unsigned int mode_flags, unsigned int *delay,
+			   enum fe_status *status)
+{
+	int ret = 0;
+
+	if (re_tune) {
+		ret = ptx_dvb_fe_set_frontend(fe);
+		if (ret)
+			return ret;
+	}
+
+	*delay = msecs_to_jiffies(PTX_DVB_READ_TIMEOUT);
+
+	return ptx_dvb_fe_read_status(fe, status);
+}
+
+static enum dvbfe_algo ptx_dvb_fe_get_frontend_algo(struct dvb_frontend *fe)
+{
+	/* the tuner polls the lock itself */
+	return DVBFE_ALGO_HW;
+}
+
+static int ptx_dvb_fe_read_snr(struct dvb_frontend *fe, u16 *snr)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+	u32 cnr = 0;
+
+	mutex_lock(&dvb->lock);
+
+	if (dvb->reader)
+		ret = ptx_chrdev_kernel_read_cnr(dvb->reader, &cnr);
+	else
+		ret = -ENODEV;
+
+	mutex_unlock(&dvb->lock);
+
+	if (!ret)
+		*snr = min_t(u32, cnr / 10, 0xffff);	// 0.1 dB
+
+	return ret;
+}
+
+static int ptx_dvb_fe_set_voltage(struct dvb_frontend *fe,
+				  enum fe_sec_voltage voltage)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = fe->demodulator_priv;
+	int v;
+
+	/* the LNB of the BS/CS110 antennas takes 15 V alone */
+	switch (voltage) {
+	case SEC_VOLTAGE_13:
+	case SEC_VOLTAGE_18:
+		v = 15;
+		break;
+
+	case SEC_VOLTAGE_OFF:
+		v = 0;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&dvb->lock);
+
+	if (dvb->reader)
+		ret = ptx_chrdev_kernel_set_lnb_voltage(dvb->reader, v);
+	else
+		ret = -ENODEV;
+
+	mutex_unlock(&dvb->lock);
+
+	return ret;
+}
+
+static const struct dvb_frontend_ops ptx_dvb_fe_ops = {
+	.info = {
+		.caps = FE_CAN_INVERSION_AUTO | FE_CAN_FEC_AUTO |
+			FE_CAN_QAM_AUTO | FE_CAN_TRANSMISSION_MODE_AUTO |
+			FE_CAN_GUARD_INTERVAL_AUTO | FE_CAN_HIERARCHY_AUTO |
+			FE_CAN_MULTISTREAM,
+	},
+	.init = ptx_dvb_fe_init,
+	.sleep = ptx_dvb_fe_sleep,
+	.tune = ptx_dvb_fe_tune,
+	.get_frontend_algo = ptx_dvb_fe_get_frontend_algo,
+	.set_frontend = ptx_dvb_fe_set_frontend,
+	.read_status = ptx_dvb_fe_read_status,
+	.read_snr = ptx_dvb_fe_read_snr,
+	.set_voltage = ptx_dvb_fe_set_voltage,
+};
+
+static int ptx_dvb_feed_thread(void *data)
+{
+	struct ptx_dvb *dvb = data;
+	struct ptx_chrdev_reader *reader = dvb->reader;
+
+	while (!kthread_should_stop()) {
+		ssize_t len;
+
+		len = ptx_chrdev_kernel_read(reader, dvb->buf, PTX_DVB_BUF_SIZE,
+					     PTX_DVB_READ_TIMEOUT);
+		if (len > 0) {
+			/* resyncs on the M2TS packets as well */
+			dvb_dmx_swfilter(&dvb->demux, dvb->buf, len);
+		} else if (len < 0) {
+			/* the device has gone, wait for the last feed to stop */
+			schedule_timeout_interruptible(msecs_to_jiffies(PTX_DVB_READ_TIMEOUT));
+		}
+	}
+
+	return 0;
+}
+
+/* must be called with dvb->lock held */
+static int ptx_dvb_update_pid_filter(struct ptx_dvb *dvb)
+{
+	unsigned int pid, num = 0;
+	u16 list[PTXT_PID_FILTER_MAX];
+
+	if (!dvb->feed_all) {
+		for (pid = 0; pid < 0x2000; pid++) {
+			if (!dvb->feed_pid[pid])
+				continue;
+
+			if (num == PTXT_PID_FILTER_MAX) {
+				num = 0;
+				break;
+			}
+
+			list[num++] = pid;
+		}
+	}
+
+	return ptx_chrdev_kernel_set_pid_filter(dvb->reader, list, num);
+}
+
+static int ptx_dvb_start_feed(struct dvb_demux_feed *feed)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb = feed->demux->priv;
+	u16 pid = feed->pid;
+
+	if (pid > 0x2000)
+		return -EINVAL;
+
+	mutex_lock(&dvb->lock);
+
+	if (pid == 0x2000)
+		dvb->feed_all++;
+	else
+		dvb->feed_pid[pid]++;
+
+	if (!dvb->feed_num) {
+		ret = ptx_dvb_get_reader(dvb);
+		if (ret)
+			goto fail;
+	}
+
+	ret = ptx_dvb_update_pid_filter(dvb);
+	if (ret)
+		goto fail_reader;
+
+	if (!dvb->feed_num) {
+		ret = ptx_chrdev_kernel_set_capture(dvb->reader, true);
+		if (ret) {
+			dev_err(dvb->dev,
+				"ptx_dvb_start_feed %u:%u: ptx_chrdev_kernel_set_capture(true) failed. (ret: %d)\n",
+				dvb->chrdev->parent->id, dvb->chrdev->id, ret);
+			goto fail_reader;
+		}
+
+		dvb->thread = kthread_run(ptx_dvb_feed_thread, dvb,
+					  "ptx_dvb%u.%u",
+					  dvb->chrdev->parent->id,
+					  dvb->chrdev->id);
+		if (IS_ERR(dvb->thread)) {
+			ret = PTR_ERR(dvb->thread);
+			dvb->thread = NULL;
+			ptx_chrdev_kernel_set_capture(dvb->reader, false);
+			goto fail_reader;
+		}
+	}
+
+	dvb->feed_num++;
+	mutex_unlock(&dvb->lock);
+
+	return 0;
+
+fail_reader:
+	if (!dvb->feed_num)
+		ptx_dvb_put_reader(dvb);
+
+fail:
+	if (pid == 0x2000)
+		dvb->feed_all--;
+	else
+		dvb->feed_pid[pid]--;
+
+	if (dvb->feed_num)
+		ptx_dvb_update_pid_filter(dvb);
+
+	mutex_unlock(&dvb->lock);
+
+	return ret;
+}
+
+static int ptx_dvb_stop_feed(struct dvb_demux_feed *feed)
+{
+	struct ptx_dvb *dvb = feed->demux->priv;
+	u16 pid = feed->pid;
+
+	if (pid > 0x2000)
+		return -EINVAL;
+
+	mutex_lock(&dvb->lock);
+
+	if (pid == 0x2000)
+		dvb->feed_all--;
+	else
+		dvb->feed_pid[pid]--;
+
+	if (--dvb->feed_num) {
+		ptx_dvb_update_pid_filter(dvb);
+		mutex_unlock(&dvb->lock);
+		return 0;
+	}
+
+	kthread_stop(dvb->thread);
+	dvb->thread = NULL;
+
+	ptx_chrdev_kernel_set_capture(dvb->reader, false);
+	ptx_chrdev_kernel_set_pid_filter(dvb->reader, NULL, 0);
+	ptx_dvb_put_reader(dvb);
+
+	mutex_unlock(&dvb->lock);
+
+	return 0;
+}
+
+int ptx_dvb_register(struct ptx_chrdev *chrdev, struct device *dev)
+{
+	int ret = 0;
+	struct ptx_dvb *dvb;
+	struct dvb_frontend_ops *ops;
+	unsigned int n = 0;
+
+	dvb = kzalloc(sizeof(*dvb), GFP_KERNEL);
+	if (!dvb)
+		return -ENOMEM;
+
+	mutex_init(&dvb->lock);
+	dvb->chrdev = chrdev;
+	dvb->dev = dev;
+
+	dvb->buf = kmalloc(PTX_DVB_BUF_SIZE, GFP_KERNEL);
+	if (!dvb->buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = dvb_register_adapter(&dvb->adapter, KBUILD_MODNAME,
+				   THIS_MODULE, dev, adapter_nr);
+	if (ret < 0) {
+		dev_err(dev,
+			"ptx_dvb_register %u:%u: dvb_register_adapter() failed. (ret: %d)\n",
+			chrdev->parent->id, chrdev->id, ret);
+		goto fail;
+	}
+
+	dvb->adapter.priv = dvb;
+
+	dvb->demux.dmx.capabilities = DMX_TS_FILTERING | DMX_SECTION_FILTERING;
+	dvb->demux.priv = dvb;
+	dvb->demux.filternum = PTX_DVB_FILTER_NUM;
+	dvb->demux.feednum = PTX_DVB_FILTER_NUM;
+	dvb->demux.start_feed = ptx_dvb_start_feed;
+	dvb->demux.stop_feed = ptx_dvb_stop_feed;
+
+	ret = dvb_dmx_init(&dvb->demux);
+	if (ret < 0) {
+		dev_err(dev,
+			"ptx_dvb_register %u:%u: dvb_dmx_init() failed. (ret: %d)\n",
+			chrdev->parent->id, chrdev->id, ret);
+		goto fail_adapter;
+	}
+
+	dvb->dmxdev.filternum = PTX_DVB_FILTER_NUM;
+	dvb->dmxdev.demux = &dvb->demux.dmx;
+	dvb->dmxdev.capabilities = 0;
+
+	ret = dvb_dmxdev_init(&dvb->dmxdev, &dvb->adapter);
+	if (ret < 0) {
+		dev_err(dev,
+			"ptx_dvb_register %u:%u: dvb_dmxdev_init() failed. (ret: %d)\n",
+			chrdev->parent->id, chrdev->id, ret);
+		goto fail_demux;
+	}
+
+	ops = &dvb->fe.ops;
+	memcpy(ops, &ptx_dvb_fe_ops, sizeof(*ops));
+	snprintf(ops->info.name, sizeof(ops->info.name), "%s %u",
+		 dev_name(dev), chrdev->id);
+
+	if (chrdev->system_cap & PTX_ISDB_T_SYSTEM)
+		ops->delsys[n++] = SYS_ISDBT;
+	if (chrdev->system_cap & PTX_ISDB_S_SYSTEM)
+		ops->delsys[n++] = SYS_ISDBS;
+
+	dvb->fe.demodulator_priv = dvb;
+
+	ret = dvb_register_frontend(&dvb->adapter, &dvb->fe);
+	if (ret < 0) {
+		dev_err(dev,
+			"ptx_dvb_register %u:%u: dvb_register_frontend() failed. (ret: %d)\n",
+			chrdev->parent->id, chrdev->id, ret);
+		goto fail_dmxdev;
+	}
+
+	chrdev->dvb = dvb;
+
+	dev_info(dev, "ptx_dvb_register %u:%u: adapter%d\n",
+		 chrdev->parent->id, chrdev->id, dvb->adapter.num);
+
+	return 0;
+
+fail_dmxdev:
+	dvb_dmxdev_release(&dvb->dmxdev);
+
+fail_demux:
+	dvb_dmx_release(&dvb->demux);
+
+fail_adapter:
+	dvb_unregister_adapter(&dvb->adapter);
+
+fail:
+	kfree(dvb->buf);
+	mutex_destroy(&dvb->lock);
+	kfree(dvb);
+
+	return ret;
+}
+
+void ptx_dvb_unregister(struct ptx_chrdev *chrdev)
+{
+	struct ptx_dvb *dvb = chrdev->dvb;
+
+	if (!dvb)
+		return;
+
+	/* each of them waits for its users, who stop the feeds and the frontend */
+	dvb_unregister_frontend(&dvb->fe);
+	dvb_frontend_detach(&dvb->fe);
+	dvb_dmxdev_release(&dvb->dmxdev);
+	dvb_dmx_release(&dvb->demux);
+	dvb_unregister_adapter(&dvb->adapter);
+
+	chrdev->dvb = NULL;
+
+	kfree(dvb->buf);
+	mutex_destroy(&dvb->lock);
+	kfree(dvb);
+
+	return;
+}
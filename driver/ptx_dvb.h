@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * DVB adapter binding for PTX devices (ptx_dvb.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __PTX_DVB_H__
+#define __PTX_DVB_H__
+
+#include <linux/types.h>
+#include <linux/device.h>
+
+#include "ptx_chrdev.h"
+
+int ptx_dvb_register(struct ptx_chrdev *chrdev, struct device *dev);
+void ptx_dvb_unregister(struct ptx_chrdev *chrdev);
+
+#endif
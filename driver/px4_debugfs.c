@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * debugfs interface of the driver (px4_debugfs.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "print_format.h"
+#include "px4_debugfs.h"
+#include "ptx_chrdev.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+
+struct px4_debugfs_chip {
+	char name[24];
+	struct i2c_comm_stats *stats;
+};
+
+struct px4_debugfs {
+	struct dentry *dir;
+	struct it930x_bridge *it930x;
+	int chip_num;
+	struct px4_debugfs_chip chip[PX4_DEBUGFS_MAX_CHIPS];
+};
+
+static const char *px4_debugfs_ctrl_name[IT930X_CTRL_STAT_NUM] = {
+	"reg_read",
+	"reg_write",
+	"i2c_read",
+	"i2c_write",
+	"fw_scatter_write",
+	"other"
+};
+
+static struct dentry *px4_debugfs_dir;
+
+struct dentry *px4_debugfs_root(void)
+{
+	return px4_debugfs_dir;
+}
+
+static int px4_debugfs_ctrl_show(struct seq_file *m, void *v)
+{
+	struct px4_debugfs *dbg = m->private;
+	struct it930x_ctrl_stats *s;
+	int i, j, chip_num;
+
+	s = kmalloc_array(IT930X_CTRL_STAT_NUM, sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	it930x_get_ctrl_stats(dbg->it930x, s);
+
+	for (i = 0; i < IT930X_CTRL_STAT_NUM; i++) {
+		seq_printf(m, "%s: count=%llu errors=%llu bytes=%llu avg_us=%llu\n",
+			   px4_debugfs_ctrl_name[i], s[i].count, s[i].errors,
+			   s[i].bytes,
+			   (s[i].count) ? div64_u64(s[i].total_ns,
+						    s[i].count * NSEC_PER_USEC)
+					: 0);
+
+		/* the buckets as in latency_hist.h: < 1 usec, then < 2^n usecs */
+		seq_printf(m, "%s_us:", px4_debugfs_ctrl_name[i]);
+		for (j = 0; j < LATENCY_HIST_BUCKETS; j++)
+			seq_printf(m, " %u", s[i].latency.count[j]);
+		seq_putc(m, '\n');
+	}
+
+	chip_num = smp_load_acquire(&dbg->chip_num);
+
+	for (i = 0; i < chip_num; i++) {
+		const struct i2c_comm_stats *c = dbg->chip[i].stats;
+
+		seq_printf(m, "%s: requests=%llu read_bytes=%llu write_bytes=%llu errors=%llu\n",
+			   dbg->chip[i].name,
+			   READ_ONCE(c->requests), READ_ONCE(c->read_bytes),
+			   READ_ONCE(c->write_bytes), READ_ONCE(c->errors));
+	}
+
+	kfree(s);
+
+	return 0;
+}
+
+static int px4_debugfs_ctrl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, px4_debugfs_ctrl_show, inode->i_private);
+}
+
+/* any write clears the counters */
+static ssize_t px4_debugfs_ctrl_write(struct file *file,
+				      const char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct px4_debugfs *dbg = ((struct seq_file *)file->private_data)->private;
+	int i, chip_num;
+
+	it930x_clear_ctrl_stats(dbg->it930x);
+
+	/* the chip counters are not locked, a request in flight may survive */
+	chip_num = smp_load_acquire(&dbg->chip_num);
+	for (i = 0; i < chip_num; i++)
+		memset(dbg->chip[i].stats, 0, sizeof(*dbg->chip[i].stats));
+
+	return count;
+}
+
+static const struct file_operations px4_debugfs_ctrl_fops = {
+	.owner = THIS_MODULE,
+	.open = px4_debugfs_ctrl_open,
+	.read = seq_read,
+	.write = px4_debugfs_ctrl_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs is optional, the device works without it */
+struct px4_debugfs *px4_debugfs_create(struct device *dev,
+				       struct it930x_bridge *it930x)
+{
+	struct px4_debugfs *dbg;
+
+	dbg = kzalloc(sizeof(*dbg), GFP_KERNEL);
+	if (!dbg)
+		return NULL;
+
+	dbg->it930x = it930x;
+	dbg->dir = debugfs_create_dir(dev_name(dev), px4_debugfs_dir);
+
+	debugfs_create_file("ctrl_stats", 0600, dbg->dir, dbg,
+			    &px4_debugfs_ctrl_fops);
+
+	return dbg;
+}
+
+/* called by the owner of the device only, the readers see the new entry at once */
+void px4_debugfs_add_chip(struct px4_debugfs *dbg, const char *name, int idx,
+			  struct i2c_comm_stats *stats)
+{
+	struct px4_debugfs_chip *chip;
+
+	if (!dbg || dbg->chip_num >= PX4_DEBUGFS_MAX_CHIPS)
+		return;
+
+	chip = &dbg->chip[dbg->chip_num];
+	snprintf(chip->name, sizeof(chip->name), "%s.%d", name, idx);
+	chip->stats = stats;
+
+	smp_store_release(&dbg->chip_num, dbg->chip_num + 1);
+}
+
+void px4_debugfs_remove(struct px4_debugfs *dbg)
+{
+	if (!dbg)
+		return;
+
+	/* waits for the readers of the file */
+	debugfs_remove_recursive(dbg->dir);
+	kfree(dbg);
+}
+
+static int px4_debugfs_metrics_show(struct seq_file *m, void *v)
+{
+	return ptx_chrdev_metrics_show(m);
+}
+
+static int px4_debugfs_metrics_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, px4_debugfs_metrics_show, NULL);
+}
+
+static const struct file_operations px4_debugfs_metrics_fops = {
+	.owner = THIS_MODULE,
+	.open = px4_debugfs_metrics_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void px4_debugfs_init(void)
+{
+	px4_debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	debugfs_create_file("metrics", 0444, px4_debugfs_dir, NULL,
+			    &px4_debugfs_metrics_fops);
+}
+
+void px4_debugfs_cleanup(void)
+{
+	debugfs_remove_recursive(px4_debugfs_dir);
+	px4_debugfs_dir = NULL;
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * debugfs interface of the driver (px4_debugfs.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __PX4_DEBUGFS_H__
+#define __PX4_DEBUGFS_H__
+
+#include <linux/types.h>
+#include <linux/device.h>
+
+#include "i2c_comm.h"
+#include "it930x.h"
+
+/*
+ * /sys/kernel/debug/px4_drv/ is shared by the whole module. Each device has
+ * a directory named after its interface, holding ctrl_stats: the control
+ * messages of the bridge by command and the i2c traffic of each chip.
+ * metrics at the top holds the counters of all the tuners and buses.
+ */
+
+#define PX4_DEBUGFS_MAX_CHIPS	16
+
+struct px4_debugfs;
+
+struct dentry *px4_debugfs_root(void);
+
+struct px4_debugfs *px4_debugfs_create(struct device *dev,
+				       struct it930x_bridge *it930x);
+void px4_debugfs_add_chip(struct px4_debugfs *dbg, const char *name, int idx,
+			  struct i2c_comm_stats *stats);
+void px4_debugfs_remove(struct px4_debugfs *dbg);
+
+void px4_debugfs_init(void);
+void px4_debugfs_cleanup(void);
+
+#endif
@@ -11,18 +11,14 @@
 #include <linux/kernel.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "px4_device_params.h"
 #include "firmware.h"
+#include "ts_demux.h"
+#include "r850_cache.h"
 
-#define PX4_DEVICE_TS_SYNC_COUNT	4
-#define PX4_DEVICE_TS_SYNC_SIZE		(188 * PX4_DEVICE_TS_SYNC_COUNT)
-
-struct px4_stream_context {
-	struct ptx_chrdev *chrdev[PX4_CHRDEV_NUM];
-	u8 remain_buf[PX4_DEVICE_TS_SYNC_SIZE];
-	size_t remain_len;
-};
+static const struct ts_demux_config px4_demux_config = TS_DEMUX_TAGGED_CONFIG(PX4_CHRDEV_NUM);
 
 static int px4_chrdev_set_lnb_voltage_s(struct ptx_chrdev *chrdev, int voltage);
 static void px4_device_release(struct kref *kref);
@@ -58,167 +54,208 @@ static int px4_backend_set_power(struct px4_device *px4, bool state)
 	return 0;
 }
 
-static int px4_backend_init(struct px4_device *px4)
+/* must be called with px4->lock held, or by a work the holder waits for */
+static int px4_backend_init_tuner(struct px4_device *px4, int i)
 {
-	int ret = 0, i;
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
 
-	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
-		struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
+	if (chrdev4->tuner_init)
+		return 0;
 
-		ret = tc90522_init(&chrdev4->tc90522);
-		if (ret) {
+	switch (chrdev4->chrdev->system_cap) {
+	case PTX_ISDB_T_SYSTEM:
+		ret = r850_init(&chrdev4->tuner.r850);
+		if (ret)
 			dev_err(px4->dev,
-				"px4_backend_init: tc90522_init() failed. (i: %d, ret: %d)\n",
+				"px4_backend_init: r850_init() failed. (i: %d, ret: %d)\n",
 				i, ret);
-			break;
-		}
+		else
+			r850_cache_load(&px4->it930x, i,
+					&chrdev4->tuner.r850);
 
-		switch (chrdev4->chrdev->system_cap) {
-		case PTX_ISDB_T_SYSTEM:
-			ret = r850_init(&chrdev4->tuner.r850);
-			if (ret)
-				dev_err(px4->dev,
-					"px4_backend_init: r850_init() failed. (i: %d, ret: %d)\n",
-					i, ret);
+		break;
 
-			break;
+	case PTX_ISDB_S_SYSTEM:
+		ret = rt710_init(&chrdev4->tuner.rt710);
+		if (ret)
+			dev_err(px4->dev,
+				"px4_backend_init: rt710_init() failed. (i: %d, ret: %d)\n",
+				i, ret);
 
-		case PTX_ISDB_S_SYSTEM:
-			ret = rt710_init(&chrdev4->tuner.rt710);
-			if (ret)
-				dev_err(px4->dev,
-					"px4_backend_init: rt710_init() failed. (i: %d, ret: %d)\n",
-					i, ret);
+		break;
 
-			break;
+	default:
+		dev_err(px4->dev,
+			"px4_backend_init: unknown system\n");
+		break;
+	}
 
-		default:
-			dev_err(px4->dev,
-				"px4_backend_init: unknown system\n");
-			break;
+	if (!ret)
+		chrdev4->tuner_init = true;
+
+	return ret;
+}
+
+struct px4_backend_init_work {
+	struct work_struct work;
+	struct px4_device *px4;
+	int i;
+	int ret;
+};
+
+static void px4_backend_init_tuner_work(struct work_struct *work)
+{
+	struct px4_backend_init_work *w = container_of(work,
+						       struct px4_backend_init_work,
+						       work);
+
+	w->ret = px4_backend_init_tuner(w->px4, w->i);
+}
+
+/*
+ * Each tuner is reached through the i2c gateway of its own demodulator and
+ * the bridge keeps the i2c requests of a bus apart, so the tuners can be
+ * initialized at the same time: most of r850_init() is spent in msleep(),
+ * during which the others use the bus. The demodulator is always set up
+ * before the tuner behind it.
+ */
+static int px4_backend_init_tuners(struct px4_device *px4)
+{
+	int ret = 0, i;
+	struct px4_backend_init_work w[PX4_CHRDEV_NUM];
+
+	if (!px4_device_params.parallel_tuner_init) {
+		for (i = 0; i < PX4_CHRDEV_NUM; i++) {
+			ret = px4_backend_init_tuner(px4, i);
+			if (ret)
+				break;
 		}
 
-		if (ret)
-			break;
+		return ret;
+	}
+
+	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
+		INIT_WORK_ONSTACK(&w[i].work, px4_backend_init_tuner_work);
+		w[i].px4 = px4;
+		w[i].i = i;
+		w[i].ret = 0;
+
+		queue_work(system_unbound_wq, &w[i].work);
+	}
+
+	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
+		flush_work(&w[i].work);
+		destroy_work_on_stack(&w[i].work);
+
+		if (w[i].ret && !ret)
+			ret = w[i].ret;
 	}
 
 	return ret;
 }
 
-static int px4_backend_term(struct px4_device *px4)
+static int px4_backend_init(struct px4_device *px4)
 {
-	int i;
+	int ret = 0, i;
 
 	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
 		struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
 
-		switch (chrdev4->chrdev->system_cap) {
-		case PTX_ISDB_T_SYSTEM:
-			r850_term(&chrdev4->tuner.r850);
-			break;
-
-		case PTX_ISDB_S_SYSTEM:
-			rt710_term(&chrdev4->tuner.rt710);
-			break;
+		chrdev4->tuner_init = false;
+		chrdev4->awake = false;
 
-		default:
-			break;
+		ret = tc90522_init(&chrdev4->tc90522);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_backend_init: tc90522_init() failed. (i: %d, ret: %d)\n",
+				i, ret);
+			return ret;
 		}
-
-		tc90522_term(&chrdev4->tc90522);
 	}
 
-	return 0;
+	/* initialized on the first tune */
+	if (px4_device_params.lazy_tuner_init)
+		return 0;
+
+	return px4_backend_init_tuners(px4);
 }
 
-static void px4_device_stream_process(struct ptx_chrdev **chrdev,
-				      u8 **buf, u32 *len)
+static int px4_backend_term(struct px4_device *px4)
 {
-	u8 *p = *buf;
-	u32 remain = *len;
+	int i;
 
-	while (likely(remain)) {
-		u32 i;
-		bool sync_remain = false;
+	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
+		struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
 
-		for (i = 0; i < PX4_DEVICE_TS_SYNC_COUNT; i++) {
-			if (likely(((i + 1) * 188) <= remain)) {
-				if (unlikely((p[i * 188] & 0x8f) != 0x07))
-					break;
-			} else {
-				sync_remain = true;
+		/* the tuner may have never been tuned */
+		if (chrdev4->tuner_init) {
+			switch (chrdev4->chrdev->system_cap) {
+			case PTX_ISDB_T_SYSTEM:
+				r850_cache_store(&px4->it930x, i,
+						 &chrdev4->tuner.r850);
+				r850_term(&chrdev4->tuner.r850);
+				break;
+
+			case PTX_ISDB_S_SYSTEM:
+				rt710_term(&chrdev4->tuner.rt710);
+				break;
+
+			default:
 				break;
 			}
 		}
 
-		if (unlikely(sync_remain))
-			break;
+		chrdev4->tuner_init = false;
+		chrdev4->awake = false;
+		tc90522_term(&chrdev4->tc90522);
+	}
 
-		if (unlikely(i < PX4_DEVICE_TS_SYNC_COUNT)) {
-			p++;
-			remain--;
-			continue;
-		}
+	return 0;
+}
+
+static void px4_backend_power_work(struct work_struct *work)
+{
+	struct px4_device *px4 = container_of(to_delayed_work(work),
+					      struct px4_device, power_work);
 
-		while (likely(remain >= 188 && ((p[0] & 0x8f) == 0x07))) {
-			u8 id = (p[0] & 0x70) >> 4;
+	mutex_lock(&px4->lock);
 
-			if (likely(id && id < 5)) {
-				p[0] = 0x47;
-				ptx_chrdev_put_stream(chrdev[id - 1], p, 188);
-			}
+	if (px4->warm && !px4->open_count &&
+	    (!atomic_read(&px4->available) ||
+	     time_after_eq(jiffies, px4->idle_deadline))) {
+		dev_dbg(px4->dev, "px4_backend_power_work: power off\n");
 
-			p += 188;
-			remain -= 188;
-		}
+		px4_backend_term(px4);
+		px4_backend_set_power(px4, false);
+		px4->warm = false;
 	}
 
-	*buf = p;
-	*len = remain;
+	mutex_unlock(&px4->lock);
 
-	return;
+	/* the reference was taken by whoever queued the work */
+	kref_put(&px4->kref, px4_device_release);
 }
 
-static int px4_device_stream_handler(void *context, void *buf, u32 len)
+/* must be called with px4->lock held */
+static bool px4_backend_keep_warm(struct px4_device *px4)
 {
-	struct px4_stream_context *stream_ctx = context;
-	u8 *ctx_remain_buf = stream_ctx->remain_buf;
-	u32 ctx_remain_len = stream_ctx->remain_len;
-	u8 *p = buf;
-	u32 remain = len;
-
-	if (unlikely(ctx_remain_len)) {
-		if (likely((ctx_remain_len + len) >= PX4_DEVICE_TS_SYNC_SIZE)) {
-			u32 t = PX4_DEVICE_TS_SYNC_SIZE - ctx_remain_len;
-
-			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
-			ctx_remain_len = PX4_DEVICE_TS_SYNC_SIZE;
-
-			px4_device_stream_process(stream_ctx->chrdev,
-						  &ctx_remain_buf,
-						  &ctx_remain_len);
-			if (likely(!ctx_remain_len)) {
-				p += t;
-				remain -= t;
-			}
+	unsigned long delay;
 
-			stream_ctx->remain_len = 0;
-		} else {
-			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
-			stream_ctx->remain_len += len;
+	if (px4->mldev || !px4_device_params.backend_idle_timeout ||
+	    !atomic_read(&px4->available))
+		return false;
 
-			return 0;
-		}
-	}
+	delay = msecs_to_jiffies(px4_device_params.backend_idle_timeout);
 
-	px4_device_stream_process(stream_ctx->chrdev, &p, &remain);
+	px4->warm = true;
+	px4->idle_deadline = jiffies + delay;
 
-	if (unlikely(remain)) {
-		memcpy(stream_ctx->remain_buf, p, remain);
-		stream_ctx->remain_len = remain;
-	}
+	kref_get(&px4->kref);
+	if (!schedule_delayed_work(&px4->power_work, delay))
+		kref_put(&px4->kref, px4_device_release);
 
-	return 0;
+	return true;
 }
 
 static int px4_chrdev_init(struct ptx_chrdev *chrdev)
@@ -270,6 +307,118 @@ static struct tc90522_regbuf tc_init_t0[] = {
 	{ 0x0f, NULL, { 0x13 } }
 };
 
+/* must be called with px4->lock held */
+static int px4_chrdev_wakeup(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+	struct ptx_chrdev_group *chrdev_group = chrdev->parent;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	struct px4_device *px4 = chrdev4->parent;
+
+	ret = px4_backend_init_tuner(px4, chrdev->id);
+	if (ret)
+		return ret;
+
+	/* wake up */
+	switch (chrdev->system_cap) {
+	case PTX_ISDB_T_SYSTEM:
+	{
+		struct r850_system_config sys;
+
+		ret = tc90522_write_multiple_regs(&chrdev4->tc90522,
+						  tc_init_t,
+						  ARRAY_SIZE(tc_init_t));
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_write_multiple_regs(tc_init_t) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		/* disable ts pins */
+		ret = tc90522_enable_ts_pins_t(&chrdev4->tc90522, false);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_enable_ts_pins_t(false) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		/* wake up */
+		ret = tc90522_sleep_t(&chrdev4->tc90522, false);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_sleep_t(false) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		ret = r850_wakeup(&chrdev4->tuner.r850);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: r850_wakeup() failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		sys.system = R850_SYSTEM_ISDB_T;
+		sys.bandwidth = R850_BANDWIDTH_6M;
+		sys.if_freq = 4063;
+
+		ret = r850_set_system(&chrdev4->tuner.r850, &sys);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: r850_set_system() failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		break;
+	}
+
+	case PTX_ISDB_S_SYSTEM:
+	{
+		ret = tc90522_write_multiple_regs(&chrdev4->tc90522,
+						  tc_init_s,
+						  ARRAY_SIZE(tc_init_s));
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_write_multiple_regs(tc_init_s) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		/* disable ts pins */
+		ret = tc90522_enable_ts_pins_s(&chrdev4->tc90522, false);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_enable_ts_pins_s(false) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		/* wake up */
+		ret = tc90522_sleep_s(&chrdev4->tc90522, false);
+		if (ret) {
+			dev_err(px4->dev,
+				"px4_chrdev_wakeup %u:%u: tc90522_sleep_s(false) failed. (ret: %d)\n",
+				chrdev_group->id, chrdev->id, ret);
+			break;
+		}
+
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	if (!ret)
+		chrdev4->awake = true;
+
+	return ret;
+}
+
 static int px4_chrdev_open(struct ptx_chrdev *chrdev)
 {
 	int ret = 0, i;
@@ -291,6 +440,11 @@ static int px4_chrdev_open(struct ptx_chrdev *chrdev)
 				chrdev_group->id, chrdev->id, ret);
 			goto fail_backend_power;
 		}
+	} else if (px4->warm) {
+		/* still powered and initialized */
+		px4->warm = false;
+		if (cancel_delayed_work(&px4->power_work))
+			kref_put(&px4->kref, px4_device_release);
 	} else if (!px4->open_count) {
 		ret = px4_backend_set_power(px4, true);
 		if (ret) {
@@ -314,7 +468,10 @@ static int px4_chrdev_open(struct ptx_chrdev *chrdev)
 				chrdev_group->id, chrdev->id, ret);
 			goto fail_backend_init;
 		}
+	}
 
+	/* with lazy_tuner_init, the tuners are left alone until they are tuned */
+	if (need_init && !px4_device_params.lazy_tuner_init) {
 		for (i = 0; i < PX4_CHRDEV_NUM; i++) {
 			struct px4_chrdev *c = &px4->chrdev4[i];
 
@@ -379,103 +536,15 @@ static int px4_chrdev_open(struct ptx_chrdev *chrdev)
 		}
 	}
 
-	/* wake up */
-	switch (chrdev->system_cap) {
-	case PTX_ISDB_T_SYSTEM:
-	{
-		struct r850_system_config sys;
-
-		ret = tc90522_write_multiple_regs(&chrdev4->tc90522,
-						  tc_init_t,
-						  ARRAY_SIZE(tc_init_t));
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_write_multiple_regs(tc_init_t) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		/* disable ts pins */
-		ret = tc90522_enable_ts_pins_t(&chrdev4->tc90522, false);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_enable_ts_pins_t(false) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		/* wake up */
-		ret = tc90522_sleep_t(&chrdev4->tc90522, false);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_sleep_t(false) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		ret = r850_wakeup(&chrdev4->tuner.r850);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: r850_wakeup() failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		sys.system = R850_SYSTEM_ISDB_T;
-		sys.bandwidth = R850_BANDWIDTH_6M;
-		sys.if_freq = 4063;
-
-		ret = r850_set_system(&chrdev4->tuner.r850, &sys);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: r850_set_system() failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		break;
-	}
-
-	case PTX_ISDB_S_SYSTEM:
-	{
-		ret = tc90522_write_multiple_regs(&chrdev4->tc90522,
-						  tc_init_s,
-						  ARRAY_SIZE(tc_init_s));
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_write_multiple_regs(tc_init_s) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		/* disable ts pins */
-		ret = tc90522_enable_ts_pins_s(&chrdev4->tc90522, false);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_enable_ts_pins_s(false) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		/* wake up */
-		ret = tc90522_sleep_s(&chrdev4->tc90522, false);
-		if (ret) {
-			dev_err(px4->dev,
-				"px4_chrdev_open %u:%u: tc90522_sleep_s(false) failed. (ret: %d)\n",
-				chrdev_group->id, chrdev->id, ret);
-			break;
-		}
-
-		break;
-	}
-
-	default:
-		break;
+	if (px4_device_params.lazy_tuner_init) {
+		/* woken up on the first tune */
+		chrdev4->awake = false;
+	} else {
+		ret = px4_chrdev_wakeup(chrdev);
+		if (ret)
+			goto fail_backend;
 	}
 
-	if (ret)
-		goto fail_backend;
-
 	if (!px4->open_count) {
 		/* S0 */
 		ret = tc90522_write_multiple_regs(&px4->chrdev4[0].tc90522,
@@ -544,11 +613,19 @@ static int px4_chrdev_release(struct ptx_chrdev *chrdev)
 	}
 
 	px4->open_count--;
-	if (!px4->open_count) {
+	if (!px4->open_count && px4->bus_streaming) {
+		dev_dbg(px4->dev,
+			"px4_chrdev_release %u:%u: stopping...\n",
+			chrdev_group->id, chrdev->id);
+		itedtv_bus_stop_streaming(&px4->it930x.bus);
+		px4->bus_streaming = false;
+	}
+
+	if (!px4->open_count && !px4_backend_keep_warm(px4)) {
 		px4_backend_term(px4);
 		if (!px4->mldev)
 			px4_backend_set_power(px4, false);
-	} else if (atomic_read(&px4->available)) {
+	} else if (atomic_read(&px4->available) && chrdev4->awake) {
 		/* sleep tuners */
 		switch (chrdev->system_cap) {
 		case PTX_ISDB_T_SYSTEM:
@@ -568,6 +645,8 @@ static int px4_chrdev_release(struct ptx_chrdev *chrdev)
 		}
 	}
 
+	chrdev4->awake = false;
+
 	if (px4->mldev)
 		px4_mldev_set_power(px4->mldev, px4, chrdev->id, false, NULL);
 
@@ -578,6 +657,23 @@ static int px4_chrdev_release(struct ptx_chrdev *chrdev)
 	return 0;
 }
 
+/* the tuner is initialized and woken up here with lazy_tuner_init */
+static int px4_chrdev_prepare_tune(struct ptx_chrdev *chrdev)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	struct px4_device *px4 = chrdev4->parent;
+
+	mutex_lock(&px4->lock);
+
+	if (!chrdev4->awake)
+		ret = px4_chrdev_wakeup(chrdev);
+
+	mutex_unlock(&px4->lock);
+
+	return ret;
+}
+
 static int px4_chrdev_tune_t(struct ptx_chrdev *chrdev,
 			     struct ptx_tune_params *params)
 {
@@ -595,6 +691,10 @@ static int px4_chrdev_tune_t(struct ptx_chrdev *chrdev,
 	if (params->system != PTX_ISDB_T_SYSTEM)
 		return -EINVAL;
 
+	ret = px4_chrdev_prepare_tune(chrdev);
+	if (ret)
+		return ret;
+
 	ret = tc90522_write_reg(tc90522, 0x47, 0x30);
 	if (ret)
 		return ret;
@@ -646,6 +746,8 @@ static int px4_chrdev_tune_t(struct ptx_chrdev *chrdev,
 		"px4_chrdev_tune_t %u:%u: PLL is locked. count: %d\n",
 		chrdev_group->id, chrdev->id, i);
 
+	ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 	ret = tc90522_set_agc_t(tc90522, true);
 	if (ret) {
 		dev_err(px4->dev,
@@ -687,6 +789,10 @@ static int px4_chrdev_tune_s(struct ptx_chrdev *chrdev,
 	if (params->system != PTX_ISDB_S_SYSTEM)
 		return -EINVAL;
 
+	ret = px4_chrdev_prepare_tune(chrdev);
+	if (ret)
+		return ret;
+
 	/* set frequency */
 
 	ret = tc90522_set_agc_s(tc90522, false);
@@ -741,6 +847,8 @@ static int px4_chrdev_tune_s(struct ptx_chrdev *chrdev,
 		"px4_chrdev_tune_s %u:%u: PLL is locked. count: %d, signal strength: %d.%03ddBm\n",
 		chrdev_group->id, chrdev->id, i, ss / 1000, -ss % 1000);
 
+	ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 	ret = tc90522_set_agc_s(tc90522, true);
 	if (ret) {
 		dev_err(px4->dev,
@@ -766,6 +874,60 @@ static int px4_chrdev_check_lock_s(struct ptx_chrdev *chrdev, bool *locked)
 	return tc90522_is_signal_locked_s(&chrdev4->tc90522, locked);
 }
 
+static int px4_chrdev_get_lock_state_t(struct ptx_chrdev *chrdev,
+				       enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	bool locked = false;
+	u8 v;
+
+	ret = tc90522_is_signal_locked_t(&chrdev4->tc90522, &locked);
+	if (ret)
+		return ret;
+
+	if (locked) {
+		*state = PTX_CHRDEV_LOCK_LOCKED;
+		return 0;
+	}
+
+	ret = tc90522_get_sync_state_t(&chrdev4->tc90522, &v);
+	if (ret)
+		return ret;
+
+	if (v >= 8)
+		*state = PTX_CHRDEV_LOCK_TMCC;
+	else if (v >= 2)
+		*state = PTX_CHRDEV_LOCK_CARRIER;
+	else
+		*state = PTX_CHRDEV_LOCK_AGC;
+
+	return 0;
+}
+
+static int px4_chrdev_get_lock_state_s(struct ptx_chrdev *chrdev,
+				       enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	u8 v;
+
+	ret = tc90522_get_status_s(&chrdev4->tc90522, &v);
+	if (ret)
+		return ret;
+
+	if (!(v & 0x10))
+		*state = PTX_CHRDEV_LOCK_LOCKED;
+	else if (!(v & 0x60))
+		*state = PTX_CHRDEV_LOCK_CARRIER;
+	else if (!(v & 0x80))
+		*state = PTX_CHRDEV_LOCK_AGC;
+	else
+		*state = PTX_CHRDEV_LOCK_SEARCHING;
+
+	return 0;
+}
+
 static int px4_chrdev_set_stream_id_s(struct ptx_chrdev *chrdev, u16 stream_id)
 {
 	int ret = 0, i;
@@ -824,8 +986,11 @@ static int px4_chrdev_set_stream_id_s(struct ptx_chrdev *chrdev, u16 stream_id)
 		msleep(10);
 	}
 
-	if (tsid2 != tsid)
+	if (tsid2 != tsid) {
+		/* resolve the slot from the TMCC again next time */
+		tc90522_tmcc_invalidate_s(tc90522);
 		ret = -EAGAIN;
+	}
 
 	return ret;
 }
@@ -884,9 +1049,9 @@ static int px4_chrdev_start_capture(struct ptx_chrdev *chrdev)
 
 	mutex_lock(&px4->lock);
 
-	if (!px4->streaming_count) {
+	if (!px4->bus_streaming) {
 		ret = it930x_purge_psb(&px4->it930x,
-				       px4_device_params.psb_purge_timeout);
+				       px4_device_psb_purge_timeout(&px4->it930x));
 		if (ret) {
 			dev_err(px4->dev,
 				"px4_chrdev_start_capture %u:%u: it930x_purge_psb() failed. (ret: %d)\n",
@@ -921,13 +1086,17 @@ static int px4_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	if (ret)
 		goto fail;
 
-	if (!px4->streaming_count) {
-		struct px4_stream_context *stream_ctx = px4->stream_ctx;
+	/* before the stream starts, which takes its share of the budget */
+	itedtv_bus_set_stream_weight(&px4->it930x.bus,
+				     px4->stream_weight + ptx_system_bitrate(chrdev->system_cap));
+
+	if (!px4->bus_streaming) {
+		struct ts_demux *stream_ctx = px4->stream_ctx;
 
-		stream_ctx->remain_len = 0;
+		ts_demux_reset(stream_ctx);
 
 		ret = itedtv_bus_start_streaming(&px4->it930x.bus,
-						 px4_device_stream_handler,
+						 ts_demux_stream_handler,
 						 stream_ctx);
 		if (ret) {
 			dev_err(px4->dev,
@@ -935,9 +1104,12 @@ static int px4_chrdev_start_capture(struct ptx_chrdev *chrdev)
 				chrdev_group->id, chrdev->id, ret);
 				goto fail_bus;
 		}
+
+		px4->bus_streaming = true;
 	}
 
 	px4->streaming_count++;
+	px4->stream_weight += ptx_system_bitrate(chrdev->system_cap);
 
 	dev_dbg(px4->dev,
 		"px4_chrdev_start_capture %u:%u: streaming_count: %u\n",
@@ -947,6 +1119,8 @@ static int px4_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	return 0;
 
 fail_bus:
+	itedtv_bus_set_stream_weight(&px4->it930x.bus, px4->stream_weight);
+
 	switch (chrdev->system_cap) {
 	case PTX_ISDB_T_SYSTEM:
 		tc90522_enable_ts_pins_t(tc90522, false);
@@ -984,11 +1158,21 @@ static int px4_chrdev_stop_capture(struct ptx_chrdev *chrdev)
 	}
 
 	px4->streaming_count--;
-	if (!px4->streaming_count) {
+	px4->stream_weight -= ptx_system_bitrate(chrdev->system_cap);
+	itedtv_bus_set_stream_weight(&px4->it930x.bus, px4->stream_weight);
+
+	if (!px4->streaming_count && px4_device_params.keep_streaming &&
+	    atomic_read(&px4->available)) {
+		/* leave the stream running until the last close */
+		dev_dbg(px4->dev,
+			"px4_chrdev_stop_capture %u:%u: keep streaming\n",
+			chrdev_group->id, chrdev->id);
+	} else if (!px4->streaming_count) {
 		dev_dbg(px4->dev,
 			"px4_chrdev_stop_capture %u:%u: stopping...\n",
 			chrdev_group->id, chrdev->id);
 		itedtv_bus_stop_streaming(&px4->it930x.bus);
+		px4->bus_streaming = false;
 	} else {
 		dev_dbg(px4->dev,
 			"px4_chrdev_stop_capture %u:%u: streaming_count: %u\n",
@@ -1036,6 +1220,115 @@ static int px4_chrdev_read_cnr_raw_s(struct ptx_chrdev *chrdev, u32 *value)
 	return tc90522_get_cn_s(&chrdev4->tc90522, (u16 *)value);
 }
 
+/* C/N in 0.01 dB units */
+static int px4_chrdev_read_cnr_t(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	u32 cndat;
+
+	ret = tc90522_get_cndat_t(&chrdev4->tc90522, &cndat);
+	if (!ret)
+		*value = tc90522_cndat_to_cnr_t(cndat);
+
+	return ret;
+}
+
+static int px4_chrdev_read_cnr_s(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	u16 cn;
+
+	ret = tc90522_get_cn_s(&chrdev4->tc90522, &cn);
+	if (!ret)
+		*value = tc90522_cn_to_cnr_s(cn);
+
+	return ret;
+}
+
+static int px4_chrdev_read_tsid_s(struct ptx_chrdev *chrdev,
+				  u16 *tsid, int num)
+{
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+
+	return tc90522_tmcc_get_tsid_list_s(&chrdev4->tc90522, tsid, num);
+}
+
+static int px4_chrdev_read_stats_t(struct ptx_chrdev *chrdev, u32 mask,
+				   struct ptx_chrdev_stat_values *values)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+
+	ret = tc90522_get_stats_t(&chrdev4->tc90522,
+				  &values->cnr_raw, &values->locked);
+	if (ret)
+		return ret;
+
+	values->cnr = tc90522_cndat_to_cnr_t(values->cnr_raw);
+	values->valid = PTX_CHRDEV_STAT_CNR | PTX_CHRDEV_STAT_CNR_RAW |
+			PTX_CHRDEV_STAT_LOCK;
+
+	return 0;
+}
+
+static int px4_chrdev_read_stats_s(struct ptx_chrdev *chrdev, u32 mask,
+				   struct ptx_chrdev_stat_values *values)
+{
+	int ret = 0;
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	u16 cn;
+
+	ret = tc90522_get_stats_s(&chrdev4->tc90522,
+				  &cn, &values->locked, &values->tsid);
+	if (ret)
+		return ret;
+
+	values->cnr = tc90522_cn_to_cnr_s(cn);
+	values->cnr_raw = cn;
+	values->valid = PTX_CHRDEV_STAT_CNR | PTX_CHRDEV_STAT_CNR_RAW |
+			PTX_CHRDEV_STAT_LOCK | PTX_CHRDEV_STAT_TSID;
+
+	return 0;
+}
+
+static int px4_chrdev_set_pid_filter(struct ptx_chrdev *chrdev,
+				     const u16 *pid, int num)
+{
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	struct px4_device *px4 = chrdev4->parent;
+	struct it930x_pid_filter filter;
+
+	if (num > ARRAY_SIZE(filter.pid))
+		return -EOPNOTSUPP;
+
+	if (num) {
+		filter.block = false;
+		filter.num = num;
+		memcpy(filter.pid, pid, sizeof(*pid) * num);
+	} else if (px4_device_params.discard_null_packets) {
+		filter.block = true;
+		filter.num = 1;
+		filter.pid[0] = 0x1fff;
+	} else {
+		filter.block = false;
+		filter.num = 0;
+	}
+
+	return it930x_set_pid_filter(&px4->it930x, chrdev->id, &filter);
+}
+
+static int px4_chrdev_set_pid_filter_entry(struct ptx_chrdev *chrdev,
+					   int index, u16 pid, bool enable)
+{
+	struct px4_chrdev *chrdev4 = chrdev->priv;
+	struct px4_device *px4 = chrdev4->parent;
+
+	return it930x_set_pid_filter_entry(&px4->it930x, chrdev->id,
+					   index, pid, enable);
+}
+
 static struct ptx_chrdev_operations px4_chrdev_t_ops = {
 	.init = px4_chrdev_init,
 	.term = px4_chrdev_term_t,
@@ -1043,12 +1336,17 @@ static struct ptx_chrdev_operations px4_chrdev_t_ops = {
 	.release = px4_chrdev_release,
 	.tune = px4_chrdev_tune_t,
 	.check_lock = px4_chrdev_check_lock_t,
+	.get_lock_state = px4_chrdev_get_lock_state_t,
 	.set_stream_id = NULL,
 	.set_lnb_voltage = NULL,
 	.set_capture = px4_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = px4_chrdev_read_cnr_raw_t
+	.read_cnr = px4_chrdev_read_cnr_t,
+	.read_cnr_raw = px4_chrdev_read_cnr_raw_t,
+	.set_pid_filter = px4_chrdev_set_pid_filter,
+	.set_pid_filter_entry = px4_chrdev_set_pid_filter_entry,
+	.read_tsid = NULL,
+	.read_stats = px4_chrdev_read_stats_t
 };
 
 static struct ptx_chrdev_operations px4_chrdev_s_ops = {
@@ -1058,12 +1356,17 @@ static struct ptx_chrdev_operations px4_chrdev_s_ops = {
 	.release = px4_chrdev_release,
 	.tune = px4_chrdev_tune_s,
 	.check_lock = px4_chrdev_check_lock_s,
+	.get_lock_state = px4_chrdev_get_lock_state_s,
 	.set_stream_id = px4_chrdev_set_stream_id_s,
 	.set_lnb_voltage = px4_chrdev_set_lnb_voltage_s,
 	.set_capture = px4_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = px4_chrdev_read_cnr_raw_s
+	.read_cnr = px4_chrdev_read_cnr_s,
+	.read_cnr_raw = px4_chrdev_read_cnr_raw_s,
+	.set_pid_filter = px4_chrdev_set_pid_filter,
+	.set_pid_filter_entry = px4_chrdev_set_pid_filter_entry,
+	.read_tsid = px4_chrdev_read_tsid_s,
+	.read_stats = px4_chrdev_read_stats_s
 };
 
 static int px4_parse_serial_number(struct px4_serial_number *serial,
@@ -1154,6 +1457,7 @@ static int px4_device_load_config(struct px4_device *px4,
 			chrdev4->tuner.r850.config.clock_out = false;
 			chrdev4->tuner.r850.config.no_imr_calibration = true;
 			chrdev4->tuner.r850.config.no_lpf_calibration = true;
+			chrdev4->tuner.r850.config.light_standby = px4_device_params.t_tuner_light_standby;
 			break;
 
 		default:
@@ -1178,7 +1482,7 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 	struct ptx_chrdev_config chrdev_config[PX4_CHRDEV_NUM];
 	struct ptx_chrdev_group_config chrdev_group_config;
 	struct ptx_chrdev_group *chrdev_group;
-	struct px4_stream_context *stream_ctx;
+	struct ts_demux *stream_ctx;
 
 	if (!px4 || !dev || !dev_serial || !chrdev_ctx || !quit_completion)
 		return -EINVAL;
@@ -1195,8 +1499,13 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 	px4->mldev = NULL;
 	px4->quit_completion = quit_completion;
 	px4->open_count = 0;
+	px4->warm = false;
+	INIT_DELAYED_WORK(&px4->power_work, px4_backend_power_work);
 	px4->lnb_power_count = 0;
 	px4->streaming_count = 0;
+	px4->stream_weight = 0;
+	px4->bus_streaming = false;
+	px4->debugfs = NULL;
 
 	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
 		struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
@@ -1231,6 +1540,8 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 		goto fail;
 	}
 	px4->stream_ctx = stream_ctx;
+	ts_demux_init(stream_ctx, &px4_demux_config);
+	ts_demux_set_clock(stream_ctx, &px4->it930x.bus.stream_time);
 
 	it930x = &px4->it930x;
 	bus = &it930x->bus;
@@ -1251,6 +1562,22 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 	if (ret)
 		goto fail_device;
 
+	px4->debugfs = px4_debugfs_create(dev, it930x);
+
+	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
+		struct px4_chrdev *chrdev4 = &px4->chrdev4[i];
+
+		px4_debugfs_add_chip(px4->debugfs, "tc90522", i,
+				     &chrdev4->tc90522.i2c_stats);
+
+		if (chrdev_config[i].system_cap == PTX_ISDB_S_SYSTEM)
+			px4_debugfs_add_chip(px4->debugfs, "rt710", i,
+					     &chrdev4->tuner.rt710.i2c_stats);
+		else
+			px4_debugfs_add_chip(px4->debugfs, "r850", i,
+					     &chrdev4->tuner.r850.i2c_stats);
+	}
+
 	for (i = 0; i < PX4_CHRDEV_NUM; i++) {
 		switch (chrdev_config[i].system_cap) {
 		case PTX_ISDB_T_SYSTEM:
@@ -1272,7 +1599,10 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 			goto fail_device;
 
 		chrdev_config[i].ringbuf_size = 188 * px4_device_params.tsdev_max_packets;
+		chrdev_config[i].ringbuf_time_t = px4_device_params.tsdev_buffer_time_t;
+		chrdev_config[i].ringbuf_time_s = px4_device_params.tsdev_buffer_time_s;
 		chrdev_config[i].ringbuf_threshold_size = chrdev_config[i].ringbuf_size / 10;
+		chrdev_config[i].max_readers = px4_device_params.tsdev_max_readers;
 		chrdev_config[i].priv = &px4->chrdev4[i];
 	}
 
@@ -1294,12 +1624,9 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 		goto fail_device;
 
 	if (use_mldev) {
-		if (px4_mldev_search(px4->serial.serial_number, &px4->mldev))
-			ret = px4_mldev_add(px4->mldev, px4);
-		else
-			ret = px4_mldev_alloc(&px4->mldev,
-					      px4_device_params.multi_device_power_control_mode,
-					      px4, px4_backend_set_power);
+		ret = px4_mldev_attach(&px4->mldev,
+				       px4_device_params.multi_device_power_control_mode,
+				       px4, px4_backend_set_power);
 
 		if (ret)
 			goto fail_device;
@@ -1338,6 +1665,8 @@ int px4_device_init(struct px4_device *px4, struct device *dev,
 
 	chrdev_group_config.owner_kref = &px4->kref;
 	chrdev_group_config.owner_kref_release = px4_device_release;
+	chrdev_group_config.bus_stats = &it930x->bus.stats;
+	chrdev_group_config.bus = &it930x->bus;
 	chrdev_group_config.reserved = false;
 	chrdev_group_config.minor_base = 0;	/* unused */
 	chrdev_group_config.chrdev_num = 4;
@@ -1364,6 +1693,7 @@ fail_device:
 	if (px4->mldev)
 		px4_mldev_remove(px4->mldev, px4);
 
+	px4_debugfs_remove(px4->debugfs);
 	it930x_term(it930x);
 
 fail_bridge:
@@ -1388,6 +1718,7 @@ static void px4_device_release(struct kref *kref)
 	if (px4->mldev)
 		px4_mldev_remove(px4->mldev, px4);
 
+	px4_debugfs_remove(px4->debugfs);
 	it930x_term(&px4->it930x);
 	itedtv_bus_term(&px4->it930x.bus);
 
@@ -1406,6 +1737,16 @@ void px4_device_term(struct px4_device *px4)
 		"px4_device_term: kref count: %u\n", kref_read(&px4->kref));
 
 	atomic_xchg(&px4->available, 0);
+
+	mutex_lock(&px4->lock);
+	if (px4->warm) {
+		/* don't keep the device around until the idle timeout */
+		kref_get(&px4->kref);
+		if (mod_delayed_work(system_wq, &px4->power_work, 0))
+			kref_put(&px4->kref, px4_device_release);
+	}
+	mutex_unlock(&px4->lock);
+
 	ptx_chrdev_group_destroy(px4->chrdev_group);
 
 	kref_put(&px4->kref, px4_device_release);
@@ -13,6 +13,7 @@
 #include <linux/kref.h>
 #include <linux/mutex.h>
 #include <linux/completion.h>
+#include <linux/workqueue.h>
 #include <linux/device.h>
 
 #include "px4_mldev.h"
@@ -21,6 +22,7 @@
 #include "tc90522.h"
 #include "r850.h"
 #include "rt710.h"
+#include "px4_debugfs.h"
 
 #define PX4_CHRDEV_NUM			4
 
@@ -30,6 +32,8 @@ struct px4_chrdev {
 	struct ptx_chrdev *chrdev;
 	struct px4_device *parent;
 	bool lnb_power;
+	bool tuner_init;		// the tuner has been initialized since power-up
+	bool awake;			// woken up for the current open
 	struct tc90522_demod tc90522;
 	union {
 		struct r850_tuner r850;
@@ -51,11 +55,17 @@ struct px4_device {
 	struct px4_mldev *mldev;
 	struct completion *quit_completion;
 	unsigned int open_count;
+	bool warm;			// powered and initialized, but not opened
+	unsigned long idle_deadline;
+	struct delayed_work power_work;
 	unsigned int lnb_power_count;
 	unsigned int streaming_count;
+	u32 stream_weight;		// of the URB budget, the streams being captured
+	bool bus_streaming;		// the shared USB stream is running
 	struct ptx_chrdev_group *chrdev_group;
 	struct px4_chrdev chrdev4[PX4_CHRDEV_NUM];
 	struct it930x_bridge it930x;
+	struct px4_debugfs *debugfs;
 	void *stream_ctx;
 };
 
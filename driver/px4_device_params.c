@@ -23,11 +23,21 @@ static const struct {
 
 struct px4_device_param_set px4_device_params = {
 	.tsdev_max_packets = 2048,
+	.tsdev_buffer_time_t = 0,
+	.tsdev_buffer_time_s = 0,
+	.tsdev_max_readers = 1,
 	.psb_purge_timeout = 2000,
+	.psb_purge_probe_timeout = 20,
+	.backend_idle_timeout = 0,
 	.disable_multi_device_power_control = false,
 	.multi_device_power_control_mode = PX4_MLDEV_ALL_MODE,
 	.s_tuner_no_sleep = false,
-	.discard_null_packets = false
+	.discard_null_packets = false,
+	.r850_cal_cache_max_age = 3600,
+	.keep_streaming = false,
+	.lazy_tuner_init = false,
+	.parallel_tuner_init = true,
+	.t_tuner_light_standby = true
 };
 
 static int set_multi_device_power_control_mode(const char *val,
@@ -71,9 +81,36 @@ module_param_named(tsdev_max_packets, px4_device_params.tsdev_max_packets,
 MODULE_PARM_DESC(tsdev_max_packets,
 		 "Maximum number of TS packets buffering in tsdev. (default: 2048)");
 
+module_param_named(tsdev_buffer_time_t, px4_device_params.tsdev_buffer_time_t,
+		   uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tsdev_buffer_time_t,
+		 "Milliseconds of an ISDB-T stream buffering in tsdev, 0 to buffer tsdev_max_packets packets. (default: 0)");
+
+module_param_named(tsdev_buffer_time_s, px4_device_params.tsdev_buffer_time_s,
+		   uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tsdev_buffer_time_s,
+		 "Milliseconds of an ISDB-S stream buffering in tsdev, 0 to buffer tsdev_max_packets packets. (default: 0)");
+
+module_param_named(tsdev_max_readers, px4_device_params.tsdev_max_readers,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tsdev_max_readers,
+		 "Maximum number of concurrent readers of a tsdev (1-8). (default: 1)");
+
 module_param_named(psb_purge_timeout, px4_device_params.psb_purge_timeout,
 		   int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
+module_param_named(psb_purge_probe_timeout,
+		   px4_device_params.psb_purge_probe_timeout,
+		   int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(psb_purge_probe_timeout,
+		 "Milliseconds to wait for more data after the stream buffer has been drained at capture start, " \
+		 "negative to wait for the whole psb_purge_timeout. (default: 20)");
+
+module_param_named(backend_idle_timeout, px4_device_params.backend_idle_timeout,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(backend_idle_timeout,
+		 "Milliseconds to keep the tuners powered after the last close, 0 to power off immediately. (default: 0)");
+
 module_param_named(disable_multi_device_power_control,
 		   px4_device_params.disable_multi_device_power_control,
 		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -87,3 +124,30 @@ module_param_named(s_tuner_no_sleep, px4_device_params.s_tuner_no_sleep,
 
 module_param_named(discard_null_packets, px4_device_params.discard_null_packets,
 		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+module_param_named(r850_calibration_cache_max_age,
+		   px4_device_params.r850_cal_cache_max_age,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(r850_calibration_cache_max_age,
+		 "Seconds to reuse the R850 calibration results across opens, 0 to always calibrate. (default: 3600)");
+
+module_param_named(keep_streaming, px4_device_params.keep_streaming,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(keep_streaming,
+		 "Keep the USB stream running while the device is open, starting and stopping a capture only switches the TS output of the demodulator. (default: false)");
+
+module_param_named(lazy_tuner_init, px4_device_params.lazy_tuner_init,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(lazy_tuner_init,
+		 "Initialize and wake up a tuner on its first tune instead of on open, and leave the unopened tuners alone. (default: false)");
+
+module_param_named(parallel_tuner_init, px4_device_params.parallel_tuner_init,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(parallel_tuner_init,
+		 "Initialize the tuners behind different demodulators at the same time on power-up. (default: true)");
+
+module_param_named(t_tuner_light_standby,
+		   px4_device_params.t_tuner_light_standby,
+		   bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(t_tuner_light_standby,
+		 "Put the idle ISDB-T tuners into a standby which keeps their settings, so that they are not programmed again on wake up. (default: true)");
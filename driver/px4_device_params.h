@@ -6,16 +6,33 @@
 #include <linux/types.h>
 
 #include "px4_mldev.h"
+#include "it930x.h"
 
 struct px4_device_param_set {
 	unsigned int tsdev_max_packets;
+	unsigned int tsdev_buffer_time_t;
+	unsigned int tsdev_buffer_time_s;
+	unsigned int tsdev_max_readers;
 	int psb_purge_timeout;
+	int psb_purge_probe_timeout;
+	unsigned int backend_idle_timeout;
 	bool disable_multi_device_power_control;
 	enum px4_mldev_mode multi_device_power_control_mode;
 	bool s_tuner_no_sleep;
 	bool discard_null_packets;
+	unsigned int r850_cal_cache_max_age;
+	bool keep_streaming;
+	bool lazy_tuner_init;
+	bool parallel_tuner_init;
+	bool t_tuner_light_standby;
 };
 
 extern struct px4_device_param_set px4_device_params;
 
+static inline int px4_device_psb_purge_timeout(const struct it930x_bridge *it930x)
+{
+	return (it930x->config.psb_purge_timeout >= 0) ? it930x->config.psb_purge_timeout
+						       : px4_device_params.psb_purge_timeout;
+}
+
 #endif
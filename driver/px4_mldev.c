@@ -14,11 +14,15 @@
 
 static LIST_HEAD(px4_mldev_list);
 static DEFINE_MUTEX(px4_mldev_glock);
+/* serializes px4_mldev_attach(), the devices of a pair may be probed in parallel */
+static DEFINE_MUTEX(px4_mldev_attach_lock);
 
 static bool px4_mldev_get_chrdev_status(struct px4_mldev *mldev,
 				       unsigned int dev_id);
 static bool px4_mldev_is_power_interlocking_required(struct px4_mldev *mldev,
 						     unsigned int dev_id);
+static void px4_mldev_power_work(struct work_struct *work);
+static void px4_mldev_release(struct kref *kref);
 
 bool px4_mldev_search(unsigned long long serial_number,
 		      struct px4_mldev **mldev)
@@ -64,10 +68,17 @@ int px4_mldev_alloc(struct px4_mldev **mldev,  enum px4_mldev_mode mode,
 	m->serial_number = px4->serial.serial_number;
 	for (i = 0; i < 2; i++) {
 		m->dev[i] = (i == dev_id) ? px4 : NULL;
-		m->power_state[i] = false;
+		m->power_state[i] = PX4_MLDEV_POWER_OFF;
+		m->power_target[i] = false;
+		m->power_busy[i] = false;
+		m->power_result[i] = 0;
+		m->power_work[i].mldev = m;
+		m->power_work[i].dev_id = i;
+		INIT_WORK(&m->power_work[i].work, px4_mldev_power_work);
 		for (j = 0; j < 4; j++)
 			m->chrdev_state[i][j] = false;
 	}
+	init_waitqueue_head(&m->power_wait);
 	m->backend_set_power = backend_set_power;
 
 	mutex_lock(&px4_mldev_glock);
@@ -96,6 +107,112 @@ static void px4_mldev_release(struct kref *kref)
 	return;
 }
 
+/*
+ * Power state machine
+ *
+ * Each half has a target power state, derived from the open chrdevs of both
+ * halves, and at most one runner which moves the half towards the target.
+ * backend_set_power() is called without mldev->lock held, so a transition
+ * of one half doesn't block the other one, and the power-up delays of both
+ * halves overlap when they are opened at the same time.
+ */
+
+/* must be called with mldev->lock held */
+static void px4_mldev_update_power_target(struct px4_mldev *mldev)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		mldev->power_target[i] = mldev->dev[i] &&
+			(px4_mldev_get_chrdev_status(mldev, i) ||
+			 px4_mldev_is_power_interlocking_required(mldev, (i) ? 0 : 1));
+}
+
+/* must be called with mldev->lock held, the lock is dropped while running */
+static void px4_mldev_power_run(struct px4_mldev *mldev, unsigned int dev_id)
+{
+	while (mldev->dev[dev_id]) {
+		struct px4_device *px4 = mldev->dev[dev_id];
+		bool target = mldev->power_target[dev_id];
+		int ret;
+
+		if ((mldev->power_state[dev_id] == PX4_MLDEV_POWER_ON) == target)
+			break;
+
+		mldev->power_state[dev_id] = (target) ? PX4_MLDEV_POWER_UP
+						      : PX4_MLDEV_POWER_DOWN;
+
+		mutex_unlock(&mldev->lock);
+		ret = mldev->backend_set_power(px4, target);
+		mutex_lock(&mldev->lock);
+
+		dev_dbg(px4->dev,
+			"px4_mldev_power_run: dev_id: %u, state: %s, ret: %d\n",
+			dev_id, (target) ? "true" : "false", ret);
+
+		mldev->power_result[dev_id] = ret;
+
+		if (ret && target) {
+			mldev->power_state[dev_id] = PX4_MLDEV_POWER_OFF;
+			break;
+		}
+
+		mldev->power_state[dev_id] = (target) ? PX4_MLDEV_POWER_ON
+						      : PX4_MLDEV_POWER_OFF;
+		wake_up_all(&mldev->power_wait);
+	}
+
+	mldev->power_busy[dev_id] = false;
+	wake_up_all(&mldev->power_wait);
+}
+
+static void px4_mldev_power_work(struct work_struct *work)
+{
+	struct px4_mldev_power_work *w = container_of(work,
+						      struct px4_mldev_power_work,
+						      work);
+	struct px4_mldev *mldev = w->mldev;
+
+	mutex_lock(&mldev->lock);
+	px4_mldev_power_run(mldev, w->dev_id);
+	mutex_unlock(&mldev->lock);
+
+	/* the reference was taken by px4_mldev_power_kick() */
+	kref_put(&mldev->kref, px4_mldev_release);
+}
+
+/* must be called with mldev->lock held */
+static void px4_mldev_power_kick(struct px4_mldev *mldev, unsigned int dev_id,
+				 bool async)
+{
+	if (!mldev->dev[dev_id] || mldev->power_busy[dev_id])
+		return;
+
+	if ((mldev->power_state[dev_id] == PX4_MLDEV_POWER_ON) ==
+	    mldev->power_target[dev_id])
+		return;
+
+	mldev->power_busy[dev_id] = true;
+
+	if (async) {
+		kref_get(&mldev->kref);
+		queue_work(system_unbound_wq, &mldev->power_work[dev_id].work);
+	} else {
+		px4_mldev_power_run(mldev, dev_id);
+	}
+}
+
+/* must be called with mldev->lock held */
+static void px4_mldev_power_wait(struct px4_mldev *mldev, unsigned int dev_id)
+{
+	while (mldev->power_busy[dev_id]) {
+		mutex_unlock(&mldev->lock);
+		wait_event(mldev->power_wait,
+			   !READ_ONCE(mldev->power_busy[dev_id]));
+		mutex_lock(&mldev->lock);
+	}
+}
+
 int px4_mldev_add(struct px4_mldev *mldev, struct px4_device *px4)
 {
 	int ret = 0, i;
@@ -120,19 +237,26 @@ int px4_mldev_add(struct px4_mldev *mldev, struct px4_device *px4)
 		goto exit;
 	}
 
-	mldev->power_state[dev_id] = false;
+	mldev->power_state[dev_id] = PX4_MLDEV_POWER_OFF;
+	mldev->power_result[dev_id] = 0;
 	for (i = 0; i < 4; i++)
 		mldev->chrdev_state[dev_id][i] = false;
 
-	if (px4_mldev_is_power_interlocking_required(mldev, (dev_id) ? 0 : 1)) {
-		ret = mldev->backend_set_power(px4, true);
-		if (ret)
-			goto exit;
+	mldev->dev[dev_id] = px4;
+	px4_mldev_update_power_target(mldev);
+
+	/* the other half may already require this one to be powered */
+	px4_mldev_power_kick(mldev, dev_id, false);
+	px4_mldev_power_wait(mldev, dev_id);
 
-		mldev->power_state[dev_id] = true;
+	if (mldev->power_target[dev_id] &&
+	    mldev->power_state[dev_id] != PX4_MLDEV_POWER_ON) {
+		ret = mldev->power_result[dev_id] ?: -EIO;
+		mldev->dev[dev_id] = NULL;
+		mldev->power_target[dev_id] = false;
+		goto exit;
 	}
 
-	mldev->dev[dev_id] = px4;
 	kref_get(&mldev->kref);
 
 exit:
@@ -140,6 +264,24 @@ exit:
 	return ret;
 }
 
+int px4_mldev_attach(struct px4_mldev **mldev, enum px4_mldev_mode mode,
+		     struct px4_device *px4,
+		     int (*backend_set_power)(struct px4_device *, bool))
+{
+	int ret = 0;
+
+	mutex_lock(&px4_mldev_attach_lock);
+
+	if (px4_mldev_search(px4->serial.serial_number, mldev))
+		ret = px4_mldev_add(*mldev, px4);
+	else
+		ret = px4_mldev_alloc(mldev, mode, px4, backend_set_power);
+
+	mutex_unlock(&px4_mldev_attach_lock);
+
+	return ret;
+}
+
 int px4_mldev_remove(struct px4_mldev *mldev, struct px4_device *px4)
 {
 	int i;
@@ -160,20 +302,24 @@ int px4_mldev_remove(struct px4_mldev *mldev, struct px4_device *px4)
 		return -EINVAL;
 	}
 
-	if (mldev->power_state[dev_id])
+	px4_mldev_power_wait(mldev, dev_id);
+
+	if (mldev->power_state[dev_id] == PX4_MLDEV_POWER_ON)
 		mldev->backend_set_power(px4, false);
 
 	mldev->dev[dev_id] = NULL;
-	mldev->power_state[dev_id] = false;
+	mldev->power_state[dev_id] = PX4_MLDEV_POWER_OFF;
 	for (i = 0; i < 4; i++)
 		mldev->chrdev_state[dev_id][i] = false;
 
-	if (mldev->dev[other_dev_id] &&
-	    !px4_mldev_get_chrdev_status(mldev, other_dev_id) &&
-	    mldev->power_state[other_dev_id]) {
-		mldev->backend_set_power(mldev->dev[other_dev_id], false);
-		mldev->power_state[other_dev_id] = false;
-	}
+	/* the other half isn't needed to be powered for this one any more */
+	px4_mldev_update_power_target(mldev);
+	px4_mldev_power_kick(mldev, other_dev_id, true);
+
+	/* a runner might still be about to drop its reference */
+	mutex_unlock(&mldev->lock);
+	flush_work(&mldev->power_work[dev_id].work);
+	mutex_lock(&mldev->lock);
 
 	if (kref_put(&mldev->kref, px4_mldev_release))
 		return 0;
@@ -222,25 +368,25 @@ int px4_mldev_set_power(struct px4_mldev *mldev, struct px4_device *px4,
 	int ret = 0;
 	unsigned int dev_id = px4->serial.dev_id - 1;
 	unsigned int other_dev_id = (dev_id) ? 0 : 1;
+	bool opened;
+
+	if (dev_id > 1 || chrdev_id > 3)
+		return -EINVAL;
+
+	mutex_lock(&mldev->lock);
 
 	dev_dbg(px4->dev,
 		"px4_mldev_set_power: serial_number: %014llu, dev_id: %u, chrdev_id: %u state: %s\n",
 		mldev->serial_number, dev_id, chrdev_id,
 		(state) ? "true" : "false");
 	dev_dbg(px4->dev,
-		"px4_mldev_set_power: power_state: %s, %s\n",
-		(mldev->power_state[0]) ? "true" : "false",
-		(mldev->power_state[1]) ? "true" : "false");
+		"px4_mldev_set_power: power_state: %d, %d\n",
+		mldev->power_state[0], mldev->power_state[1]);
 	dev_dbg(px4->dev,
 		"px4_mldev_set_power: chrdev_state[%u][%u]: %s\n",
-		dev_id, chrdev_id, 
+		dev_id, chrdev_id,
 		(mldev->chrdev_state[dev_id][chrdev_id]) ? "true" : "false");
 
-	if (dev_id > 1 || chrdev_id > 3)
-		return -EINVAL;
-
-	mutex_lock(&mldev->lock);
-
 	if (mldev->dev[dev_id] != px4) {
 		ret = -EINVAL;
 		goto exit;
@@ -249,44 +395,42 @@ int px4_mldev_set_power(struct px4_mldev *mldev, struct px4_device *px4,
 	if (mldev->chrdev_state[dev_id][chrdev_id] == state)
 		goto exit;
 
-	if (!state)
-		mldev->chrdev_state[dev_id][chrdev_id] = false;
+	opened = px4_mldev_get_chrdev_status(mldev, dev_id);
 
-	if (!px4_mldev_get_chrdev_status(mldev, dev_id)) {
-		if (mldev->power_state[dev_id] != state &&
-		    (state || !px4_mldev_is_power_interlocking_required(mldev, other_dev_id))) {
-			ret = mldev->backend_set_power(mldev->dev[dev_id],
-						       state);
-			if (ret && state)
-				goto exit;
+	mldev->chrdev_state[dev_id][chrdev_id] = state;
+	px4_mldev_update_power_target(mldev);
 
-			mldev->power_state[dev_id] = state;
-		}
+	dev_dbg(px4->dev,
+		"px4_mldev_set_power: power_target: %s, %s\n",
+		(mldev->power_target[0]) ? "true" : "false",
+		(mldev->power_target[1]) ? "true" : "false");
 
-		if (state && first)
-			*first = true;
-	}
+	/* the other half is sequenced in parallel with this one */
+	px4_mldev_power_kick(mldev, other_dev_id, true);
+	px4_mldev_power_kick(mldev, dev_id, false);
 
-	if (state)
-		mldev->chrdev_state[dev_id][chrdev_id] = true;
+	if (!state)
+		goto exit;
 
-	if (mldev->dev[other_dev_id]) {
-		bool interlocking = px4_mldev_is_power_interlocking_required(mldev, dev_id);
+	/* the half may be in a transition started by the other one */
+	px4_mldev_power_wait(mldev, dev_id);
 
-		dev_dbg(px4->dev,
-			"px4_mldev_set_power: interlocking: %s\n",
-			(interlocking) ? "true" : "false");
-
-		if (interlocking == state &&
-		    mldev->power_state[other_dev_id] != interlocking &&
-		    (state || !px4_mldev_get_chrdev_status(mldev, other_dev_id))) {
-			ret = mldev->backend_set_power(mldev->dev[other_dev_id],
-						       state);
-			if (!ret || !state)
-				mldev->power_state[other_dev_id] = state;
-		}
+	if (mldev->power_state[dev_id] != PX4_MLDEV_POWER_ON) {
+		ret = mldev->power_result[dev_id] ?: -EIO;
+
+		mldev->chrdev_state[dev_id][chrdev_id] = false;
+		px4_mldev_update_power_target(mldev);
+		px4_mldev_power_kick(mldev, other_dev_id, true);
+		goto exit;
 	}
 
+	/* don't return before the other half has been powered for this one */
+	if (mldev->power_target[other_dev_id])
+		px4_mldev_power_wait(mldev, other_dev_id);
+
+	if (!opened && first)
+		*first = true;
+
 exit:
 	mutex_unlock(&mldev->lock);
 	return ret;
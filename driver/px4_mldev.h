@@ -12,6 +12,8 @@
 #include <linux/kref.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "px4_device.h"
 
@@ -22,6 +24,21 @@ enum px4_mldev_mode {
 	PX4_MLDEV_S1_ONLY_MODE,
 };
 
+enum px4_mldev_power_state {
+	PX4_MLDEV_POWER_OFF = 0,
+	PX4_MLDEV_POWER_UP,		// backend_set_power(true) in progress
+	PX4_MLDEV_POWER_ON,
+	PX4_MLDEV_POWER_DOWN,		// backend_set_power(false) in progress
+};
+
+struct px4_mldev;
+
+struct px4_mldev_power_work {
+	struct work_struct work;
+	struct px4_mldev *mldev;
+	unsigned int dev_id;
+};
+
 struct px4_mldev {
 	struct kref kref;
 	struct list_head list;
@@ -29,7 +46,12 @@ struct px4_mldev {
 	enum px4_mldev_mode mode;
 	unsigned long long serial_number;
 	struct px4_device *dev[2];
-	bool power_state[2];
+	enum px4_mldev_power_state power_state[2];
+	bool power_target[2];
+	bool power_busy[2];		// a transition of the half is running
+	int power_result[2];
+	struct px4_mldev_power_work power_work[2];
+	wait_queue_head_t power_wait;
 	bool chrdev_state[2][4];
 	int (*backend_set_power)(struct px4_device *px4, bool state);
 };
@@ -40,6 +62,9 @@ int px4_mldev_alloc(struct px4_mldev **mldev, enum px4_mldev_mode mode,
 		    struct px4_device *px4,
 		    int (*backend_set_power)(struct px4_device *, bool));
 int px4_mldev_add(struct px4_mldev *mldev, struct px4_device *px4);
+int px4_mldev_attach(struct px4_mldev **mldev, enum px4_mldev_mode mode,
+		     struct px4_device *px4,
+		     int (*backend_set_power)(struct px4_device *, bool));
 int px4_mldev_remove(struct px4_mldev *mldev, struct px4_device *px4);
 int px4_mldev_set_power(struct px4_mldev *mldev, struct px4_device *px4,
 			unsigned int chrdev_id, bool state, bool *first);
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Tracepoint definitions (px4_trace.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM px4_drv
+
+#if !defined(__PX4_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __PX4_TRACE_H__
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(px4_tune_start,
+	TP_PROTO(unsigned int group, unsigned int id,
+		 int system, u32 freq, u32 stream_id),
+	TP_ARGS(group, id, system, freq, stream_id),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(int, system)
+		__field(u32, freq)
+		__field(u32, stream_id)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->system = system;
+		__entry->freq = freq;
+		__entry->stream_id = stream_id;
+	),
+	TP_printk("%u:%u system=%d freq=%u stream_id=0x%x",
+		  __entry->group, __entry->id, __entry->system,
+		  __entry->freq, __entry->stream_id)
+);
+
+TRACE_EVENT(px4_tune_end,
+	TP_PROTO(unsigned int group, unsigned int id,
+		 int system, u32 freq, int result,
+		 unsigned int polls, u64 duration),
+	TP_ARGS(group, id, system, freq, result, polls, duration),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(int, system)
+		__field(u32, freq)
+		__field(int, result)
+		__field(unsigned int, polls)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->system = system;
+		__entry->freq = freq;
+		__entry->result = result;
+		__entry->polls = polls;
+		__entry->duration = duration;
+	),
+	TP_printk("%u:%u system=%d freq=%u result=%d polls=%u duration=%lluns",
+		  __entry->group, __entry->id, __entry->system,
+		  __entry->freq, __entry->result, __entry->polls,
+		  (unsigned long long)__entry->duration)
+);
+
+/* elapsed: since the tune started, or since the open for the open phase */
+TRACE_EVENT(px4_tune_phase,
+	TP_PROTO(unsigned int group, unsigned int id,
+		 int phase, u64 elapsed),
+	TP_ARGS(group, id, phase, elapsed),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(int, phase)
+		__field(u64, elapsed)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->phase = phase;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("%u:%u phase=%d elapsed=%lluns",
+		  __entry->group, __entry->id, __entry->phase,
+		  (unsigned long long)__entry->elapsed)
+);
+
+TRACE_EVENT(px4_lock_poll,
+	TP_PROTO(unsigned int group, unsigned int id,
+		 unsigned int poll, bool locked, int ret),
+	TP_ARGS(group, id, poll, locked, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(unsigned int, poll)
+		__field(bool, locked)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->poll = poll;
+		__entry->locked = locked;
+		__entry->ret = ret;
+	),
+	TP_printk("%u:%u poll=%u locked=%d ret=%d",
+		  __entry->group, __entry->id, __entry->poll,
+		  __entry->locked, __entry->ret)
+);
+
+/* latency: from the URB completion to the stream handler being called */
+TRACE_EVENT(px4_urb_complete,
+	TP_PROTO(const void *bus, u32 index, u32 len, u64 latency),
+	TP_ARGS(bus, index, len, latency),
+	TP_STRUCT__entry(
+		__field(const void *, bus)
+		__field(u32, index)
+		__field(u32, len)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->index = index;
+		__entry->len = len;
+		__entry->latency = latency;
+	),
+	TP_printk("bus=%p urb=%u len=%u latency=%lluns",
+		  __entry->bus, __entry->index, __entry->len,
+		  (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(px4_ringbuf_wakeup,
+	TP_PROTO(unsigned int group, unsigned int id, int reader,
+		 size_t readable, size_t size),
+	TP_ARGS(group, id, reader, readable, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(int, reader)
+		__field(size_t, readable)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->reader = reader;
+		__entry->readable = readable;
+		__entry->size = size;
+	),
+	TP_printk("%u:%u reader=%d readable=%zu size=%zu",
+		  __entry->group, __entry->id, __entry->reader,
+		  __entry->readable, __entry->size)
+);
+
+/* data not written for every reader */
+TRACE_EVENT(px4_ringbuf_overflow,
+	TP_PROTO(unsigned int group, unsigned int id, size_t dropped),
+	TP_ARGS(group, id, dropped),
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, id)
+		__field(size_t, dropped)
+	),
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->id = id;
+		__entry->dropped = dropped;
+	),
+	TP_printk("%u:%u dropped=%zu",
+		  __entry->group, __entry->id, __entry->dropped)
+);
+
+/* oldest data discarded for a single reader (RINGBUFFER_DROP_OLDEST) */
+TRACE_EVENT(px4_ringbuf_drop,
+	TP_PROTO(const void *ringbuf, int reader, size_t dropped),
+	TP_ARGS(ringbuf, reader, dropped),
+	TP_STRUCT__entry(
+		__field(const void *, ringbuf)
+		__field(int, reader)
+		__field(size_t, dropped)
+	),
+	TP_fast_assign(
+		__entry->ringbuf = ringbuf;
+		__entry->reader = reader;
+		__entry->dropped = dropped;
+	),
+	TP_printk("ringbuf=%p reader=%d dropped=%zu",
+		  __entry->ringbuf, __entry->reader, __entry->dropped)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE px4_trace
+#include <trace/define_trace.h>
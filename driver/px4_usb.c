@@ -13,6 +13,7 @@
 #include <linux/mutex.h>
 #include <linux/completion.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/usb.h>
@@ -61,10 +62,18 @@
 #endif
 #define PXS1UR_USB_MAX_CHRDEV	(PXS1UR_USB_MAX_DEVICE * ISDB2056_CHRDEV_NUM)
 
+/* the bridge takes the transfer size in units of 4 bytes, in 16 bits */
+#define PX4_USB_MAX_XFER_PACKETS	((0xffff * 4) / 188)
+
 
 struct px4_usb_context {
 	enum px4_usb_device_type type;
 	struct completion quit_completion;
+	struct usb_interface *intf;
+	const struct usb_device_id *id;
+	struct work_struct init_work;
+	int init_ret;	/* -EINPROGRESS until the device has been initialized */
+	struct it930x_bridge *it930x;
 	union {
 		struct px4_device px4;
 		struct pxmlt_device pxmlt;
@@ -76,47 +85,278 @@ struct px4_usb_context {
 
 static struct ptx_chrdev_context *px4_usb_chrdev_ctx[MAX_USB_DEVICE_TYPE];
 
-static int px4_usb_init_bridge(struct device *dev, struct usb_device *usb_dev,
+static struct ptx_chrdev_group *px4_usb_chrdev_group(struct px4_usb_context *ctx)
+{
+	switch (ctx->type) {
+	case PX4_USB_DEVICE:
+		return ctx->ctx.px4.chrdev_group;
+
+	case PXMLT5_USB_DEVICE:
+	case PXMLT8_USB_DEVICE:
+	case ISDB6014_4TS_USB_DEVICE:
+		return ctx->ctx.pxmlt.chrdev_group;
+
+	case ISDB2056_USB_DEVICE:
+		return ctx->ctx.isdb2056.chrdev_group;
+
+	case PXM1UR_USB_DEVICE:
+		return ctx->ctx.m1ur.chrdev_group;
+
+	case PXS1UR_USB_DEVICE:
+		return ctx->ctx.s1ur.chrdev_group;
+
+	default:
+		return NULL;
+	}
+}
+
+/* called by the stream watchdog of the bus, with the pipe stopped */
+static void px4_usb_restart_stream(void *context)
+{
+	int ret = 0;
+	struct px4_usb_context *ctx = context;
+	struct it930x_bridge *it930x = ctx->it930x;
+	struct ptx_chrdev_group *chrdev_group = px4_usb_chrdev_group(ctx);
+
+	ret = it930x_purge_psb(it930x, px4_device_psb_purge_timeout(it930x));
+	if (ret)
+		dev_err(it930x->dev,
+			"px4_usb_restart_stream: it930x_purge_psb() failed. (ret: %d)\n",
+			ret);
+
+	if (chrdev_group)
+		ptx_chrdev_group_report_restart(chrdev_group);
+
+	return;
+}
+
+/*
+ * The bridge ends a transfer every xfer_size bytes with a short packet, so a
+ * URB of the same size receives exactly one transfer. The packets then never
+ * straddle two URBs and the stream handler has nothing to reassemble. A
+ * smaller URB would also have to end on a bulk packet boundary.
+ */
+static void px4_usb_negotiate_xfer_size(struct device *dev,
+					struct it930x_bridge *it930x)
+{
+	u32 xfer = px4_usb_params.xfer_packets;
+	u32 urb = px4_usb_params.urb_max_packets;
+	u32 num;
+
+	num = clamp_val(min(xfer, urb), 1, PX4_USB_MAX_XFER_PACKETS);
+
+	it930x->config.xfer_size = 188 * num;
+	it930x->bus.usb.streaming.urb_buffer_size = 188 * num;
+
+	if (num != xfer || num != urb)
+		dev_info(dev,
+			 "Transfer size: %u packets (xfer_packets: %u, urb_max_packets: %u)\n",
+			 num, xfer, urb);
+	else
+		dev_info(dev, "Transfer size: %u packets\n", num);
+
+	return;
+}
+
+static int px4_usb_init_bridge(struct px4_usb_context *ctx,
+			       struct device *dev, struct usb_device *usb_dev,
 			       struct it930x_bridge *it930x)
 {
 	struct itedtv_bus *bus = &it930x->bus;
 
+	ctx->it930x = it930x;
+
 	bus->dev = dev;
 	bus->type = ITEDTV_BUS_USB;
 	bus->usb.dev = usb_dev;
 	bus->usb.ctrl_timeout = px4_usb_params.ctrl_timeout;
-	bus->usb.streaming.urb_buffer_size = 188 * px4_usb_params.urb_max_packets;
 	bus->usb.streaming.urb_num = px4_usb_params.max_urbs;
 	bus->usb.streaming.no_dma = px4_usb_params.no_dma;
+	bus->usb.streaming.dma_probe = px4_usb_params.dma_probe;
+	bus->usb.streaming.adaptive = px4_usb_params.adaptive_urbs;
+	bus->usb.streaming.urb_min_num = px4_usb_params.min_urbs;
+	bus->usb.streaming.workqueue = px4_usb_params.urb_workqueue;
+	bus->usb.streaming.double_buffer = px4_usb_params.urb_double_buffer;
+	bus->usb.streaming.sg = px4_usb_params.urb_sg;
+	bus->usb.streaming.wq_max_active = px4_usb_params.urb_wq_max_active;
+	bus->usb.streaming.watchdog_timeout = px4_usb_params.stream_watchdog;
+	bus->usb.streaming.restart_handler = px4_usb_restart_stream;
+	bus->usb.streaming.restart_context = ctx;
+
+	/* module-wide, taken again on each probe */
+	itedtv_bus_set_urb_budget(px4_usb_params.urb_budget);
 
 	it930x->dev = dev;
-	it930x->config.xfer_size = 188 * px4_usb_params.xfer_packets;
 	it930x->config.i2c_speed = 0x07;
+	it930x->config.psb_purge_timeout = -1;
+	it930x->config.psb_purge_probe = px4_device_params.psb_purge_probe_timeout;
+	it930x->config.ctrl_pipeline = px4_usb_params.ctrl_pipeline;
+	it930x->config.fw_pipeline_depth = clamp_val(px4_usb_params.fw_pipeline_depth,
+						     1, 16);
+	it930x->config.warm_reattach = px4_usb_params.warm_reattach;
+
+	px4_usb_negotiate_xfer_size(dev, it930x);
 
 	return 0;
 }
 
-static int px4_usb_probe(struct usb_interface *intf,
-			 const struct usb_device_id *id)
+/*
+ * Per-device overrides of the module parameters.
+ * The URB settings take effect the next time streaming is started.
+ */
+static ssize_t max_urbs_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ctx->it930x->bus.usb.streaming.urb_num);
+}
+
+static ssize_t max_urbs_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
 	int ret = 0;
-	struct device *dev;
-	struct usb_device *usb_dev;
-	struct px4_usb_context *ctx;
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+	unsigned int val;
 
-	dev = &intf->dev;
-	usb_dev = interface_to_usbdev(intf);
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	if (usb_dev->speed < USB_SPEED_HIGH)
-		dev_warn(dev, "This device is operating as USB 1.1.\n");
+	if (!val)
+		return -EINVAL;
 
-	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
-	if (!ctx) {
-		dev_err(dev, "px4_usb_probe: kzalloc(sizeof(*ctx)) failed.\n");
-		return -ENOMEM;
-	}
+	WRITE_ONCE(ctx->it930x->bus.usb.streaming.urb_num, val);
 
-	init_completion(&ctx->quit_completion);
+	return count;
+}
+
+static DEVICE_ATTR_RW(max_urbs);
+
+static ssize_t urb_max_packets_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n",
+		       ctx->it930x->bus.usb.streaming.urb_buffer_size / 188);
+}
+
+static ssize_t urb_max_packets_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int ret = 0;
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+	unsigned int val;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	if (!val || val > (INT_MAX / 188))
+		return -EINVAL;
+
+	/* allowed, but the stream handler has to reassemble the packets */
+	if (188 * val != ctx->it930x->config.xfer_size)
+		dev_info(dev,
+			 "urb_max_packets_store: %u packets don't match the transfer size. (xfer_packets: %u)\n",
+			 val, ctx->it930x->config.xfer_size / 188);
+
+	WRITE_ONCE(ctx->it930x->bus.usb.streaming.urb_buffer_size, 188 * val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(urb_max_packets);
+
+/* the transfer size of the bridge, set once on initialization */
+static ssize_t xfer_packets_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ctx->it930x->config.xfer_size / 188);
+}
+
+static DEVICE_ATTR_RO(xfer_packets);
+
+static ssize_t urb_workqueue_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n",
+		       ctx->it930x->bus.usb.streaming.workqueue ? 1 : 0);
+}
+
+static ssize_t urb_workqueue_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int ret = 0;
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+	bool val;
+
+	ret = kstrtobool(buf, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ctx->it930x->bus.usb.streaming.workqueue, val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(urb_workqueue);
+
+static ssize_t psb_purge_timeout_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", ctx->it930x->config.psb_purge_timeout);
+}
+
+static ssize_t psb_purge_timeout_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int ret = 0;
+	struct px4_usb_context *ctx = dev_get_drvdata(dev);
+	int val;
+
+	/* negative: follow the psb_purge_timeout module parameter */
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ctx->it930x->config.psb_purge_timeout, (val < 0) ? -1 : val);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(psb_purge_timeout);
+
+static struct attribute *px4_usb_attrs[] = {
+	&dev_attr_max_urbs.attr,
+	&dev_attr_urb_max_packets.attr,
+	&dev_attr_xfer_packets.attr,
+	&dev_attr_urb_workqueue.attr,
+	&dev_attr_psb_purge_timeout.attr,
+	NULL
+};
+
+static const struct attribute_group px4_usb_attr_group = {
+	.attrs = px4_usb_attrs,
+};
+
+static int px4_usb_init_device(struct px4_usb_context *ctx)
+{
+	int ret = 0;
+	struct device *dev = &ctx->intf->dev;
+	struct usb_device *usb_dev = interface_to_usbdev(ctx->intf);
+	const struct usb_device_id *id = ctx->id;
 
 	switch (id->idVendor) {
 	case 0x0511:
@@ -138,7 +378,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 		case USB_PID_PX_W3U4:
 		case USB_PID_PX_W3PE4:
 		case USB_PID_PX_W3PE5:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.px4.it930x);
 			if (ret)
 				break;
@@ -154,7 +394,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			pxmlt5_model = PXMLT5U_MODEL;
 			/* fall through */
 		case USB_PID_PX_MLT5PE:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.pxmlt.it930x);
 			if (ret)
 				break;
@@ -169,7 +409,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			pxmlt8_model = PXMLT8PE3_MODEL;
 			/* fall through */
 		case USB_PID_PX_MLT8PE5:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.pxmlt.it930x);
 			if (ret)
 				break;
@@ -181,7 +421,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			break;
 
 		case USB_PID_DIGIBEST_ISDB2056:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.isdb2056.it930x);
 			if (ret)
 				break;
@@ -193,7 +433,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			break;
 
 		case USB_PID_DIGIBEST_ISDB6014_4TS:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.pxmlt.it930x);
 			if (ret)
 				break;
@@ -205,7 +445,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			break;
 
 		case USB_PID_PX_M1UR:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 						  &ctx->ctx.isdb2056.it930x);
 			if (ret)
 				break;
@@ -217,7 +457,7 @@ static int px4_usb_probe(struct usb_interface *intf,
 			break;
 
 		case USB_PID_PX_S1UR:
-			ret = px4_usb_init_bridge(dev, usb_dev,
+			ret = px4_usb_init_bridge(ctx, dev, usb_dev,
 							&ctx->ctx.s1ur.it930x);
 			if (ret)
 				break;
@@ -242,12 +482,80 @@ static int px4_usb_probe(struct usb_interface *intf,
 		break;
 	}
 
+	return ret;
+}
+
+/* firmware download, warm init and the chrdevs, without holding up the other devices */
+static void px4_usb_init_work(struct work_struct *work)
+{
+	int ret = 0;
+	struct px4_usb_context *ctx = container_of(work,
+						   struct px4_usb_context,
+						   init_work);
+	struct device *dev = &ctx->intf->dev;
+
+	ret = px4_usb_init_device(ctx);
+	if (ret) {
+		dev_err(dev, "px4_usb_init_work: px4_usb_init_device() failed. (ret: %d)\n", ret);
+		WRITE_ONCE(ctx->init_ret, ret);
+		return;
+	}
+
+	if (sysfs_create_group(&dev->kobj, &px4_usb_attr_group))
+		dev_warn(dev, "px4_usb_init_work: sysfs_create_group() failed.\n");
+
+	WRITE_ONCE(ctx->init_ret, 0);
+
+	return;
+}
+
+static int px4_usb_probe(struct usb_interface *intf,
+			 const struct usb_device_id *id)
+{
+	int ret = 0;
+	struct device *dev;
+	struct usb_device *usb_dev;
+	struct px4_usb_context *ctx;
+
+	dev = &intf->dev;
+	usb_dev = interface_to_usbdev(intf);
+
+	if (usb_dev->speed < USB_SPEED_HIGH)
+		dev_warn(dev, "This device is operating as USB 1.1.\n");
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx) {
+		dev_err(dev, "px4_usb_probe: kzalloc(sizeof(*ctx)) failed.\n");
+		return -ENOMEM;
+	}
+
+	init_completion(&ctx->quit_completion);
+	ctx->intf = intf;
+	ctx->id = id;
+	ctx->init_ret = -EINPROGRESS;
+	INIT_WORK(&ctx->init_work, px4_usb_init_work);
+
+	if (px4_usb_params.async_probe) {
+		/* the device stays bound even if the deferred init fails */
+		get_device(dev);
+		usb_set_intfdata(intf, ctx);
+		queue_work(system_unbound_wq, &ctx->init_work);
+
+		return 0;
+	}
+
+	ret = px4_usb_init_device(ctx);
 	if (ret)
 		goto fail;
 
+	ctx->init_ret = 0;
+
 	get_device(dev);
 	usb_set_intfdata(intf, ctx);
 
+	if (sysfs_create_group(&dev->kobj, &px4_usb_attr_group))
+		dev_warn(dev, "px4_usb_probe: sysfs_create_group() failed.\n");
+
 	return 0;
 
 fail:
@@ -267,6 +575,15 @@ static void px4_usb_disconnect(struct usb_interface *intf)
 		return;
 	}
 
+	/* waits for the deferred init */
+	cancel_work_sync(&ctx->init_work);
+
+	if (ctx->init_ret) {
+		usb_set_intfdata(intf, NULL);
+		goto release;
+	}
+
+	sysfs_remove_group(&intf->dev.kobj, &px4_usb_attr_group);
 	usb_set_intfdata(intf, NULL);
 
 	switch (ctx->type) {
@@ -302,6 +619,7 @@ static void px4_usb_disconnect(struct usb_interface *intf)
 		break;
 	}
 
+release:
 	dev_dbg(&intf->dev, "px4_usb_disconnect: release\n");
 
 	put_device(&intf->dev);
@@ -310,14 +628,46 @@ static void px4_usb_disconnect(struct usb_interface *intf)
 	return;
 }
 
+/*
+ * The tuners keep their settings while the device is suspended, the capture
+ * is stopped and the tuners are retuned in the background on resume.
+ * A device which lost its power is probed again by the USB core instead,
+ * as there is no reset_resume.
+ */
 static int px4_usb_suspend(struct usb_interface *intf, pm_message_t message)
 {
-	return -ENOSYS;
+	struct px4_usb_context *ctx = usb_get_intfdata(intf);
+	struct ptx_chrdev_group *chrdev_group;
+
+	if (!ctx)
+		return 0;
+
+	/* waits for the deferred init */
+	flush_work(&ctx->init_work);
+
+	if (ctx->init_ret)
+		return 0;
+
+	chrdev_group = px4_usb_chrdev_group(ctx);
+	if (!chrdev_group)
+		return 0;
+
+	return ptx_chrdev_group_suspend(chrdev_group);
 }
 
 static int px4_usb_resume(struct usb_interface *intf)
 {
-	return 0;
+	struct px4_usb_context *ctx = usb_get_intfdata(intf);
+	struct ptx_chrdev_group *chrdev_group;
+
+	if (!ctx || READ_ONCE(ctx->init_ret))
+		return 0;
+
+	chrdev_group = px4_usb_chrdev_group(ctx);
+	if (!chrdev_group)
+		return 0;
+
+	return ptx_chrdev_group_resume(chrdev_group);
 }
 
 static const struct usb_device_id px4_usb_ids[] = {
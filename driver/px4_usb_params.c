@@ -12,10 +12,23 @@
 
 struct px4_usb_param_set px4_usb_params = {
 	.ctrl_timeout = 3000,
+	.ctrl_pipeline = false,
+	.fw_pipeline_depth = 1,
 	.xfer_packets = 816,
 	.urb_max_packets = 816,
 	.max_urbs = 6,
-	.no_dma = false
+	.no_dma = false,
+	.dma_probe = false,
+	.adaptive_urbs = false,
+	.min_urbs = 2,
+	.urb_budget = 0,
+	.urb_workqueue = false,
+	.urb_double_buffer = false,
+	.urb_sg = false,
+	.urb_wq_max_active = 0,
+	.stream_watchdog = 0,
+	.async_probe = true,
+	.warm_reattach = true
 };
 
 module_param_named(ctrl_timeout, px4_usb_params.ctrl_timeout,
@@ -24,15 +37,29 @@ MODULE_PARM_DESC(ctrl_timeout,
 		 "Time in msecs to wait for the message to complete " \
 		 "before timing out (if 0 the wait is forever). (default: 3000)");
 
+module_param_named(ctrl_pipeline, px4_usb_params.ctrl_pipeline,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(ctrl_pipeline,
+		 "Send control messages without waiting for the responses " \
+		 "to the preceding ones. (default: false)");
+
+module_param_named(fw_pipeline_depth, px4_usb_params.fw_pipeline_depth,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(fw_pipeline_depth,
+		 "Number of firmware blocks in flight while loading " \
+		 "the firmware (1-16, 1: wait for each block). (default: 1)");
+
 module_param_named(xfer_packets, px4_usb_params.xfer_packets,
 		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(xfer_packets,
-		 "Number of transfer packets from the device. (default: 816)");
+		 "Number of transfer packets from the device, the URBs are " \
+		 "sized to match it. (default: 816)");
 
 module_param_named(urb_max_packets, px4_usb_params.urb_max_packets,
 		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(urb_max_packets,
-		 "Maximum number of TS packets per URB. (default: 816)");
+		 "Maximum number of TS packets per URB, xfer_packets is " \
+		 "lowered to it if larger. (default: 816)");
 
 module_param_named(max_urbs, px4_usb_params.max_urbs,
 		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -40,3 +67,70 @@ MODULE_PARM_DESC(max_urbs, "Maximum number of URBs. (default: 6)");
 
 module_param_named(no_dma, px4_usb_params.no_dma,
 		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+module_param_named(dma_probe, px4_usb_params.dma_probe,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(dma_probe,
+		 "Choose between coherent and kmalloc'd URB buffers by timing " \
+		 "reads of them on the first start of streaming on each host " \
+		 "controller, no_dma is ignored. (default: false)");
+
+module_param_named(adaptive_urbs, px4_usb_params.adaptive_urbs,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(adaptive_urbs,
+		 "Grow and shrink the number of URBs between min_urbs and " \
+		 "max_urbs while streaming. (default: false)");
+
+module_param_named(min_urbs, px4_usb_params.min_urbs,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(min_urbs,
+		 "Minimum number of URBs in adaptive mode. (default: 2)");
+
+module_param_named(urb_budget, px4_usb_params.urb_budget,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(urb_budget,
+		 "MiB of URB buffers shared by all of the streaming devices " \
+		 "in proportion to their streams, taking the place of " \
+		 "max_urbs (if 0 it is disabled). (default: 0)");
+
+module_param_named(urb_workqueue, px4_usb_params.urb_workqueue,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(urb_workqueue,
+		 "Process the completed URBs on a shared high priority " \
+		 "workqueue instead of in the completion handler. (default: false)");
+
+module_param_named(urb_wq_max_active, px4_usb_params.urb_wq_max_active,
+		   int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(urb_wq_max_active,
+		 "Maximum number of URB works running at once per CPU " \
+		 "(if 0 the workqueue default is used). (default: 0)");
+
+module_param_named(urb_double_buffer, px4_usb_params.urb_double_buffer,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(urb_double_buffer,
+		 "Resubmit each URB with a spare buffer before demuxing " \
+		 "the received data. (default: false)");
+
+module_param_named(urb_sg, px4_usb_params.urb_sg,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(urb_sg,
+		 "Build the URB buffers from single pages with scatter-gather " \
+		 "if the host controller supports it. (default: false)");
+
+module_param_named(stream_watchdog, px4_usb_params.stream_watchdog,
+		   uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(stream_watchdog,
+		 "Restart the stream pipe without retuning if no data has " \
+		 "been received for this many msecs (if 0 it is disabled). (default: 0)");
+
+module_param_named(async_probe, px4_usb_params.async_probe,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(async_probe,
+		 "Download the firmware and initialize the devices on a " \
+		 "workqueue, so that several devices come up in parallel. (default: true)");
+
+module_param_named(warm_reattach, px4_usb_params.warm_reattach,
+		   bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(warm_reattach,
+		 "Keep the stream and i2c configuration of a bridge which " \
+		 "still has it from a previous load of the driver. (default: true)");
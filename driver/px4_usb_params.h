@@ -7,10 +7,23 @@
 
 struct px4_usb_param_set {
 	int ctrl_timeout;
+	bool ctrl_pipeline;
+	unsigned int fw_pipeline_depth;
 	unsigned int xfer_packets;
 	unsigned int urb_max_packets;
 	unsigned int max_urbs;
 	bool no_dma;
+	bool dma_probe;
+	bool adaptive_urbs;
+	unsigned int min_urbs;
+	unsigned int urb_budget;
+	bool urb_workqueue;
+	bool urb_double_buffer;
+	bool urb_sg;
+	int urb_wq_max_active;
+	unsigned int stream_watchdog;
+	bool async_probe;
+	bool warm_reattach;
 };
 
 extern struct px4_usb_param_set px4_usb_params;
@@ -14,15 +14,9 @@
 
 #include "px4_device_params.h"
 #include "firmware.h"
+#include "ts_demux.h"
 
-#define PXMLT_DEVICE_TS_SYNC_COUNT	4
-#define PXMLT_DEVICE_TS_SYNC_SIZE	(188 * PXMLT_DEVICE_TS_SYNC_COUNT)
-
-struct pxmlt_stream_context {
-	struct ptx_chrdev *chrdev[PXMLT_CHRDEV_MAX_NUM];
-	u8 remain_buf[PXMLT_DEVICE_TS_SYNC_SIZE];
-	size_t remain_len;
-};
+static const struct ts_demux_config pxmlt_demux_config = TS_DEMUX_TAGGED_CONFIG(PXMLT_CHRDEV_MAX_NUM);
 
 static int pxmlt_chrdev_set_lnb_voltage(struct ptx_chrdev *chrdev, int voltage);
 static void pxmlt_device_release(struct kref *kref);
@@ -107,96 +101,6 @@ static int pxmlt_backend_term(struct pxmlt_device *pxmlt)
 }
 #endif
 
-static void pxmlt_device_stream_process(struct ptx_chrdev **chrdev,
-				      u8 **buf, u32 *len)
-{
-	u8 *p = *buf;
-	u32 remain = *len;
-
-	while (likely(remain)) {
-		u32 i;
-		bool sync_remain = false;
-
-		for (i = 0; i < PXMLT_DEVICE_TS_SYNC_COUNT; i++) {
-			if (likely(((i + 1) * 188) <= remain)) {
-				if (unlikely((p[i * 188] & 0x8f) != 0x07))
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-		}
-
-		if (unlikely(sync_remain))
-			break;
-
-		if (unlikely(i < PXMLT_DEVICE_TS_SYNC_COUNT)) {
-			p++;
-			remain--;
-			continue;
-		}
-
-		while (likely(remain >= 188 && ((p[0] & 0x8f) == 0x07))) {
-			u8 id = (p[0] & 0x70) >> 4;
-
-			if (likely(id && id < 6)) {
-				p[0] = 0x47;
-				ptx_chrdev_put_stream(chrdev[id - 1], p, 188);
-			}
-
-			p += 188;
-			remain -= 188;
-		}
-	}
-
-	*buf = p;
-	*len = remain;
-
-	return;
-}
-
-static int pxmlt_device_stream_handler(void *context, void *buf, u32 len)
-{
-	struct pxmlt_stream_context *stream_ctx = context;
-	u8 *ctx_remain_buf = stream_ctx->remain_buf;
-	u32 ctx_remain_len = stream_ctx->remain_len;
-	u8 *p = buf;
-	u32 remain = len;
-
-	if (unlikely(ctx_remain_len)) {
-		if (likely((ctx_remain_len + len) >= PXMLT_DEVICE_TS_SYNC_SIZE)) {
-			u32 t = PXMLT_DEVICE_TS_SYNC_SIZE - ctx_remain_len;
-
-			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
-			ctx_remain_len = PXMLT_DEVICE_TS_SYNC_SIZE;
-
-			pxmlt_device_stream_process(stream_ctx->chrdev,
-						  &ctx_remain_buf,
-						  &ctx_remain_len);
-			if (likely(!ctx_remain_len)) {
-				p += t;
-				remain -= t;
-			}
-
-			stream_ctx->remain_len = 0;
-		} else {
-			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
-			stream_ctx->remain_len += len;
-
-			return 0;
-		}
-	}
-
-	pxmlt_device_stream_process(stream_ctx->chrdev, &p, &remain);
-
-	if (unlikely(remain)) {
-		memcpy(stream_ctx->remain_buf, p, remain);
-		stream_ctx->remain_len = remain;
-	}
-
-	return 0;
-}
-
 static int pxmlt_chrdev_init(struct ptx_chrdev *chrdev)
 {
 	dev_dbg(chrdev->parent->dev, "pxmlt_chrdev_init\n");
@@ -485,6 +389,42 @@ static int pxmlt_chrdev_check_lock(struct ptx_chrdev *chrdev, bool *locked)
 	return ret;
 }
 
+static int pxmlt_chrdev_get_lock_state(struct ptx_chrdev *chrdev,
+				       enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct pxmlt_chrdev *chrdevm = chrdev->priv;
+	bool locked = false, unlocked = false;
+
+	switch (chrdev->current_system) {
+	case PTX_ISDB_T_SYSTEM:
+		ret = cxd2856er_is_ts_locked_isdbt(&chrdevm->cxd2856er,
+						   &locked, &unlocked);
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		ret = cxd2856er_is_ts_locked_isdbs(&chrdevm->cxd2856er,
+						   &locked);
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (ret)
+		return ret;
+
+	if (locked)
+		*state = PTX_CHRDEV_LOCK_LOCKED;
+	else if (unlocked)
+		*state = PTX_CHRDEV_LOCK_NO_SIGNAL;
+	else
+		*state = PTX_CHRDEV_LOCK_SEARCHING;
+
+	return 0;
+}
+
 static int pxmlt_chrdev_set_stream_id(struct ptx_chrdev *chrdev, u16 stream_id)
 {
 	int ret = 0;
@@ -566,38 +506,49 @@ static int pxmlt_chrdev_start_capture(struct ptx_chrdev *chrdev)
 
 	mutex_lock(&pxmlt->lock);
 
+	/* before the stream starts, which takes its share of the budget */
+	chrdevm->stream_weight = ptx_system_bitrate(chrdev->params.system);
+	itedtv_bus_set_stream_weight(&pxmlt->it930x.bus,
+				     pxmlt->stream_weight + chrdevm->stream_weight);
+
 	if (!pxmlt->streaming_count) {
-		struct pxmlt_stream_context *stream_ctx = pxmlt->stream_ctx;
+		struct ts_demux *stream_ctx = pxmlt->stream_ctx;
 
 		ret = it930x_purge_psb(&pxmlt->it930x,
-				       px4_device_params.psb_purge_timeout);
+				       px4_device_psb_purge_timeout(&pxmlt->it930x));
 		if (ret) {
 			dev_err(pxmlt->dev,
 				"pxmlt_chrdev_start_capture %u:%u: it930x_purge_psb() failed. (ret: %d)\n",
 				chrdev_group->id, chrdev->id, ret);
-			goto exit;
+			goto fail;
 		}
 
-		stream_ctx->remain_len = 0;
+		ts_demux_reset(stream_ctx);
 
 		ret = itedtv_bus_start_streaming(&pxmlt->it930x.bus,
-						 pxmlt_device_stream_handler,
+						 ts_demux_stream_handler,
 						 stream_ctx);
 		if (ret) {
 			dev_err(pxmlt->dev,
 				"pxmlt_chrdev_start_capture %u:%u: itedtv_bus_start_streaming() failed. (ret: %d)\n",
 				chrdev_group->id, chrdev->id, ret);
-			goto exit;
+			goto fail;
 		}
 	}
 
 	pxmlt->streaming_count++;
+	pxmlt->stream_weight += chrdevm->stream_weight;
 
 	dev_dbg(pxmlt->dev,
 		"pxmlt_chrdev_start_capture %u:%u: streaming_count: %u\n",
 		chrdev_group->id, chrdev->id, pxmlt->streaming_count);
 
-exit:
+	mutex_unlock(&pxmlt->lock);
+	return 0;
+
+fail:
+	itedtv_bus_set_stream_weight(&pxmlt->it930x.bus, pxmlt->stream_weight);
+
 	mutex_unlock(&pxmlt->lock);
 	return ret;
 }
@@ -620,6 +571,9 @@ static int pxmlt_chrdev_stop_capture(struct ptx_chrdev *chrdev)
 	}
 
 	pxmlt->streaming_count--;
+	pxmlt->stream_weight -= chrdevm->stream_weight;
+	itedtv_bus_set_stream_weight(&pxmlt->it930x.bus, pxmlt->stream_weight);
+
 	if (!pxmlt->streaming_count) {
 		dev_dbg(pxmlt->dev,
 			"pxmlt_chrdev_stop_capture %u:%u: stopping...\n",
@@ -836,6 +790,78 @@ static int pxmlt_chrdev_read_cnr_raw(struct ptx_chrdev *chrdev, u32 *value)
 	return ret;
 }
 
+/* C/N in 0.01 dB units, interpolated between the entries of the tables */
+static int pxmlt_chrdev_read_cnr(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0, i, num;
+	struct pxmlt_chrdev *chrdevm = chrdev->priv;
+	u16 val;
+
+	switch (chrdev->current_system) {
+	case PTX_ISDB_T_SYSTEM:
+		ret = cxd2856er_read_cnr_raw_isdbt(&chrdevm->cxd2856er, &val);
+		if (ret)
+			break;
+
+		/* ascending, 10 dB + 0.5 dB * i */
+		num = ARRAY_SIZE(isdbt_cn_raw_table);
+
+		if (val <= isdbt_cn_raw_table[0].val) {
+			*value = 1000;
+			break;
+		}
+
+		for (i = 1; i < num; i++) {
+			if (val < isdbt_cn_raw_table[i].val)
+				break;
+		}
+
+		if (i == num) {
+			*value = 1000 + 50 * (num - 1);
+			break;
+		}
+
+		*value = 1000 + 50 * (i - 1) +
+			 (50 * (val - isdbt_cn_raw_table[i - 1].val)) /
+			 (isdbt_cn_raw_table[i].val - isdbt_cn_raw_table[i - 1].val);
+		break;
+
+	case PTX_ISDB_S_SYSTEM:
+		ret = cxd2856er_read_cnr_raw_isdbs(&chrdevm->cxd2856er, &val);
+		if (ret)
+			break;
+
+		/* descending, 0.1 dB * i */
+		num = ARRAY_SIZE(isdbs_cn_raw_table);
+
+		if (val >= isdbs_cn_raw_table[0].val) {
+			*value = 0;
+			break;
+		}
+
+		for (i = 1; i < num; i++) {
+			if (val > isdbs_cn_raw_table[i].val)
+				break;
+		}
+
+		if (i == num) {
+			*value = 10 * (num - 1);
+			break;
+		}
+
+		*value = 10 * (i - 1) +
+			 (10 * (isdbs_cn_raw_table[i - 1].val - val)) /
+			 (isdbs_cn_raw_table[i - 1].val - isdbs_cn_raw_table[i].val);
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	return ret;
+}
+
 static struct ptx_chrdev_operations pxmlt_chrdev_ops = {
 	.init = pxmlt_chrdev_init,
 	.term = pxmlt_chrdev_term,
@@ -843,12 +869,17 @@ static struct ptx_chrdev_operations pxmlt_chrdev_ops = {
 	.release = pxmlt_chrdev_release,
 	.tune = pxmlt_chrdev_tune,
 	.check_lock = pxmlt_chrdev_check_lock,
+	.get_lock_state = pxmlt_chrdev_get_lock_state,
 	.set_stream_id = pxmlt_chrdev_set_stream_id,
 	.set_lnb_voltage = pxmlt_chrdev_set_lnb_voltage,
 	.set_capture = pxmlt_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = pxmlt_chrdev_read_cnr_raw
+	.read_cnr = pxmlt_chrdev_read_cnr,
+	.read_cnr_raw = pxmlt_chrdev_read_cnr_raw,
+	.set_pid_filter = NULL,
+	.set_pid_filter_entry = NULL,
+	.read_tsid = NULL,
+	.read_stats = NULL
 };
 
 static const struct {
@@ -937,7 +968,7 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 	struct ptx_chrdev_config chrdev_config[PXMLT_CHRDEV_MAX_NUM];
 	struct ptx_chrdev_group_config chrdev_group_config;
 	struct ptx_chrdev_group *chrdev_group;
-	struct pxmlt_stream_context *stream_ctx;
+	struct ts_demux *stream_ctx;
 
 	if (!pxmlt || !dev || !chrdev_ctx || !quit_completion)
 		return -EINVAL;
@@ -953,6 +984,7 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 	pxmlt->open_count = 0;
 	pxmlt->lnb_power_count = 0;
 	pxmlt->streaming_count = 0;
+	pxmlt->stream_weight = 0;
 	mutex_init(&pxmlt->tuner_lock[0]);
 	mutex_init(&pxmlt->tuner_lock[1]);
 	switch (model) {
@@ -978,8 +1010,11 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 		chrdevm->parent = pxmlt;
 		chrdevm->lnb_power = false;
 		chrdevm->tuner_lock = &pxmlt->tuner_lock[tuner_lock_idx];
+		chrdevm->stream_weight = 0;
 	}
 
+	pxmlt->debugfs = NULL;
+
 	stream_ctx = kzalloc(sizeof(*stream_ctx), GFP_KERNEL);
 	if (!stream_ctx) {
 		dev_err(pxmlt->dev,
@@ -988,6 +1023,8 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 		goto fail;
 	}
 	pxmlt->stream_ctx = stream_ctx;
+	ts_demux_init(stream_ctx, &pxmlt_demux_config);
+	ts_demux_set_clock(stream_ctx, &pxmlt->it930x.bus.stream_time);
 
 	it930x = &pxmlt->it930x;
 	bus = &it930x->bus;
@@ -1008,11 +1045,23 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 	if (ret)
 		goto fail_device;
 
+	pxmlt->debugfs = px4_debugfs_create(dev, it930x);
+
+	for (i = 0; i < pxmlt->chrdevm_num; i++) {
+		px4_debugfs_add_chip(pxmlt->debugfs, "cxd2856er", i,
+				     &pxmlt->chrdevm[i].cxd2856er.i2c_stats);
+		px4_debugfs_add_chip(pxmlt->debugfs, "cxd2858er", i,
+				     &pxmlt->chrdevm[i].cxd2858er.i2c_stats);
+	}
+
 	for (i = 0; i < pxmlt->chrdevm_num; i++) {
 		chrdev_config[i].ops = &pxmlt_chrdev_ops;
 		chrdev_config[i].options = PTX_CHRDEV_SAT_SET_STREAM_ID_BEFORE_TUNE;
 		chrdev_config[i].ringbuf_size = 188 * px4_device_params.tsdev_max_packets;
+		chrdev_config[i].ringbuf_time_t = px4_device_params.tsdev_buffer_time_t;
+		chrdev_config[i].ringbuf_time_s = px4_device_params.tsdev_buffer_time_s;
 		chrdev_config[i].ringbuf_threshold_size = chrdev_config[i].ringbuf_size / 10;
+		chrdev_config[i].max_readers = px4_device_params.tsdev_max_readers;
 		chrdev_config[i].priv = &pxmlt->chrdevm[i];
 	}
 
@@ -1066,6 +1115,8 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 
 	chrdev_group_config.owner_kref = &pxmlt->kref;
 	chrdev_group_config.owner_kref_release = pxmlt_device_release;
+	chrdev_group_config.bus_stats = &it930x->bus.stats;
+	chrdev_group_config.bus = &it930x->bus;
 	chrdev_group_config.reserved = false;
 	chrdev_group_config.minor_base = 0;	/* unused */
 	chrdev_group_config.chrdev_num = pxmlt->chrdevm_num;
@@ -1089,6 +1140,7 @@ int pxmlt_device_init(struct pxmlt_device *pxmlt, struct device *dev,
 fail_chrdev:
 
 fail_device:
+	px4_debugfs_remove(pxmlt->debugfs);
 	it930x_term(it930x);
 
 fail_bridge:
@@ -1113,6 +1165,7 @@ static void pxmlt_device_release(struct kref *kref)
 
 	dev_dbg(pxmlt->dev, "pxmlt_device_release\n");
 
+	px4_debugfs_remove(pxmlt->debugfs);
 	it930x_term(&pxmlt->it930x);
 	itedtv_bus_term(&pxmlt->it930x.bus);
 
@@ -19,6 +19,7 @@
 #include "it930x.h"
 #include "cxd2856er.h"
 #include "cxd2858er.h"
+#include "px4_debugfs.h"
 
 #define PXMLT_CHRDEV_MAX_NUM	5
 
@@ -41,6 +42,7 @@ struct pxmlt_chrdev {
 	struct pxmlt_device *parent;
 	bool lnb_power;
 	struct mutex *tuner_lock;
+	u32 stream_weight;	// added to the weight of the device while capturing
 	struct cxd2856er_demod cxd2856er;
 	struct cxd2858er_tuner cxd2858er;
 };
@@ -54,11 +56,13 @@ struct pxmlt_device {
 	unsigned int open_count;
 	unsigned int lnb_power_count;
 	unsigned int streaming_count;
+	u32 stream_weight;	// of the URB budget, the streams being captured
 	struct mutex tuner_lock[2];
 	struct ptx_chrdev_group *chrdev_group;
 	int chrdevm_num;
 	struct pxmlt_chrdev chrdevm[PXMLT_CHRDEV_MAX_NUM];
 	struct it930x_bridge it930x;
+	struct px4_debugfs *debugfs;
 	void *stream_ctx;
 };
 
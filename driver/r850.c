@@ -55,6 +55,10 @@ static const u8 wakeup_regs[R850_NUM_REGS] = {
 	0x53, 0xab, 0x5b, 0x46, 0xb3, 0x93, 0x6e, 0x41
 };
 
+/* the power control registers, the light standby only rewrites these */
+#define R850_POWER_REG		0x09
+#define R850_POWER_REG_NUM	4
+
 static const u8 imr_cal_regs[R850_NUM_REGS] = {
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 	0xc0, 0x49, 0x3a, 0x90, 0x03, 0xc1, 0x61, 0x71,
@@ -73,12 +77,6 @@ static const u8 lpf_cal_regs[R850_NUM_REGS] = {
 	0xa3, 0x00, 0x0b, 0x44, 0x92, 0x1f, 0xe6, 0x80
 };
 
-struct r850_lpf_params {
-	u8 code;
-	u8 bandwidth;
-	u8 lsb;
-};
-
 struct r850_system_params {
 	enum r850_bandwidth bandwidth;
 	u32 if_freq;
@@ -533,6 +531,131 @@ static const u16 mixer_acc_gain[16] = {
 	56, 68, 80, 90, 100, 100, 100, 100
 };
 
+struct r850_pll_params {
+	u32 lo_freq;
+	u8 div;		// mix_div = 2 << div
+	u8 xtal_div;
+	u8 ni;
+	u8 si;
+	u16 sdm;
+};
+
+/*
+ * r850_calc_pll() for the ISDB-T UHF channels 13-62, with the 4.063MHz IF
+ * every device uses, [chip][channel - 13]. Other crystals, systems and
+ * frequencies go through the calculation.
+ */
+#define R850_PLL_TABLE_XTAL		24000
+#define R850_PLL_TABLE_ISDB_T_IF	4063
+#define R850_PLL_TABLE_ISDB_T_LO	(473143 - R850_PLL_TABLE_ISDB_T_IF)
+
+static const struct r850_pll_params r850_isdb_t_pll_params[2][50] = {
+	{
+		{ 469080, 2, 0, 0x10, 1, 0x2e16 },	/* UHF 13 */
+		{ 475080, 2, 3, 0x4b, 3, 0xb858 },	/* UHF 14 */
+		{ 481080, 2, 0, 0x10, 3, 0x2e16 },	/* UHF 15 */
+		{ 487080, 2, 0, 0x11, 0, 0x2e16 },	/* UHF 16 */
+		{ 493080, 2, 0, 0x11, 1, 0x2e16 },	/* UHF 17 */
+		{ 499080, 2, 0, 0x11, 2, 0x2e16 },	/* UHF 18 */
+		{ 505080, 2, 0, 0x11, 3, 0x2e16 },	/* UHF 19 */
+		{ 511080, 2, 0, 0x12, 0, 0x2e16 },	/* UHF 20 */
+		{ 517080, 2, 0, 0x12, 1, 0x2e16 },	/* UHF 21 */
+		{ 523080, 2, 0, 0x12, 2, 0x2e16 },	/* UHF 22 */
+		{ 529080, 2, 0, 0x12, 3, 0x2e16 },	/* UHF 23 */
+		{ 535080, 2, 0, 0x13, 0, 0x2e16 },	/* UHF 24 */
+		{ 541080, 2, 0, 0x13, 1, 0x2e16 },	/* UHF 25 */
+		{ 547080, 2, 0, 0x13, 2, 0x2e16 },	/* UHF 26 */
+		{ 553080, 2, 0, 0x13, 3, 0x2e16 },	/* UHF 27 */
+		{ 559080, 2, 0, 0x14, 0, 0x2e16 },	/* UHF 28 */
+		{ 565080, 2, 0, 0x14, 1, 0x2e16 },	/* UHF 29 */
+		{ 571080, 1, 0, 0x08, 2, 0x970c },	/* UHF 30 */
+		{ 577080, 1, 0, 0x08, 3, 0x170c },	/* UHF 31 */
+		{ 583080, 1, 0, 0x08, 3, 0x970c },	/* UHF 32 */
+		{ 589080, 1, 0, 0x09, 0, 0x170c },	/* UHF 33 */
+		{ 595080, 1, 0, 0x09, 0, 0x970c },	/* UHF 34 */
+		{ 601080, 1, 0, 0x09, 1, 0x170c },	/* UHF 35 */
+		{ 607080, 1, 0, 0x09, 1, 0x970c },	/* UHF 36 */
+		{ 613080, 1, 0, 0x09, 2, 0x170c },	/* UHF 37 */
+		{ 619080, 1, 0, 0x09, 2, 0x970c },	/* UHF 38 */
+		{ 625080, 1, 0, 0x09, 3, 0x170c },	/* UHF 39 */
+		{ 631080, 1, 0, 0x09, 3, 0x970c },	/* UHF 40 */
+		{ 637080, 1, 0, 0x0a, 0, 0x170c },	/* UHF 41 */
+		{ 643080, 1, 0, 0x0a, 0, 0x970c },	/* UHF 42 */
+		{ 649080, 1, 0, 0x0a, 1, 0x170c },	/* UHF 43 */
+		{ 655080, 1, 0, 0x0a, 1, 0x970c },	/* UHF 44 */
+		{ 661080, 1, 0, 0x0a, 2, 0x170c },	/* UHF 45 */
+		{ 667080, 1, 0, 0x0a, 2, 0x970c },	/* UHF 46 */
+		{ 673080, 1, 0, 0x0a, 3, 0x170c },	/* UHF 47 */
+		{ 679080, 1, 0, 0x0a, 3, 0x970c },	/* UHF 48 */
+		{ 685080, 1, 0, 0x0b, 0, 0x170c },	/* UHF 49 */
+		{ 691080, 1, 0, 0x0b, 0, 0x970c },	/* UHF 50 */
+		{ 697080, 1, 0, 0x0b, 1, 0x170c },	/* UHF 51 */
+		{ 703080, 1, 0, 0x0b, 1, 0x970c },	/* UHF 52 */
+		{ 709080, 1, 0, 0x0b, 2, 0x170c },	/* UHF 53 */
+		{ 715080, 1, 0, 0x0b, 2, 0x970c },	/* UHF 54 */
+		{ 721080, 1, 0, 0x0b, 3, 0x170c },	/* UHF 55 */
+		{ 727080, 1, 0, 0x0b, 3, 0x970c },	/* UHF 56 */
+		{ 733080, 1, 0, 0x0c, 0, 0x170c },	/* UHF 57 */
+		{ 739080, 1, 0, 0x0c, 0, 0x970c },	/* UHF 58 */
+		{ 745080, 1, 0, 0x0c, 1, 0x170c },	/* UHF 59 */
+		{ 751080, 1, 0, 0x0c, 1, 0x970c },	/* UHF 60 */
+		{ 757080, 1, 0, 0x0c, 2, 0x170c },	/* UHF 61 */
+		{ 763080, 1, 0, 0x0c, 2, 0x970c },	/* UHF 62 */
+	},
+	{
+		{ 469080, 2, 0, 0x10, 1, 0x2e16 },	/* UHF 13 */
+		{ 475080, 2, 3, 0x4b, 3, 0xb858 },	/* UHF 14 */
+		{ 481080, 2, 0, 0x10, 3, 0x2e16 },	/* UHF 15 */
+		{ 487080, 2, 0, 0x11, 0, 0x2e16 },	/* UHF 16 */
+		{ 493080, 2, 0, 0x11, 1, 0x2e16 },	/* UHF 17 */
+		{ 499080, 2, 0, 0x11, 2, 0x2e16 },	/* UHF 18 */
+		{ 505080, 2, 0, 0x11, 3, 0x2e16 },	/* UHF 19 */
+		{ 511080, 2, 0, 0x12, 0, 0x2e16 },	/* UHF 20 */
+		{ 517080, 2, 0, 0x12, 1, 0x2e16 },	/* UHF 21 */
+		{ 523080, 2, 0, 0x12, 2, 0x2e16 },	/* UHF 22 */
+		{ 529080, 2, 0, 0x12, 3, 0x2e16 },	/* UHF 23 */
+		{ 535080, 2, 0, 0x13, 0, 0x2e16 },	/* UHF 24 */
+		{ 541080, 2, 0, 0x13, 1, 0x2e16 },	/* UHF 25 */
+		{ 547080, 2, 0, 0x13, 2, 0x2e16 },	/* UHF 26 */
+		{ 553080, 1, 0, 0x08, 1, 0x170c },	/* UHF 27 */
+		{ 559080, 1, 0, 0x08, 1, 0x970c },	/* UHF 28 */
+		{ 565080, 1, 0, 0x08, 2, 0x170c },	/* UHF 29 */
+		{ 571080, 1, 0, 0x08, 2, 0x970c },	/* UHF 30 */
+		{ 577080, 1, 0, 0x08, 3, 0x170c },	/* UHF 31 */
+		{ 583080, 1, 0, 0x08, 3, 0x970c },	/* UHF 32 */
+		{ 589080, 1, 0, 0x09, 0, 0x170c },	/* UHF 33 */
+		{ 595080, 1, 0, 0x09, 0, 0x970c },	/* UHF 34 */
+		{ 601080, 1, 0, 0x09, 1, 0x170c },	/* UHF 35 */
+		{ 607080, 1, 0, 0x09, 1, 0x970c },	/* UHF 36 */
+		{ 613080, 1, 0, 0x09, 2, 0x170c },	/* UHF 37 */
+		{ 619080, 1, 0, 0x09, 2, 0x970c },	/* UHF 38 */
+		{ 625080, 1, 0, 0x09, 3, 0x170c },	/* UHF 39 */
+		{ 631080, 1, 0, 0x09, 3, 0x970c },	/* UHF 40 */
+		{ 637080, 1, 0, 0x0a, 0, 0x170c },	/* UHF 41 */
+		{ 643080, 1, 0, 0x0a, 0, 0x970c },	/* UHF 42 */
+		{ 649080, 1, 0, 0x0a, 1, 0x170c },	/* UHF 43 */
+		{ 655080, 1, 0, 0x0a, 1, 0x970c },	/* UHF 44 */
+		{ 661080, 1, 0, 0x0a, 2, 0x170c },	/* UHF 45 */
+		{ 667080, 1, 0, 0x0a, 2, 0x970c },	/* UHF 46 */
+		{ 673080, 1, 0, 0x0a, 3, 0x170c },	/* UHF 47 */
+		{ 679080, 1, 0, 0x0a, 3, 0x970c },	/* UHF 48 */
+		{ 685080, 1, 0, 0x0b, 0, 0x170c },	/* UHF 49 */
+		{ 691080, 1, 0, 0x0b, 0, 0x970c },	/* UHF 50 */
+		{ 697080, 1, 0, 0x0b, 1, 0x170c },	/* UHF 51 */
+		{ 703080, 1, 0, 0x0b, 1, 0x970c },	/* UHF 52 */
+		{ 709080, 1, 0, 0x0b, 2, 0x170c },	/* UHF 53 */
+		{ 715080, 1, 0, 0x0b, 2, 0x970c },	/* UHF 54 */
+		{ 721080, 1, 0, 0x0b, 3, 0x170c },	/* UHF 55 */
+		{ 727080, 1, 0, 0x0b, 3, 0x970c },	/* UHF 56 */
+		{ 733080, 1, 0, 0x0c, 0, 0x170c },	/* UHF 57 */
+		{ 739080, 1, 0, 0x0c, 0, 0x970c },	/* UHF 58 */
+		{ 745080, 1, 0, 0x0c, 1, 0x170c },	/* UHF 59 */
+		{ 751080, 1, 0, 0x0c, 1, 0x970c },	/* UHF 60 */
+		{ 757080, 1, 0, 0x0c, 2, 0x170c },	/* UHF 61 */
+		{ 763080, 1, 0, 0x0c, 2, 0x970c },	/* UHF 62 */
+	},
+};
+
 static u8 reverse_bit(u8 val)
 {
 	u8 t = val;
@@ -568,7 +691,7 @@ static int r850_read_regs(struct r850_tuner *t, u8 reg, u8 *buf, int len)
 	req[1].data = b;
 	req[1].len = reg + len;
 
-	ret = i2c_comm_master_request(t->i2c, req, 2);
+	ret = i2c_comm_master_request_stats(t->i2c, &t->i2c_stats, req, 2);
 	if (ret) {
 		dev_err(t->dev,
 			"r850_read_regs: i2c_comm_master_request() failed. (reg: 0x%02x, len: %d, ret: %d)\n",
@@ -595,6 +718,19 @@ static int r850_write_regs(struct r850_tuner *t,
 	if (len > (R850_NUM_REGS - reg))
 		return -EINVAL;
 
+	/* skip the unchanged registers at both ends of a range */
+	if (len > 1) {
+		int first, last;
+
+		if (!reg_cache_get_dirty_range(&t->priv.hw_regs, 0,
+					       reg, buf, len, &first, &last))
+			return 0;
+
+		reg += first;
+		buf += first;
+		len = last - first + 1;
+	}
+
 	b[0] = reg;
 	memcpy(&b[1], buf, len);
 
@@ -603,11 +739,15 @@ static int r850_write_regs(struct r850_tuner *t,
 	req[0].data = b;
 	req[0].len = 1 + len;
 
-	ret = i2c_comm_master_request(t->i2c, req, 1);
-	if (ret)
+	ret = i2c_comm_master_request_stats(t->i2c, &t->i2c_stats, req, 1);
+	if (ret) {
 		dev_err(t->dev,
 			"r850_write_regs: i2c_comm_master_request() failed. (reg: 0x%02x, len: %d, ret: %d)\n",
 			reg, len, ret);
+		reg_cache_invalidate(&t->priv.hw_regs);
+	} else {
+		reg_cache_write(&t->priv.hw_regs, 0, reg, buf, len);
+	}
 
 	return ret;
 }
@@ -652,28 +792,135 @@ static int r850_set_xtal_cap(struct r850_tuner *t, u8 cap)
 	return 0;
 }
 
-static int r850_set_pll(struct r850_tuner *t,
-			u32 lo_freq, u32 if_freq,
-			enum r850_system sys)
+static void r850_calc_pll(u32 xtal, int chip,
+			  u32 lo_freq, u32 if_freq,
+			  enum r850_system sys,
+			  struct r850_pll_params *pll)
 {
-	int ret = 0;
-	u32 xtal, vco_min, vco_max, vco_freq;
+	u32 vco_min, vco_max, vco_freq;
 	u16 nint, vco_fra;
 	u16 nsdm = 2, sdm = 0;
 	u8 mix_div = 2, div = 0, ni, si;
 	u8 xtal_div;
-	u8 b;
 	u16 div_judge;
 
-	xtal = t->config.xtal;
-
 	vco_min = 2200000;
-	if (!t->priv.chip)
+	if (!chip)
 		vco_min += 70000;
 
 	vco_max = vco_min * 2;
 	vco_freq = lo_freq * mix_div;
 
+	/* xtal == 24000 */
+	div_judge = ((lo_freq + if_freq) / 1000 / 12);
+
+	while (div < 6) {
+		if (vco_min <= vco_freq && vco_freq < vco_max)
+			break;
+
+		mix_div *= 2;
+		vco_freq = lo_freq * mix_div;
+
+		div++;
+	}
+
+	xtal_div = 0;
+
+	if (sys != R850_SYSTEM_UNDEFINED) {
+		if (lo_freq < 380500) {
+			if (!(div_judge & 1)) {
+				xtal /= 2;
+				xtal_div = 1;
+			}
+		} else if ((lo_freq + if_freq - 478000) < 4000 &&
+			   sys == R850_SYSTEM_ISDB_T) {
+#if 1
+			xtal /= 4;
+			xtal_div = 3;
+#endif
+		}
+	}
+
+	nint = (vco_freq / 2) / xtal;
+	vco_fra = vco_freq - (xtal * 2 * nint);
+
+	if (vco_fra < (xtal / 64)) {
+		vco_fra = 0;
+	} else if (vco_fra > (xtal * 127 / 64)) {
+		vco_fra = 0;
+		nint++;
+	} else if (vco_fra > (xtal * 127 / 128) && (xtal > vco_fra)) {
+		vco_fra = xtal * 127 / 128;
+	} else if ((xtal < vco_fra) && (vco_fra < (xtal * 129 / 128))) {
+		vco_fra = xtal * 129 / 128;
+	}
+
+	ni = (nint - 13) / 4;
+	si = nint - 13 - (ni * 4);
+
+	while (vco_fra > 1) {
+		if ((xtal * 2 / nsdm) < vco_fra) {
+			vco_fra -= (xtal * 2) / nsdm;
+			sdm += 0x8000 / (nsdm / 2);
+
+			if (nsdm & 0x8000)
+				break;
+		}
+		nsdm += nsdm;
+	}
+
+	pll->lo_freq = lo_freq;
+	pll->div = div;
+	pll->xtal_div = xtal_div;
+	pll->ni = ni;
+	pll->si = si;
+	pll->sdm = sdm;
+}
+
+static const struct r850_pll_params *r850_find_pll(u32 xtal, int chip,
+						   u32 lo_freq, u32 if_freq,
+						   enum r850_system sys)
+{
+	u32 i;
+
+	if (xtal != R850_PLL_TABLE_XTAL ||
+	    sys != R850_SYSTEM_ISDB_T ||
+	    if_freq != R850_PLL_TABLE_ISDB_T_IF ||
+	    lo_freq < R850_PLL_TABLE_ISDB_T_LO)
+		return NULL;
+
+	i = lo_freq - R850_PLL_TABLE_ISDB_T_LO;
+	if (i % 6000)
+		return NULL;
+
+	i /= 6000;
+	if (i >= ARRAY_SIZE(r850_isdb_t_pll_params[0]))
+		return NULL;
+
+	return &r850_isdb_t_pll_params[(chip) ? 1 : 0][i];
+}
+
+static int r850_set_pll(struct r850_tuner *t,
+			u32 lo_freq, u32 if_freq,
+			enum r850_system sys)
+{
+	int ret = 0;
+	const struct r850_pll_params *pll;
+	struct r850_pll_params calc;
+	u8 mix_div;
+	u8 b;
+	u16 div_judge;
+
+	pll = r850_find_pll(t->config.xtal, t->priv.chip,
+			    lo_freq, if_freq, sys);
+	if (!pll) {
+		r850_calc_pll(t->config.xtal, t->priv.chip,
+			      lo_freq, if_freq, sys, &calc);
+		pll = &calc;
+	}
+
+	mix_div = 2 << pll->div;
+
 	t->priv.regs[0x20] &= 0xfc;
 	t->priv.regs[0x2e] |= 0x40;
 	t->priv.regs[0x0c] &= 0x3c;
@@ -730,35 +977,11 @@ static int r850_set_pll(struct r850_tuner *t,
 	else
 		t->priv.regs[0x2f] &= 0xfc;
 
-	while (div < 6) {
-		if (vco_min <= vco_freq && vco_freq < vco_max)
-			break;
-
-		mix_div *= 2;
-		vco_freq = lo_freq * mix_div;
-
-		div++;
-	}
-
-	xtal_div = 0;
-
 	t->priv.regs[0x22] &= 0xfc;
-	if (sys != R850_SYSTEM_UNDEFINED) {
-		if (lo_freq < 380500) {
-			if (!(div_judge & 1)) {
-				xtal /= 2;
-				t->priv.regs[0x22] |= 0x02;
-				xtal_div = 1;
-			}
-		} else if ((lo_freq + if_freq - 478000) < 4000 &&
-			   sys == R850_SYSTEM_ISDB_T) {
-#if 1
-			xtal /= 4;
-			t->priv.regs[0x22] |= 0x03;
-			xtal_div = 3;
-#endif
-		}
-	}
+	if (pll->xtal_div == 1)
+		t->priv.regs[0x22] |= 0x02;
+	else if (pll->xtal_div == 3)
+		t->priv.regs[0x22] |= 0x03;
 
 	t->priv.regs[0x0b] &= 0xfe;
 
@@ -784,52 +1007,24 @@ static int r850_set_pll(struct r850_tuner *t,
 		t->priv.regs[0x11] |= 0x80;
 
 	t->priv.regs[0x1e] &= 0xe3;
-	t->priv.regs[0x1e] |= ((div << 2) & 0x1c);
-
-	nint = (vco_freq / 2) / xtal;
-	vco_fra = vco_freq - (xtal * 2 * nint);
-
-	if (vco_fra < (xtal / 64)) {
-		vco_fra = 0;
-	} else if (vco_fra > (xtal * 127 / 64)) {
-		vco_fra = 0;
-		nint++;
-	} else if (vco_fra > (xtal * 127 / 128) && (xtal > vco_fra)) {
-		vco_fra = xtal * 127 / 128;
-	} else if ((xtal < vco_fra) && (vco_fra < (xtal * 129 / 128))) {
-		vco_fra = xtal * 129 / 128;
-	}
-
-	ni = (nint - 13) / 4;
-	si = nint - 13 - (ni * 4);
+	t->priv.regs[0x1e] |= ((pll->div << 2) & 0x1c);
 
 	t->priv.regs[0x1b] &= 0x80;
-	t->priv.regs[0x1b] |= (ni & 0x7f);
+	t->priv.regs[0x1b] |= (pll->ni & 0x7f);
 
 	t->priv.regs[0x1e] &= 0xfc;
-	t->priv.regs[0x1e] |= (si & 0x03);
+	t->priv.regs[0x1e] |= (pll->si & 0x03);
 
 	t->priv.regs[0x20] &= 0x3f;
 
-	while (vco_fra > 1) {
-		if ((xtal * 2 / nsdm) < vco_fra) {
-			vco_fra -= (xtal * 2) / nsdm;
-			sdm += 0x8000 / (nsdm / 2);
-
-			if (nsdm & 0x8000)
-				break;
-		}
-		nsdm += nsdm;
-	}
-
-	t->priv.regs[0x1c] = (sdm & 0xff);
-	t->priv.regs[0x1d] = ((sdm >> 8) & 0xff);
+	t->priv.regs[0x1c] = (pll->sdm & 0xff);
+	t->priv.regs[0x1d] = ((pll->sdm >> 8) & 0xff);
 
 	ret = r850_write_regs(t, 0x08, &t->priv.regs[0x08], 0x28);
 	if (ret)
 		return ret;
 
-	switch (xtal_div) {
+	switch (pll->xtal_div) {
 	case 0:
 		msleep(10);
 		break;
@@ -1719,16 +1914,28 @@ static int r850_set_system_params(struct r850_tuner *t)
 			return -EINVAL;
 
 		if (!t->config.no_lpf_calibration) {
-			ret = r850_prepare_calibration(t,
-						       R850_CALIBRATION_LPF);
-			if (ret)
-				return ret;
+			struct r850_lpf_calibration *lpf_cal = &t->priv.lpf_cal;
 
-			ret = r850_calibrate_lpf(t,
-						 prm->filt_cal_if, prm->bw,
-						 2, &lpf);
-			if (ret)
-				return ret;
+			if (lpf_cal->done &&
+			    !memcmp(&lpf_cal->sys, sys,
+				    sizeof(struct r850_system_config))) {
+				lpf = lpf_cal->lpf;
+			} else {
+				ret = r850_prepare_calibration(t,
+							       R850_CALIBRATION_LPF);
+				if (ret)
+					return ret;
+
+				ret = r850_calibrate_lpf(t,
+							 prm->filt_cal_if,
+							 prm->bw, 2, &lpf);
+				if (ret)
+					return ret;
+
+				lpf_cal->done = true;
+				lpf_cal->sys = *sys;
+				lpf_cal->lpf = lpf;
+			}
 		} else {
 			lpf = prm->lpf;
 		}
@@ -2058,13 +2265,17 @@ int r850_init(struct r850_tuner *t)
 
 	t->priv.init = false;
 
+	reg_cache_init(&t->priv.hw_regs, &t->priv.hw_regs_bank, 1);
+
 	t->priv.chip = 0;
 	t->priv.sleep = false;
+	t->priv.standby = false;
 
 	t->priv.sys.system = R850_SYSTEM_UNDEFINED;
 
 	t->priv.imr_cal[0].done = false;
 	t->priv.imr_cal[1].done = false;
+	t->priv.lpf_cal.done = false;
 
 	t->priv.sys_curr.system = R850_SYSTEM_UNDEFINED;
 
@@ -2120,6 +2331,7 @@ int r850_term(struct r850_tuner *t)
 
 	t->priv.imr_cal[0].done = false;
 	t->priv.imr_cal[1].done = false;
+	t->priv.lpf_cal.done = false;
 
 	t->priv.sys_curr.system = R850_SYSTEM_UNDEFINED;
 
@@ -2134,6 +2346,102 @@ int r850_term(struct r850_tuner *t)
 	return 0;
 }
 
+int r850_get_calibration(struct r850_tuner *t,
+			 struct r850_calibration_data *cal)
+{
+	if (!t->priv.init)
+		return -EINVAL;
+
+	mutex_lock(&t->priv.lock);
+
+	memcpy(cal->imr_cal, t->priv.imr_cal, sizeof(cal->imr_cal));
+	cal->lpf_cal = t->priv.lpf_cal;
+
+	mutex_unlock(&t->priv.lock);
+
+	return 0;
+}
+
+int r850_set_calibration(struct r850_tuner *t,
+			 const struct r850_calibration_data *cal)
+{
+	if (!t->priv.init)
+		return -EINVAL;
+
+	mutex_lock(&t->priv.lock);
+
+	memcpy(t->priv.imr_cal, cal->imr_cal, sizeof(t->priv.imr_cal));
+	t->priv.lpf_cal = cal->lpf_cal;
+
+	/* force the system parameters to be applied again */
+	t->priv.sys_curr.system = R850_SYSTEM_UNDEFINED;
+
+	mutex_unlock(&t->priv.lock);
+
+	return 0;
+}
+
+/*
+ * The light standby powers down the blocks of the tuner with the registers
+ * 0x09-0x0c of the sleep settings, everything else is left as it is. The
+ * settings of the system and the calibration results stay valid, so the
+ * tuner is ready again as soon as the power registers are restored.
+ */
+static int r850_standby(struct r850_tuner *t)
+{
+	int ret = 0;
+
+	mutex_lock(&t->priv.lock);
+
+	if (t->priv.sleep)
+		goto exit;
+
+	ret = r850_write_regs(t, R850_POWER_REG,
+			      &sleep_regs[R850_POWER_REG], R850_POWER_REG_NUM);
+	if (ret) {
+		dev_err(t->dev,
+			"r850_standby: r850_write_regs() failed. (ret: %d)\n",
+			ret);
+		goto exit;
+	}
+
+	t->priv.sleep = true;
+	t->priv.standby = true;
+
+exit:
+	mutex_unlock(&t->priv.lock);
+
+	return ret;
+}
+
+static int r850_resume(struct r850_tuner *t)
+{
+	int ret = 0;
+
+	mutex_lock(&t->priv.lock);
+
+	if (!t->priv.standby)
+		goto exit;
+
+	/* the values before r850_standby() */
+	ret = r850_write_regs(t, R850_POWER_REG,
+			      &t->priv.regs[R850_POWER_REG], R850_POWER_REG_NUM);
+	if (ret) {
+		dev_err(t->dev,
+			"r850_resume: r850_write_regs() failed. (ret: %d)\n",
+			ret);
+		goto exit;
+	}
+
+	t->priv.sleep = false;
+	t->priv.standby = false;
+
+exit:
+	mutex_unlock(&t->priv.lock);
+
+	return ret;
+}
+
 int r850_sleep(struct r850_tuner *t)
 {
 	int ret = 0;
@@ -2141,6 +2449,9 @@ int r850_sleep(struct r850_tuner *t)
 	if (!t->priv.init)
 		return -EINVAL;
 
+	if (t->config.light_standby)
+		return r850_standby(t);
+
 #if 0
 	mutex_lock(&t->priv.lock);
 
@@ -2208,6 +2519,9 @@ int r850_wakeup(struct r850_tuner *t)
 	if (!t->priv.init)
 		return -EINVAL;
 
+	if (t->priv.standby)
+		return r850_resume(t);
+
 #if 0
 	mutex_lock(&t->priv.lock);
 
@@ -2277,12 +2591,19 @@ int r850_set_system(struct r850_tuner *t, struct r850_system_config *system)
 
 	mutex_lock(&t->priv.lock);
 
+	/* the tuner is still programmed for it after the light standby */
+	if (!memcmp(&t->priv.sys, system, sizeof(*system)) &&
+	    t->priv.mixer_mode == mixer_mode &&
+	    t->priv.mixer_amp_lpf_imr_cal == mixer_amp_lpf_imr_cal)
+		goto exit;
+
 	t->priv.sys = *system;
 	t->priv.mixer_mode = mixer_mode;
 	t->priv.mixer_amp_lpf_imr_cal = mixer_amp_lpf_imr_cal;
 
 	t->priv.sys_curr.system = R850_SYSTEM_UNDEFINED;
 
+exit:
 	mutex_unlock(&t->priv.lock);
 
 	return 0;
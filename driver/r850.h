@@ -17,6 +17,7 @@
 #endif
 
 #include "i2c_comm.h"
+#include "reg_cache.h"
 
 #define R850_NUM_REGS	0x30
 
@@ -26,6 +27,7 @@ struct r850_config {
 	bool clock_out;
 	bool no_imr_calibration;
 	bool no_lpf_calibration;
+	bool light_standby;	// r850_sleep() only powers down, keeping the settings
 };
 
 enum r850_system {
@@ -60,22 +62,46 @@ struct r850_imr {
 	u8 value;
 };
 
+struct r850_lpf_params {
+	u8 code;
+	u8 bandwidth;
+	u8 lsb;
+};
+
+struct r850_imr_calibration {
+	struct r850_imr imr[5];
+	bool done;
+	bool result[5];
+	u8 mixer_amp_lpf;
+};
+
+struct r850_lpf_calibration {
+	bool done;
+	struct r850_system_config sys;
+	struct r850_lpf_params lpf;
+};
+
+/* calibration results, can be saved and restored across r850_init() */
+struct r850_calibration_data {
+	struct r850_imr_calibration imr_cal[2];
+	struct r850_lpf_calibration lpf_cal;
+};
+
 struct r850_priv {
 	struct mutex lock;
 	bool init;
 	int chip;
 	u8 xtal_pwr;
 	u8 regs[R850_NUM_REGS];
+	struct reg_cache hw_regs;	// values in the tuner
+	struct reg_cache_bank hw_regs_bank;
 	bool sleep;
+	bool standby;		// asleep in the light standby
 	struct r850_system_config sys;
 	u8 mixer_mode;
 	u8 mixer_amp_lpf_imr_cal;
-	struct {
-		struct r850_imr imr[5];
-		bool done;
-		bool result[5];
-		u8 mixer_amp_lpf;
-	} imr_cal[2];
+	struct r850_imr_calibration imr_cal[2];
+	struct r850_lpf_calibration lpf_cal;
 	struct r850_system_config sys_curr;
 };
 
@@ -83,6 +109,7 @@ struct r850_tuner {
 	const struct device *dev;
 	const struct i2c_comm_master *i2c;
 	u8 i2c_addr;
+	struct i2c_comm_stats i2c_stats;
 	struct r850_config config;
 	struct r850_priv priv;
 };
@@ -93,6 +120,11 @@ extern "C" {
 int r850_init(struct r850_tuner *t);
 int r850_term(struct r850_tuner *t);
 
+int r850_get_calibration(struct r850_tuner *t,
+			 struct r850_calibration_data *cal);
+int r850_set_calibration(struct r850_tuner *t,
+			 const struct r850_calibration_data *cal);
+
 int r850_sleep(struct r850_tuner *t);
 int r850_wakeup(struct r850_tuner *t);
 int r850_set_system(struct r850_tuner *t,
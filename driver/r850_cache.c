@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * R850 calibration cache (r850_cache.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "print_format.h"
+#include "r850_cache.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/usb.h>
+
+#include "px4_device_params.h"
+
+struct r850_cache_entry {
+	struct list_head list;
+	char key[64];
+	int index;
+	unsigned long timestamp;
+	struct r850_calibration_data cal;
+};
+
+static LIST_HEAD(r850_cache_list);
+static DEFINE_MUTEX(r850_cache_lock);
+
+static void r850_cache_make_key(struct it930x_bridge *it930x,
+				char *key, size_t len)
+{
+	struct usb_device *usb_dev = it930x->bus.usb.dev;
+
+	/* fall back to the bus path for devices without a serial number */
+	if (usb_dev && usb_dev->serial && usb_dev->serial[0])
+		snprintf(key, len, "%04x:%04x:%s",
+			 le16_to_cpu(usb_dev->descriptor.idVendor),
+			 le16_to_cpu(usb_dev->descriptor.idProduct),
+			 usb_dev->serial);
+	else
+		snprintf(key, len, "%s", dev_name(it930x->dev));
+}
+
+/* must be called with r850_cache_lock held */
+static struct r850_cache_entry *r850_cache_find(const char *key, int index)
+{
+	struct r850_cache_entry *entry;
+
+	list_for_each_entry(entry, &r850_cache_list, list) {
+		if (entry->index == index && !strcmp(entry->key, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+bool r850_cache_load(struct it930x_bridge *it930x, int index,
+		     struct r850_tuner *t)
+{
+	unsigned int max_age = px4_device_params.r850_cal_cache_max_age;
+	struct r850_cache_entry *entry;
+	char key[64];
+	bool loaded = false;
+
+	if (!max_age)
+		return false;
+
+	r850_cache_make_key(it930x, key, sizeof(key));
+
+	mutex_lock(&r850_cache_lock);
+
+	entry = r850_cache_find(key, index);
+	if (!entry)
+		goto exit;
+
+	if (time_after(jiffies,
+		       entry->timestamp + msecs_to_jiffies(max_age * 1000))) {
+		dev_dbg(it930x->dev,
+			"r850_cache_load: %s:%d: expired\n", key, index);
+		list_del(&entry->list);
+		kfree(entry);
+		goto exit;
+	}
+
+	loaded = !r850_set_calibration(t, &entry->cal);
+
+exit:
+	mutex_unlock(&r850_cache_lock);
+
+	return loaded;
+}
+
+void r850_cache_store(struct it930x_bridge *it930x, int index,
+		      struct r850_tuner *t)
+{
+	struct r850_cache_entry *entry;
+	struct r850_calibration_data cal;
+	char key[64];
+
+	if (!px4_device_params.r850_cal_cache_max_age)
+		return;
+
+	if (r850_get_calibration(t, &cal))
+		return;
+
+	/* nothing calibrated yet */
+	if (!cal.imr_cal[0].done && !cal.imr_cal[1].done && !cal.lpf_cal.done)
+		return;
+
+	r850_cache_make_key(it930x, key, sizeof(key));
+
+	mutex_lock(&r850_cache_lock);
+
+	entry = r850_cache_find(key, index);
+	if (!entry) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry)
+			goto exit;
+
+		memcpy(entry->key, key, sizeof(entry->key));
+		entry->index = index;
+		entry->timestamp = jiffies;
+		list_add(&entry->list, &r850_cache_list);
+	} else if (memcmp(&entry->cal, &cal, sizeof(cal))) {
+		/* recalibrated, restart the age from now */
+		entry->timestamp = jiffies;
+	}
+
+	entry->cal = cal;
+
+exit:
+	mutex_unlock(&r850_cache_lock);
+}
+
+void r850_cache_cleanup(void)
+{
+	struct r850_cache_entry *entry, *tmp;
+
+	mutex_lock(&r850_cache_lock);
+
+	list_for_each_entry_safe(entry, tmp, &r850_cache_list, list) {
+		list_del(&entry->list);
+		kfree(entry);
+	}
+
+	mutex_unlock(&r850_cache_lock);
+}
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * R850 calibration cache definitions (r850_cache.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __R850_CACHE_H__
+#define __R850_CACHE_H__
+
+#include <linux/types.h>
+
+#include "it930x.h"
+#include "r850.h"
+
+bool r850_cache_load(struct it930x_bridge *it930x, int index,
+		     struct r850_tuner *t);
+void r850_cache_store(struct it930x_bridge *it930x, int index,
+		      struct r850_tuner *t);
+void r850_cache_cleanup(void);
+
+#endif
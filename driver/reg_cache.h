@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Shadow register cache for I2C devices (reg_cache.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __REG_CACHE_H__
+#define __REG_CACHE_H__
+
+#ifdef __linux__
+#include <linux/types.h>
+#include <linux/string.h>
+#elif defined(_WIN32) || defined(_WIN64)
+#include "misc_win.h"
+#endif
+
+/*
+ * Keeps the last values written to (or read from) the registers of a device
+ * with 8-bit register addresses, optionally switching between register banks.
+ * Only registers holding configuration should go through the cache, status
+ * registers must always be read from the device.
+ */
+
+#define REG_CACHE_BANK_UNKNOWN	-1
+
+struct reg_cache_bank {
+	int bank;
+	unsigned int lru;
+	u8 val[256];
+	u8 valid[256 / 8];
+};
+
+struct reg_cache {
+	int num;
+	struct reg_cache_bank *banks;
+	int current_bank;	// selected bank, managed by the driver
+	unsigned int clock;
+};
+
+static inline void reg_cache_invalidate(struct reg_cache *c)
+{
+	int i;
+
+	for (i = 0; i < c->num; i++) {
+		c->banks[i].bank = REG_CACHE_BANK_UNKNOWN;
+		memset(c->banks[i].valid, 0, sizeof(c->banks[i].valid));
+	}
+
+	c->current_bank = REG_CACHE_BANK_UNKNOWN;
+	c->clock = 0;
+}
+
+static inline void reg_cache_init(struct reg_cache *c,
+				  struct reg_cache_bank *banks, int num)
+{
+	c->num = num;
+	c->banks = banks;
+	reg_cache_invalidate(c);
+}
+
+static inline struct reg_cache_bank *reg_cache_get_bank(struct reg_cache *c,
+							int bank, bool create)
+{
+	int i;
+	struct reg_cache_bank *b = NULL;
+
+	if (bank == REG_CACHE_BANK_UNKNOWN)
+		return NULL;
+
+	for (i = 0; i < c->num; i++) {
+		if (c->banks[i].bank == bank) {
+			b = &c->banks[i];
+			break;
+		}
+	}
+
+	if (!b && create) {
+		/* replace the least recently used bank */
+		b = &c->banks[0];
+		for (i = 1; i < c->num; i++) {
+			if (c->banks[i].bank == REG_CACHE_BANK_UNKNOWN ||
+			    c->banks[i].lru < b->lru) {
+				b = &c->banks[i];
+				if (b->bank == REG_CACHE_BANK_UNKNOWN)
+					break;
+			}
+		}
+
+		b->bank = bank;
+		memset(b->valid, 0, sizeof(b->valid));
+	}
+
+	if (b)
+		b->lru = ++c->clock;
+
+	return b;
+}
+
+static inline bool reg_cache_read(struct reg_cache *c, int bank,
+				  u8 reg, u8 *val)
+{
+	struct reg_cache_bank *b = reg_cache_get_bank(c, bank, false);
+
+	if (!b || !(b->valid[reg / 8] & (1 << (reg % 8))))
+		return false;
+
+	*val = b->val[reg];
+	return true;
+}
+
+static inline void reg_cache_write(struct reg_cache *c, int bank,
+				   u8 reg, const u8 *buf, int len)
+{
+	int i;
+	struct reg_cache_bank *b = reg_cache_get_bank(c, bank, true);
+
+	if (!b)
+		return;
+
+	for (i = 0; i < len && reg + i < 256; i++) {
+		b->val[reg + i] = buf[i];
+		b->valid[(reg + i) / 8] |= (1 << ((reg + i) % 8));
+	}
+}
+
+/*
+ * Finds the registers in buf[0..len) which differ from the cached values
+ * (are dirty). Returns false if all of them are known to be up to date.
+ */
+static inline bool reg_cache_get_dirty_range(struct reg_cache *c, int bank,
+					     u8 reg, const u8 *buf, int len,
+					     int *first, int *last)
+{
+	int i;
+	struct reg_cache_bank *b = reg_cache_get_bank(c, bank, false);
+
+	*first = -1;
+	*last = -1;
+
+	for (i = 0; i < len && reg + i < 256; i++) {
+		int r = reg + i;
+
+		if (b && (b->valid[r / 8] & (1 << (r % 8))) && b->val[r] == buf[i])
+			continue;
+
+		if (*first < 0)
+			*first = i;
+
+		*last = i;
+	}
+
+	return (*first >= 0);
+}
+
+/*
+ * Finds the next run of dirty registers in buf[*first..len). Clean gaps of
+ * up to max_gap registers are included in the run, rewriting them costs less
+ * than starting another transfer. Returns false if there is none left.
+ */
+static inline bool reg_cache_get_dirty_run(struct reg_cache *c, int bank,
+					   u8 reg, const u8 *buf, int len,
+					   int max_gap, int *first, int *last)
+{
+	int i, start = *first, gap = 0;
+	struct reg_cache_bank *b = reg_cache_get_bank(c, bank, false);
+
+	*first = -1;
+	*last = -1;
+
+	for (i = start; i < len && reg + i < 256; i++) {
+		int r = reg + i;
+
+		if (b && (b->valid[r / 8] & (1 << (r % 8))) && b->val[r] == buf[i]) {
+			if (*first >= 0 && ++gap > max_gap)
+				break;
+
+			continue;
+		}
+
+		if (*first < 0)
+			*first = i;
+
+		*last = i;
+		gap = 0;
+	}
+
+	return (*first >= 0);
+}
+
+#endif
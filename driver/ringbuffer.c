@@ -8,29 +8,149 @@
 #include "ringbuffer.h"
 
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/sched.h>
 #include <linux/uaccess.h>
 
+#include "px4_trace.h"
+#include "hotpath_prof.h"
+
 static void ringbuffer_free_nolock(struct ringbuffer *ringbuf);
 static void ringbuffer_lock(struct ringbuffer *ringbuf);
 
-int ringbuffer_create(struct ringbuffer **ringbuf)
+/*
+ * Buffers given back are kept for the next user of the same size and node,
+ * up to RINGBUFFER_POOL_MAX of them, instead of being freed right away.
+ */
+#define RINGBUFFER_POOL_MAX	4
+
+struct ringbuffer_pool_entry {
+	struct list_head list;
+	u8 *buf;
+	size_t size;
+	int node;
+};
+
+static LIST_HEAD(ringbuffer_pool);
+static DEFINE_MUTEX(ringbuffer_pool_lock);
+static unsigned int ringbuffer_pool_num = 0;
+
+static u8 *ringbuffer_pool_get(size_t size, int node)
+{
+	struct ringbuffer_pool_entry *entry;
+	u8 *buf = NULL;
+
+	mutex_lock(&ringbuffer_pool_lock);
+
+	list_for_each_entry(entry, &ringbuffer_pool, list) {
+		if (entry->size == size && entry->node == node) {
+			list_del(&entry->list);
+			ringbuffer_pool_num--;
+			buf = entry->buf;
+			kfree(entry);
+			break;
+		}
+	}
+
+	mutex_unlock(&ringbuffer_pool_lock);
+
+	if (buf)
+		/* nothing of the previous user may be mapped to the next one */
+		memset(buf, 0, size);
+	else
+		/* built from single pages, large buffers don't need contiguous memory */
+		buf = vzalloc_node(size, node);
+
+	return buf;
+}
+
+static void ringbuffer_pool_put(u8 *buf, size_t size, int node)
+{
+	struct ringbuffer_pool_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry) {
+		vfree(buf);
+		return;
+	}
+
+	entry->buf = buf;
+	entry->size = size;
+	entry->node = node;
+
+	mutex_lock(&ringbuffer_pool_lock);
+
+	list_add(&entry->list, &ringbuffer_pool);
+
+	/* the oldest one goes first */
+	if (++ringbuffer_pool_num > RINGBUFFER_POOL_MAX) {
+		entry = list_last_entry(&ringbuffer_pool,
+					struct ringbuffer_pool_entry, list);
+		list_del(&entry->list);
+		ringbuffer_pool_num--;
+	} else {
+		entry = NULL;
+	}
+
+	mutex_unlock(&ringbuffer_pool_lock);
+
+	if (entry) {
+		vfree(entry->buf);
+		kfree(entry);
+	}
+
+	return;
+}
+
+/* frees the buffers left in the pool, on unloading of the module */
+void ringbuffer_pool_cleanup(void)
+{
+	struct ringbuffer_pool_entry *entry, *tmp;
+
+	mutex_lock(&ringbuffer_pool_lock);
+
+	list_for_each_entry_safe(entry, tmp, &ringbuffer_pool, list) {
+		list_del(&entry->list);
+		vfree(entry->buf);
+		kfree(entry);
+	}
+
+	ringbuffer_pool_num = 0;
+
+	mutex_unlock(&ringbuffer_pool_lock);
+
+	return;
+}
+
+/* the buffer and the state are allocated on the node of the writer */
+int ringbuffer_create(struct ringbuffer **ringbuf, int node)
 {
 	struct ringbuffer *p;
 
-	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	p = kzalloc_node(sizeof(*p), GFP_KERNEL, node);
 	if (!p)
 		return -ENOMEM;
 
 	atomic_set(&p->state, 0);
-	atomic_set(&p->rw_count, 0);
+	atomic_set(&p->r_count, 0);
 	atomic_set(&p->wait_count, 0);
 	init_waitqueue_head(&p->wait);
 	p->buf = NULL;
 	p->size = 0;
-	atomic_set(&p->actual_size, 0);
-	atomic_set(&p->head, 0);
+	p->node = node;
+	atomic_set(&p->w_count, 0);
 	atomic_set(&p->tail, 0);
+	p->write_count = 0;
+	p->filled = 0;
+	atomic_set(&p->reader_mask, 0);
+	atomic_set(&p->sync_mask, 0);
+	atomic_set(&p->seek_mask, 0);
+	p->policy = RINGBUFFER_DROP_OLDEST;
+	p->unit_size = RINGBUFFER_DEFAULT_UNIT_SIZE;
+	p->dropped = 0;
+	p->peak_size = 0;
 
 	*ringbuf = p;
 
@@ -48,23 +168,59 @@ int ringbuffer_destroy(struct ringbuffer *ringbuf)
 	return 0;
 }
 
-static void ringbuffer_free_nolock(struct ringbuffer *ringbuf)
+/* gives the buffer back to the pool, the size is kept */
+static void ringbuffer_depopulate_nolock(struct ringbuffer *ringbuf)
 {
 	if (ringbuf->buf)
-		free_pages((unsigned long)ringbuf->buf,
-			   get_order(ringbuf->size));
+		ringbuffer_pool_put(ringbuf->buf, ringbuf->size, ringbuf->node);
 
 	ringbuf->buf = NULL;
+
+	return;
+}
+
+static void ringbuffer_free_nolock(struct ringbuffer *ringbuf)
+{
+	ringbuffer_depopulate_nolock(ringbuf);
 	ringbuf->size = 0;
 
 	return;
 }
 
+static void ringbuffer_reader_reset(struct ringbuffer *ringbuf, int id,
+				    int head, u32 tail)
+{
+	struct ringbuffer_reader *reader = &ringbuf->reader[id];
+	struct ringbuffer_ctrl *ctrl = reader->ctrl;
+
+	/* nothing to read */
+	reader->read_count = ringbuf->write_count;
+	ringbuf->cached_read_count[id] = ringbuf->write_count;
+	smp_wmb();
+	atomic_set(&reader->head, head);
+
+	if (ctrl) {
+		WRITE_ONCE(ctrl->head, tail);
+		WRITE_ONCE(ctrl->tail, tail);
+		WRITE_ONCE(ctrl->read_count, 0);
+		smp_store_release(&ctrl->write_count, 0);
+	}
+
+	return;
+}
+
 static void ringbuffer_reset_nolock(struct ringbuffer *ringbuf)
 {
-	atomic_set(&ringbuf->actual_size, 0);
-	atomic_set(&ringbuf->head, 0);
+	int i;
+
 	atomic_set(&ringbuf->tail, 0);
+	ringbuf->write_count = 0;
+	ringbuf->filled = 0;
+	atomic_set(&ringbuf->sync_mask, 0);
+	atomic_set(&ringbuf->seek_mask, 0);
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++)
+		ringbuffer_reader_reset(ringbuf, i, 0, 0);
 
 	return;
 }
@@ -72,7 +228,8 @@ static void ringbuffer_reset_nolock(struct ringbuffer *ringbuf)
 static void ringbuffer_lock(struct ringbuffer *ringbuf)
 {
 	atomic_add_return(1, &ringbuf->wait_count);
-	wait_event(ringbuf->wait, !atomic_read(&ringbuf->rw_count));
+	wait_event(ringbuf->wait, (!atomic_read(&ringbuf->w_count) &&
+				   !atomic_read(&ringbuf->r_count)));
 
 	return;
 }
@@ -104,13 +261,7 @@ int ringbuffer_alloc(struct ringbuffer *ringbuf, size_t size)
 	ringbuffer_reset_nolock(ringbuf);
 
 	if (!ringbuf->buf) {
-#ifdef __GFP_RETRY_MAYFAIL
-		ringbuf->buf = (u8 *)__get_free_pages(GFP_KERNEL | __GFP_RETRY_MAYFAIL,
-						      get_order(size));
-#else
-		ringbuf->buf = (u8 *)__get_free_pages(GFP_KERNEL | __GFP_REPEAT,
-						      get_order(size));
-#endif
+		ringbuf->buf = ringbuffer_pool_get(size, ringbuf->node);
 		if (!ringbuf->buf)
 			ret = -ENOMEM;
 		else
@@ -122,6 +273,65 @@ int ringbuffer_alloc(struct ringbuffer *ringbuf, size_t size)
 	return ret;
 }
 
+/*
+ * Sets the size without allocating the buffer yet, ringbuffer_populate()
+ * does it when the buffer is about to be used.
+ */
+int ringbuffer_set_size(struct ringbuffer *ringbuf, size_t size)
+{
+	if (size > INT_MAX)
+		return -EINVAL;
+
+	if (atomic_read_acquire(&ringbuf->state))
+		return -EBUSY;
+
+	ringbuffer_lock(ringbuf);
+
+	if (ringbuf->size != size)
+		ringbuffer_depopulate_nolock(ringbuf);
+
+	ringbuf->size = size;
+	ringbuffer_reset_nolock(ringbuf);
+	ringbuffer_unlock(ringbuf);
+
+	return 0;
+}
+
+int ringbuffer_populate(struct ringbuffer *ringbuf)
+{
+	int ret = 0;
+
+	if (atomic_read_acquire(&ringbuf->state))
+		return -EBUSY;
+
+	ringbuffer_lock(ringbuf);
+
+	if (!ringbuf->buf && ringbuf->size) {
+		ringbuf->buf = ringbuffer_pool_get(ringbuf->size, ringbuf->node);
+		if (!ringbuf->buf)
+			ret = -ENOMEM;
+		else
+			ringbuffer_reset_nolock(ringbuf);
+	}
+
+	ringbuffer_unlock(ringbuf);
+
+	return ret;
+}
+
+int ringbuffer_depopulate(struct ringbuffer *ringbuf)
+{
+	if (atomic_read_acquire(&ringbuf->state))
+		return -EBUSY;
+
+	ringbuffer_lock(ringbuf);
+	ringbuffer_reset_nolock(ringbuf);
+	ringbuffer_depopulate_nolock(ringbuf);
+	ringbuffer_unlock(ringbuf);
+
+	return 0;
+}
+
 int ringbuffer_free(struct ringbuffer *ringbuf)
 {
 	if (atomic_read_acquire(&ringbuf->state))
@@ -149,6 +359,10 @@ int ringbuffer_reset(struct ringbuffer *ringbuf)
 
 int ringbuffer_start(struct ringbuffer *ringbuf)
 {
+	/* nothing to write into */
+	if (unlikely(!ringbuf->buf))
+		return -ENOMEM;
+
 	if (atomic_cmpxchg(&ringbuf->state, 0, 1))
 		return -EALREADY;
 
@@ -171,26 +385,189 @@ int ringbuffer_ready_read(struct ringbuffer *ringbuf)
 	return 0;
 }
 
-int ringbuffer_read_user(struct ringbuffer *ringbuf,
-			 void __user *buf, size_t *len)
+/* the caller must serialize attach and detach */
+int ringbuffer_attach(struct ringbuffer *ringbuf,
+		      struct ringbuffer_ctrl *ctrl, int *id)
+{
+	int mask, i;
+	struct ringbuffer_reader *reader;
+
+	mask = atomic_read(&ringbuf->reader_mask);
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		if (!(mask & (1 << i)))
+			break;
+	}
+
+	if (i == RINGBUFFER_MAX_READERS)
+		return -EBUSY;
+
+	reader = &ringbuf->reader[i];
+
+	atomic_set(&reader->busy, 0);
+	reader->flags = 0;
+	reader->dropped = 0;
+	atomic_set(&reader->overflows, 0);
+	reader->ctrl = ctrl;
+
+	if (ctrl)
+		ctrl->size = ringbuf->size;
+
+	/* the writer moves the head to the current tail on the next write */
+	atomic_set(&reader->head, -1);
+	atomic_fetch_or(1 << i, &ringbuf->sync_mask);
+
+	atomic_fetch_or(1 << i, &ringbuf->reader_mask);
+
+	*id = i;
+
+	return 0;
+}
+
+void ringbuffer_detach(struct ringbuffer *ringbuf, int id)
+{
+	atomic_fetch_andnot(1 << id, &ringbuf->reader_mask);
+	atomic_fetch_andnot(1 << id, &ringbuf->sync_mask);
+	atomic_fetch_andnot(1 << id, &ringbuf->seek_mask);
+
+	/* wait for the writer to leave the reader */
+	ringbuffer_lock(ringbuf);
+	ringbuf->reader[id].ctrl = NULL;
+	ringbuffer_unlock(ringbuf);
+
+	return;
+}
+
+void ringbuffer_set_reader_flags(struct ringbuffer *ringbuf, int id, u32 flags)
+{
+	WRITE_ONCE(ringbuf->reader[id].flags, flags);
+}
+
+int ringbuffer_set_overflow_policy(struct ringbuffer *ringbuf,
+				   enum ringbuffer_overflow_policy policy)
+{
+	switch (policy) {
+	case RINGBUFFER_DROP_OLDEST:
+	case RINGBUFFER_DROP_NEWEST:
+	case RINGBUFFER_DROP_WRITE:
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(ringbuf->policy, policy);
+
+	return 0;
+}
+
+/* the caller must not change the unit size while writing */
+int ringbuffer_set_unit_size(struct ringbuffer *ringbuf, u32 unit_size)
+{
+	if (!unit_size || unit_size > ringbuf->size)
+		return -EINVAL;
+
+	WRITE_ONCE(ringbuf->unit_size, unit_size);
+
+	return 0;
+}
+
+/* returns the number of overflow events since the last call */
+u32 ringbuffer_get_overflows(struct ringbuffer *ringbuf, int id)
+{
+	return atomic_xchg(&ringbuf->reader[id].overflows, 0);
+}
+
+bool ringbuffer_has_overflowed(struct ringbuffer *ringbuf, int id)
+{
+	return !!atomic_read(&ringbuf->reader[id].overflows);
+}
+
+/* data got lost before it reached the buffer, reported as an overflow */
+void ringbuffer_report_loss(struct ringbuffer *ringbuf)
+{
+	int mask = atomic_read_acquire(&ringbuf->reader_mask), i;
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		if (mask & (1 << i))
+			atomic_inc(&ringbuf->reader[i].overflows);
+	}
+
+	return;
+}
+
+static void ringbuffer_reader_claim(struct ringbuffer_reader *reader)
+{
+	while (atomic_cmpxchg(&reader->busy, 0, 1))
+		cond_resched();
+
+	return;
+}
+
+static void ringbuffer_reader_release(struct ringbuffer_reader *reader)
+{
+	atomic_set_release(&reader->busy, 0);
+}
+
+static size_t ringbuffer_reader_readable(struct ringbuffer *ringbuf,
+					 struct ringbuffer_reader *reader)
+{
+	/* pairs with the release of write_count by the writer */
+	return smp_load_acquire(&ringbuf->write_count) - reader->read_count;
+}
+
+static void ringbuffer_reader_consume(struct ringbuffer_reader *reader,
+				      size_t head, size_t len)
+{
+	struct ringbuffer_ctrl *ctrl = reader->ctrl;
+
+	atomic_set(&reader->head, head);
+	smp_store_release(&reader->read_count, reader->read_count + len);
+
+	if (ctrl) {
+		WRITE_ONCE(ctrl->head, head);
+		smp_store_release(&ctrl->read_count, ctrl->read_count + len);
+	}
+
+	return;
+}
+
+static __always_inline unsigned long ringbuffer_copy(void *to,
+						     const void *from,
+						     size_t len, bool user)
+{
+	if (user)
+		return copy_to_user((void __force __user *)to, from, len);
+
+	memcpy(to, from, len);
+	return 0;
+}
+
+static __always_inline int ringbuffer_read_common(struct ringbuffer *ringbuf,
+						  int id, void *buf,
+						  size_t *len, bool user)
 {
 	int ret = 0;
+	struct ringbuffer_reader *reader = &ringbuf->reader[id];
 	u8 *p;
-	size_t buf_size, actual_size, head, read_size;
+	size_t buf_size, actual_size, read_size;
+	int head;
 
-	atomic_add_return_acquire(1, &ringbuf->rw_count);
+	atomic_add_return_acquire(1, &ringbuf->r_count);
+	ringbuffer_reader_claim(reader);
 
 	p = ringbuf->buf;
 	buf_size = ringbuf->size;
-	actual_size = atomic_read_acquire(&ringbuf->actual_size);
-	head = atomic_read(&ringbuf->head);
+	/* pairs with the barrier when the writer synchronizes the reader */
+	head = atomic_read_acquire(&reader->head);
+	actual_size = ringbuffer_reader_readable(ringbuf, reader);
 
 	read_size = (*len <= actual_size) ? *len : actual_size;
-	if (likely(read_size)) {
+	if (likely(read_size && head >= 0)) {
 		unsigned long res;
 
 		if (likely(head + read_size <= buf_size)) {
-			res = copy_to_user(buf, p + head, read_size);
+			res = ringbuffer_copy(buf, p + head, read_size, user);
 			if (unlikely(res)) {
 				read_size -= res;
 				ret = -EFAULT;
@@ -201,10 +578,10 @@ int ringbuffer_read_user(struct ringbuffer *ringbuf,
 		} else {
 			size_t tmp = buf_size - head;
 
-			res = copy_to_user(buf, p + head, tmp);
+			res = ringbuffer_copy(buf, p + head, tmp, user);
 			if (likely(!res))
-				res = copy_to_user(((u8 *)buf) + tmp, p,
-						   read_size - tmp);
+				res = ringbuffer_copy(((u8 *)buf) + tmp, p,
+						      read_size - tmp, user);
 
 			if (unlikely(res)) {
 				read_size -= res;
@@ -214,12 +591,14 @@ int ringbuffer_read_user(struct ringbuffer *ringbuf,
 			head = read_size - tmp;
 		}
 
-		atomic_xchg(&ringbuf->head, head);
-		atomic_sub_return_release(read_size,
-					  &ringbuf->actual_size);
+		ringbuffer_reader_consume(reader, head, read_size);
+	} else {
+		read_size = 0;
 	}
 
-	if (unlikely(!atomic_sub_return(1, &ringbuf->rw_count) &&
+	ringbuffer_reader_release(reader);
+
+	if (unlikely(!atomic_sub_return(1, &ringbuf->r_count) &&
 	    atomic_read(&ringbuf->wait_count)))
 		wake_up(&ringbuf->wait);
 
@@ -228,61 +607,400 @@ int ringbuffer_read_user(struct ringbuffer *ringbuf,
 	return ret;
 }
 
-int ringbuffer_write_atomic(struct ringbuffer *ringbuf,
-			    const void *buf, size_t *len)
+int ringbuffer_read_user(struct ringbuffer *ringbuf, int id,
+			 void __user *buf, size_t *len)
+{
+	return ringbuffer_read_common(ringbuf, id, (void __force *)buf, len,
+				      true);
+}
+
+/* copies into a kernel buffer, used to fill the pages given to a pipe */
+int ringbuffer_read(struct ringbuffer *ringbuf, int id, void *buf, size_t *len)
+{
+	return ringbuffer_read_common(ringbuf, id, buf, len, false);
+}
+
+int ringbuffer_advance(struct ringbuffer *ringbuf, int id, size_t *len)
+{
+	struct ringbuffer_reader *reader = &ringbuf->reader[id];
+	size_t buf_size, actual_size, read_size;
+	int head;
+
+	atomic_add_return_acquire(1, &ringbuf->r_count);
+	ringbuffer_reader_claim(reader);
+
+	buf_size = ringbuf->size;
+	/* pairs with the barrier when the writer synchronizes the reader */
+	head = atomic_read_acquire(&reader->head);
+	actual_size = ringbuffer_reader_readable(ringbuf, reader);
+
+	read_size = (*len <= actual_size) ? *len : actual_size;
+	if (likely(read_size && head >= 0)) {
+		head += read_size;
+		if (head >= buf_size)
+			head -= buf_size;
+
+		ringbuffer_reader_consume(reader, head, read_size);
+	} else {
+		read_size = 0;
+	}
+
+	ringbuffer_reader_release(reader);
+
+	if (unlikely(!atomic_sub_return(1, &ringbuf->r_count) &&
+	    atomic_read(&ringbuf->wait_count)))
+		wake_up(&ringbuf->wait);
+
+	*len = read_size;
+
+	return 0;
+}
+
+/*
+ * Moves the reader to where the writer had written write_count bytes in
+ * total, backwards as well as forwards, as far as the data is still in the
+ * buffer. The writer does it on its next write, the reader has nothing to
+ * read until then.
+ */
+void ringbuffer_seek(struct ringbuffer *ringbuf, int id, u32 write_count)
+{
+	WRITE_ONCE(ringbuf->reader[id].seek_count, write_count);
+	atomic_fetch_or(1 << id, &ringbuf->seek_mask);
+}
+
+int ringbuffer_mmap(struct ringbuffer *ringbuf, struct vm_area_struct *vma,
+		    unsigned long addr, unsigned long size)
+{
+	int ret = 0;
+	unsigned long off;
+
+	if (!ringbuf->buf)
+		return -EINVAL;
+
+	if (size > PAGE_ALIGN(ringbuf->size))
+		return -EINVAL;
+
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		ret = vm_insert_page(vma, addr + off,
+				     vmalloc_to_page(ringbuf->buf + off));
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns the number of bytes that can be written without overwriting
+ * unread data of the reader.
+ * A full reader which is not being read at the moment loses its oldest data
+ * instead, so that a stalled reader never holds up the others.
+ */
+static size_t ringbuffer_reader_make_room(struct ringbuffer *ringbuf, int id,
+					  enum ringbuffer_overflow_policy policy,
+					  size_t len)
+{
+	struct ringbuffer_reader *reader = &ringbuf->reader[id];
+	size_t buf_size = ringbuf->size;
+	u32 write_count = ringbuf->write_count;
+	size_t actual_size, free_size, drop_size;
+	int head;
+
+	/* the cached read count is never ahead of the reader */
+	free_size = buf_size - (write_count - ringbuf->cached_read_count[id]);
+	if (likely(len <= free_size))
+		return free_size;
+
+	ringbuf->cached_read_count[id] = smp_load_acquire(&reader->read_count);
+	free_size = buf_size - (write_count - ringbuf->cached_read_count[id]);
+	if (likely(len <= free_size))
+		return free_size;
+
+	if (policy != RINGBUFFER_DROP_OLDEST ||
+	    (READ_ONCE(reader->flags) & RINGBUFFER_READER_NO_DISCARD) ||
+	    atomic_cmpxchg(&reader->busy, 0, 1))
+		return free_size;
+
+	/* whole packets only, the reader may have consumed part of one */
+	actual_size = write_count - reader->read_count;
+	free_size = buf_size - actual_size;
+	drop_size = (len > free_size) ? roundup(min(len, buf_size) - free_size,
+						ringbuf->unit_size)
+				      : 0;
+	if (drop_size > actual_size)
+		drop_size = actual_size;
+
+	head = atomic_read(&reader->head) + drop_size;
+	if (head >= buf_size)
+		head -= buf_size;
+
+	ringbuffer_reader_consume(reader, head, drop_size);
+	ringbuf->cached_read_count[id] = reader->read_count;
+
+	if (drop_size) {
+		reader->dropped += drop_size;
+		ringbuf->dropped += drop_size;
+		atomic_inc(&reader->overflows);
+		trace_px4_ringbuf_drop(ringbuf, id, drop_size);
+	}
+
+	ringbuffer_reader_release(reader);
+
+	return free_size + drop_size;
+}
+
+/*
+ * Done by the writer, which knows how much of the buffer holds valid data.
+ * A reader in the middle of a read is moved on a later write.
+ */
+static void ringbuffer_seek_readers(struct ringbuffer *ringbuf, int seek,
+				    size_t tail)
+{
+	size_t buf_size = ringbuf->size;
+	u32 write_count = ringbuf->write_count;
+	u32 max_size = rounddown(buf_size, READ_ONCE(ringbuf->unit_size));
+	int i, done = 0;
+
+	/* the buffer is not full yet, write_count wraps and can't tell */
+	if (ringbuf->filled < max_size)
+		max_size = ringbuf->filled;
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		struct ringbuffer_reader *reader = &ringbuf->reader[i];
+		struct ringbuffer_ctrl *ctrl = reader->ctrl;
+		u32 back;
+		int head;
+
+		if (!(seek & (1 << i)) || atomic_cmpxchg(&reader->busy, 0, 1))
+			continue;
+
+		back = write_count - READ_ONCE(reader->seek_count);
+		if ((s32)back < 0)
+			back = 0;
+		else if (back > max_size)
+			back = max_size;
+
+		head = (tail >= back) ? (tail - back) : (tail + buf_size - back);
+
+		reader->read_count = write_count - back;
+		ringbuf->cached_read_count[i] = write_count - back;
+		smp_wmb();
+		atomic_set(&reader->head, head);
+
+		if (ctrl) {
+			WRITE_ONCE(ctrl->head, head);
+			smp_store_release(&ctrl->read_count,
+					  ctrl->write_count - back);
+		}
+
+		ringbuffer_reader_release(reader);
+		done |= 1 << i;
+	}
+
+	if (done)
+		atomic_fetch_andnot(done, &ringbuf->seek_mask);
+
+	return;
+}
+
+/* copies into the buffer at tail, returns the new tail */
+static __always_inline size_t ringbuffer_put(u8 *p, size_t buf_size,
+					     size_t tail, const void *buf,
+					     size_t len)
+{
+	if (likely(tail + len <= buf_size)) {
+		memcpy(p + tail, buf, len);
+		return unlikely(tail + len == buf_size) ? 0 : (tail + len);
+	} else {
+		size_t tmp = buf_size - tail;
+
+		memcpy(p + tail, buf, tmp);
+		memcpy(p, ((u8 *)buf) + tmp, len - tmp);
+		return len - tmp;
+	}
+}
+
+/* *len: the total of the runs in, the size written out */
+static __always_inline int ringbuffer_write_common(struct ringbuffer *ringbuf,
+						   const struct ringbuffer_vec *vec,
+						   unsigned int num,
+						   size_t *len)
 {
 	int ret = 0;
 	u8 *p;
-	size_t buf_size, actual_size, tail, write_size;
+	size_t buf_size, tail, write_size, peak_size;
+	enum ringbuffer_overflow_policy policy;
+	u32 unit_size, write_count;
+	int mask, sync, seek, i;
 
 	if (unlikely(atomic_read(&ringbuf->state) != 2))
 		return -EINVAL;
 
-	atomic_add_return_acquire(1, &ringbuf->rw_count);
+	atomic_add_return_acquire(1, &ringbuf->w_count);
+
+	mask = atomic_read_acquire(&ringbuf->reader_mask);
+	if (unlikely(!mask))
+		goto exit;
 
 	p = ringbuf->buf;
 	buf_size = ringbuf->size;
-	actual_size = atomic_read_acquire(&ringbuf->actual_size);
 	tail = atomic_read(&ringbuf->tail);
+	policy = READ_ONCE(ringbuf->policy);
+	unit_size = READ_ONCE(ringbuf->unit_size);
+
+	/* newly attached readers start from the current tail */
+	sync = atomic_read(&ringbuf->sync_mask) & mask;
+	if (unlikely(sync)) {
+		for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+			if (sync & (1 << i))
+				ringbuffer_reader_reset(ringbuf, i, tail, tail);
+		}
+
+		atomic_fetch_andnot(sync, &ringbuf->sync_mask);
+	}
+
+	/* after the synchronization, a new reader may start in the past */
+	seek = atomic_read(&ringbuf->seek_mask) & mask;
+	if (unlikely(seek))
+		ringbuffer_seek_readers(ringbuf, seek, tail);
+
+	write_size = *len;
+	px4_prof_add(PX4_PROF_RB_WRITES, 1);
+
+	for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+		size_t free_size;
+
+		if (!(mask & (1 << i)))
+			continue;
+
+		free_size = ringbuffer_reader_make_room(ringbuf, i, policy, *len);
+		if (write_size > free_size)
+			write_size = free_size;
+	}
+
+	if (unlikely(write_size != *len)) {
+		if (policy == RINGBUFFER_DROP_WRITE)
+			write_size = 0;
+		else
+			write_size = rounddown(write_size, unit_size);
+
+		/* the data not written is lost for every reader */
+		for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+			if (mask & (1 << i))
+				atomic_inc(&ringbuf->reader[i].overflows);
+		}
+	}
 
-	write_size = likely(actual_size + *len <= buf_size) ? *len
-							    : (buf_size - actual_size);
 	if (likely(write_size)) {
-		if (likely(tail + write_size <= buf_size)) {
-			memcpy(p + tail, buf, write_size);
-			tail = unlikely(tail + write_size == buf_size) ? 0
-								       : (tail + write_size);
-		} else {
-			size_t tmp = buf_size - tail;
+		size_t left = write_size;
+		unsigned int j;
+
+		/* the runs in order, as far as they fit */
+		for (j = 0; j < num && left; j++) {
+			size_t n = min(vec[j].len, left);
 
-			memcpy(p + tail, buf, tmp);
-			memcpy(p, ((u8 *)buf) + tmp, write_size - tmp);
-			tail = write_size - tmp;
+			tail = ringbuffer_put(p, buf_size, tail, vec[j].buf, n);
+			left -= n;
 		}
 
-		atomic_xchg(&ringbuf->tail, tail);
-		atomic_add_return_release(write_size,
-					  &ringbuf->actual_size);
-	}
+		atomic_set(&ringbuf->tail, tail);
 
-	if (unlikely(!atomic_sub_return(1, &ringbuf->rw_count) &&
-	    atomic_read(&ringbuf->wait_count)))
-		wake_up(&ringbuf->wait);
+		write_count = ringbuf->write_count + write_size;
+		smp_store_release(&ringbuf->write_count, write_count);
+
+		if (unlikely(ringbuf->filled < buf_size))
+			ringbuf->filled = min_t(size_t,
+						ringbuf->filled + write_size,
+						buf_size);
+
+		peak_size = ringbuf->peak_size;
+
+		for (i = 0; i < RINGBUFFER_MAX_READERS; i++) {
+			struct ringbuffer_ctrl *ctrl = ringbuf->reader[i].ctrl;
+			size_t actual_size;
+
+			if (!(mask & (1 << i)))
+				continue;
+
+			/* may be a bit higher than the real one */
+			actual_size = write_count - ringbuf->cached_read_count[i];
+			if (unlikely(actual_size > peak_size))
+				peak_size = actual_size;
 
-	if (unlikely(*len != write_size))
+			if (ctrl) {
+				WRITE_ONCE(ctrl->tail, tail);
+				smp_store_release(&ctrl->write_count,
+						  ctrl->write_count + write_size);
+			}
+		}
+
+		WRITE_ONCE(ringbuf->peak_size, peak_size);
+	}
+
+	if (unlikely(*len != write_size)) {
+		px4_prof_add((write_size) ? PX4_PROF_RB_PARTIAL
+					  : PX4_PROF_RB_NOTHING, 1);
+		px4_prof_add(PX4_PROF_RB_LOST_BYTES, *len - write_size);
+		px4_prof_hist(PX4_PROF_HIST_RB_LOST, *len - write_size);
 		ret = -EOVERFLOW;
+	}
 
 	*len = write_size;
 
+exit:
+	if (unlikely(!atomic_sub_return(1, &ringbuf->w_count) &&
+	    atomic_read(&ringbuf->wait_count)))
+		wake_up(&ringbuf->wait);
+
 	return ret;
 }
 
+int ringbuffer_write_atomic(struct ringbuffer *ringbuf,
+			    const void *buf, size_t *len)
+{
+	struct ringbuffer_vec vec = { buf, *len };
+
+	return ringbuffer_write_common(ringbuf, &vec, 1, len);
+}
+
+/*
+ * Writes the runs as a single write: one update of the tail and the counts
+ * for all of them. *len is set to the size written, as for
+ * ringbuffer_write_atomic(); on overflow the runs are cut at that size.
+ */
+int ringbuffer_writev_atomic(struct ringbuffer *ringbuf,
+			     const struct ringbuffer_vec *vec,
+			     unsigned int num, size_t *len)
+{
+	unsigned int i;
+
+	*len = 0;
+	for (i = 0; i < num; i++)
+		*len += vec[i].len;
+
+	return ringbuffer_write_common(ringbuf, vec, num, len);
+}
+
 bool ringbuffer_is_running(struct ringbuffer *ringbuf)
 {
 	return !!atomic_read_acquire(&ringbuf->state);
 }
 
-bool ringbuffer_is_readable(struct ringbuffer *ringbuf)
+size_t ringbuffer_readable_size(struct ringbuffer *ringbuf, int id)
+{
+	struct ringbuffer_reader *reader = &ringbuf->reader[id];
+
+	if (atomic_read_acquire(&reader->head) < 0)
+		return 0;
+
+	/* the position is about to change */
+	if (unlikely(atomic_read(&ringbuf->seek_mask) & (1 << id)))
+		return 0;
+
+	return ringbuffer_reader_readable(ringbuf, reader);
+}
+
+bool ringbuffer_is_readable(struct ringbuffer *ringbuf, int id)
 {
-	return !!atomic_read_acquire(&ringbuf->actual_size);
+	return !!ringbuffer_readable_size(ringbuf, id);
 }
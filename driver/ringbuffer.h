@@ -11,32 +11,116 @@
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/cache.h>
+#include <linux/numa.h>
+
+#define RINGBUFFER_MAX_READERS		8
+
+#define RINGBUFFER_READER_NO_DISCARD	0x00000001
+
+/* data is dropped in units of a TS packet by default */
+#define RINGBUFFER_DEFAULT_UNIT_SIZE	188
+
+enum ringbuffer_overflow_policy {
+	RINGBUFFER_DROP_OLDEST = 0,	// discard the oldest data of a full reader
+	RINGBUFFER_DROP_NEWEST,		// write as much as fits
+	RINGBUFFER_DROP_WRITE,		// write nothing unless all of it fits
+};
+
+/* shared with userspace, same layout as struct ptx_mmap_ctrl */
+struct ringbuffer_ctrl {
+	u32 size;
+	u32 head;
+	u32 tail;
+	u32 read_count;
+	u32 write_count;
+};
+
+/*
+ * The readable size of a reader is (write_count - read_count). Each counter
+ * is written by one side only, and the writer keeps a copy of the read counts
+ * which it refreshes only when a reader looks full, so that the writer and
+ * the readers don't keep pulling each other's cache lines.
+ */
+
+struct ringbuffer_reader {
+	atomic_t busy;
+	atomic_t head;		// read, -1: not synchronized with the writer yet
+	u32 read_count;		// total bytes consumed (wraps)
+	u32 flags;
+	u64 dropped;
+	u32 seek_count;		// ringbuffer_seek(), write count to move to
+	atomic_t overflows;	// overflow events not reported yet
+	struct ringbuffer_ctrl *ctrl;
+} ____cacheline_aligned_in_smp;
+
+/* a run of data for ringbuffer_writev_atomic() */
+struct ringbuffer_vec {
+	const void *buf;
+	size_t len;
+};
 
 struct ringbuffer {
 	atomic_t state;
-	atomic_t rw_count;
+	atomic_t r_count;	// readers inside the buffer
 	atomic_t wait_count;
 	wait_queue_head_t wait;
 	u8 *buf;
 	size_t size;
-	atomic_t actual_size;
-	atomic_t head;	// read
+	int node;		// NUMA node of the buffer, NUMA_NO_NODE: any
+	atomic_t reader_mask;
+	atomic_t sync_mask;	// readers to be synchronized on the next write
+	atomic_t seek_mask;	// readers to be moved on the next write
+	enum ringbuffer_overflow_policy policy;
+	u32 unit_size;
+	/* written by the writer only */
+	atomic_t w_count ____cacheline_aligned_in_smp;
 	atomic_t tail;	// write
+	u32 write_count;	// total bytes written (wraps)
+	size_t filled;		// bytes written since the reset, up to size
+	u32 cached_read_count[RINGBUFFER_MAX_READERS];
+	u64 dropped;		// total bytes discarded from full readers
+	size_t peak_size;	// highest fill level seen by the writer
+	struct ringbuffer_reader reader[RINGBUFFER_MAX_READERS];
 };
 
-int ringbuffer_create(struct ringbuffer **ringbuf);
+int ringbuffer_create(struct ringbuffer **ringbuf, int node);
 int ringbuffer_destroy(struct ringbuffer *ringbuf);
 int ringbuffer_alloc(struct ringbuffer *ringbuf, size_t size);
 int ringbuffer_free(struct ringbuffer *ringbuf);
+int ringbuffer_set_size(struct ringbuffer *ringbuf, size_t size);
+int ringbuffer_populate(struct ringbuffer *ringbuf);
+int ringbuffer_depopulate(struct ringbuffer *ringbuf);
 int ringbuffer_reset(struct ringbuffer *ringbuf);
 int ringbuffer_start(struct ringbuffer *ringbuf);
 int ringbuffer_stop(struct ringbuffer *ringbuf);
 int ringbuffer_ready_read(struct ringbuffer *ringbuf);
-int ringbuffer_read_user(struct ringbuffer *ringbuf,
+int ringbuffer_attach(struct ringbuffer *ringbuf,
+		      struct ringbuffer_ctrl *ctrl, int *id);
+void ringbuffer_detach(struct ringbuffer *ringbuf, int id);
+void ringbuffer_set_reader_flags(struct ringbuffer *ringbuf, int id, u32 flags);
+int ringbuffer_set_overflow_policy(struct ringbuffer *ringbuf,
+				   enum ringbuffer_overflow_policy policy);
+int ringbuffer_set_unit_size(struct ringbuffer *ringbuf, u32 unit_size);
+u32 ringbuffer_get_overflows(struct ringbuffer *ringbuf, int id);
+bool ringbuffer_has_overflowed(struct ringbuffer *ringbuf, int id);
+void ringbuffer_report_loss(struct ringbuffer *ringbuf);
+int ringbuffer_read_user(struct ringbuffer *ringbuf, int id,
 			 void __user *buf, size_t *len);
+int ringbuffer_read(struct ringbuffer *ringbuf, int id, void *buf, size_t *len);
+int ringbuffer_advance(struct ringbuffer *ringbuf, int id, size_t *len);
+void ringbuffer_seek(struct ringbuffer *ringbuf, int id, u32 write_count);
+int ringbuffer_mmap(struct ringbuffer *ringbuf, struct vm_area_struct *vma,
+		    unsigned long addr, unsigned long size);
 int ringbuffer_write_atomic(struct ringbuffer *ringbuf,
 			    const void *buf, size_t *len);
-bool ringbuffer_is_readable(struct ringbuffer *ringbuf);
+int ringbuffer_writev_atomic(struct ringbuffer *ringbuf,
+			     const struct ringbuffer_vec *vec,
+			     unsigned int num, size_t *len);
+size_t ringbuffer_readable_size(struct ringbuffer *ringbuf, int id);
+bool ringbuffer_is_readable(struct ringbuffer *ringbuf, int id);
 bool ringbuffer_is_running(struct ringbuffer *ringbuf);
+void ringbuffer_pool_cleanup(void);
 
 #endif
@@ -17,11 +17,25 @@
 
 #define NUM_REGS	0x10
 
+/*
+ * Unchanged registers rewritten rather than splitting a write, each transfer
+ * costs a round trip to the bridge.
+ */
+#define RT710_WRITE_MAX_GAP	4
+
 struct rt710_bandwidth_param {
 	u8 coarse;
 	u8 fine;
 };
 
+struct rt710_pll_params {
+	u32 freq;
+	u8 div_num;
+	u8 ni_si;	// register 0x05
+	bool integer;	// no fractional part, sdm is 0
+	u16 sdm;
+};
+
 static const u8 rt710_init_regs[NUM_REGS] = {
 	0x40, 0x1d, 0x20, 0x10, 0x41, 0x50, 0xed, 0x25,
 	0x07, 0x58, 0x39, 0x64, 0x38, 0xe7, 0x90, 0x35
@@ -69,6 +83,40 @@ static const struct {
 	{ 379999, { 16, 1 } },
 };
 
+/*
+ * rt710_calc_pll() for the BS and CS110 (ND) channels, in the order of their
+ * channel numbers. Every device uses a 24MHz crystal, other crystals go
+ * through the calculation.
+ */
+#define RT710_PLL_TABLE_XTAL	24000
+
+static const struct rt710_pll_params rt710_isdb_s_pll_params[] = {
+	{ 1049480, 0, 0x92, false, 0x74ec },	/* BS-1 */
+	{ 1087840, 0, 0x53, false, 0xa742 },	/* BS-3 */
+	{ 1126200, 0, 0x14, false, 0xd99e },	/* BS-5 */
+	{ 1164560, 0, 0x15, false, 0x0bf6 },	/* BS-7 */
+	{ 1202920, 1, 0x49, false, 0x1f26 },	/* BS-9 */
+	{ 1241280, 1, 0x89, false, 0xb854 },	/* BS-11 */
+	{ 1279640, 1, 0x0a, false, 0x517e },	/* BS-13 */
+	{ 1318000, 1, 0x4a, false, 0xeaae },	/* BS-15 */
+	{ 1356360, 1, 0xca, false, 0x83dc },	/* BS-17 */
+	{ 1394720, 1, 0x4b, false, 0x1d04 },	/* BS-19 */
+	{ 1433080, 1, 0x8b, false, 0xb630 },	/* BS-21 */
+	{ 1471440, 1, 0x0c, false, 0x4f5e },	/* BS-23 */
+	{ 1613000, 1, 0x8d, false, 0x3558 },	/* ND-2 */
+	{ 1653000, 1, 0xcd, false, 0xdffe },	/* ND-4 */
+	{ 1693000, 1, 0x4e, false, 0x8aae },	/* ND-6 */
+	{ 1733000, 1, 0xce, false, 0x3558 },	/* ND-8 */
+	{ 1773000, 1, 0x0f, false, 0xdffe },	/* ND-10 */
+	{ 1813000, 1, 0x8f, false, 0x8aae },	/* ND-12 */
+	{ 1853000, 1, 0x10, false, 0x3558 },	/* ND-14 */
+	{ 1893000, 1, 0x50, false, 0xdffe },	/* ND-16 */
+	{ 1933000, 1, 0xd0, false, 0x8aae },	/* ND-18 */
+	{ 1973000, 1, 0x51, false, 0x3558 },	/* ND-20 */
+	{ 2013000, 1, 0x91, false, 0xdffe },	/* ND-22 */
+	{ 2053000, 1, 0x12, false, 0x8aae },	/* ND-24 */
+};
+
 static const u16 rt710_lna_acc_gain[] = {
 	0, 26, 42, 74, 103, 129, 158, 181,
 	188, 200, 220, 248, 280, 312, 341, 352,
@@ -117,7 +165,7 @@ static int rt710_read_regs(struct rt710_tuner *t, u8 reg, u8 *buf, int len)
 	req[1].data = b;
 	req[1].len = reg + len;
 
-	ret = i2c_comm_master_request(t->i2c, req, 2);
+	ret = i2c_comm_master_request_stats(t->i2c, &t->i2c_stats, req, 2);
 	if (ret) {
 		dev_err(t->dev,
 			"rt710_read_regs: i2c_comm_master_request() failed. (reg: 0x%02x, len: %d, ret: %d)\n",
@@ -130,20 +178,14 @@ static int rt710_read_regs(struct rt710_tuner *t, u8 reg, u8 *buf, int len)
 	return ret;
 }
 
-static int rt710_write_regs(struct rt710_tuner *t,
-			    u8 reg,
-			    const u8 *buf, int len)
+static int rt710_write_regs_raw(struct rt710_tuner *t,
+				u8 reg,
+				const u8 *buf, int len)
 {
 	int ret = 0;
 	u8 b[1 + NUM_REGS];
 	struct i2c_comm_request req[1];
 
-	if (!t || !buf || !len)
-		return -EINVAL;
-
-	if (len > (NUM_REGS - reg))
-		return -EINVAL;
-
 	b[0] = reg;
 	memcpy(&b[1], buf, len);
 
@@ -152,30 +194,59 @@ static int rt710_write_regs(struct rt710_tuner *t,
 	req[0].data = b;
 	req[0].len = 1 + len;
 
-	ret = i2c_comm_master_request(t->i2c, req, 1);
-	if (ret)
+	ret = i2c_comm_master_request_stats(t->i2c, &t->i2c_stats, req, 1);
+	if (ret) {
 		dev_err(t->dev,
 			"rt710_write_regs: i2c_comm_master_request() failed. (reg: 0x%02x, len: %d, ret: %d)\n",
 			reg, len, ret);
+		reg_cache_invalidate(&t->priv.hw_regs);
+	} else {
+		reg_cache_write(&t->priv.hw_regs, 0, reg, buf, len);
+	}
 
 	return ret;
 }
 
-static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
+static int rt710_write_regs(struct rt710_tuner *t,
+			    u8 reg,
+			    const u8 *buf, int len)
 {
-	int ret = 0;
-	u32 xtal, vco_min, vco_max, vco_freq;
+	int ret = 0, first = 0, last;
+
+	if (!t || !buf || !len)
+		return -EINVAL;
+
+	if (len > (NUM_REGS - reg))
+		return -EINVAL;
+
+	if (len == 1)
+		return rt710_write_regs_raw(t, reg, buf, len);
+
+	/* only the registers which differ from the last written image */
+	while (first < len &&
+	       reg_cache_get_dirty_run(&t->priv.hw_regs, 0, reg, buf, len,
+				       RT710_WRITE_MAX_GAP, &first, &last)) {
+		ret = rt710_write_regs_raw(t, reg + first,
+					   buf + first, last - first + 1);
+		if (ret)
+			break;
+
+		first = last + 1;
+	}
+
+	return ret;
+}
+
+static void rt710_calc_pll(u32 xtal, u32 freq, struct rt710_pll_params *pll)
+{
+	u32 vco_min, vco_max, vco_freq;
 	u16 vco_fra, nsdm = 2, sdm = 0;
 	u8 mix_div = 2, div_num, nint, ni, si;
 
-	xtal = t->config.xtal;
-
 	vco_min = 2350000;
 	vco_max = vco_min * 2;
 	vco_freq = freq * mix_div;
 
-	t->priv.freq = 0;
-
 	while (mix_div <= 16) {
 		if (vco_freq >= vco_min && vco_freq <= vco_max)
 			break;
@@ -202,8 +273,93 @@ static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
 		break;
 	}
 
+	nint = (vco_freq / 2) / xtal;
+	vco_fra = vco_freq - (xtal * 2 * nint);
+
+	if (vco_fra < (xtal / 64)) {
+		vco_fra = 0;
+	} else if (vco_fra > (xtal * 127 / 64)) {
+		vco_fra = 0;
+		nint++;
+	} else if ((vco_fra > (xtal * 127 / 128)) && (vco_fra < xtal)) {
+		vco_fra = xtal * 127 / 128;
+	} else if ((vco_fra > xtal) && vco_fra < (xtal * 129 / 128)) {
+		vco_fra = xtal * 129 / 128;
+	}
+
+	ni = (nint - 13) / 4;
+	si = nint - (ni * 4) - 13;
+
+	pll->freq = freq;
+	pll->div_num = div_num;
+	pll->ni_si = (ni & 0x3f) | ((si << 6) & 0xc0);
+	pll->integer = !vco_fra;
+
+	while (vco_fra > 1) {
+		u32 t;
+
+		t = (xtal * 2) / nsdm;
+		if (vco_fra > t) {
+			sdm += (0x8000 / (nsdm / 2));
+			vco_fra -= t;
+
+			if (nsdm >= 0x8000)
+				break;
+		}
+
+		nsdm *= 2;
+	}
+
+	pll->sdm = sdm;
+}
+
+static const struct rt710_pll_params *rt710_find_pll(u32 xtal, u32 freq)
+{
+	u32 i;
+
+	if (xtal != RT710_PLL_TABLE_XTAL)
+		return NULL;
+
+	if (freq >= 1613000) {
+		i = freq - 1613000;
+		if (i % 40000)
+			return NULL;
+
+		i = 12 + (i / 40000);
+	} else if (freq >= 1049480) {
+		i = freq - 1049480;
+		if (i % 38360)
+			return NULL;
+
+		i /= 38360;
+		if (i >= 12)
+			return NULL;
+	} else {
+		return NULL;
+	}
+
+	if (i >= ARRAY_SIZE(rt710_isdb_s_pll_params))
+		return NULL;
+
+	return &rt710_isdb_s_pll_params[i];
+}
+
+static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
+{
+	int ret = 0;
+	const struct rt710_pll_params *pll;
+	struct rt710_pll_params calc;
+
+	t->priv.freq = 0;
+
+	pll = rt710_find_pll(t->config.xtal, freq);
+	if (!pll) {
+		rt710_calc_pll(t->config.xtal, freq, &calc);
+		pll = &calc;
+	}
+
 	regs[0x04] &= 0xfe;
-	regs[0x04] |= (div_num & 0x01);
+	regs[0x04] |= (pll->div_num & 0x01);
 
 	ret = rt710_write_regs(t, 0x04, &regs[0x04], 1);
 	if (ret)
@@ -211,7 +367,7 @@ static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
 
 	if (t->priv.chip == RT710_CHIP_TYPE_RT720) {
 		regs[0x08] &= 0xef;
-		regs[0x08] |= ((div_num << 3) & 0x10);
+		regs[0x08] |= ((pll->div_num << 3) & 0x10);
 
 		ret = rt710_write_regs(t, 0x08, &regs[0x08], 1);
 		if (ret)
@@ -219,7 +375,7 @@ static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
 
 		regs[0x04] &= 0x3f;
 
-		if (div_num <= 1) {
+		if (pll->div_num <= 1) {
 			regs[0x04] |= 0x40;
 			regs[0x0c] |= 0x10;
 		} else {
@@ -236,53 +392,21 @@ static int rt710_set_pll(struct rt710_tuner *t, u8 *regs, u32 freq)
 			return ret;
 	}
 
-	nint = (vco_freq / 2) / xtal;
-	vco_fra = vco_freq - (xtal * 2 * nint);
-
-	if (vco_fra < (xtal / 64)) {
-		vco_fra = 0;
-	} else if (vco_fra > (xtal * 127 / 64)) {
-		vco_fra = 0;
-		nint++;
-	} else if ((vco_fra > (xtal * 127 / 128)) && (vco_fra < xtal)) {
-		vco_fra = xtal * 127 / 128;
-	} else if ((vco_fra > xtal) && vco_fra < (xtal * 129 / 128)) {
-		vco_fra = xtal * 129 / 128;
-	}
-
-	ni = (nint - 13) / 4;
-	si = nint - (ni * 4) - 13;
-
-	regs[0x05] = (ni & 0x3f) | ((si << 6) & 0xc0);
+	regs[0x05] = pll->ni_si;
 
 	ret = rt710_write_regs(t, 0x05, &regs[0x05], 1);
 	if (ret)
 		return ret;
 
-	if (!vco_fra)
+	if (pll->integer)
 		regs[0x04] |= 0x02;
 
 	ret = rt710_write_regs(t, 0x04, &regs[0x04], 1);
 	if (ret)
 		return ret;
 
-	while (vco_fra > 1) {
-		u32 t;
-
-		t = (xtal * 2) / nsdm;
-		if (vco_fra > t) {
-			sdm += (0x8000 / (nsdm / 2));
-			vco_fra -= t;
-
-			if (nsdm >= 0x8000)
-				break;
-		}
-
-		nsdm *= 2;
-	}
-
-	regs[0x07] = ((sdm >> 8) & 0xff);
-	regs[0x06] = (sdm & 0xff);
+	regs[0x07] = ((pll->sdm >> 8) & 0xff);
+	regs[0x06] = (pll->sdm & 0xff);
 
 	ret = rt710_write_regs(t, 0x07, &regs[0x07], 1);
 	if (ret)
@@ -307,6 +431,8 @@ int rt710_init(struct rt710_tuner *t)
 	t->priv.init = false;
 	t->priv.freq = 0;
 
+	reg_cache_init(&t->priv.hw_regs, &t->priv.hw_regs_bank, 1);
+
 	ret = rt710_read_regs(t, 0x03, &tmp, 1);
 	if (ret) {
 		dev_err(t->dev,
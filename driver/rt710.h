@@ -17,6 +17,7 @@
 #endif
 
 #include "i2c_comm.h"
+#include "reg_cache.h"
 
 enum rt710_chip_type {
 	RT710_CHIP_TYPE_UNKNOWN = 0,
@@ -67,12 +68,15 @@ struct rt710_priv {
 	bool init;
 	enum rt710_chip_type chip;
 	u32 freq;
+	struct reg_cache hw_regs;	// values in the tuner
+	struct reg_cache_bank hw_regs_bank;
 };
 
 struct rt710_tuner {
 	const struct device *dev;
 	const struct i2c_comm_master *i2c;
 	u8 i2c_addr;
+	struct i2c_comm_stats i2c_stats;
 	struct rt710_config config;
 	struct rt710_priv priv;
 };
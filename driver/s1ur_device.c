@@ -14,15 +14,10 @@
 
 #include "px4_device_params.h"
 #include "firmware.h"
+#include "ts_demux.h"
+#include "r850_cache.h"
 
-#define S1UR_DEVICE_TS_SYNC_COUNT	4
-#define S1UR_DEVICE_TS_SYNC_SIZE	(188 * S1UR_DEVICE_TS_SYNC_COUNT)
-
-struct s1ur_stream_context {
-	struct ptx_chrdev *chrdev;
-	u8 remain_buf[S1UR_DEVICE_TS_SYNC_SIZE];
-	size_t remain_len;
-};
+static const struct ts_demux_config s1ur_demux_config = TS_DEMUX_SINGLE_CONFIG;
 
 static void s1ur_device_release(struct kref *kref);
 
@@ -87,6 +82,8 @@ static int s1ur_backend_init(struct s1ur_device *s1ur)
 		return ret;
 	}
 
+	r850_cache_load(&s1ur->it930x, 0, &chrdevs1ur->r850);
+
 #if 0
 	ret = rt710_init(&chrdevs1ur->rt710);
 	if (ret) {
@@ -103,6 +100,7 @@ static int s1ur_backend_term(struct s1ur_device *s1ur)
 {
 	struct s1ur_chrdev *chrdevs1ur = &s1ur->chrdevs1ur;
 
+	r850_cache_store(&s1ur->it930x, 0, &chrdevs1ur->r850);
 	r850_term(&chrdevs1ur->r850);
 #if 0
 	rt710_term(&chrdevs1ur->rt710);
@@ -113,90 +111,6 @@ static int s1ur_backend_term(struct s1ur_device *s1ur)
 	return 0;
 }
 
-static void s1ur_device_stream_process(struct ptx_chrdev *chrdev,
-					   u8 **buf, u32 *len)
-{
-	u8 *p = *buf;
-	u32 remain = *len;
-
-	while (likely(remain)) {
-		u32 i = 0;
-		bool sync_remain = false;
-
-		while (true) {
-			if (likely(((i + 1) * 188) <= remain)) {
-				if (unlikely(p[i * 188] != 0x47))
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-			i++;
-		}
-
-		if (unlikely(i < S1UR_DEVICE_TS_SYNC_COUNT)) {
-			p++;
-			remain--;
-			continue;
-		}
-
-		ptx_chrdev_put_stream(chrdev, p, 188 * i);
-
-		p += 188 * i;
-		remain -= 188 * i;
-
-		if (unlikely(sync_remain))
-			break;
-	}
-
-	*buf = p;
-	*len = remain;
-
-	return;
-}
-
-static int s1ur_device_stream_handler(void *context, void *buf, u32 len)
-{
-	struct s1ur_stream_context *stream_ctx = context;
-	u8 *ctx_remain_buf = stream_ctx->remain_buf;
-	u32 ctx_remain_len = stream_ctx->remain_len;
-	u8 *p = buf;
-	u32 remain = len;
-
-	if (unlikely(ctx_remain_len)) {
-		if (likely((ctx_remain_len + len) >= S1UR_DEVICE_TS_SYNC_SIZE)) {
-			u32 t = S1UR_DEVICE_TS_SYNC_SIZE - ctx_remain_len;
-
-			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
-			ctx_remain_len = S1UR_DEVICE_TS_SYNC_SIZE;
-
-			s1ur_device_stream_process(stream_ctx->chrdev,
-						  &ctx_remain_buf,
-						  &ctx_remain_len);
-			if (likely(!ctx_remain_len)) {
-				p += t;
-				remain -= t;
-			}
-
-			stream_ctx->remain_len = 0;
-		} else {
-			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
-			stream_ctx->remain_len += len;
-
-			return 0;
-		}
-	}
-
-	s1ur_device_stream_process(stream_ctx->chrdev, &p, &remain);
-
-	if (unlikely(remain)) {
-		memcpy(stream_ctx->remain_buf, p, remain);
-		stream_ctx->remain_len = remain;
-	}
-
-	return 0;
-}
-
 static int s1ur_chrdev_init(struct ptx_chrdev *chrdev)
 {
 	dev_dbg(chrdev->parent->dev, "s1ur_chrdev_init\n");
@@ -470,6 +384,8 @@ static int s1ur_chrdev_tune(struct ptx_chrdev *chrdev,
 			"s1ur_chrdev_tune %u: PLL is locked. count: %d\n",
 			chrdev_group->id, i);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_t(&chrdevs1ur->tc90522_t, true);
 		if (ret) {
 			dev_err(s1ur->dev,
@@ -586,6 +502,8 @@ static int s1ur_chrdev_tune(struct ptx_chrdev *chrdev,
 			"s1ur_chrdev_tune %u: PLL is locked. count: %d, signal strength: %d.%03ddBm\n",
 			chrdev_group->id, i, ss / 1000, -ss % 1000);
 
+		ptx_chrdev_tune_phase(chrdev, PTX_CHRDEV_TUNE_PHASE_PLL);
+
 		ret = tc90522_set_agc_s(&chrdevs1ur->tc90522_s, true);
 		if (ret) {
 			dev_err(s1ur->dev,
@@ -628,6 +546,40 @@ static int s1ur_chrdev_check_lock(struct ptx_chrdev *chrdev, bool *locked)
 	return ret;
 }
 
+static int s1ur_chrdev_get_lock_state(struct ptx_chrdev *chrdev,
+				      enum ptx_chrdev_lock_state *state)
+{
+	int ret = 0;
+	struct s1ur_chrdev *chrdevs1ur = chrdev->priv;
+	bool locked = false;
+	u8 v;
+
+	if (chrdev->current_system != PTX_ISDB_T_SYSTEM)
+		return -EINVAL;
+
+	ret = tc90522_is_signal_locked_t(&chrdevs1ur->tc90522_t, &locked);
+	if (ret)
+		return ret;
+
+	if (locked) {
+		*state = PTX_CHRDEV_LOCK_LOCKED;
+		return 0;
+	}
+
+	ret = tc90522_get_sync_state_t(&chrdevs1ur->tc90522_t, &v);
+	if (ret)
+		return ret;
+
+	if (v >= 8)
+		*state = PTX_CHRDEV_LOCK_TMCC;
+	else if (v >= 2)
+		*state = PTX_CHRDEV_LOCK_CARRIER;
+	else
+		*state = PTX_CHRDEV_LOCK_AGC;
+
+	return 0;
+}
+
 static int s1ur_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 					 u16 stream_id)
 {
@@ -691,8 +643,11 @@ static int s1ur_chrdev_set_stream_id(struct ptx_chrdev *chrdev,
 		msleep(10);
 	}
 
-	if (tsid2 != tsid)
+	if (tsid2 != tsid) {
+		/* resolve the slot from the TMCC again next time */
+		tc90522_tmcc_invalidate_s(tc90522_s);
 		ret = -EAGAIN;
+	}
 
 	return ret;
 }
@@ -705,14 +660,14 @@ static int s1ur_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	struct s1ur_device *s1ur = container_of(chrdevs1ur,
 							struct s1ur_device,
 							chrdevs1ur);
-	struct s1ur_stream_context *stream_ctx = s1ur->stream_ctx;
+	struct ts_demux *stream_ctx = s1ur->stream_ctx;
 
 
 	dev_dbg(s1ur->dev,
 		"s1ur_chrdev_start_capture %u\n", chrdev_group->id);
 
 	ret = it930x_purge_psb(&s1ur->it930x,
-			       px4_device_params.psb_purge_timeout);
+			       px4_device_psb_purge_timeout(&s1ur->it930x));
 	if (ret) {
 		dev_err(s1ur->dev,
 			"s1ur_chrdev_start_capture %u: it930x_purge_psb() failed. (ret: %d)\n",
@@ -748,10 +703,14 @@ static int s1ur_chrdev_start_capture(struct ptx_chrdev *chrdev)
 	if (ret)
 		goto fail_tc;
 
-	stream_ctx->remain_len = 0;
+	ts_demux_reset(stream_ctx);
+
+	/* a single stream, its weight in the URB budget */
+	itedtv_bus_set_stream_weight(&s1ur->it930x.bus,
+				     ptx_system_bitrate(chrdev->params.system));
 
 	ret = itedtv_bus_start_streaming(&s1ur->it930x.bus,
-					 s1ur_device_stream_handler,
+					 ts_demux_stream_handler,
 					 stream_ctx);
 	if (ret) {
 		dev_err(s1ur->dev,
@@ -846,6 +805,21 @@ static int s1ur_chrdev_read_cnr_raw(struct ptx_chrdev *chrdev, u32 *value)
 	return ret;
 }
 
+/* C/N in 0.01 dB units */
+static int s1ur_chrdev_read_cnr(struct ptx_chrdev *chrdev, u32 *value)
+{
+	int ret = 0;
+	u32 raw = 0;
+
+	ret = s1ur_chrdev_read_cnr_raw(chrdev, &raw);
+	if (ret)
+		return ret;
+
+	*value = tc90522_cndat_to_cnr_t(raw);
+
+	return 0;
+}
+
 static struct ptx_chrdev_operations s1ur_chrdev_ops = {
 	.init = s1ur_chrdev_init,
 	.term = s1ur_chrdev_term,
@@ -853,12 +827,17 @@ static struct ptx_chrdev_operations s1ur_chrdev_ops = {
 	.release = s1ur_chrdev_release,
 	.tune = s1ur_chrdev_tune,
 	.check_lock = s1ur_chrdev_check_lock,
+	.get_lock_state = s1ur_chrdev_get_lock_state,
 	.set_stream_id = s1ur_chrdev_set_stream_id,
 	.set_lnb_voltage = NULL,
 	.set_capture = s1ur_chrdev_set_capture,
 	.read_signal_strength = NULL,
-	.read_cnr = NULL,
-	.read_cnr_raw = s1ur_chrdev_read_cnr_raw
+	.read_cnr = s1ur_chrdev_read_cnr,
+	.read_cnr_raw = s1ur_chrdev_read_cnr_raw,
+	.set_pid_filter = NULL,
+	.set_pid_filter_entry = NULL,
+	.read_tsid = NULL,
+	.read_stats = NULL
 };
 
 static int s1ur_device_load_config(struct s1ur_device *s1ur,
@@ -910,6 +889,7 @@ static int s1ur_device_load_config(struct s1ur_device *s1ur,
 	chrdevs1ur->r850.config.clock_out = false;
 	chrdevs1ur->r850.config.no_imr_calibration = true;
 	chrdevs1ur->r850.config.no_lpf_calibration = true;
+	chrdevs1ur->r850.config.light_standby = px4_device_params.t_tuner_light_standby;
 
 #if 0
 	chrdevs1ur->rt710.dev = dev;
@@ -943,7 +923,7 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 	struct ptx_chrdev_config chrdev_config;
 	struct ptx_chrdev_group_config chrdev_group_config;
 	struct ptx_chrdev_group *chrdev_group;
-	struct s1ur_stream_context *stream_ctx;
+	struct ts_demux *stream_ctx;
 
 	if (!s1ur || !dev || !chrdev_ctx || !quit_completion)
 		return -EINVAL;
@@ -955,6 +935,7 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 	kref_init(&s1ur->kref);
 	s1ur->dev = dev;
 	s1ur->quit_completion = quit_completion;
+	s1ur->debugfs = NULL;
 
 	stream_ctx = kzalloc(sizeof(*stream_ctx), GFP_KERNEL);
 	if (!stream_ctx) {
@@ -964,6 +945,8 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 		goto fail;
 	}
 	s1ur->stream_ctx = stream_ctx;
+	ts_demux_init(stream_ctx, &s1ur_demux_config);
+	ts_demux_set_clock(stream_ctx, &s1ur->it930x.bus.stream_time);
 
 	it930x = &s1ur->it930x;
 	bus = &it930x->bus;
@@ -984,10 +967,21 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 	if (ret)
 		goto fail_device;
 
+	s1ur->debugfs = px4_debugfs_create(dev, it930x);
+	px4_debugfs_add_chip(s1ur->debugfs, "tc90522_t", 0,
+			     &s1ur->chrdevs1ur.tc90522_t.i2c_stats);
+	px4_debugfs_add_chip(s1ur->debugfs, "tc90522_s", 0,
+			     &s1ur->chrdevs1ur.tc90522_s.i2c_stats);
+	px4_debugfs_add_chip(s1ur->debugfs, "r850", 0,
+			     &s1ur->chrdevs1ur.r850.i2c_stats);
+
 	chrdev_config.ops = &s1ur_chrdev_ops;
 	chrdev_config.options = PTX_CHRDEV_WAIT_AFTER_LOCK_TC_T;
 	chrdev_config.ringbuf_size = 188 * px4_device_params.tsdev_max_packets;
+	chrdev_config.ringbuf_time_t = px4_device_params.tsdev_buffer_time_t;
+	chrdev_config.ringbuf_time_s = px4_device_params.tsdev_buffer_time_s;
 	chrdev_config.ringbuf_threshold_size = chrdev_config.ringbuf_size / 10;
+	chrdev_config.max_readers = px4_device_params.tsdev_max_readers;
 	chrdev_config.priv = &s1ur->chrdevs1ur;
 
 	ret = it930x_load_firmware(it930x, IT930X_FIRMWARE_FILENAME);
@@ -1040,6 +1034,8 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 
 	chrdev_group_config.owner_kref = &s1ur->kref;
 	chrdev_group_config.owner_kref_release = s1ur_device_release;
+	chrdev_group_config.bus_stats = &it930x->bus.stats;
+	chrdev_group_config.bus = &it930x->bus;
 	chrdev_group_config.reserved = false;
 	chrdev_group_config.minor_base = 0;	/* unused */
 	chrdev_group_config.chrdev_num = 1;
@@ -1052,7 +1048,7 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 
 	s1ur->chrdev_group = chrdev_group;
 	s1ur->chrdevs1ur.chrdev = &chrdev_group->chrdev[0];
-	stream_ctx->chrdev = &chrdev_group->chrdev[0];
+	stream_ctx->chrdev[0] = &chrdev_group->chrdev[0];
 
 	atomic_set(&s1ur->available, 1);
 	return 0;
@@ -1060,6 +1056,7 @@ int s1ur_device_init(struct s1ur_device *s1ur, struct device *dev,
 fail_chrdev:
 
 fail_device:
+	px4_debugfs_remove(s1ur->debugfs);
 	it930x_term(it930x);
 
 fail_bridge:
@@ -1081,6 +1078,7 @@ static void s1ur_device_release(struct kref *kref)
 
 	dev_dbg(s1ur->dev, "s1ur_device_release\n");
 
+	px4_debugfs_remove(s1ur->debugfs);
 	it930x_term(&s1ur->it930x);
 	itedtv_bus_term(&s1ur->it930x.bus);
 
@@ -18,6 +18,7 @@
 #include "it930x.h"
 #include "tc90522.h"
 #include "r850.h"
+#include "px4_debugfs.h"
 
 #define S1UR_CHRDEV_NUM	1
 
@@ -37,6 +38,7 @@ struct s1ur_device {
 	struct ptx_chrdev_group *chrdev_group;
 	struct s1ur_chrdev chrdevs1ur;
 	struct it930x_bridge it930x;
+	struct px4_debugfs *debugfs;
 	void *stream_ctx;
 };
 
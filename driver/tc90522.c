@@ -15,6 +15,67 @@
 #include <linux/slab.h>
 #endif
 
+struct tc90522_cnr_point {
+	u32 val;
+	u32 cnr;	// 0.01 dB
+};
+
+/*
+ * CNR = 0.000024P^4 - 0.0016P^3 + 0.0398P^2 + 0.5491P + 3.0965 [dB],
+ * P = 10log10(5505024 / CNDAT), from 0 to 40 in steps of 1
+ */
+static const struct tc90522_cnr_point tc90522_cnr_table_t[] = {
+	{ 5505024, 310 }, { 4372796, 368 }, { 3473435, 434 }, { 2759048, 506 },
+	{ 2191590, 583 }, { 1740841, 665 }, { 1382800, 751 }, { 1098397, 840 },
+	{ 872488, 932 }, { 693041, 1025 }, { 550502, 1121 }, { 437280, 1217 },
+	{ 347344, 1315 }, { 275905, 1413 }, { 219159, 1512 }, { 174084, 1610 },
+	{ 138280, 1709 }, { 109840, 1808 }, { 87249, 1906 }, { 69304, 2005 },
+	{ 55050, 2104 }, { 43728, 2203 }, { 34734, 2303 }, { 27590, 2403 },
+	{ 21916, 2504 }, { 17408, 2607 }, { 13828, 2712 }, { 10984, 2820 },
+	{ 8725, 2930 }, { 6930, 3044 }, { 5505, 3163 }, { 4373, 3287 },
+	{ 3473, 3416 }, { 2759, 3552 }, { 2192, 3696 }, { 1741, 3848 },
+	{ 1383, 4011 }, { 1098, 4183 }, { 872, 4368 }, { 693, 4566 },
+	{ 551, 4778 }
+};
+
+/*
+ * CNR = -1.6346P^5 + 14.341P^4 - 50.259P^3 + 88.977P^2 - 89.565P + 58.857 [dB],
+ * P = sqrt(CN - 3000) / 64, up to 0 dB, denser where it changes fast
+ */
+static const struct tc90522_cnr_point tc90522_cnr_table_s[] = {
+	{ 38215, 0 }, { 37447, 68 }, { 35113, 253 }, { 32860, 402 },
+	{ 30689, 526 }, { 28600, 632 }, { 26593, 727 }, { 24668, 816 },
+	{ 22825, 901 }, { 21063, 986 }, { 19384, 1071 }, { 17787, 1158 },
+	{ 16271, 1247 }, { 14837, 1339 }, { 13486, 1432 }, { 12216, 1527 },
+	{ 11028, 1625 }, { 9922, 1726 }, { 8898, 1833 }, { 7956, 1947 },
+	{ 7096, 2072 }, { 6318, 2212 }, { 5621, 2376 }, { 5007, 2569 },
+	{ 4475, 2803 }, { 4024, 3088 }, { 3924, 3169 }, { 3829, 3255 },
+	{ 3740, 3345 }, { 3655, 3440 }, { 3576, 3540 }, { 3502, 3646 },
+	{ 3433, 3758 }, { 3369, 3875 }, { 3310, 3999 }, { 3256, 4130 },
+	{ 3207, 4267 }, { 3164, 4412 }, { 3125, 4565 }, { 3092, 4726 },
+	{ 3064, 4896 }, { 3041, 5074 }, { 3026, 5224 }, { 3015, 5379 },
+	{ 3007, 5541 }, { 3002, 5710 }, { 3000, 5886 }
+};
+
+/* linear interpolation, the table is in descending order of val */
+static u32 tc90522_interpolate_cnr(const struct tc90522_cnr_point *table,
+				   int num, u32 val)
+{
+	int i;
+
+	if (val >= table[0].val)
+		return table[0].cnr;
+
+	for (i = 1; i < num; i++) {
+		const struct tc90522_cnr_point *h = &table[i - 1], *l = &table[i];
+
+		if (val >= l->val)
+			return l->cnr - ((l->cnr - h->cnr) * (val - l->val)) / (h->val - l->val);
+	}
+
+	return table[num - 1].cnr;
+}
+
 static int tc90522_read_regs_nolock(struct tc90522_demod *demod,
 				    u8 reg,
 				    u8 *buf, u8 len)
@@ -38,7 +99,7 @@ static int tc90522_read_regs_nolock(struct tc90522_demod *demod,
 	req[1].data = buf;
 	req[1].len = len;
 
-	ret = i2c_comm_master_request(demod->i2c, req, 2);
+	ret = i2c_comm_master_request_stats(demod->i2c, &demod->i2c_stats, req, 2);
 	if (ret)
 		dev_err(demod->dev,
 			"tc90522_read_regs_nolock: i2c_comm_master_request() failed. (addr: 0x%x, reg: 0x%x, len: %u)\n",
@@ -126,7 +187,7 @@ static int tc90522_write_regs_nolock(struct tc90522_demod *demod,
 	req[0].data = b;
 	req[0].len = 1 + len;
 
-	ret = i2c_comm_master_request(demod->i2c, req, 1);
+	ret = i2c_comm_master_request_stats(demod->i2c, &demod->i2c_stats, req, 1);
 	if (ret)
 		dev_err(demod->dev,
 			"tc90522_write_regs_nolock: i2c_comm_master_request() failed. (addr: 0x%x, reg: 0x%x, len: %u, ret: %d)\n",
@@ -172,28 +233,40 @@ int tc90522_write_multiple_regs(struct tc90522_demod *demod,
 				struct tc90522_regbuf *regbuf, int num)
 {
 	int ret = 0, i;
+	struct i2c_comm_write_batch batch;
 
 	if (!regbuf || !num)
 		return -EINVAL;
 
+	i2c_comm_write_batch_init(&batch, demod->i2c, &demod->i2c_stats, demod->i2c_addr);
+
 	mutex_lock(&demod->priv.lock);
 
+	/* writes to adjacent registers are sent as one i2c transaction */
 	for (i = 0; i < num; i++) {
 		if (regbuf[i].buf)
-			ret = tc90522_write_regs_nolock(demod,
-							regbuf[i].reg,
-							regbuf[i].buf,
-							regbuf[i].u.len);
+			ret = i2c_comm_write_batch_add(&batch,
+						       regbuf[i].reg,
+						       regbuf[i].buf,
+						       regbuf[i].u.len);
 		else
-			ret = tc90522_write_regs_nolock(demod,
-							regbuf[i].reg,
-							&regbuf[i].u.val,
-							1);
+			ret = i2c_comm_write_batch_add(&batch,
+						       regbuf[i].reg,
+						       &regbuf[i].u.val,
+						       1);
 
 		if (ret)
 			break;
 	}
 
+	if (!ret)
+		ret = i2c_comm_write_batch_flush(&batch);
+
+	if (ret)
+		dev_err(demod->dev,
+			"tc90522_write_multiple_regs: write failed. (addr: 0x%x, i: %d, ret: %d)\n",
+			demod->i2c_addr, i, ret);
+
 	mutex_unlock(&demod->priv.lock);
 
 	return ret;
@@ -367,6 +440,8 @@ int tc90522_init(struct tc90522_demod *demod)
 {
 	mutex_init(&demod->priv.lock);
 
+	demod->tmcc.valid = false;
+
 	demod->i2c_master.gate_ctrl = NULL;
 	demod->i2c_master.request = tc90522_i2c_master_request;
 	demod->i2c_master.priv = demod;
@@ -422,24 +497,68 @@ int tc90522_set_agc_s(struct tc90522_demod *demod, bool on)
 		regbuf[0].u.val = 0xff;
 		regbuf[1].u.val |= 0x02;
 		regbuf[2].u.val = 0x00;
+	} else {
+		/* retuning, the TMCC of the next transponder is not known */
+		tc90522_tmcc_invalidate_s(demod);
 	}
 
 	return tc90522_write_multiple_regs(demod, regbuf, 4);
 }
 
+/*
+ * The TMCC of a transponder seldom changes, so the slot table is kept until
+ * the next retune once the requested slot has been decoded. Slot switches
+ * on the same transponder are then resolved without polling the TMCC.
+ */
 int tc90522_tmcc_get_tsid_s(struct tc90522_demod *demod, u8 idx, u16 *tsid)
 {
 	int ret = 0;
-	u8 b[2];
+	struct tc90522_tmcc_cache *tmcc = &demod->tmcc;
 
 	if (idx >= 12)
 		return -EINVAL;
 
-	ret = tc90522_read_regs(demod, 0xce + (idx * 2), &b[0], 2);
-	if (!ret)
-		*tsid = (b[0] << 8 | b[1]);
+	if (tmcc->valid && tmcc->tsid[idx]) {
+		*tsid = tmcc->tsid[idx];
+		return 0;
+	}
 
-	return ret;
+	ret = tc90522_tmcc_get_tsid_list_s(demod, tmcc->tsid, 12);
+	if (ret) {
+		tmcc->valid = false;
+		return ret;
+	}
+
+	tmcc->valid = !!tmcc->tsid[idx];
+	*tsid = tmcc->tsid[idx];
+
+	return 0;
+}
+
+/* the TMCC may have changed, e.g. the confirmed TSID differs */
+void tc90522_tmcc_invalidate_s(struct tc90522_demod *demod)
+{
+	demod->tmcc.valid = false;
+}
+
+int tc90522_tmcc_get_tsid_list_s(struct tc90522_demod *demod,
+				 u16 *tsid, int num)
+{
+	int ret = 0, i;
+	u8 b[24];
+
+	if (num <= 0 || num > 12)
+		return -EINVAL;
+
+	/* all slots in one transfer */
+	ret = tc90522_read_regs(demod, 0xce, &b[0], num * 2);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num; i++)
+		tsid[i] = (b[i * 2] << 8 | b[(i * 2) + 1]);
+
+	return 0;
 }
 
 int tc90522_get_tsid_s(struct tc90522_demod *demod, u16 *tsid)
@@ -476,6 +595,16 @@ int tc90522_get_cn_s(struct tc90522_demod *demod, u16 *cn)
 	return ret;
 }
 
+/* C/N in 0.01 dB units from the value of tc90522_get_cn_s() */
+u32 tc90522_cn_to_cnr_s(u16 cn)
+{
+	if (cn < 3000)
+		return 0;
+
+	return tc90522_interpolate_cnr(tc90522_cnr_table_s,
+				       ARRAY_SIZE(tc90522_cnr_table_s), cn);
+}
+
 int tc90522_enable_ts_pins_s(struct tc90522_demod *demod, bool e)
 {
 	struct tc90522_regbuf regbuf[] = {
@@ -505,6 +634,37 @@ int tc90522_is_signal_locked_s(struct tc90522_demod *demod, bool *lock)
 	return ret;
 }
 
+/*
+ * bit 7: no input signal, bit 6-5: not synchronized, bit 4: not locked
+ */
+int tc90522_get_status_s(struct tc90522_demod *demod, u8 *status)
+{
+	return tc90522_read_reg(demod, 0xc3, status);
+}
+
+/* C/N, lock state and the current TSID in one go, for monitoring */
+int tc90522_get_stats_s(struct tc90522_demod *demod,
+			u16 *cn, bool *lock, u16 *tsid)
+{
+	int ret = 0;
+	u8 b[5];
+	struct tc90522_regbuf regbuf[3];
+
+	tc90522_regbuf_set_buf(&regbuf[0], 0xbc, &b[0], 2);
+	tc90522_regbuf_set_buf(&regbuf[1], 0xc3, &b[2], 1);
+	tc90522_regbuf_set_buf(&regbuf[2], 0xe6, &b[3], 2);
+
+	ret = tc90522_read_multiple_regs(demod, regbuf, 3);
+	if (ret)
+		return ret;
+
+	*cn = (b[0] << 8) | b[1];
+	*lock = !(b[2] & 0x10);
+	*tsid = (b[3] << 8) | b[4];
+
+	return 0;
+}
+
 int tc90522_sleep_t(struct tc90522_demod *demod, bool sleep)
 {
 #if 1
@@ -542,6 +702,16 @@ int tc90522_get_cndat_t(struct tc90522_demod *demod, u32 *cndat)
 	return ret;
 }
 
+/* C/N in 0.01 dB units from the value of tc90522_get_cndat_t() */
+u32 tc90522_cndat_to_cnr_t(u32 cndat)
+{
+	if (!cndat)
+		return 0;
+
+	return tc90522_interpolate_cnr(tc90522_cnr_table_t,
+				       ARRAY_SIZE(tc90522_cnr_table_t), cndat);
+}
+
 int tc90522_enable_ts_pins_t(struct tc90522_demod *demod, bool e)
 {
 	return tc90522_write_reg(demod, 0x1d, (e) ? 0x00 : 0xa8);
@@ -571,3 +741,38 @@ exit:
 
 	return 0;
 }
+
+/* CNDAT and lock state in one go, for monitoring */
+int tc90522_get_stats_t(struct tc90522_demod *demod, u32 *cndat, bool *lock)
+{
+	int ret = 0;
+	u8 b[5];
+	struct tc90522_regbuf regbuf[3];
+
+	tc90522_regbuf_set_buf(&regbuf[0], 0x80, &b[0], 1);
+	tc90522_regbuf_set_buf(&regbuf[1], 0x8b, &b[1], 3);
+	tc90522_regbuf_set_buf(&regbuf[2], 0xb0, &b[4], 1);
+
+	ret = tc90522_read_multiple_regs(demod, regbuf, 3);
+	if (ret)
+		return ret;
+
+	*cndat = (b[1] << 16) | (b[2] << 8) | b[3];
+	/* same conditions as tc90522_is_signal_locked_t() */
+	*lock = !(b[0] & 0x28) && (b[4] & 0x0f) >= 8;
+
+	return 0;
+}
+
+/* demodulator sequence state, 8 or later once TMCC has been decoded */
+int tc90522_get_sync_state_t(struct tc90522_demod *demod, u8 *state)
+{
+	int ret = 0;
+	u8 b;
+
+	ret = tc90522_read_reg(demod, 0xb0, &b);
+	if (!ret)
+		*state = b & 0x0f;
+
+	return ret;
+}
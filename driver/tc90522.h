@@ -22,13 +22,21 @@ struct tc90522_priv {
 	struct mutex lock;
 };
 
+/* slot -> TSID table of the TMCC of the received transponder (ISDB-S) */
+struct tc90522_tmcc_cache {
+	bool valid;
+	u16 tsid[12];
+};
+
 struct tc90522_demod {
 	const struct device *dev;
 	const struct i2c_comm_master *i2c;
 	u8 i2c_addr;
+	struct i2c_comm_stats i2c_stats;	// the demodulator itself, without the tuner
 	struct i2c_comm_master i2c_master;
 	bool is_secondary;
 	struct tc90522_priv priv;
+	struct tc90522_tmcc_cache tmcc;
 };
 
 struct tc90522_regbuf {
@@ -74,17 +82,27 @@ int tc90522_term(struct tc90522_demod *demod);
 int tc90522_sleep_s(struct tc90522_demod *demod, bool sleep);
 int tc90522_set_agc_s(struct tc90522_demod *demod, bool on);
 int tc90522_tmcc_get_tsid_s(struct tc90522_demod *demod, u8 idx, u16 *tsid);
+void tc90522_tmcc_invalidate_s(struct tc90522_demod *demod);
+int tc90522_tmcc_get_tsid_list_s(struct tc90522_demod *demod,
+				 u16 *tsid, int num);
 int tc90522_get_tsid_s(struct tc90522_demod *demod, u16 *tsid);
 int tc90522_set_tsid_s(struct tc90522_demod *demod, u16 tsid);
 int tc90522_get_cn_s(struct tc90522_demod *demod, u16 *cn);
+u32 tc90522_cn_to_cnr_s(u16 cn);
 int tc90522_enable_ts_pins_s(struct tc90522_demod *demod, bool e);
 int tc90522_is_signal_locked_s(struct tc90522_demod *demod, bool *lock);
+int tc90522_get_status_s(struct tc90522_demod *demod, u8 *status);
+int tc90522_get_stats_s(struct tc90522_demod *demod,
+			u16 *cn, bool *lock, u16 *tsid);
 
 int tc90522_sleep_t(struct tc90522_demod *demod, bool sleep);
 int tc90522_set_agc_t(struct tc90522_demod *demod, bool on);
 int tc90522_get_cndat_t(struct tc90522_demod *demod, u32 *cndat);
+u32 tc90522_cndat_to_cnr_t(u32 cndat);
 int tc90522_enable_ts_pins_t(struct tc90522_demod *demod, bool e);
 int tc90522_is_signal_locked_t(struct tc90522_demod *demod, bool *lock);
+int tc90522_get_sync_state_t(struct tc90522_demod *demod, u8 *state);
+int tc90522_get_stats_t(struct tc90522_demod *demod, u32 *cndat, bool *lock);
 #ifdef __cplusplus
 }
 #endif
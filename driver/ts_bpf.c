@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS packet filter program (ts_bpf.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "ts_bpf.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/math64.h>
+
+#define TS_BPF_PACKET_SIZE	188
+
+/* forward jumps within the program only, so that every program ends */
+static int ts_bpf_check(const struct sock_filter *insns, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		const struct sock_filter *f = &insns[i];
+		unsigned int left = len - i - 1;
+
+		switch (f->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+		case BPF_LD | BPF_W | BPF_LEN:
+		case BPF_LDX | BPF_W | BPF_LEN:
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_IMM:
+		case BPF_LDX | BPF_B | BPF_MSH:
+		case BPF_ALU | BPF_ADD | BPF_K:
+		case BPF_ALU | BPF_ADD | BPF_X:
+		case BPF_ALU | BPF_SUB | BPF_K:
+		case BPF_ALU | BPF_SUB | BPF_X:
+		case BPF_ALU | BPF_MUL | BPF_K:
+		case BPF_ALU | BPF_MUL | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU | BPF_MOD | BPF_X:
+		case BPF_ALU | BPF_OR | BPF_K:
+		case BPF_ALU | BPF_OR | BPF_X:
+		case BPF_ALU | BPF_AND | BPF_K:
+		case BPF_ALU | BPF_AND | BPF_X:
+		case BPF_ALU | BPF_XOR | BPF_K:
+		case BPF_ALU | BPF_XOR | BPF_X:
+		case BPF_ALU | BPF_LSH | BPF_X:
+		case BPF_ALU | BPF_RSH | BPF_X:
+		case BPF_ALU | BPF_NEG:
+		case BPF_RET | BPF_K:
+		case BPF_RET | BPF_A:
+		case BPF_MISC | BPF_TAX:
+		case BPF_MISC | BPF_TXA:
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_K:
+		case BPF_ALU | BPF_MOD | BPF_K:
+			if (!f->k)
+				return -EINVAL;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_K:
+		case BPF_ALU | BPF_RSH | BPF_K:
+			if (f->k >= 32)
+				return -EINVAL;
+			break;
+
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			if (f->k >= BPF_MEMWORDS)
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			if (f->k >= left)
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			if (f->jt >= left || f->jf >= left)
+				return -EINVAL;
+			break;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (BPF_CLASS(insns[len - 1].code) != BPF_RET)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * As check_load_and_stores() of the kernel, a scratch word is loaded only
+ * after it is stored on every path to the load. The jumps are checked.
+ */
+static int ts_bpf_check_mem(const struct sock_filter *insns, unsigned int len)
+{
+	int ret = 0;
+	u16 *masks, memvalid = 0;	// one bit per word of BPF_MEMWORDS
+	unsigned int i;
+
+	masks = kmalloc_array(len, sizeof(*masks), GFP_KERNEL);
+	if (!masks)
+		return -ENOMEM;
+
+	memset(masks, 0xff, len * sizeof(*masks));
+
+	for (i = 0; i < len; i++) {
+		const struct sock_filter *f = &insns[i];
+
+		memvalid &= masks[i];
+
+		switch (f->code) {
+		case BPF_ST:
+		case BPF_STX:
+			memvalid |= (1 << f->k);
+			break;
+
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+			if (!(memvalid & (1 << f->k))) {
+				ret = -EINVAL;
+				goto exit;
+			}
+			break;
+
+		case BPF_JMP | BPF_JA:
+			masks[i + 1 + f->k] &= memvalid;
+			memvalid = ~0;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			masks[i + 1 + f->jt] &= memvalid;
+			masks[i + 1 + f->jf] &= memvalid;
+			memvalid = ~0;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+exit:
+	kfree(masks);
+	return ret;
+}
+
+int ts_bpf_create(struct ts_bpf **prog, const struct sock_filter __user *insns,
+		  unsigned int len)
+{
+	int ret = 0;
+	struct ts_bpf *p;
+
+	if (!len || len > PTX_PACKET_FILTER_MAX_INSNS)
+		return -EINVAL;
+
+	p = kzalloc(sizeof(*p) + sizeof(*p->insns) * len, GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	if (copy_from_user(p->insns, insns, sizeof(*insns) * len)) {
+		ret = -EFAULT;
+		goto fail;
+	}
+
+	ret = ts_bpf_check(p->insns, len);
+	if (ret)
+		goto fail;
+
+	ret = ts_bpf_check_mem(p->insns, len);
+	if (ret)
+		goto fail;
+
+	p->len = len;
+	*prog = p;
+
+	return 0;
+
+fail:
+	kfree(p);
+	return ret;
+}
+
+void ts_bpf_destroy(struct ts_bpf *prog)
+{
+	kfree(prog);
+}
+
+static u32 ts_bpf_size(u16 code)
+{
+	switch (BPF_SIZE(code)) {
+	case BPF_W:
+		return 4;
+
+	case BPF_H:
+		return 2;
+
+	default:
+		return 1;
+	}
+}
+
+static bool ts_bpf_load(const u8 *packet, u64 time, u32 size, u32 off,
+			u32 *val)
+{
+	if (size == 4 && off == PTX_PACKET_FILTER_LD_TIME) {
+		*val = (u32)div_u64(time, NSEC_PER_MSEC);
+		return true;
+	}
+
+	if (off >= TS_BPF_PACKET_SIZE || TS_BPF_PACKET_SIZE - off < size)
+		return false;
+
+	packet += off;
+
+	switch (size) {
+	case 4:
+		*val = (packet[0] << 24) | (packet[1] << 16) |
+		       (packet[2] << 8) | packet[3];
+		break;
+
+	case 2:
+		*val = (packet[0] << 8) | packet[1];
+		break;
+
+	default:
+		*val = packet[0];
+		break;
+	}
+
+	return true;
+}
+
+/* returns 0 to drop the packet, a load out of the packet drops it too */
+u32 ts_bpf_run(struct ts_bpf *prog, const u8 *packet, u64 time)
+{
+	const struct sock_filter *f = prog->insns;
+	u32 mem[BPF_MEMWORDS];	// never loaded before stored, see ts_bpf_check_mem()
+	u32 a = 0, x = 0, val;
+
+	for (;; f++) {
+		u32 k = f->k;
+
+		switch (f->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!ts_bpf_load(packet, time, ts_bpf_size(f->code), k, &val))
+				return 0;
+			a = val;
+			break;
+
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!ts_bpf_load(packet, time, ts_bpf_size(f->code), x + k, &val))
+				return 0;
+			a = val;
+			break;
+
+		case BPF_LD | BPF_W | BPF_LEN:
+			a = TS_BPF_PACKET_SIZE;
+			break;
+
+		case BPF_LDX | BPF_W | BPF_LEN:
+			x = TS_BPF_PACKET_SIZE;
+			break;
+
+		case BPF_LD | BPF_IMM:
+			a = k;
+			break;
+
+		case BPF_LDX | BPF_IMM:
+			x = k;
+			break;
+
+		case BPF_LD | BPF_MEM:
+			a = mem[k];
+			break;
+
+		case BPF_LDX | BPF_MEM:
+			x = mem[k];
+			break;
+
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (k >= TS_BPF_PACKET_SIZE)
+				return 0;
+			x = (packet[k] & 0x0f) << 2;
+			break;
+
+		case BPF_ST:
+			mem[k] = a;
+			break;
+
+		case BPF_STX:
+			mem[k] = x;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K:
+			a += k;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_X:
+			a += x;
+			break;
+
+		case BPF_ALU | BPF_SUB | BPF_K:
+			a -= k;
+			break;
+
+		case BPF_ALU | BPF_SUB | BPF_X:
+			a -= x;
+			break;
+
+		case BPF_ALU | BPF_MUL | BPF_K:
+			a *= k;
+			break;
+
+		case BPF_ALU | BPF_MUL | BPF_X:
+			a *= x;
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_K:
+			a /= k;
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!x)
+				return 0;
+			a /= x;
+			break;
+
+		case BPF_ALU | BPF_MOD | BPF_K:
+			a %= k;
+			break;
+
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!x)
+				return 0;
+			a %= x;
+			break;
+
+		case BPF_ALU | BPF_OR | BPF_K:
+			a |= k;
+			break;
+
+		case BPF_ALU | BPF_OR | BPF_X:
+			a |= x;
+			break;
+
+		case BPF_ALU | BPF_AND | BPF_K:
+			a &= k;
+			break;
+
+		case BPF_ALU | BPF_AND | BPF_X:
+			a &= x;
+			break;
+
+		case BPF_ALU | BPF_XOR | BPF_K:
+			a ^= k;
+			break;
+
+		case BPF_ALU | BPF_XOR | BPF_X:
+			a ^= x;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_K:
+			a <<= k;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_X:
+			a = (x < 32) ? a << x : 0;
+			break;
+
+		case BPF_ALU | BPF_RSH | BPF_K:
+			a >>= k;
+			break;
+
+		case BPF_ALU | BPF_RSH | BPF_X:
+			a = (x < 32) ? a >> x : 0;
+			break;
+
+		case BPF_ALU | BPF_NEG:
+			a = -a;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			f += k;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			f += (a == k) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			f += (a == x) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JGT | BPF_K:
+			f += (a > k) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JGT | BPF_X:
+			f += (a > x) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JGE | BPF_K:
+			f += (a >= k) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JGE | BPF_X:
+			f += (a >= x) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JSET | BPF_K:
+			f += (a & k) ? f->jt : f->jf;
+			break;
+
+		case BPF_JMP | BPF_JSET | BPF_X:
+			f += (a & x) ? f->jt : f->jf;
+			break;
+
+		case BPF_RET | BPF_K:
+			return k;
+
+		case BPF_RET | BPF_A:
+			return a;
+
+		case BPF_MISC | BPF_TAX:
+			x = a;
+			break;
+
+		case BPF_MISC | BPF_TXA:
+			a = x;
+			break;
+
+		default:
+			/* rejected by ts_bpf_check() */
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS packet filter program definitions (ts_bpf.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __TS_BPF_H__
+#define __TS_BPF_H__
+
+#include <linux/types.h>
+#include <linux/filter.h>
+
+#include "ptx_ioctl.h"
+
+/*
+ * A classic BPF program run on each 188-byte packet, see
+ * PTX_SET_PACKET_FILTER. It is shared by the readers, the scratch memory
+ * is on the stack of each run.
+ */
+struct ts_bpf {
+	unsigned int len;
+	struct sock_filter insns[];
+};
+
+int ts_bpf_create(struct ts_bpf **prog, const struct sock_filter __user *insns,
+		  unsigned int len);
+void ts_bpf_destroy(struct ts_bpf *prog);
+u32 ts_bpf_run(struct ts_bpf *prog, const u8 *packet, u64 time);
+
+#endif
@@ -0,0 +1,399 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS stream demultiplexer (ts_demux.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "print_format.h"
+#include "ts_demux.h"
+#include "hotpath_prof.h"
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/time.h>
+#else
+#include <string.h>
+#endif
+
+static ts_demux_process_t ts_demux_select_process(const struct ts_demux_config *config);
+
+void ts_demux_init(struct ts_demux *demux,
+		   const struct ts_demux_config *config)
+{
+	memcpy(&demux->config, config, sizeof(demux->config));
+	if (demux->config.chrdev_num > TS_DEMUX_MAX_CHRDEV)
+		demux->config.chrdev_num = TS_DEMUX_MAX_CHRDEV;
+
+	demux->process = ts_demux_select_process(&demux->config);
+	memset(demux->chrdev, 0, sizeof(demux->chrdev));
+	demux->synced = false;
+	demux->skipped = 0;
+	demux->remain_len = 0;
+	demux->stream_time = NULL;
+	demux->last_time = 0;
+	demux->time = 0;
+	demux->time_step = 0;
+
+	return;
+}
+
+void ts_demux_reset(struct ts_demux *demux)
+{
+	demux->synced = false;
+	demux->skipped = 0;
+	demux->remain_len = 0;
+	demux->last_time = 0;
+}
+
+void ts_demux_set_clock(struct ts_demux *demux, const u64 *stream_time)
+{
+	demux->stream_time = stream_time;
+}
+
+/*
+ * The packets of a buffer arrived between the completion of the previous
+ * buffer and that of this one, spread them evenly over the interval.
+ */
+static void ts_demux_update_time(struct ts_demux *demux, u32 len)
+{
+	u64 now = *demux->stream_time;
+	u64 prev = demux->last_time;
+	u32 num = len / 188;
+
+	/* the first buffer, or after a gap in the stream */
+	if (!prev || now < prev || (now - prev) > NSEC_PER_SEC)
+		prev = now;
+
+	demux->last_time = now;
+	demux->time_step = (num) ? (u32)div_u64(now - prev, num) : 0;
+	demux->time = prev + demux->time_step;
+
+	return;
+}
+
+static void ts_demux_lost_sync(struct ts_demux *demux)
+{
+	unsigned int i;
+
+	demux->synced = false;
+
+	/* the stream is shared, so every tuner on it is affected */
+	for (i = 0; i < demux->config.chrdev_num; i++) {
+		if (demux->chrdev[i])
+			demux->chrdev[i]->stats.resyncs++;
+	}
+
+	return;
+}
+
+#ifdef __KERNEL__
+/*
+ * Checks the continuity counters of a run of packets. A packet repeated once
+ * with the same counter is allowed, and the counter of a pid is forgotten at
+ * a discontinuity_indicator. Packets with transport errors are not trusted.
+ */
+static void ts_demux_count_pids(struct ptx_chrdev *chrdev,
+				const u8 *p, const u8 *end)
+{
+	/* pairs with the smp_store_release() of pid_stats_store() */
+	u64 *table = smp_load_acquire(&chrdev->pid_packets);
+
+	if (unlikely(!table))
+		return;
+
+	for (; p < end; p += 188)
+		table[((p[1] & 0x1f) << 8) | p[2]]++;
+
+	return;
+}
+
+static void ts_demux_check_cc(struct ptx_chrdev *chrdev,
+			      const u8 *p, const u8 *end)
+{
+	u32 seq = READ_ONCE(chrdev->cc_seq);
+	u32 errors = 0, lost = 0;
+
+	if (unlikely(seq != chrdev->cc_seq_seen)) {
+		bitmap_zero(chrdev->cc_valid, 0x2000);
+		chrdev->cc_seq_seen = seq;
+	}
+
+	for (; p < end; p += 188) {
+		u16 pid = ((p[1] & 0x1f) << 8) | p[2];
+		u8 afc = (p[3] >> 4) & 0x03, cc = p[3] & 0x0f;
+		u8 *e = &chrdev->cc_table[pid >> 1];
+		unsigned int shift = (pid & 1) << 2;
+
+		if (unlikely(p[1] & 0x80) || pid == 0x1fff || !afc)
+			continue;
+
+		if (likely(test_bit(pid, chrdev->cc_valid)) &&
+		    likely(!((afc & 0x02) && p[4] && (p[5] & 0x80)))) {
+			u8 last = (*e >> shift) & 0x0f;
+			u8 expected = (afc & 0x01) ? ((last + 1) & 0x0f) : last;
+
+			if (unlikely(cc != expected) &&
+			    !((afc & 0x01) && cc == last)) {
+				errors++;
+				lost += (cc - expected) & 0x0f;
+			}
+		} else {
+			__set_bit(pid, chrdev->cc_valid);
+		}
+
+		*e = (*e & ~(0x0f << shift)) | (cc << shift);
+	}
+
+	if (unlikely(errors)) {
+		chrdev->stats.cc_errors += errors;
+		chrdev->stats.cc_lost_packets += lost;
+	}
+
+	return;
+}
+#endif
+
+/* hands a run of packets of a tuner over to its sink */
+static __always_inline void ts_demux_put_run(struct ts_demux *demux,
+					     ts_demux_sink_t *chrdev,
+					     u8 *run, u8 *end)
+{
+#ifdef __KERNEL__
+	if (unlikely(READ_ONCE(chrdev->cc_check)))
+		ts_demux_check_cc(chrdev, run, end);
+
+	if (unlikely(READ_ONCE(chrdev->pid_stats)))
+		ts_demux_count_pids(chrdev, run, end);
+
+	chrdev->arrival_time = demux->time;
+	chrdev->arrival_step = demux->time_step;
+
+	ptx_chrdev_put_stream(chrdev, run, end - run);
+#else
+	chrdev->put_stream(chrdev, run, (u32)(end - run));
+#endif
+}
+
+/*
+ * The demultiplexer proper, instantiated below for each configuration with
+ * the sync byte, the tuner ID of it and the number of tuners as constants.
+ */
+static __always_inline void ts_demux_process_tmpl(struct ts_demux *demux,
+						  u8 **buf, u32 *len,
+						  u8 sync_mask, u8 sync_byte,
+						  u8 id_mask, u8 id_shift,
+						  u8 id_base,
+						  unsigned int chrdev_num)
+{
+	u8 *p = *buf;
+	u32 remain = *len;
+
+	while (likely(remain)) {
+		u32 i;
+		bool sync_remain = false;
+
+		for (i = 0; i < TS_DEMUX_SYNC_COUNT; i++) {
+			if (likely(((i + 1) * 188) <= remain)) {
+				if (unlikely((p[i * 188] & sync_mask) != sync_byte))
+					break;
+			} else {
+				sync_remain = true;
+				break;
+			}
+		}
+
+		if (unlikely(sync_remain))
+			break;
+
+		if (unlikely(i < TS_DEMUX_SYNC_COUNT)) {
+			if (demux->synced)
+				ts_demux_lost_sync(demux);
+
+			p++;
+			remain--;
+			demux->skipped++;
+			continue;
+		}
+
+		demux->synced = true;
+
+		if (unlikely(demux->skipped)) {
+			px4_prof_add(PX4_PROF_RESYNCS, 1);
+			px4_prof_add(PX4_PROF_RESYNC_BYTES, demux->skipped);
+			px4_prof_hist(PX4_PROF_HIST_RESYNC_LEN, demux->skipped);
+			demux->skipped = 0;
+		}
+
+		while (likely(remain >= 188 && ((p[0] & sync_mask) == sync_byte))) {
+			u8 sync = p[0];
+			unsigned int idx = ((sync & id_mask) >> id_shift) - id_base;
+			u8 *run = p;
+			u32 tei = 0;
+
+			/* commit consecutive packets of the same tuner at once */
+			do {
+				tei += p[1] >> 7;
+				p += 188;
+				remain -= 188;
+			} while (remain >= 188 && p[0] == sync);
+
+			if (likely(idx < chrdev_num && demux->chrdev[idx])) {
+				if (unlikely(tei))
+					demux->chrdev[idx]->stats.tei_errors += tei;
+
+				if (sync != 0x47) {
+					u8 *q;
+
+					for (q = run; q < p; q += 188)
+						q[0] = 0x47;
+				}
+
+				ts_demux_put_run(demux, demux->chrdev[idx], run, p);
+			}
+
+			demux->time += (u64)demux->time_step * ((p - run) / 188);
+		}
+	}
+
+	*buf = p;
+	*len = remain;
+
+	return;
+}
+
+#define TS_DEMUX_DEFINE_PROCESS(_name, _sync_mask, _sync_byte,		\
+				_id_mask, _id_shift, _id_base, _num)	\
+static void _name(struct ts_demux *demux, u8 **buf, u32 *len)		\
+{									\
+	ts_demux_process_tmpl(demux, buf, len, _sync_mask, _sync_byte,	\
+			      _id_mask, _id_shift, _id_base, _num);	\
+}
+
+/*
+ * The IDs of all the tagged devices fit in chrdev[], those of no tuner
+ * find a NULL there, just as the ones beyond chrdev_num.
+ */
+TS_DEMUX_DEFINE_PROCESS(ts_demux_process_tagged, 0x8f, 0x07, 0x70, 4, 1,
+			TS_DEMUX_MAX_CHRDEV);
+TS_DEMUX_DEFINE_PROCESS(ts_demux_process_single, 0xff, 0x47, 0x00, 0, 0, 1);
+
+static void ts_demux_process_generic(struct ts_demux *demux, u8 **buf, u32 *len)
+{
+	const struct ts_demux_config *config = &demux->config;
+
+	ts_demux_process_tmpl(demux, buf, len,
+			      config->sync_mask, config->sync_byte,
+			      config->id_mask, config->id_shift,
+			      config->id_base, config->chrdev_num);
+}
+
+static ts_demux_process_t ts_demux_select_process(const struct ts_demux_config *config)
+{
+	const struct ts_demux_config tagged = TS_DEMUX_TAGGED_CONFIG(0);
+	const struct ts_demux_config single = TS_DEMUX_SINGLE_CONFIG;
+
+	if (config->sync_mask == tagged.sync_mask &&
+	    config->sync_byte == tagged.sync_byte &&
+	    config->id_mask == tagged.id_mask &&
+	    config->id_shift == tagged.id_shift &&
+	    config->id_base == tagged.id_base)
+		return ts_demux_process_tagged;
+
+	if (config->sync_mask == single.sync_mask &&
+	    config->sync_byte == single.sync_byte &&
+	    config->id_mask == single.id_mask &&
+	    config->chrdev_num == 1)
+		return ts_demux_process_single;
+
+	return ts_demux_process_generic;
+}
+
+/*
+ * A single tuner, in sync and a buffer of whole packets: the buffer goes to
+ * the tuner in one piece once each packet has been seen to start with the
+ * sync byte. Returns false to leave anything else to the demultiplexer.
+ */
+static bool ts_demux_single_fast(struct ts_demux *demux, u8 *buf, u32 len)
+{
+	ts_demux_sink_t *chrdev = demux->chrdev[0];
+	u8 *p, *end = buf + len;
+	u32 tei = 0;
+
+	if (unlikely(!demux->synced || !len || len % 188))
+		return false;
+
+	for (p = buf; p < end; p += 188) {
+		if (unlikely(p[0] != 0x47))
+			return false;
+
+		tei += p[1] >> 7;
+	}
+
+	if (likely(chrdev)) {
+		if (unlikely(tei))
+			chrdev->stats.tei_errors += tei;
+
+		ts_demux_put_run(demux, chrdev, buf, end);
+	}
+
+	demux->time += (u64)demux->time_step * (len / 188);
+
+	return true;
+}
+
+int ts_demux_stream_handler(void *context, void *buf, u32 len)
+{
+	struct ts_demux *demux = context;
+	u8 *ctx_remain_buf = demux->remain_buf;
+	u32 ctx_remain_len = demux->remain_len;
+	u8 *p = buf;
+	u32 remain = len;
+	u64 prof = px4_prof_sample_start();
+
+	if (demux->stream_time)
+		ts_demux_update_time(demux, len);
+
+	if (demux->process == ts_demux_process_single && likely(!ctx_remain_len) &&
+	    likely(ts_demux_single_fast(demux, p, len)))
+		goto exit;
+
+	if (unlikely(ctx_remain_len)) {
+		if (likely((ctx_remain_len + len) >= TS_DEMUX_SYNC_SIZE)) {
+			u32 t = TS_DEMUX_SYNC_SIZE - ctx_remain_len;
+
+			memcpy(ctx_remain_buf + ctx_remain_len, p, t);
+			ctx_remain_len = TS_DEMUX_SYNC_SIZE;
+
+			demux->process(demux, &ctx_remain_buf, &ctx_remain_len);
+			if (likely(!ctx_remain_len)) {
+				p += t;
+				remain -= t;
+			}
+
+			demux->remain_len = 0;
+			px4_prof_add(PX4_PROF_REMAIN_JOINED, 1);
+		} else {
+			memcpy(ctx_remain_buf + ctx_remain_len, p, len);
+			demux->remain_len += len;
+			px4_prof_add(PX4_PROF_REMAIN_SHORT, 1);
+
+			goto exit;
+		}
+	}
+
+	demux->process(demux, &p, &remain);
+
+	if (unlikely(remain)) {
+		memcpy(demux->remain_buf, p, remain);
+		demux->remain_len = remain;
+		px4_prof_add(PX4_PROF_REMAIN_SAVED, 1);
+	}
+
+exit:
+	px4_prof_stream_end(prof, len);
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS stream demultiplexer definitions (ts_demux.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __TS_DEMUX_H__
+#define __TS_DEMUX_H__
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+
+#include "ptx_chrdev.h"
+#elif defined(_WIN32) || defined(_WIN64)
+#include "misc_win.h"
+#else
+/* userspace (selftest/), the kernel types come from kcompat.h */
+#endif
+
+#define TS_DEMUX_MAX_CHRDEV	8
+
+#define TS_DEMUX_SYNC_COUNT	4
+#define TS_DEMUX_SYNC_SIZE	(188 * TS_DEMUX_SYNC_COUNT)
+
+struct ts_demux_config {
+	u8 sync_mask;		// bits of the sync byte compared with sync_byte
+	u8 sync_byte;
+	u8 id_mask;		// bits of the sync byte carrying the tuner ID
+	u8 id_shift;
+	u8 id_base;		// tuner ID of chrdev[0]
+	unsigned int chrdev_num;
+};
+
+/* IT930x tagged sync bytes: ((id << 4) | 0x07), id starts from 1 */
+#define TS_DEMUX_TAGGED_CONFIG(num)	\
+	{ 0x8f, 0x07, 0x70, 4, 1, (num) }
+/* plain MPEG-TS, a single tuner */
+#define TS_DEMUX_SINGLE_CONFIG	\
+	{ 0xff, 0x47, 0x00, 0, 0, 1 }
+
+#ifdef __KERNEL__
+typedef struct ptx_chrdev ts_demux_sink_t;
+#else
+/* the receiver of the packets of a tuner, in place of a ptx_chrdev */
+struct ts_demux_sink {
+	void (*put_stream)(struct ts_demux_sink *sink, u8 *buf, u32 len);
+	struct {
+		u64 tei_errors;
+		u64 resyncs;
+	} stats;
+};
+
+typedef struct ts_demux_sink ts_demux_sink_t;
+#endif
+
+struct ts_demux;
+
+typedef void (*ts_demux_process_t)(struct ts_demux *demux, u8 **buf, u32 *len);
+
+struct ts_demux {
+	struct ts_demux_config config;
+	ts_demux_process_t process;	// specialized for the config
+	ts_demux_sink_t *chrdev[TS_DEMUX_MAX_CHRDEV];
+	bool synced;
+	u32 skipped;		// bytes skipped looking for the sync
+	u8 remain_buf[TS_DEMUX_SYNC_SIZE];
+	size_t remain_len;
+	/* arrival time of the packets */
+	const u64 *stream_time;	// completion time of the current buffer
+	u64 last_time;
+	u64 time;		// of the next packet
+	u32 time_step;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void ts_demux_init(struct ts_demux *demux,
+		   const struct ts_demux_config *config);
+void ts_demux_reset(struct ts_demux *demux);
+void ts_demux_set_clock(struct ts_demux *demux, const u64 *stream_time);
+int ts_demux_stream_handler(void *context, void *buf, u32 len);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
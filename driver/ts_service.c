@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS service extractor (ts_service.c)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#include "ts_service.h"
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+
+/* SI tables shared by all services, kept in the partial TS */
+static const u16 ts_service_si_pids[] = {
+	0x0001,	/* CAT */
+	0x0010,	/* NIT */
+	0x0011,	/* SDT, BAT */
+	0x0012,	/* EIT */
+	0x0014,	/* TDT, TOT */
+	0x0023,	/* SDTT */
+	0x0024,	/* BIT */
+	0x0026,	/* EIT (L-EIT) */
+	0x0027,	/* EIT (M-EIT) */
+	0x0028,	/* SDTT */
+	0x0029	/* CDT */
+};
+
+static void ts_service_reset_pids(struct ts_service *svc)
+{
+	int i;
+
+	bitmap_zero(svc->pid_map, 0x2000);
+
+	for (i = 0; i < ARRAY_SIZE(ts_service_si_pids); i++)
+		set_bit(ts_service_si_pids[i], svc->pid_map);
+
+	if (svc->pmt_pid)
+		set_bit(svc->pmt_pid, svc->pid_map);
+
+	return;
+}
+
+void ts_service_init(struct ts_service *svc, u32 service)
+{
+	svc->partial = (service == TS_SERVICE_PARTIAL);
+	svc->program_number = (svc->partial) ? 0 : service;
+	svc->pmt_pid = 0;
+	svc->pat_version = -1;
+	svc->pmt_version = -1;
+	svc->pcr_pid = 0x1fff;
+	svc->pat.active = false;
+	svc->pmt.active = false;
+	svc->pat_ready = false;
+	svc->pat_cc = 0;
+
+	ts_service_reset_pids(svc);
+
+	return;
+}
+
+static bool ts_service_check_section(const u8 *buf, unsigned int size,
+				     u8 table_id)
+{
+	/* the CRC of a valid section including its CRC_32 field is zero */
+	return buf[0] == table_id && (buf[1] & 0x80) && (buf[5] & 0x01) &&
+	       !crc32_be(~0, buf, size);
+}
+
+static void ts_service_build_pat(struct ts_service *svc, const u8 *pat,
+				 bool nit, u16 nit_pid)
+{
+	u8 *p = svc->pat_packet, *s = p + 5;
+	unsigned int len;
+	u32 crc;
+
+	memset(p, 0xff, 188);
+
+	/* payload_unit_start_indicator, pid 0, pointer_field 0 */
+	p[0] = 0x47;
+	p[1] = 0x40;
+	p[2] = 0x00;
+	p[3] = 0x10;
+	p[4] = 0x00;
+
+	/* transport_stream_id and version of the original PAT */
+	s[0] = 0x00;
+	s[3] = pat[3];
+	s[4] = pat[4];
+	s[5] = pat[5];
+	s[6] = 0x00;
+	s[7] = 0x00;
+	len = 8;
+
+	if (nit) {
+		s[len++] = 0x00;
+		s[len++] = 0x00;
+		s[len++] = 0xe0 | ((nit_pid >> 8) & 0x1f);
+		s[len++] = nit_pid & 0xff;
+	}
+
+	s[len++] = (svc->program_number >> 8) & 0xff;
+	s[len++] = svc->program_number & 0xff;
+	s[len++] = 0xe0 | ((svc->pmt_pid >> 8) & 0x1f);
+	s[len++] = svc->pmt_pid & 0xff;
+
+	s[1] = 0xb0 | (((len + 1) >> 8) & 0x0f);
+	s[2] = (len + 1) & 0xff;
+
+	crc = crc32_be(~0, s, len);
+	s[len++] = (crc >> 24) & 0xff;
+	s[len++] = (crc >> 16) & 0xff;
+	s[len++] = (crc >> 8) & 0xff;
+	s[len++] = crc & 0xff;
+
+	svc->pat_ready = true;
+
+	return;
+}
+
+static void ts_service_parse_pat(struct ts_service *svc,
+				 const u8 *buf, unsigned int size)
+{
+	unsigned int i;
+	int version;
+	bool nit = false;
+	u16 nit_pid = 0, pmt_pid = 0;
+
+	if (!ts_service_check_section(buf, size, 0x00))
+		return;
+
+	version = (buf[5] >> 1) & 0x1f;
+	if (svc->pat_ready && version == svc->pat_version)
+		return;
+
+	for (i = 8; i + 4 <= size - 4; i += 4) {
+		u16 num = (buf[i] << 8) | buf[i + 1];
+		u16 pid = ((buf[i + 2] & 0x1f) << 8) | buf[i + 3];
+
+		if (!num) {
+			nit = true;
+			nit_pid = pid;
+		} else if (num == svc->program_number) {
+			pmt_pid = pid;
+		} else if (svc->partial && !pmt_pid &&
+			   pid >= 0x1fc8 && pid <= 0x1fcf) {
+			/* ARIB TR-B14: the PMT of the partial reception service */
+			svc->program_number = num;
+			pmt_pid = pid;
+		}
+	}
+
+	svc->pat_version = version;
+
+	if (pmt_pid != svc->pmt_pid) {
+		svc->pmt_pid = pmt_pid;
+		svc->pmt_version = -1;
+		svc->pmt.active = false;
+		ts_service_reset_pids(svc);
+	}
+
+	if (!pmt_pid) {
+		/* the service is not (or no longer) on this stream */
+		svc->pat_ready = false;
+		if (svc->partial)
+			svc->program_number = 0;
+		return;
+	}
+
+	ts_service_build_pat(svc, buf, nit, nit_pid);
+
+	return;
+}
+
+/* adds the ECM pids of the CA descriptors */
+static void ts_service_parse_descriptors(struct ts_service *svc,
+					 const u8 *d, unsigned int len)
+{
+	unsigned int i = 0;
+
+	while (i + 2 <= len) {
+		u8 tag = d[i], l = d[i + 1];
+
+		if (i + 2 + l > len)
+			break;
+
+		if (tag == 0x09 && l >= 4)
+			set_bit(((d[i + 4] & 0x1f) << 8) | d[i + 5], svc->pid_map);
+
+		i += 2 + l;
+	}
+
+	return;
+}
+
+static void ts_service_parse_pmt(struct ts_service *svc,
+				 const u8 *buf, unsigned int size)
+{
+	unsigned int i, end, info_len;
+	int version;
+
+	if (size < 16 || !ts_service_check_section(buf, size, 0x02))
+		return;
+
+	if (((buf[3] << 8) | buf[4]) != svc->program_number)
+		return;
+
+	version = (buf[5] >> 1) & 0x1f;
+	if (version == svc->pmt_version)
+		return;
+
+	svc->pmt_version = version;
+	ts_service_reset_pids(svc);
+
+	svc->pcr_pid = ((buf[8] & 0x1f) << 8) | buf[9];
+	if (svc->pcr_pid != 0x1fff)
+		set_bit(svc->pcr_pid, svc->pid_map);
+
+	end = size - 4;
+	info_len = ((buf[10] & 0x0f) << 8) | buf[11];
+	if (12 + info_len > end)
+		return;
+
+	ts_service_parse_descriptors(svc, buf + 12, info_len);
+
+	for (i = 12 + info_len; i + 5 <= end; i += 5 + info_len) {
+		set_bit(((buf[i + 1] & 0x1f) << 8) | buf[i + 2], svc->pid_map);
+
+		info_len = ((buf[i + 3] & 0x0f) << 8) | buf[i + 4];
+		if (i + 5 + info_len > end)
+			break;
+
+		ts_service_parse_descriptors(svc, buf + i + 5, info_len);
+	}
+
+	return;
+}
+
+static void ts_service_append(struct ts_service *svc,
+			      struct ts_service_section *sec,
+			      const u8 *p, unsigned int len,
+			      void (*parse)(struct ts_service *,
+					    const u8 *, unsigned int))
+{
+	if (len > TS_SERVICE_SECTION_MAX - sec->len)
+		len = TS_SERVICE_SECTION_MAX - sec->len;
+
+	memcpy(sec->buf + sec->len, p, len);
+	sec->len += len;
+
+	if (!sec->size && sec->len >= 3) {
+		/* 0xff: stuffing after the last section */
+		if (sec->buf[0] == 0xff) {
+			sec->active = false;
+			return;
+		}
+
+		sec->size = 3 + (((sec->buf[1] & 0x0f) << 8) | sec->buf[2]);
+		if (sec->size < 12 || sec->size > TS_SERVICE_SECTION_MAX) {
+			sec->active = false;
+			return;
+		}
+	}
+
+	if (sec->size && sec->len >= sec->size) {
+		parse(svc, sec->buf, sec->size);
+		sec->active = false;
+	}
+
+	return;
+}
+
+/* reassembles the sections on a pid, only the first one of a packet is used */
+static void ts_service_feed(struct ts_service *svc,
+			    struct ts_service_section *sec, const u8 *packet,
+			    void (*parse)(struct ts_service *,
+					  const u8 *, unsigned int))
+{
+	const u8 *p = packet + 4, *end = packet + 188;
+	u8 cc = packet[3] & 0x0f;
+	bool cont;
+
+	if (unlikely(packet[1] & 0x80)) {
+		/* transport_error_indicator */
+		sec->active = false;
+		return;
+	}
+
+	if (!(packet[3] & 0x10))
+		return;
+
+	if (packet[3] & 0x20) {
+		p += 1 + packet[4];
+		if (p >= end) {
+			sec->active = false;
+			return;
+		}
+	}
+
+	if (sec->active && cc == sec->cc)
+		return;		/* duplicate packet */
+
+	cont = sec->active && (((sec->cc + 1) & 0x0f) == cc);
+	sec->cc = cc;
+
+	if (packet[1] & 0x40) {
+		unsigned int pointer = *p++;
+
+		if (p + pointer >= end) {
+			sec->active = false;
+			return;
+		}
+
+		/* the end of the previous section */
+		if (cont && pointer)
+			ts_service_append(svc, sec, p, pointer, parse);
+
+		p += pointer;
+
+		sec->active = true;
+		sec->len = 0;
+		sec->size = 0;
+	} else if (!cont) {
+		sec->active = false;
+		return;
+	}
+
+	ts_service_append(svc, sec, p, end - p, parse);
+
+	return;
+}
+
+/*
+ * Decides what to do with a packet of the full TS. The PAT is replaced by
+ * one which lists the service only, and the pids of the service are learned
+ * from its PMT, following version changes of both tables.
+ */
+enum ts_service_action ts_service_filter(struct ts_service *svc,
+					 const u8 *packet, const u8 **out)
+{
+	u16 pid = ((packet[1] & 0x1f) << 8) | packet[2];
+
+	if (unlikely(!pid)) {
+		ts_service_feed(svc, &svc->pat, packet, ts_service_parse_pat);
+
+		/* one rewritten PAT per original one */
+		if (!svc->pat_ready || !(packet[1] & 0x40))
+			return TS_SERVICE_DROP;
+
+		svc->pat_packet[3] = 0x10 | svc->pat_cc;
+		svc->pat_cc = (svc->pat_cc + 1) & 0x0f;
+
+		*out = svc->pat_packet;
+		return TS_SERVICE_REPLACE;
+	}
+
+	if (unlikely(pid == svc->pmt_pid))
+		ts_service_feed(svc, &svc->pmt, packet, ts_service_parse_pmt);
+
+	return (test_bit(pid, svc->pid_map)) ? TS_SERVICE_PASS
+					     : TS_SERVICE_DROP;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * TS service extractor definitions (ts_service.h)
+ *
+ * Copyright (c) 2018-2021 nns779
+ */
+
+#ifndef __TS_SERVICE_H__
+#define __TS_SERVICE_H__
+
+#include <linux/types.h>
+#include <linux/bitmap.h>
+
+/* PAT and PMT sections are 1024 bytes at most */
+#define TS_SERVICE_SECTION_MAX	1024
+
+/* the partial reception service, whatever its program number */
+#define TS_SERVICE_PARTIAL	0x10000
+
+enum ts_service_action {
+	TS_SERVICE_DROP = 0,
+	TS_SERVICE_PASS,
+	TS_SERVICE_REPLACE,	// send the packet returned by ts_service_filter()
+};
+
+struct ts_service_section {
+	bool active;		// a section is being received
+	unsigned int len;	// received
+	unsigned int size;	// whole section, 0: unknown yet
+	u8 cc;			// continuity counter of the last packet
+	u8 buf[TS_SERVICE_SECTION_MAX];
+};
+
+struct ts_service {
+	u16 program_number;	// 0: not found yet, TS_SERVICE_PARTIAL
+	bool partial;
+	u16 pmt_pid;		// 0: not found in the PAT yet
+	int pat_version;	// -1: unknown
+	int pmt_version;
+	u16 pcr_pid;
+	DECLARE_BITMAP(pid_map, 0x2000);	// pids of the service
+	struct ts_service_section pat;
+	struct ts_service_section pmt;
+	bool pat_ready;
+	u8 pat_cc;
+	u8 pat_packet[188];	// the PAT rewritten to the service
+};
+
+void ts_service_init(struct ts_service *svc, u32 service);
+enum ts_service_action ts_service_filter(struct ts_service *svc,
+					 const u8 *packet, const u8 **out);
+
+#endif
@@ -6,3 +6,4 @@
 #include <stddef.h>
 
 uint32_t crc32_calc(const void *buf, size_t size);
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
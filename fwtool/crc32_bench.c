@@ -0,0 +1,103 @@
+// crc32_bench.c
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define BENCH_SIZE	(64 * 1024 * 1024)
+#define BENCH_LOOPS	4
+
+// the byte-at-a-time loop, for comparison
+static uint32_t crc32_bytewise(const void *buf, size_t size)
+{
+	static uint32_t table[256];
+	const uint8_t *p = buf;
+	uint32_t crc = 0xffffffff;
+
+	if (!table[1]) {
+		uint32_t i, j;
+
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+
+			table[i] = c;
+		}
+	}
+
+	while (size--)
+		crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint32_t (*fn)(const void *, size_t), const uint8_t *buf, uint32_t *crc)
+{
+	int i;
+	double t;
+
+	t = now();
+
+	for (i = 0; i < BENCH_LOOPS; i++)
+		*crc = fn(buf, BENCH_SIZE);
+
+	t = now() - t;
+
+	return (double)BENCH_SIZE * BENCH_LOOPS / t / (1024 * 1024);
+}
+
+int main(void)
+{
+	uint8_t *buf;
+	uint32_t crc_ref, crc;
+	double mbps_ref, mbps;
+	size_t i;
+
+	buf = (uint8_t *)malloc(BENCH_SIZE + 1);
+	if (!buf) {
+		fprintf(stderr, "No enough memory.\n");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < BENCH_SIZE + 1; i++)
+		buf[i] = (uint8_t)rand();
+
+	// check the unaligned and the short cases as well
+	for (i = 0; i < 64; i++) {
+		if (crc32_calc(buf + 1, i) != crc32_bytewise(buf + 1, i)) {
+			fprintf(stderr, "CRC32 mismatch at length %zu!\n", i);
+			free(buf);
+			return 1;
+		}
+	}
+
+	mbps_ref = bench(crc32_bytewise, buf, &crc_ref);
+	mbps = bench(crc32_calc, buf, &crc);
+
+	printf("bytewise    : %8.1f MiB/s (%08x)\n", mbps_ref, crc_ref);
+	printf("crc32_calc  : %8.1f MiB/s (%08x)\n", mbps, crc);
+
+	free(buf);
+
+	if (crc != crc_ref) {
+		fprintf(stderr, "CRC32 mismatch!\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -8,6 +8,8 @@
 #include <io.h>
 #else
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #endif
 #include <fcntl.h>
 #include <sys/types.h>
@@ -57,6 +59,26 @@ static struct {
 #define NAME_NUM	(sizeof(name) / sizeof(name[0]))
 #define TARGET_LIST_NUM	(sizeof(target_list) / sizeof(target_list[0]))
 
+// (size, crc32) lookup, the entries of the same size are chained
+struct fwindex {
+	unsigned int mask;
+	int *head;
+	int *next;
+	struct fwinfo *fi;
+};
+
+#define BATCH_MAX_THREADS	64
+
+// the firmware CRC32 values of 'fwinfo.tsv', for the scan mode
+struct fwscan {
+	uint32_t *crc32;
+	int num;
+};
+
+#define SCAN_MAX_FW	(64 * 1024)	// bytes, the known ones are < 8 KiB
+#define SCAN_MIN_FW	256
+#define SCAN_MAX_BLOCK	(255 - 3 - 2)	// as checked by the driver
+
 static int load_file(const char *path, uint8_t **buf, unsigned long *size)
 {
 	int ret = -1, fd = -1;
@@ -126,6 +148,69 @@ exit:
 	return ret;
 }
 
+// only the files of a known size are read as a whole, so map them instead
+static int map_file(const char *path, const uint8_t **buf, unsigned long *size)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	uint8_t *b;
+
+	if (load_file(path, &b, size))
+		return -1;
+
+	*buf = b;
+
+	return 0;
+#else
+	int fd;
+	struct stat stbuf;
+	void *p;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Couldn't open file '%s' to read.\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &stbuf) == -1) {
+		fprintf(stderr, "fstat() failed.\n");
+		close(fd);
+		return -1;
+	}
+
+	if (!S_ISREG(stbuf.st_mode) || stbuf.st_size <= 0) {
+		close(fd);
+		*buf = NULL;
+		*size = 0;
+		return 0;
+	}
+
+	p = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Failed to map file '%s'.\n", path);
+		return -1;
+	}
+
+	*buf = p;
+	*size = stbuf.st_size;
+
+	return 0;
+#endif
+}
+
+static void unmap_file(const uint8_t *buf, unsigned long size)
+{
+	if (!buf)
+		return;
+
+#if defined(_WIN32) || defined(_WIN64)
+	free((void *)buf);
+#else
+	munmap((void *)buf, size);
+#endif
+}
+
 static int load_tsv_file(struct tsv_data **tsv)
 {
 	int ret = -1;
@@ -208,13 +293,86 @@ static int load_fwinfo(struct tsv_data *tsv, struct fwinfo *fi, int num)
 	return 0;
 }
 
-static int output_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long size, const char *path)
+static unsigned int fwindex_hash(const struct fwindex *idx, unsigned long size)
+{
+	uint32_t h = (uint32_t)size * 0x9e3779b1;
+
+	return (h ^ (h >> 16)) & idx->mask;
+}
+
+static int fwindex_build(struct fwindex *idx, struct fwinfo *fi, int num)
+{
+	int i;
+	unsigned int n = 16;
+
+	while (n < (unsigned int)num * 2)
+		n <<= 1;
+
+	idx->mask = n - 1;
+	idx->fi = fi;
+	idx->head = (int *)malloc(sizeof(int) * n);
+	idx->next = (int *)malloc(sizeof(int) * num);
+
+	if (!idx->head || !idx->next) {
+		fprintf(stderr, "No enough memory.\n");
+		free(idx->head);
+		free(idx->next);
+		return -1;
+	}
+
+	memset(idx->head, 0xff, sizeof(int) * n);
+
+	// backwards, so that the chains keep the order of 'fwinfo.tsv'
+	for (i = num - 1; i >= 0; i--) {
+		unsigned int h = fwindex_hash(idx, fi[i].size);
+
+		idx->next[i] = idx->head[h];
+		idx->head[h] = i;
+	}
+
+	return 0;
+}
+
+static void fwindex_free(struct fwindex *idx)
+{
+	free(idx->head);
+	free(idx->next);
+}
+
+static int fwindex_has_size(const struct fwindex *idx, unsigned long size)
+{
+	int i;
+
+	for (i = idx->head[fwindex_hash(idx, size)]; i != -1; i = idx->next[i]) {
+		if (idx->fi[i].size == size)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct fwinfo *fwindex_find(const struct fwindex *idx, enum fw_target target,
+				   unsigned long size, uint32_t crc32)
+{
+	int i;
+
+	for (i = idx->head[fwindex_hash(idx, size)]; i != -1; i = idx->next[i]) {
+		struct fwinfo *fi = &idx->fi[i];
+
+		if (target == fi->target && size == fi->size && crc32 == fi->crc32)
+			return fi;
+	}
+
+	return NULL;
+}
+
+static int locate_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long size,
+			   uint32_t *ofs, size_t *len, uint32_t *fw_crc32)
 {
 	uint8_t i, n;
 	uint8_t align;
 	uint32_t partition_ofs, segment_ofs, code_ofs, crc32;
 	size_t code_len = 0;
-	FILE *fp;
 
 	align = fi->align;
 	partition_ofs = fi->partition_ofs;
@@ -261,14 +419,209 @@ static int output_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long
 
 	crc32 = crc32_calc(&buf[code_ofs], code_len);
 
-	fprintf(stderr, "Firmware length: %zu %s\n", code_len, (code_len == 1) ? "byte" : "bytes");
-	fprintf(stderr, "Firmware CRC32: %08x\n", crc32);
+	*ofs = code_ofs;
+	*len = code_len;
+	*fw_crc32 = crc32;
 
-	if (fi->fw_crc32 && crc32 != fi->fw_crc32) {
-		fprintf(stderr, "Incorrect CRC32 checksum!\n");
+	return 0;
+}
+
+static int fwscan_init(struct fwscan *sc, const struct fwinfo *fi, int num, enum fw_target target)
+{
+	int i, j;
+
+	sc->num = 0;
+	sc->crc32 = (uint32_t *)malloc(sizeof(uint32_t) * num);
+	if (!sc->crc32) {
+		fprintf(stderr, "No enough memory.\n");
 		return -1;
 	}
 
+	for (i = 0; i < num; i++) {
+		if (fi[i].target != target || !fi[i].fw_crc32)
+			continue;
+
+		for (j = 0; j < sc->num; j++) {
+			if (sc->crc32[j] == fi[i].fw_crc32)
+				break;
+		}
+
+		if (j >= sc->num)
+			sc->crc32[sc->num++] = fi[i].fw_crc32;
+	}
+
+	if (!sc->num) {
+		fprintf(stderr, "No firmware CRC32 in 'fwinfo.tsv'.\n");
+		free(sc->crc32);
+		sc->crc32 = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void fwscan_free(struct fwscan *sc)
+{
+	free(sc->crc32);
+	sc->crc32 = NULL;
+}
+
+/*
+ * The firmware is a chain of blocks, just like the driver parses it:
+ * 0x03, 2 bytes, the number of ranges m, m * (2 bytes, length), the data.
+ * Follows the chain at p and returns its length as soon as the CRC32 of the
+ * blocks so far is a known one, 0 if it breaks before.
+ */
+static size_t scan_chain(const struct fwscan *sc, const uint8_t *p, size_t n, uint32_t *fw_crc32)
+{
+	size_t i = 0;
+	uint32_t crc32 = 0;
+
+	while (n - i >= 4 && p[i] == 0x03) {
+		const uint8_t *b = &p[i];
+		size_t j, m, len = 0;
+		int k;
+
+		m = b[3];
+		if (n - i < 4 + (m * 3))
+			break;
+
+		for (j = 0; j < m; j++)
+			len += b[6 + (j * 3)];
+
+		len += 4 + (m * 3);
+		if (len > SCAN_MAX_BLOCK || len > n - i)
+			break;
+
+		crc32 = crc32_update(crc32, b, len);
+		i += len;
+
+		if (i < SCAN_MIN_FW)
+			continue;
+
+		for (k = 0; k < sc->num; k++) {
+			if (crc32 == sc->crc32[k]) {
+				*fw_crc32 = crc32;
+				return i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// looks for a firmware starting before limit, the data after it is up to len
+static int scan_buffer(const struct fwscan *sc, const uint8_t *buf, size_t len, size_t limit,
+		       size_t *ofs, size_t *fw_len, uint32_t *fw_crc32)
+{
+	const uint8_t *p = buf, *end = buf + limit;
+
+	while (p < end) {
+		size_t n;
+
+		p = memchr(p, 0x03, end - p);
+		if (!p)
+			break;
+
+		n = len - (p - buf);
+		if (n > SCAN_MAX_FW)
+			n = SCAN_MAX_FW;
+
+		n = scan_chain(sc, p, n, fw_crc32);
+		if (n) {
+			*ofs = p - buf;
+			*fw_len = n;
+			return 0;
+		}
+
+		p++;
+	}
+
+	return -1;
+}
+
+/*
+ * Reads the file once through a window of twice the firmware size at most,
+ * so that inputs of any size are scanned with bounded memory.
+ */
+static int scan_file(const struct fwscan *sc, const char *path, uint8_t **fw,
+		     size_t *fw_len, unsigned long *fw_ofs, uint32_t *fw_crc32)
+{
+	int ret = -1, eof = 0;
+	FILE *fp;
+	uint8_t *buf;
+	size_t filled = 0;
+	unsigned long base = 0;
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (fopen_s(&fp, path, "rb") || !fp) {
+#else
+	fp = fopen(path, "rb");
+	if (!fp) {
+#endif
+		fprintf(stderr, "Couldn't open file '%s' to read.\n", path);
+		return -1;
+	}
+
+	buf = (uint8_t *)malloc(SCAN_MAX_FW * 2);
+	if (!buf) {
+		fprintf(stderr, "No enough memory.\n");
+		fclose(fp);
+		return -1;
+	}
+
+	while (1) {
+		size_t limit, ofs;
+
+		while (!eof && filled < SCAN_MAX_FW * 2) {
+			size_t r = fread(&buf[filled], 1, (SCAN_MAX_FW * 2) - filled, fp);
+
+			if (!r)
+				eof = 1;
+
+			filled += r;
+		}
+
+		if (ferror(fp)) {
+			fprintf(stderr, "Failed to read from file '%s'.\n", path);
+			break;
+		}
+
+		limit = (eof) ? filled : filled - SCAN_MAX_FW;
+
+		if (!scan_buffer(sc, buf, filled, limit, &ofs, fw_len, fw_crc32)) {
+			*fw = (uint8_t *)malloc(*fw_len);
+			if (!*fw) {
+				fprintf(stderr, "No enough memory.\n");
+				break;
+			}
+
+			memcpy(*fw, &buf[ofs], *fw_len);
+			*fw_ofs = base + ofs;
+			ret = 0;
+			break;
+		}
+
+		if (eof) {
+			ret = 1;
+			break;
+		}
+
+		memmove(buf, &buf[limit], filled - limit);
+		filled -= limit;
+		base += limit;
+	}
+
+	free(buf);
+	fclose(fp);
+
+	return ret;
+}
+
+static int write_firmware(const uint8_t *code, size_t code_len, const char *path)
+{
+	FILE *fp;
+
 #if defined(_WIN32) || defined(_WIN64)
 	if (fopen_s(&fp, path, "wb") || !fp) {
 #else
@@ -279,7 +632,7 @@ static int output_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long
 		return -1;
 	}
 
-	if (fwrite(&buf[code_ofs], code_len, 1, fp) < 1) {
+	if (fwrite(code, code_len, 1, fp) < 1) {
 		fprintf(stderr, "Failed to write to file '%s'.\n", path);
 		fclose(fp);
 		return -1;
@@ -290,14 +643,235 @@ static int output_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long
 	return 0;
 }
 
+static int output_firmware(struct fwinfo *fi, const uint8_t *buf, unsigned long size, const char *path)
+{
+	uint32_t code_ofs, crc32;
+	size_t code_len;
+
+	if (locate_firmware(fi, buf, size, &code_ofs, &code_len, &crc32))
+		return -1;
+
+	fprintf(stderr, "Firmware length: %zu %s\n", code_len, (code_len == 1) ? "byte" : "bytes");
+	fprintf(stderr, "Firmware CRC32: %08x\n", crc32);
+
+	if (fi->fw_crc32 && crc32 != fi->fw_crc32) {
+		fprintf(stderr, "Incorrect CRC32 checksum!\n");
+		return -1;
+	}
+
+	return write_firmware(&buf[code_ofs], code_len, path);
+}
+
+/*
+ * Batch mode: every driver file is checked against the index and the firmware
+ * found in it is written to '<output directory>/<target>-firmware-<crc32>.bin',
+ * once per distinct firmware.
+ */
+struct batch {
+	const struct fwindex *idx;
+	const struct fwscan *scan;	// for the unknown files, optional
+	enum fw_target target;
+	const char *target_str;
+	const char *dir;
+	char **in;
+	int in_num;
+	int next;		// next input to process
+	int found;
+	int failed;
+	uint32_t *written;	// crc32 of the firmware written so far
+	int written_num;
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_mutex_t lock;
+#endif
+};
+
+static void batch_lock(struct batch *b)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_mutex_lock(&b->lock);
+#endif
+}
+
+static void batch_unlock(struct batch *b)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+// returns 1 if the firmware has already been written by another file
+static int batch_claim(struct batch *b, uint32_t crc32)
+{
+	int i, ret = 0;
+
+	batch_lock(b);
+
+	for (i = 0; i < b->written_num; i++) {
+		if (b->written[i] == crc32) {
+			ret = 1;
+			break;
+		}
+	}
+
+	if (!ret)
+		b->written[b->written_num++] = crc32;
+
+	batch_unlock(b);
+
+	return ret;
+}
+
+static void batch_file(struct batch *b, const char *in)
+{
+	int ret = -1;
+	const uint8_t *buf = NULL;
+	unsigned long size = 0;
+	struct fwinfo *fi = NULL;
+	uint32_t code_ofs, crc32, fw_crc32 = 0;
+	size_t code_len = 0;
+	char out[4096];
+	int skipped = 0;
+	const char *desc = NULL;
+
+	if (map_file(in, &buf, &size))
+		goto exit;
+
+	ret = 0;
+
+	if (!buf)
+		goto exit;
+
+	// no need to checksum the files which can't be any of the known ones
+	if (fwindex_has_size(b->idx, size)) {
+		crc32 = crc32_calc(buf, size);
+		fi = fwindex_find(b->idx, b->target, size, crc32);
+	}
+
+	if (fi) {
+		desc = fi->desc;
+
+		ret = locate_firmware(fi, buf, size, &code_ofs, &code_len, &fw_crc32);
+		if (ret)
+			goto exit;
+
+		if (fi->fw_crc32 && fw_crc32 != fi->fw_crc32) {
+			fprintf(stderr, "%s: incorrect firmware CRC32 checksum!\n", in);
+			ret = -1;
+			goto exit;
+		}
+	} else if (b->scan) {
+		size_t ofs;
+
+		if (scan_buffer(b->scan, buf, size, size, &ofs, &code_len, &fw_crc32))
+			goto exit;
+
+		code_ofs = (uint32_t)ofs;
+		desc = "found by scan";
+	} else {
+		goto exit;
+	}
+
+	snprintf(out, sizeof(out), "%s/%s-firmware-%08x.bin", b->dir, b->target_str, fw_crc32);
+
+	if (batch_claim(b, fw_crc32))
+		skipped = 1;
+	else
+		ret = write_firmware(&buf[code_ofs], code_len, out);
+
+exit:
+	unmap_file(buf, size);
+
+	batch_lock(b);
+
+	if (ret) {
+		b->failed++;
+		fprintf(stderr, "%s: failed.\n", in);
+	} else if (desc) {
+		b->found++;
+		fprintf(stderr, "%s: %s, firmware %08x%s %s\n", in, desc, fw_crc32,
+			(skipped) ? ", already written to" : " ->", out);
+	}
+
+	batch_unlock(b);
+}
+
+static void *batch_thread(void *arg)
+{
+	struct batch *b = arg;
+
+	while (1) {
+		int i;
+
+		batch_lock(b);
+		i = b->next++;
+		batch_unlock(b);
+
+		if (i >= b->in_num)
+			break;
+
+		batch_file(b, b->in[i]);
+	}
+
+	return NULL;
+}
+
+static int run_batch(struct batch *b, int jobs)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	batch_thread(b);
+#else
+	pthread_t thread[BATCH_MAX_THREADS];
+	int i, n = 0;
+
+	if (jobs <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = (cpus > 0) ? (int)cpus : 1;
+	}
+
+	if (jobs > BATCH_MAX_THREADS)
+		jobs = BATCH_MAX_THREADS;
+
+	if (jobs > b->in_num)
+		jobs = b->in_num;
+
+	pthread_mutex_init(&b->lock, NULL);
+
+	// the main thread is one of the workers
+	for (i = 1; i < jobs; i++) {
+		if (pthread_create(&thread[n], NULL, batch_thread, b))
+			break;
+
+		n++;
+	}
+
+	batch_thread(b);
+
+	for (i = 0; i < n; i++)
+		pthread_join(thread[i], NULL);
+
+	pthread_mutex_destroy(&b->lock);
+#endif
+
+	fprintf(stderr, "\n%d of %d %s recognized, %d failed.\n",
+		b->found, b->in_num, (b->in_num == 1) ? "file" : "files", b->failed);
+
+	return (b->failed) ? -1 : 0;
+}
+
 static void usage()
 {
 	fprintf(stderr, "usage: fwtool <driver binary> <output>\n");
+	fprintf(stderr, "       fwtool -b [-s] [-o <output directory>] [-j <jobs>] <driver binary>...\n");
+	fprintf(stderr, "       fwtool -s <any binary> <output>\n");
 }
 
 int main(int argc, char *argv[])
 {
 	int ret, num, i;
+	int batch_mode = 0, scan_mode = 0, jobs = 0, in_num = 0;
+	struct fwscan scan = { NULL, 0 };
+	char **in_list = NULL;
 	char *in = NULL, *out = NULL;
 	enum fw_target target = FW_TARGET_UNKNOWN;
 	struct tsv_data *tsv = NULL;
@@ -308,6 +882,14 @@ int main(int argc, char *argv[])
 
 	fprintf(stderr, "fwtool for px4 drivers\n\n");
 
+	// all the other arguments are driver files in batch mode
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-b")) {
+			batch_mode = 1;
+			break;
+		}
+	}
+
 	for (i = 1; i < argc; i++) {
 		if (argv[i][0] == '-') {
 			if (argv[i][1] == 't') {
@@ -325,7 +907,39 @@ int main(int argc, char *argv[])
 					continue;
 
 				parse_fw_target(t, &target);
+			} else if (argv[i][1] == 's') {
+				// look for the firmware blocks in files unknown to 'fwinfo.tsv'
+				scan_mode = 1;
+			} else if (argv[i][1] == 'o' || argv[i][1] == 'j') {
+				// output directory and number of jobs, batch mode
+				char opt = argv[i][1];
+				char *v = NULL;
+
+				if (argv[i][2] == '\0') {
+					if ((i + 1) < argc)
+						v = argv[++i];
+				} else {
+					v = &argv[i][2];
+				}
+
+				if (!v)
+					continue;
+
+				if (opt == 'o')
+					out = v;
+				else
+					jobs = atoi(v);
+			}
+		} else if (batch_mode) {
+			if (!in_list) {
+				in_list = (char **)malloc(sizeof(char *) * argc);
+				if (!in_list) {
+					fprintf(stderr, "No enough memory.\n");
+					return 1;
+				}
 			}
+
+			in_list[in_num++] = argv[i];
 		} else if (!in) {
 			in = argv[i];
 		} else if (!out) {
@@ -333,7 +947,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!in) {
+	if (batch_mode) {
+		if (!in_num) {
+			usage();
+			return 0;
+		}
+
+		if (target == FW_TARGET_UNKNOWN)
+			target = FW_TARGET_IT930X;
+
+		if (!out)
+			out = ".";
+	} else if (!in) {
 		usage();
 		return 0;
 	}
@@ -343,13 +968,18 @@ int main(int argc, char *argv[])
 	else if (!out && target == FW_TARGET_IT930X)
 		out = "it930x-firmware.bin";
 
-	if (!out || target == FW_TARGET_UNKNOWN) {
+	if (!batch_mode && (!out || target == FW_TARGET_UNKNOWN)) {
 		usage();
 		return 0;
 	}
 
-	fprintf(stderr, "Driver file (in)    : %s\n", in);
-	fprintf(stderr, "Firmware file (out) : %s\n\n", out);
+	if (batch_mode) {
+		fprintf(stderr, "Driver files (in)   : %d\n", in_num);
+		fprintf(stderr, "Directory (out)     : %s\n\n", out);
+	} else {
+		fprintf(stderr, "Driver file (in)    : %s\n", in);
+		fprintf(stderr, "Firmware file (out) : %s\n\n", out);
+	}
 
 	ret = load_tsv_file(&tsv);
 	if (ret) {
@@ -376,6 +1006,85 @@ int main(int argc, char *argv[])
 		goto fail;
 	}
 
+	if (scan_mode && fwscan_init(&scan, fi, num, target))
+		goto fail;
+
+	if (batch_mode) {
+		struct fwindex idx;
+		struct batch b;
+
+		if (fwindex_build(&idx, fi, num))
+			goto fail;
+
+		memset(&b, 0, sizeof(b));
+		b.idx = &idx;
+		b.scan = (scan_mode) ? &scan : NULL;
+		b.target = target;
+		b.target_str = target_list[0].str;
+		b.dir = out;
+		b.in = in_list;
+		b.in_num = in_num;
+		b.written = (uint32_t *)malloc(sizeof(uint32_t) * in_num);
+
+		for (i = 0; i < TARGET_LIST_NUM; i++) {
+			if (target_list[i].target == target)
+				b.target_str = target_list[i].str;
+		}
+
+		if (!b.written) {
+			fprintf(stderr, "No enough memory.\n");
+			fwindex_free(&idx);
+			goto fail;
+		}
+
+		ret = run_batch(&b, jobs);
+
+		free(b.written);
+		fwindex_free(&idx);
+
+		if (ret)
+			goto fail;
+
+		free(in_list);
+		fwscan_free(&scan);
+		free(fi);
+		tsv_free(tsv);
+
+		return 0;
+	}
+
+	if (scan_mode) {
+		uint8_t *fw = NULL;
+		size_t fw_len;
+		unsigned long fw_ofs;
+		uint32_t fw_crc32;
+
+		ret = scan_file(&scan, in, &fw, &fw_len, &fw_ofs, &fw_crc32);
+		if (ret) {
+			if (ret > 0)
+				fprintf(stderr, "No firmware was found.\n");
+			goto fail;
+		}
+
+		fprintf(stderr, "Firmware offset: 0x%lx\n", fw_ofs);
+		fprintf(stderr, "Firmware length: %zu %s\n", fw_len, (fw_len == 1) ? "byte" : "bytes");
+		fprintf(stderr, "Firmware CRC32: %08x\n", fw_crc32);
+
+		ret = write_firmware(fw, fw_len, out);
+		free(fw);
+
+		if (ret)
+			goto fail;
+
+		fprintf(stderr, "OK.\n");
+
+		fwscan_free(&scan);
+		free(fi);
+		tsv_free(tsv);
+
+		return 0;
+	}
+
 	ret = load_file(in, &buf, &size);
 	if (ret == -1) {
 		fprintf(stderr, "Failed to load driver file.\n");
@@ -408,6 +1117,12 @@ int main(int argc, char *argv[])
 	return 0;
 
 fail:
+	if (in_list)
+		free(in_list);
+
+	if (scan.crc32)
+		fwscan_free(&scan);
+
 	if (buf)
 		free(buf);
 
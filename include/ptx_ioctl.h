@@ -33,6 +33,245 @@ struct ptx_freq {
 #define PTX_DISABLE_LNB_POWER	_IO(0x8d, 0x06)
 #define PTX_SET_SYSTEM_MODE	_IOW(0x8d, 0x0b, int)
 
+// mmap interface
+
+/*
+ * The first page of the mapping is a read-only control page described by
+ * struct ptx_mmap_ctrl, followed by the ring buffer itself.
+ * Readable bytes are (write_count - read_count) starting at offset 'head' of
+ * the buffer, wrapping around at 'size'.
+ * PTX_ADVANCE_READ_POINTER consumes the given number of bytes, waits until
+ * new data arrives if the buffer is empty and returns the readable bytes.
+ */
+
+struct ptx_mmap_ctrl {
+	__u32 size;				// ring buffer size
+	__u32 head;				// read offset
+	__u32 tail;				// write offset
+	__u32 read_count;			// total bytes consumed (wraps)
+	__u32 write_count;			// total bytes written (wraps)
+};
+
+#define PTX_ADVANCE_READ_POINTER	_IOWR(0x8d, 0x0c, __u32)
+
+// reader wake-up control (per open file, reset on open)
+
+struct ptx_wake_threshold {
+	__u32 size;				// bytes, 0: driver default
+	__u32 latency;				// ms, 0: disabled
+};
+
+#define PTX_SET_WAKE_THRESHOLD	_IOW(0x8d, 0x0d, struct ptx_wake_threshold)
+
+// asynchronous tuning
+
+/*
+ * PTX_SET_CHANNEL_ASYNC returns as soon as the tuner has been programmed and
+ * waits for lock in the background. poll() reports POLLPRI when it has
+ * finished, and PTX_GET_TUNE_STATUS returns 0 once locked, -EINPROGRESS while
+ * waiting, or the error PTX_SET_CHANNEL would have returned (e.g. -EAGAIN).
+ */
+
+#define PTX_SET_CHANNEL_ASYNC	_IOW(0x8d, 0x0e, struct ptx_freq)
+#define PTX_GET_TUNE_STATUS	_IO(0x8d, 0x0f)
+
+// overflow handling (per device, reset on the first open)
+
+/*
+ * PTX_SET_OVERFLOW_POLICY selects what happens to a reader which has no room
+ * left. The data is always dropped in whole TS packets.
+ *   PTX_OVERFLOW_DROP_OLDEST: discard the oldest unread packets (default)
+ *   PTX_OVERFLOW_DROP_NEWEST: keep the unread packets, write as many as fit
+ *   PTX_OVERFLOW_BLOCK: keep the unread packets, discard the received data
+ *                       until all of it fits
+ * poll() reports POLLPRI once data has been lost, and PTX_GET_OVERFLOW_COUNT
+ * returns the number of overflow events since the last call.
+ */
+
+enum ptx_overflow_policy {
+	PTX_OVERFLOW_DROP_OLDEST = 0,
+	PTX_OVERFLOW_DROP_NEWEST,
+	PTX_OVERFLOW_BLOCK
+};
+
+#define PTX_SET_OVERFLOW_POLICY	_IOW(0x8d, 0x10, int)
+#define PTX_GET_OVERFLOW_COUNT	_IOR(0x8d, 0x11, __u32)
+
+// pooled tuner allocation (/dev/<name>video-any)
+
+/*
+ * PTX_ALLOC_TUNER, on the pool node only, opens a free tuner capable of the
+ * requested system and returns a new file descriptor for it, which behaves
+ * as if /dev/<name>video<minor> had been opened. Tuners on the least busy USB
+ * bus are chosen first, then those on an already powered device, then the
+ * least loaded device. -EBUSY is returned if all capable tuners are in use.
+ */
+
+struct ptx_alloc_tuner {
+	__s32 system;				// in: enum ptx_system_type
+	__s32 fd;				// out
+	__u32 minor;				// out
+};
+
+#define PTX_ALLOC_TUNER		_IOWR(0x8d, 0x12, struct ptx_alloc_tuner)
+
+// packet aligned reads (per open file, reset on open)
+
+/*
+ * PTX_SET_PACKET_ALIGNED(1) makes read() and splice() return whole packets
+ * only (188 bytes, or 192 bytes with PTXT_TIMESTAMP_M2TS), so that every
+ * read starts on a packet boundary. read() fails with -EINVAL if the buffer
+ * can't hold a single packet. It can be changed only while the file is not
+ * streaming.
+ */
+
+#define PTX_SET_PACKET_ALIGNED	_IOW(0x8d, 0x13, int)
+
+// service extraction (per device, reset on the first open)
+
+/*
+ * PTX_SET_SERVICE(program_number) passes only the packets of one service
+ * and the SI tables shared by all services (CAT, NIT, SDT, EIT, TOT, SDTT,
+ * BIT, CDT). The pids of the service are taken from its PMT, including the
+ * ECM pids, and follow version changes of the PAT and the PMT. The PAT is
+ * replaced by one which lists the service only. 0 passes the whole stream.
+ */
+
+#define PTX_SET_SERVICE		_IOW(0x8d, 0x14, int)
+
+// pre-roll (per device, reset on the last close)
+
+/*
+ * PTX_SET_PREROLL(msecs) starts capturing right away, without a streaming
+ * reader, and keeps capturing after the last reader has stopped. A reader
+ * which starts streaming meanwhile receives the data of the given time in
+ * the past first, as far as it fits in the buffer (see tsdev_max_packets).
+ * The buffer drops the oldest data as long as nobody reads it, unless
+ * another overflow policy has been chosen. 0 ends the pre-roll.
+ */
+
+#define PTX_SET_PREROLL		_IOW(0x8d, 0x15, __u32)
+
+// aggregated stream (per device, one at a time)
+
+/*
+ * PTX_OPEN_GROUP_STREAM returns a new file descriptor which reads the
+ * packets of every streaming tuner of the device, in records of
+ * PTX_GROUP_PACKET_SIZE bytes: the index of the tuner in the device, three
+ * reserved bytes (0), then the 188-byte TS packet as received. The tuners
+ * are still tuned and started through their own file descriptors.
+ */
+
+#define PTX_GROUP_PACKET_SIZE	192
+#define PTX_OPEN_GROUP_STREAM	_IO(0x8d, 0x16)
+
+// buffer queue (per device, one reader at a time)
+
+/*
+ * PTX_QBUF hands a buffer of the application to the driver, which fills it
+ * with whole packets (192 bytes with timestamps, 188 bytes otherwise) in the
+ * order the buffers were queued. PTX_DQBUF returns the next filled buffer,
+ * blocking unless the file is non-blocking. The first reader to queue a
+ * buffer owns the queue until it is closed; the buffers it still has queued
+ * are given back then. The data doesn't go through the read buffer while the
+ * owner is the only reader. A buffer stays pinned after PTX_DQBUF and is
+ * reused when the same addr and length are queued again, until the owner is
+ * closed, so it must not be unmapped while it may still be queued.
+ */
+
+#define PTX_BUF_FLAG_DROPPED	0x00000001	// data lost before this buffer
+
+struct ptx_buffer {
+	__u64 addr;		// in: user address
+	__u32 length;		// in: bytes
+	__u32 index;		// in: returned as is
+	__u32 bytesused;	// out
+	__u32 flags;		// out: PTX_BUF_FLAG_*
+	__u64 timestamp;	// out: ns (CLOCK_MONOTONIC), of the first packet
+};
+
+#define PTX_QBUF		_IOW(0x8d, 0x17, struct ptx_buffer)
+#define PTX_DQBUF		_IOWR(0x8d, 0x18, struct ptx_buffer)
+
+// packet filter program (per device, reset on the last close)
+
+/*
+ * PTX_SET_PACKET_FILTER sets a classic BPF program (struct sock_filter of
+ * <linux/filter.h>) which is run on each 188-byte packet, after the pid
+ * filters and the service extraction. It returns 0 to drop the packet. The
+ * scratch memory (M[]) only lives for one packet, and a word has to be
+ * stored on every path before it is loaded, as for the socket filters.
+ * "ld [PTX_PACKET_FILTER_LD_TIME]" loads the arrival time in ms. Only
+ * forward jumps within the program are allowed. It can be
+ * changed while streaming, from the next block of packets on. A len of 0
+ * removes the program.
+ */
+
+#define PTX_PACKET_FILTER_MAX_INSNS	256
+#define PTX_PACKET_FILTER_LD_TIME	0xfffff000
+
+struct ptx_packet_filter {
+	__u32 len;			// instructions
+	struct sock_filter *filter;
+};
+
+#define PTX_SET_PACKET_FILTER	_IOW(0x8d, 0x19, struct ptx_packet_filter)
+
+// pid traffic (per device, enabled through the pid_stats attribute)
+
+/*
+ * PTX_GET_PID_STATS copies the number of packets received on each pid since
+ * the last reset to packets[PTX_PID_STATS_NUM], counted as the packets come
+ * in, before any filter of the driver. PTX_PID_STATS_RESET starts over right
+ * after the read, without losing any packet in between. -ENODATA while the
+ * counting is disabled.
+ */
+
+#define PTX_PID_STATS_NUM	0x2000
+#define PTX_PID_STATS_RESET	0x00000001
+
+struct ptx_pid_stats {
+	__u32 flags;			// in: PTX_PID_STATS_*
+	__u32 reserved;
+	__u64 elapsed;			// out: ns since the last reset
+	__u64 *packets;			// in: PTX_PID_STATS_NUM entries
+};
+
+#define PTX_GET_PID_STATS	_IOWR(0x8d, 0x1a, struct ptx_pid_stats)
+
+// EPG capture (per open file, reset on open)
+
+/*
+ * PTX_SET_EPG_MODE(1) sets the pid filter of the file to the SI of the EPG:
+ * PAT, NIT, SDT/BAT, EIT (0x12, 0x26, 0x27) and TDT/TOT. The hardware of
+ * each input filters them where it can, so that nothing else goes over the
+ * bus. It replaces the filter of PTXT_SET_PID_FILTER, 0 removes it.
+ */
+
+#define PTX_SET_EPG_MODE	_IOW(0x8d, 0x1b, int)
+
+// tune priority and cancellation
+
+/*
+ * PTX_SET_TUNE_PRIORITY sets the priority of the tunes of the open file,
+ * PTX_TUNE_PRIORITY_NORMAL by default. A tune which has to wait for the
+ * tuner cancels a synchronous tune or scan of a lower priority in progress
+ * at its next lock poll, and a tune of a lower priority returns -EBUSY at
+ * once while one of a higher priority is waiting.
+ * PTX_CANCEL_TUNE, from any file of the tuner, cancels the tune in progress.
+ * A cancelled PTX_SET_CHANNEL, PTXT_TUNE or PTXT_SCAN returns -EINTR, and an
+ * asynchronous tune reports -ECANCELED through PTX_GET_TUNE_STATUS.
+ */
+
+enum ptx_tune_priority {
+	PTX_TUNE_PRIORITY_LOW = 0,	// background scans
+	PTX_TUNE_PRIORITY_NORMAL,
+	PTX_TUNE_PRIORITY_HIGH		// scheduled recordings
+};
+
+#define PTX_SET_TUNE_PRIORITY	_IOW(0x8d, 0x1c, int)
+#define PTX_CANCEL_TUNE		_IO(0x8d, 0x1d)
+
 // extended ioctls
 
 struct ptxt_cap {
@@ -40,17 +279,53 @@ struct ptxt_cap {
 	enum ptx_stream_type streams;
 };
 
+/*
+ * The bus fields describe the USB device the tuner belongs to, and are
+ * shared by all tuners of it. bus_bandwidth is the bulk bandwidth currently
+ * used by streaming of all of those tuners, averaged over about a second.
+ */
 struct ptxt_info {
 	char name[64];
 	struct ptxt_cap cap;			// device capability information
+	char bus_path[32];			// USB port path (e.g. "3-1.2"), empty: unknown
+	__u32 bus_number;			// 0: unknown
+	__u32 bus_speed;			// Mbit/s, 0: unknown
+	__u32 bus_bandwidth;			// bytes per second
 };
 
 enum ptxt_param_code {
 	PTXT_UNDEFINED_PARAM = 0,
 	PTXT_BANDWIDTH_PARAM = 1,
-	PTXT_STREAM_ID_PARAM = 16
+	PTXT_LAYER_PARAM = 2,			// enum ptxt_layer, ISDB-T
+	PTXT_STREAM_ID_PARAM = 16,
+	PTXT_TIMESTAMP_PARAM = 32		// enum ptxt_timestamp_mode
+};
+
+/*
+ * PTXT_TIMESTAMP_M2TS prefixes each 188-byte packet with a 4-byte big-endian
+ * header as in BDAV MPEG-2 TS (M2TS): the lower 30 bits are the arrival time
+ * of the packet in 27MHz units. The time is taken once per USB transfer and
+ * interpolated for the packets in it.
+ * It can only be changed while not streaming and is reset on the first open.
+ */
+enum ptxt_timestamp_mode {
+	PTXT_TIMESTAMP_NONE = 0,
+	PTXT_TIMESTAMP_M2TS = 1
+};
+
+/*
+ * PTXT_LAYER_A passes the partial reception service (1seg) of layer A only,
+ * the service of the PMT on 0x1fc8-0x1fcf, as PTX_SET_SERVICE does. It
+ * replaces the service set by PTX_SET_SERVICE. The other layers can't be
+ * selected on their own.
+ */
+enum ptxt_layer {
+	PTXT_LAYER_ALL = 0,
+	PTXT_LAYER_A = 1
 };
 
+#define PTXT_MAX_PARAMS		16
+
 struct ptxt_additional_param {
 	enum ptxt_param_code prop;
 	__u32 data;
@@ -66,12 +341,24 @@ struct ptxt_params {
 enum ptxt_stat_code {
 	PTXT_UNKNOWN_STAT = 0,
 	PTXT_SIGNAL_STRENGTH_STAT,
-	PTXT_CNR_STAT
+	PTXT_CNR_STAT,				// 0.01 dB
+	PTXT_CNR_RAW_STAT,			// as PTX_GET_CNR
+	PTXT_LOCK_STAT,				// 1: locked
+	PTXT_TSID_STAT				// ISDB-S, of the current stream
 };
 
+/*
+ * PTXT_READ_STATS reads all requested stats from the device at once. A value
+ * read within the last stats_cache_time msecs (sysfs, per tuner) is returned
+ * again without accessing the device, timestamp tells when it was read.
+ * PTXT_READ_STATS and PTX_GET_CNR never wait behind a tune in progress: the
+ * stats last read are returned then, or -EAGAIN if there are none (they
+ * are forgotten when a tune starts).
+ */
 struct ptxt_stat {
-	enum ptxt_stat_code stat;
-	__u32 value;
+	enum ptxt_stat_code stat;		// in
+	__u32 value;				// out
+	__u64 timestamp;			// out, ns, CLOCK_MONOTONIC
 };
 
 struct ptxt_stats {
@@ -88,4 +375,64 @@ struct ptxt_stats {
 #define PTXT_SET_CAPTURE	_IOW(0xe7, 0x06, bool)
 #define PTXT_READ_STATS		_IOR(0xe7, 0x07, struct ptxt_stats *)
 
+/*
+ * PTXT_TUNE tunes to the parameters set by PTXT_SET_PARAMS and waits for
+ * lock like PTX_SET_CHANNEL. PTXT_TUNE_AND_START returns as soon as the tuner
+ * has been programmed like PTX_SET_CHANNEL_ASYNC, and starts streaming for
+ * the calling file once locked, so that the data can be read without
+ * another call. The result is reported the same way as the asynchronous
+ * tuning, and streaming is not started if it fails.
+ * PTXT_SET_LNB_VOLTAGE takes 0, 11 or 15 (V), PTXT_SET_CAPTURE enables or
+ * disables streaming like PTX_START/STOP_STREAMING. PTXT_READ_STATS takes up
+ * to PTXT_MAX_PARAMS entries.
+ */
+
+#define PTXT_PID_FILTER_MAX	64
+
+/*
+ * The filter is set per open file. The readers of a tuner share its stream,
+ * so each of them receives the pids requested by all of them, and nothing is
+ * filtered while any of them has not set a filter. The device filters in
+ * hardware where possible, up to PTXT_PID_FILTER_MAX pids in total, and the
+ * driver in software beyond that.
+ */
+
+struct ptxt_pid_filter {
+	__u32 num;				// 0: disable filter
+	__u16 pid[PTXT_PID_FILTER_MAX];		// pids to pass
+};
+
+#define PTXT_SET_PID_FILTER	_IOW(0xe7, 0x08, struct ptxt_pid_filter)
+
+#define PTXT_SCAN_MAX_ENTRY	256
+#define PTXT_SCAN_MAX_TSID	12
+
+#define PTXT_SCAN_CNR_VALID		0x00000001
+#define PTXT_SCAN_SIGNAL_STRENGTH_VALID	0x00000002
+
+struct ptxt_scan_entry {
+	// in
+	enum ptx_system_type system;
+	__u32 freq;				// ISDB-T: Hz, ISDB-S/S3: kHz
+	__u32 bandwidth;			// ISDB-T: MHz, 0: 6MHz
+	__u32 stream_id;			// ISDB-S/S3
+	// out
+	__s32 status;				// 0: locked, -EAGAIN: no signal
+	__u32 flags;				// PTXT_SCAN_*_VALID
+	__u32 cnr_raw;
+	__u32 signal_strength;
+	__u32 num_tsid;				// ISDB-S/S3
+	__u16 tsid[PTXT_SCAN_MAX_TSID];
+};
+
+struct ptxt_scan {
+	__u32 num_entry;
+	__u32 timeout;				// ms per entry, 0: driver default
+	struct ptxt_scan_entry *entry;
+};
+
+#define PTXT_SCAN		_IOW(0xe7, 0x09, struct ptxt_scan)
+
+#define PTXT_TUNE_AND_START	_IO(0xe7, 0x0a)
+
 #endif
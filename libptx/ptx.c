@@ -0,0 +1,479 @@
+// ptx.c
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ptx.h"
+
+#define PTX_READ_BUF_SIZE	(188 * 1024)
+#define PTX_BOUNCE_SIZE		(192 * 4)	// packets across the end of the buffer
+
+struct ptx_tuner {
+	int fd;
+	// mapped buffer of the driver
+	uint8_t *map;
+	size_t map_size;
+	volatile struct ptx_mmap_ctrl *ctrl;
+	uint8_t *ringbuf;
+	uint8_t bounce[PTX_BOUNCE_SIZE];
+	// read() fallback
+	uint8_t *buf;
+	size_t buf_len;
+	ptx_tune_callback tune_callback;
+	void *tune_arg;
+	ptx_stream_callback stream_callback;
+	void *stream_arg;
+	uint32_t overflow_count;
+};
+
+static int ptx_ioctl(struct ptx_tuner *tuner, unsigned long cmd, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(tuner->fd, cmd, arg);
+	} while (ret == -1 && errno == EINTR);
+
+	return (ret == -1) ? -errno : ret;
+}
+
+// the control page first, to learn the size of the buffer
+static void ptx_map(struct ptx_tuner *tuner)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	void *p;
+	size_t size;
+
+	p = mmap(NULL, page, PROT_READ, MAP_SHARED, tuner->fd, 0);
+	if (p == MAP_FAILED)
+		return;
+
+	size = ((volatile struct ptx_mmap_ctrl *)p)->size;
+	munmap(p, page);
+
+	if (!size)
+		return;
+
+	size = page + ((size + page - 1) & ~(page - 1));
+
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, tuner->fd, 0);
+	if (p == MAP_FAILED)
+		return;
+
+	tuner->map = p;
+	tuner->map_size = size;
+	tuner->ctrl = p;
+	tuner->ringbuf = (uint8_t *)p + page;
+}
+
+static int ptx_init_tuner(int fd, struct ptx_tuner **tuner)
+{
+	struct ptx_tuner *t;
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -errno;
+
+	t = (struct ptx_tuner *)calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	t->fd = fd;
+
+	ptx_map(t);
+
+	if (!t->map) {
+		t->buf = (uint8_t *)malloc(PTX_READ_BUF_SIZE);
+		if (!t->buf) {
+			free(t);
+			return -ENOMEM;
+		}
+	}
+
+	*tuner = t;
+
+	return 0;
+}
+
+int ptx_open(const char *path, struct ptx_tuner **tuner)
+{
+	int ret, fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	ret = ptx_init_tuner(fd, tuner);
+	if (ret)
+		close(fd);
+
+	return ret;
+}
+
+int ptx_open_any(const char *pool_path, enum ptx_system_type system,
+		 struct ptx_tuner **tuner)
+{
+	int ret, pool;
+	struct ptx_alloc_tuner alloc;
+
+	pool = open(pool_path, O_RDWR | O_CLOEXEC);
+	if (pool == -1)
+		return -errno;
+
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.system = system;
+
+	ret = ioctl(pool, PTX_ALLOC_TUNER, &alloc);
+	ret = (ret == -1) ? -errno : 0;
+	close(pool);
+
+	if (ret)
+		return ret;
+
+	ret = ptx_init_tuner(alloc.fd, tuner);
+	if (ret)
+		close(alloc.fd);
+
+	return ret;
+}
+
+void ptx_close(struct ptx_tuner *tuner)
+{
+	if (!tuner)
+		return;
+
+	if (tuner->map)
+		munmap(tuner->map, tuner->map_size);
+
+	close(tuner->fd);
+	free(tuner->buf);
+	free(tuner);
+}
+
+int ptx_fd(const struct ptx_tuner *tuner)
+{
+	return tuner->fd;
+}
+
+int ptx_is_mapped(const struct ptx_tuner *tuner)
+{
+	return (tuner->map) ? 1 : 0;
+}
+
+int ptx_get_info(struct ptx_tuner *tuner, struct ptxt_info *info)
+{
+	return ptx_ioctl(tuner, PTXT_GET_INFO, info);
+}
+
+int ptx_channel_params(enum ptx_system_type system, int freq_no, int slot,
+		       struct ptx_tune_args *params)
+{
+	// both systems: a tuner in PTX_UNSPECIFIED_SYSTEM mode capable of both
+	int both = ((system & (PTX_ISDB_T_SYSTEM | PTX_ISDB_S_SYSTEM)) ==
+		    (PTX_ISDB_T_SYSTEM | PTX_ISDB_S_SYSTEM));
+
+	if ((system & PTX_ISDB_S_SYSTEM) && freq_no >= 0 && freq_no < 24) {
+		params->system = PTX_ISDB_S_SYSTEM;
+		params->freq = (freq_no < 12) ? 1049480 + (38360 * freq_no)	// BS
+					      : 1613000 + (40000 * (freq_no - 12));	// CS
+		params->stream_id = slot;
+		return 0;
+	}
+
+	if (!(system & PTX_ISDB_T_SYSTEM) || (system & PTX_ISDB_S_SYSTEM && !both))
+		return -EINVAL;
+
+	params->system = PTX_ISDB_T_SYSTEM;
+	params->stream_id = 0;
+
+	if ((!both && ((freq_no >= 3 && freq_no <= 12) || (freq_no >= 22 && freq_no <= 62))) ||
+	    (both && freq_no >= 24 && freq_no <= 62)) {
+		// CATV
+		params->freq = 93143 + freq_no * 6000 + slot;
+
+		if (freq_no == 12)
+			params->freq += 2000;
+	} else if (freq_no >= 63 && freq_no <= 112) {
+		// UHF 13-62ch
+		params->freq = 95143 + freq_no * 6000 + slot;
+	} else {
+		return -EINVAL;
+	}
+
+	params->freq *= 1000;
+
+	return 0;
+}
+
+static int ptx_set_params(struct ptx_tuner *tuner, const struct ptx_tune_args *params)
+{
+	struct ptxt_params p;
+	struct ptxt_additional_param prop[1];
+
+	memset(&p, 0, sizeof(p));
+	p.system = params->system;
+	p.freq = params->freq;
+	p.prop = prop;
+
+	if (params->system == PTX_ISDB_S_SYSTEM) {
+		prop[p.num_prop].prop = PTXT_STREAM_ID_PARAM;
+		prop[p.num_prop++].data = params->stream_id;
+	} else if (params->layer) {
+		prop[p.num_prop].prop = PTXT_LAYER_PARAM;
+		prop[p.num_prop++].data = params->layer;
+	}
+
+	return ptx_ioctl(tuner, PTXT_SET_PARAMS, &p);
+}
+
+int ptx_tune(struct ptx_tuner *tuner, const struct ptx_tune_args *params)
+{
+	int ret;
+
+	ret = ptx_set_params(tuner, params);
+	if (ret)
+		return ret;
+
+	return ptx_ioctl(tuner, PTXT_TUNE, NULL);
+}
+
+int ptx_tune_async(struct ptx_tuner *tuner, const struct ptx_tune_args *params,
+		   ptx_tune_callback callback, void *arg)
+{
+	int ret;
+
+	ret = ptx_set_params(tuner, params);
+	if (ret)
+		return ret;
+
+	ret = ptx_ioctl(tuner, PTXT_TUNE_AND_START, NULL);
+	if (ret)
+		return ret;
+
+	tuner->tune_callback = callback;
+	tuner->tune_arg = arg;
+
+	return 0;
+}
+
+int ptx_set_stream_callback(struct ptx_tuner *tuner, ptx_stream_callback callback,
+			    void *arg)
+{
+	tuner->stream_callback = callback;
+	tuner->stream_arg = arg;
+
+	return 0;
+}
+
+int ptx_start(struct ptx_tuner *tuner)
+{
+	tuner->buf_len = 0;
+
+	return ptx_ioctl(tuner, PTX_START_STREAMING, NULL);
+}
+
+int ptx_stop(struct ptx_tuner *tuner)
+{
+	return ptx_ioctl(tuner, PTX_STOP_STREAMING, NULL);
+}
+
+/*
+ * In place: the readable bytes start at head, up to the end of the buffer.
+ * What the callback leaves at the end of the buffer (a packet split by the
+ * wrap around) is passed again in the bounce buffer, joined to the start.
+ */
+static int ptx_process_mapped(struct ptx_tuner *tuner)
+{
+	volatile struct ptx_mmap_ctrl *ctrl = tuner->ctrl;
+
+	while (1) {
+		uint32_t size, head, avail, len, consumed;
+		long ret;
+		int r, more;
+
+		size = ctrl->size;
+		head = ctrl->head;
+		avail = __atomic_load_n(&ctrl->write_count, __ATOMIC_ACQUIRE) - ctrl->read_count;
+
+		if (!avail)
+			return 0;
+
+		len = (avail > size - head) ? size - head : avail;
+
+		ret = tuner->stream_callback(tuner, tuner->ringbuf + head, len, tuner->stream_arg);
+		if (ret < 0)
+			return (int)ret;
+
+		if ((uint32_t)ret > len)
+			ret = len;
+
+		consumed = (uint32_t)ret;
+		more = (consumed == len);
+
+		if (!more && len < avail && len - consumed < PTX_BOUNCE_SIZE) {
+			uint32_t rest = len - consumed;
+			uint32_t n = PTX_BOUNCE_SIZE - rest;
+
+			if (n > avail - len)
+				n = avail - len;
+
+			memcpy(tuner->bounce, tuner->ringbuf + head + consumed, rest);
+			memcpy(tuner->bounce + rest, tuner->ringbuf, n);
+
+			ret = tuner->stream_callback(tuner, tuner->bounce, rest + n, tuner->stream_arg);
+			if (ret < 0)
+				return (int)ret;
+
+			if ((uint32_t)ret > rest + n)
+				ret = rest + n;
+
+			consumed += (uint32_t)ret;
+
+			// past the wrap around, go on in place
+			more = (consumed > len);
+		}
+
+		r = ptx_ioctl(tuner, PTX_ADVANCE_READ_POINTER, &consumed);
+		if (r == -EAGAIN)
+			return 0;
+		else if (r)
+			return r;
+
+		// otherwise the callback waits for more data
+		if (!more)
+			return 0;
+	}
+}
+
+static int ptx_process_read(struct ptx_tuner *tuner)
+{
+	while (1) {
+		ssize_t n;
+		long ret;
+
+		n = read(tuner->fd, tuner->buf + tuner->buf_len, PTX_READ_BUF_SIZE - tuner->buf_len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (errno == EAGAIN) ? 0 : -errno;
+		}
+
+		if (!n)
+			return 0;
+
+		tuner->buf_len += n;
+
+		ret = tuner->stream_callback(tuner, tuner->buf, tuner->buf_len, tuner->stream_arg);
+		if (ret < 0)
+			return (int)ret;
+
+		if ((size_t)ret > tuner->buf_len)
+			ret = tuner->buf_len;
+
+		tuner->buf_len -= ret;
+		memmove(tuner->buf, tuner->buf + ret, tuner->buf_len);
+	}
+}
+
+int ptx_process(struct ptx_tuner *tuner, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = tuner->fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+
+	// never wake up for data which nobody takes
+	if (tuner->stream_callback)
+		pfd.events |= POLLIN;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret == -1)
+		return (errno == EINTR) ? 0 : -errno;
+
+	if (!ret)
+		return -ETIMEDOUT;
+
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -EIO;
+
+	if (pfd.revents & POLLPRI) {
+		uint32_t count = 0;
+
+		// clears the overflow event
+		if (!ptx_ioctl(tuner, PTX_GET_OVERFLOW_COUNT, &count))
+			tuner->overflow_count += count;
+
+		if (tuner->tune_callback) {
+			ptx_tune_callback callback = tuner->tune_callback;
+
+			ret = ptx_ioctl(tuner, PTX_GET_TUNE_STATUS, NULL);
+			if (ret != -EINPROGRESS) {
+				tuner->tune_callback = NULL;
+				callback(tuner, ret, tuner->tune_arg);
+			}
+		} else {
+			// clears the tune event
+			ptx_ioctl(tuner, PTX_GET_TUNE_STATUS, NULL);
+		}
+	}
+
+	if ((pfd.revents & POLLIN) && tuner->stream_callback)
+		return (tuner->map) ? ptx_process_mapped(tuner) : ptx_process_read(tuner);
+
+	return 0;
+}
+
+uint32_t ptx_overflow_count(const struct ptx_tuner *tuner)
+{
+	return tuner->overflow_count;
+}
+
+int ptx_read_stat(struct ptx_tuner *tuner, enum ptxt_stat_code stat, uint32_t *value)
+{
+	int ret;
+	struct ptxt_stat s;
+	struct ptxt_stats stats;
+
+	memset(&s, 0, sizeof(s));
+	s.stat = stat;
+	stats.num_stat = 1;
+	stats.stat = &s;
+
+	ret = ptx_ioctl(tuner, PTXT_READ_STATS, &stats);
+	if (!ret)
+		*value = s.value;
+
+	return ret;
+}
+
+int ptx_set_lnb_voltage(struct ptx_tuner *tuner, int voltage)
+{
+	return ptx_ioctl(tuner, PTXT_SET_LNB_VOLTAGE, (void *)(long)voltage);
+}
+
+int ptx_set_epg_mode(struct ptx_tuner *tuner, int enable)
+{
+	return ptx_ioctl(tuner, PTX_SET_EPG_MODE, (void *)(long)!!enable);
+}
+
+int ptx_set_tune_priority(struct ptx_tuner *tuner, int priority)
+{
+	return ptx_ioctl(tuner, PTX_SET_TUNE_PRIORITY, (void *)(long)priority);
+}
+
+int ptx_cancel_tune(struct ptx_tuner *tuner)
+{
+	return ptx_ioctl(tuner, PTX_CANCEL_TUNE, NULL);
+}
@@ -0,0 +1,81 @@
+// ptx.h
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ptx_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libptx: a thin wrapper of the ioctls in ptx_ioctl.h.
+ * All functions return 0 or a negative errno value.
+ *
+ * A tuner is opened non-blocking. ptx_process() waits for the file with
+ * poll() and dispatches the tune result and the stream data to the
+ * callbacks, or it can be driven by an event loop of the application
+ * watching ptx_fd() for POLLIN and POLLPRI.
+ * The stream is passed to the callback in place in the mapped buffer of
+ * the driver, or from read() into a buffer of the library if the buffer
+ * can't be mapped.
+ */
+
+struct ptx_tuner;
+
+struct ptx_tune_args {
+	enum ptx_system_type system;
+	uint32_t freq;		// ISDB-T: Hz, ISDB-S/S3: kHz
+	uint32_t stream_id;	// ISDB-S/S3
+	uint32_t layer;		// ISDB-T, enum ptxt_layer
+};
+
+// result: 0 when locked, or the error PTXT_TUNE would have returned
+typedef void (*ptx_tune_callback)(struct ptx_tuner *tuner, int result, void *arg);
+// returns the number of bytes consumed (the rest is passed again), < 0 to stop
+typedef long (*ptx_stream_callback)(struct ptx_tuner *tuner, const uint8_t *data,
+				    size_t len, void *arg);
+
+int ptx_open(const char *path, struct ptx_tuner **tuner);
+// picks a free tuner through the pool node (/dev/<name>video-any)
+int ptx_open_any(const char *pool_path, enum ptx_system_type system,
+		 struct ptx_tuner **tuner);
+void ptx_close(struct ptx_tuner *tuner);
+
+int ptx_fd(const struct ptx_tuner *tuner);
+int ptx_is_mapped(const struct ptx_tuner *tuner);
+int ptx_get_info(struct ptx_tuner *tuner, struct ptxt_info *info);
+
+// the channel numbers of PTX_SET_CHANNEL, as the driver interprets them
+int ptx_channel_params(enum ptx_system_type system_cap, int freq_no, int slot,
+		       struct ptx_tune_args *params);
+
+int ptx_tune(struct ptx_tuner *tuner, const struct ptx_tune_args *params);
+// returns once programmed, streaming starts on lock and callback is called
+int ptx_tune_async(struct ptx_tuner *tuner, const struct ptx_tune_args *params,
+		   ptx_tune_callback callback, void *arg);
+
+int ptx_set_stream_callback(struct ptx_tuner *tuner, ptx_stream_callback callback,
+			    void *arg);
+int ptx_start(struct ptx_tuner *tuner);
+int ptx_stop(struct ptx_tuner *tuner);
+
+// timeout: msecs, -1: infinite. returns -ETIMEDOUT if nothing happened
+int ptx_process(struct ptx_tuner *tuner, int timeout);
+
+uint32_t ptx_overflow_count(const struct ptx_tuner *tuner);
+int ptx_read_stat(struct ptx_tuner *tuner, enum ptxt_stat_code stat, uint32_t *value);
+int ptx_set_lnb_voltage(struct ptx_tuner *tuner, int voltage);
+// passes the SI of the EPG only
+int ptx_set_epg_mode(struct ptx_tuner *tuner, int enable);
+// PTX_TUNE_PRIORITY_*, of the following tunes
+int ptx_set_tune_priority(struct ptx_tuner *tuner, int priority);
+// may be called from another thread, the tune in progress returns -EINTR
+int ptx_cancel_tune(struct ptx_tuner *tuner);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,345 @@
+// ptxbench.c
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "ptx.h"
+
+#define MAX_DEVICES		16
+#define MAX_CHANNELS		256
+
+// the files in tune_timing/ of the driver, in the order of the phases
+static const char *const phase_names[] = {
+	"open",
+	"queue",
+	"pll",
+	"program",
+	"lock",
+	"stream_id",
+	"first_packet",
+};
+
+#define NUM_PHASES	(sizeof(phase_names) / sizeof(phase_names[0]))
+
+struct channel {
+	const char *name;
+	struct ptx_tune_args params;
+};
+
+struct device {
+	const char *path;
+	char sysfs[64];		// /sys/dev/char/<major>:<minor>, empty if unknown
+	struct ptx_tuner *tuner;
+};
+
+struct round {
+	double start;
+	double tuned;		// 0: not yet
+	double first_byte;	// 0: not yet
+	int result;
+	int done;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_us(double secs)
+{
+	if (secs > 0)
+		printf(",%.0f", secs * 1e6);
+	else
+		printf(",");
+}
+
+static void on_tune(struct ptx_tuner *tuner, int result, void *arg)
+{
+	struct round *r = arg;
+
+	r->result = result;
+	r->tuned = now();
+
+	if (result)
+		r->done = 1;
+}
+
+static long on_stream(struct ptx_tuner *tuner, const uint8_t *data, size_t len, void *arg)
+{
+	struct round *r = arg;
+
+	if (len && !r->first_byte) {
+		r->first_byte = now();
+		r->done = 1;
+	}
+
+	return len;
+}
+
+static void find_sysfs(struct device *dev)
+{
+	struct stat st;
+
+	dev->sysfs[0] = '\0';
+
+	if (stat(dev->path, &st) || !S_ISCHR(st.st_mode))
+		return;
+
+	snprintf(dev->sysfs, sizeof(dev->sysfs), "/sys/dev/char/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+}
+
+// empty if the phase was not reached, or the driver has no tune_timing/
+static void print_phase(const struct device *dev, const char *name)
+{
+	char path[128], buf[32];
+	FILE *fp;
+
+	if (!dev->sysfs[0]) {
+		printf(",");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/tune_timing/%s", dev->sysfs, name);
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		printf(",");
+		return;
+	}
+
+	if (fgets(buf, sizeof(buf), fp))
+		printf(",%lu", strtoul(buf, NULL, 10));
+	else
+		printf(",");
+
+	fclose(fp);
+}
+
+static int parse_channel(const char *s, enum ptx_system_type system, int freq_mode,
+			 struct channel *ch)
+{
+	int n, sub = 0;
+
+	if (sscanf(s, "%d:%i", &n, &sub) < 1 || n < 0)
+		return -1;
+
+	ch->name = s;
+
+	if (freq_mode) {
+		ch->params.system = system;
+		ch->params.freq = n;
+		ch->params.stream_id = sub;
+		return 0;
+	}
+
+	return (ptx_channel_params(system, n, sub, &ch->params)) ? -1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ptxbench [options] -d <device> [-d <device>...] <ch>[:<slot>]...\n"
+		"  -d <device>  tuner device, can be given more than once\n"
+		"  -S           ISDB-S (default: ISDB-T)\n"
+		"  -f           the channels are <freq>[:<stream id>] (ISDB-T: Hz, ISDB-S: kHz)\n"
+		"  -n <rounds>  repeat the channel list (default: 1)\n"
+		"  -k           keep the tuner open between the channels\n"
+		"  -w <msecs>   time limit of a tune until the first byte (default: 10000)\n"
+		"  -H           no CSV header\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, opt, i, j, k, rounds = 1, keep_open = 0, freq_mode = 0, header = 1;
+	int timeout = 10000, num_devices = 0, num_channels = 0, failed = 0;
+	enum ptx_system_type system = PTX_ISDB_T_SYSTEM;
+	const char *device_paths[MAX_DEVICES];
+	struct device devices[MAX_DEVICES];
+	struct channel *channels;
+
+	while ((opt = getopt(argc, argv, "d:Sfn:kw:H")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (num_devices == MAX_DEVICES) {
+				fprintf(stderr, "Too many devices.\n");
+				return 1;
+			}
+
+			device_paths[num_devices++] = optarg;
+			break;
+
+		case 'S':
+			system = PTX_ISDB_S_SYSTEM;
+			break;
+
+		case 'f':
+			freq_mode = 1;
+			break;
+
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+
+		case 'k':
+			keep_open = 1;
+			break;
+
+		case 'w':
+			timeout = atoi(optarg);
+			break;
+
+		case 'H':
+			header = 0;
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!num_devices || optind >= argc || rounds < 1) {
+		usage();
+		return 1;
+	}
+
+	if (argc - optind > MAX_CHANNELS) {
+		fprintf(stderr, "Too many channels.\n");
+		return 1;
+	}
+
+	channels = calloc(argc - optind, sizeof(*channels));
+	if (!channels) {
+		fprintf(stderr, "No enough memory.\n");
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (parse_channel(argv[i], system, freq_mode, &channels[num_channels])) {
+			fprintf(stderr, "Invalid channel '%s'.\n", argv[i]);
+			free(channels);
+			return 1;
+		}
+
+		num_channels++;
+	}
+
+	for (i = 0; i < num_devices; i++) {
+		devices[i].path = device_paths[i];
+		devices[i].tuner = NULL;
+		find_sysfs(&devices[i]);
+	}
+
+	if (header) {
+		printf("round,device,channel,system,freq,stream_id,result,open_us,tune_us,first_byte_us");
+		for (k = 0; k < NUM_PHASES; k++)
+			printf(",drv_%s_us", phase_names[k]);
+		printf("\n");
+	}
+
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < num_devices; j++) {
+			struct device *dev = &devices[j];
+
+			for (k = 0; k < num_channels; k++) {
+				const struct channel *ch = &channels[k];
+				struct round r;
+				double t, open_time = 0, deadline;
+				int p;
+
+				memset(&r, 0, sizeof(r));
+				r.start = now();
+
+				if (!dev->tuner) {
+					ret = ptx_open(dev->path, &dev->tuner);
+					if (ret) {
+						dev->tuner = NULL;
+						r.result = ret;
+						goto report;
+					}
+
+					open_time = now() - r.start;
+				}
+
+				ptx_set_stream_callback(dev->tuner, on_stream, &r);
+
+				r.start = now();
+				ret = ptx_tune_async(dev->tuner, &ch->params, on_tune, &r);
+				if (ret) {
+					r.result = ret;
+					goto stop;
+				}
+
+				deadline = r.start + timeout / 1000.0;
+
+				while (!r.done) {
+					t = now();
+					if (t >= deadline) {
+						if (!r.result)
+							r.result = -ETIMEDOUT;
+						break;
+					}
+
+					ret = ptx_process(dev->tuner, (int)((deadline - t) * 1000) + 1);
+					if (ret && ret != -ETIMEDOUT) {
+						r.result = ret;
+						break;
+					}
+				}
+
+stop:
+				ptx_stop(dev->tuner);
+
+report:
+				printf("%d,%s,%s,%s,%u,0x%x,%d", i, dev->path, ch->name,
+				       (ch->params.system == PTX_ISDB_S_SYSTEM) ? "S" : "T",
+				       ch->params.freq, ch->params.stream_id, r.result);
+				print_us(open_time);
+				print_us((r.tuned) ? r.tuned - r.start : 0);
+				print_us((r.first_byte) ? r.first_byte - r.start : 0);
+
+				for (p = 0; p < NUM_PHASES; p++) {
+					if (dev->tuner)
+						print_phase(dev, phase_names[p]);
+					else
+						printf(",");
+				}
+
+				printf("\n");
+				fflush(stdout);
+
+				if (r.result)
+					failed++;
+
+				if (dev->tuner && !keep_open) {
+					ptx_close(dev->tuner);
+					dev->tuner = NULL;
+				}
+			}
+		}
+	}
+
+	for (j = 0; j < num_devices; j++) {
+		if (devices[j].tuner)
+			ptx_close(devices[j].tuner);
+	}
+
+	free(channels);
+
+	return (failed) ? 1 : 0;
+}
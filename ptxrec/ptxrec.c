@@ -0,0 +1,393 @@
+// ptxrec.c
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "ptx.h"
+
+#define DIRECT_ALIGN		4096
+#define DEFAULT_BUF_SIZE	(4 * 1024 * 1024)
+
+struct recorder {
+	int out;
+	int direct;
+	uint8_t *buf;		// aligned, for O_DIRECT
+	size_t buf_size;
+	size_t buf_len;
+	uint64_t written;	// bytes, to the file
+	uint64_t received;	// bytes, from the tuner
+	uint64_t last_received;
+	uint32_t last_overflows;
+	double start;
+	double last_report;
+	double duration;	// secs, 0: until interrupted
+	int quiet;
+	int error;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int flush_buf(struct recorder *rec, size_t len)
+{
+	size_t ofs = 0;
+
+	while (ofs < len) {
+		ssize_t n = write(rec->out, rec->buf + ofs, len - ofs);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "write() failed. (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		ofs += n;
+	}
+
+	rec->written += len;
+
+	return 0;
+}
+
+// O_DIRECT takes whole blocks only, the tail is written through the page cache
+static int finish(struct recorder *rec)
+{
+	if (!rec->buf_len)
+		return 0;
+
+	if (rec->direct) {
+		int flags = fcntl(rec->out, F_GETFL);
+
+		if (flags == -1 || fcntl(rec->out, F_SETFL, flags & ~O_DIRECT) == -1) {
+			fprintf(stderr, "fcntl() failed. (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	if (flush_buf(rec, rec->buf_len))
+		return -1;
+
+	rec->buf_len = 0;
+
+	return 0;
+}
+
+static long on_stream(struct ptx_tuner *tuner, const uint8_t *data, size_t len, void *arg)
+{
+	struct recorder *rec = arg;
+	size_t ofs = 0;
+
+	while (ofs < len) {
+		size_t n = rec->buf_size - rec->buf_len;
+
+		if (n > len - ofs)
+			n = len - ofs;
+
+		memcpy(rec->buf + rec->buf_len, data + ofs, n);
+		rec->buf_len += n;
+		ofs += n;
+
+		if (rec->buf_len == rec->buf_size) {
+			if (flush_buf(rec, rec->buf_size)) {
+				rec->error = 1;
+				return -EIO;
+			}
+
+			rec->buf_len = 0;
+		}
+	}
+
+	rec->received += len;
+
+	return len;
+}
+
+static void on_tune(struct ptx_tuner *tuner, int result, void *arg)
+{
+	struct recorder *rec = arg;
+
+	if (result) {
+		fprintf(stderr, "Tuning failed. (%s)\n", strerror(-result));
+		rec->error = 1;
+		stop = 1;
+		return;
+	}
+
+	fprintf(stderr, "Locked after %.0f ms.\n", (now() - rec->start) * 1000);
+	rec->start = rec->last_report = now();
+}
+
+static void report(struct recorder *rec, struct ptx_tuner *tuner, double t)
+{
+	uint32_t overflows = ptx_overflow_count(tuner);
+	uint32_t cnr = 0;
+	double secs = t - rec->last_report;
+
+	if (ptx_read_stat(tuner, PTXT_CNR_STAT, &cnr))
+		cnr = 0;
+
+	fprintf(stderr, "%8.1f s: %7.2f MiB/s, %10llu bytes, %u overflows (+%u), C/N %u.%02u dB\n",
+		t - rec->start,
+		(rec->received - rec->last_received) / secs / (1024 * 1024),
+		(unsigned long long)rec->received,
+		overflows, overflows - rec->last_overflows, cnr / 100, cnr % 100);
+
+	rec->last_received = rec->received;
+	rec->last_overflows = overflows;
+	rec->last_report = t;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ptxrec [options] <output>\n"
+		"  -d <device>     tuner device (default: /dev/px4video0)\n"
+		"  -a <pool>       pick a free tuner through the pool node instead\n"
+		"  -S              ISDB-S (default: ISDB-T)\n"
+		"  -f <freq>       ISDB-T: Hz, ISDB-S: kHz\n"
+		"  -c <ch>[:<slot>] channel number of PTX_SET_CHANNEL instead of -f\n"
+		"  -i <stream id>  ISDB-S stream id (slot or TSID)\n"
+		"  -L              ISDB-T: the partial reception service (1seg) only\n"
+		"  -t <secs>       duration, 0: until interrupted (default)\n"
+		"  -b <KiB>        write size (default: 4096)\n"
+		"  -p <MiB>        preallocate the output file\n"
+		"  -e              EPG capture, the SI pids only\n"
+		"  -n              don't use O_DIRECT\n"
+		"  -q              no per-second report\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, opt, use_direct = 1, epg = 0;
+	const char *device = "/dev/px4video0", *pool = NULL, *out_path;
+	struct ptx_tune_args params;
+	int channel = -1, slot = 0;
+	unsigned long prealloc = 0;
+	struct ptx_tuner *tuner = NULL;
+	struct recorder rec;
+	struct sigaction sa;
+
+	memset(&rec, 0, sizeof(rec));
+	memset(&params, 0, sizeof(params));
+	params.system = PTX_ISDB_T_SYSTEM;
+	rec.out = -1;
+	rec.buf_size = DEFAULT_BUF_SIZE;
+
+	while ((opt = getopt(argc, argv, "d:a:Sf:c:i:Lt:b:p:enq")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+
+		case 'a':
+			pool = optarg;
+			break;
+
+		case 'S':
+			params.system = PTX_ISDB_S_SYSTEM;
+			break;
+
+		case 'f':
+			params.freq = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			if (sscanf(optarg, "%d:%d", &channel, &slot) < 1) {
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'i':
+			params.stream_id = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			params.layer = PTXT_LAYER_A;
+			break;
+
+		case 't':
+			rec.duration = strtod(optarg, NULL);
+			break;
+
+		case 'b':
+			rec.buf_size = strtoul(optarg, NULL, 10) * 1024;
+			break;
+
+		case 'p':
+			prealloc = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'e':
+			epg = 1;
+			break;
+
+		case 'n':
+			use_direct = 0;
+			break;
+
+		case 'q':
+			rec.quiet = 1;
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	out_path = argv[optind];
+
+	if (channel >= 0) {
+		ret = ptx_channel_params(params.system, channel, slot, &params);
+		if (ret) {
+			fprintf(stderr, "Invalid channel number.\n");
+			return 1;
+		}
+	}
+
+	if (!params.freq) {
+		usage();
+		return 1;
+	}
+
+	// whole blocks for O_DIRECT
+	rec.buf_size = (rec.buf_size + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+	if (!rec.buf_size)
+		rec.buf_size = DIRECT_ALIGN;
+
+	if (posix_memalign((void **)&rec.buf, DIRECT_ALIGN, rec.buf_size)) {
+		fprintf(stderr, "No enough memory.\n");
+		return 1;
+	}
+
+	rec.out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | ((use_direct) ? O_DIRECT : 0), 0644);
+	if (rec.out == -1 && use_direct && errno == EINVAL) {
+		// the file system does not support it
+		fprintf(stderr, "O_DIRECT is not supported, writing through the page cache.\n");
+		use_direct = 0;
+		rec.out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (rec.out == -1) {
+		fprintf(stderr, "Couldn't open file '%s' to write. (%s)\n", out_path, strerror(errno));
+		goto fail;
+	}
+
+	rec.direct = use_direct;
+
+	if (prealloc) {
+		// keeps the file size at 0, only reserves the blocks
+		ret = fallocate(rec.out, FALLOC_FL_KEEP_SIZE, 0, (off_t)prealloc * 1024 * 1024);
+		if (ret == -1)
+			fprintf(stderr, "fallocate() failed. (%s)\n", strerror(errno));
+	}
+
+	ret = (pool) ? ptx_open_any(pool, params.system, &tuner) : ptx_open(device, &tuner);
+	if (ret) {
+		fprintf(stderr, "Couldn't open the tuner. (%s)\n", strerror(-ret));
+		goto fail;
+	}
+
+	fprintf(stderr, "Stream access: %s\n", (ptx_is_mapped(tuner)) ? "mmap" : "read");
+	fprintf(stderr, "Output: %s%s\n", out_path, (rec.direct) ? " (O_DIRECT)" : "");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (epg) {
+		ret = ptx_set_epg_mode(tuner, 1);
+		if (ret) {
+			fprintf(stderr, "Couldn't set the EPG mode. (%s)\n", strerror(-ret));
+			goto fail;
+		}
+	}
+
+	ptx_set_stream_callback(tuner, on_stream, &rec);
+
+	rec.start = rec.last_report = now();
+
+	ret = ptx_tune_async(tuner, &params, on_tune, &rec);
+	if (ret) {
+		fprintf(stderr, "Tuning failed. (%s)\n", strerror(-ret));
+		goto fail;
+	}
+
+	while (!stop) {
+		double t;
+
+		ret = ptx_process(tuner, 100);
+		if (ret && ret != -ETIMEDOUT) {
+			if (!rec.error)
+				fprintf(stderr, "ptx_process() failed. (%s)\n", strerror(-ret));
+			rec.error = 1;
+			break;
+		}
+
+		t = now();
+
+		if (!rec.quiet && t - rec.last_report >= 1.0)
+			report(&rec, tuner, t);
+
+		if (rec.duration > 0 && t - rec.start >= rec.duration)
+			break;
+	}
+
+	ptx_stop(tuner);
+
+	if (finish(&rec))
+		rec.error = 1;
+
+	fprintf(stderr, "Total: %llu bytes in %.1f s, %u overflows\n",
+		(unsigned long long)rec.written, now() - rec.start,
+		ptx_overflow_count(tuner));
+
+	ptx_close(tuner);
+	close(rec.out);
+	free(rec.buf);
+
+	return (rec.error) ? 1 : 0;
+
+fail:
+	if (tuner)
+		ptx_close(tuner);
+
+	if (rec.out != -1)
+		close(rec.out);
+
+	free(rec.buf);
+
+	return 1;
+}
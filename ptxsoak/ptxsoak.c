@@ -0,0 +1,539 @@
+// ptxsoak.c
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "ptx.h"
+
+#define MAX_TUNERS	64
+#define HIST_BUCKETS	21	// as latency_hist.h of the driver
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+};
+
+struct tuner {
+	const char *spec;
+	const char *path;
+	char sysfs[64];		// /sys/dev/char/<major>:<minor>
+	struct ptx_tuner *t;
+	struct ptxt_info info;
+	struct ptx_tune_args params;
+	int locked;
+	int failed;
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t sync_errors;	// bytes skipped to find the sync byte
+	uint64_t cc_errors;
+	uint8_t cc[0x2000];	// last counter, 0xff: unknown
+	uint64_t last_bytes;
+	uint64_t last_cc_errors;
+	uint64_t start_overflow;	// statistics/ of the driver, at the start
+	uint64_t start_cc_errors;
+	struct hist start_wakeup;
+	struct hist start_urb;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void find_sysfs(struct tuner *tn)
+{
+	struct stat st;
+
+	tn->sysfs[0] = '\0';
+
+	if (stat(tn->path, &st) || !S_ISCHR(st.st_mode))
+		return;
+
+	snprintf(tn->sysfs, sizeof(tn->sysfs), "/sys/dev/char/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+}
+
+static int read_sysfs(const struct tuner *tn, const char *name, char *buf, size_t size)
+{
+	char path[128];
+	FILE *fp;
+	int ret = -1;
+
+	if (!tn->sysfs[0])
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/statistics/%s", tn->sysfs, name);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	if (fgets(buf, size, fp))
+		ret = 0;
+
+	fclose(fp);
+
+	return ret;
+}
+
+static uint64_t read_counter(const struct tuner *tn, const char *name)
+{
+	char buf[32];
+
+	if (read_sysfs(tn, name, buf, sizeof(buf)))
+		return 0;
+
+	return strtoull(buf, NULL, 10);
+}
+
+static void read_hist(const struct tuner *tn, const char *name, struct hist *h)
+{
+	char buf[512], *p = buf, *end;
+	int i;
+
+	memset(h, 0, sizeof(*h));
+
+	if (read_sysfs(tn, name, buf, sizeof(buf)))
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		h->count[i] = strtoull(p, &end, 10);
+		if (end == p)
+			break;
+		p = end;
+	}
+}
+
+static void sub_hist(struct hist *h, const struct hist *base)
+{
+	int i;
+
+	// the driver counters are 32-bit
+	for (i = 0; i < HIST_BUCKETS; i++)
+		h->count[i] = (uint32_t)(h->count[i] - base->count[i]);
+}
+
+// upper bound of the bucket holding the percentile, in usecs, 0: empty
+static uint64_t hist_percentile(const struct hist *h, double percent)
+{
+	uint64_t total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->count[i];
+
+	if (!total)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum * 100.0 >= total * percent)
+			break;
+	}
+
+	return (i < HIST_BUCKETS) ? (1ULL << i) : (1ULL << (HIST_BUCKETS - 1));
+}
+
+static void print_hist(const char *name, const struct hist *h)
+{
+	int i, last = -1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (h->count[i])
+			last = i;
+	}
+
+	if (last < 0) {
+		printf("  %s: no samples\n", name);
+		return;
+	}
+
+	printf("  %s: p50 < %lluus, p99 < %lluus, p99.9 < %lluus, max < %lluus%s\n",
+	       name,
+	       (unsigned long long)hist_percentile(h, 50),
+	       (unsigned long long)hist_percentile(h, 99),
+	       (unsigned long long)hist_percentile(h, 99.9),
+	       1ULL << last, (last == HIST_BUCKETS - 1) ? " (or more)" : "");
+}
+
+static void check_packet(struct tuner *tn, const uint8_t *p)
+{
+	unsigned int pid = ((p[1] & 0x1f) << 8) | p[2];
+	unsigned int afc = (p[3] >> 4) & 0x3, cc = p[3] & 0xf;
+
+	tn->packets++;
+
+	if (pid == 0x1fff || (p[1] & 0x80))
+		return;
+
+	// discontinuity_indicator
+	if ((afc & 0x2) && p[4] && (p[5] & 0x80))
+		tn->cc[pid] = 0xff;
+
+	if (!(afc & 0x1))
+		return;
+
+	// a duplicate packet is allowed once, it is not counted
+	if (tn->cc[pid] != 0xff && cc != tn->cc[pid] && cc != ((tn->cc[pid] + 1) & 0xf))
+		tn->cc_errors++;
+
+	tn->cc[pid] = cc;
+}
+
+static long on_stream(struct ptx_tuner *t, const uint8_t *data, size_t len, void *arg)
+{
+	struct tuner *tn = arg;
+	size_t ofs = 0;
+
+	while (len - ofs >= 188) {
+		if (data[ofs] != 0x47) {
+			tn->sync_errors++;
+			ofs++;
+			continue;
+		}
+
+		check_packet(tn, data + ofs);
+		ofs += 188;
+	}
+
+	tn->bytes += ofs;
+
+	// a partial packet at the end is passed again
+	return ofs;
+}
+
+static void on_tune(struct ptx_tuner *t, int result, void *arg)
+{
+	struct tuner *tn = arg;
+
+	if (result) {
+		fprintf(stderr, "%s: tuning failed. (%s)\n", tn->spec, strerror(-result));
+		tn->failed = 1;
+		return;
+	}
+
+	tn->locked = 1;
+}
+
+static int setup_tuner(struct tuner *tn, char *spec)
+{
+	char *ch;
+	int n, slot = 0, ret;
+
+	tn->spec = strdup(spec);
+	memset(tn->cc, 0xff, sizeof(tn->cc));
+
+	ch = strchr(spec, '@');
+	if (!ch || sscanf(ch + 1, "%d:%i", &n, &slot) < 1) {
+		fprintf(stderr, "Invalid tuner '%s'.\n", spec);
+		return -1;
+	}
+
+	*ch = '\0';
+	tn->path = spec;
+	find_sysfs(tn);
+
+	ret = ptx_open(tn->path, &tn->t);
+	if (ret) {
+		fprintf(stderr, "%s: couldn't open the tuner. (%s)\n", tn->spec, strerror(-ret));
+		tn->t = NULL;
+		return -1;
+	}
+
+	ret = ptx_get_info(tn->t, &tn->info);
+	if (ret) {
+		fprintf(stderr, "%s: PTXT_GET_INFO failed. (%s)\n", tn->spec, strerror(-ret));
+		return -1;
+	}
+
+	// the numbering follows the systems the tuner is capable of
+	if (ptx_channel_params(tn->info.cap.systems, n, slot, &tn->params)) {
+		fprintf(stderr, "%s: invalid channel number for the tuner.\n", tn->spec);
+		return -1;
+	}
+
+	ptx_set_stream_callback(tn->t, on_stream, tn);
+
+	ret = ptx_tune_async(tn->t, &tn->params, on_tune, tn);
+	if (ret) {
+		fprintf(stderr, "%s: tuning failed. (%s)\n", tn->spec, strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void snapshot_start(struct tuner *tn)
+{
+	tn->start_overflow = read_counter(tn, "overflow_packets");
+	tn->start_cc_errors = read_counter(tn, "cc_errors");
+	read_hist(tn, "wakeup_latency_hist", &tn->start_wakeup);
+	read_hist(tn, "urb_interval_hist", &tn->start_urb);
+}
+
+static void report_interval(struct tuner *tuners, int num, double elapsed, double secs)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		struct tuner *tn = &tuners[i];
+
+		printf("%9.0f s %-24s %7.2f Mbps, %llu CC errors (+%llu), %llu overflows\n",
+		       elapsed, tn->spec,
+		       (tn->bytes - tn->last_bytes) * 8 / secs / 1e6,
+		       (unsigned long long)tn->cc_errors,
+		       (unsigned long long)(tn->cc_errors - tn->last_cc_errors),
+		       (unsigned long long)(read_counter(tn, "overflow_packets") - tn->start_overflow));
+
+		tn->last_bytes = tn->bytes;
+		tn->last_cc_errors = tn->cc_errors;
+	}
+
+	fflush(stdout);
+}
+
+// grouped by the USB bus, the tuners on a bus share its bandwidth
+static int report_final(struct tuner *tuners, int num, double elapsed)
+{
+	int i, j, bad = 0;
+	uint32_t buses[MAX_TUNERS];
+	int num_buses = 0;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < num_buses; j++) {
+			if (buses[j] == tuners[i].info.bus_number)
+				break;
+		}
+
+		if (j == num_buses)
+			buses[num_buses++] = tuners[i].info.bus_number;
+	}
+
+	printf("\nCapacity report, %.0f s\n", elapsed);
+
+	for (j = 0; j < num_buses; j++) {
+		double total = 0;
+
+		if (buses[j])
+			printf("\nUSB bus %u\n", buses[j]);
+		else
+			printf("\nbus unknown\n");
+
+		for (i = 0; i < num; i++) {
+			struct tuner *tn = &tuners[i];
+			uint64_t overflow, drv_cc;
+			struct hist wakeup, urb;
+			int ok;
+
+			if (tn->info.bus_number != buses[j])
+				continue;
+
+			overflow = read_counter(tn, "overflow_packets") - tn->start_overflow;
+			drv_cc = read_counter(tn, "cc_errors") - tn->start_cc_errors;
+			read_hist(tn, "wakeup_latency_hist", &wakeup);
+			sub_hist(&wakeup, &tn->start_wakeup);
+			read_hist(tn, "urb_interval_hist", &urb);
+			sub_hist(&urb, &tn->start_urb);
+
+			ok = !tn->failed && tn->locked && !tn->cc_errors &&
+			     !tn->sync_errors && !overflow;
+			if (!ok)
+				bad++;
+
+			total += tn->bytes * 8 / elapsed / 1e6;
+
+			printf(" %s %s (%s%s%u Mbit/s)\n", (ok) ? "OK  " : "FAIL", tn->spec,
+			       tn->info.bus_path, (tn->info.bus_path[0]) ? ", " : "",
+			       tn->info.bus_speed);
+			printf("  %llu bytes, %.2f Mbps, %llu packets\n",
+			       (unsigned long long)tn->bytes, tn->bytes * 8 / elapsed / 1e6,
+			       (unsigned long long)tn->packets);
+			printf("  CC errors: %llu, sync errors: %llu, driver: %llu CC errors, %llu overflow packets\n",
+			       (unsigned long long)tn->cc_errors,
+			       (unsigned long long)tn->sync_errors,
+			       (unsigned long long)drv_cc, (unsigned long long)overflow);
+			print_hist("read wake-up latency", &wakeup);
+			print_hist("URB completion interval", &urb);
+		}
+
+		printf(" total %.2f Mbps\n", total);
+	}
+
+	printf("\n%s: %d of %d tuners without drops\n", (bad) ? "FAIL" : "PASS",
+	       num - bad, num);
+
+	return bad;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ptxsoak [options] <device>@<ch>[:<slot>]...\n"
+		"  -t <secs>  duration (default: 86400), 0: until interrupted\n"
+		"  -i <secs>  report interval (default: 60)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret, opt, i, num = 0, bad;
+	double duration = 86400, interval = 60, start, last;
+	struct tuner *tuners;
+	struct pollfd fds[MAX_TUNERS];
+	struct sigaction sa;
+
+	while ((opt = getopt(argc, argv, "t:i:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = strtod(optarg, NULL);
+			break;
+
+		case 'i':
+			interval = strtod(optarg, NULL);
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc || interval <= 0) {
+		usage();
+		return 1;
+	}
+
+	if (argc - optind > MAX_TUNERS) {
+		fprintf(stderr, "Too many tuners.\n");
+		return 1;
+	}
+
+	tuners = calloc(argc - optind, sizeof(*tuners));
+	if (!tuners) {
+		fprintf(stderr, "No enough memory.\n");
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		ret = setup_tuner(&tuners[num], argv[i]);
+		num++;
+		if (ret)
+			goto exit;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// the clock starts when all of them are streaming
+	while (!stop) {
+		int waiting = 0;
+
+		for (i = 0; i < num; i++) {
+			if (tuners[i].failed)
+				goto exit;
+
+			if (!tuners[i].locked)
+				waiting++;
+		}
+
+		if (!waiting)
+			break;
+
+		for (i = 0; i < num; i++) {
+			ret = ptx_process(tuners[i].t, 10);
+			if (ret && ret != -ETIMEDOUT) {
+				fprintf(stderr, "%s: %s\n", tuners[i].spec, strerror(-ret));
+				goto exit;
+			}
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		tuners[i].bytes = tuners[i].packets = 0;
+		tuners[i].sync_errors = tuners[i].cc_errors = 0;
+		snapshot_start(&tuners[i]);
+		fds[i].fd = ptx_fd(tuners[i].t);
+		fds[i].events = POLLIN | POLLPRI;
+	}
+
+	start = last = now();
+
+	while (!stop) {
+		double t;
+
+		ret = poll(fds, num, 100);
+		if (ret < 0 && errno != EINTR) {
+			fprintf(stderr, "poll() failed. (%s)\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; ret > 0 && i < num; i++) {
+			int r;
+
+			if (!fds[i].revents)
+				continue;
+
+			r = ptx_process(tuners[i].t, 0);
+			if (r && r != -ETIMEDOUT) {
+				fprintf(stderr, "%s: %s\n", tuners[i].spec, strerror(-r));
+				tuners[i].failed = 1;
+				stop = 1;
+			}
+		}
+
+		t = now();
+
+		if (t - last >= interval) {
+			report_interval(tuners, num, t - start, t - last);
+			last = t;
+		}
+
+		if (duration > 0 && t - start >= duration)
+			break;
+	}
+
+	bad = report_final(tuners, num, now() - start);
+
+	for (i = 0; i < num; i++)
+		ptx_close(tuners[i].t);
+
+	for (i = 0; i < num; i++)
+		free((void *)tuners[i].spec);
+	free(tuners);
+
+	return (bad) ? 1 : 0;
+
+exit:
+	for (i = 0; i < num; i++) {
+		if (tuners[i].t)
+			ptx_close(tuners[i].t);
+		free((void *)tuners[i].spec);
+	}
+
+	free(tuners);
+
+	return 1;
+}
@@ -0,0 +1,3 @@
+// atomic.h
+
+#include "../../kcompat.h"
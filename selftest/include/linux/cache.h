@@ -0,0 +1,3 @@
+// cache.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// list.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// mm.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// mutex.h
+
+#include "../../kcompat.h"
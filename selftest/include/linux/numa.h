@@ -0,0 +1,3 @@
+// numa.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// sched.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// slab.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// tracepoint.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// types.h
+
+#include "../../kcompat.h"
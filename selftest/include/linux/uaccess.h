@@ -0,0 +1,3 @@
+// uaccess.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// vmalloc.h
+
+#include "../../kcompat.h"
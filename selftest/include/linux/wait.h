@@ -0,0 +1,3 @@
+// wait.h
+
+#include "../../kcompat.h"
@@ -0,0 +1,3 @@
+// define_trace.h
+
+#include "../../kcompat.h"
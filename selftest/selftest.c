@@ -0,0 +1,995 @@
+// selftest.c
+
+// Feeds synthetic TS through the demultiplexer (ts_demux.c) and the
+// ringbuffer (ringbuffer.c) of the driver, built in userspace, to check the
+// resynchronization and the reassembly of the packets split over transfers,
+// and to measure the throughput and the cost per packet of both.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "kcompat.h"
+#include "ringbuffer.h"
+#include "ts_demux.h"
+
+#define TS_PACKET_SIZE	188
+
+// the tagged sync byte has 3 bits for the ID, which starts from 1
+#define MAX_TUNERS	7
+
+struct tuner {
+	struct ts_demux_sink sink;
+	unsigned int idx;
+	struct ringbuffer *ringbuf;	// NULL: the packets are only read and summed up
+	int reader;
+	u64 put_bytes;
+	u64 unwritten;		// not taken by the ringbuffer
+	// the generator
+	u32 next_seq;
+	u64 sent;
+	u64 tei_sent;
+	// the checker
+	u8 partial[TS_PACKET_SIZE];
+	size_t partial_len;
+	u32 expect_seq;
+	u64 received;
+	u64 lost;
+	u64 tei;
+	u64 errors;
+};
+
+struct stream {
+	u8 *buf;
+	size_t len;
+	size_t size;
+	unsigned int garbage;	// runs of garbage inserted
+};
+
+struct options {
+	unsigned int tuners;
+	unsigned int xfer_packets;
+	unsigned int ringbuf_packets;
+	unsigned int test_packets;
+	unsigned int bench_mib;
+	int writer_cpu;		// -1: any
+	int reader_cpu;
+	int tests;
+	int benchmarks;
+};
+
+static u64 rand_state = 0x9e3779b97f4a7c15ULL;
+
+static u32 rand32(void)
+{
+	u64 x = rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	rand_state = x;
+
+	return (u32)(x >> 32);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64 cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void set_cpu(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(thread, sizeof(set), &set))
+		fprintf(stderr, "Can't run on CPU %d.\n", cpu);
+}
+
+/*
+ * The stream.
+ * No byte but the sync byte of a packet matches the sync byte of either
+ * configuration, garbage included, so that the demultiplexer can only sync
+ * at the start of a real packet.
+ */
+
+static u8 sync_byte(const struct ts_demux_config *config, unsigned int idx)
+{
+	if (!config->id_mask)
+		return config->sync_byte;
+
+	return ((idx + config->id_base) << config->id_shift) | config->sync_byte;
+}
+
+static void stream_reserve(struct stream *s, size_t len)
+{
+	if (s->len + len <= s->size)
+		return;
+
+	s->size = (s->size) ? s->size * 2 : (1 << 20);
+	if (s->size < s->len + len)
+		s->size = s->len + len;
+
+	s->buf = realloc(s->buf, s->size);
+	if (!s->buf) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+}
+
+static void stream_put_packet(struct stream *s, struct tuner *t, u8 sync,
+			      unsigned int tei_every)
+{
+	u8 *p;
+	u16 pid = 0x100 + t->idx;
+	u32 seq = t->next_seq++;
+	int tei = (tei_every && !(rand32() % tei_every));
+	int i;
+
+	stream_reserve(s, TS_PACKET_SIZE);
+	p = s->buf + s->len;
+
+	p[0] = sync;
+	p[1] = ((tei) ? 0x80 : 0x00) | (pid >> 8);
+	p[2] = pid & 0xff;
+	p[3] = 0x10;
+	// the sequence number, a nibble in each byte
+	for (i = 0; i < 8; i++)
+		p[4 + i] = 0x80 | ((seq >> (i * 4)) & 0x0f);
+	memset(p + 12, 0xff, TS_PACKET_SIZE - 12);
+
+	s->len += TS_PACKET_SIZE;
+	t->sent++;
+	if (tei)
+		t->tei_sent++;
+}
+
+/*
+ * Runs of 1 to 8 packets of a tuner, as the device interleaves them, with
+ * garbage between the runs once in garbage_every runs if it is not 0.
+ * The garbage runs are 16 packets apart at least, and the stream ends with
+ * packets, so that the demultiplexer is in sync whenever it is left.
+ */
+static void stream_generate(struct stream *s, const struct ts_demux_config *config,
+			    struct tuner *tuners, unsigned int num,
+			    unsigned int packets, unsigned int garbage_every,
+			    unsigned int tei_every)
+{
+	unsigned int n = 0, since_garbage = 0;
+
+	s->len = 0;
+	s->garbage = 0;
+
+	while (n < packets) {
+		unsigned int idx = rand32() % num;
+		unsigned int run = rand32() % 8 + 1, i;
+
+		for (i = 0; i < run && n < packets; i++, n++)
+			stream_put_packet(s, &tuners[idx], sync_byte(config, idx),
+					  tei_every);
+
+		since_garbage += run;
+
+		if (garbage_every && since_garbage >= 16 && n + 16 < packets &&
+		    !(rand32() % garbage_every)) {
+			size_t len = rand32() % (TS_PACKET_SIZE * 3) + 1;
+
+			stream_reserve(s, len);
+			memset(s->buf + s->len, 0xff, len);
+			s->len += len;
+			s->garbage++;
+			since_garbage = 0;
+		}
+	}
+}
+
+/* the checker */
+
+static void tuner_check_packet(struct tuner *t, const u8 *p)
+{
+	u16 pid = ((p[1] & 0x1f) << 8) | p[2];
+	u32 seq = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		seq |= (u32)(p[4 + i] & 0x0f) << (i * 4);
+
+	if (p[0] != 0x47 || pid != 0x100 + t->idx || seq < t->expect_seq) {
+		t->errors++;
+		return;
+	}
+
+	for (i = 12; i < TS_PACKET_SIZE; i++) {
+		if (p[i] != 0xff) {
+			t->errors++;
+			return;
+		}
+	}
+
+	t->lost += seq - t->expect_seq;
+	t->expect_seq = seq + 1;
+	t->received++;
+	t->tei += p[1] >> 7;
+}
+
+static void tuner_check(struct tuner *t, const u8 *buf, size_t len)
+{
+	if (t->partial_len) {
+		size_t n = min(len, TS_PACKET_SIZE - t->partial_len);
+
+		memcpy(t->partial + t->partial_len, buf, n);
+		t->partial_len += n;
+		buf += n;
+		len -= n;
+
+		if (t->partial_len < TS_PACKET_SIZE)
+			return;
+
+		tuner_check_packet(t, t->partial);
+		t->partial_len = 0;
+	}
+
+	for (; len >= TS_PACKET_SIZE; buf += TS_PACKET_SIZE, len -= TS_PACKET_SIZE)
+		tuner_check_packet(t, buf);
+
+	memcpy(t->partial, buf, len);
+	t->partial_len = len;
+}
+
+/* reads what there is in the ringbuffer of the tuner, max bytes at a time */
+static size_t tuner_drain(struct tuner *t, u8 *buf, size_t max, int random)
+{
+	size_t total = 0;
+
+	for (;;) {
+		size_t len = (random) ? rand32() % max + 1 : max;
+
+		ringbuffer_read(t->ringbuf, t->reader, buf, &len);
+		if (!len)
+			break;
+
+		tuner_check(t, buf, len);
+		total += len;
+	}
+
+	return total;
+}
+
+// the packets are summed up into it when there is no ringbuffer to take them
+static volatile u64 put_sum;
+
+static void tuner_put_stream(struct ts_demux_sink *sink, u8 *buf, u32 len)
+{
+	struct tuner *t = container_of(sink, struct tuner, sink);
+	size_t n = len;
+
+	t->put_bytes += len;
+
+	if (!t->ringbuf) {
+		u64 sum = 0, v;
+
+		for (n = 0; n + sizeof(v) <= len; n += sizeof(v)) {
+			memcpy(&v, buf + n, sizeof(v));
+			sum += v;
+		}
+		for (; n < len; n++)
+			sum += buf[n];
+
+		put_sum += sum;
+		return;
+	}
+
+	ringbuffer_write_atomic(t->ringbuf, buf, &n);
+	t->unwritten += len - n;
+}
+
+static int tuners_init(struct tuner *tuners, unsigned int num,
+		       struct ts_demux *demux, size_t ringbuf_size)
+{
+	unsigned int i;
+	int ret;
+
+	memset(tuners, 0, sizeof(*tuners) * num);
+
+	for (i = 0; i < num; i++) {
+		struct tuner *t = &tuners[i];
+
+		t->idx = i;
+		t->sink.put_stream = tuner_put_stream;
+		demux->chrdev[i] = &t->sink;
+
+		if (!ringbuf_size)
+			continue;
+
+		ret = ringbuffer_create(&t->ringbuf, NUMA_NO_NODE);
+		if (ret)
+			return ret;
+
+		ret = ringbuffer_alloc(t->ringbuf, ringbuf_size);
+		if (!ret)
+			ret = ringbuffer_attach(t->ringbuf, NULL, &t->reader);
+		if (!ret)
+			ret = ringbuffer_start(t->ringbuf);
+		if (!ret)
+			ret = ringbuffer_ready_read(t->ringbuf);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void tuners_term(struct tuner *tuners, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		struct tuner *t = &tuners[i];
+
+		if (!t->ringbuf)
+			continue;
+
+		ringbuffer_detach(t->ringbuf, t->reader);
+		ringbuffer_destroy(t->ringbuf);
+		t->ringbuf = NULL;
+	}
+}
+
+/*
+ * The tests.
+ * Transfers of random sizes, from a byte up to 64KiB, most of them short of
+ * TS_DEMUX_SYNC_SIZE, put the remain_buf path to work. The last transfer is
+ * never that short, or its packets would be left in remain_buf.
+ */
+
+static size_t xfer_size(size_t left, unsigned int xfer_packets, int aligned)
+{
+	size_t len;
+
+	if (xfer_packets)
+		len = (size_t)xfer_packets * TS_PACKET_SIZE;
+	else if (aligned && (rand32() & 1))
+		len = (size_t)(rand32() % 64 + 1) * TS_PACKET_SIZE;
+	else
+		len = rand32() % (1u << (rand32() % 17)) + 1;
+
+	if (len >= left || left - len < TS_DEMUX_SYNC_SIZE)
+		len = left;
+
+	return len;
+}
+
+struct test {
+	const char *name;
+	struct ts_demux_config config;
+	unsigned int tuners;	// 0: as many as given with -n
+	unsigned int garbage_every;
+	unsigned int xfer_packets;	// 0: random sizes
+};
+
+static int run_test(const struct test *test, const struct options *opt)
+{
+	struct ts_demux demux;
+	struct tuner tuners[MAX_TUNERS];
+	struct stream s = { 0 };
+	unsigned int num = (test->tuners) ? test->tuners : opt->tuners;
+	size_t off, ringbuf_size;
+	u8 *xfer, *rbuf;
+	u64 received = 0, lost = 0;
+	int ret, failed = 0;
+	unsigned int i;
+
+	ts_demux_init(&demux, &test->config);
+
+	// a transfer fits in it with any remain_buf, nothing is dropped
+	ringbuf_size = (size_t)opt->ringbuf_packets * TS_PACKET_SIZE;
+	if (ringbuf_size < (1 << 17))
+		ringbuf_size = 1 << 17;
+
+	ret = tuners_init(tuners, num, &demux, ringbuf_size);
+	if (ret) {
+		fprintf(stderr, "%s: tuners_init() failed. (ret: %d)\n",
+			test->name, ret);
+		tuners_term(tuners, num);
+		return ret;
+	}
+
+	stream_generate(&s, &test->config, tuners, num, opt->test_packets,
+			test->garbage_every, 64);
+
+	xfer = malloc(s.len);
+	rbuf = malloc(1 << 16);
+	if (!xfer || !rbuf) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	for (off = 0; off < s.len;) {
+		size_t len = xfer_size(s.len - off, test->xfer_packets,
+				       !test->config.id_mask);
+
+		memcpy(xfer, s.buf + off, len);
+		ts_demux_stream_handler(&demux, xfer, len);
+		off += len;
+
+		for (i = 0; i < num; i++)
+			tuner_drain(&tuners[i], rbuf, 1 << 16, 1);
+	}
+
+	for (i = 0; i < num; i++) {
+		struct tuner *t = &tuners[i];
+
+		// the packets missing at the end
+		t->lost += t->next_seq - t->expect_seq;
+		received += t->received;
+		lost += t->lost;
+
+		if (t->errors || t->partial_len || t->unwritten ||
+		    ringbuffer_get_overflows(t->ringbuf, t->reader) ||
+		    t->tei != t->sink.stats.tei_errors ||
+		    t->sink.stats.resyncs != s.garbage ||
+		    (!s.garbage && (t->lost || t->tei != t->tei_sent))) {
+			printf("%s: tuner %u: %llu sent, %llu received, %llu lost, %llu bad, "
+			       "%llu/%llu/%llu tei (sent/received/counted), "
+			       "%llu/%u resyncs (counted/inserted)\n",
+			       test->name, i,
+			       (unsigned long long)t->sent,
+			       (unsigned long long)t->received,
+			       (unsigned long long)t->lost,
+			       (unsigned long long)t->errors,
+			       (unsigned long long)t->tei_sent,
+			       (unsigned long long)t->tei,
+			       (unsigned long long)t->sink.stats.tei_errors,
+			       (unsigned long long)t->sink.stats.resyncs,
+			       s.garbage);
+			failed = 1;
+		}
+	}
+
+	// a packet split over transfers before garbage, and those that can't
+	// be seen to be followed by TS_DEMUX_SYNC_COUNT packets
+	if (lost > (u64)s.garbage * TS_DEMUX_SYNC_COUNT)
+		failed = 1;
+
+	printf("%-32s %s: %llu packets, %u garbage runs, %llu packets lost\n",
+	       test->name, (failed) ? "FAILED" : "ok",
+	       (unsigned long long)received, s.garbage,
+	       (unsigned long long)lost);
+
+	tuners_term(tuners, num);
+	free(rbuf);
+	free(xfer);
+	free(s.buf);
+
+	return (failed) ? -EINVAL : 0;
+}
+
+/*
+ * A reader on another thread, with a small buffer for the writer to overrun.
+ * Every packet lost has to be accounted for as dropped by the ringbuffer.
+ */
+
+struct reader_thread {
+	pthread_t thread;
+	struct tuner *tuners;
+	unsigned int num;
+	size_t read_size;
+	int cpu;
+	volatile int stop;
+	u64 bytes;
+};
+
+static void *reader_thread_fn(void *arg)
+{
+	struct reader_thread *r = arg;
+	u8 *buf = malloc(r->read_size);
+	unsigned int i;
+	int stop;
+
+	if (!buf) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	set_cpu(pthread_self(), r->cpu);
+
+	do {
+		size_t n = 0;
+
+		stop = __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < r->num; i++)
+			n += tuner_drain(&r->tuners[i], buf, r->read_size, 0);
+
+		r->bytes += n;
+		if (!n)
+			sched_yield();
+	} while (!stop);
+
+	free(buf);
+
+	return NULL;
+}
+
+static int run_concurrent_test(const struct options *opt)
+{
+	const char *name = "ringbuffer, concurrent reader";
+	const struct ts_demux_config config = TS_DEMUX_TAGGED_CONFIG(opt->tuners);
+	struct ts_demux demux;
+	struct tuner tuners[MAX_TUNERS];
+	struct reader_thread r = { 0 };
+	struct stream s = { 0 };
+	size_t off, xfer_len = (size_t)opt->xfer_packets * TS_PACKET_SIZE;
+	u64 received = 0, lost = 0, dropped = 0;
+	u8 *xfer;
+	unsigned int i;
+	int ret, failed = 0;
+
+	ts_demux_init(&demux, &config);
+
+	// a few transfers only
+	ret = tuners_init(tuners, opt->tuners, &demux, xfer_len * 2);
+	if (ret) {
+		fprintf(stderr, "%s: tuners_init() failed. (ret: %d)\n", name, ret);
+		tuners_term(tuners, opt->tuners);
+		return ret;
+	}
+
+	stream_generate(&s, &config, tuners, opt->tuners, opt->test_packets, 0, 0);
+
+	xfer = malloc(xfer_len);
+	if (!xfer) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	r.tuners = tuners;
+	r.num = opt->tuners;
+	r.read_size = TS_PACKET_SIZE * 64;
+	r.cpu = opt->reader_cpu;
+	pthread_create(&r.thread, NULL, reader_thread_fn, &r);
+
+	for (off = 0; off < s.len;) {
+		size_t len = min(xfer_len, s.len - off);
+
+		memcpy(xfer, s.buf + off, len);
+		ts_demux_stream_handler(&demux, xfer, len);
+		off += len;
+	}
+
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(r.thread, NULL);
+
+	for (i = 0; i < opt->tuners; i++) {
+		struct tuner *t = &tuners[i];
+		u64 gone = t->ringbuf->reader[t->reader].dropped + t->unwritten;
+
+		t->lost += t->next_seq - t->expect_seq;
+		received += t->received;
+		lost += t->lost;
+		dropped += gone;
+
+		if (t->errors || t->partial_len || t->lost * TS_PACKET_SIZE != gone) {
+			printf("%s: tuner %u: %llu sent, %llu received, %llu lost, "
+			       "%llu bad, %llu bytes dropped\n",
+			       name, i,
+			       (unsigned long long)t->sent,
+			       (unsigned long long)t->received,
+			       (unsigned long long)t->lost,
+			       (unsigned long long)t->errors,
+			       (unsigned long long)gone);
+			failed = 1;
+		}
+	}
+
+	printf("%-32s %s: %llu packets, %llu packets dropped\n",
+	       name, (failed) ? "FAILED" : "ok",
+	       (unsigned long long)received,
+	       (unsigned long long)(dropped / TS_PACKET_SIZE));
+
+	tuners_term(tuners, opt->tuners);
+	free(xfer);
+	free(s.buf);
+
+	return (failed) ? -EINVAL : 0;
+}
+
+/*
+ * The benchmarks.
+ * Only the calls into the driver code are timed, the copy of each transfer
+ * into place, which stands for the DMA of the device, is not.
+ */
+
+struct bench_result {
+	u64 bytes;
+	u64 cycles;
+	double secs;
+};
+
+static void bench_print(const char *name, const struct bench_result *res,
+			u64 dropped)
+{
+	u64 packets = res->bytes / TS_PACKET_SIZE;
+
+	printf("%-40s %9.1f MB/s %8.1f ns/packet", name,
+	       res->bytes / res->secs / 1e6, res->secs * 1e9 / packets);
+#ifdef HAVE_TSC
+	printf(" %8.1f cycles/packet", (double)res->cycles / packets);
+#endif
+	if (dropped)
+		printf(" (%llu packets dropped)",
+		       (unsigned long long)(dropped / TS_PACKET_SIZE));
+	printf("\n");
+}
+
+static void bench_demux(const char *name, const struct ts_demux_config *config,
+			unsigned int num, int ringbuf, const struct options *opt)
+{
+	struct ts_demux demux;
+	struct tuner tuners[MAX_TUNERS];
+	struct reader_thread r = { 0 };
+	struct stream s = { 0 };
+	struct bench_result res = { 0 };
+	size_t xfer_len = (size_t)opt->xfer_packets * TS_PACKET_SIZE, off = 0;
+	u64 total = (u64)opt->bench_mib << 20, dropped = 0;
+	u8 *xfer;
+	unsigned int i;
+	int ret;
+
+	ts_demux_init(&demux, config);
+
+	ret = tuners_init(tuners, num, &demux,
+			  (ringbuf) ? (size_t)opt->ringbuf_packets * TS_PACKET_SIZE : 0);
+	if (ret) {
+		fprintf(stderr, "%s: tuners_init() failed. (ret: %d)\n", name, ret);
+		tuners_term(tuners, num);
+		return;
+	}
+
+	// long enough not to fit in the caches
+	stream_generate(&s, config, tuners, num,
+			(64 << 20) / TS_PACKET_SIZE / opt->xfer_packets * opt->xfer_packets,
+			0, 0);
+
+	xfer = malloc(xfer_len);
+	if (!xfer) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	if (ringbuf) {
+		r.tuners = tuners;
+		r.num = num;
+		r.read_size = TS_PACKET_SIZE * 1024;
+		r.cpu = opt->reader_cpu;
+		pthread_create(&r.thread, NULL, reader_thread_fn, &r);
+	}
+
+	while (res.bytes < total) {
+		double t;
+		u64 c;
+
+		memcpy(xfer, s.buf + off, xfer_len);
+		off += xfer_len;
+		if (off >= s.len)
+			off = 0;
+
+		t = now();
+		c = cycles();
+		ts_demux_stream_handler(&demux, xfer, xfer_len);
+		res.cycles += cycles() - c;
+		res.secs += now() - t;
+		res.bytes += xfer_len;
+	}
+
+	if (ringbuf) {
+		__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(r.thread, NULL);
+
+		for (i = 0; i < num; i++)
+			dropped += tuners[i].ringbuf->reader[tuners[i].reader].dropped +
+				   tuners[i].unwritten;
+	}
+
+	bench_print(name, &res, dropped);
+
+	tuners_term(tuners, num);
+	free(xfer);
+	free(s.buf);
+}
+
+/*
+ * The writes of the demultiplexer alone, of run packets each, or of 1 to run
+ * packets if random.
+ */
+static void bench_ringbuffer(const char *name, unsigned int run, int random,
+			     const struct options *opt)
+{
+	struct ts_demux demux;
+	struct tuner t;
+	struct reader_thread r = { 0 };
+	struct bench_result res = { 0 };
+	u64 total = (u64)opt->bench_mib << 20;
+	u8 *buf;
+	int ret;
+
+	ret = tuners_init(&t, 1, &demux, (size_t)opt->ringbuf_packets * TS_PACKET_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s: tuners_init() failed. (ret: %d)\n", name, ret);
+		tuners_term(&t, 1);
+		return;
+	}
+
+	buf = calloc(run, TS_PACKET_SIZE);
+	if (!buf) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	r.tuners = &t;
+	r.num = 1;
+	r.read_size = TS_PACKET_SIZE * 1024;
+	r.cpu = opt->reader_cpu;
+	pthread_create(&r.thread, NULL, reader_thread_fn, &r);
+
+	while (res.bytes < total) {
+		unsigned int i;
+		double tm;
+		u64 c, bytes = 0;
+
+		tm = now();
+		c = cycles();
+		// a transfer worth of writes
+		for (i = 0; i < opt->xfer_packets;) {
+			unsigned int n = (random) ? rand32() % run + 1 : run;
+			size_t len;
+
+			if (n > opt->xfer_packets - i)
+				n = opt->xfer_packets - i;
+
+			len = (size_t)n * TS_PACKET_SIZE;
+			ringbuffer_write_atomic(t.ringbuf, buf, &len);
+			bytes += (u64)n * TS_PACKET_SIZE;
+			i += n;
+		}
+		res.cycles += cycles() - c;
+		res.secs += now() - tm;
+		res.bytes += bytes;
+	}
+
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(r.thread, NULL);
+
+	bench_print(name, &res, t.ringbuf->reader[t.reader].dropped);
+
+	tuners_term(&t, 1);
+	free(buf);
+}
+
+/*
+ * The same writes on a single thread, each transfer read back right after
+ * it in reads of 64 packets: the cost of the calls themselves, without the
+ * drops or the cache misses the other thread would cause.
+ */
+static void bench_ringbuffer_rw(const char *name, unsigned int run,
+				const struct options *opt)
+{
+	struct ts_demux demux;
+	struct tuner t;
+	struct bench_result w = { 0 }, r = { 0 };
+	u64 total = (u64)opt->bench_mib << 20;
+	size_t read_size = TS_PACKET_SIZE * 64;
+	char rname[64];
+	u8 *buf, *rbuf;
+	int ret;
+
+	ret = tuners_init(&t, 1, &demux,
+			  (size_t)(opt->xfer_packets + 64) * TS_PACKET_SIZE);
+	if (ret) {
+		fprintf(stderr, "%s: tuners_init() failed. (ret: %d)\n", name, ret);
+		tuners_term(&t, 1);
+		return;
+	}
+
+	buf = calloc(run, TS_PACKET_SIZE);
+	rbuf = malloc(read_size);
+	if (!buf || !rbuf) {
+		fprintf(stderr, "No enough memory.\n");
+		exit(1);
+	}
+
+	while (w.bytes < total) {
+		unsigned int i;
+		double tm;
+		u64 c;
+
+		tm = now();
+		c = cycles();
+		for (i = 0; i < opt->xfer_packets; i += run) {
+			size_t len = (size_t)min(run, opt->xfer_packets - i) * TS_PACKET_SIZE;
+
+			ringbuffer_write_atomic(t.ringbuf, buf, &len);
+			w.bytes += len;
+		}
+		w.cycles += cycles() - c;
+		w.secs += now() - tm;
+
+		tm = now();
+		c = cycles();
+		for (;;) {
+			size_t len = read_size;
+
+			ringbuffer_read(t.ringbuf, t.reader, rbuf, &len);
+			if (!len)
+				break;
+
+			r.bytes += len;
+		}
+		r.cycles += cycles() - c;
+		r.secs += now() - tm;
+	}
+
+	bench_print(name, &w, t.ringbuf->reader[t.reader].dropped);
+	snprintf(rname, sizeof(rname), "%s, reads", name);
+	bench_print(rname, &r, 0);
+
+	tuners_term(&t, 1);
+	free(rbuf);
+	free(buf);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-t | -b] [-n <tuners>] [-c <packets per transfer>]\n"
+		"       [-r <packets in a ringbuffer>] [-p <packets per test>]\n"
+		"       [-m <MiB per benchmark>] [-s <seed>]\n"
+		"       [-W <CPU of the writer>] [-R <CPU of the reader>]\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opt = {
+		.tuners = 4,
+		.xfer_packets = 816,
+		.ringbuf_packets = 16384,
+		.test_packets = 200000,
+		.bench_mib = 1024,
+		.writer_cpu = -1,
+		.reader_cpu = -1,
+		.tests = 1,
+		.benchmarks = 1,
+	};
+	const struct ts_demux_config single = TS_DEMUX_SINGLE_CONFIG;
+	struct ts_demux_config tagged;
+	char name[64];
+	int opt_c, failed = 0;
+
+	while ((opt_c = getopt(argc, argv, "tbn:c:r:p:m:s:W:R:")) != -1) {
+		switch (opt_c) {
+		case 't':
+			opt.benchmarks = 0;
+			break;
+
+		case 'b':
+			opt.tests = 0;
+			break;
+
+		case 'n':
+			opt.tuners = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			opt.xfer_packets = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			opt.ringbuf_packets = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'p':
+			opt.test_packets = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'm':
+			opt.bench_mib = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			rand_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+
+		case 'W':
+			opt.writer_cpu = strtol(optarg, NULL, 0);
+			break;
+
+		case 'R':
+			opt.reader_cpu = strtol(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!opt.tuners || opt.tuners > MAX_TUNERS) {
+		fprintf(stderr, "The number of tuners must be 1 to %d.\n", MAX_TUNERS);
+		return 1;
+	}
+
+	if (!opt.xfer_packets || !opt.ringbuf_packets ||
+	    opt.test_packets < 1000 || !opt.bench_mib)
+		usage(argv[0]);
+
+	tagged = (struct ts_demux_config)TS_DEMUX_TAGGED_CONFIG(opt.tuners);
+
+	// the demultiplexer and the writes run on the main thread
+	set_cpu(pthread_self(), opt.writer_cpu);
+
+	if (opt.tests) {
+		const struct test tests[] = {
+			{ "reassembly", tagged, 0, 0, 0 },
+			{ "reassembly, single", single, 1, 0, 0 },
+			{ "resync", tagged, 0, 32, 0 },
+			{ "resync, single", single, 1, 32, 0 },
+			{ "resync, whole transfers", tagged, 0, 32, opt.xfer_packets },
+		};
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(tests); i++) {
+			if (run_test(&tests[i], &opt))
+				failed = 1;
+		}
+
+		if (run_concurrent_test(&opt))
+			failed = 1;
+	}
+
+	if (opt.benchmarks) {
+		snprintf(name, sizeof(name), "demux, %u tuners", opt.tuners);
+		bench_demux(name, &tagged, opt.tuners, 0, &opt);
+		bench_demux("demux, single", &single, 1, 0, &opt);
+		snprintf(name, sizeof(name), "demux+ringbuffer, %u tuners", opt.tuners);
+		bench_demux(name, &tagged, opt.tuners, 1, &opt);
+		bench_demux("demux+ringbuffer, single", &single, 1, 1, &opt);
+		bench_ringbuffer("ringbuffer, 1 packet writes", 1, 0, &opt);
+		bench_ringbuffer("ringbuffer, 1-8 packet writes", 8, 1, &opt);
+		bench_ringbuffer("ringbuffer, whole transfers", opt.xfer_packets, 0, &opt);
+		bench_ringbuffer_rw("ringbuffer alone, 1 packet writes", 1, &opt);
+		bench_ringbuffer_rw("ringbuffer alone, 8 packet writes", 8, &opt);
+		bench_ringbuffer_rw("ringbuffer alone, whole transfers",
+				    opt.xfer_packets, &opt);
+	}
+
+	ringbuffer_pool_cleanup();
+
+	return failed;
+}
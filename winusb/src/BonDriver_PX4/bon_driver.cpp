@@ -1,5 +1,8 @@
 // bon_driver.cpp
 
+#define msg_prefix	"BonDriver_PX4"
+
+#include <cstring>
 #include <string>
 #include <map>
 #include <stdexcept>
@@ -15,9 +18,19 @@
 #include "pipe_client.hpp"
 #include "command.hpp"
 #include "util.hpp"
+#include "msg.h"
 
 namespace px4 {
 
+namespace {
+
+// shared by the instances of the module, the files are loaded by the first one only
+std::mutex shared_mtx;
+std::weak_ptr<const px4::ConfigSet> shared_configs;
+std::weak_ptr<const px4::ChannelSet> shared_chset;
+
+} // namespace
+
 BonDriver::BonDriver() noexcept
 	: mtx_(),
 	driver_host_path_(),
@@ -30,7 +43,9 @@ BonDriver::BonDriver() noexcept
 	lnb_power_state_(false),
 	pipe_timeout_(2000),
 	tune_timeout_(5000),
+	use_shared_ring_(true),
 	ctrl_client_(nullptr),
+	cmd_version_(0),
 	data_pipe_(nullptr),
 	open_(FALSE),
 	space_(0),
@@ -39,6 +54,8 @@ BonDriver::BonDriver() noexcept
 	stream_mtx_(),
 	ioq_(nullptr),
 	iorp_(*this),
+	ring_(),
+	purge_epoch_(0),
 	current_ofs_(0),
 	quit_event_(nullptr)
 {
@@ -56,15 +73,32 @@ bool BonDriver::Init()
 	try {
 		const std::wstring &dir_path = px4::util::path::GetDir();
 
-		if (!configs_.Load(px4::util::path::GetFileBase() + L".ini"))
-			return false;
+		std::unique_lock<std::mutex> shared_lock(shared_mtx);
+		std::shared_ptr<px4::ChannelSet> chset;
+
+		configs_ = shared_configs.lock();
+		if (!configs_) {
+			std::shared_ptr<px4::ConfigSet> configs = std::make_shared<px4::ConfigSet>();
+
+			if (!configs->Load(px4::util::path::GetFileBase() + L".ini"))
+				return false;
+
+			configs_ = configs;
+			shared_configs = configs_;
+		}
+
+		chset_ = shared_chset.lock();
+		if (!chset_)
+			chset = std::make_shared<px4::ChannelSet>();
 
 		std::size_t num_packets = 1024;
-		std::uintptr_t max_buffers = 64, min_buffers = 4;
+		std::size_t max_buffers = 64;
+		std::size_t min_packets = 0, min_buffers = 0;	// 0: same as the maximum, nothing is adapted
+		std::uint32_t max_latency = 100;
 		int data_ignore_count = 1;
 
-		if (configs_.Exists(L"BonDriver")) {
-			const px4::Config &bon_config = configs_.Get(L"BonDriver");
+		if (configs_->Exists(L"BonDriver")) {
+			const px4::Config &bon_config = configs_->Get(L"BonDriver");
 			const std::wstring &mode = bon_config.Get(L"System", L"ISDB-T");
 			WCHAR path[MAX_PATH];
 
@@ -97,14 +131,17 @@ bool BonDriver::Init()
 					return false;
 			} catch (const std::out_of_range &) {}
 
+			try {
+				min_packets = px4::util::wtoui(bon_config.Get(L"MinimumNumberOfPacketsPerBuffer"));
+			} catch (const std::out_of_range &) {}
+
 			try {
 				min_buffers = px4::util::wtoui(bon_config.Get(L"MinimumNumberOfBuffers"));
-				if (min_buffers <= 0)
-					return false;
 			} catch (const std::out_of_range &) {}
 
-			if (max_buffers < min_buffers)
-				return false;
+			try {
+				max_latency = px4::util::wtoui32(bon_config.Get(L"MaximumLatency"));
+			} catch (const std::out_of_range &) {}
 
 			try {
 				data_ignore_count = px4::util::wtoi(bon_config.Get(L"NumberOfBuffersToIgnoreAfterPurge"));
@@ -118,47 +155,53 @@ bool BonDriver::Init()
 					display_error_message_ = true;
 				}
 			} catch (const std::out_of_range &) {}
+
+			try {
+				use_shared_ring_ = !!px4::util::wtoi(bon_config.Get(L"UseSharedMemory"));
+			} catch (const std::out_of_range &) {}
 		} else {
 			systems_ = px4::SystemType::ISDB_T;
 			driver_host_path_ = dir_path + L"DriverHost_PX4.exe";
 			name_ = L"PX4";
 		}
 
-		if ((systems_ & px4::SystemType::ISDB_T) == px4::SystemType::ISDB_T) {
+		if (chset && (systems_ & px4::SystemType::ISDB_T) == px4::SystemType::ISDB_T) {
 			px4::ChannelSet chset_t;
 			bool result;
 
 			try {
-				std::wstring chset_path = configs_.Get(L"BonDriver.ISDB-T").Get(L"ChSetPath");
+				std::wstring chset_path = configs_->Get(L"BonDriver.ISDB-T").Get(L"ChSetPath");
 				WCHAR path[MAX_PATH];
 
 				if (PathIsRelativeW(chset_path.c_str()) && PathCanonicalizeW(path, (dir_path + chset_path).c_str()))
 					chset_path = path;
 
-				result = chset_t.Load(chset_path, px4::SystemType::ISDB_T);
+				result = chset_t.LoadCached(chset_path, px4::SystemType::ISDB_T);
 			} catch (const std::out_of_range&) {
 				result = false;
 			}
 
 			if (!result) {
 				chset_t.Clear();
-				result = chset_t.Load(dir_path + L"BonDriver_PX4-T.ChSet.txt", px4::SystemType::ISDB_T);
+				result = chset_t.LoadCached(dir_path + L"BonDriver_PX4-T.ChSet.txt", px4::SystemType::ISDB_T);
 			}
 
 			if (result)
-				chset_.Merge(chset_t);
+				chset->Merge(chset_t);
 		}
 
 		if ((systems_ & px4::SystemType::ISDB_S) == px4::SystemType::ISDB_S) {
+			try {
+				lnb_power_ = !!px4::util::wtoi(configs_->Get(L"BonDriver.ISDB-S").Get(L"LNBPower"));
+			} catch (const std::out_of_range &) {}
+		}
+
+		if (chset && (systems_ & px4::SystemType::ISDB_S) == px4::SystemType::ISDB_S) {
 			px4::ChannelSet chset_s;
 			bool result;
 
 			try {
-				auto &config = configs_.Get(L"BonDriver.ISDB-S");
-
-				try {
-					lnb_power_ = !!px4::util::wtoi(config.Get(L"LNBPower"));
-				} catch (const std::out_of_range &) {}
+				auto &config = configs_->Get(L"BonDriver.ISDB-S");
 
 				std::wstring chset_path = config.Get(L"ChSetPath");
 				WCHAR path[MAX_PATH];
@@ -166,27 +209,37 @@ bool BonDriver::Init()
 				if (PathIsRelativeW(chset_path.c_str()) && PathCanonicalizeW(path, (dir_path + chset_path).c_str()))
 					chset_path = path;
 
-				result = chset_s.Load(chset_path, px4::SystemType::ISDB_S);
+				result = chset_s.LoadCached(chset_path, px4::SystemType::ISDB_S);
 			} catch (const std::out_of_range&) {
 				result = false;
 			}
 
 			if (!result) {
 				chset_s.Clear();
-				result = chset_s.Load(dir_path + L"BonDriver_PX4-S.ChSet.txt", px4::SystemType::ISDB_S);
+				result = chset_s.LoadCached(dir_path + L"BonDriver_PX4-S.ChSet.txt", px4::SystemType::ISDB_S);
 			}
 
 			if (result)
-				chset_.Merge(chset_s);
+				chset->Merge(chset_s);
 		}
 
-		receivers_.Load(configs_);
+		if (chset) {
+			chset_ = chset;
+			shared_chset = chset_;
+		}
+
+		shared_lock.unlock();
+
+		receivers_.Load(*configs_);
 
 		quit_event_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
 		if (!quit_event_)
 			return false;
 
-		ioq_.reset(new px4::IoQueue(px4::IoQueue::IoOperation::READ, iorp_, 188 * num_packets, max_buffers, min_buffers, data_ignore_count));
+		ioq_.reset(new px4::IoQueue(px4::IoQueue::IoOperation::READ, iorp_, 188 * num_packets, max_buffers, data_ignore_count));
+		// the buffers are still allocated for the maximum, only the part in use is adapted
+		ioq_->SetAdaptiveBounds(188 * ((min_packets) ? min_packets : num_packets), (min_buffers) ? min_buffers : max_buffers, 188);
+		ioq_->SetMaxLatency(std::chrono::milliseconds(max_latency));
 	} catch (const std::runtime_error &e) {
 		if (display_error_message_) MessageBoxA(nullptr, e.what(), "BonDriver_PX4 (BonDriver::Init)", MB_OK);
 		return false;
@@ -260,6 +313,11 @@ const BOOL BonDriver::OpenTuner()
 
 		ctrl_client_.SetPipe(ctrl_pipe);
 
+		std::uint32_t driver_version;
+
+		if (!ctrl_client_.GetVersion(driver_version, cmd_version_))
+			cmd_version_ = 0;
+
 		try {
 			for (std::size_t i = 0; ; i++) {
 				const px4::command::ReceiverInfo &ri = receivers_.Get(i);
@@ -281,6 +339,9 @@ const BOOL BonDriver::OpenTuner()
 		if (!data_pipe_->Connect(L"px4_data_pipe", data_pipe_config, nullptr))
 			throw BonDriverError("BonDriver::OpenTuner: data pipe: cannot connect.");
 
+		if (use_shared_ring_ && !OpenSharedRing(ri_res.data_id))
+			throw BonDriverError("BonDriver::OpenTuner: data pipe: command failed.");
+
 		px4::command::DataCmd data_cmd;
 		std::size_t ret_size;
 
@@ -311,6 +372,8 @@ const BOOL BonDriver::OpenTuner()
 			data_pipe_.reset();
 		}
 
+		ring_.Close();
+
 		ctrl_client_.Close();
 		ctrl_client_.ClearPipe();
 	}
@@ -331,6 +394,14 @@ void BonDriver::CloseTuner()
 		data_pipe_.reset();
 	}
 
+	ring_.Close();
+
+	{
+		px4::IoQueue::Stats stats = ioq_->GetStats();
+
+		msg_info("BonDriver::CloseTuner: buffers: %zu, size: %zu, rate: %llu bytes/s, overflows: %llu\n", stats.num, stats.fill_size, stats.fill_rate, stats.overflow_count);
+	}
+
 	if (lnb_power_state_) {
 		ctrl_client_.SetLnbVoltage(0);
 		lnb_power_state_ = false;
@@ -417,16 +488,7 @@ const BOOL BonDriver::GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain
 
 void BonDriver::PurgeTsStream(void)
 {
-	{
-		px4::command::DataCmd data_cmd;
-		std::size_t ret_size;
-		std::lock_guard<std::mutex> lock(mtx_);
-
-		data_cmd.cmd = px4::command::DataCmdCode::PURGE;
-		data_pipe_->Write(&data_cmd, sizeof(data_cmd), ret_size);
-	}
-
-	ioq_->PurgeDataBuffer();
+	Purge(true);
 	return;
 }
 
@@ -448,7 +510,7 @@ const BOOL BonDriver::IsTunerOpening(void)
 LPCTSTR BonDriver::EnumTuningSpace(const DWORD dwSpace)
 {
 	try {
-		return chset_.GetSpaceName(dwSpace).c_str();
+		return chset_->GetSpaceName(dwSpace).c_str();
 	} catch (const std::out_of_range&) {
 		return nullptr;
 	}
@@ -457,7 +519,7 @@ LPCTSTR BonDriver::EnumTuningSpace(const DWORD dwSpace)
 LPCTSTR BonDriver::EnumChannelName(const DWORD dwSpace, const DWORD dwChannel)
 {
 	try {
-		return chset_.GetChannel(dwSpace, dwChannel).name.c_str();
+		return chset_->GetChannel(dwSpace, dwChannel).name.c_str();
 	} catch (const std::out_of_range&) {
 		return nullptr;
 	}
@@ -468,11 +530,11 @@ const BOOL BonDriver::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
 	if (!open_)
 		return FALSE;
 
-	if (!chset_.ExistsChannel(dwSpace, dwChannel))
+	if (!chset_->ExistsChannel(dwSpace, dwChannel))
 		return FALSE;
 
-	const px4::ChannelSet::ChannelInfo &channel = chset_.GetChannel(dwSpace, dwChannel);
-	px4::SystemType system = chset_.GetSpaceSystem(dwSpace);
+	const px4::ChannelSet::ChannelInfo &channel = chset_->GetChannel(dwSpace, dwChannel);
+	px4::SystemType system = chset_->GetSpaceSystem(dwSpace);
 	std::uint32_t real_freq, num_param = 0;
 
 	switch (system) {
@@ -525,27 +587,47 @@ const BOOL BonDriver::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
 		param_set->params[0].value = channel.tsid;
 	}
 
-	bool ret = true;
+	bool ret = true, async = false, purged = false;
 
 	try {
 		std::lock_guard<std::mutex> lock(mtx_);
 
-		if (lnb_power_) {
-			if (system == px4::SystemType::ISDB_S) {
-				if (!lnb_power_state_) {
-					ret = ctrl_client_.SetLnbVoltage(15);
-					lnb_power_state_ = true;
+		if (cmd_version_ >= px4::command::SET_CHANNEL_MIN_VERSION) {
+			// all of the steps below and the purge in one round trip
+			// the purge with a marker is sent on the data pipe instead, it has no reply
+			bool marker = (cmd_version_ >= px4::command::PURGE_MARKER_MIN_VERSION);
+			std::uint32_t flags = px4::command::SET_CHANNEL_TUNE_ASYNC | ((marker) ? 0 : px4::command::SET_CHANNEL_PURGE);
+			std::int32_t voltage = 0;
+
+			if (lnb_power_ && (system == px4::SystemType::ISDB_S) != lnb_power_state_) {
+				flags |= px4::command::SET_CHANNEL_LNB_VOLTAGE;
+				voltage = (system == px4::SystemType::ISDB_S) ? 15 : 0;
+				lnb_power_state_ = !lnb_power_state_;
+			}
+
+			async = true;
+			ret = ctrl_client_.SetChannel(flags, voltage, tune_timeout_, *param_set);
+			purged = ret && !marker;
+		} else {
+			if (lnb_power_) {
+				if (system == px4::SystemType::ISDB_S) {
+					if (!lnb_power_state_) {
+						ret = ctrl_client_.SetLnbVoltage(15);
+						lnb_power_state_ = true;
+					}
+				} else if (lnb_power_state_) {
+					ret = ctrl_client_.SetLnbVoltage(0);
+					lnb_power_state_ = false;
 				}
-			} else if (lnb_power_state_) {
-				ret = ctrl_client_.SetLnbVoltage(0);
-				lnb_power_state_ = false;
 			}
-		}
 
-		if (ret) {
-			ret = ctrl_client_.SetParams(*param_set);
-			if (ret)
-				ret = ctrl_client_.Tune(tune_timeout_);
+			if (ret) {
+				ret = ctrl_client_.SetParams(*param_set);
+				if (ret) {
+					async = (cmd_version_ >= px4::command::TUNE_ASYNC_MIN_VERSION);
+					ret = (async) ? ctrl_client_.TuneAsync(tune_timeout_) : ctrl_client_.Tune(tune_timeout_);
+				}
+			}
 		}
 	} catch (const std::exception &e) {
 		if (display_error_message_) MessageBoxA(nullptr, e.what(), "BonDriver_PX4 (BonDriver::SetChannel)", MB_OK | MB_ICONERROR);
@@ -555,7 +637,15 @@ const BOOL BonDriver::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
 
 	delete[] reinterpret_cast<std::uint8_t*>(param_set);
 
-	PurgeTsStream();
+	// with TUNE_ASYNC, the stream is purged while the demodulator is locking
+	Purge(!purged);
+
+	if (ret && async) {
+		std::lock_guard<std::mutex> lock(mtx_);
+
+		// DriverHost_PX4 also waits a little after the lock
+		ret = ctrl_client_.WaitTune(tune_timeout_ + 1000);
+	}
 
 	if (ret) {
 		// succeeded
@@ -576,6 +666,81 @@ const DWORD BonDriver::GetCurChannel(void)
 	return ch_;
 }
 
+// remote: PURGE is sent on the data pipe, otherwise SET_CHANNEL has done it already.
+// Newer DriverHost_PX4 writes a marker where it has purged, the data is dropped exactly up to it;
+// the older one is followed by NumberOfBuffersToIgnoreAfterPurge.
+void BonDriver::Purge(bool remote)
+{
+	bool marker = remote && (cmd_version_ >= px4::command::PURGE_MARKER_MIN_VERSION);
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+		std::uint32_t epoch = 0;
+
+		if (marker) {
+			epoch = purge_epoch_.load() + 1;
+			if (!epoch)
+				epoch++;
+
+			// the queue must be looking for the marker before it can be written
+			purge_epoch_ = epoch;
+			ioq_->PurgeDataBuffer(true);
+		}
+
+		if (remote) {
+			px4::command::DataCmd data_cmd;
+			std::size_t ret_size;
+
+			data_cmd.cmd = px4::command::DataCmdCode::PURGE;
+			data_cmd.purge_epoch = epoch;
+			data_pipe_->Write(&data_cmd, sizeof(data_cmd), ret_size);
+		}
+
+		// skipping to the latest data of the ring could skip the marker too
+		if (!marker && ring_.IsOpened())
+			ring_.Purge();
+	}
+
+	if (!marker)
+		ioq_->PurgeDataBuffer();
+
+	return;
+}
+
+// Returns false only if the data pipe has been lost, otherwise the pipe is used as a fallback.
+bool BonDriver::OpenSharedRing(std::uint32_t data_id)
+{
+	// older DriverHost_PX4 drops the connection on unknown commands
+	if (cmd_version_ < px4::command::SHARED_RING_MIN_VERSION)
+		return true;
+
+	px4::command::DataCmd data_cmd;
+	std::size_t ret_size;
+	std::wstring name = L"Local\\px4_shared_ring_" + std::to_wstring(GetCurrentProcessId()) + L"_" + std::to_wstring(data_id);
+	std::size_t size = 188 * 4096 * 4;
+
+	if (name.size() >= _countof(data_cmd.shared_ring.name) || !ring_.Create(name, size))
+		return true;
+
+	memset(&data_cmd, 0, sizeof(data_cmd));
+	data_cmd.cmd = px4::command::DataCmdCode::SET_SHARED_RING;
+	data_cmd.shared_ring.size = static_cast<std::uint32_t>(size);
+	wcscpy_s(data_cmd.shared_ring.name, name.c_str());
+
+	if (!data_pipe_->Write(&data_cmd, sizeof(data_cmd), ret_size) ||
+	    !data_pipe_->Read(&data_cmd, sizeof(data_cmd), ret_size) ||
+	    ret_size != sizeof(data_cmd)) {
+		ring_.Close();
+		data_pipe_.reset();
+		return false;
+	}
+
+	if (data_cmd.cmd != px4::command::DataCmdCode::SET_SHARED_RING || !data_cmd.shared_ring.size)
+		ring_.Close();
+
+	return true;
+}
+
 bool BonDriver::ReadProvider::Start()
 {
 	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
@@ -589,9 +754,66 @@ void BonDriver::ReadProvider::Stop()
 
 bool BonDriver::ReadProvider::Do(void *buf, std::size_t &size)
 {
+	if (parent_.ring_.IsOpened())
+		return parent_.ring_.Read(buf, size, size, parent_.quit_event_);
+
 	return parent_.data_pipe_->Read(buf, size, size, parent_.quit_event_);
 }
 
+bool BonDriver::ReadProvider::Do(void *buf, std::size_t &size, std::chrono::milliseconds timeout)
+{
+	DWORD ms = static_cast<DWORD>(timeout.count());
+
+	if (parent_.ring_.IsOpened())
+		return parent_.ring_.Read(buf, size, size, parent_.quit_event_, ms);
+
+	return parent_.data_pipe_->Read(buf, size, size, parent_.quit_event_, ms);
+}
+
+bool BonDriver::ReadProvider::FindBoundary(const void *buf, std::size_t size, std::size_t &pos)
+{
+	const std::uint8_t *p = static_cast<const std::uint8_t *>(buf);
+	std::uint32_t epoch = parent_.purge_epoch_.load();
+
+	if (epoch != epoch_) {
+		// purged again, the older markers are dropped as data
+		px4::command::PurgeMarker marker;
+
+		std::memcpy(marker.magic, px4::command::PURGE_MARKER_MAGIC, sizeof(marker.magic));
+		marker.epoch = epoch;
+		marker.epoch_inv = ~epoch;
+		std::memcpy(pattern_, &marker, sizeof(pattern_));
+
+		// the failure function of the Knuth-Morris-Pratt search
+		fail_[0] = 0;
+		for (std::size_t i = 1, k = 0; i < sizeof(pattern_); i++) {
+			while (k && pattern_[i] != pattern_[k])
+				k = fail_[k - 1];
+
+			if (pattern_[i] == pattern_[k])
+				k++;
+
+			fail_[i] = k;
+		}
+
+		epoch_ = epoch;
+		matched_ = 0;
+	}
+
+	for (std::size_t i = 0; i < size; i++) {
+		while (matched_ && p[i] != pattern_[matched_])
+			matched_ = fail_[matched_ - 1];
+
+		if (p[i] == pattern_[matched_] && ++matched_ == sizeof(pattern_)) {
+			matched_ = 0;
+			pos = i + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 } // namespace px4
 
 #pragma warning(disable: 4273)
@@ -4,6 +4,7 @@
 
 #include <memory>
 #include <string>
+#include <atomic>
 #include <mutex>
 #include <map>
 #include <queue>
@@ -19,6 +20,7 @@
 #include "command.hpp"
 #include "cmd_client.hpp"
 #include "io_queue.hpp"
+#include "shared_ring.hpp"
 
 namespace px4 {
 
@@ -61,31 +63,43 @@ public:
 	const DWORD GetCurChannel(void) override;
 
 private:
+	bool OpenSharedRing(std::uint32_t data_id);
+	void Purge(bool remote);
+
 	class ReadProvider final : public IoQueue::IoProvider {
 	public:
-		explicit ReadProvider(BonDriver& parent) : parent_(parent) {}
+		explicit ReadProvider(BonDriver& parent) : parent_(parent), epoch_(0), matched_(0) {}
 		~ReadProvider() {}
 
 		bool Start() override;
 		void Stop() override;
 		bool Do(void *buf, std::size_t &size) override;
+		bool Do(void *buf, std::size_t &size, std::chrono::milliseconds timeout) override;
+		bool FindBoundary(const void *buf, std::size_t size, std::size_t &pos) override;
 
 	private:
 		BonDriver &parent_;
+		// the PurgeMarker searched for, the stream may split it anywhere
+		std::uint32_t epoch_;
+		std::uint8_t pattern_[sizeof(px4::command::PurgeMarker)];
+		std::size_t fail_[sizeof(px4::command::PurgeMarker)];
+		std::size_t matched_;
 	};
 
 	std::mutex mtx_;
 	std::wstring driver_host_path_;
-	px4::ConfigSet configs_;
+	std::shared_ptr<const px4::ConfigSet> configs_;
 	std::wstring name_;
 	px4::SystemType systems_;
-	px4::ChannelSet chset_;
+	std::shared_ptr<const px4::ChannelSet> chset_;
 	px4::ReceiverInfoSet receivers_;
 	bool lnb_power_;
 	bool lnb_power_state_;
 	std::uint32_t pipe_timeout_;
 	std::uint32_t tune_timeout_;
+	bool use_shared_ring_;
 	px4::CtrlCmdClient ctrl_client_;
+	std::uint32_t cmd_version_;
 	std::unique_ptr<px4::PipeClient> data_pipe_;
 	BOOL open_;
 	DWORD space_, ch_;
@@ -94,6 +108,8 @@ private:
 	std::mutex stream_mtx_;
 	std::unique_ptr<px4::IoQueue> ioq_;
 	ReadProvider iorp_;
+	px4::SharedRing ring_;
+	std::atomic<std::uint32_t> purge_epoch_;	// of the latest PURGE with a marker
 	std::size_t current_ofs_;
 	HANDLE quit_event_;
 };
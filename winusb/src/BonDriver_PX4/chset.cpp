@@ -2,13 +2,52 @@
 
 #include "chset.hpp"
 
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <fstream>
+#include <functional>
+
+#include <windows.h>
 
 #include "util.hpp"
 
 namespace px4 {
 
+namespace {
+
+#pragma pack(push, 4)
+struct CacheHeader {
+	std::uint32_t magic;
+	std::uint32_t version;
+	std::uint64_t source_time;	// last write time of the text file
+	std::uint64_t source_size;
+	std::uint32_t system;
+	std::uint32_t strict;
+	std::uint32_t num_spaces;
+	std::uint32_t reserved;
+};
+
+// followed by the name and the channels
+struct CacheSpace {
+	std::uint32_t name_len;
+	std::uint32_t num_channels;
+};
+
+// followed by the name
+struct CacheChannel {
+	std::uint32_t ch_id;
+	std::uint32_t ptx_ch;
+	std::uint16_t tsid;
+	std::uint16_t name_len;
+};
+#pragma pack(pop)
+
+static const std::uint32_t CACHE_MAGIC = 0x43345850;	// 'PX4C'
+static const std::uint32_t CACHE_VERSION = 1;
+
+} // namespace
+
 bool ChannelSet::Load(const std::wstring &path, px4::SystemType system) noexcept
 {
 	std::lock_guard<std::shared_mutex> lock(mtx_);
@@ -105,6 +144,27 @@ bool ChannelSet::Load(const std::wstring &path, px4::SystemType system) noexcept
 	return true;
 }
 
+bool ChannelSet::LoadCached(const std::wstring &path, px4::SystemType system) noexcept
+{
+	std::wstring cache_path;
+	std::uint64_t time, size;
+
+	// the cache holds the result of a load into an empty set only
+	if (!spaces_.empty() || !GetCachePath(path, cache_path, time, size))
+		return Load(path, system);
+
+	if (ReadCache(cache_path, time, size, system))
+		return true;
+
+	Clear();
+
+	if (!Load(path, system))
+		return false;
+
+	WriteCache(cache_path, time, size, system);
+	return true;
+}
+
 bool ChannelSet::Merge(ChannelSet &chset) noexcept
 {
 	// TODO: Space ID炷
@@ -193,6 +253,200 @@ bool ChannelSet::AddChannel(std::uint32_t space_id, std::uint32_t ch_id, const C
 	return true;
 }
 
+// the cache is in the temporary directory, the directory of the text file may not be writable
+bool ChannelSet::GetCachePath(const std::wstring &path, std::wstring &cache_path, std::uint64_t &time, std::uint64_t &size) noexcept
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	WCHAR tmp[MAX_PATH + 1];
+	DWORD len;
+
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attr))
+		return false;
+
+	time = (static_cast<std::uint64_t>(attr.ftLastWriteTime.dwHighDateTime) << 32) | attr.ftLastWriteTime.dwLowDateTime;
+	size = (static_cast<std::uint64_t>(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+
+	len = GetTempPathW(MAX_PATH + 1, tmp);
+	if (!len || len > MAX_PATH)
+		return false;
+
+	try {
+		cache_path = tmp;
+		cache_path += L"px4_chset_" + std::to_wstring(std::hash<std::wstring>()(path)) + L".bin";
+	} catch (...) {
+		return false;
+	}
+
+	return true;
+}
+
+// the file is mapped, the copies of the DLL in the other processes share the pages
+bool ChannelSet::ReadCache(const std::wstring &cache_path, std::uint64_t time, std::uint64_t size, px4::SystemType system) noexcept
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
+	HANDLE file, mapping = nullptr;
+	LARGE_INTEGER file_size;
+	const std::uint8_t *view = nullptr, *p, *end;
+	CacheHeader header;
+	bool ret = false;
+
+	file = CreateFileW(cache_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < static_cast<LONGLONG>(sizeof(header)) || file_size.QuadPart > 0x10000000)
+		goto end;
+
+	mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+		goto end;
+
+	view = static_cast<const std::uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!view)
+		goto end;
+
+	p = view;
+	end = view + file_size.QuadPart;
+
+	std::memcpy(&header, p, sizeof(header));
+	p += sizeof(header);
+
+	if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+	    header.source_time != time || header.source_size != size ||
+	    header.system != static_cast<std::uint32_t>(system) || header.strict != static_cast<std::uint32_t>(strict_))
+		goto end;
+
+	try {
+		// the records are not aligned, they are copied out
+		auto read = [&p, end](void *buf, std::size_t len) {
+			if (static_cast<std::size_t>(end - p) < len)
+				return false;
+
+			std::memcpy(buf, p, len);
+			p += len;
+			return true;
+		};
+		auto read_name = [&p, end](std::wstring &name, std::size_t len) {
+			if (static_cast<std::size_t>(end - p) / sizeof(wchar_t) < len)
+				return false;
+
+			name.resize(len);
+			std::memcpy(&name[0], p, len * sizeof(wchar_t));
+			p += len * sizeof(wchar_t);
+			return true;
+		};
+
+		for (std::uint32_t i = 0; i < header.num_spaces; i++) {
+			CacheSpace cs;
+			SpaceInfo space(system);
+
+			if (!read(&cs, sizeof(cs)) || !read_name(space.name, cs.name_len))
+				goto end;
+
+			for (std::uint32_t j = 0; j < cs.num_channels; j++) {
+				CacheChannel cc;
+				ChannelInfo ch;
+
+				if (!read(&cc, sizeof(cc)) || !read_name(ch.name, cc.name_len))
+					goto end;
+
+				ch.ptx_ch = cc.ptx_ch;
+				ch.tsid = cc.tsid;
+				space.channels.emplace(cc.ch_id, ch);
+			}
+
+			spaces_.emplace_back(std::move(space));
+		}
+	} catch (...) {
+		goto end;
+	}
+
+	next_space_id_ = header.num_spaces;
+	ret = true;
+
+end:
+	if (!ret)
+		Clear();
+
+	if (view)
+		UnmapViewOfFile(view);
+
+	if (mapping)
+		CloseHandle(mapping);
+
+	CloseHandle(file);
+
+	return ret;
+}
+
+// written aside and moved in place, another process may be reading or writing it too
+bool ChannelSet::WriteCache(const std::wstring &cache_path, std::uint64_t time, std::uint64_t size, px4::SystemType system) const noexcept
+{
+	std::shared_lock<std::shared_mutex> lock(mtx_);
+	std::string data;
+	std::wstring tmp_path;
+	HANDLE file;
+	DWORD written = 0;
+	bool ret;
+
+	try {
+		CacheHeader header = { 0 };
+		auto append = [&data](const void *buf, std::size_t len) {
+			data.append(static_cast<const char *>(buf), len);
+		};
+
+		header.magic = CACHE_MAGIC;
+		header.version = CACHE_VERSION;
+		header.source_time = time;
+		header.source_size = size;
+		header.system = static_cast<std::uint32_t>(system);
+		header.strict = strict_;
+		header.num_spaces = static_cast<std::uint32_t>(spaces_.size());
+		append(&header, sizeof(header));
+
+		for (const auto &space : spaces_) {
+			CacheSpace cs;
+
+			cs.name_len = static_cast<std::uint32_t>(space.name.size());
+			cs.num_channels = static_cast<std::uint32_t>(space.channels.size());
+			append(&cs, sizeof(cs));
+			append(space.name.data(), space.name.size() * sizeof(wchar_t));
+
+			for (const auto &ch : space.channels) {
+				CacheChannel cc;
+
+				if (ch.second.name.size() > 0xffff)
+					return false;
+
+				cc.ch_id = ch.first;
+				cc.ptx_ch = ch.second.ptx_ch;
+				cc.tsid = ch.second.tsid;
+				cc.name_len = static_cast<std::uint16_t>(ch.second.name.size());
+				append(&cc, sizeof(cc));
+				append(ch.second.name.data(), ch.second.name.size() * sizeof(wchar_t));
+			}
+		}
+
+		tmp_path = cache_path + L"." + std::to_wstring(GetCurrentProcessId());
+	} catch (...) {
+		return false;
+	}
+
+	file = CreateFileW(tmp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	ret = WriteFile(file, data.data(), static_cast<DWORD>(data.size()), &written, nullptr) && written == data.size();
+	CloseHandle(file);
+
+	if (!ret || !MoveFileExW(tmp_path.c_str(), cache_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileW(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
 void ChannelSet::Split(char **head, char **tail, char c) noexcept
 {
 	char *h = *head, *t = *tail;
@@ -38,6 +38,8 @@ public:
 	void SetStrict(bool strict) noexcept { strict_ = strict; }
 	void Clear() noexcept { spaces_.clear(); next_space_id_ = 0; }
 	bool Load(const std::wstring &path, px4::SystemType system) noexcept;
+	// Load() through a binary cache of the file, rebuilt when the file has changed
+	bool LoadCached(const std::wstring &path, px4::SystemType system) noexcept;
 	bool Merge(ChannelSet &chset) noexcept;
 	bool ExistsSpace(std::uint32_t space_id) const noexcept;
 	const std::wstring& GetSpaceName(std::uint32_t space_id) const;
@@ -49,6 +51,9 @@ private:
 	bool AddSpace(uint32_t space_id, const std::wstring *name, px4::SystemType system = px4::SystemType::UNSPECIFIED) noexcept;
 	bool AddChannel(uint32_t space_id, uint32_t ch_id, const ChannelInfo& ch) noexcept;
 	static void Split(char **head, char **tail, char c) noexcept;
+	static bool GetCachePath(const std::wstring &path, std::wstring &cache_path, std::uint64_t &time, std::uint64_t &size) noexcept;
+	bool ReadCache(const std::wstring &cache_path, std::uint64_t time, std::uint64_t size, px4::SystemType system) noexcept;
+	bool WriteCache(const std::wstring &cache_path, std::uint64_t time, std::uint64_t size, px4::SystemType system) const noexcept;
 
 	bool strict_;
 	mutable std::shared_mutex mtx_;
@@ -4,6 +4,25 @@
 
 namespace px4 {
 
+bool CtrlCmdClient::GetVersion(std::uint32_t &driver_version, std::uint32_t &cmd_version) noexcept
+{
+	px4::command::CtrlVersionCmd version_cmd;
+
+	version_cmd.cmd = px4::command::CtrlCmdCode::GET_VERSION;
+	version_cmd.status = px4::command::CtrlStatusCode::NONE;
+	version_cmd.driver_version = 0;
+	version_cmd.cmd_version = 0;
+
+	bool ret = Call(version_cmd);
+
+	if (ret) {
+		driver_version = version_cmd.driver_version;
+		cmd_version = version_cmd.cmd_version;
+	}
+
+	return ret;
+}
+
 bool CtrlCmdClient::Open(const px4::command::ReceiverInfo &in, px4::SystemType systems, px4::command::ReceiverInfo *out) noexcept
 {
 	px4::command::CtrlOpenCmd open_cmd;
@@ -114,6 +133,28 @@ bool CtrlCmdClient::Tune(std::uint32_t timeout) noexcept
 	return Call(tune_cmd);
 }
 
+bool CtrlCmdClient::TuneAsync(std::uint32_t timeout) noexcept
+{
+	px4::command::CtrlTuneCmd tune_cmd;
+
+	tune_cmd.cmd = px4::command::CtrlCmdCode::TUNE_ASYNC;
+	tune_cmd.status = px4::command::CtrlStatusCode::NONE;
+	tune_cmd.timeout = timeout;
+
+	return Call(tune_cmd);
+}
+
+bool CtrlCmdClient::WaitTune(std::uint32_t timeout) noexcept
+{
+	px4::command::CtrlTuneCmd tune_cmd;
+
+	tune_cmd.cmd = px4::command::CtrlCmdCode::WAIT_TUNE;
+	tune_cmd.status = px4::command::CtrlStatusCode::NONE;
+	tune_cmd.timeout = timeout;
+
+	return Call(tune_cmd);
+}
+
 bool CtrlCmdClient::CheckLock(bool &locked) noexcept
 {
 	px4::command::CtrlCheckLockCmd check_lock_cmd;
@@ -141,6 +182,20 @@ bool CtrlCmdClient::SetLnbVoltage(std::int32_t voltage) noexcept
 	return Call(lnb_cmd);
 }
 
+bool CtrlCmdClient::SetChannel(std::uint32_t flags, std::int32_t lnb_voltage, std::uint32_t timeout, const px4::command::ParameterSet &param_set) noexcept
+{
+	px4::command::CtrlSetChannelCmd ch_cmd;
+
+	ch_cmd.cmd = px4::command::CtrlCmdCode::SET_CHANNEL;
+	ch_cmd.status = px4::command::CtrlStatusCode::NONE;
+	ch_cmd.flags = flags;
+	ch_cmd.lnb_voltage = lnb_voltage;
+	ch_cmd.timeout = timeout;
+	ch_cmd.param_set = param_set;
+
+	return Call(ch_cmd);
+}
+
 bool CtrlCmdClient::ReadStats(px4::command::StatSet &stat_set) noexcept
 {
 	px4::command::CtrlStatsCmd stat_cmd;
@@ -157,6 +212,26 @@ bool CtrlCmdClient::ReadStats(px4::command::StatSet &stat_set) noexcept
 	return ret;
 }
 
+bool CtrlCmdClient::WaitStats(std::uint32_t timeout, std::uint32_t &sequence, px4::command::StatSet &stat_set) noexcept
+{
+	px4::command::CtrlWaitStatsCmd stat_cmd;
+
+	stat_cmd.cmd = px4::command::CtrlCmdCode::WAIT_STATS;
+	stat_cmd.status = px4::command::CtrlStatusCode::NONE;
+	stat_cmd.timeout = timeout;
+	stat_cmd.sequence = sequence;
+	stat_cmd.stat_set = stat_set;
+
+	bool ret = Call(stat_cmd);
+
+	if (ret) {
+		sequence = stat_cmd.sequence;
+		stat_set = stat_cmd.stat_set;
+	}
+
+	return ret;
+}
+
 template <typename T>
 bool CtrlCmdClient::Call(T& cmd) noexcept
 {
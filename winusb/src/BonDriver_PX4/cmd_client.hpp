@@ -27,6 +27,7 @@ public:
 	void SetPipe(std::unique_ptr<px4::PipeClient> &pipe) noexcept { pipe_ = std::move(pipe); }
 	void ClearPipe() noexcept { pipe_.reset(); }
 
+	bool GetVersion(std::uint32_t &driver_version, std::uint32_t &cmd_version) noexcept;
 	bool Open(const px4::command::ReceiverInfo &in, px4::SystemType systems, px4::command::ReceiverInfo *out) noexcept;
 	bool Close() noexcept;
 	bool GetInfo(px4::command::ReceiverInfo &receiver_info) noexcept;
@@ -35,9 +36,13 @@ public:
 	bool SetParams(const px4::command::ParameterSet &param_set) noexcept;
 	bool ClearParams() noexcept;
 	bool Tune(std::uint32_t timeout) noexcept;
+	bool TuneAsync(std::uint32_t timeout) noexcept;
+	bool WaitTune(std::uint32_t timeout) noexcept;
 	bool CheckLock(bool &locked) noexcept;
 	bool SetLnbVoltage(std::int32_t voltage) noexcept;
+	bool SetChannel(std::uint32_t flags, std::int32_t lnb_voltage, std::uint32_t timeout, const px4::command::ParameterSet &param_set) noexcept;
 	bool ReadStats(px4::command::StatSet &stat_set) noexcept;
+	bool WaitStats(std::uint32_t timeout, std::uint32_t &sequence, px4::command::StatSet &stat_set) noexcept;
 
 private:
 	template <typename T> bool Call(T &cmd) noexcept;
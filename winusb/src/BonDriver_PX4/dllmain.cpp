@@ -3,6 +3,7 @@
 #include <windows.h>
 
 #include "util.hpp"
+#include "msg.h"
 
 BOOL WINAPI DllMain(HANDLE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 {
@@ -12,6 +13,9 @@ BOOL WINAPI DllMain(HANDLE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 	case DLL_PROCESS_ATTACH:
 		if (!px4::util::path::Init(hinstDLL))
 			ret = FALSE;
+
+		// the diagnostics of the stream are seen with a debugger only
+		msg_set_mode(MSG_MODE_DEBUGGER);
 		break;
 
 	default:
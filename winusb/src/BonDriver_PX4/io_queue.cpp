@@ -8,68 +8,96 @@
 #include "io_queue.hpp"
 
 #include <cstring>
-#include <utility>
+#include <algorithm>
 
 namespace px4 {
 
-IoQueue::IoQueue(IoOperation io_op, IoProvider &iop, std::size_t buf_size, std::uintptr_t max, std::uintptr_t min, int data_ignore_count)
+// the fill rate is measured and the queue adapted by intervals of this length
+#define IOQUEUE_ADAPT_INTERVAL	1000
+// the time a buffer is given to be filled in
+#define IOQUEUE_FILL_TIME	50
+
+IoQueue::IoQueue(IoOperation io_op, IoProvider &iop, std::size_t buf_size, std::size_t num, int data_ignore_count)
 	: io_op_(io_op),
 	iop_(iop),
 	buf_size_(buf_size),
-	max_(max),
-	min_(min),
-	total_buf_num_(0),
+	num_((num) ? num : 1),
+	min_buf_size_(buf_size_),
+	min_num_(num_),
+	unit_size_(1),
+	max_latency_(0),
+	write_pos_(0),
+	read_pos_(0),
+	closed_(false),
+	data_waiters_(0),
+	free_waiters_(0),
+	holding_(false),
 	current_ofs_(0),
 	data_ignore_count_(data_ignore_count),
-	data_ignore_remain_(0)
+	data_ignore_remain_(0),
+	purge_seq_(0),
+	depth_(num_),
+	fill_size_(buf_size_),
+	fill_rate_(0),
+	overflow_count_(0),
+	drain_time_(0),
+	drain_gap_max_(0)
 {
-	while (min--)
-		IncreaseFreeBuffer();
+	pool_.reset(new std::uint8_t[buf_size_ * num_]);
+	slots_.reset(new IoBuffer[num_]);
+
+	for (std::size_t i = 0; i < num_; i++) {
+		slots_[i].buf = pool_.get() + (buf_size_ * i);
+		slots_[i].actual_length = 0;
+		slots_[i].purge_seq = 0;
+	}
 }
 
 IoQueue::~IoQueue()
 {
 	Stop();
-	data_buf_.clear();
-	free_buf_.clear();
 }
 
-bool IoQueue::Start()
+void IoQueue::SetAdaptiveBounds(std::size_t min_buf_size, std::size_t min_num, std::size_t unit_size)
 {
 	std::lock_guard<std::mutex> lock(mtx_);
 
-	if (th_)
-		return true;
-
-	std::unique_lock<std::mutex> free_lock(free_mtx_);
-	std::unique_lock<std::mutex> data_lock(data_mtx_);
+	if (th_ || io_op_ != IoOperation::READ)
+		return;
 
-	for (auto it = free_buf_.begin(); it != free_buf_.end();) {
-		if (!*it)
-			it = free_buf_.erase(it);
-		else
-			++it;
-	}
+	unit_size_ = (unit_size && unit_size <= buf_size_) ? unit_size : 1;
+	min_buf_size_ = std::min(std::max(min_buf_size - (min_buf_size % unit_size_), unit_size_), buf_size_);
+	min_num_ = std::min(std::max(min_num, static_cast<std::size_t>(1)), num_);
+}
 
-	if (current_buf_) {
-		free_buf_.push_back(std::move(current_buf_));
-		current_ofs_ = 0;
-	}
+void IoQueue::SetMaxLatency(std::chrono::milliseconds latency)
+{
+	std::lock_guard<std::mutex> lock(mtx_);
 
-	while (!data_buf_.empty()) {
-		auto buf = std::move(data_buf_.front());
-		data_buf_.pop_front();
+	if (th_ || io_op_ != IoOperation::READ)
+		return;
 
-		if (!buf)
-			continue;
+	max_latency_ = (latency.count() > 0) ? latency : std::chrono::milliseconds(0);
+}
 
-		free_buf_.push_back(std::move(buf));
-	}
+bool IoQueue::Start()
+{
+	std::lock_guard<std::mutex> lock(mtx_);
 
-	free_lock.unlock();
-	free_cond_.notify_all();
+	if (th_)
+		return true;
 
-	data_lock.unlock();
+	write_pos_ = 0;
+	read_pos_ = 0;
+	closed_ = false;
+	holding_ = false;
+	current_ofs_ = 0;
+	depth_ = num_;
+	fill_size_ = buf_size_;
+	fill_rate_ = 0;
+	overflow_count_ = 0;
+	drain_time_ = 0;
+	drain_gap_max_ = 0;
 
 	th_.reset(new std::thread((io_op_ == IoOperation::READ) ? &px4::IoQueue::ReadWorker : &px4::IoQueue::WriteWorker, this));
 	return true;
@@ -82,19 +110,10 @@ bool IoQueue::Stop()
 	if (!th_)
 		return true;
 
-	if (io_op_ == IoOperation::READ) {
-		// stop ReadWorker
-		PushBackFreeBuffer(nullptr);
-	} else {
-		if (current_buf_) {
-			// flush
-			PushBackDataBuffer(std::move(current_buf_));
-			current_ofs_ = 0;
-		}
-
-		// stop WriteWorker
-		PushBackDataBuffer(nullptr);
-	}
+	// the WriteWorker flushes the remaining data before it quits
+	closed_ = true;
+	Notify(data_cond_, data_waiters_);
+	Notify(free_cond_, free_waiters_);
 
 	try {
 		th_->join();
@@ -106,58 +125,57 @@ bool IoQueue::Stop()
 
 std::size_t IoQueue::GetDataBufferCount() const
 {
-	std::lock_guard<std::mutex> lock(data_mtx_);
-
-	return data_buf_.size();
+	return DataCount();
 }
 
 std::size_t IoQueue::GetFreeBufferCount() const
 {
-	std::lock_guard<std::mutex> lock(free_mtx_);
+	std::size_t n = write_pos_.load() - read_pos_.load(), depth = depth_.load();
 
-	return free_buf_.size();
+	return (n < depth) ? depth - n : 0;
 }
 
-bool IoQueue::WaitDataBuffer(std::chrono::milliseconds ms)
+IoQueue::Stats IoQueue::GetStats() const
 {
-	std::lock_guard<std::mutex> lock(mtx_);
-	std::unique_lock<std::mutex> data_lock(data_mtx_);
+	Stats stats;
+
+	stats.num = depth_.load();
+	stats.fill_size = fill_size_.load();
+	stats.fill_rate = fill_rate_.load();
+	stats.overflow_count = overflow_count_.load();
 
-	if (data_buf_.size())
+	return stats;
+}
+
+bool IoQueue::WaitDataBuffer(std::chrono::milliseconds ms)
+{
+	if (DataCount())
 		return true;
 
-	if (ms.count()) {
-		if (data_cond_.wait_for(data_lock, ms) == std::cv_status::timeout)
-			return false;
-	} else {
-		data_cond_.wait(data_lock);
-	}
+	WaitFor(data_cond_, data_waiters_, true, ms);
 
-	return true;
+	return !!DataCount();
 }
 
-void IoQueue::PurgeDataBuffer()
+// until_boundary: the data is dropped up to the boundary found by the provider instead of
+// a fixed number of buffers, which must be requested before the boundary can be read
+void IoQueue::PurgeDataBuffer(bool until_boundary)
 {
-	std::lock_guard<std::mutex> lock(mtx_);
-	std::unique_lock<std::mutex> free_lock(free_mtx_);
-	std::lock_guard<std::mutex> data_lock(data_mtx_);
-
-	if (current_buf_) {
-		free_buf_.push_back(std::move(current_buf_));
-		current_ofs_ = 0;
-	}
+	if (io_op_ != IoOperation::READ)
+		return;
 
-	while (!data_buf_.empty()) {
-		auto buf = std::move(data_buf_.front());
-		data_buf_.pop_front();
+	std::lock_guard<std::mutex> lock(mtx_);
 
-		free_buf_.push_back(std::move(buf));
-	}
+	if (until_boundary)
+		purge_seq_++;
+	else
+		data_ignore_remain_ = data_ignore_count_;
 
-	data_ignore_remain_ = data_ignore_count_;
+	holding_ = false;
+	current_ofs_ = 0;
+	read_pos_ = write_pos_.load();
 
-	free_lock.unlock();
-	free_cond_.notify_all();
+	Notify(free_cond_, free_waiters_);
 
 	return;
 }
@@ -173,16 +191,19 @@ bool IoQueue::Read(void *buf, std::size_t &size, std::size_t &remain_count, bool
 	std::size_t remain = size;
 
 	while (remain) {
-		if (!current_buf_) {
-			current_buf_ = PopFrontDataBuffer(blocking);
-			if (!current_buf_)
+		if (!holding_) {
+			if (!AcquireDataBuffer(blocking))
 				break;
+
+			holding_ = true;
+			current_ofs_ = 0;
+			NoteDrain();
 		}
 
-		auto buf = current_buf_.get();
-		std::size_t rlen = ((buf->actual_length - current_ofs_) < remain) ? (buf->actual_length - current_ofs_) : remain;
+		auto &b = Slot(read_pos_.load(std::memory_order_relaxed));
+		std::size_t rlen = ((b.actual_length - current_ofs_) < remain) ? (b.actual_length - current_ofs_) : remain;
 
-		std::memcpy(p, buf->buf.get() + current_ofs_, rlen);
+		std::memcpy(p, b.buf + current_ofs_, rlen);
 
 		current_ofs_ += rlen;
 		p += rlen;
@@ -190,14 +211,14 @@ bool IoQueue::Read(void *buf, std::size_t &size, std::size_t &remain_count, bool
 
 		ret = true;
 
-		if (buf->actual_length == current_ofs_) {
-			PushBackFreeBuffer(std::move(current_buf_));
-			current_ofs_ = 0;
+		if (b.actual_length == current_ofs_) {
+			holding_ = false;
+			ReleaseDataBuffer();
 		}
 	}
 
 	size -= remain;
-	remain_count = GetDataBufferCount() + ((current_buf_) ? 1 : 0);
+	remain_count = DataCount() + ((holding_) ? 1 : 0);
 
 	return ret;
 }
@@ -211,28 +232,34 @@ bool IoQueue::ReadBuffer(void **buf, std::size_t &size, std::size_t &remain_coun
 
 	std::lock_guard<std::mutex> lock(mtx_);
 
-	if (current_buf_ && current_buf_->actual_length == current_ofs_) {
-		PushBackFreeBuffer(std::move(current_buf_));
-		current_ofs_ = 0;
+	if (holding_ && Slot(read_pos_.load(std::memory_order_relaxed)).actual_length == current_ofs_) {
+		// the buffer returned by the previous call is given back here
+		holding_ = false;
+		ReleaseDataBuffer();
 	}
 
-	if (!current_buf_) {
-		current_buf_ = PopFrontDataBuffer(blocking);
-		if (!current_buf_)
+	if (!holding_) {
+		if (!AcquireDataBuffer(blocking))
 			return false;
+
+		holding_ = true;
+		current_ofs_ = 0;
+		NoteDrain();
 	}
 
-	*buf = current_buf_->buf.get() + current_ofs_;
-	size = current_buf_->actual_length - current_ofs_;
-	current_ofs_ = current_buf_->actual_length;
-	remain_count = GetDataBufferCount();
+	auto &b = Slot(read_pos_.load(std::memory_order_relaxed));
+
+	*buf = b.buf + current_ofs_;
+	size = b.actual_length - current_ofs_;
+	current_ofs_ = b.actual_length;
+	remain_count = DataCount();
 
 	return true;
 }
 
 bool IoQueue::HaveReadingBuffer()
 {
-	return !!current_buf_;
+	return holding_ && Slot(read_pos_.load(std::memory_order_relaxed)).actual_length != current_ofs_;
 }
 
 bool IoQueue::Write(void *buf, std::size_t &size, bool blocking)
@@ -241,187 +268,297 @@ bool IoQueue::Write(void *buf, std::size_t &size, bool blocking)
 	return false;
 }
 
-bool IoQueue::IncreaseFreeBuffer()
+std::size_t IoQueue::DataCount() const
 {
-	if (total_buf_num_ >= max_)
-		return false;
-
-	auto buf = new IoBuffer;
+	std::size_t n = write_pos_.load() - read_pos_.load();
 
-	buf->buf.reset(new std::uint8_t[buf_size_]);
-	buf->actual_length = 0;
+	return (holding_ && n) ? n - 1 : n;
+}
 
-	free_buf_.emplace_front(buf);
-	total_buf_num_++;
+bool IoQueue::IsFull() const
+{
+	return (write_pos_.load() - read_pos_.load()) >= depth_.load();
+}
 
-	return true;
+static std::int64_t SteadyMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void IoQueue::DecreaseFreeBuffer()
+// a buffer has been taken by the client
+void IoQueue::NoteDrain()
 {
-	if (free_buf_.empty() || !free_buf_.front())
+	std::int64_t now = SteadyMs(), prev = drain_time_.exchange(now), gap, max;
+
+	if (!prev)
 		return;
 
-	free_buf_.pop_front();
-	total_buf_num_--;
+	gap = now - prev;
+	max = drain_gap_max_.load();
 
-	return;
+	while (gap > max && !drain_gap_max_.compare_exchange_weak(max, gap));
 }
 
-bool IoQueue::PushBackDataBuffer(std::unique_ptr<IoBuffer> &&buf)
+// Worker only. The fill size follows the rate so that a buffer is completed in IOQUEUE_FILL_TIME,
+// the depth covers twice the longest wait of the client and grows at once on an overflow.
+void IoQueue::Adapt(std::uint64_t bytes, std::chrono::milliseconds elapsed, bool overflowed)
 {
-	std::unique_lock<std::mutex> lock(data_mtx_);
+	std::uint64_t rate = (elapsed.count() > 0) ? (bytes * 1000 / elapsed.count()) : 0;
+	std::size_t fill = fill_size_.load(), depth = depth_.load();
 
-	if (data_ignore_remain_ > 0) {
-		data_ignore_remain_--;
-		lock.unlock();
-		return PushBackFreeBuffer(std::move(buf));
+	fill_rate_ = rate;
+
+	if (min_buf_size_ < buf_size_ && rate) {
+		fill = static_cast<std::size_t>(std::min<std::uint64_t>(rate * IOQUEUE_FILL_TIME / 1000, buf_size_));
+		fill = std::min(std::max(fill - (fill % unit_size_), min_buf_size_), buf_size_);
+		fill_size_ = fill;
 	}
 
-	data_buf_.push_back(std::move(buf));
+	if (min_num_ < num_) {
+		std::int64_t last = drain_time_.load(), gap = drain_gap_max_.exchange(0);
+		std::size_t target;
 
-	lock.unlock();
-	data_cond_.notify_all();
+		// the client may not have read anything since
+		if (last)
+			gap = std::max(gap, SteadyMs() - last);
 
-	return true;
+		target = static_cast<std::size_t>(std::min<std::uint64_t>(rate * static_cast<std::uint64_t>(gap) / 1000 / fill + 1, num_) * 2);
+		target = std::min(std::max(target, min_num_), num_);
+
+		if (overflowed)
+			depth = std::max(target, depth);
+		else if (target < depth)
+			depth--;	// step by step, a single quick read shouldn't take the slack away
+		else
+			depth = target;
+
+		depth_ = depth;
+	}
+
+	return;
 }
 
-bool IoQueue::PushBackFreeBuffer(std::unique_ptr<IoBuffer> &&buf)
+bool IoQueue::WaitFor(std::condition_variable &cond, std::atomic<int> &waiters, bool data, std::chrono::milliseconds ms)
 {
-	std::unique_lock<std::mutex> lock(free_mtx_);
+	bool ret = true;
+	// the waiter count is raised before the condition is checked again, so that
+	// the other side can't advance its position without seeing a sleeper
+	waiters++;
 
-	free_buf_.push_back(std::move(buf));
+	{
+		std::unique_lock<std::mutex> lock(wait_mtx_);
+		auto ready = [this, data] { return closed_ || ((data) ? !!DataCount() : !IsFull()); };
 
-	lock.unlock();
-	free_cond_.notify_all();
+		if (ms.count())
+			ret = cond.wait_for(lock, ms, ready);
+		else
+			cond.wait(lock, ready);
+	}
 
-	return true;
+	waiters--;
+	return ret;
 }
 
-std::unique_ptr<IoQueue::IoBuffer> IoQueue::PopFrontDataBuffer(bool wait)
+void IoQueue::Notify(std::condition_variable &cond, std::atomic<int> &waiters)
 {
-	std::unique_lock<std::mutex> lock(data_mtx_);
-
-	if (data_buf_.empty()) {
-		if (wait) {
-			do {
-				data_cond_.wait(lock);
-			} while (data_buf_.empty());
-		} else {
-			return nullptr;
-		}
-	}
-
-	auto buf = std::move(data_buf_.front());
-	data_buf_.pop_front();
+	if (!waiters)
+		return;
 
-	if (!buf)
-		data_buf_.push_front(nullptr);
+	{
+		std::lock_guard<std::mutex> lock(wait_mtx_);
+	}
 
-	return buf;
+	cond.notify_all();
 }
 
-std::unique_ptr<IoQueue::IoBuffer> IoQueue::PopBackFreeBuffer(bool wait)
+IoQueue::IoBuffer* IoQueue::AcquireDataBuffer(bool wait)
 {
-	std::unique_lock<std::mutex> lock(free_mtx_);
-
-	auto size = free_buf_.size();
-	if (!size) {
-		if (!IncreaseFreeBuffer()) {
-			if (wait) {
-				do {
-					free_cond_.wait(lock);
-				} while (free_buf_.empty());
-			} else {
+	while (true) {
+		while (write_pos_.load() == read_pos_.load(std::memory_order_relaxed)) {
+			if (!wait || closed_)
 				return nullptr;
-			}
+
+			WaitFor(data_cond_, data_waiters_, true, std::chrono::milliseconds(0));
 		}
-	} else if (size > min_) {
-		DecreaseFreeBuffer();
-	}
 
-	auto buf = std::move(free_buf_.back());
-	free_buf_.pop_back();
+		auto &b = Slot(read_pos_.load(std::memory_order_relaxed));
 
-	if (!buf)
-		free_buf_.push_back(nullptr);
+		// committed by the worker while a purge was being requested
+		if (b.purge_seq == purge_seq_.load())
+			return &b;
 
-	return buf;
+		ReleaseDataBuffer();
+	}
 }
 
-void IoQueue::ReadWorker()
+void IoQueue::ReleaseDataBuffer()
 {
-	if (!iop_.Start())
-		return;
+	read_pos_ = read_pos_.load(std::memory_order_relaxed) + 1;
+	Notify(free_cond_, free_waiters_);
+}
 
-	while (true) {
-		auto buf = PopBackFreeBuffer(true);
-		if (!buf) {
-			PushBackDataBuffer(nullptr);
-			break;
-		}
+IoQueue::IoBuffer* IoQueue::AcquireFreeBuffer(bool wait)
+{
+	if (!closed_ && IsFull()) {
+		std::size_t depth = depth_.load();
+
+		overflow_count_++;
+
+		// more of the pool is put in use rather than waiting
+		if (depth < num_)
+			depth_ = std::min(depth * 2, num_);
+	}
+
+	while (!closed_ && IsFull()) {
+		if (!wait)
+			return nullptr;
+
+		WaitFor(free_cond_, free_waiters_, false, std::chrono::milliseconds(0));
+	}
+
+	if (closed_)
+		return nullptr;
+
+	return &Slot(write_pos_.load(std::memory_order_relaxed));
+}
 
-		std::size_t rofs = 0;
-		bool quit = false;
+void IoQueue::CommitDataBuffer()
+{
+	int n = data_ignore_remain_;
+
+	while (n > 0) {
+		// the slot is reused for the next data
+		if (data_ignore_remain_.compare_exchange_weak(n, n - 1))
+			return;
+	}
 
-		while (rofs < buf_size_) {
-			std::size_t rlen = buf_size_ - rofs;
+	write_pos_ = write_pos_.load(std::memory_order_relaxed) + 1;
+	Notify(data_cond_, data_waiters_);
+}
 
-			if (!iop_.Do(buf->buf.get() + rofs, rlen)) {
-				quit = true;
+void IoQueue::ReadWorker()
+{
+	std::uint32_t purge_seq = purge_seq_.load();
+	auto interval_start = std::chrono::steady_clock::now();
+	std::uint64_t interval_bytes = 0, overflow_count = 0;
+
+	if (iop_.Start()) {
+		while (true) {
+			auto buf = AcquireFreeBuffer(true);
+			if (!buf)
 				break;
+
+			std::size_t rofs = 0, fill = fill_size_.load();
+			std::chrono::steady_clock::time_point deadline;
+			bool quit = false;
+
+			while (rofs < fill) {
+				std::size_t rlen = fill - rofs;
+				std::uint32_t seq;
+				bool ret;
+
+				if (rofs && max_latency_.count()) {
+					// the data in the buffer is published when the deadline passes, whatever the bitrate
+					auto now = std::chrono::steady_clock::now();
+
+					if (now >= deadline)
+						break;
+
+					ret = iop_.Do(buf->buf + rofs, rlen, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1));
+				} else {
+					ret = iop_.Do(buf->buf + rofs, rlen);
+				}
+
+				if (!ret) {
+					quit = true;
+					break;
+				}
+
+				// taken after the read, the boundary of the latest purge may be in the data
+				seq = purge_seq_.load();
+				if (seq != purge_seq) {
+					std::size_t pos;
+
+					// older than the purge, along with what is in the buffer already
+					if (!iop_.FindBoundary(buf->buf + rofs, rlen, pos)) {
+						rofs = 0;
+						continue;
+					}
+
+					std::memmove(buf->buf, buf->buf + rofs + pos, rlen - pos);
+					rofs = 0;
+					rlen -= pos;
+					purge_seq = seq;
+				}
+
+				if (!rofs && rlen)
+					deadline = std::chrono::steady_clock::now() + max_latency_;
+
+				rofs += rlen;
 			}
 
-			rofs += rlen;
-		}
+			buf->actual_length = rofs;
+			buf->purge_seq = purge_seq;
+			if (rofs)
+				CommitDataBuffer();
 
-		buf->actual_length = rofs;
-		PushBackDataBuffer(std::move(buf));
+			interval_bytes += rofs;
 
-		if (quit) {
-			PushBackDataBuffer(nullptr);
-			break;
+			auto now = std::chrono::steady_clock::now();
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - interval_start);
+
+			if (elapsed.count() >= IOQUEUE_ADAPT_INTERVAL) {
+				Adapt(interval_bytes, elapsed, overflow_count_.load() != overflow_count);
+
+				interval_start = now;
+				interval_bytes = 0;
+				overflow_count = overflow_count_.load();
+			}
+
+			if (quit)
+				break;
 		}
+
+		iop_.Stop();
 	}
 
-	iop_.Stop();
+	closed_ = true;
+	Notify(data_cond_, data_waiters_);
 }
 
 void IoQueue::WriteWorker()
 {
-	if (!iop_.Start())
-		return;
+	if (iop_.Start()) {
+		while (true) {
+			auto buf = AcquireDataBuffer(true);
+			if (!buf)
+				break;
 
-	while (true) {
-		auto buf = PopFrontDataBuffer(true);
-		if (!buf) {
-			PushBackFreeBuffer(nullptr);
-			break;
-		}
+			std::size_t len = buf->actual_length, wofs = 0;
+			bool quit = false;
 
-		std::size_t len = buf->actual_length, wofs = 0;
-		bool quit = false;
+			while (wofs < len) {
+				std::size_t wlen = len - wofs;
 
-		while (wofs < len) {
-			std::size_t wlen = len - wofs;
+				if (!iop_.Do(buf->buf + wofs, wlen)) {
+					quit = true;
+					break;
+				}
 
-			if (!iop_.Do(buf->buf.get() + wofs, wlen)) {
-				quit = true;
-				break;
+				wofs += wlen;
 			}
 
-			wofs += wlen;
-		}
+			ReleaseDataBuffer();
 
-		PushBackFreeBuffer(std::move(buf));
-
-		if (quit) {
-			PushBackFreeBuffer(nullptr);
-			break;
+			if (quit)
+				break;
 		}
+
+		iop_.Stop();
 	}
 
-	iop_.Stop();
+	closed_ = true;
+	Notify(free_cond_, free_waiters_);
 }
 
 } // namespace px4
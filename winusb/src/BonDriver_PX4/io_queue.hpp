@@ -6,13 +6,16 @@
 #include <cstdint>
 #include <memory>
 #include <chrono>
+#include <atomic>
 #include <mutex>
-#include <deque>
 #include <condition_variable>
 #include <thread>
 
 namespace px4 {
 
+// Fixed ring of preallocated buffers shared between the worker thread and a single client.
+// A buffer returned by ReadBuffer() stays valid until the next call of Read(), ReadBuffer(),
+// PurgeDataBuffer() or Stop(); the worker does not reuse it before that.
 class IoQueue final {
 public:
 	enum class IoOperation : int {
@@ -21,8 +24,16 @@ public:
 	};
 
 	struct IoBuffer final {
-		std::unique_ptr<std::uint8_t[]> buf;
+		std::uint8_t *buf;
 		std::size_t actual_length;
+		std::uint32_t purge_seq;	// the purge the data is newer than
+	};
+
+	struct Stats final {
+		std::size_t num;		// buffers the worker may fill ahead of the client
+		std::size_t fill_size;		// bytes the worker puts in a buffer
+		std::uint64_t fill_rate;	// bytes per second over the last interval
+		std::uint64_t overflow_count;	// times the worker has found no free buffer
 	};
 
 	class IoProvider {
@@ -33,22 +44,34 @@ public:
 		virtual bool Start() = 0;
 		virtual void Stop() = 0;
 		virtual bool Do(void *buf, std::size_t &size) = 0;
+		// READ: may return with size 0 once the timeout has passed
+		virtual bool Do(void *buf, std::size_t &size, std::chrono::milliseconds timeout) { return Do(buf, size); }
+		// READ: called for the data read after PurgeDataBuffer(true) until it returns true,
+		// pos is set to the offset of the first byte newer than the purge then
+		virtual bool FindBoundary(const void *buf, std::size_t size, std::size_t &pos) { pos = 0; return true; }
 	};
 
-	IoQueue(IoOperation io_op, IoProvider &iop, std::size_t buf_size, std::uintptr_t max = 32, std::uintptr_t min = 2, int data_ignore_count = 1);
+	IoQueue(IoOperation io_op, IoProvider &iop, std::size_t buf_size, std::size_t num = 32, int data_ignore_count = 1);
 	~IoQueue();
 
 	// cannot copy
 	IoQueue(const IoQueue &) = delete;
 	IoQueue& operator=(const IoQueue &) = delete;
 
+	// READ: the depth and the fill size are adapted between these and the ones of the constructor,
+	// the fill size in multiples of unit_size. Must be called before Start().
+	void SetAdaptiveBounds(std::size_t min_buf_size, std::size_t min_num, std::size_t unit_size);
+	// READ: a buffer is committed partially filled once its first data is older than this, 0 to disable
+	void SetMaxLatency(std::chrono::milliseconds latency);
+
 	bool Start();
 	bool Stop();
 
 	std::size_t GetDataBufferCount() const;
 	std::size_t GetFreeBufferCount() const;
+	Stats GetStats() const;
 	bool WaitDataBuffer(std::chrono::milliseconds ms);
-	void PurgeDataBuffer();
+	void PurgeDataBuffer(bool until_boundary = false);
 
 	bool Read(void *buf, std::size_t &size, std::size_t &remain_count, bool blocking);
 	bool ReadBuffer(void **buf, std::size_t &size, std::size_t &remain_count, bool blocking);
@@ -56,12 +79,17 @@ public:
 	bool Write(void *buf, std::size_t &size, bool blocking);
 
 private:
-	bool IncreaseFreeBuffer();
-	void DecreaseFreeBuffer();
-	bool PushBackDataBuffer(std::unique_ptr<IoBuffer> &&buf);
-	bool PushBackFreeBuffer(std::unique_ptr<IoBuffer> &&buf);
-	std::unique_ptr<IoBuffer> PopFrontDataBuffer(bool wait);
-	std::unique_ptr<IoBuffer> PopBackFreeBuffer(bool wait);
+	IoBuffer& Slot(std::size_t pos) const { return slots_[pos % num_]; }
+	std::size_t DataCount() const;
+	bool IsFull() const;
+	void NoteDrain();
+	void Adapt(std::uint64_t bytes, std::chrono::milliseconds elapsed, bool overflowed);
+	bool WaitFor(std::condition_variable &cond, std::atomic<int> &waiters, bool data, std::chrono::milliseconds ms);
+	void Notify(std::condition_variable &cond, std::atomic<int> &waiters);
+	IoBuffer* AcquireDataBuffer(bool wait);
+	void ReleaseDataBuffer();
+	IoBuffer* AcquireFreeBuffer(bool wait);
+	void CommitDataBuffer();
 
 	void ReadWorker();
 	void WriteWorker();
@@ -69,20 +97,34 @@ private:
 	IoOperation io_op_;
 	IoProvider &iop_;
 	std::size_t buf_size_;
-	std::uintptr_t max_;
-	std::uintptr_t min_;
-	std::mutex mtx_;
-	std::size_t total_buf_num_;
-	std::deque<std::unique_ptr<IoBuffer>> data_buf_;
-	mutable std::mutex data_mtx_;
-	std::deque<std::unique_ptr<IoBuffer>> free_buf_;
-	mutable std::mutex free_mtx_;
+	std::size_t num_;
+	std::size_t min_buf_size_;
+	std::size_t min_num_;
+	std::size_t unit_size_;
+	std::chrono::milliseconds max_latency_;
+	std::unique_ptr<std::uint8_t[]> pool_;
+	std::unique_ptr<IoBuffer[]> slots_;
+	std::mutex mtx_;	// serializes the client side
+	std::atomic<std::size_t> write_pos_;	// owned by the producer
+	std::uint8_t pad_[64];	// keep the positions on separate cache lines
+	std::atomic<std::size_t> read_pos_;	// owned by the consumer
+	std::atomic_bool closed_;
+	std::mutex wait_mtx_;	// only taken to sleep and to wake a sleeper up
 	std::condition_variable data_cond_;
 	std::condition_variable free_cond_;
-	std::unique_ptr<IoBuffer> current_buf_;
+	std::atomic<int> data_waiters_;
+	std::atomic<int> free_waiters_;
+	bool holding_;
 	std::size_t current_ofs_;
 	int data_ignore_count_;
-	int data_ignore_remain_;
+	std::atomic<int> data_ignore_remain_;
+	std::atomic<std::uint32_t> purge_seq_;	// raised by PurgeDataBuffer(true)
+	std::atomic<std::size_t> depth_;	// adapted by the worker
+	std::atomic<std::size_t> fill_size_;	// adapted by the worker
+	std::atomic<std::uint64_t> fill_rate_;
+	std::atomic<std::uint64_t> overflow_count_;
+	std::atomic<std::int64_t> drain_time_;	// ms of the steady clock, 0 until the client reads
+	std::atomic<std::int64_t> drain_gap_max_;	// the longest time between the reads of the client
 	std::unique_ptr<std::thread> th_;
 };
 
@@ -2,10 +2,12 @@
 
 #include "ctrl_server.hpp"
 
+#include <cerrno>
+
 namespace px4 {
 
-CtrlServer::CtrlServer(px4::ReceiverManager &receiver_manager)
-	: ServerBase(L"px4_ctrl_pipe", receiver_manager)
+CtrlServer::CtrlServer(px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool)
+	: ServerBase(L"px4_ctrl_pipe", receiver_manager, io_pool)
 {
 	pipe_config_.in_buffer_size = 512;
 	pipe_config_.out_buffer_size = 512;
@@ -20,200 +22,297 @@ px4::ServerBase::Connection* CtrlServer::CreateConnection(std::unique_ptr<px4::P
 }
 
 CtrlServer::CtrlConnection::CtrlConnection(ServerBase &parent, std::unique_ptr<px4::PipeServer> &pipe) noexcept
-	: Connection(parent, pipe)
+	: Connection(parent, pipe),
+	info_({ 0 }),
+	receiver_(nullptr),
+	data_id_(0),
+	tune_pending_(false),
+	tune_result_(false)
 {
 
 }
 
-void CtrlServer::CtrlConnection::Worker() noexcept
+// runs on the I/O pool, the commands which block make it start another worker
+bool CtrlServer::CtrlConnection::OnRead(std::size_t size) noexcept
 {
-	std::size_t size = config_.in_buffer_size;
-	std::unique_ptr<std::uint8_t[]> buf(new std::uint8_t[size]);
-	px4::command::ReceiverInfo info = { 0 };
-	px4::ReceiverBase *receiver = nullptr;
+	px4::command::CtrlCmdHeader *hdr = reinterpret_cast<px4::command::CtrlCmdHeader *>(buf_.get());
+
+	switch (hdr->cmd) {
+	case px4::command::CtrlCmdCode::GET_VERSION:
+	{
+		px4::command::CtrlVersionCmd *version = reinterpret_cast<px4::command::CtrlVersionCmd *>(buf_.get());
+
+		version->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		version->driver_version = 0x00040000;
+		version->cmd_version = px4::command::VERSION;
+
+		break;
+	}
 
-	while (true) {
-		bool ret = true;
-		std::size_t read;
+	case px4::command::CtrlCmdCode::OPEN:
+	{
+		if (receiver_) {
+			receiver_manager_.Close(data_id_);
+			receiver_ = nullptr;
+		}
 
-		if (!conn_->Read(buf.get(), size, read, quit_event_))
-			break;
+		px4::command::CtrlOpenCmd *open = reinterpret_cast<px4::command::CtrlOpenCmd *>(buf_.get());
 
-		px4::command::CtrlCmdHeader *hdr = reinterpret_cast<px4::command::CtrlCmdHeader *>(buf.get());
+		receiver_ = receiver_manager_.SearchAndOpen(open->receiver_info, info_, data_id_);
+		if (receiver_)
+			open->receiver_info = info_;
 
-		switch (hdr->cmd) {
-		case px4::command::CtrlCmdCode::GET_VERSION:
-		{
-			px4::command::CtrlVersionCmd *version = reinterpret_cast<px4::command::CtrlVersionCmd *>(buf.get());
+		open->status = (receiver_) ? px4::command::CtrlStatusCode::SUCCEEDED : px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
 
-			version->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			version->driver_version = 0x00040000;
-			version->cmd_version = px4::command::VERSION;
+	case px4::command::CtrlCmdCode::CLOSE:
+		if (receiver_) {
+			receiver_manager_.Close(data_id_);
+			receiver_ = nullptr;
+			info_ = { 0 };
 
-			break;
+			hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		} else {
+			hdr->status = px4::command::CtrlStatusCode::FAILED;
 		}
 
-		case px4::command::CtrlCmdCode::OPEN:
-		{
-			if (receiver) {
-				receiver->Close();
-				receiver_manager_.ClearDataId(receiver);
-				receiver = nullptr;
-			}
-
-			px4::command::CtrlOpenCmd *open = reinterpret_cast<px4::command::CtrlOpenCmd *>(buf.get());
-			std::uint32_t data_id;
-
-			receiver = receiver_manager_.SearchAndOpen(open->receiver_info, info, data_id);
-			if (receiver) {
-				open->receiver_info = info;
-				open->receiver_info.data_id = data_id;
-			}
-
-			open->status = (receiver) ? px4::command::CtrlStatusCode::SUCCEEDED : px4::command::CtrlStatusCode::FAILED;
-			break;
+		break;
+
+	case px4::command::CtrlCmdCode::GET_INFO:
+	{
+		px4::command::CtrlReceiverInfoCmd *receiver_info = reinterpret_cast<px4::command::CtrlReceiverInfoCmd *>(buf_.get());
+
+		if (receiver_) {
+			receiver_info->receiver_info = info_;
+			hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		} else {
+			hdr->status = px4::command::CtrlStatusCode::FAILED;
 		}
 
-		case px4::command::CtrlCmdCode::CLOSE:
-			if (receiver) {
-				receiver->Close();
-				receiver_manager_.ClearDataId(receiver);
-				receiver = nullptr;
-				info = { 0 };
+		break;
+	}
 
-				hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			} else {
-				hdr->status = px4::command::CtrlStatusCode::FAILED;
-			}
+	case px4::command::CtrlCmdCode::SET_CAPTURE:
+	{
+		px4::command::CtrlCaptureCmd *capture = reinterpret_cast<px4::command::CtrlCaptureCmd *>(buf_.get());
 
-			break;
+		if (receiver_ && !receiver_manager_.SetCapture(data_id_, (capture->capture) ? true : false))
+			capture->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			capture->status = px4::command::CtrlStatusCode::FAILED;
 
-		case px4::command::CtrlCmdCode::GET_INFO:
-		{
-			px4::command::CtrlReceiverInfoCmd *receiver_info = reinterpret_cast<px4::command::CtrlReceiverInfoCmd *>(buf.get());
+		break;
+	}
 
-			if (receiver) {
-				receiver_info->receiver_info = info;
-				hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			} else {
-				hdr->status = px4::command::CtrlStatusCode::FAILED;
-			}
+	case px4::command::CtrlCmdCode::GET_PARAMS:
+	{
+		px4::command::CtrlParamsCmd *params = reinterpret_cast<px4::command::CtrlParamsCmd *>(buf_.get());
 
-			break;
-		}
+		if (receiver_ && receiver_->GetParameters(params->param_set))
+			params->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			params->status = px4::command::CtrlStatusCode::FAILED;
 
-		case px4::command::CtrlCmdCode::SET_CAPTURE:
-		{
-			px4::command::CtrlCaptureCmd *capture = reinterpret_cast<px4::command::CtrlCaptureCmd *>(buf.get());
+		break;
+	}
 
-			if (receiver && !receiver->SetCapture((capture->capture) ? true : false))
-				capture->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				capture->status = px4::command::CtrlStatusCode::FAILED;
+	case px4::command::CtrlCmdCode::SET_PARAMS:
+	{
+		px4::command::CtrlParamsCmd *params = reinterpret_cast<px4::command::CtrlParamsCmd *>(buf_.get());
 
-			break;
-		}
+		if (SetParameters(params->param_set))
+			params->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			params->status = px4::command::CtrlStatusCode::FAILED;
 
-		case px4::command::CtrlCmdCode::GET_PARAMS:
-		{
-			px4::command::CtrlParamsCmd *params = reinterpret_cast<px4::command::CtrlParamsCmd *>(buf.get());
+		break;
+	}
 
-			if (receiver && receiver->GetParameters(params->param_set))
-				params->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				params->status = px4::command::CtrlStatusCode::FAILED;
+	case px4::command::CtrlCmdCode::CLEAR_PARAMS:
+		if (receiver_ && (receiver_manager_.IsShared(receiver_) || (receiver_->ClearParameters(), true)))
+			hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			hdr->status = px4::command::CtrlStatusCode::FAILED;
 
-			break;
-		}
+		break;
 
-		case px4::command::CtrlCmdCode::SET_PARAMS:
-		{
-			px4::command::CtrlParamsCmd *params = reinterpret_cast<px4::command::CtrlParamsCmd *>(buf.get());
+	case px4::command::CtrlCmdCode::TUNE:
+	case px4::command::CtrlCmdCode::TUNE_ASYNC:
+	{
+		px4::command::CtrlTuneCmd *tune = reinterpret_cast<px4::command::CtrlTuneCmd *>(buf_.get());
 
-			if (receiver && receiver->SetParameters(params->param_set))
-				params->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				params->status = px4::command::CtrlStatusCode::FAILED;
+		if (Tune(tune->timeout, hdr->cmd == px4::command::CtrlCmdCode::TUNE_ASYNC))
+			hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			hdr->status = px4::command::CtrlStatusCode::FAILED;
+
+		break;
+	}
 
-			break;
+	case px4::command::CtrlCmdCode::WAIT_TUNE:
+	{
+		px4::command::CtrlTuneCmd *tune = reinterpret_cast<px4::command::CtrlTuneCmd *>(buf_.get());
+		bool result = false;
+
+		if (!receiver_)
+			result = false;
+		else if (!tune_pending_)
+			result = tune_result_;
+		else if (receiver_->WaitTune(tune->timeout, result)) {
+			tune_pending_ = false;
+			tune_result_ = result;
 		}
 
-		case px4::command::CtrlCmdCode::CLEAR_PARAMS:
-			if (receiver && (receiver->ClearParameters(), true))
-				hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				hdr->status = px4::command::CtrlStatusCode::FAILED;
+		hdr->status = (result) ? px4::command::CtrlStatusCode::SUCCEEDED : px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
 
-			break;
+	case px4::command::CtrlCmdCode::CHECK_LOCK:
+	{
+		px4::command::CtrlCheckLockCmd *check_lock = reinterpret_cast<px4::command::CtrlCheckLockCmd *>(buf_.get());
 
-		case px4::command::CtrlCmdCode::TUNE:
-		{
-			px4::command::CtrlTuneCmd *tune = reinterpret_cast<px4::command::CtrlTuneCmd *>(buf.get());
+		if (receiver_ && !receiver_->CheckLock(check_lock->locked))
+			check_lock->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			check_lock->status = px4::command::CtrlStatusCode::FAILED;
 
-			if (receiver && receiver->Tune(tune->timeout))
-				hdr->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				hdr->status = px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
 
-			break;
-		}
+	case px4::command::CtrlCmdCode::SET_LNB_VOLTAGE:
+	{
+		px4::command::CtrlLnbVoltageCmd *lnb = reinterpret_cast<px4::command::CtrlLnbVoltageCmd *>(buf_.get());
 
-		case px4::command::CtrlCmdCode::CHECK_LOCK:
-		{
-			px4::command::CtrlCheckLockCmd *check_lock = reinterpret_cast<px4::command::CtrlCheckLockCmd *>(buf.get());
+		if (SetLnbVoltage(lnb->voltage))
+			lnb->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			lnb->status = px4::command::CtrlStatusCode::FAILED;
 
-			if (receiver && !receiver->CheckLock(check_lock->locked))
-				check_lock->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				check_lock->status = px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
 
-			break;
-		}
+	case px4::command::CtrlCmdCode::SET_CHANNEL:
+	{
+		px4::command::CtrlSetChannelCmd *ch = reinterpret_cast<px4::command::CtrlSetChannelCmd *>(buf_.get());
+		bool result = receiver_ != nullptr;
+
+		if (result && (ch->flags & px4::command::SET_CHANNEL_LNB_VOLTAGE))
+			result = SetLnbVoltage(ch->lnb_voltage);
+
+		if (result)
+			result = SetParameters(ch->param_set);
 
-		case px4::command::CtrlCmdCode::SET_LNB_VOLTAGE:
-		{
-			px4::command::CtrlLnbVoltageCmd *lnb = reinterpret_cast<px4::command::CtrlLnbVoltageCmd *>(buf.get());
+		if (result)
+			result = Tune(ch->timeout, (ch->flags & px4::command::SET_CHANNEL_TUNE_ASYNC) ? true : false);
 
-			if (receiver && !receiver->SetLnbVoltage(lnb->voltage))
-				lnb->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				lnb->status = px4::command::CtrlStatusCode::FAILED;
+		if (result && (ch->flags & px4::command::SET_CHANNEL_CAPTURE)) {
+			int ret = receiver_manager_.SetCapture(data_id_, true);
 
-			break;
+			result = (!ret || ret == -EALREADY);
 		}
 
-		case px4::command::CtrlCmdCode::READ_STATS:
-		{
-			px4::command::CtrlStatsCmd *stats = reinterpret_cast<px4::command::CtrlStatsCmd *>(buf.get());
+		// with TUNE_ASYNC, the stream is purged while the demodulator is locking
+		if (result && (ch->flags & px4::command::SET_CHANNEL_PURGE))
+			receiver_manager_.Purge(data_id_);
 
-			if (receiver && receiver->ReadStats(stats->stat_set))
-				stats->status = px4::command::CtrlStatusCode::SUCCEEDED;
-			else
-				stats->status = px4::command::CtrlStatusCode::FAILED;
+		ch->status = (result) ? px4::command::CtrlStatusCode::SUCCEEDED : px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
 
-			break;
-		}
+	case px4::command::CtrlCmdCode::READ_STATS:
+	{
+		px4::command::CtrlStatsCmd *stats = reinterpret_cast<px4::command::CtrlStatsCmd *>(buf_.get());
 
-		default:
-			hdr->status = px4::command::CtrlStatusCode::FAILED;
-			break;
-		}
+		if (receiver_ && receiver_->ReadStats(stats->stat_set))
+			stats->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			stats->status = px4::command::CtrlStatusCode::FAILED;
+
+		break;
+	}
+
+	case px4::command::CtrlCmdCode::WAIT_STATS:
+	{
+		px4::command::CtrlWaitStatsCmd *stats = reinterpret_cast<px4::command::CtrlWaitStatsCmd *>(buf_.get());
+
+		if (receiver_ && receiver_->WaitStats(stats->timeout, stats->sequence, stats->stat_set))
+			stats->status = px4::command::CtrlStatusCode::SUCCEEDED;
+		else
+			stats->status = px4::command::CtrlStatusCode::FAILED;
+
+		break;
+	}
+
+	default:
+		hdr->status = px4::command::CtrlStatusCode::FAILED;
+		break;
+	}
+
+	return RequestWrite(size);
+}
 
-		if (!ret)
-			break;
+// moves the client to a receiver of its own first if the receiver is shared
+bool CtrlServer::CtrlConnection::SetParameters(const px4::command::ParameterSet &param_set) noexcept
+{
+	if (receiver_ && receiver_manager_.IsShared(receiver_)) {
+		// nothing to change
+		if (receiver_->IsTunedTo(param_set))
+			return true;
 
-		std::size_t written;
+		// the other clients keep the current channel, move to a receiver of our own
+		px4::ReceiverBase *r = receiver_manager_.Unshare(data_id_, info_);
+		if (!r)
+			return false;
 
-		if (!conn_->Write(buf.get(), read, written) || read != written)
-			break;
+		receiver_ = r;
 	}
 
-	if (receiver) {
-		receiver->Close();
-		receiver_manager_.ClearDataId(receiver);
+	return (receiver_ && receiver_->SetParameters(param_set));
+}
+
+bool CtrlServer::CtrlConnection::Tune(std::uint32_t timeout, bool async) noexcept
+{
+	tune_pending_ = false;
+	tune_result_ = false;
+
+	if (receiver_ && !receiver_manager_.IsShared(receiver_)) {
+		// use the receiver of another client if it is already streaming the same channel
+		px4::ReceiverBase *r = receiver_manager_.Share(data_id_, info_);
+		if (r) {
+			receiver_ = r;
+			tune_result_ = true;
+			return true;
+		}
+	} else if (receiver_) {
+		// already tuned by the other client
+		tune_result_ = true;
+		return true;
 	}
 
-	delete this;
+	if (async)
+		tune_pending_ = (receiver_ && receiver_->StartTune(timeout));
+	else
+		tune_result_ = (receiver_ && receiver_->Tune(timeout));
+
+	return (tune_pending_ || tune_result_);
+}
+
+bool CtrlServer::CtrlConnection::SetLnbVoltage(std::int32_t voltage) noexcept
+{
+	// the other clients may still need the power
+	if (receiver_ && !voltage && receiver_manager_.IsShared(receiver_))
+		return true;
+
+	return (receiver_ && !receiver_->SetLnbVoltage(voltage));
+}
+
+void CtrlServer::CtrlConnection::OnClose() noexcept
+{
+	if (receiver_)
+		receiver_manager_.Close(data_id_);
+
+	receiver_ = nullptr;
 }
 
 } // namespace px4
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <memory>
 
+#include "io_pool.hpp"
 #include "server_base.hpp"
 #include "pipe_server.hpp"
 #include "receiver_base.hpp"
@@ -14,7 +15,7 @@ namespace px4 {
 
 class CtrlServer final : public px4::ServerBase {
 public:
-	explicit CtrlServer(px4::ReceiverManager &receiver_manager);
+	explicit CtrlServer(px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool);
 	~CtrlServer() {}
 
 	// cannot copy
@@ -40,7 +41,17 @@ private:
 		CtrlConnection& operator=(CtrlConnection &&) = delete;
 
 	private:
-		void Worker() noexcept override;
+		bool OnRead(std::size_t size) noexcept override;
+		void OnClose() noexcept override;
+		bool SetParameters(const px4::command::ParameterSet &param_set) noexcept;
+		bool Tune(std::uint32_t timeout, bool async) noexcept;
+		bool SetLnbVoltage(std::int32_t voltage) noexcept;
+
+		px4::command::ReceiverInfo info_;
+		px4::ReceiverBase *receiver_;
+		std::uint32_t data_id_;
+		bool tune_pending_;
+		bool tune_result_;
 	};
 
 	px4::ServerBase::Connection* CreateConnection(std::unique_ptr<px4::PipeServer> &pipe) override;
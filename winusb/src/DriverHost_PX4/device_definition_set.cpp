@@ -51,6 +51,9 @@ void DeviceDefinitionSet::Load(const px4::ConfigSet &configs) noexcept
 			px4::util::ParseGuidStr(rcvr_guid_str, rcvr_def.guid);
 			px4::util::ParseSystemStr(rcvr_system_str, rcvr_def.systems);
 			rcvr_def.index = static_cast<std::int32_t>(std::stol(rcvr_index_str));
+			rcvr_def.network_output = cr.Get(L"NetworkOutput", L"");
+			rcvr_def.network_output_interface = cr.Get(L"NetworkOutputInterface", L"");
+			rcvr_def.network_output_ttl = px4::util::wtoui32(cr.Get(L"NetworkOutputTtl", L"1"));
 
 			dev_def.receivers.emplace_back(rcvr_def);
 		}
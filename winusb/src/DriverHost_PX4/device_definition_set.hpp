@@ -22,6 +22,9 @@ struct ReceiverDefinition final {
 	GUID guid;
 	px4::SystemType systems;
 	std::int32_t index;
+	std::wstring network_output;		// "rtp://<address>:<port>" or "udp://<address>:<port>", empty: none
+	std::wstring network_output_interface;
+	std::uint32_t network_output_ttl;
 };
 
 struct DeviceDefinition final {
@@ -14,6 +14,11 @@ namespace px4 {
 
 void DeviceManager::NotifyHandler::Handle(px4::DeviceNotifyType type, const GUID &interface_guid, const wchar_t *path) noexcept
 {
+	// every interface class is notified, the others are not ours
+	auto def = parent_.device_map_.find(interface_guid);
+	if (def == parent_.device_map_.end())
+		return;
+
 	try {
 		std::wstring path_lower = path;
 
@@ -21,21 +26,24 @@ void DeviceManager::NotifyHandler::Handle(px4::DeviceNotifyType type, const GUID
 
 		switch (type) {
 		case px4::DeviceNotifyType::ARRIVAL:
-			parent_.Add(path_lower, parent_.device_map_.at(interface_guid));
+			parent_.Add(path_lower, def->second);
 			break;
 
 		case px4::DeviceNotifyType::REMOVE:
 			parent_.Remove(path_lower);
 			break;
 		}
-	} catch (const std::out_of_range &) {}
+	} catch (...) {}
 }
 
-DeviceManager::DeviceManager(const px4::DeviceDefinitionSet &device_defs, px4::ReceiverManager &receiver_manager)
+DeviceManager::DeviceManager(const px4::DeviceDefinitionSet &device_defs, px4::ReceiverManager &receiver_manager, unsigned int max_parallel_init)
 	: device_map_(),
 	receiver_manager_(receiver_manager),
 	mtx_(),
 	index_(0),
+	max_parallel_init_((max_parallel_init) ? max_parallel_init : 1),
+	init_workers_(0),
+	init_quit_(false),
 	handler_(*this)
 {
 	auto &all_devs = device_defs.GetAll();
@@ -61,11 +69,37 @@ DeviceManager::DeviceManager(const px4::DeviceDefinitionSet &device_defs, px4::R
 
 	for (auto it = device_map_.cbegin(); it != device_map_.cend(); ++it)
 		Search(it->first, it->second);
+
+	// the clients can use the first device while the others are still being initialized
+	std::unique_lock<std::mutex> lock(mtx_);
+
+	init_cond_.wait(lock, [this] { return !devices_.empty() || initializing_.empty(); });
 }
 
 DeviceManager::~DeviceManager()
 {
 	notifier_.reset();
+
+	std::deque<InitJob> queue;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+
+		init_quit_ = true;
+
+		for (auto it = init_queue_.cbegin(); it != init_queue_.cend(); ++it) {
+			if (!it->remove)
+				initializing_.erase(it->path);
+		}
+
+		queue.swap(init_queue_);
+	}
+
+	// the unplugged devices left in the queue are destroyed out of the lock
+	queue.clear();
+
+	for (auto it = init_threads_.begin(); it != init_threads_.end(); ++it)
+		it->join();
 }
 
 void DeviceManager::Search(const GUID &guid, const std::pair<DeviceType, px4::DeviceDefinition> &def)
@@ -112,46 +146,135 @@ void DeviceManager::Add(const std::wstring &path, const std::pair<DeviceType, px
 {
 	std::lock_guard<std::mutex> lock(mtx_);
 
-	if (Exists(path))
+	if (init_quit_ || Exists(path) || initializing_.count(path))
 		return;
 
+	std::unique_ptr<DeviceBase> dev;
+
 	switch (def.first) {
 	case px4::DeviceType::PX4:
-	{
-		auto dev = std::make_unique<Px4Device>(path, def.second, ++index_, receiver_manager_);
-		
-		if (!dev->Init())
-			devices_.emplace(path, std::move(dev));
+		dev = std::make_unique<Px4Device>(path, def.second, ++index_, receiver_manager_);
+		break;
 
+	case px4::DeviceType::PXMLT:
+		dev = std::make_unique<PxMltDevice>(path, def.second, ++index_, receiver_manager_);
 		break;
+
+	default:
+		return;
 	}
 
-	case px4::DeviceType::PXMLT:
-	{
-		auto dev = std::make_unique<PxMltDevice>(path, def.second, ++index_, receiver_manager_);
+	if (!StartWorker(false))
+		return;
 
-		if (!dev->Init())
-			devices_.emplace(path, std::move(dev));
+	initializing_.emplace(path, false);
+	init_queue_.push_back({ path, std::move(dev), false });
 
-		break;
+	return;
+}
+
+// must be called with mtx_ held, returns false if no worker is running to take the job
+bool DeviceManager::StartWorker(bool force) noexcept
+{
+	// all of the previous workers have exited
+	if (!init_workers_) {
+		for (auto it = init_threads_.begin(); it != init_threads_.end(); ++it)
+			it->join();
+
+		init_threads_.clear();
 	}
 
-	default:
-		break;
+	if (init_workers_ < max_parallel_init_ || force) {
+		try {
+			init_threads_.emplace_back(&DeviceManager::InitWorker, this);
+			init_workers_++;
+		} catch (...) {
+			// the running workers will take it
+		}
 	}
 
-	return;
+	return !!init_workers_;
 }
 
+// initializes the devices in the queue, up to max_parallel_init_ workers are running at once
+// the unplugged devices are destroyed here too, on a worker started for each of them
+void DeviceManager::InitWorker() noexcept
+{
+	std::unique_lock<std::mutex> lock(mtx_);
+
+	while (!init_quit_ && !init_queue_.empty()) {
+		InitJob job = std::move(init_queue_.front());
+		bool ok = false;
+
+		init_queue_.pop_front();
+
+		if (job.remove) {
+			// Term() waits for the clients to close the receivers
+			lock.unlock();
+			job.dev.reset();
+			lock.lock();
+			continue;
+		}
+
+		if (!initializing_.at(job.path)) {
+			lock.unlock();
+
+			// the receivers are registered to ReceiverManager by Init()
+			ok = !job.dev->Init();
+
+			lock.lock();
+		}
+
+		if (ok && !initializing_.at(job.path) && !init_quit_)
+			devices_.emplace(job.path, std::move(job.dev));
+		else if (ok)
+			job.dev->SetAvailability(false);
+
+		initializing_.erase(job.path);
+		init_cond_.notify_all();
+
+		if (job.dev) {
+			// failed or unplugged meanwhile
+			lock.unlock();
+			job.dev.reset();
+			lock.lock();
+		}
+	}
+
+	init_workers_--;
+	init_cond_.notify_all();
+}
+
+// only the device on the path is touched, the others and the arrivals are not held up by its teardown
 void DeviceManager::Remove(const std::wstring &path)
 {
-	std::lock_guard<std::mutex> lock(mtx_);
+	std::unique_lock<std::mutex> lock(mtx_);
 
-	if (!Exists(path))
+	auto it = initializing_.find(path);
+
+	if (it != initializing_.end()) {
+		// InitWorker() takes care of it
+		it->second = true;
 		return;
+	}
+
+	auto dev_it = devices_.find(path);
+	if (dev_it == devices_.end())
+		return;
+
+	std::unique_ptr<DeviceBase> dev = std::move(dev_it->second);
+
+	devices_.erase(dev_it);
+	dev->SetAvailability(false);
+
+	// a worker of its own, the others may be busy initializing
+	if (!init_quit_ && StartWorker(true)) {
+		init_queue_.push_front({ path, std::move(dev), true });
+		return;
+	}
 
-	devices_.at(path)->SetAvailability(false);
-	devices_.erase(path);
+	lock.unlock();
+	dev.reset();
 }
 
 bool DeviceManager::Exists(const std::wstring &path) const
@@ -6,6 +6,9 @@
 #include <memory>
 #include <string>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
 #include <vector>
 #include <unordered_map>
 #include <stdexcept>
@@ -38,8 +41,14 @@ private:
 		DeviceManager &parent_;
 	};
 
+	struct InitJob {
+		std::wstring path;
+		std::unique_ptr<DeviceBase> dev;
+		bool remove;	// the device has been unplugged and is to be destroyed
+	};
+
 public:
-	explicit DeviceManager(const px4::DeviceDefinitionSet &device_defs, px4::ReceiverManager &receiver_manager);
+	explicit DeviceManager(const px4::DeviceDefinitionSet &device_defs, px4::ReceiverManager &receiver_manager, unsigned int max_parallel_init);
 	~DeviceManager();
 
 	// cannot copy
@@ -55,6 +64,8 @@ private:
 	void Add(const std::wstring &path, const std::pair<DeviceType, px4::DeviceDefinition> &def);
 	void Remove(const std::wstring &path);
 	bool Exists(const std::wstring &path) const;
+	bool StartWorker(bool force) noexcept;
+	void InitWorker() noexcept;
 
 	std::unordered_map<GUID, std::pair<DeviceType, px4::DeviceDefinition>> device_map_;
 	px4::ReceiverManager &receiver_manager_;
@@ -62,6 +73,13 @@ private:
 	std::mutex mtx_;
 	std::unordered_map<std::wstring, std::unique_ptr<DeviceBase>> devices_;
 	std::uintptr_t index_;
+	unsigned int max_parallel_init_;
+	std::condition_variable init_cond_;
+	std::deque<InitJob> init_queue_;
+	std::unordered_map<std::wstring, bool> initializing_;	// true if the device has been removed meanwhile
+	unsigned int init_workers_;
+	std::vector<std::thread> init_threads_;
+	bool init_quit_;
 	NotifyHandler handler_;
 	std::unique_ptr<px4::DeviceNotifier> notifier_;
 };
@@ -2,25 +2,64 @@
 
 #include "driver_host.hpp"
 
+#include <cwchar>
 #include <aclapi.h>
 
 #include "security_attributes.hpp"
 #include "notify_icon.hpp"
+#include "thread_config.h"
 
 namespace px4 {
 
+struct ThreadPriorityParam final {
+	int priority;
+	const wchar_t str[16];
+} thread_priority_param[] = {
+	{ THREAD_PRIORITY_IDLE, L"idle" },
+	{ THREAD_PRIORITY_LOWEST, L"lowest" },
+	{ THREAD_PRIORITY_BELOW_NORMAL, L"below-normal" },
+	{ THREAD_PRIORITY_NORMAL, L"normal" },
+	{ THREAD_PRIORITY_ABOVE_NORMAL, L"above-normal" },
+	{ THREAD_PRIORITY_HIGHEST, L"highest" },
+	{ THREAD_PRIORITY_TIME_CRITICAL, L"time-critical" },
+};
+
+struct ThreadRoleParam final {
+	thread_role role;
+	const wchar_t prefix[8];
+} thread_role_param[] = {
+	{ THREAD_ROLE_STREAM, L"Stream" },
+	{ THREAD_ROLE_USB, L"Usb" },
+};
+
 DriverHost::DriverHost()
-	: mutex_(nullptr),
+	: max_parallel_init_(4),
+	max_pipe_threads_(32),
+	mutex_(nullptr),
 	startup_event_(nullptr)
 {
 	configs_.Load(px4::util::path::GetFileBase() + L".ini");
 
+	if (configs_.Exists(L"DriverHost_PX4")) {
+		auto &config = configs_.Get(L"DriverHost_PX4");
+
+		if (config.Exists(L"MaxParallelDeviceInit"))
+			max_parallel_init_ = px4::util::wtoui(config.Get(L"MaxParallelDeviceInit"));
+
+		// the pipes are served by 2 threads at least, more while the commands are blocked in a tune
+		if (config.Exists(L"MaxPipeThreads"))
+			max_pipe_threads_ = px4::util::wtoui(config.Get(L"MaxPipeThreads"));
+
+		LoadThreadConfigs(config);
+	}
+
 	dev_defs_.Load(configs_);
 }
 
 DriverHost::~DriverHost()
 {
 	ctrl_server_.reset();
+	io_pool_.reset();
 	device_manager_.reset();
 
 	if (startup_event_)
@@ -32,6 +71,49 @@ DriverHost::~DriverHost()
 	}
 }
 
+// <Role>ThreadPriority, <Role>ThreadMmcssTask and <Role>ThreadAffinity
+void DriverHost::LoadThreadConfigs(const px4::Config &config)
+{
+	for (auto &role_param : thread_role_param) {
+		std::wstring prefix(role_param.prefix);
+		thread_config tc;
+
+		thread_config_get(role_param.role, &tc);
+
+		if (config.Exists(prefix + L"ThreadPriority")) {
+			auto &priority_str = config.Get(prefix + L"ThreadPriority");
+
+			if (priority_str == L"default") {
+				tc.set_priority = false;
+			} else {
+				for (auto &priority_param : thread_priority_param) {
+					if (priority_str == priority_param.str) {
+						tc.set_priority = true;
+						tc.priority = priority_param.priority;
+						break;
+					}
+				}
+			}
+		}
+
+		// "Capture", "Pro Audio" and so on
+		if (config.Exists(prefix + L"ThreadMmcssTask")) {
+			auto &task_str = config.Get(prefix + L"ThreadMmcssTask");
+
+			if (task_str.size() < _countof(tc.mmcss_task))
+				wcscpy_s(tc.mmcss_task, task_str.c_str());
+		}
+
+		// bit mask of the logical processors, "0x" prefix for hex
+		if (config.Exists(prefix + L"ThreadAffinity"))
+			tc.affinity = static_cast<DWORD_PTR>(std::wcstoull(config.Get(prefix + L"ThreadAffinity").c_str(), nullptr, 0));
+
+		thread_config_set(role_param.role, &tc);
+	}
+
+	return;
+}
+
 void DriverHost::Run()
 {
 	{
@@ -58,10 +140,14 @@ void DriverHost::Run()
 		throw DriverHostError("px4::DriverHost::Run: CreateEventW() failed.");
 	}
 
-	device_manager_.reset(new px4::DeviceManager(dev_defs_, receiver_manager_));
+	device_manager_.reset(new px4::DeviceManager(dev_defs_, receiver_manager_, max_parallel_init_));
+
+	io_pool_.reset(new px4::IoPool(2, max_pipe_threads_));
+	if (!io_pool_->Start())
+		throw DriverHostError("px4::DriverHost::Run: px4::IoPool::Start() failed.");
 
-	ctrl_server_.reset(new px4::CtrlServer(receiver_manager_));
-	stream_server_.reset(new px4::StreamServer(receiver_manager_));
+	ctrl_server_.reset(new px4::CtrlServer(receiver_manager_, *io_pool_));
+	stream_server_.reset(new px4::StreamServer(receiver_manager_, *io_pool_));
 
 	ctrl_server_->Start();
 	stream_server_->Start();
@@ -83,6 +169,7 @@ void DriverHost::Run()
 
 	stream_server_.reset();
 	ctrl_server_.reset();
+	io_pool_.reset();
 	device_manager_.reset();
 
 	CloseHandle(startup_event_);
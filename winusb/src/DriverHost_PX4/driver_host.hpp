@@ -12,6 +12,7 @@
 #include "device_definition_set.hpp"
 #include "device_manager.hpp"
 #include "receiver_manager.hpp"
+#include "io_pool.hpp"
 #include "ctrl_server.hpp"
 #include "stream_server.hpp"
 #include "util.hpp"
@@ -34,13 +35,18 @@ public:
 	void Run();
 
 private:
+	void LoadThreadConfigs(const px4::Config &config);
+
 	px4::ConfigSet configs_;
 	px4::DeviceDefinitionSet dev_defs_;
 	px4::ReceiverManager receiver_manager_;
+	unsigned int max_parallel_init_;
+	unsigned int max_pipe_threads_;
 
 	HANDLE mutex_;
 	HANDLE startup_event_;
 	std::unique_ptr<px4::DeviceManager> device_manager_;
+	std::unique_ptr<px4::IoPool> io_pool_;
 	std::unique_ptr<px4::CtrlServer> ctrl_server_;
 	std::unique_ptr<px4::StreamServer> stream_server_;
 };
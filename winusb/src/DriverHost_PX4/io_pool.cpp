@@ -0,0 +1,161 @@
+// io_pool.cpp
+
+#include "io_pool.hpp"
+
+#include <thread>
+
+namespace px4 {
+
+// the workers above min_threads exit after this idle time
+#define IOPOOL_IDLE_TIMEOUT	30000
+
+IoPool::IoPool(unsigned int min_threads, unsigned int max_threads) noexcept
+	: min_threads_((min_threads) ? min_threads : 1),
+	max_threads_((max_threads > min_threads_) ? max_threads : min_threads_),
+	iocp_(nullptr),
+	num_threads_(0),
+	idle_threads_(0),
+	quit_(false)
+{
+
+}
+
+IoPool::~IoPool()
+{
+	Stop();
+}
+
+bool IoPool::Start() noexcept
+{
+	if (iocp_) {
+		error_.assign(EINVAL, std::generic_category());
+		return false;
+	}
+
+	iocp_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+	if (!iocp_) {
+		error_.assign(GetLastError(), std::system_category());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mtx_);
+
+	quit_ = false;
+
+	for (unsigned int i = 0; i < min_threads_; i++) {
+		if (!StartWorker())
+			break;
+	}
+
+	return (num_threads_) ? true : false;
+}
+
+// all of the associated handles must have been closed
+bool IoPool::Stop() noexcept
+{
+	if (!iocp_) {
+		error_.assign(EINVAL, std::generic_category());
+		return false;
+	}
+
+	try {
+		std::unique_lock<std::mutex> lock(mtx_);
+
+		quit_ = true;
+
+		for (unsigned int i = 0; i < num_threads_; i++)
+			PostQueuedCompletionStatus(iocp_, 0, 0, nullptr);
+
+		while (num_threads_)
+			cond_.wait(lock);
+	} catch (...) {}
+
+	CloseHandle(iocp_);
+	iocp_ = nullptr;
+
+	return true;
+}
+
+bool IoPool::Associate(HANDLE handle) noexcept
+{
+	if (!CreateIoCompletionPort(handle, iocp_, 0, 0)) {
+		error_.assign(GetLastError(), std::system_category());
+		return false;
+	}
+
+	return true;
+}
+
+// completes the request on a worker without any I/O
+bool IoPool::Post(Request &req, std::size_t size) noexcept
+{
+	if (!PostQueuedCompletionStatus(iocp_, static_cast<DWORD>(size), 0, &req.ol)) {
+		error_.assign(GetLastError(), std::system_category());
+		return false;
+	}
+
+	return true;
+}
+
+// must be called with mtx_ held
+bool IoPool::StartWorker() noexcept
+{
+	try {
+		std::thread(&px4::IoPool::Worker, this).detach();
+	} catch (const std::system_error &e) {
+		error_.assign(e.code().value(), e.code().category());
+		return false;
+	}
+
+	num_threads_++;
+	idle_threads_++;
+
+	return true;
+}
+
+void IoPool::Worker() noexcept
+{
+	while (true) {
+		DWORD size = 0, err = 0;
+		ULONG_PTR key;
+		OVERLAPPED *ol = nullptr;
+		BOOL result;
+
+		result = GetQueuedCompletionStatus(iocp_, &size, &key, &ol, IOPOOL_IDLE_TIMEOUT);
+		if (!ol) {
+			if (!result)
+				err = GetLastError();
+
+			std::lock_guard<std::mutex> lock(mtx_);
+
+			if (quit_ || (err == WAIT_TIMEOUT && num_threads_ > min_threads_)) {
+				num_threads_--;
+				idle_threads_--;
+				cond_.notify_all();
+				break;
+			}
+
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+
+			// the handler may block, leave a worker waiting for the other completions
+			if (!--idle_threads_ && !quit_ && num_threads_ < max_threads_)
+				StartWorker();
+		}
+
+		CONTAINING_RECORD(ol, Request, ol)->handler->OnComplete(ol, (result) ? true : false, size);
+
+		{
+			std::lock_guard<std::mutex> lock(mtx_);
+
+			idle_threads_++;
+		}
+	}
+
+	return;
+}
+
+} // namespace px4
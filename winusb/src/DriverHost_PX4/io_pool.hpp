@@ -0,0 +1,65 @@
+// io_pool.hpp
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+
+#include <windows.h>
+
+namespace px4 {
+
+// A completion port with a few workers which complete the overlapped I/O of the associated handles.
+// The workers may block in a handler, another one is started then, up to max_threads.
+class IoPool final {
+public:
+	class Handler {
+	public:
+		virtual ~Handler() {}
+
+		virtual void OnComplete(OVERLAPPED *ol, bool result, std::size_t size) noexcept = 0;
+	};
+
+	// must be used as the OVERLAPPED of the operations
+	struct Request {
+		OVERLAPPED ol;
+		Handler *handler;
+	};
+
+	explicit IoPool(unsigned int min_threads, unsigned int max_threads) noexcept;
+	~IoPool();
+
+	// cannot copy
+	IoPool(const IoPool &) = delete;
+	IoPool& operator=(const IoPool &) = delete;
+
+	// cannot move
+	IoPool(IoPool &&) = delete;
+	IoPool& operator=(IoPool &&) = delete;
+
+	bool Start() noexcept;
+	bool Stop() noexcept;
+	bool Associate(HANDLE handle) noexcept;
+	bool Post(Request &req, std::size_t size) noexcept;
+
+	const std::error_condition& GetError() const noexcept { return error_; }
+
+private:
+	bool StartWorker() noexcept;
+	void Worker() noexcept;
+
+	const unsigned int min_threads_;
+	const unsigned int max_threads_;
+
+	std::error_condition error_;
+	std::mutex mtx_;
+	std::condition_variable cond_;
+	HANDLE iocp_;
+	unsigned int num_threads_;
+	unsigned int idle_threads_;
+	bool quit_;
+};
+
+} // namespace px4
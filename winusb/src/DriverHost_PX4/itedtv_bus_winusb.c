@@ -12,6 +12,18 @@
 #include <windows.h>
 
 #include "itedtv_bus.h"
+#include "thread_config.h"
+
+/*
+ * Bulk-IN transfers of every device complete on a single I/O completion port
+ * which is served by a small pool of threads. The port and the threads live
+ * as long as the process does, since a handle can't be dissociated from the
+ * port once it has been associated.
+ */
+#define ITEDTV_WINUSB_MAX_THREADS	4
+
+/* upper bound of the transfers in flight on the stream pipe */
+#define ITEDTV_WINUSB_MAX_WORKS		64
 
 struct itedtv_usb_context;
 
@@ -20,7 +32,10 @@ struct itedtv_usb_work {
 	OVERLAPPED ol;
 	void *buffer;
 	size_t size;
-	bool can_submit;
+	bool submitted;	// in flight or completed, not handled yet
+	bool done;
+	BOOL result;
+	DWORD rlen;
 };
 
 struct itedtv_usb_context {
@@ -33,10 +48,20 @@ struct itedtv_usb_context {
 	bool no_raw_io;
 	uint32_t num_works;
 	struct itedtv_usb_work *works;
+	void *arena;	// the buffers of all works
+	size_t arena_size;
+	bool arena_large_pages;
 	LONG streaming;
-	HANDLE worker_thread;
+	CRITICAL_SECTION stream_lock;
+	uint32_t next_idx;	// the transfers are handled in the order they were submitted
+	bool draining;
+	LONG in_flight;
+	HANDLE idle_event;	// signaled when in_flight drops to 0
 };
 
+static INIT_ONCE itedtv_winusb_iocp_once = INIT_ONCE_STATIC_INIT;
+static HANDLE itedtv_winusb_iocp = NULL;
+
 static int winerr_to_errno(struct device *dev)
 {
 	int ret = 0;
@@ -87,13 +112,14 @@ static int itedtv_usb_ctrl_tx(struct itedtv_bus *bus, void *buf, int len)
 	if (!buf || !len)
 		return -EINVAL;
 
-	ol.hEvent = ctx->ctrl_event[0];
-	ResetEvent(ol.hEvent);
+	/* the low-order bit keeps the completion off the completion port */
+	ResetEvent(ctx->ctrl_event[0]);
+	ol.hEvent = (HANDLE)((ULONG_PTR)ctx->ctrl_event[0] | 1);
 
 	/* Endpoint 0x02: Host->Device bulk endpoint for controlling the device */
 	if (!WinUsb_WritePipe(dev->winusb, 0x02, buf, len, NULL, &ol)) {
 		if (GetLastError() == ERROR_IO_PENDING)
-			WaitForSingleObject(ol.hEvent, bus->usb.ctrl_timeout);
+			WaitForSingleObject(ctx->ctrl_event[0], bus->usb.ctrl_timeout);
 		else
 			ret = -winerr_to_errno(bus->dev);
 	} else {
@@ -122,13 +148,13 @@ static int itedtv_usb_ctrl_rx(struct itedtv_bus *bus, void *buf, int *len)
 	if (!buf || !len || !*len)
 		return -EINVAL;
 
-	ol.hEvent = ctx->ctrl_event[1];
-	ResetEvent(ol.hEvent);
+	ResetEvent(ctx->ctrl_event[1]);
+	ol.hEvent = (HANDLE)((ULONG_PTR)ctx->ctrl_event[1] | 1);
 
 	/* Endpoint 0x81: Device->Host bulk endpoint for controlling the device */
 	if (!WinUsb_ReadPipe(dev->winusb, 0x81, buf, *len, NULL, &ol)) {
 		if (GetLastError() == ERROR_IO_PENDING)
-			WaitForSingleObject(ol.hEvent, bus->usb.ctrl_timeout);
+			WaitForSingleObject(ctx->ctrl_event[1], bus->usb.ctrl_timeout);
 		else
 			ret = -winerr_to_errno(bus->dev);
 	} else {
@@ -156,20 +182,23 @@ static int itedtv_usb_stream_rx(struct itedtv_bus *bus, void *buf, int *len, int
 	struct usb_device *dev = bus->usb.dev;
 	ULONG rlen = 0;
 	OVERLAPPED ol;
+	HANDLE event;
 
 	if (!buf | !len || !*len)
 		return -EINVAL;
 
-	ol.hEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
-	if (!ol.hEvent) {
+	event = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (!event) {
 		*len = 0;
 		return -winerr_to_errno(bus->dev);
 	}
 
+	ol.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+
 	/* Endpoint 0x84: Device->Host bulk endpoint for receiving TS from the device */
 	if (!WinUsb_ReadPipe(dev->winusb, 0x84, buf, *len, NULL, &ol)) {
 		if (GetLastError() == ERROR_IO_PENDING)
-			WaitForSingleObject(ol.hEvent, timeout);
+			WaitForSingleObject(event, timeout);
 		else
 			ret = -winerr_to_errno(bus->dev);
 	} else {
@@ -188,61 +217,112 @@ static int itedtv_usb_stream_rx(struct itedtv_bus *bus, void *buf, int *len, int
 		*len = rlen;
 	}
 
-	CloseHandle(ol.hEvent);
+	CloseHandle(event);
 	return ret;
 }
 
+/* large pages are never paged out, but SeLockMemoryPrivilege has to be granted to the user */
+static void * itedtv_usb_alloc_large_pages(struct itedtv_bus *bus, size_t *size)
+{
+	SIZE_T min = GetLargePageMinimum();
+	HANDLE token;
+	TOKEN_PRIVILEGES tp;
+	size_t alloc_size;
+	void *p;
+
+	if (!min)
+		return NULL;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return NULL;
+
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	/* VirtualAlloc() fails below if the privilege could not be enabled */
+	if (LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid))
+		AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL);
+
+	CloseHandle(token);
+
+	alloc_size = ((*size + min - 1) / min) * min;
+
+	p = VirtualAlloc(NULL, alloc_size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+	if (!p) {
+		dev_warn(bus->dev, "itedtv_usb_alloc_large_pages: VirtualAlloc(MEM_LARGE_PAGES) failed. (code: 0x%08x)\n", GetLastError());
+		return NULL;
+	}
+
+	*size = alloc_size;
+
+	return p;
+}
+
+static void itedtv_usb_free_arena(struct itedtv_usb_context *ctx)
+{
+	if (ctx->arena) {
+		VirtualFree(ctx->arena, 0, MEM_RELEASE);
+		ctx->arena = NULL;
+	}
+
+	ctx->arena_size = 0;
+	ctx->arena_large_pages = false;
+
+	return;
+}
+
+/* the buffers are carved out of one page-aligned arena, each of them starts on a page boundary */
 static int itedtv_usb_alloc_work_buffers(struct itedtv_usb_context *ctx, uint32_t buf_size)
 {
 	uint32_t i;
 	struct itedtv_bus *bus = ctx->bus;
-	struct usb_device *dev = bus->usb.dev;
 	uint32_t num = ctx->num_works;
 	struct itedtv_usb_work *works = ctx->works;
+	bool large_pages = bus->usb.streaming.large_pages;
+	SYSTEM_INFO si;
+	size_t stride, size;
 
-	if (!works)
+	if (!works || !num)
 		return -EINVAL;
 
-	for (i = 0; i < num; i++) {
-		void *p;
+	GetSystemInfo(&si);
 
-		works[i].ctx = ctx;
+	stride = ((buf_size + si.dwPageSize - 1) / si.dwPageSize) * si.dwPageSize;
+	size = stride * num;
 
-		if (!works[i].ol.hEvent) {
-			works[i].ol.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
-			if (!works[i].ol.hEvent) {
-				dev_err(bus->dev, "itedtv_usb_alloc_work_buffers: CreateEventW() failed. (i: %u)\n", i);
-				break;
-			}
-		}
+	if (ctx->arena && (ctx->arena_size < size || ctx->arena_large_pages != large_pages))
+		itedtv_usb_free_arena(ctx);
 
-		if (works[i].buffer && works[i].size != buf_size) {
-			VirtualFree(works[i].buffer, 0, MEM_RELEASE);
-			works[i].buffer = NULL;
-		}
+	if (!ctx->arena) {
+		void *p = NULL;
+
+		if (large_pages)
+			p = itedtv_usb_alloc_large_pages(bus, &size);
 
-		if (!works[i].buffer) {
-			p = VirtualAlloc(NULL, buf_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!p) {
+			p = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 			if (!p) {
-				dev_err(bus->dev, "itedtv_usb_alloc_work_buffers: VirtualAlloc() failed. (i: %u)\n", i);
-				CloseHandle(works[i].ol.hEvent);
-				works[i].ol.hEvent = NULL;
-				break;
+				dev_err(bus->dev, "itedtv_usb_alloc_work_buffers: VirtualAlloc() failed. (size: %zu)\n", size);
+				return -ENOMEM;
 			}
-
-			dev_dbg(bus->dev, "itedtv_usb_alloc_work_buffers: p: %p, buf_size: %u\n", p, buf_size);
-
-			works[i].buffer = p;
-			works[i].size = buf_size;
 		}
 
-		works[i].can_submit = true;
+		dev_dbg(bus->dev, "itedtv_usb_alloc_work_buffers: p: %p, size: %zu, stride: %zu\n", p, size, stride);
+
+		ctx->arena = p;
+		ctx->arena_size = size;
+		ctx->arena_large_pages = large_pages;
 	}
 
-	ctx->num_urb = i;
+	for (i = 0; i < num; i++) {
+		works[i].ctx = ctx;
+		works[i].buffer = (uint8_t *)ctx->arena + (stride * i);
+		works[i].size = buf_size;
+		works[i].submitted = false;
+		works[i].done = false;
+	}
 
-	if (!i)
-		return -ENOMEM;
+	ctx->num_urb = num;
 
 	return 0;
 }
@@ -250,28 +330,20 @@ static int itedtv_usb_alloc_work_buffers(struct itedtv_usb_context *ctx, uint32_
 static void itedtv_usb_free_work_buffers(struct itedtv_usb_context *ctx)
 {
 	uint32_t i;
-	struct usb_device *dev = ctx->bus->usb.dev;
 	uint32_t num = ctx->num_works;
 	struct itedtv_usb_work *works = ctx->works;
 
-	if (!works)
-		return;
-
-	for (i = 0; i < num; i++) {
-		if (works[i].ol.hEvent) {
-			CloseHandle(works[i].ol.hEvent);
-			works[i].ol.hEvent = NULL;
-		}
-
-		if (works[i].buffer) {
-			VirtualFree(works[i].buffer, 0, MEM_RELEASE);
+	if (works) {
+		for (i = 0; i < num; i++) {
 			works[i].buffer = NULL;
+			works[i].size = 0;
+			works[i].submitted = false;
+			works[i].done = false;
 		}
-
-		works[i].size = 0;
-		works[i].can_submit = false;
 	}
 
+	itedtv_usb_free_arena(ctx);
+
 	ctx->num_urb = 0;
 
 	return;
@@ -291,108 +363,246 @@ static void itedtv_usb_clean_context(struct itedtv_usb_context *ctx)
 	ctx->works = NULL;
 }
 
-unsigned __stdcall itedtv_winusb_worker(void *arg)
+static int itedtv_usb_submit_work(struct itedtv_usb_context *ctx, struct itedtv_usb_work *work)
 {
-	struct itedtv_usb_context *ctx = arg;
-	struct itedtv_bus *bus = ctx->bus;
-	uint32_t i, num, next_idx = 0;
-	struct itedtv_usb_work *works;
-	WINUSB_INTERFACE_HANDLE winusb;
-	UCHAR raw_io;
+	int ret = 0;
 
-	dev_dbg(bus->dev, "itedtv_winusb_worker: start\n");
+	/* no event, the completion is queued to the completion port */
+	memset(&work->ol, 0, sizeof(work->ol));
+	work->done = false;
+	work->submitted = true;
+	InterlockedIncrement(&ctx->in_flight);
 
-	num = ctx->num_urb;
-	works = ctx->works;
-	winusb = bus->usb.dev->winusb;
-	raw_io = (ctx->no_raw_io) ? 0 : 1;
+	if (WinUsb_ReadPipe(ctx->bus->usb.dev->winusb, 0x84, work->buffer, (ULONG)work->size, NULL, &work->ol))
+		return 0;
 
-	if (!WinUsb_SetPipePolicy(winusb, 0x84, RAW_IO, sizeof(raw_io), &raw_io)) {
-		dev_err(bus->dev, "itedtv_winusb_worker: WinUsb_SetPipePolicy(RAW_IO, %u) failed.\n", raw_io);
-		goto exit;
-	}
+	if (GetLastError() == ERROR_IO_PENDING)
+		return 0;
+
+	ret = -winerr_to_errno(ctx->bus->dev);
+
+	EnterCriticalSection(&ctx->stream_lock);
+	work->submitted = false;
+	LeaveCriticalSection(&ctx->stream_lock);
+
+	if (!InterlockedDecrement(&ctx->in_flight))
+		SetEvent(ctx->idle_event);
+
+	return ret;
+}
+
+/* must be called with ctx->stream_lock held */
+static struct itedtv_usb_work *itedtv_usb_next_work(struct itedtv_usb_context *ctx)
+{
+	uint32_t i, num = ctx->num_urb;
 
 	for (i = 0; i < num; i++) {
-		if (!works[i].can_submit)
+		struct itedtv_usb_work *work = &ctx->works[(ctx->next_idx + i) % num];
+
+		if (!work->submitted)
 			continue;
 
-		works[i].can_submit = false;
-		ResetEvent(works[i].ol.hEvent);
+		ctx->next_idx = (ctx->next_idx + i) % num;
+		return work;
+	}
 
-		if (WinUsb_ReadPipe(winusb, 0x84, works[i].buffer, (ULONG)works[i].size, NULL, &works[i].ol))
-			continue;
+	return NULL;
+}
 
-		if (GetLastError() == ERROR_IO_PENDING)
-			continue;
+/*
+ * Transfers of a device may complete on any thread of the pool. Whichever
+ * thread finds the oldest transfer done hands the transfers to the stream
+ * handler in order, the other threads only mark theirs as done.
+ */
+static void itedtv_usb_complete(struct itedtv_usb_work *work, BOOL result, DWORD rlen)
+{
+	struct itedtv_usb_context *ctx = work->ctx;
+	struct itedtv_bus *bus = ctx->bus;
 
-		dev_err(bus->dev, "itedtv_winusb_worker: WinUsb_ReadPipe() 1 failed. (%u, %u)\n", i, GetLastError());
-		works[i].can_submit = true;
+	EnterCriticalSection(&ctx->stream_lock);
 
-		num = i;
-		break;
+	work->result = result;
+	work->rlen = rlen;
+	work->done = true;
+
+	if (ctx->draining) {
+		LeaveCriticalSection(&ctx->stream_lock);
+		return;
 	}
 
-	dev_dbg(bus->dev, "itedtv_winusb_worker: num: %u\n", num);
+	ctx->draining = true;
 
-	while (ctx->streaming) {
-		uint32_t idx = next_idx;
-		DWORD ret, rlen = 0;
-		struct itedtv_usb_work *work = &works[idx];
+	while (true) {
+		struct itedtv_usb_work *w = itedtv_usb_next_work(ctx);
+		int ret;
 
-		if (work->can_submit) {
-			dev_dbg(bus->dev, "itedtv_winusb_worker: can_submit %u\n", idx);
-			for (i = (idx + 1) % num; i != idx; i = (i + 1) % num) {
-				if (!works[i].can_submit)
-					break;
-			}
-			if (i == idx)
-				break;
+		if (!w || !w->done)
+			break;
+
+		w->submitted = false;
+		w->done = false;
+		ctx->next_idx = (ctx->next_idx + 1) % ctx->num_urb;
+
+		LeaveCriticalSection(&ctx->stream_lock);
 
-			idx = i;
-			work = &works[idx];
+		if (w->result && w->rlen)
+			ctx->stream_handler(ctx->ctx, w->buffer, w->rlen);
+		else if (!w->result)
+			dev_dbg(bus->dev, "itedtv_usb_complete: failed. (%u)\n", (uint32_t)(w - ctx->works));
+
+		if (InterlockedCompareExchange(&ctx->streaming, 0, 0)) {
+			ret = itedtv_usb_submit_work(ctx, w);
+			if (ret)
+				dev_err(bus->dev, "itedtv_usb_complete: WinUsb_ReadPipe() failed. (%u, %d)\n", (uint32_t)(w - ctx->works), ret);
 		}
 
-		ret = WaitForSingleObject(work->ol.hEvent, 500);
-		if (ret == WAIT_TIMEOUT) {
-			dev_dbg(bus->dev, "itedtv_winusb_worker: timeout %u\n", idx);
+		if (!InterlockedDecrement(&ctx->in_flight))
+			SetEvent(ctx->idle_event);
+
+		EnterCriticalSection(&ctx->stream_lock);
+	}
+
+	ctx->draining = false;
+
+	LeaveCriticalSection(&ctx->stream_lock);
+
+	return;
+}
+
+static unsigned __stdcall itedtv_winusb_worker(void *arg)
+{
+	HANDLE iocp = arg;
+
+	// the workers are never stopped, MMCSS is not reverted
+	thread_config_apply(THREAD_ROLE_USB);
+
+	while (true) {
+		DWORD rlen = 0;
+		ULONG_PTR key;
+		OVERLAPPED *ol = NULL;
+		BOOL result;
+
+		result = GetQueuedCompletionStatus(iocp, &rlen, &key, &ol, INFINITE);
+		if (!ol) {
+			if (!result)
+				break;
+
 			continue;
-		} else if (ret == WAIT_FAILED)
+		}
+
+		itedtv_usb_complete(CONTAINING_RECORD(ol, struct itedtv_usb_work, ol), result, rlen);
+	}
+
+	return 0;
+}
+
+static BOOL CALLBACK itedtv_usb_init_iocp(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	SYSTEM_INFO si;
+	DWORD i, num;
+	HANDLE iocp;
+
+	GetSystemInfo(&si);
+	num = (si.dwNumberOfProcessors < ITEDTV_WINUSB_MAX_THREADS) ? si.dwNumberOfProcessors : ITEDTV_WINUSB_MAX_THREADS;
+	if (!num)
+		num = 1;
+
+	iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, num);
+	if (!iocp)
+		return FALSE;
+
+	for (i = 0; i < num; i++) {
+		HANDLE th = (HANDLE)_beginthreadex(NULL, 0, itedtv_winusb_worker, iocp, 0, NULL);
+
+		if (!th)
 			break;
 
-		if (WinUsb_GetOverlappedResult(winusb, &work->ol, &rlen, TRUE))
-			ctx->stream_handler(ctx->ctx, work->buffer, rlen);
+		CloseHandle(th);
+	}
 
-		next_idx = (idx + 1) % num;
-		ResetEvent(work->ol.hEvent);
+	if (!i) {
+		CloseHandle(iocp);
+		return FALSE;
+	}
 
-		if (WinUsb_ReadPipe(winusb, 0x84, work->buffer, (ULONG)work->size, NULL, &work->ol))
-			continue;
+	itedtv_winusb_iocp = iocp;
 
-		if (GetLastError() == ERROR_IO_PENDING)
-			continue;
-		
-		dev_err(bus->dev, "itedtv_winusb_worker: WinUsb_ReadPipe() 2 failed. (%u, %u)\n", idx, GetLastError());
-		work->can_submit = true;
+	return TRUE;
+}
+
+static HANDLE itedtv_usb_get_iocp(void)
+{
+	if (!InitOnceExecuteOnce(&itedtv_winusb_iocp_once, itedtv_usb_init_iocp, NULL, NULL))
+		return NULL;
+
+	return itedtv_winusb_iocp;
+}
+
+/* the max packet size of the stream pipe as reported by WinUSB, the one of the bus if it is not found */
+static u32 itedtv_usb_stream_packet_size(struct itedtv_bus *bus)
+{
+	WINUSB_INTERFACE_HANDLE winusb = bus->usb.dev->winusb;
+	USB_INTERFACE_DESCRIPTOR desc;
+	WINUSB_PIPE_INFORMATION info;
+	UCHAR i;
+
+	if (!WinUsb_QueryInterfaceSettings(winusb, 0, &desc))
+		return bus->usb.max_bulk_size;
+
+	for (i = 0; i < desc.bNumEndpoints; i++) {
+		if (!WinUsb_QueryPipe(winusb, 0, i, &info))
+			break;
+
+		if (info.PipeId == 0x84 && info.MaximumPacketSize)
+			return info.MaximumPacketSize;
 	}
 
-	WinUsb_AbortPipe(winusb, 0x84);
+	return bus->usb.max_bulk_size;
+}
 
-	if (raw_io) {
-		raw_io = 0;
-		WinUsb_SetPipePolicy(winusb, 0x84, RAW_IO, sizeof(raw_io), &raw_io);
+/*
+ * With RAW_IO, a transfer must be a multiple of the max packet size and must
+ * not exceed MAXIMUM_TRANSFER_SIZE of the pipe. The configured buffer size is
+ * fitted to them, and the depth is scaled so that as many bytes as configured
+ * are still in flight.
+ */
+static void itedtv_usb_fit_transfer(struct itedtv_bus *bus, bool raw_io, u32 *buf_size, u32 *num)
+{
+	u32 packet_size = itedtv_usb_stream_packet_size(bus);
+	u64 total = (u64)*buf_size * *num;
+	ULONG max_transfer = 0, len = sizeof(max_transfer);
+	u32 size = *buf_size, n;
+
+	if (raw_io && packet_size) {
+		if (size % packet_size)
+			size += packet_size - (size % packet_size);
+
+		if (WinUsb_GetPipePolicy(bus->usb.dev->winusb, 0x84, MAXIMUM_TRANSFER_SIZE, &len, &max_transfer) &&
+		    max_transfer >= packet_size && size > max_transfer)
+			size = max_transfer - (max_transfer % packet_size);
 	}
 
-exit:
-	dev_dbg(bus->dev, "itedtv_winusb_worker: exit\n");
-	return 0;
+	n = (u32)((total + size - 1) / size);
+	if (!n)
+		n = 1;
+	else if (n > ITEDTV_WINUSB_MAX_WORKS)
+		n = ITEDTV_WINUSB_MAX_WORKS;
+
+	dev_info(bus->dev, "itedtv_usb_fit_transfer: raw_io: %s, transfer size: %u, depth: %u (packet size: %u, max transfer size: %lu)\n",
+		 (raw_io) ? "true" : "false", size, n, packet_size, max_transfer);
+
+	*buf_size = size;
+	*num = n;
 }
 
 static int itedtv_usb_start_streaming(struct itedtv_bus *bus, itedtv_bus_stream_handler_t stream_handler, void *context)
 {
 	int ret = 0;
-	u32 buf_size, num;
+	u32 buf_size, num, i;
 	struct itedtv_usb_context *ctx = bus->usb.priv;
 	struct itedtv_usb_work *works;
+	WINUSB_INTERFACE_HANDLE winusb = bus->usb.dev->winusb;
+	UCHAR raw_io;
 
 	if (!stream_handler)
 		return -EINVAL;
@@ -408,11 +618,27 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus, itedtv_bus_stream_
 	buf_size = bus->usb.streaming.urb_buffer_size;
 	num = bus->usb.streaming.urb_num;
 
-	if (num > 64)
+	if (!buf_size || !num) {
+		ret = -EINVAL;
 		goto fail;
+	}
+
+	WinUsb_ResetPipe(winusb, 0x84);
 
-	if (!ctx->no_raw_io && (buf_size % bus->usb.max_bulk_size))
-		buf_size += bus->usb.max_bulk_size - (buf_size % bus->usb.max_bulk_size);
+	/* read without RAW_IO if the pipe does not accept it */
+	raw_io = (ctx->no_raw_io) ? 0 : 1;
+	if (!WinUsb_SetPipePolicy(winusb, 0x84, RAW_IO, sizeof(raw_io), &raw_io)) {
+		dev_warn(bus->dev, "itedtv_usb_start_streaming: WinUsb_SetPipePolicy(RAW_IO, %u) failed. (code: 0x%08x)\n", raw_io, GetLastError());
+
+		if (!raw_io) {
+			ret = -winerr_to_errno(bus->dev);
+			goto fail;
+		}
+
+		ctx->no_raw_io = true;
+	}
+
+	itedtv_usb_fit_transfer(bus, !ctx->no_raw_io, &buf_size, &num);
 
 	if (ctx->works && num != ctx->num_works) {
 		itedtv_usb_free_work_buffers(ctx);
@@ -434,19 +660,26 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus, itedtv_bus_stream_
 	if (ret)
 		goto fail;
 
-	WinUsb_ResetPipe(bus->usb.dev->winusb, 0x84);
+	ctx->next_idx = 0;
+	ctx->draining = false;
+	ctx->in_flight = 0;
+	ResetEvent(ctx->idle_event);
 	InterlockedExchange(&ctx->streaming, 1);
 
-	ctx->worker_thread = (HANDLE)_beginthreadex(NULL, 0, itedtv_winusb_worker, ctx, 0, NULL);
-	if (!ctx->worker_thread) {
-		dev_err(bus->dev, "itedtv_usb_start_streaming: _beginthreadex() failed.");
-		goto fail;
+	for (i = 0; i < ctx->num_urb; i++) {
+		ret = itedtv_usb_submit_work(ctx, &ctx->works[i]);
+		if (ret) {
+			dev_err(bus->dev, "itedtv_usb_start_streaming: WinUsb_ReadPipe() failed. (%u, %d)\n", i, ret);
+			break;
+		}
 	}
 
-	if (!SetThreadPriority(ctx->worker_thread, THREAD_PRIORITY_TIME_CRITICAL))
-		dev_dbg(bus->dev, "itedtv_usb_start_streaming: SetThreadPriority(THREAD_PRIORITY_TIME_CRITICAL) failed.\n");
+	if (!i)
+		goto fail;
+
+	ret = 0;
 
-	dev_dbg(bus->dev, "itedtv_usb_start_streaming: num: %u\n", num);
+	dev_dbg(bus->dev, "itedtv_usb_start_streaming: num: %u\n", i);
 
 	LeaveCriticalSection(&ctx->lock);
 
@@ -455,12 +688,6 @@ static int itedtv_usb_start_streaming(struct itedtv_bus *bus, itedtv_bus_stream_
 fail:
 	InterlockedExchange(&ctx->streaming, 0);
 
-	if (ctx->worker_thread) {
-		WaitForSingleObject(ctx->worker_thread, INFINITE);
-		CloseHandle(ctx->worker_thread);
-		ctx->worker_thread = NULL;
-	}
-
 	itedtv_usb_clean_context(ctx);
 
 	LeaveCriticalSection(&ctx->lock);
@@ -471,16 +698,24 @@ fail:
 static int itedtv_usb_stop_streaming(struct itedtv_bus *bus)
 {
 	struct itedtv_usb_context *ctx = bus->usb.priv;
+	WINUSB_INTERFACE_HANDLE winusb = bus->usb.dev->winusb;
 
 	dev_dbg(bus->dev, "itedtv_usb_stop_streaming\n");
 
 	EnterCriticalSection(&ctx->lock);
 
-	InterlockedExchange(&ctx->streaming, 0);
+	if (InterlockedExchange(&ctx->streaming, 0)) {
+		/* a transfer may still be resubmitted right after the abort */
+		do {
+			WinUsb_AbortPipe(winusb, 0x84);
+		} while (WaitForSingleObject(ctx->idle_event, 100) == WAIT_TIMEOUT);
 
-	WaitForSingleObject(ctx->worker_thread, INFINITE);
-	CloseHandle(ctx->worker_thread);
-	ctx->worker_thread = NULL;
+		if (!ctx->no_raw_io) {
+			UCHAR raw_io = 0;
+
+			WinUsb_SetPipePolicy(winusb, 0x84, RAW_IO, sizeof(raw_io), &raw_io);
+		}
+	}
 
 	itedtv_usb_clean_context(ctx);
 
@@ -502,6 +737,7 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 	{
 		UCHAR raw_io;
 		struct itedtv_usb_context *ctx;
+		HANDLE iocp;
 
 		if (!bus->usb.dev) {
 			ret = -EINVAL;
@@ -519,6 +755,19 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 			break;
 		}
 
+		iocp = itedtv_usb_get_iocp();
+		if (!iocp) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		/* fails with ERROR_INVALID_PARAMETER if the handle has already been associated */
+		if (!CreateIoCompletionPort(bus->usb.dev->dev, iocp, 0, 0) &&
+		    GetLastError() != ERROR_INVALID_PARAMETER) {
+			ret = -winerr_to_errno(bus->dev);
+			break;
+		}
+
 		ctx = malloc(sizeof(*ctx));
 		if (!ctx) {
 			ret = -ENOMEM;
@@ -526,6 +775,7 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 		}
 
 		InitializeCriticalSection(&ctx->lock);
+		InitializeCriticalSection(&ctx->stream_lock);
 		for (int i = 0; i < 2; i++) {
 			ctx->ctrl_event[i] = CreateEventW(NULL, TRUE, FALSE, NULL);
 			if (!ctx->ctrl_event[i]) {
@@ -533,14 +783,22 @@ int itedtv_bus_init(struct itedtv_bus *bus)
 				break;
 			}
 		}
+		ctx->idle_event = CreateEventW(NULL, TRUE, TRUE, NULL);
+		if (!ctx->idle_event)
+			ret = -winerr_to_errno(bus->dev);
 		ctx->bus = bus;
 		ctx->stream_handler = NULL;
 		ctx->ctx = NULL;
 		ctx->num_urb = 0;
 		ctx->num_works = 0;
 		ctx->works = NULL;
+		ctx->arena = NULL;
+		ctx->arena_size = 0;
+		ctx->arena_large_pages = false;
 		ctx->streaming = 0;
-		ctx->worker_thread = NULL;
+		ctx->next_idx = 0;
+		ctx->draining = false;
+		ctx->in_flight = 0;
 
 		bus->usb.priv = ctx;
 
@@ -578,6 +836,9 @@ int itedtv_bus_term(struct itedtv_bus *bus)
 			itedtv_usb_stop_streaming(bus);
 			CloseHandle(ctx->ctrl_event[0]);
 			CloseHandle(ctx->ctrl_event[1]);
+			if (ctx->idle_event)
+				CloseHandle(ctx->idle_event);
+			DeleteCriticalSection(&ctx->stream_lock);
 			DeleteCriticalSection(&ctx->lock);
 			free(ctx);
 		}
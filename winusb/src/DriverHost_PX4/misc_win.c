@@ -11,7 +11,8 @@ int request_firmware(const struct firmware **p, const char *name, struct device
 	struct firmware *fw;
 	uint8_t *buf = NULL, *data;
 
-	file = CreateFileA(name, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	// the devices may be initialized in parallel
+	file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (file == INVALID_HANDLE_VALUE) {
 		ret = -ENOENT;
 		goto fail;
@@ -14,12 +14,28 @@
 typedef int8_t s8;
 typedef int16_t s16;
 typedef int32_t s32;
+typedef int64_t s64;
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 #define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
 
+#define likely(x)	(x)
+#define unlikely(x)	(x)
+
+#ifndef __always_inline
+#define __always_inline	__forceinline
+#endif
+
+#define NSEC_PER_SEC	1000000000ULL
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
 #define msleep(ms)		Sleep((ms) + (16 - ((ms) % 16)))
 #define mdelay(ms)		/* do nothing*/
 
@@ -0,0 +1,366 @@
+// network_sink.cpp
+
+#define msg_prefix	"DriverHost_PX4"
+
+#include "network_sink.hpp"
+
+#include <cstring>
+#include <cwchar>
+#include <random>
+
+// before windows.h, which would bring winsock.h in otherwise
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#include "msg.h"
+#include "thread_config.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+namespace px4 {
+
+#define NETWORK_SINK_PACKETS		7
+#define NETWORK_SINK_DATAGRAM_SIZE	(188 * NETWORK_SINK_PACKETS)
+#define NETWORK_SINK_READ_SIZE		(NETWORK_SINK_DATAGRAM_SIZE * 64)
+#define NETWORK_SINK_SNDBUF_SIZE	(1024 * 1024)
+
+// the bitrate is measured over this period (ms)
+#define NETWORK_SINK_RATE_WINDOW	1000
+// sent a little faster than measured, so that a backlog drains
+#define NETWORK_SINK_RATE_HEADROOM	1.05
+// behind the schedule by more than this (ms), the schedule starts over
+#define NETWORK_SINK_MAX_LAG		50
+
+#define RTP_HEADER_SIZE		12
+#define RTP_PAYLOAD_TYPE_MP2T	33
+
+NetworkSink::NetworkSink(const Config &config, std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf) noexcept
+	: config_(config),
+	stream_buf_(stream_buf),
+	reader_(),
+	wsa_(false),
+	sock_(INVALID_SOCKET),
+	addr_(0),
+	port_(0),
+	rtp_(true),
+	quit_(false),
+	carry_len_(0),
+	rtp_seq_(0),
+	rtp_ssrc_(0),
+	rate_(0.0),
+	window_bytes_(0),
+	send_errors_(0)
+{
+
+}
+
+NetworkSink::~NetworkSink()
+{
+	Stop();
+}
+
+bool NetworkSink::Start() noexcept
+{
+	WSADATA wsa_data;
+	SOCKET sock;
+	int ret;
+
+	if (wsa_) {
+		error_.assign(EINVAL, std::generic_category());
+		return false;
+	}
+
+	if (!ParseAddress()) {
+		error_.assign(EINVAL, std::generic_category());
+		return false;
+	}
+
+	ret = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+	if (ret) {
+		error_.assign(ret, std::system_category());
+		return false;
+	}
+
+	wsa_ = true;
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET) {
+		error_.assign(WSAGetLastError(), std::system_category());
+		goto fail;
+	}
+
+	sock_ = sock;
+
+	{
+		DWORD ttl = (config_.ttl) ? config_.ttl : 1;
+		int sndbuf = NETWORK_SINK_SNDBUF_SIZE;
+
+		if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char *>(&ttl), sizeof(ttl))) {
+			error_.assign(WSAGetLastError(), std::system_category());
+			goto fail;
+		}
+
+		// absorbs the bursts when the schedule starts over
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char *>(&sndbuf), sizeof(sndbuf));
+	}
+
+	if (!config_.interface_address.empty()) {
+		IN_ADDR in_addr;
+
+		if (InetPtonW(AF_INET, config_.interface_address.c_str(), &in_addr) != 1) {
+			error_.assign(EINVAL, std::generic_category());
+			goto fail;
+		}
+
+		if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char *>(&in_addr), sizeof(in_addr))) {
+			error_.assign(WSAGetLastError(), std::system_category());
+			goto fail;
+		}
+	}
+
+	try {
+		std::random_device seed;
+
+		rtp_seq_ = static_cast<std::uint16_t>(seed());
+		rtp_ssrc_ = seed();
+
+		reader_ = stream_buf_->CreateReader();
+
+		quit_ = false;
+		th_ = std::thread(&px4::NetworkSink::Worker, this);
+	} catch (...) {
+		reader_.reset();
+		error_.assign(ENOMEM, std::generic_category());
+		goto fail;
+	}
+
+	msg_info("px4::NetworkSink::Start: %S, rtp: %s\n", config_.address.c_str(), (rtp_) ? "true" : "false");
+
+	return true;
+
+fail:
+	if (sock_ != INVALID_SOCKET) {
+		closesocket(sock_);
+		sock_ = INVALID_SOCKET;
+	}
+
+	WSACleanup();
+	wsa_ = false;
+
+	return false;
+}
+
+void NetworkSink::Stop() noexcept
+{
+	if (!wsa_)
+		return;
+
+	quit_ = true;
+
+	if (reader_)
+		reader_->StopRequest();
+
+	if (th_.joinable())
+		th_.join();
+
+	// the stream memory may be released with the last reader
+	reader_.reset();
+
+	closesocket(sock_);
+	sock_ = INVALID_SOCKET;
+
+	WSACleanup();
+	wsa_ = false;
+
+	msg_info("px4::NetworkSink::Stop: %S, send errors: %llu\n", config_.address.c_str(), send_errors_);
+
+	return;
+}
+
+// "rtp://<address>:<port>" or "udp://<address>:<port>", IPv4 only
+bool NetworkSink::ParseAddress() noexcept
+{
+	const std::wstring &address = config_.address;
+	std::size_t pos;
+
+	if (!address.compare(0, 6, L"rtp://")) {
+		rtp_ = true;
+		pos = 6;
+	} else if (!address.compare(0, 6, L"udp://")) {
+		rtp_ = false;
+		pos = 6;
+	} else {
+		return false;
+	}
+
+	std::size_t colon = address.rfind(L':');
+
+	if (colon == std::wstring::npos || colon < pos)
+		return false;
+
+	std::wstring host = address.substr(pos, colon - pos);
+	wchar_t *end = nullptr;
+	unsigned long port = std::wcstoul(address.c_str() + colon + 1, &end, 10);
+	IN_ADDR in_addr;
+
+	if (!port || port > 0xffff || *end)
+		return false;
+
+	if (InetPtonW(AF_INET, host.c_str(), &in_addr) != 1)
+		return false;
+
+	addr_ = in_addr.s_addr;
+	port_ = static_cast<std::uint16_t>(port);
+
+	return true;
+}
+
+void NetworkSink::Worker() noexcept
+{
+	HANDLE mmcss = thread_config_apply(THREAD_ROLE_STREAM);
+
+	while (!quit_) {
+		// each capture of the receiver is measured from the start
+		carry_len_ = 0;
+		rate_ = 0.0;
+		window_bytes_ = 0;
+		window_start_ = std::chrono::steady_clock::time_point();
+
+		try {
+			// returns when the capture stops, the next one is waited for then
+			reader_->HandleRead(NETWORK_SINK_READ_SIZE, [this](const void *buf, std::size_t size) {
+				return HandleData(static_cast<const std::uint8_t *>(buf), size);
+			});
+		} catch (...) {
+			msg_err("px4::NetworkSink::Worker: %S: cannot read the stream.\n", config_.address.c_str());
+			break;
+		}
+	}
+
+	thread_config_revert(mmcss);
+
+	return;
+}
+
+// the data of a read, whole datagrams are sent and the rest is kept for the next read
+bool NetworkSink::HandleData(const std::uint8_t *buf, std::size_t size) noexcept
+{
+	auto now = std::chrono::steady_clock::now();
+	// more than a read was waiting, sent without the pacing until it has caught up
+	bool behind = (size == NETWORK_SINK_READ_SIZE);
+
+	if (window_start_ == std::chrono::steady_clock::time_point()) {
+		window_start_ = now;
+	} else {
+		window_bytes_ += size;
+
+		auto elapsed = now - window_start_;
+
+		if (elapsed >= std::chrono::milliseconds(NETWORK_SINK_RATE_WINDOW)) {
+			rate_ = window_bytes_ / std::chrono::duration<double>(elapsed).count();
+			window_bytes_ = 0;
+			window_start_ = now;
+		}
+	}
+
+	if (carry_len_) {
+		std::size_t n = sizeof(carry_) - carry_len_;
+
+		if (n > size)
+			n = size;
+
+		std::memcpy(carry_ + carry_len_, buf, n);
+		carry_len_ += n;
+		buf += n;
+		size -= n;
+
+		if (carry_len_ < sizeof(carry_))
+			return !quit_;
+
+		Pace(sizeof(carry_), behind);
+		SendDatagram(carry_, sizeof(carry_));
+		carry_len_ = 0;
+	}
+
+	while (size >= NETWORK_SINK_DATAGRAM_SIZE && !quit_) {
+		Pace(NETWORK_SINK_DATAGRAM_SIZE, behind);
+		SendDatagram(buf, NETWORK_SINK_DATAGRAM_SIZE);
+		buf += NETWORK_SINK_DATAGRAM_SIZE;
+		size -= NETWORK_SINK_DATAGRAM_SIZE;
+	}
+
+	if (size && !quit_) {
+		std::memcpy(carry_, buf, size);
+		carry_len_ = size;
+	}
+
+	return !quit_;
+}
+
+// spreads the datagrams over the time the data took to arrive, with the resolution of the timer
+void NetworkSink::Pace(std::size_t size, bool behind) noexcept
+{
+	auto now = std::chrono::steady_clock::now();
+
+	if (behind || rate_ <= 0.0 || (now - next_send_) > std::chrono::milliseconds(NETWORK_SINK_MAX_LAG)) {
+		next_send_ = now;
+	} else if (next_send_ > now) {
+		std::this_thread::sleep_until(next_send_);
+	}
+
+	if (rate_ > 0.0)
+		next_send_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(size / (rate_ * NETWORK_SINK_RATE_HEADROOM)));
+
+	return;
+}
+
+// the RTP header and the packets are gathered by the send, the packets are not copied again
+void NetworkSink::SendDatagram(const std::uint8_t *buf, std::size_t size) noexcept
+{
+	std::uint8_t header[RTP_HEADER_SIZE];
+	WSABUF wsa_buf[2];
+	DWORD num = 0, sent = 0;
+	sockaddr_in sa;
+
+	if (rtp_) {
+		// 90kHz clock
+		std::uint32_t ts = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() * 9 / 100);
+
+		header[0] = 0x80;	// version 2
+		header[1] = RTP_PAYLOAD_TYPE_MP2T;
+		header[2] = static_cast<std::uint8_t>(rtp_seq_ >> 8);
+		header[3] = static_cast<std::uint8_t>(rtp_seq_);
+		header[4] = static_cast<std::uint8_t>(ts >> 24);
+		header[5] = static_cast<std::uint8_t>(ts >> 16);
+		header[6] = static_cast<std::uint8_t>(ts >> 8);
+		header[7] = static_cast<std::uint8_t>(ts);
+		header[8] = static_cast<std::uint8_t>(rtp_ssrc_ >> 24);
+		header[9] = static_cast<std::uint8_t>(rtp_ssrc_ >> 16);
+		header[10] = static_cast<std::uint8_t>(rtp_ssrc_ >> 8);
+		header[11] = static_cast<std::uint8_t>(rtp_ssrc_);
+
+		rtp_seq_++;
+
+		wsa_buf[num].buf = reinterpret_cast<CHAR *>(header);
+		wsa_buf[num].len = RTP_HEADER_SIZE;
+		num++;
+	}
+
+	wsa_buf[num].buf = reinterpret_cast<CHAR *>(const_cast<std::uint8_t *>(buf));
+	wsa_buf[num].len = static_cast<ULONG>(size);
+	num++;
+
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port_);
+	sa.sin_addr.s_addr = addr_;
+
+	// a datagram lost here is no different from one lost on the network
+	if (WSASendTo(static_cast<SOCKET>(sock_), wsa_buf, num, &sent, 0, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa), nullptr, nullptr))
+		send_errors_++;
+
+	return;
+}
+
+} // namespace px4
@@ -0,0 +1,75 @@
+// network_sink.hpp
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <system_error>
+
+#include "receiver_base.hpp"
+
+namespace px4 {
+
+// Sends the stream of a receiver to the network on its own reader, whoever has tuned the receiver.
+// The packets go out 7 per datagram, in RTP (payload type 33) or plain UDP, paced to the bitrate.
+class NetworkSink final {
+public:
+	struct Config final {
+		std::wstring address;		// "rtp://<address>:<port>" or "udp://<address>:<port>"
+		std::wstring interface_address;	// local IPv4 address of the multicast interface, empty: default
+		std::uint32_t ttl;
+	};
+
+	explicit NetworkSink(const Config &config, std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf) noexcept;
+	~NetworkSink();
+
+	// cannot copy
+	NetworkSink(const NetworkSink &) = delete;
+	NetworkSink& operator=(const NetworkSink &) = delete;
+
+	// cannot move
+	NetworkSink(NetworkSink &&) = delete;
+	NetworkSink& operator=(NetworkSink &&) = delete;
+
+	bool Start() noexcept;
+	void Stop() noexcept;
+
+	const std::error_condition& GetError() const noexcept { return error_; }
+
+private:
+	bool ParseAddress() noexcept;
+	void Worker() noexcept;
+	bool HandleData(const std::uint8_t *buf, std::size_t size) noexcept;
+	void Pace(std::size_t size, bool behind) noexcept;
+	void SendDatagram(const std::uint8_t *buf, std::size_t size) noexcept;
+
+	const Config config_;
+	std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf_;
+	std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader_;
+
+	std::error_condition error_;
+	bool wsa_;
+	std::uintptr_t sock_;	// SOCKET, winsock2.h is left to network_sink.cpp
+	std::uint32_t addr_;	// in network byte order
+	std::uint16_t port_;
+	bool rtp_;
+	std::thread th_;
+	std::atomic_bool quit_;
+
+	// used by the worker only
+	std::uint8_t carry_[188 * 7];	// the packets short of a datagram at the end of a read
+	std::size_t carry_len_;
+	std::uint16_t rtp_seq_;
+	std::uint32_t rtp_ssrc_;
+	double rate_;	// bytes per second, 0 until measured
+	std::size_t window_bytes_;
+	std::chrono::steady_clock::time_point window_start_;
+	std::chrono::steady_clock::time_point next_send_;
+	std::uint64_t send_errors_;
+};
+
+} // namespace px4
@@ -23,22 +23,14 @@ PipeServer::~PipeServer()
 	DisconnectNamedPipe(handle_);
 }
 
-bool PipeServer::Accept(const std::wstring &name, const PipeServerConfig &config, HANDLE ready_event, HANDLE cancel_event, DWORD timeout) noexcept
+bool PipeServer::Create(const std::wstring &name, const PipeServerConfig &config) noexcept
 {
 	if (IsConnected())
 		return false;
 
-	bool ret = false;
 	std::wstring path = L"\\\\.\\pipe\\" + name;
-	OVERLAPPED ol = { 0 };
 	DWORD mode = 0;
-	HANDLE pipe_handle = nullptr;
-
-	ol.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
-	if (!ol.hEvent) {
-		error_.assign(GetLastError(), std::system_category());
-		goto exit;
-	}
+	HANDLE pipe_handle;
 
 	mode |= (config.stream_pipe) ? PIPE_TYPE_BYTE : PIPE_TYPE_MESSAGE;
 	mode |= (config.stream_read) ? PIPE_READMODE_BYTE : PIPE_READMODE_MESSAGE;
@@ -58,50 +50,74 @@ bool PipeServer::Accept(const std::wstring &name, const PipeServerConfig &config
 			sa.Get());
 		if (pipe_handle == INVALID_HANDLE_VALUE) {
 			error_.assign(GetLastError(), std::system_category());
-			goto exit;
+			return false;
 		}
 	} catch (SecurityAttributesError &e) {
 		error_.assign(GetLastError(), std::system_category());
-		goto exit;
+		return false;
+	}
+
+	SetHandle(pipe_handle);
+
+	return true;
+}
+
+// connected is set if the client connected before, there is no completion then
+bool PipeServer::Listen(OVERLAPPED &ol, bool &connected) noexcept
+{
+	connected = false;
+
+	if (ConnectNamedPipe(handle_, &ol))
+		return true;
+
+	DWORD err = GetLastError();
+
+	if (err == ERROR_PIPE_CONNECTED) {
+		connected = true;
+		return true;
+	}
+
+	if (err != ERROR_IO_PENDING && err != ERROR_PIPE_LISTENING) {
+		error_.assign(err, std::system_category());
+		return false;
 	}
 
-	if (ready_event)
-		SetEvent(ready_event);
+	return true;
+}
 
-	if (ConnectNamedPipe(pipe_handle, &ol)) {
-		ret = true;
-		goto exit;
-	} else {
+bool PipeServer::BeginRead(void *buf, std::size_t size, OVERLAPPED &ol) noexcept
+{
+	if (!ReadFile(handle_, buf, static_cast<DWORD>(size), nullptr, &ol)) {
 		DWORD err = GetLastError();
 
-		if (err == ERROR_IO_PENDING || err == ERROR_PIPE_LISTENING) {
-			HANDLE handles[2] = { ol.hEvent, cancel_event };
-			DWORD res, t;
-
-			res = WaitForMultipleObjects((cancel_event) ? 2 : 1, handles, FALSE, INFINITE);
-			if (res == WAIT_OBJECT_0 && GetOverlappedResult(pipe_handle, &ol, &t, TRUE))
-				ret = true;
-			else
-				error_.assign(err, std::system_category());
-		} else if (err == ERROR_PIPE_CONNECTED) {
-			ret = true;
-		} else {
+		if (err != ERROR_IO_PENDING) {
 			error_.assign(err, std::system_category());
+			return false;
 		}
 	}
 
-exit:
-	if (ret) {
-		SetHandle(pipe_handle);
-	} else {
-		if (pipe_handle && pipe_handle != INVALID_HANDLE_VALUE)
-			CloseHandle(pipe_handle);
+	return true;
+}
+
+bool PipeServer::BeginWrite(const void *buf, std::size_t size, OVERLAPPED &ol) noexcept
+{
+	if (!WriteFile(handle_, buf, static_cast<DWORD>(size), nullptr, &ol)) {
+		DWORD err = GetLastError();
+
+		if (err != ERROR_IO_PENDING) {
+			error_.assign(err, std::system_category());
+			return false;
+		}
 	}
 
-	if (ol.hEvent)
-		CloseHandle(ol.hEvent);
+	return true;
+}
 
-	return ret;
+// the pending operations complete with ERROR_OPERATION_ABORTED
+void PipeServer::Cancel() noexcept
+{
+	if (IsConnected())
+		CancelIoEx(handle_, nullptr);
 }
 
 } // namespace px4
@@ -24,7 +24,15 @@ public:
 	PipeServer() noexcept;
 	~PipeServer();
 
-	bool Accept(const std::wstring &name, const PipeServerConfig &config, HANDLE ready_event, HANDLE cancel_event, DWORD timeout = INFINITE) noexcept;
+	bool Create(const std::wstring &name, const PipeServerConfig &config) noexcept;
+	bool Listen(OVERLAPPED &ol, bool &connected) noexcept;
+
+	// overlapped, completed on the completion port associated with the handle
+	bool BeginRead(void *buf, std::size_t size, OVERLAPPED &ol) noexcept;
+	bool BeginWrite(const void *buf, std::size_t size, OVERLAPPED &ol) noexcept;
+	void Cancel() noexcept;
+
+	HANDLE GetHandle() const noexcept { return handle_; }
 };
 
 } // namespace px4
@@ -11,6 +11,8 @@
 
 namespace px4 {
 
+static const struct ts_demux_config px4_demux_config = TS_DEMUX_TAGGED_CONFIG(4);
+
 struct Px4MultiDeviceModeParam final {
 	Px4MultiDeviceMode mode;
 	const wchar_t str[8];
@@ -36,7 +38,10 @@ Px4Device::Px4Device(const std::wstring &path, const px4::DeviceDefinition &devi
 	ParseSerialNumber();
 
 	memset(&it930x_, 0, sizeof(it930x_));
-	memset(&stream_ctx_, 0, sizeof(stream_ctx_));
+
+	ts_demux_init(&stream_ctx_.demux, &px4_demux_config);
+	for (auto &stream_sink : stream_ctx_.sink)
+		stream_sink.sink.put_stream = StreamPut;
 }
 
 Px4Device::~Px4Device()
@@ -60,12 +65,18 @@ void Px4Device::LoadConfig()
 	if (configs.Exists(L"NoRawIo"))
 		config_.usb.no_raw_io = px4::util::wtob(configs.Get(L"NoRawIo"));
 
+	if (configs.Exists(L"LargePages"))
+		config_.usb.large_pages = px4::util::wtob(configs.Get(L"LargePages"));
+
 	if (configs.Exists(L"ReceiverMaxPackets"))
 		config_.device.receiver_max_packets = px4::util::wtoui(configs.Get(L"ReceiverMaxPackets"));
 
 	if (configs.Exists(L"PsbPurgeTimeout"))
 		config_.device.psb_purge_timeout = px4::util::wtoi(configs.Get(L"PsbPurgeTimeout"));
 
+	if (configs.Exists(L"PsbPurgeProbeTimeout"))
+		config_.device.psb_purge_probe_timeout = px4::util::wtoi(configs.Get(L"PsbPurgeProbeTimeout"));
+
 	if (configs.Exists(L"DisableMultiDevicePowerControl"))
 		config_.device.disable_multi_device_power_control = px4::util::wtob(configs.Get(L"DisableMultiDevicePowerControl"));
 
@@ -87,8 +98,10 @@ void Px4Device::LoadConfig()
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: urb_max_packets: %u\n", config_.usb.urb_max_packets);
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: max_urbs: %u\n", config_.usb.max_urbs);
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: no_raw_io: %s\n", (config_.usb.no_raw_io) ? "true" : "false");
+	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: large_pages: %s\n", (config_.usb.large_pages) ? "true" : "false");
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: receiver_max_packets: %u\n", config_.device.receiver_max_packets);
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: psb_purge_timeout: %i\n", config_.device.psb_purge_timeout);
+	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: psb_purge_probe_timeout: %i\n", config_.device.psb_purge_probe_timeout);
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: disable_multi_device_power_control: %s\n", (config_.device.disable_multi_device_power_control) ? "true" : "false");
 	dev_dbg(&dev_, "px4::Px4Device::LoadConfig: discard_null_packets: %s\n", (config_.device.discard_null_packets) ? "true" : "false");
 
@@ -133,6 +146,7 @@ int Px4Device::Init()
 	it930x_.dev = &dev_;
 	it930x_.config.xfer_size = 188 * config_.usb.xfer_packets;
 	it930x_.config.i2c_speed = 0x07;
+	it930x_.config.psb_purge_probe = config_.device.psb_purge_probe_timeout;
 
 	ret = itedtv_bus_init(&bus);
 	if (ret)
@@ -162,7 +176,8 @@ int Px4Device::Init()
 		input.sync_byte = ((i + 1) << 4) | 0x07;
 
 		receivers_[i].reset(new Px4Receiver(*this, i));
-		stream_ctx_.stream_buf[i] = receivers_[i]->GetStreamBuffer();
+		stream_ctx_.sink[i].stream_buf = receivers_[i]->GetStreamBuffer();
+		stream_ctx_.demux.chrdev[i] = &stream_ctx_.sink[i].sink;
 	}
 
 	ret = it930x_raise(&it930x_);
@@ -254,14 +269,15 @@ int Px4Device::Init()
 		ri.index = it->index;
 		ri.data_id = 0;
 
-		receiver_manager_.Register(ri, receivers_[((it->systems == px4::SystemType::ISDB_T) ? 2 : 0) + it->index].get());
+		receiver_manager_.Register(ri, receivers_[((it->systems == px4::SystemType::ISDB_T) ? 2 : 0) + it->index].get(), *it);
 	}
 
 	return 0;
 
 fail_device:
 	for (int i = 0; i < 4; i++) {
-		stream_ctx_.stream_buf[i] = nullptr;
+		stream_ctx_.demux.chrdev[i] = nullptr;
+		stream_ctx_.sink[i].stream_buf = nullptr;
 		receivers_[i].reset();
 	}
 
@@ -290,7 +306,8 @@ void Px4Device::Term()
 	lock.unlock();
 
 	for (int i = 0; i < 4; i++) {
-		stream_ctx_.stream_buf[i] = nullptr;
+		stream_ctx_.demux.chrdev[i] = nullptr;
+		stream_ctx_.sink[i].stream_buf = nullptr;
 		receivers_[i].reset();
 	}
 
@@ -407,8 +424,9 @@ int Px4Device::StartCapture()
 		it930x_.bus.usb.streaming.urb_num = config_.usb.max_urbs;
 		it930x_.bus.usb.streaming.no_dma = true;
 		it930x_.bus.usb.streaming.no_raw_io = config_.usb.no_raw_io;
+		it930x_.bus.usb.streaming.large_pages = config_.usb.large_pages;
 
-		stream_ctx_.remain_len = 0;
+		ts_demux_reset(&stream_ctx_.demux);
 
 		ret = itedtv_bus_start_streaming(&it930x_.bus, StreamHandler, this);
 		if (ret) {
@@ -442,95 +460,32 @@ int Px4Device::StopCapture()
 	return 0;
 }
 
-void Px4Device::StreamProcess(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[], std::uint8_t **buf, std::size_t &len)
+// a run of packets of a receiver, with the sync byte restored
+void Px4Device::StreamPut(struct ts_demux_sink *sink, u8 *buf, u32 len)
 {
-	std::uint8_t *p = *buf;
-	std::size_t remain = len;
-
-	while (remain) {
-		std::size_t i;
-		bool sync_remain = false;
-
-		for (i = 0; i < PX4_DEVICE_TS_SYNC_COUNT; i++) {
-			if (((i + 1) * 188) <= remain) {
-				if ((p[i * 188] & 0x8f) != 0x07)
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-		}
-
-		if (sync_remain)
-			break;
-
-		if (i < PX4_DEVICE_TS_SYNC_COUNT) {
-			p++;
-			remain--;
-			continue;
-		}
+	StreamSink &stream_sink = *CONTAINING_RECORD(sink, StreamSink, sink);
+	std::size_t size = len;
 
-		while (remain >= 188 && ((p[0] & 0x8f) == 0x07)) {
-			u8 id = (p[0] & 0x70) >> 4;
-
-			if (id && id < 5) {
-				std::size_t pkt_len = 188;
-
-				p[0] = 0x47;
-				stream_buf[id - 1]->Write(p, pkt_len);
-			}
-
-			p += 188;
-			remain -= 188;
-		}
-	}
-
-	for (int i = 0; i < 4; i++)
-		stream_buf[i]->NotifyWrite();
-
-	*buf = p;
-	len = remain;
+	stream_sink.stream_buf->Write(buf, size);
+	stream_sink.written = true;
 
 	return;
 }
 
 int Px4Device::StreamHandler(void *context, void *buf, std::uint32_t len)
 {
-	Px4Device &obj = *static_cast<Px4Device*>(context);
-	StreamContext &stream_ctx = obj.stream_ctx_;
-	std::uint8_t *p = static_cast<std::uint8_t*>(buf);
-	std::size_t remain = len;
-
-	if (stream_ctx.remain_len) {
-		if ((stream_ctx.remain_len + len) >= PX4_DEVICE_TS_SYNC_SIZE) {
-			std::uint8_t * remain_buf = stream_ctx.remain_buf;
-			std::size_t t = PX4_DEVICE_TS_SYNC_SIZE - stream_ctx.remain_len;
-
-			memcpy(remain_buf + stream_ctx.remain_len, p, t);
-			stream_ctx.remain_len = PX4_DEVICE_TS_SYNC_SIZE;
-
-			StreamProcess(stream_ctx.stream_buf, &remain_buf, stream_ctx.remain_len);
-			if (!stream_ctx.remain_len) {
-				p += t;
-				remain -= t;
-			}
+	StreamContext &stream_ctx = static_cast<Px4Device*>(context)->stream_ctx_;
 
-			stream_ctx.remain_len = 0;
-		} else {
-			memcpy(stream_ctx.remain_buf + stream_ctx.remain_len, p, len);
-			stream_ctx.remain_len += len;
+	ts_demux_stream_handler(&stream_ctx.demux, buf, len);
 
-			return 0;
+	// the readers are woken up once for the whole buffer
+	for (auto &stream_sink : stream_ctx.sink) {
+		if (stream_sink.written) {
+			stream_sink.stream_buf->NotifyWrite();
+			stream_sink.written = false;
 		}
 	}
 
-	StreamProcess(stream_ctx.stream_buf, &p, remain);
-
-	if (remain) {
-		memcpy(stream_ctx.remain_buf, p, remain);
-		stream_ctx.remain_len = remain;
-	}
-
 	return 0;
 }
 
@@ -578,13 +533,21 @@ int Px4Device::MultiDevice::Alloc(Px4Device &dev, Px4MultiDeviceMode mode, std::
 	if (dev_id > 1)
 		return -EINVAL;
 
+	std::shared_ptr<MultiDevice> new_mldev(new MultiDevice(mode, dev.serial_.serial_number));
+
+	new_mldev->dev_[dev_id] = &dev;
+
 	{
 		std::lock_guard<std::mutex> lock(mldev_list_lock_);
-		mldev = mldev_list_.emplace(dev.serial_.serial_number, new MultiDevice(mode, dev.serial_.serial_number)).first->second;
+		auto r = mldev_list_.emplace(dev.serial_.serial_number, new_mldev);
+
+		mldev = r.first->second;
+		if (r.second)
+			return 0;
 	}
 
-	mldev->dev_[dev_id] = &dev;
-	return 0;
+	// the other device has been initialized at the same time
+	return mldev->Add(dev);
 }
 
 int Px4Device::MultiDevice::Add(Px4Device &dev)
@@ -815,6 +778,7 @@ Px4Device::Px4Receiver::Px4Receiver(Px4Device &parent, std::uintptr_t index)
 		r850_.config.clock_out = false;
 		r850_.config.no_imr_calibration = true;
 		r850_.config.no_lpf_calibration = true;
+		r850_.config.light_standby = true;
 		break;
 
 	case px4::SystemType::ISDB_S:
@@ -1088,6 +1052,7 @@ void Px4Device::Px4Receiver::Close()
 
 	SetCapture(false);
 	SetLnbVoltage(0);
+	stream_buf_->Release();
 
 	std::unique_lock<std::mutex> lock(lock_);
 	std::lock_guard<std::recursive_mutex> dev_lock(parent_.lock_);
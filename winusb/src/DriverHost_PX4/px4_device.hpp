@@ -20,15 +20,13 @@
 #include "i2c_comm.h"
 #include "it930x.h"
 #include "itedtv_bus.h"
+#include "ts_demux.h"
 #include "tc90522.h"
 #include "r850.h"
 #include "rt710.h"
 
 namespace px4 {
 
-#define PX4_DEVICE_TS_SYNC_COUNT	4U
-#define PX4_DEVICE_TS_SYNC_SIZE		(188U * PX4_DEVICE_TS_SYNC_COUNT)
-
 enum class Px4MultiDeviceMode {
 	ALL = 0,
 	S_ONLY,
@@ -46,10 +44,12 @@ struct Px4DeviceConfig final {
 		unsigned int urb_max_packets;
 		unsigned int max_urbs;
 		bool no_raw_io;
+		bool large_pages;
 	} usb;
 	struct {
 		unsigned int receiver_max_packets;
 		int psb_purge_timeout;
+		int psb_purge_probe_timeout;
 		bool disable_multi_device_power_control;
 		Px4MultiDeviceMode multi_device_power_control_mode;
 		bool discard_null_packets;
@@ -81,10 +81,15 @@ private:
 		std::uint64_t serial_number;
 		std::uint8_t dev_id;
 	};
+	struct StreamSink final {
+		StreamSink() : sink(), stream_buf(), written(false) {}
+		struct ts_demux_sink sink;
+		std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf;
+		bool written;	// NotifyWrite() is pending
+	};
 	struct StreamContext final {
-		std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[4];
-		std::uint8_t remain_buf[PX4_DEVICE_TS_SYNC_SIZE];
-		std::size_t remain_len;
+		struct ts_demux demux;
+		StreamSink sink[4];
 	};
 
 	class MultiDevice final {
@@ -189,7 +194,7 @@ private:
 	int StartCapture();
 	int StopCapture();
 
-	static void StreamProcess(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[], std::uint8_t **buf, std::size_t &len);
+	static void StreamPut(struct ts_demux_sink *sink, u8 *buf, u32 len);
 	static int StreamHandler(void *context, void *buf, std::uint32_t len);
 
 	Px4DeviceConfig config_;
@@ -11,6 +11,8 @@
 
 namespace px4 {
 
+static const struct ts_demux_config pxmlt_demux_config = TS_DEMUX_TAGGED_CONFIG(5);
+
 const PxMltDevice::PxMltDeviceParam PxMltDevice::params_[][5] = {
 	/* PX-MLT5U */
 	{ { 0x65, 3, 4 }, { 0x6c, 1, 3 }, { 0x64, 1, 1 }, { 0x6c, 3, 2 }, { 0x64, 3, 0 } },
@@ -70,7 +72,10 @@ PxMltDevice::PxMltDevice(const std::wstring &path, const px4::DeviceDefinition &
 	LoadConfig();
 
 	memset(&it930x_, 0, sizeof(it930x_));
-	memset(&stream_ctx_, 0, sizeof(stream_ctx_));
+
+	ts_demux_init(&stream_ctx_.demux, &pxmlt_demux_config);
+	for (auto &stream_sink : stream_ctx_.sink)
+		stream_sink.sink.put_stream = StreamPut;
 }
 
 PxMltDevice::~PxMltDevice()
@@ -94,12 +99,18 @@ void PxMltDevice::LoadConfig()
 	if (configs.Exists(L"NoRawIo"))
 		config_.usb.no_raw_io = px4::util::wtob(configs.Get(L"NoRawIo"));
 
+	if (configs.Exists(L"LargePages"))
+		config_.usb.large_pages = px4::util::wtob(configs.Get(L"LargePages"));
+
 	if (configs.Exists(L"ReceiverMaxPackets"))
 		config_.device.receiver_max_packets = px4::util::wtoui(configs.Get(L"ReceiverMaxPackets"));
 
 	if (configs.Exists(L"PsbPurgeTimeout"))
 		config_.device.psb_purge_timeout = px4::util::wtoi(configs.Get(L"PsbPurgeTimeout"));
 
+	if (configs.Exists(L"PsbPurgeProbeTimeout"))
+		config_.device.psb_purge_probe_timeout = px4::util::wtoi(configs.Get(L"PsbPurgeProbeTimeout"));
+
 	if (configs.Exists(L"DiscardNullPackets"))
 		config_.device.discard_null_packets = px4::util::wtob(configs.Get(L"DiscardNullPackets"));
 
@@ -107,8 +118,10 @@ void PxMltDevice::LoadConfig()
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: urb_max_packets: %u\n", config_.usb.urb_max_packets);
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: max_urbs: %u\n", config_.usb.max_urbs);
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: no_raw_io: %s\n", (config_.usb.no_raw_io) ? "true" : "false");
+	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: large_pages: %s\n", (config_.usb.large_pages) ? "true" : "false");
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: receiver_max_packets: %u\n", config_.device.receiver_max_packets);
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: psb_purge_timeout: %i\n", config_.device.psb_purge_timeout);
+	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: psb_purge_probe_timeout: %i\n", config_.device.psb_purge_probe_timeout);
 	dev_dbg(&dev_, "px4::PxMltDevice::LoadConfig: discard_null_packets: %s\n", (config_.device.discard_null_packets) ? "true" : "false");
 
 	return;
@@ -134,6 +147,7 @@ int PxMltDevice::Init()
 	it930x_.dev = &dev_;
 	it930x_.config.xfer_size = 188 * config_.usb.xfer_packets;
 	it930x_.config.i2c_speed = 0x07;
+	it930x_.config.psb_purge_probe = config_.device.psb_purge_probe_timeout;
 
 	ret = itedtv_bus_init(&bus);
 	if (ret)
@@ -156,7 +170,8 @@ int PxMltDevice::Init()
 		input.sync_byte = ((i + 1) << 4) | 0x07;
 
 		receivers_[i].reset(new PxMltReceiver(*this, i));
-		stream_ctx_.stream_buf[i] = receivers_[i]->GetStreamBuffer();
+		stream_ctx_.sink[i].stream_buf = receivers_[i]->GetStreamBuffer();
+		stream_ctx_.demux.chrdev[i] = &stream_ctx_.sink[i].sink;
 	}
 
 	for (int i = receiver_num_; i < 5; i++) {
@@ -232,14 +247,15 @@ int PxMltDevice::Init()
 		ri.index = it->index;
 		ri.data_id = 0;
 
-		receiver_manager_.Register(ri, receivers_[it->index].get());
+		receiver_manager_.Register(ri, receivers_[it->index].get(), *it);
 	}
 
 	return 0;
 
 fail_device:
 	for (int i = 0; i < receiver_num_; i++) {
-		stream_ctx_.stream_buf[i] = nullptr;
+		stream_ctx_.demux.chrdev[i] = nullptr;
+		stream_ctx_.sink[i].stream_buf = nullptr;
 		receivers_[i].reset();
 	}
 
@@ -267,7 +283,8 @@ void PxMltDevice::Term()
 	lock.unlock();
 
 	for (int i = 0; i < receiver_num_; i++) {
-		stream_ctx_.stream_buf[i] = nullptr;
+		stream_ctx_.demux.chrdev[i] = nullptr;
+		stream_ctx_.sink[i].stream_buf = nullptr;
 		receivers_[i].reset();
 	}
 
@@ -374,8 +391,9 @@ int PxMltDevice::StartCapture()
 		it930x_.bus.usb.streaming.urb_num = config_.usb.max_urbs;
 		it930x_.bus.usb.streaming.no_dma = true;
 		it930x_.bus.usb.streaming.no_raw_io = config_.usb.no_raw_io;
+		it930x_.bus.usb.streaming.large_pages = config_.usb.large_pages;
 
-		stream_ctx_.remain_len = 0;
+		ts_demux_reset(&stream_ctx_.demux);
 
 		ret = itedtv_bus_start_streaming(&it930x_.bus, StreamHandler, this);
 		if (ret) {
@@ -409,97 +427,32 @@ int PxMltDevice::StopCapture()
 	return 0;
 }
 
-void PxMltDevice::StreamProcess(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[], int num, std::uint8_t **buf, std::size_t &len)
+// a run of packets of a receiver, with the sync byte restored
+void PxMltDevice::StreamPut(struct ts_demux_sink *sink, u8 *buf, u32 len)
 {
-	std::uint8_t *p = *buf;
-	std::size_t remain = len;
-
-	while (remain) {
-		std::size_t i;
-		bool sync_remain = false;
-
-		for (i = 0; i < PXMLT_DEVICE_TS_SYNC_COUNT; i++) {
-			if (((i + 1) * 188) <= remain) {
-				if ((p[i * 188] & 0x8f) != 0x07)
-					break;
-			} else {
-				sync_remain = true;
-				break;
-			}
-		}
-
-		if (sync_remain)
-			break;
-
-		if (i < PXMLT_DEVICE_TS_SYNC_COUNT) {
-			p++;
-			remain--;
-			continue;
-		}
+	StreamSink &stream_sink = *CONTAINING_RECORD(sink, StreamSink, sink);
+	std::size_t size = len;
 
-		while (remain >= 188 && ((p[0] & 0x8f) == 0x07)) {
-			u8 id = (p[0] & 0x70) >> 4;
-
-			if (id && id <= num) {
-				std::size_t pkt_len = 188;
-
-				p[0] = 0x47;
-				stream_buf[id - 1]->Write(p, pkt_len);
-			}
-
-			p += 188;
-			remain -= 188;
-		}
-	}
-
-	for (int i = 0; i < num; i++)
-		stream_buf[i]->NotifyWrite();
-
-	*buf = p;
-	len = remain;
+	stream_sink.stream_buf->Write(buf, size);
+	stream_sink.written = true;
 
 	return;
 }
 
 int PxMltDevice::StreamHandler(void *context, void *buf, std::uint32_t len)
 {
-	PxMltDevice &obj = *static_cast<PxMltDevice*>(context);
-	int receiver_num = obj.receiver_num_;
-	StreamContext &stream_ctx = obj.stream_ctx_;
-	std::uint8_t *p = static_cast<std::uint8_t*>(buf);
-	std::size_t remain = len;
-
-	if (stream_ctx.remain_len) {
-		if ((stream_ctx.remain_len + len) >= PXMLT_DEVICE_TS_SYNC_SIZE) {
-			std::uint8_t * remain_buf = stream_ctx.remain_buf;
-			std::size_t t = PXMLT_DEVICE_TS_SYNC_SIZE - stream_ctx.remain_len;
-
-			memcpy(remain_buf + stream_ctx.remain_len, p, t);
-			stream_ctx.remain_len = PXMLT_DEVICE_TS_SYNC_SIZE;
-
-			StreamProcess(stream_ctx.stream_buf, receiver_num, &remain_buf, stream_ctx.remain_len);
-			if (!stream_ctx.remain_len) {
-				p += t;
-				remain -= t;
-			}
+	StreamContext &stream_ctx = static_cast<PxMltDevice*>(context)->stream_ctx_;
 
-			stream_ctx.remain_len = 0;
-		} else {
-			memcpy(stream_ctx.remain_buf + stream_ctx.remain_len, p, len);
-			stream_ctx.remain_len += len;
+	ts_demux_stream_handler(&stream_ctx.demux, buf, len);
 
-			return 0;
+	// the readers are woken up once for the whole buffer
+	for (auto &stream_sink : stream_ctx.sink) {
+		if (stream_sink.written) {
+			stream_sink.stream_buf->NotifyWrite();
+			stream_sink.written = false;
 		}
 	}
 
-	StreamProcess(stream_ctx.stream_buf, receiver_num, &p, remain);
-
-	if (remain) {
-		dev_dbg(&obj.dev_, "px4::PxMltDevice::StreamHandler: remain: %lu\n", remain);
-		memcpy(stream_ctx.remain_buf, p, remain);
-		stream_ctx.remain_len = remain;
-	}
-
 	return 0;
 }
 
@@ -711,6 +664,7 @@ void PxMltDevice::PxMltReceiver::Close()
 
 	SetCapture(false);
 	SetLnbVoltage(0);
+	stream_buf_->Release();
 
 	std::unique_lock<std::mutex> lock(lock_);
 	std::lock_guard<std::recursive_mutex> dev_lock(parent_.lock_);
@@ -20,14 +20,12 @@
 #include "i2c_comm.h"
 #include "it930x.h"
 #include "itedtv_bus.h"
+#include "ts_demux.h"
 #include "cxd2856er.h"
 #include "cxd2858er.h"
 
 namespace px4 {
 
-#define PXMLT_DEVICE_TS_SYNC_COUNT	4
-#define PXMLT_DEVICE_TS_SYNC_SIZE	(188 * PXMLT_DEVICE_TS_SYNC_COUNT)
-
 enum class PxMltDeviceModel {
 	PXMLT5U = 0,
 	PXMLT5PE,
@@ -46,10 +44,12 @@ struct PxMltDeviceConfig final {
 		unsigned int urb_max_packets;
 		unsigned int max_urbs;
 		bool no_raw_io;
+		bool large_pages;
 	} usb;
 	struct {
 		unsigned int receiver_max_packets;
 		int psb_purge_timeout;
+		int psb_purge_probe_timeout;
 		bool discard_null_packets;
 	} device;
 };
@@ -74,10 +74,15 @@ public:
 	px4::ReceiverBase* GetReceiver(int id) const override;
 
 private:
+	struct StreamSink final {
+		StreamSink() : sink(), stream_buf(), written(false) {}
+		struct ts_demux_sink sink;
+		std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf;
+		bool written;	// NotifyWrite() is pending
+	};
 	struct StreamContext final {
-		std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[5];
-		std::uint8_t remain_buf[PXMLT_DEVICE_TS_SYNC_SIZE];
-		std::size_t remain_len;
+		struct ts_demux demux;
+		StreamSink sink[5];
 	};
 
 	class PxMltReceiver final : public px4::ReceiverBase {
@@ -135,7 +140,7 @@ private:
 	int StartCapture();
 	int StopCapture();
 
-	static void StreamProcess(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf[], int num, std::uint8_t **buf, std::size_t &len);
+	static void StreamPut(struct ts_demux_sink *sink, u8 *buf, u32 len);
 	static int StreamHandler(void *context, void *buf, std::uint32_t len);
 
 	static const struct PxMltDeviceParam final {
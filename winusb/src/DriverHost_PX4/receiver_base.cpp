@@ -7,19 +7,36 @@
 
 #include "msg.h"
 
+// the stats are sampled at this interval while clients are asking for them
+#define RECEIVER_STATS_INTERVAL		500
+#define RECEIVER_STATS_IDLE_TIMEOUT	5000
+
 namespace px4 {
 
 ReceiverBase::ReceiverBase(unsigned int options)
 	: options_(options),
-	lock_()
+	tuned_(false),
+	lock_(),
+	tuning_(false),
+	tune_result_(false),
+	tune_abort_(false),
+	stats_running_(false),
+	stats_quit_(false),
+	stats_valid_(false),
+	stats_waiters_(0),
+	stats_seq_(0)
 {
 	memset(&params_, 0, sizeof(params_));
+	memset(stats_, 0, sizeof(stats_));
 	stream_buf_.reset(new StreamBuffer());
 }
 
 ReceiverBase::~ReceiverBase()
 {
+	StopStats();
 
+	if (tune_th_.joinable())
+		tune_th_.join();
 }
 
 bool ReceiverBase::GetParameters(px4::command::ParameterSet &param_set) noexcept
@@ -52,6 +69,7 @@ bool ReceiverBase::SetParameters(const px4::command::ParameterSet &param_set) no
 {
 	std::lock_guard<std::mutex> lock(lock_);
 
+	tuned_ = false;
 	params_.system = param_set.system;
 	params_.freq = param_set.freq;
 
@@ -78,6 +96,7 @@ void ReceiverBase::ClearParameters() noexcept
 {
 	std::lock_guard<std::mutex> lock(lock_);
 
+	tuned_ = false;
 	memset(&params_, 0, sizeof(params_));
 }
 
@@ -86,6 +105,9 @@ bool ReceiverBase::Tune(std::uint32_t timeout)
 	int ret = 0;
 	std::lock_guard<std::mutex> lock(lock_);
 
+	tuned_ = false;
+	InvalidateStats();
+
 	if ((params_.system == px4::SystemType::ISDB_S) && (options_ & RECEIVER_SAT_SET_STREAM_ID_BEFORE_TUNE)) {
 		ret = SetStreamId();
 		if (ret)
@@ -99,24 +121,36 @@ bool ReceiverBase::Tune(std::uint32_t timeout)
 	int i;
 	auto begin = std::chrono::steady_clock::now();
 	bool locked = false;
+	DWORD interval = 5;
 
-	for (i = 0; true; i++) {
+	while (true) {
 		ret = CheckLock(locked);
 		if ((!ret && locked) || ret == -ECANCELED)
 			break;
 
+		if (tune_abort_) {
+			ret = -ECANCELED;
+			break;
+		}
+
 		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
 		if (duration.count() >= timeout) {
 			ret = -ETIMEDOUT;
 			break;
 		}
 
-		Sleep(20);
+		// a quick lock is noticed early, a slow one is not polled more often than before
+		Sleep(interval);
+		if (interval < 20)
+			interval *= 2;
 	}
 
 	if (ret || !locked)
 		return false;
 
+	// number of 20ms polls it took to lock
+	i = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count() / 20);
+
 	if ((params_.system == px4::SystemType::ISDB_T) && (options_ & RECEIVER_WAIT_AFTER_LOCK_TC_T) && (i < 35))
 		Sleep((35 - i) * 10);
 
@@ -129,24 +163,270 @@ bool ReceiverBase::Tune(std::uint32_t timeout)
 	if (options_ & RECEIVER_WAIT_AFTER_LOCK)
 		Sleep(200);
 
+	tuned_ = true;
+
 	return true;
 }
 
+// tunes on another thread, the result is taken by WaitTune()
+bool ReceiverBase::StartTune(std::uint32_t timeout)
+{
+	std::lock_guard<std::mutex> lock(tune_mtx_);
+
+	if (tuning_)
+		return false;
+
+	if (tune_th_.joinable())
+		tune_th_.join();
+
+	tuning_ = true;
+	tune_result_ = false;
+	tune_abort_ = false;
+
+	try {
+		tune_th_ = std::thread([this, timeout] {
+			bool result = Tune(timeout);
+
+			{
+				std::lock_guard<std::mutex> lock(tune_mtx_);
+
+				tune_result_ = result;
+				tuning_ = false;
+			}
+
+			tune_cond_.notify_all();
+		});
+	} catch (...) {
+		tuning_ = false;
+		return false;
+	}
+
+	return true;
+}
+
+// returns false if the tune has not finished within the timeout
+bool ReceiverBase::WaitTune(std::uint32_t timeout, bool &result)
+{
+	std::unique_lock<std::mutex> lock(tune_mtx_);
+
+	if (!tune_cond_.wait_for(lock, std::chrono::milliseconds(timeout), [this] { return !tuning_; }))
+		return false;
+
+	result = tune_result_;
+
+	return true;
+}
+
+// must be called before the receiver is closed
+void ReceiverBase::AbortTune() noexcept
+{
+	tune_abort_ = true;
+
+	{
+		std::unique_lock<std::mutex> lock(tune_mtx_);
+
+		tune_cond_.wait(lock, [this] { return !tuning_; });
+
+		if (tune_th_.joinable())
+			tune_th_.join();
+	}
+
+	tune_abort_ = false;
+}
+
+// served from the cache, so that the clients polling the signal level do not access the I2C bus each time
 bool ReceiverBase::ReadStats(px4::command::StatSet &stat_set)
 {
+	{
+		std::lock_guard<std::mutex> lock(stats_mtx_);
+
+		RequestStats();
+
+		if (stats_valid_ && (std::chrono::steady_clock::now() - stats_time_) < std::chrono::milliseconds(RECEIVER_STATS_INTERVAL * 2))
+			return GetCachedStats(stat_set);
+	}
+
+	// not sampled since the last tune
 	std::lock_guard<std::mutex> lock(lock_);
 
+	SampleStats();
+
+	std::lock_guard<std::mutex> stats_lock(stats_mtx_);
+
+	return GetCachedStats(stat_set);
+}
+
+// waits for the stats newer than the sequence, returns false on timeout
+bool ReceiverBase::WaitStats(std::uint32_t timeout, std::uint32_t &sequence, px4::command::StatSet &stat_set)
+{
+	std::unique_lock<std::mutex> lock(stats_mtx_);
+	std::uint32_t seq = sequence;
+
+	RequestStats();
+
+	stats_waiters_++;
+	bool ret = stats_cond_.wait_for(lock, std::chrono::milliseconds(timeout), [this, seq] { return stats_quit_ || (stats_valid_ && stats_seq_ != seq); });
+	stats_waiters_--;
+
+	// keeps the poller running until the next request
+	stats_request_time_ = std::chrono::steady_clock::now();
+
+	if (!ret || stats_quit_)
+		return false;
+
+	sequence = stats_seq_;
+
+	return GetCachedStats(stat_set);
+}
+
+// must be called before the receiver is closed
+void ReceiverBase::StopStats() noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock(stats_mtx_);
+
+		stats_quit_ = true;
+		stats_valid_ = false;
+	}
+	stats_cond_.notify_all();
+
+	if (stats_th_.joinable())
+		stats_th_.join();
+
+	{
+		std::lock_guard<std::mutex> lock(stats_mtx_);
+
+		stats_quit_ = false;
+	}
+}
+
+// returns true if the last tune with exactly these parameters has succeeded
+bool ReceiverBase::IsTunedTo(const px4::command::ParameterSet &param_set) noexcept
+{
+	std::lock_guard<std::mutex> lock(lock_);
+
+	if (!tuned_ || params_.system != param_set.system || params_.freq != param_set.freq)
+		return false;
+
+	for (std::uint32_t i = 0; i < param_set.num; i++) {
+		switch (param_set.params[i].type) {
+		case px4::command::ParameterType::BANDWIDTH:
+			if (params_.bandwidth != param_set.params[i].value)
+				return false;
+
+			break;
+
+		case px4::command::ParameterType::STREAM_ID:
+			if (params_.stream_id != param_set.params[i].value)
+				return false;
+
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// stats_mtx_ must be held
+void ReceiverBase::RequestStats()
+{
+	stats_request_time_ = std::chrono::steady_clock::now();
+
+	if (stats_running_ || stats_quit_)
+		return;
+
+	if (stats_th_.joinable())
+		stats_th_.join();
+
+	stats_running_ = true;
+
+	try {
+		stats_th_ = std::thread(&ReceiverBase::StatsWorker, this);
+	} catch (...) {
+		// ReadStats() still works without the poller
+		stats_running_ = false;
+	}
+}
+
+void ReceiverBase::InvalidateStats() noexcept
+{
+	std::lock_guard<std::mutex> lock(stats_mtx_);
+
+	stats_valid_ = false;
+}
+
+// lock_ must be held
+void ReceiverBase::SampleStats()
+{
+	StatCache stats[_countof(stats_)];
+
+	stats[0].ret = -EINVAL;
+	stats[0].value = 0;
+
+	for (std::size_t i = 1; i < _countof(stats); i++) {
+		stats[i].value = 0;
+		stats[i].ret = ReadStat(static_cast<px4::command::StatType>(i), stats[i].value);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(stats_mtx_);
+
+		memcpy(stats_, stats, sizeof(stats_));
+		stats_valid_ = true;
+		stats_seq_++;
+		stats_time_ = std::chrono::steady_clock::now();
+	}
+	stats_cond_.notify_all();
+}
+
+// stats_mtx_ must be held
+bool ReceiverBase::GetCachedStats(px4::command::StatSet &stat_set) const noexcept
+{
 	for (std::uint32_t i = 0; i < stat_set.num; i++) {
-		if (ReadStat(stat_set.data[i].type, stat_set.data[i].value))
+		std::size_t type = static_cast<std::size_t>(stat_set.data[i].type);
+
+		if (!type || type >= _countof(stats_) || stats_[type].ret)
 			return false;
+
+		stat_set.data[i].value = stats_[type].value;
 	}
 
 	return true;
 }
 
+// one poller per receiver, it stops by itself when nobody has asked for a while
+void ReceiverBase::StatsWorker() noexcept
+{
+	std::unique_lock<std::mutex> lock(stats_mtx_);
+
+	while (!stats_quit_) {
+		if (!stats_waiters_ && (std::chrono::steady_clock::now() - stats_request_time_) >= std::chrono::milliseconds(RECEIVER_STATS_IDLE_TIMEOUT))
+			break;
+
+		lock.unlock();
+
+		{
+			std::lock_guard<std::mutex> receiver_lock(lock_);
+
+			SampleStats();
+		}
+
+		lock.lock();
+		stats_cond_.wait_for(lock, std::chrono::milliseconds(RECEIVER_STATS_INTERVAL), [this] { return stats_quit_; });
+	}
+
+	stats_running_ = false;
+}
+
 ReceiverBase::StreamBuffer::StreamBuffer()
-	: write_size_(0),
-	threshold_size_(0)
+	: stop_count_(0),
+	write_size_(0),
+	threshold_size_(0),
+	num_readers_(0),
+	release_pending_(false)
 {
 
 }
@@ -161,33 +441,56 @@ void ReceiverBase::StreamBuffer::SetThresholdSize(std::size_t size) noexcept
 	threshold_size_ = size;
 }
 
+// the memory is allocated when the capture starts, not for the receivers which are never used
 bool ReceiverBase::StreamBuffer::Alloc(std::size_t size)
 {
+	std::lock_guard<std::mutex> lock(mtx_);
+
+	release_pending_ = false;
+
 	return ringbuf_.Alloc(size);
 }
 
-void ReceiverBase::StreamBuffer::Start() noexcept
+// called on close, the memory is kept until the last reader has gone if any is left
+void ReceiverBase::StreamBuffer::Release() noexcept
 {
-	stop_ = false;
-	write_size_ = 0;
+	std::lock_guard<std::mutex> lock(mtx_);
+
+	if (ringbuf_.IsActive())
+		return;
+
+	if (num_readers_)
+		release_pending_ = true;
+	else
+		ringbuf_.Free();
 
-	ringbuf_.Start();
 	return;
 }
 
-void ReceiverBase::StreamBuffer::Stop() noexcept
+void ReceiverBase::StreamBuffer::Start() noexcept
 {
-	ringbuf_.Stop();
+	write_size_ = 0;
 
-	stop_ = true;
+	ringbuf_.Start();
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+	}
 	cond_.notify_all();
 
 	return;
 }
 
-void ReceiverBase::StreamBuffer::StopRequest() noexcept
+void ReceiverBase::StreamBuffer::Stop() noexcept
 {
-	stop_ = true;
+	ringbuf_.Stop();
+
+	// the readers which have seen the buffer active stop reading
+	stop_count_++;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+	}
 	cond_.notify_all();
 
 	return;
@@ -212,42 +515,124 @@ void ReceiverBase::StreamBuffer::NotifyWrite() noexcept
 	return;
 }
 
-void ReceiverBase::StreamBuffer::HandleRead(std::size_t buf_size, std::function<bool(const void *buf, std::size_t size)> handler)
+std::shared_ptr<ReceiverBase::StreamBuffer::Reader> ReceiverBase::StreamBuffer::CreateReader()
 {
-	stop_ = false;
+	return std::make_shared<Reader>(shared_from_this());
+}
+
+ReceiverBase::StreamBuffer::Reader::Reader(std::shared_ptr<StreamBuffer> parent) noexcept
+	: parent_(parent),
+	cursor_(),
+	stop_(false)
+{
+	std::lock_guard<std::mutex> lock(parent_->mtx_);
+
+	parent_->num_readers_++;
+	parent_->ringbuf_.Attach(cursor_);
+}
+
+ReceiverBase::StreamBuffer::Reader::~Reader()
+{
+	std::lock_guard<std::mutex> lock(parent_->mtx_);
+
+	if (!--parent_->num_readers_ && parent_->release_pending_ && !parent_->ringbuf_.IsActive()) {
+		parent_->release_pending_ = false;
+		parent_->ringbuf_.Free();
+	}
+}
+
+void ReceiverBase::StreamBuffer::Reader::StopRequest() noexcept
+{
+	stop_ = true;
+
+	{
+		std::lock_guard<std::mutex> lock(parent_->mtx_);
+	}
+	parent_->cond_.notify_all();
+
+	return;
+}
+
+bool ReceiverBase::StreamBuffer::Reader::WaitActive(unsigned int &stop_count)
+{
+	std::unique_lock<std::mutex> lock(parent_->mtx_);
+
+	parent_->cond_.wait(lock, [this, &stop_count] {
+		// read before the state, so that a Stop() in between is not missed
+		stop_count = parent_->stop_count_;
+		return parent_->ringbuf_.IsActive() || stop_;
+	});
+
+	return !stop_;
+}
+
+bool ReceiverBase::StreamBuffer::Reader::WaitReadable(unsigned int stop_count)
+{
+	std::unique_lock<std::mutex> lock(parent_->mtx_);
+
+	parent_->cond_.wait(lock, [this, stop_count] {
+		return stop_ || parent_->stop_count_ != stop_count || parent_->ringbuf_.GetReadableSize(cursor_);
+	});
+
+	return !stop_ && parent_->stop_count_ == stop_count;
+}
 
+void ReceiverBase::StreamBuffer::Reader::HandleRead(std::size_t buf_size, std::function<bool(const void *buf, std::size_t size)> handler)
+{
 	std::unique_ptr<std::uint8_t[]> buf(new std::uint8_t[buf_size]);
 	std::uint8_t *p = buf.get();
-	std::unique_lock<std::mutex> lock(mtx_);
+	unsigned int stop_count;
 
-	while (!ringbuf_.IsActive() && !stop_)
-		cond_.wait(lock);
+	if (!WaitActive(stop_count))
+		return;
 
-	while (true) {
-		while (!ringbuf_.GetReadableSize() && !stop_)
-			cond_.wait(lock);
+	while (WaitReadable(stop_count)) {
+		std::size_t size = buf_size;
 
-		if (stop_)
+		if (!parent_->ringbuf_.Read(cursor_, p, size))
 			break;
 
-		std::size_t size = buf_size;
+		if (!size)
+			continue;
+
+		if (!handler(p, size))
+			break;
+	}
+
+	return;
+}
+
+// reads directly into the buffer provided by begin(), without an intermediate copy
+void ReceiverBase::StreamBuffer::Reader::HandleRead(std::function<bool(void *&buf, std::size_t &size)> begin, std::function<bool(std::size_t size)> end)
+{
+	unsigned int stop_count;
+
+	if (!WaitActive(stop_count))
+		return;
+
+	while (WaitReadable(stop_count)) {
+		void *p;
+		std::size_t size;
 
-		if (!ringbuf_.Read(p, size))
+		if (!begin(p, size))
+			break;
+
+		if (!parent_->ringbuf_.Read(cursor_, p, size))
 			break;
 
 		if (!size)
 			continue;
 
-		if (!handler(p, size))
+		if (!end(size))
 			break;
 	}
 
 	return;
 }
 
-bool ReceiverBase::StreamBuffer::Purge() noexcept
+bool ReceiverBase::StreamBuffer::Reader::Purge() noexcept
 {
-	return ringbuf_.Purge();
+	return parent_->ringbuf_.Purge(cursor_);
 }
 
 } // namespace px4
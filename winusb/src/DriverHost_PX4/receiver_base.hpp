@@ -5,9 +5,12 @@
 #include <cstdint>
 #include <cstddef>
 #include <memory>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <thread>
+#include <chrono>
 #include <stdexcept>
 
 #include "type.hpp"
@@ -25,28 +28,58 @@ public:
 		std::uint32_t stream_id;
 	};
 
-	class StreamBuffer final {
+	class StreamBuffer final : public std::enable_shared_from_this<StreamBuffer> {
 	public:
+		// each reader has its own position and overflow accounting
+		class Reader final {
+		public:
+			explicit Reader(std::shared_ptr<StreamBuffer> parent) noexcept;
+			~Reader();
+
+			// cannot copy
+			Reader(const Reader &) = delete;
+			Reader& operator=(const Reader &) = delete;
+
+			// cannot move
+			Reader(Reader &&) = delete;
+			Reader& operator=(Reader &&) = delete;
+
+			void StopRequest() noexcept;
+			void HandleRead(std::size_t buf_size, std::function<bool(const void *buf, std::size_t size)> handler);
+			void HandleRead(std::function<bool(void *&buf, std::size_t &size)> begin, std::function<bool(std::size_t size)> end);
+			bool Purge() noexcept;
+			std::uint64_t GetOverflowSize() const noexcept { return cursor_.GetOverflowSize(); }
+
+		private:
+			bool WaitActive(unsigned int &stop_count);
+			bool WaitReadable(unsigned int stop_count);
+
+			std::shared_ptr<StreamBuffer> parent_;
+			px4::RingBuffer::Cursor cursor_;
+			std::atomic_bool stop_;
+		};
+
 		StreamBuffer();
 		~StreamBuffer();
 
 		void SetThresholdSize(std::size_t size) noexcept;
 		bool Alloc(std::size_t size);
+		void Release() noexcept;
 		void Start() noexcept;
 		void Stop() noexcept;
-		void StopRequest() noexcept;
 		bool Write(const void *buf, std::size_t &size) noexcept;
 		void NotifyWrite() noexcept;
-		void HandleRead(std::size_t buf_size, std::function<bool(const void *buf, std::size_t size)> handler);
-		bool Purge() noexcept;
+		std::shared_ptr<Reader> CreateReader();
 
 	private:
 		std::mutex mtx_;
 		px4::RingBuffer ringbuf_;
-		std::atomic_bool stop_;
+		std::atomic_uint stop_count_;
 		std::condition_variable cond_;
 		std::size_t write_size_;
 		std::size_t threshold_size_;
+		unsigned int num_readers_;
+		bool release_pending_;	// released by the last reader
 	};
 
 	ReceiverBase(unsigned int options);
@@ -64,7 +97,13 @@ public:
 	bool SetParameters(const px4::command::ParameterSet &param_set) noexcept;
 	void ClearParameters() noexcept;
 	bool Tune(std::uint32_t timeout);
+	bool StartTune(std::uint32_t timeout);
+	bool WaitTune(std::uint32_t timeout, bool &result);
+	void AbortTune() noexcept;
 	bool ReadStats(px4::command::StatSet &stat_set);
+	bool WaitStats(std::uint32_t timeout, std::uint32_t &sequence, px4::command::StatSet &stat_set);
+	void StopStats() noexcept;
+	bool IsTunedTo(const px4::command::ParameterSet &param_set) noexcept;
 	std::shared_ptr<StreamBuffer> GetStreamBuffer() noexcept { return stream_buf_; }
 
 	virtual int Open() = 0;
@@ -85,10 +124,39 @@ protected:
 #define RECEIVER_WAIT_AFTER_LOCK_TC_T		0x00000080
 
 	Parameters params_;
+	bool tuned_;
 	std::shared_ptr<StreamBuffer> stream_buf_;
 
 private:
+	struct StatCache {
+		int ret;
+		std::int32_t value;
+	};
+
+	void RequestStats();
+	void InvalidateStats() noexcept;
+	void SampleStats();
+	bool GetCachedStats(px4::command::StatSet &stat_set) const noexcept;
+	void StatsWorker() noexcept;
+
 	std::mutex lock_;
+	std::thread tune_th_;
+	std::mutex tune_mtx_;
+	std::condition_variable tune_cond_;
+	bool tuning_;
+	bool tune_result_;
+	std::atomic_bool tune_abort_;
+	std::thread stats_th_;
+	std::mutex stats_mtx_;
+	std::condition_variable stats_cond_;
+	bool stats_running_;
+	bool stats_quit_;
+	bool stats_valid_;
+	unsigned int stats_waiters_;
+	std::uint32_t stats_seq_;
+	std::chrono::steady_clock::time_point stats_time_;
+	std::chrono::steady_clock::time_point stats_request_time_;
+	StatCache stats_[3];	// indexed by StatType
 };
 
 class ReceiverError : public std::runtime_error {
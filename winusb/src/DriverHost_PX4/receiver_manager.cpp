@@ -2,73 +2,214 @@
 
 #include "receiver_manager.hpp"
 
+#include <cerrno>
 #include <random>
 
+#include "network_sink.hpp"
+#include "msg.h"
+
 namespace px4 {
 
-bool ReceiverManager::Register(px4::command::ReceiverInfo &info, px4::ReceiverBase *receiver)
+std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> ReceiverManager::Session::WaitReader(const std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> &prev)
+{
+	std::unique_lock<std::mutex> lock(mtx_);
+
+	cond_.wait(lock, [this, &prev] { return closed_ || reader_ != prev; });
+
+	return (closed_) ? nullptr : reader_;
+}
+
+bool ReceiverManager::Session::Purge() noexcept
 {
+	std::lock_guard<std::mutex> lock(mtx_);
+
+	return (reader_) ? reader_->Purge() : false;
+}
+
+void ReceiverManager::Session::Close() noexcept
+{
+	std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+
+		closed_ = true;
+		reader = std::move(reader_);
+	}
+
+	if (reader)
+		reader->StopRequest();
+
+	cond_.notify_all();
+}
+
+void ReceiverManager::Session::SetReader(std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader) noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+
+		if (closed_)
+			return;
+
+		reader_.swap(reader);
+	}
+
+	// stop the reader of the previous receiver
+	if (reader)
+		reader->StopRequest();
+
+	cond_.notify_all();
+}
+
+bool ReceiverManager::Register(px4::command::ReceiverInfo &info, px4::ReceiverBase *receiver, const px4::ReceiverDefinition &def)
+{
+	std::shared_ptr<px4::NetworkSink> sink;
+
+	if (!def.network_output.empty()) {
+		px4::NetworkSink::Config config = { def.network_output, def.network_output_interface, def.network_output_ttl };
+
+		sink = std::make_shared<px4::NetworkSink>(config, receiver->GetStreamBuffer());
+
+		// the receiver is still usable by the clients without it
+		if (!sink->Start()) {
+			msg_err("px4::ReceiverManager::Register: cannot start the network output %S. (code: %d)\n", def.network_output.c_str(), sink->GetError().value());
+			sink.reset();
+		}
+	}
+
 	std::lock_guard<std::shared_mutex> lock(mtx_);
 
 	if (data_.count(receiver))
 		return false;
 
-	data_.emplace(receiver, ReceiverData{ info, false });
+	data_.emplace(receiver, ReceiverData{ info, true, 0, 0, sink });
 	return true;
 }
 
 bool ReceiverManager::Unregister(px4::ReceiverBase *receiver)
 {
-	std::lock_guard<std::shared_mutex> lock(mtx_);
+	std::shared_ptr<px4::NetworkSink> sink;
 
-	if (!data_.count(receiver))
-		return false;
+	{
+		std::lock_guard<std::shared_mutex> lock(mtx_);
+
+		if (!data_.count(receiver))
+			return false;
+
+		auto& data = data_.at(receiver);
+
+		// stopped out of the lock, when it goes out of scope
+		sink = std::move(data.sink);
+
+		if (data.ref_count) {
+			// still used by the clients, erased by the last Detach()
+			data.registered = false;
+			return true;
+		}
+
+		data_.erase(receiver);
+	}
 
-	data_.erase(receiver);
 	return true;
 }
 
 static GUID empty_guid = { 0 };
 
+static bool MatchKey(const px4::command::ReceiverInfo &key, const px4::command::ReceiverInfo &k)
+{
+	if (key.device_name[0] && wcscmp(key.device_name, k.device_name))
+		return false;
+
+	if (memcmp(&key.device_guid, &empty_guid, sizeof(key.device_guid) && memcmp(&key.device_guid, &k.device_guid, sizeof(key.device_guid))))
+		return false;
+
+	if (key.receiver_name[0] && wcscmp(key.receiver_name, k.receiver_name))
+		return false;
+
+	if (memcmp(&key.receiver_guid, &empty_guid, sizeof(key.receiver_guid) && memcmp(&key.receiver_guid, &k.receiver_guid, sizeof(key.receiver_guid))))
+		return false;
+
+	if ((key.systems & k.systems) != key.systems)
+		return false;
+
+	if ((key.index >= 0) && (key.index != k.index))
+		return false;
+
+	return true;
+}
+
 px4::ReceiverBase* ReceiverManager::SearchAndOpen(px4::command::ReceiverInfo &key, px4::command::ReceiverInfo &info, std::uint32_t &data_id)
 {
 	std::lock_guard<std::shared_mutex> lock(mtx_);
 
-	for (auto it = data_.cbegin(); it != data_.cend(); ++it) {
-		const px4::command::ReceiverInfo& k = it->second.info;
+	px4::ReceiverBase *r = Open(key, info);
+	if (!r)
+		return nullptr;
 
-		if (k.data_id)
-			continue;
+	if (!GenerateDataId(data_id)) {
+		r->Close();
+		return nullptr;
+	}
 
-		if (key.device_name[0] && wcscmp(key.device_name, k.device_name))
-			continue;
+	ClientData client{ key, nullptr, std::make_shared<Session>(), true, false };
 
-		if (memcmp(&key.device_guid, &empty_guid, sizeof(key.device_guid) && memcmp(&key.device_guid, &k.device_guid, sizeof(key.device_guid))))
-			continue;
+	Attach(client, r);
+	clients_.emplace(data_id, client);
 
-		if (key.receiver_name[0] && wcscmp(key.receiver_name, k.receiver_name))
-			continue;
+	info.data_id = data_id;
 
-		if (memcmp(&key.receiver_guid, &empty_guid, sizeof(key.receiver_guid) && memcmp(&key.receiver_guid, &k.receiver_guid, sizeof(key.receiver_guid))))
-			continue;
+	return r;
+}
 
-		if ((key.systems & k.systems) != key.systems)
-			continue;
+std::shared_ptr<ReceiverManager::Session> ReceiverManager::SearchByDataId(std::uint32_t data_id)
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
 
-		if ((key.index >= 0) && (key.index != k.index))
-			continue;
+	auto it = clients_.find(data_id);
+	if (it == clients_.end() || !it->second.valid_data_id)
+		return nullptr;
+
+	it->second.valid_data_id = false;
+	return it->second.session;
+}
 
+// moves the client to another receiver which is already streaming with the parameters set to its own
+px4::ReceiverBase* ReceiverManager::Share(std::uint32_t data_id, px4::command::ReceiverInfo &info)
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
+
+	auto client = clients_.find(data_id);
+	if (client == clients_.end())
+		return nullptr;
+
+	std::uint8_t buf[sizeof(px4::command::ParameterSet) + sizeof(px4::command::Parameter)];
+	px4::command::ParameterSet &param_set = *reinterpret_cast<px4::command::ParameterSet *>(buf);
+
+	param_set.num = 2;
+	param_set.params[0].type = px4::command::ParameterType::BANDWIDTH;
+	param_set.params[1].type = px4::command::ParameterType::STREAM_ID;
+
+	if (!client->second.receiver->GetParameters(param_set))
+		return nullptr;
+
+	for (auto it = data_.begin(); it != data_.end(); ++it) {
 		px4::ReceiverBase *r = it->first;
+		const ReceiverData &v = it->second;
 
-		if (r->Open())
+		if (r == client->second.receiver || !v.registered || !v.ref_count || !v.capture_count)
 			continue;
 
-		if (!GenerateDataId(r, data_id)) {
-			r->Close();
+		if (!MatchKey(client->second.key, v.info))
 			continue;
-		}
 
-		info = k;
+		if (!r->IsTunedTo(param_set))
+			continue;
+
+		info = v.info;
+		info.data_id = data_id;
+
+		Detach(client->second);
+		Attach(client->second, r);
 
 		return r;
 	}
@@ -76,64 +217,183 @@ px4::ReceiverBase* ReceiverManager::SearchAndOpen(px4::command::ReceiverInfo &ke
 	return nullptr;
 }
 
-px4::ReceiverBase* ReceiverManager::SearchByDataId(std::uint32_t data_id)
+// moves the client from a shared receiver to a receiver of its own
+px4::ReceiverBase* ReceiverManager::Unshare(std::uint32_t data_id, px4::command::ReceiverInfo &info)
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
+
+	auto client = clients_.find(data_id);
+	if (client == clients_.end())
+		return nullptr;
+
+	px4::ReceiverBase *r = Open(client->second.key, info);
+	if (!r)
+		return nullptr;
+
+	info.data_id = data_id;
+
+	Detach(client->second);
+	Attach(client->second, r);
+
+	return r;
+}
+
+bool ReceiverManager::IsShared(px4::ReceiverBase *receiver)
 {
 	std::shared_lock<std::shared_mutex> lock(mtx_);
 
-	for (auto it = data_.begin(); it != data_.end(); ++it) {
-		if (it->second.info.data_id != data_id || !it->second.valid_data_id)
-			continue;
+	auto it = data_.find(receiver);
+
+	return (it != data_.end() && it->second.ref_count > 1);
+}
+
+// the receiver keeps capturing as long as one of its clients wants to
+int ReceiverManager::SetCapture(std::uint32_t data_id, bool capture)
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
+
+	auto client = clients_.find(data_id);
+	if (client == clients_.end())
+		return -EINVAL;
 
-		it->second.valid_data_id = false;
-		return it->first;
+	if (client->second.capture == capture)
+		return -EALREADY;
+
+	px4::ReceiverBase *r = client->second.receiver;
+	ReceiverData &v = data_.at(r);
+	int ret = 0;
+
+	if (capture) {
+		if (!v.capture_count)
+			ret = r->SetCapture(true);
+
+		if (ret)
+			return ret;
+
+		v.capture_count++;
+	} else {
+		if (v.capture_count == 1)
+			ret = r->SetCapture(false);
+
+		if (ret)
+			return ret;
+
+		v.capture_count--;
 	}
 
-	return nullptr;
+	client->second.capture = capture;
+
+	return 0;
 }
 
-bool ReceiverManager::GenerateDataId(px4::ReceiverBase *receiver, std::uint32_t &data_id)
+// purges the stream of the client, as PURGE on its data pipe does
+bool ReceiverManager::Purge(std::uint32_t data_id)
 {
-	if (!data_.count(receiver))
-		return false;
+	std::shared_ptr<Session> session;
 
-	auto& v = data_.at(receiver);
+	{
+		std::shared_lock<std::shared_mutex> lock(mtx_);
 
-	if (v.info.data_id)
-		return false;
+		auto client = clients_.find(data_id);
+		if (client == clients_.end())
+			return false;
+
+		session = client->second.session;
+	}
+
+	return session->Purge();
+}
+
+void ReceiverManager::Close(std::uint32_t data_id)
+{
+	std::lock_guard<std::shared_mutex> lock(mtx_);
+
+	auto client = clients_.find(data_id);
+	if (client == clients_.end())
+		return;
+
+	client->second.session->Close();
+	Detach(client->second);
 
+	clients_.erase(client);
+
+	return;
+}
+
+px4::ReceiverBase* ReceiverManager::Open(const px4::command::ReceiverInfo &key, px4::command::ReceiverInfo &info)
+{
+	for (auto it = data_.cbegin(); it != data_.cend(); ++it) {
+		const px4::command::ReceiverInfo& k = it->second.info;
+
+		if (!it->second.registered || it->second.ref_count)
+			continue;
+
+		if (!MatchKey(key, k))
+			continue;
+
+		px4::ReceiverBase *r = it->first;
+
+		if (r->Open())
+			continue;
+
+		info = k;
+
+		return r;
+	}
+
+	return nullptr;
+}
+
+bool ReceiverManager::GenerateDataId(std::uint32_t &data_id)
+{
 	while (true) {
 		std::uint32_t tmp = std::random_device()();
 
-		if (!tmp)
+		if (!tmp || clients_.count(tmp))
 			continue;
 
-		auto it = data_.cbegin();
-		for (; it != data_.cend(); ++it) {
-			if (it->second.info.data_id == tmp)
-				break;
-		}
-
-		if (it == data_.cend()) {
-			v.info.data_id = data_id = tmp;
-			v.valid_data_id = true;
-			break;
-		}
+		data_id = tmp;
+		break;
 	}
 
 	return true;
 }
 
-void ReceiverManager::ClearDataId(px4::ReceiverBase *receiver)
+void ReceiverManager::Attach(ClientData &client, px4::ReceiverBase *receiver)
 {
-	std::lock_guard<std::shared_mutex> lock(mtx_);
+	ReceiverData &v = data_.at(receiver);
+
+	v.ref_count++;
+	client.receiver = receiver;
+
+	if (client.capture && !v.capture_count++)
+		receiver->SetCapture(true);
+
+	client.session->SetReader(receiver->GetStreamBuffer()->CreateReader());
+
+	return;
+}
+
+void ReceiverManager::Detach(ClientData &client)
+{
+	px4::ReceiverBase *r = client.receiver;
+	ReceiverData &v = data_.at(r);
+
+	client.receiver = nullptr;
+
+	if (client.capture && !--v.capture_count && v.ref_count > 1)
+		r->SetCapture(false);
 
-	if (!data_.count(receiver))
+	if (--v.ref_count)
 		return;
 
-	auto& data = data_.at(receiver);
+	// Close() also stops capturing
+	r->AbortTune();
+	r->StopStats();
+	r->Close();
 
-	data.info.data_id = 0;
-	data.valid_data_id = false;
+	if (!v.registered)
+		data_.erase(r);
 
 	return;
 }
@@ -2,16 +2,57 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #include <shared_mutex>
+#include <condition_variable>
 #include <map>
 
 #include "command.hpp"
+#include "device_definition_set.hpp"
 #include "receiver_base.hpp"
 
 namespace px4 {
 
+class NetworkSink;
+
 class ReceiverManager final {
 public:
+	// the stream of one client, it follows the client when it is moved to another receiver
+	class Session final {
+	public:
+		Session() noexcept : closed_(false), purge_epoch_(0) {}
+		~Session() {}
+
+		// cannot copy
+		Session(const Session &) = delete;
+		Session& operator=(const Session &) = delete;
+
+		// cannot move
+		Session(Session &&) = delete;
+		Session& operator=(Session &&) = delete;
+
+		std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> WaitReader(const std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> &prev);
+		bool Purge() noexcept;
+		// the purge is done by the stream thread, which writes the marker at the exact point
+		void RequestPurge(std::uint32_t epoch) noexcept { purge_epoch_ = epoch; }
+		std::uint32_t TakePurge() noexcept { return purge_epoch_.exchange(0); }
+		void Close() noexcept;
+
+	private:
+		friend class ReceiverManager;
+
+		void SetReader(std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader) noexcept;
+
+		std::mutex mtx_;
+		std::condition_variable cond_;
+		std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader_;
+		bool closed_;
+		std::atomic<std::uint32_t> purge_epoch_;	// 0: none requested
+	};
+
 	ReceiverManager() {};
 	~ReceiverManager() {};
 
@@ -23,22 +64,42 @@ public:
 	ReceiverManager(ReceiverManager &&) = delete;
 	ReceiverManager& operator=(ReceiverManager &&) = delete;
 
-	bool Register(px4::command::ReceiverInfo &info, px4::ReceiverBase *receiver);
+	bool Register(px4::command::ReceiverInfo &info, px4::ReceiverBase *receiver, const px4::ReceiverDefinition &def);
 	bool Unregister(px4::ReceiverBase *receiver);
 	px4::ReceiverBase* SearchAndOpen(px4::command::ReceiverInfo &key, px4::command::ReceiverInfo &info, std::uint32_t &data_id);
-	px4::ReceiverBase* SearchByDataId(std::uint32_t data_id);
-	void ClearDataId(px4::ReceiverBase *receiver);
+	std::shared_ptr<Session> SearchByDataId(std::uint32_t data_id);
+	px4::ReceiverBase* Share(std::uint32_t data_id, px4::command::ReceiverInfo &info);
+	px4::ReceiverBase* Unshare(std::uint32_t data_id, px4::command::ReceiverInfo &info);
+	bool IsShared(px4::ReceiverBase *receiver);
+	int SetCapture(std::uint32_t data_id, bool capture);
+	bool Purge(std::uint32_t data_id);
+	void Close(std::uint32_t data_id);
 
 private:
 	struct ReceiverData {
 		px4::command::ReceiverInfo info;
+		bool registered;
+		unsigned int ref_count;
+		unsigned int capture_count;
+		std::shared_ptr<px4::NetworkSink> sink;	// NetworkOutput of the receiver definition
+	};
+
+	struct ClientData {
+		px4::command::ReceiverInfo key;
+		px4::ReceiverBase *receiver;
+		std::shared_ptr<Session> session;
 		bool valid_data_id;
+		bool capture;
 	};
 
-	bool GenerateDataId(px4::ReceiverBase *receiver, std::uint32_t &data_id);
+	px4::ReceiverBase* Open(const px4::command::ReceiverInfo &key, px4::command::ReceiverInfo &info);
+	bool GenerateDataId(std::uint32_t &data_id);
+	void Attach(ClientData &client, px4::ReceiverBase *receiver);
+	void Detach(ClientData &client);
 
 	std::shared_mutex mtx_;
 	std::map<px4::ReceiverBase*, ReceiverData> data_;
+	std::map<std::uint32_t, ClientData> clients_;
 };
 
 } // namespace px4
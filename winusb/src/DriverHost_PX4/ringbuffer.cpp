@@ -3,6 +3,7 @@
 #include "ringbuffer.hpp"
 
 #include <cstring>
+#include <thread>
 
 #include <windows.h>
 
@@ -10,14 +11,12 @@ namespace px4 {
 
 RingBuffer::RingBuffer(std::size_t size)
 	: state_(0),
+	writing_(false),
 	buf_(nullptr),
-	actual_size_(0),
-	head_(0),
-	tail_(0),
-	wait_(false),
-	rw_count_(0),
-	wait_lock_(),
-	wait_cond_()
+	buf_size_(0),
+	generation_(0),
+	reserve_(0),
+	tail_(0)
 {
 	Alloc(size);
 }
@@ -36,6 +35,9 @@ bool RingBuffer::Alloc(std::size_t size)
 		return false;
 
 	if (buf_ && buf_size_ != size) {
+		while (writing_.load())
+			std::this_thread::yield();
+
 		VirtualFree(buf_, 0, MEM_RELEASE);
 		buf_ = nullptr;
 		buf_size_ = 0;
@@ -54,11 +56,33 @@ bool RingBuffer::Alloc(std::size_t size)
 	return true;
 }
 
+// releases the memory of a stopped buffer, none of the cursors may be reading it
+bool RingBuffer::Free() noexcept
+{
+	if (state_)
+		return false;
+
+	// a Write() which has seen the buffer active before Stop() may still be copying
+	while (writing_.load())
+		std::this_thread::yield();
+
+	if (buf_) {
+		VirtualFree(buf_, 0, MEM_RELEASE);
+		buf_ = nullptr;
+		buf_size_ = 0;
+	}
+
+	Reset();
+
+	return true;
+}
+
+// must not be called while writing
 void RingBuffer::Reset() noexcept
 {
-	actual_size_ = 0;
-	head_ = 0;
+	reserve_ = 0;
 	tail_ = 0;
+	generation_++;
 }
 
 void RingBuffer::Start() noexcept
@@ -73,45 +97,73 @@ void RingBuffer::Stop() noexcept
 	state_ = 0;
 }
 
-bool RingBuffer::Read(void *buf, std::size_t &size) noexcept
+// the cursor starts at the current end of the data
+void RingBuffer::Attach(Cursor &cursor) noexcept
+{
+	cursor.generation_ = generation_.load(std::memory_order_acquire);
+	cursor.head_ = tail_.load(std::memory_order_acquire);
+	cursor.read_epoch_ = cursor.purge_epoch_;
+}
+
+bool RingBuffer::Read(Cursor &cursor, void *buf, std::size_t &size) noexcept
 {
-#if 0
-	int expected_state = 1;
+	unsigned int generation = generation_.load(std::memory_order_acquire);
 
-	state_.compare_exchange_strong(expected_state, 2);
-#endif
+	if (cursor.generation_ != generation) {
+		// the buffer has been reset (reallocated) since the last read
+		cursor.generation_ = generation;
+		cursor.head_ = 0;
+	}
+
+	std::size_t head = cursor.head_;
+	std::size_t tail = tail_.load(std::memory_order_acquire);
+	unsigned int epoch = cursor.purge_epoch_.load(std::memory_order_acquire);
 
-	if (wait_) {
+	if (epoch != cursor.read_epoch_) {
+		// purge requested, discard everything written so far
+		cursor.read_epoch_ = epoch;
+		cursor.head_ = tail;
 		size = 0;
 		return true;
 	}
 
-	++rw_count_;
-
-	std::size_t actual_size = actual_size_;
-	std::intptr_t head = head_;
 	std::size_t buf_size = buf_size_;
+	std::size_t actual_size = tail - head;
+
+	if (actual_size > buf_size) {
+		// overrun by the producer
+		cursor.overflow_size_ += actual_size;
+		cursor.head_ = tail;
+		size = 0;
+		return true;
+	}
+
 	std::size_t read_size = (size <= actual_size) ? size : actual_size;
 
 	if (read_size) {
-		std::size_t tmp = (head + read_size <= buf_size) ? read_size : (buf_size - head);
+		std::size_t ofs = head % buf_size;
+		std::size_t tmp = (ofs + read_size <= buf_size) ? read_size : (buf_size - ofs);
+
+		std::memcpy(buf, buf_ + ofs, tmp);
+
+		if (tmp < read_size)
+			std::memcpy(reinterpret_cast<std::uint8_t *>(buf) + tmp, buf_, read_size - tmp);
 
-		memcpy(buf, buf_ + head, tmp);
+		// the producer may have started to overwrite the region while it was being copied
+		std::atomic_thread_fence(std::memory_order_acquire);
 
-		if (tmp < read_size) {
-			memcpy(reinterpret_cast<std::uint8_t *>(buf) + tmp, buf_, read_size - tmp);
-			head = read_size - tmp;
-		} else {
-			head = (head + read_size == buf_size) ? 0 : (head + read_size);
+		std::size_t reserve = reserve_.load(std::memory_order_relaxed);
+
+		if (reserve - head > buf_size) {
+			cursor.overflow_size_ += tail - head;
+			cursor.head_ = tail;
+			size = 0;
+			return true;
 		}
 
-		head_ = head;
-		actual_size_ -= read_size;
+		cursor.head_ = head + read_size;
 	}
 
-	if (!--rw_count_ && wait_)
-		wait_cond_.notify_all();
-
 	size = read_size;
 
 	return true;
@@ -119,46 +171,35 @@ bool RingBuffer::Read(void *buf, std::size_t &size) noexcept
 
 bool RingBuffer::Write(const void *buf, std::size_t &size) noexcept
 {
-#if 0
-	if (state_ != 2)
-		return false;
-#else
-	if (!state_) {
-		size = 0;
-		return false;
-	}
-#endif
+	// ordered against Stop() and Free(), so that the buffer is not released under the copy
+	writing_.store(true);
 
-	if (wait_) {
+	if (!state_.load()) {
+		writing_.store(false, std::memory_order_release);
 		size = 0;
-		return true;
+		return false;
 	}
 
-	++rw_count_;
-
-	std::size_t actual_size = actual_size_;
-	std::intptr_t tail = tail_;
+	std::size_t tail = tail_.load(std::memory_order_relaxed);
 	std::size_t buf_size = buf_size_;
-	std::size_t write_size = (actual_size + size <= buf_size) ? size : (buf_size - actual_size);
+	std::size_t write_size = (size <= buf_size) ? size : buf_size;
 
 	if (write_size) {
-		std::size_t tmp = (tail + write_size <= buf_size) ? write_size : (buf_size - tail);
+		std::size_t ofs = tail % buf_size;
+		std::size_t tmp = (ofs + write_size <= buf_size) ? write_size : (buf_size - ofs);
 
-		std::memcpy(buf_ + tail, buf, tmp);
+		reserve_.store(tail + write_size, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 
-		if (tmp < write_size) {
+		std::memcpy(buf_ + ofs, buf, tmp);
+
+		if (tmp < write_size)
 			std::memcpy(buf_, reinterpret_cast<const std::uint8_t *>(buf) + tmp, write_size - tmp);
-			tail = write_size - tmp;
-		} else {
-			tail = (tail + write_size == buf_size) ? 0 : (tail + write_size);
-		}
 
-		tail_ = tail;
-		actual_size_ += write_size;
+		tail_.store(tail + write_size, std::memory_order_release);
 	}
 
-	if (!--rw_count_ && wait_)
-		wait_cond_.notify_all();
+	writing_.store(false, std::memory_order_release);
 
 	bool ret = (size == write_size);
 
@@ -166,28 +207,19 @@ bool RingBuffer::Write(const void *buf, std::size_t &size) noexcept
 	return ret;
 }
 
-bool RingBuffer::Purge() noexcept
+// may be called from any thread, the data is discarded by the next Read() of the cursor
+bool RingBuffer::Purge(Cursor &cursor) noexcept
 {
-	try {
-		bool expected = false;
-
-		if (!wait_.compare_exchange_strong(expected, true))
-			return false;
-
-		{
-			std::unique_lock<std::mutex> lock(wait_lock_);
-			wait_cond_.wait(lock, [this] {
-				return (rw_count_ == 0);
-			});
-		}
+	cursor.purge_epoch_.fetch_add(1, std::memory_order_release);
+	return true;
+}
 
-		Reset();
-		wait_ = false;
-	} catch (...) {
-		return false;
-	}
+std::size_t RingBuffer::GetReadableSize(const Cursor &cursor) const noexcept
+{
+	if (cursor.generation_ != generation_.load(std::memory_order_acquire))
+		return tail_.load(std::memory_order_acquire);
 
-	return true;
+	return tail_.load(std::memory_order_acquire) - cursor.head_;
 }
 
 } // namespace px4
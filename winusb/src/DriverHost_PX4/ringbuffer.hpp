@@ -5,39 +5,55 @@
 #include <cstdint>
 #include <atomic>
 #include <memory>
-#include <mutex>
-#include <condition_variable>
 
 namespace px4 {
 
+// single producer, any number of consumers, each with its own cursor
+// The producer never waits for the consumers, a consumer which falls behind by more than
+// the size of the buffer loses the data it has not read yet.
 class RingBuffer final {
 public:
+	class Cursor final {
+	public:
+		Cursor() noexcept : generation_(0), head_(0), purge_epoch_(0), read_epoch_(0), overflow_size_(0) {}
+
+		std::uint64_t GetOverflowSize() const noexcept { return overflow_size_; }
+
+	private:
+		friend class RingBuffer;
+
+		unsigned int generation_;
+		std::size_t head_;	// owned by the consumer
+		std::atomic_uint purge_epoch_;
+		unsigned int read_epoch_;
+		std::atomic<std::uint64_t> overflow_size_;
+	};
+
 	explicit RingBuffer() : RingBuffer(0) {}
 	explicit RingBuffer(std::size_t size);
 	~RingBuffer();
 
 	bool Alloc(std::size_t size);
+	bool Free() noexcept;
 	void Reset() noexcept;
 	void Start() noexcept;
 	void Stop() noexcept;
 	bool IsActive() noexcept { return (state_.load()); }
-	bool Read(void *buf, std::size_t &size) noexcept;
+	void Attach(Cursor &cursor) noexcept;
+	bool Read(Cursor &cursor, void *buf, std::size_t &size) noexcept;
 	bool Write(const void *buf, std::size_t &size) noexcept;
-	bool Purge() noexcept;
-	std::size_t GetReadableSize() const noexcept { return actual_size_; }
-	std::size_t GetWritableSize() const noexcept { return buf_size_ - actual_size_; }
+	bool Purge(Cursor &cursor) noexcept;
+	std::size_t GetReadableSize(const Cursor &cursor) const noexcept;
 
 private:
 	std::atomic_int state_;
+	std::atomic_bool writing_;	// a Write() may be using buf_
 	std::uint8_t *buf_;
 	std::size_t buf_size_;
-	std::atomic_size_t actual_size_;
-	std::atomic_intptr_t head_;	// read
-	std::atomic_intptr_t tail_;	// write
-	std::atomic_bool wait_;
-	std::atomic_intptr_t rw_count_;
-	std::mutex wait_lock_;
-	std::condition_variable wait_cond_;
+	std::atomic_uint generation_;	// incremented by Reset()
+	std::uint8_t pad_[64];	// keep the indices away from the read-mostly members
+	std::atomic_size_t reserve_;	// end of the region being written
+	std::atomic_size_t tail_;	// end of the written data
 };
 
 } // namespace px4
@@ -4,13 +4,19 @@
 
 namespace px4 {
 
-ServerBase::ServerBase(const std::wstring &pipe_name, px4::ReceiverManager &receiver_manager) noexcept
+ServerBase::ServerBase(const std::wstring &pipe_name, px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool) noexcept
 	: pipe_name_(pipe_name),
 	receiver_manager_(receiver_manager),
+	io_pool_(io_pool),
 	mtx_(),
-	quit_event_(nullptr)
+	quit_event_(nullptr),
+	listen_pipe_(),
+	listening_(false)
 {
 	pipe_config_ = { 0 };
+
+	ZeroMemory(&accept_req_, sizeof(accept_req_));
+	accept_req_.handler = this;
 }
 
 ServerBase::~ServerBase()
@@ -20,64 +26,48 @@ ServerBase::~ServerBase()
 
 bool ServerBase::Start() noexcept
 {
-	if (th_) {
+	if (quit_event_) {
 		error_.assign(EINVAL, std::generic_category());
 		return false;
 	}
 
+	quit_event_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
 	if (!quit_event_) {
-		quit_event_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
-		if (!quit_event_) {
-			error_.assign(GetLastError(), std::system_category());
-			return false;
-		}
-	}
-
-	HANDLE ready_event;
-
-	ready_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
-	if (!ready_event) {
-		CloseHandle(quit_event_);
-		quit_event_ = nullptr;
-
 		error_.assign(GetLastError(), std::system_category());
 		return false;
 	}
 
-	try {
-		th_.reset(new std::thread(&px4::ServerBase::Worker, this, ready_event));
-	} catch (const std::system_error &e) {
-		CloseHandle(ready_event);
+	// the clients can connect once it returns
+	if (!Listen()) {
 		CloseHandle(quit_event_);
 		quit_event_ = nullptr;
-
-		error_.assign(e.code().value(), e.code().category());
 		return false;
 	}
 
-	WaitForSingleObject(ready_event, INFINITE);
-	CloseHandle(ready_event);
-
 	return true;
 }
 
 bool ServerBase::Stop() noexcept
 {
-	if (!th_) {
+	if (!quit_event_) {
 		error_.assign(EINVAL, std::generic_category());
 		return false;
 	}
 
 	SetEvent(quit_event_);
-	try {
-		th_->join();
-	} catch (...) {}
-
-	th_.reset();
 
 	try {
 		std::unique_lock<std::mutex> lock(mtx_);
 
+		if (listen_pipe_)
+			listen_pipe_->Cancel();
+
+		while (listening_)
+			cond_.wait(lock);
+
+		for (auto &conn : conns_)
+			conn->Cancel();
+
 		while (conns_.size())
 			cond_.wait(lock);
 
@@ -100,7 +90,7 @@ std::size_t ServerBase::GetActiveConnectionCount() const noexcept
 void ServerBase::RemoveConnection(Connection *conn, bool destruct) noexcept
 {
 	bool empty = false;
-	
+
 	try {
 		std::lock_guard<std::mutex> lock(mtx_);
 
@@ -121,28 +111,90 @@ void ServerBase::RemoveConnection(Connection *conn, bool destruct) noexcept
 		cond_.notify_all();
 }
 
-void ServerBase::Worker(HANDLE ready_event) noexcept
+// creates the next instance of the pipe and waits for a client on it
+bool ServerBase::Listen() noexcept
 {
-	while (true) {
-		std::unique_ptr<px4::PipeServer> pipe(new px4::PipeServer());
+	std::lock_guard<std::mutex> lock(mtx_);
+	bool connected = false;
 
-		if (!pipe->Accept(pipe_name_, pipe_config_, ready_event, quit_event_))
-			break;
+	// Stop() cancels the pending accept under the lock
+	if (WaitForSingleObject(quit_event_, 0) != WAIT_TIMEOUT) {
+		error_.assign(ECANCELED, std::generic_category());
+		goto fail;
+	}
 
-		ready_event = NULL;
+	try {
+		listen_pipe_.reset(new px4::PipeServer());
+	} catch (...) {
+		error_.assign(ENOMEM, std::generic_category());
+		goto fail;
+	}
+
+	if (!listen_pipe_->Create(pipe_name_, pipe_config_)) {
+		error_ = listen_pipe_->GetError();
+		goto fail;
+	}
+
+	if (!io_pool_.Associate(listen_pipe_->GetHandle())) {
+		error_ = io_pool_.GetError();
+		goto fail;
+	}
+
+	ZeroMemory(&accept_req_.ol, sizeof(accept_req_.ol));
+
+	if (!listen_pipe_->Listen(accept_req_.ol, connected)) {
+		error_ = listen_pipe_->GetError();
+		goto fail;
+	}
+
+	if (connected && !io_pool_.Post(accept_req_, 0)) {
+		error_ = io_pool_.GetError();
+		goto fail;
+	}
+
+	listening_ = true;
+
+	return true;
+
+fail:
+	listen_pipe_.reset();
+	listening_ = false;
+	cond_.notify_all();
+
+	return false;
+}
+
+// a client has connected to listen_pipe_
+void ServerBase::OnComplete(OVERLAPPED *ol, bool result, std::size_t size) noexcept
+{
+	std::unique_ptr<px4::PipeServer> pipe;
+	Connection *conn = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
 
+		pipe = std::move(listen_pipe_);
+	}
+
+	if (result) {
 		try {
+			conn = CreateConnection(pipe);
+
 			std::lock_guard<std::mutex> lock(mtx_);
 
-			auto &p = conns_.emplace_back(std::unique_ptr<Connection>());
-			p.reset(CreateConnection(pipe));
-			if (!p->Start())
-				break;
+			conns_.emplace_back(conn);
 		} catch (...) {
-			break;
+			// not in conns_, RemoveConnection() has nothing to do
+			delete conn;
+			conn = nullptr;
 		}
+
+		if (conn && !conn->Start())
+			delete conn;
 	}
 
+	Listen();
+
 	return;
 }
 
@@ -152,53 +204,115 @@ ServerBase::Connection::Connection(ServerBase &parent, std::unique_ptr<px4::Pipe
 	config_(parent_.pipe_config_),
 	receiver_manager_(parent_.receiver_manager_),
 	quit_event_(parent.quit_event_),
-	th_()
+	buf_(),
+	io_mtx_(),
+	canceled_(false),
+	write_size_(0)
 {
+	ZeroMemory(&read_req_, sizeof(read_req_));
+	read_req_.handler = this;
 
+	ZeroMemory(&write_req_, sizeof(write_req_));
+	write_req_.handler = this;
 }
 
 ServerBase::Connection::~Connection()
 {
-	Stop();
-	conn_.reset();
-
+	// Stop() may cancel the connection until it has been removed
 	parent_.RemoveConnection(this, false);
+	conn_.reset();
 }
 
+// the connection must be deleted by the caller if it fails
 bool ServerBase::Connection::Start() noexcept
 {
-	if (th_) {
+	if (buf_) {
 		error_.assign(EINVAL, std::generic_category());
 		return false;
 	}
 
 	try {
-		th_.reset(new std::thread(&px4::ServerBase::Connection::Worker, this));
-	} catch (const std::system_error &e) {
-		error_.assign(static_cast<int>(e.code().value()), e.code().category());
+		buf_.reset(new std::uint8_t[config_.in_buffer_size]);
+	} catch (...) {
+		error_.assign(ENOMEM, std::generic_category());
+		return false;
+	}
+
+	return RequestRead();
+}
+
+void ServerBase::Connection::Cancel() noexcept
+{
+	std::lock_guard<std::mutex> lock(io_mtx_);
+
+	canceled_ = true;
+	conn_->Cancel();
+}
+
+bool ServerBase::Connection::RequestRead() noexcept
+{
+	std::lock_guard<std::mutex> lock(io_mtx_);
+
+	// a read requested after Cancel() would never complete
+	if (canceled_) {
+		error_.assign(ECANCELED, std::generic_category());
+		return false;
+	}
+
+	ZeroMemory(&read_req_.ol, sizeof(read_req_.ol));
+
+	if (!conn_->BeginRead(buf_.get(), config_.in_buffer_size, read_req_.ol)) {
+		error_ = conn_->GetError();
 		return false;
 	}
 
 	return true;
 }
 
-bool ServerBase::Connection::Stop() noexcept
+// the reply in buf_, the next command is read when it has been written
+bool ServerBase::Connection::RequestWrite(std::size_t size) noexcept
 {
-	if (!th_) {
-		error_.assign(EINVAL, std::generic_category());
+	std::lock_guard<std::mutex> lock(io_mtx_);
+
+	if (canceled_) {
+		error_.assign(ECANCELED, std::generic_category());
 		return false;
 	}
 
-	try {
-		if (std::this_thread::get_id() == th_->get_id())
-			th_->detach();
-		else
-			th_->join();
-	} catch (...) {}
+	ZeroMemory(&write_req_.ol, sizeof(write_req_.ol));
+	write_size_ = size;
 
-	th_.reset();
+	if (!conn_->BeginWrite(buf_.get(), size, write_req_.ol)) {
+		error_ = conn_->GetError();
+		return false;
+	}
 
 	return true;
 }
 
+void ServerBase::Connection::OnComplete(OVERLAPPED *ol, bool result, std::size_t size) noexcept
+{
+	bool ret;
+
+	if (!result)
+		ret = false;
+	else if (ol == &read_req_.ol)
+		ret = OnRead(size);
+	else
+		ret = (size == write_size_ && RequestRead());
+
+	if (!ret)
+		Close();
+
+	return;
+}
+
+// no operation is pending any more
+void ServerBase::Connection::Close() noexcept
+{
+	OnClose();
+
+	delete this;
+}
+
 } // namespace px4
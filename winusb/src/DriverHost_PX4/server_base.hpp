@@ -6,19 +6,21 @@
 #include <memory>
 #include <deque>
 #include <mutex>
-#include <thread>
+#include <condition_variable>
 #include <system_error>
 
 #include <windows.h>
 
+#include "io_pool.hpp"
 #include "pipe_server.hpp"
 #include "receiver_manager.hpp"
 
 namespace px4 {
 
-class ServerBase {
+// The pipes are accepted and served on the I/O pool, no thread is dedicated to a connection.
+class ServerBase : private px4::IoPool::Handler {
 public:
-	explicit ServerBase(const std::wstring &pipe_name, px4::ReceiverManager &receiver_manager) noexcept;
+	explicit ServerBase(const std::wstring &pipe_name, px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool) noexcept;
 	virtual ~ServerBase();
 
 	// cannot copy
@@ -37,7 +39,7 @@ public:
 	const std::error_condition& GetError() const noexcept { return error_; }
 
 protected:
-	class Connection {
+	class Connection : private px4::IoPool::Handler {
 	public:
 		explicit Connection(ServerBase &parent, std::unique_ptr<px4::PipeServer> &pipe) noexcept;
 		virtual ~Connection();
@@ -51,37 +53,60 @@ protected:
 		Connection& operator=(Connection &&) = delete;
 
 		bool Start() noexcept;
-		bool Stop() noexcept;
+		void Cancel() noexcept;
 
 		const std::error_condition& GetError() const noexcept { return error_; }
 
 	protected:
-		virtual void Worker() noexcept {};
+		// the command is in buf_, the next read or write must be requested, or false to disconnect
+		virtual bool OnRead(std::size_t size) noexcept = 0;
+		// called before the connection is deleted
+		virtual void OnClose() noexcept {};
+
+		bool RequestRead() noexcept;
+		bool RequestWrite(std::size_t size) noexcept;
 
 		ServerBase &parent_;
 		std::unique_ptr<PipeServer> conn_;
 		px4::PipeServer::PipeServerConfig config_;
 		px4::ReceiverManager &receiver_manager_;
 		HANDLE quit_event_;
+		std::unique_ptr<std::uint8_t[]> buf_;
 
 		std::error_condition error_;
-		std::unique_ptr<std::thread> th_;
+
+	private:
+		void OnComplete(OVERLAPPED *ol, bool result, std::size_t size) noexcept override;
+		void Close() noexcept;
+
+		std::mutex io_mtx_;
+		bool canceled_;
+		px4::IoPool::Request read_req_;
+		px4::IoPool::Request write_req_;
+		std::size_t write_size_;
 	};
 
 	virtual Connection* CreateConnection(std::unique_ptr<px4::PipeServer> &pipe) = 0;
 	void RemoveConnection(Connection *conn, bool destruct) noexcept;
-	void Worker(HANDLE ready_event) noexcept;
 
 	const std::wstring pipe_name_;
 	px4::PipeServer::PipeServerConfig pipe_config_;
 	px4::ReceiverManager &receiver_manager_;
+	px4::IoPool &io_pool_;
 
 	std::error_condition error_;
 	mutable std::mutex mtx_;
 	std::condition_variable cond_;
 	std::deque<std::unique_ptr<Connection>> conns_;
 	HANDLE quit_event_;
-	std::unique_ptr<std::thread> th_;
+
+private:
+	void OnComplete(OVERLAPPED *ol, bool result, std::size_t size) noexcept override;
+	bool Listen() noexcept;
+
+	std::unique_ptr<px4::PipeServer> listen_pipe_;
+	px4::IoPool::Request accept_req_;
+	bool listening_;
 };
 
 } // namespace px4
@@ -4,17 +4,20 @@
 
 #include "stream_server.hpp"
 
+#include <cstring>
+#include <string>
 #include <thread>
 
 #include <windows.h>
 
 #include "msg.h"
 #include "command.hpp"
+#include "thread_config.h"
 
 namespace px4 {
 
-StreamServer::StreamServer(px4::ReceiverManager &receiver_manager) noexcept
-	: ServerBase(L"px4_data_pipe", receiver_manager)
+StreamServer::StreamServer(px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool) noexcept
+	: ServerBase(L"px4_data_pipe", receiver_manager, io_pool)
 {
 	pipe_config_.in_buffer_size = 512;
 	pipe_config_.out_buffer_size = 188 * 4096;
@@ -29,84 +32,183 @@ px4::ServerBase::Connection* StreamServer::CreateConnection(std::unique_ptr<px4:
 }
 
 StreamServer::StreamConnection::StreamConnection(ServerBase &parent, std::unique_ptr<px4::PipeServer> &pipe) noexcept
-	: Connection(parent, pipe)
+	: Connection(parent, pipe),
+	ring_(),
+	stop_event_(nullptr),
+	session_(),
+	stream_th_()
 {
 
 }
 
-void StreamServer::StreamConnection::Worker() noexcept
+StreamServer::StreamConnection::~StreamConnection()
 {
-	std::size_t size = config_.in_buffer_size;
-	std::unique_ptr<std::uint8_t[]> buf(new std::uint8_t[size]);
-	px4::ReceiverBase *receiver = nullptr;
-	std::unique_ptr<std::thread> stream_th;
-
-	while (true) {
-		std::size_t read;
+	if (stop_event_)
+		CloseHandle(stop_event_);
+}
 
-		if (!conn_->Read(buf.get(), size, read, quit_event_))
-			break;
+bool StreamServer::StreamConnection::OpenSharedRing(const px4::command::DataCmd &cmd) noexcept
+{
+	std::wstring name(cmd.shared_ring.name, wcsnlen(cmd.shared_ring.name, _countof(cmd.shared_ring.name)));
 
-		int ret = true;
-		px4::command::DataCmd *cmd = reinterpret_cast<px4::command::DataCmd *>(buf.get());
+	if (ring_ || name.empty())
+		return false;
 
-		switch (cmd->cmd) {
-		case px4::command::DataCmdCode::SET_DATA_ID:
-			if (receiver)
-				break;
+	if (!stop_event_) {
+		stop_event_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		if (!stop_event_)
+			return false;
+	}
 
-			receiver = receiver_manager_.SearchByDataId(cmd->data_id);
-			if (!receiver) {
-				ret = false;
-				break;
-			}
+	try {
+		ring_.reset(new px4::SharedRing());
+	} catch (...) {
+		return false;
+	}
 
-			try {
-				stream_th.reset(new std::thread(&px4::StreamServer::StreamConnection::StreamWorker, this, receiver->GetStreamBuffer()));
-			} catch (...) {
-				ret = false;
-				break;
-			}
+	if (!ring_->Open(name, cmd.shared_ring.size)) {
+		msg_err("px4::StreamServer::StreamConnection::OpenSharedRing: cannot open the shared ring.\n");
+		ring_.reset();
+		return false;
+	}
 
-			break;
+	return true;
+}
 
-		case px4::command::DataCmdCode::PURGE:
-			if (!receiver)
-				break;
+bool StreamServer::StreamConnection::OnRead(std::size_t size) noexcept
+{
+	px4::command::DataCmd *cmd = reinterpret_cast<px4::command::DataCmd *>(buf_.get());
 
-			receiver->GetStreamBuffer()->Purge();
+	switch (cmd->cmd) {
+	case px4::command::DataCmdCode::SET_DATA_ID:
+		if (session_)
 			break;
 
-		default:
-			ret = false;
-			break;
+		session_ = receiver_manager_.SearchByDataId(cmd->data_id);
+		if (!session_)
+			return false;
+
+		// the stream is sent by a thread of its own, the pool only serves the commands
+		try {
+			stream_th_.reset(new std::thread(&px4::StreamServer::StreamConnection::StreamWorker, this, session_));
+		} catch (...) {
+			return false;
 		}
 
-		if (!ret)
+		break;
+
+	case px4::command::DataCmdCode::PURGE:
+		if (!session_)
 			break;
+
+		// older clients send no epoch, the reader is purged from here then
+		if (cmd->purge_epoch)
+			session_->RequestPurge(cmd->purge_epoch);
+		else
+			session_->Purge();
+
+		break;
+
+	case px4::command::DataCmdCode::SET_SHARED_RING:
+		// must be requested before SET_DATA_ID, the pipe carries no data yet
+		if (session_ || !OpenSharedRing(*cmd))
+			cmd->shared_ring.size = 0;
+
+		return RequestWrite(sizeof(*cmd));
+
+	default:
+		return false;
 	}
 
-	if (receiver && stream_th) {
-		receiver->GetStreamBuffer()->StopRequest();
+	return RequestRead();
+}
+
+// called by the stream thread only, right after the reader has been purged
+bool StreamServer::StreamConnection::WriteMarker(std::uint32_t epoch) noexcept
+{
+	px4::command::PurgeMarker marker;
+	std::size_t size;
+
+	std::memcpy(marker.magic, px4::command::PURGE_MARKER_MAGIC, sizeof(marker.magic));
+	marker.epoch = epoch;
+	marker.epoch_inv = ~epoch;
+
+	if (ring_)
+		return ring_->Write(&marker, sizeof(marker), stop_event_);
+
+	return conn_->Write(&marker, sizeof(marker), size, quit_event_) && size == sizeof(marker);
+}
+
+void StreamServer::StreamConnection::OnClose() noexcept
+{
+	if (session_)
+		session_->Close();
+
+	if (stream_th_) {
+		if (stop_event_)
+			SetEvent(stop_event_);
 
-		stream_th->join();
-		stream_th.reset();
+		stream_th_->join();
+		stream_th_.reset();
 	}
 
-	delete this;
+	session_.reset();
 }
 
-void StreamServer::StreamConnection::StreamWorker(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf) noexcept
+void StreamServer::StreamConnection::StreamWorker(std::shared_ptr<px4::ReceiverManager::Session> session) noexcept
 {
 	msg_dbg("px4::StreamServer::StreamConnection::StreamWorker\n");
 
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
-
-	stream_buf->HandleRead(config_.out_buffer_size / 4,
-		[this](const void *buf, std::size_t size) {
-			return conn_->Write(buf, size, size, quit_event_);
+	HANDLE mmcss = thread_config_apply(THREAD_ROLE_STREAM);
+
+	std::shared_ptr<px4::ReceiverBase::StreamBuffer::Reader> reader;
+	bool ret = true;
+
+	// the reader is replaced when the client is moved to another receiver
+	while (ret && (reader = session->WaitReader(reader))) {
+		if (ring_) {
+			reader->HandleRead(
+				[this, &ret, &session, &reader](void *&buf, std::size_t &size) {
+					std::uint32_t epoch = session->TakePurge();
+
+					// nothing has been read for this write yet
+					if (epoch) {
+						reader->Purge();
+						if (!(ret = WriteMarker(epoch)))
+							return false;
+					}
+
+					return (ret = ring_->BeginWrite(buf, size, stop_event_));
+				},
+				[this](std::size_t size) {
+					ring_->EndWrite(size);
+					return true;
+				}
+			);
+		} else {
+			reader->HandleRead(config_.out_buffer_size / 4,
+				[this, &ret, &session, &reader](const void *buf, std::size_t size) {
+					std::uint32_t epoch = session->TakePurge();
+
+					// the data has been read before the purge was applied, it is dropped as well
+					if (epoch) {
+						reader->Purge();
+						return (ret = WriteMarker(epoch));
+					}
+
+					return (ret = conn_->Write(buf, size, size, quit_event_));
+				}
+			);
 		}
-	);
+
+		if (reader->GetOverflowSize())
+			msg_dbg("px4::StreamServer::StreamConnection::StreamWorker: overflow: %llu bytes\n", reader->GetOverflowSize());
+	}
+
+	if (ring_)
+		ring_->Shutdown();
+
+	thread_config_revert(mmcss);
 
 	msg_dbg("px4::StreamServer::StreamConnection::StreamWorker: exit\n");
 
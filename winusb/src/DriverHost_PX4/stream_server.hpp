@@ -5,17 +5,22 @@
 #include <cstdint>
 #include <memory>
 #include <atomic>
+#include <thread>
 
+#include <windows.h>
+
+#include "io_pool.hpp"
 #include "server_base.hpp"
 #include "pipe_server.hpp"
 #include "receiver_base.hpp"
 #include "receiver_manager.hpp"
+#include "shared_ring.hpp"
 
 namespace px4 {
 
 class StreamServer final : public px4::ServerBase {
 public:
-	explicit StreamServer(px4::ReceiverManager &receiver_manager) noexcept;
+	explicit StreamServer(px4::ReceiverManager &receiver_manager, px4::IoPool &io_pool) noexcept;
 	~StreamServer() {}
 
 	// cannot copy
@@ -30,7 +35,7 @@ private:
 	class StreamConnection final : public px4::ServerBase::Connection {
 	public:
 		explicit StreamConnection(ServerBase &parent, std::unique_ptr<px4::PipeServer> &pipe) noexcept;
-		~StreamConnection() {}
+		~StreamConnection();
 
 		// cannot copy
 		StreamConnection(const StreamConnection &) = delete;
@@ -41,8 +46,16 @@ private:
 		StreamConnection& operator=(StreamConnection &&) = delete;
 
 	private:
-		void Worker() noexcept override;
-		void StreamWorker(std::shared_ptr<px4::ReceiverBase::StreamBuffer> stream_buf) noexcept;
+		bool OnRead(std::size_t size) noexcept override;
+		void OnClose() noexcept override;
+		bool OpenSharedRing(const px4::command::DataCmd &cmd) noexcept;
+		bool WriteMarker(std::uint32_t epoch) noexcept;
+		void StreamWorker(std::shared_ptr<px4::ReceiverManager::Session> session) noexcept;
+
+		std::unique_ptr<px4::SharedRing> ring_;
+		HANDLE stop_event_;
+		std::shared_ptr<px4::ReceiverManager::Session> session_;
+		std::unique_ptr<std::thread> stream_th_;	// the only thread of the connection
 	};
 
 	px4::ServerBase::Connection* CreateConnection(std::unique_ptr<px4::PipeServer> &pipe) override;
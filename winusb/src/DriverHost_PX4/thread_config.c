@@ -0,0 +1,69 @@
+// thread_config.c
+
+#define msg_prefix	"DriverHost_PX4"
+
+#include "thread_config.h"
+
+#include <avrt.h>
+
+#include "msg.h"
+
+// must be set before the threads are started
+static struct thread_config thread_configs[THREAD_ROLE_NUM] = {
+	{ true, THREAD_PRIORITY_TIME_CRITICAL, L"", 0 },	// THREAD_ROLE_STREAM
+	{ true, THREAD_PRIORITY_TIME_CRITICAL, L"", 0 },	// THREAD_ROLE_USB
+};
+
+void thread_config_get(enum thread_role role, struct thread_config *config)
+{
+	if (role < THREAD_ROLE_NUM)
+		*config = thread_configs[role];
+
+	return;
+}
+
+void thread_config_set(enum thread_role role, const struct thread_config *config)
+{
+	if (role < THREAD_ROLE_NUM)
+		thread_configs[role] = *config;
+
+	return;
+}
+
+// Applies the config of the role to the current thread.
+// The returned handle must be passed to thread_config_revert() before the thread exits.
+HANDLE thread_config_apply(enum thread_role role)
+{
+	const struct thread_config *config;
+	HANDLE mmcss = NULL;
+
+	if (role >= THREAD_ROLE_NUM)
+		return NULL;
+
+	config = &thread_configs[role];
+
+	if (config->affinity && !SetThreadAffinityMask(GetCurrentThread(), config->affinity))
+		msg_err("thread_config_apply: SetThreadAffinityMask() failed. (role: %d, code: 0x%08x)\n", role, GetLastError());
+
+	if (config->mmcss_task[0]) {
+		DWORD index = 0;
+
+		mmcss = AvSetMmThreadCharacteristicsW(config->mmcss_task, &index);
+		if (!mmcss)
+			msg_err("thread_config_apply: AvSetMmThreadCharacteristicsW() failed. (role: %d, code: 0x%08x)\n", role, GetLastError());
+	}
+
+	// the priority is managed by MMCSS while the thread is registered
+	if (!mmcss && config->set_priority && !SetThreadPriority(GetCurrentThread(), config->priority))
+		msg_err("thread_config_apply: SetThreadPriority() failed. (role: %d, code: 0x%08x)\n", role, GetLastError());
+
+	return mmcss;
+}
+
+void thread_config_revert(HANDLE mmcss)
+{
+	if (mmcss)
+		AvRevertMmThreadCharacteristics(mmcss);
+
+	return;
+}
@@ -0,0 +1,32 @@
+// thread_config.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <wchar.h>
+
+#include <windows.h>
+
+enum thread_role {
+	THREAD_ROLE_STREAM = 0,	// sends the stream to the clients
+	THREAD_ROLE_USB,	// completes the bulk-IN transfers
+	THREAD_ROLE_NUM
+};
+
+struct thread_config {
+	bool set_priority;
+	int priority;
+	wchar_t mmcss_task[32];	// MMCSS is not used if empty
+	DWORD_PTR affinity;	// not changed if 0
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void thread_config_get(enum thread_role role, struct thread_config *config);
+void thread_config_set(enum thread_role role, const struct thread_config *config);
+HANDLE thread_config_apply(enum thread_role role);
+void thread_config_revert(HANDLE mmcss);
+#ifdef __cplusplus
+}
+#endif
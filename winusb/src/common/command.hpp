@@ -13,7 +13,12 @@ namespace px4 {
 #pragma pack(push, 8)
 
 namespace command {
-	static const std::uint32_t VERSION = 0x00040002U;
+	static const std::uint32_t VERSION = 0x00040007U;
+	static const std::uint32_t SHARED_RING_MIN_VERSION = 0x00040003U;
+	static const std::uint32_t TUNE_ASYNC_MIN_VERSION = 0x00040004U;
+	static const std::uint32_t WAIT_STATS_MIN_VERSION = 0x00040005U;
+	static const std::uint32_t SET_CHANNEL_MIN_VERSION = 0x00040006U;
+	static const std::uint32_t PURGE_MARKER_MIN_VERSION = 0x00040007U;
 
 	enum class CtrlCmdCode : std::uint32_t {
 		UNDEFINED = 0,
@@ -27,8 +32,12 @@ namespace command {
 		CLEAR_PARAMS,
 		TUNE,
 		CHECK_LOCK,
+		TUNE_ASYNC,	// returns as soon as the tune has been started
+		WAIT_TUNE,	// waits for the result of TUNE_ASYNC
 		SET_LNB_VOLTAGE = 24,
 		READ_STATS = 32,
+		WAIT_STATS,	// waits for the stats newer than the given sequence
+		SET_CHANNEL = 40,	// SET_LNB_VOLTAGE, SET_PARAMS, TUNE and so on in one round trip
 	};
 
 	enum class CtrlStatusCode : std::uint32_t {
@@ -100,7 +109,7 @@ namespace command {
 	};
 
 	struct CtrlTuneCmd : CtrlCmdHeader {
-		std::uint32_t timeout;
+		std::uint32_t timeout;	// TUNE and TUNE_ASYNC: lock timeout, WAIT_TUNE: wait timeout
 	};
 
 	struct CtrlCheckLockCmd : CtrlCmdHeader {
@@ -111,6 +120,19 @@ namespace command {
 		std::int32_t voltage;
 	};
 
+	// the steps of SET_CHANNEL, done in this order and stopped at the first failure
+	static const std::uint32_t SET_CHANNEL_LNB_VOLTAGE = 0x00000001U;	// SET_LNB_VOLTAGE with lnb_voltage first
+	static const std::uint32_t SET_CHANNEL_TUNE_ASYNC = 0x00000002U;	// TUNE_ASYNC instead of TUNE, WAIT_TUNE follows
+	static const std::uint32_t SET_CHANNEL_CAPTURE = 0x00000004U;		// SET_CAPTURE on after the tune
+	static const std::uint32_t SET_CHANNEL_PURGE = 0x00000008U;		// PURGE of the data pipe at last
+
+	struct CtrlSetChannelCmd : CtrlCmdHeader {
+		std::uint32_t flags;
+		std::int32_t lnb_voltage;
+		std::uint32_t timeout;		// lock timeout
+		ParameterSet param_set;		// SET_PARAMS
+	};
+
 	enum class StatType : std::uint32_t {
 		UNDEFINED = 0,
 		SIGNAL_STRENGTH,
@@ -131,19 +153,41 @@ namespace command {
 		StatSet stat_set;
 	};
 
+	struct CtrlWaitStatsCmd : CtrlCmdHeader {
+		std::uint32_t timeout;	// should be shorter than the pipe timeout
+		std::uint32_t sequence;	// request: the last one received, response: the one of stat_set
+		StatSet stat_set;
+	};
+
 	enum class DataCmdCode : std::uint32_t {
 		UNDEFINED = 0,
 		SET_DATA_ID = 1,
 		PURGE = 8,
+		SET_SHARED_RING = 16,	// answered with the same command, size is 0 on failure
 	};
 
 	struct DataCmd {
 		DataCmdCode cmd;
 		union {
 			std::uint32_t data_id;
+			std::uint32_t purge_epoch;	// PURGE: non-zero to have a PurgeMarker written at the purge point
+			struct {
+				std::uint32_t size;
+				wchar_t name[64];
+			} shared_ring;
 		};
 	};
 
+	// Written into the stream by the stream thread right after it has dropped the data before the purge,
+	// everything which follows it is newer. The reader finds it by scanning, the stream is not framed.
+	struct PurgeMarker {
+		std::uint8_t magic[8];
+		std::uint32_t epoch;
+		std::uint32_t epoch_inv;	// ~epoch
+	};
+
+	static const std::uint8_t PURGE_MARKER_MAGIC[8] = { 0xff, 'P', 'X', '4', 'P', 'R', 'G', 0x00 };
+
 } // namespace command
 
 #pragma pack(pop)
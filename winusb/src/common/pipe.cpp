@@ -33,6 +33,12 @@ bool Pipe::Read(void *buf, std::size_t size, std::size_t &return_size) noexcept
 }
 
 bool Pipe::Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event) noexcept
+{
+	return Read(buf, size, return_size, cancel_event, INFINITE);
+}
+
+// succeeds with return_size 0 if nothing has arrived within the timeout
+bool Pipe::Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event, DWORD timeout) noexcept
 {
 	if (!ol_event_[0]) {
 		ol_event_[0] = CreateEventW(nullptr, TRUE, FALSE, nullptr);
@@ -46,7 +52,8 @@ bool Pipe::Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE ca
 	OVERLAPPED ol = { 0 };
 
 	ResetEvent(ol_event_[0]);
-	ol.hEvent = ol_event_[0];
+	// the low-order bit keeps the completion off the port the handle may be associated with
+	ol.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(ol_event_[0]) | 1);
 
 	if (ReadFile(handle_, buf, static_cast<DWORD>(size), &read, &ol)) {
 		return_size = read;
@@ -62,12 +69,30 @@ bool Pipe::Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE ca
 	HANDLE events[2] = { ol_event_[0], cancel_event };
 	DWORD res;
 
-	res = WaitForMultipleObjects((cancel_event) ? 2 : 1, events, FALSE, INFINITE);
+	res = WaitForMultipleObjects((cancel_event) ? 2 : 1, events, FALSE, timeout);
 	if (res == WAIT_FAILED) {
 		error_.assign(GetLastError(), std::system_category());
 		return false;
 	}
 
+	if (res == WAIT_TIMEOUT) {
+		// no data is lost by the cancel, it may have completed in the meantime though
+		CancelIoEx(handle_, &ol);
+
+		if (!GetOverlappedResult(handle_, &ol, &read, TRUE)) {
+			err = GetLastError();
+			if (err != ERROR_OPERATION_ABORTED) {
+				error_.assign(err, std::system_category());
+				return false;
+			}
+
+			read = 0;
+		}
+
+		return_size = read;
+		return true;
+	}
+
 	if (res != WAIT_OBJECT_0) {
 		error_.assign(ECANCELED, std::generic_category());
 		return false;
@@ -102,7 +127,8 @@ bool Pipe::Write(const void *buf, std::size_t size, std::size_t &return_size, HA
 	OVERLAPPED ol = { 0 };
 
 	ResetEvent(ol_event_[1]);
-	ol.hEvent = ol_event_[1];
+	// the low-order bit keeps the completion off the port the handle may be associated with
+	ol.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(ol_event_[1]) | 1);
 
 	if (WriteFile(handle_, buf, static_cast<DWORD>(size), &written, &ol)) {
 		return_size = written;
@@ -25,6 +25,7 @@ public:
 
 	bool Read(void *buf, std::size_t size, std::size_t &return_size) noexcept;
 	bool Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event) noexcept;
+	bool Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event, DWORD timeout) noexcept;
 	bool Write(const void *buf, std::size_t size, std::size_t &return_size) noexcept;
 	bool Write(const void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event) noexcept;
 	bool Call(void *buf, std::size_t size) noexcept;
@@ -0,0 +1,267 @@
+// shared_ring.cpp
+
+#include "shared_ring.hpp"
+
+#include <cstring>
+
+#include "security_attributes.hpp"
+
+namespace px4 {
+
+SharedRing::SharedRing() noexcept
+	: mapping_(nullptr),
+	header_(nullptr),
+	data_(nullptr),
+	size_(0),
+	data_event_(nullptr),
+	space_event_(nullptr),
+	purge_(false)
+{
+
+}
+
+SharedRing::~SharedRing()
+{
+	Close();
+}
+
+bool SharedRing::Create(const std::wstring &name, std::size_t size) noexcept
+{
+	return Map(true, name, size);
+}
+
+bool SharedRing::Open(const std::wstring &name, std::size_t size) noexcept
+{
+	return Map(false, name, size);
+}
+
+bool SharedRing::Map(bool create, const std::wstring &name, std::size_t size) noexcept
+{
+	if (header_ || !size || size > 0x10000000)
+		return false;
+
+	std::size_t total = sizeof(Header) + size;
+
+	try {
+		if (create) {
+			SecurityAttributes sa(FILE_MAP_ALL_ACCESS);
+
+			mapping_ = CreateFileMappingW(INVALID_HANDLE_VALUE, sa.Get(), PAGE_READWRITE, 0, static_cast<DWORD>(total), name.c_str());
+			if (mapping_ && GetLastError() == ERROR_ALREADY_EXISTS) {
+				CloseHandle(mapping_);
+				mapping_ = nullptr;
+			}
+		} else {
+			mapping_ = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		}
+
+		if (create) {
+			SecurityAttributes sa(EVENT_ALL_ACCESS);
+
+			data_event_ = CreateEventW(sa.Get(), FALSE, FALSE, (name + L"_data").c_str());
+			space_event_ = CreateEventW(sa.Get(), FALSE, FALSE, (name + L"_space").c_str());
+		} else {
+			data_event_ = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (name + L"_data").c_str());
+			space_event_ = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (name + L"_space").c_str());
+		}
+	} catch (...) {
+		Close();
+		return false;
+	}
+
+	if (!mapping_ || !data_event_ || !space_event_) {
+		Close();
+		return false;
+	}
+
+	header_ = static_cast<Header *>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, total));
+	if (!header_) {
+		Close();
+		return false;
+	}
+
+	if (create) {
+		std::memset(header_, 0, sizeof(*header_));
+		header_->version = VERSION;
+		header_->size = static_cast<std::uint32_t>(size);
+	} else if (header_->version != VERSION || header_->size != size) {
+		Close();
+		return false;
+	}
+
+	data_ = reinterpret_cast<std::uint8_t *>(header_ + 1);
+	size_ = size;
+	purge_ = false;
+
+	return true;
+}
+
+void SharedRing::Close() noexcept
+{
+	if (space_event_) {
+		CloseHandle(space_event_);
+		space_event_ = nullptr;
+	}
+
+	if (data_event_) {
+		CloseHandle(data_event_);
+		data_event_ = nullptr;
+	}
+
+	if (header_) {
+		UnmapViewOfFile(header_);
+		header_ = nullptr;
+	}
+
+	if (mapping_) {
+		CloseHandle(mapping_);
+		mapping_ = nullptr;
+	}
+
+	data_ = nullptr;
+	size_ = 0;
+}
+
+DWORD SharedRing::Wait(HANDLE event, HANDLE cancel_event, DWORD timeout) noexcept
+{
+	HANDLE events[2] = { event, cancel_event };
+
+	return WaitForMultipleObjects((cancel_event) ? 2 : 1, events, FALSE, timeout);
+}
+
+bool SharedRing::BeginWrite(void *&buf, std::size_t &size, HANDLE cancel_event) noexcept
+{
+	if (!header_)
+		return false;
+
+	std::uint64_t write_count = header_->write_count.load(std::memory_order_relaxed);
+	std::size_t free_size;
+
+	while (!(free_size = size_ - static_cast<std::size_t>(write_count - header_->read_count.load(std::memory_order_acquire)))) {
+		if (Wait(space_event_, cancel_event, INFINITE) != WAIT_OBJECT_0)
+			return false;
+	}
+
+	std::size_t ofs = static_cast<std::size_t>(write_count % size_);
+
+	buf = data_ + ofs;
+	size = (free_size < size_ - ofs) ? free_size : (size_ - ofs);
+
+	return true;
+}
+
+void SharedRing::EndWrite(std::size_t size) noexcept
+{
+	if (!header_ || !size)
+		return;
+
+	header_->write_count.store(header_->write_count.load(std::memory_order_relaxed) + size, std::memory_order_release);
+	SetEvent(data_event_);
+}
+
+// copies the whole buffer, across the end of the data area if needed
+bool SharedRing::Write(const void *buf, std::size_t size, HANDLE cancel_event) noexcept
+{
+	const std::uint8_t *p = static_cast<const std::uint8_t *>(buf);
+
+	while (size) {
+		void *wbuf;
+		std::size_t wsize;
+
+		if (!BeginWrite(wbuf, wsize, cancel_event))
+			return false;
+
+		if (wsize > size)
+			wsize = size;
+
+		std::memcpy(wbuf, p, wsize);
+		EndWrite(wsize);
+
+		p += wsize;
+		size -= wsize;
+	}
+
+	return true;
+}
+
+void SharedRing::Shutdown() noexcept
+{
+	if (!header_)
+		return;
+
+	header_->closed.store(1, std::memory_order_release);
+	SetEvent(data_event_);
+}
+
+// succeeds with return_size 0 if nothing has been written within the timeout
+bool SharedRing::Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event, DWORD timeout) noexcept
+{
+	if (!header_)
+		return false;
+
+	std::uint64_t read_count = header_->read_count.load(std::memory_order_relaxed);
+	std::uint64_t write_count;
+	ULONGLONG deadline = (timeout != INFINITE) ? GetTickCount64() + timeout : 0;
+
+	while (true) {
+		write_count = header_->write_count.load(std::memory_order_acquire);
+
+		if (purge_.exchange(false)) {
+			// drop everything written so far
+			read_count = write_count;
+			header_->read_count.store(read_count, std::memory_order_release);
+			SetEvent(space_event_);
+		}
+
+		if (write_count != read_count)
+			break;
+
+		if (header_->closed.load(std::memory_order_acquire))
+			return false;
+
+		DWORD wait = INFINITE;
+
+		if (deadline) {
+			ULONGLONG now = GetTickCount64();
+
+			wait = (now < deadline) ? static_cast<DWORD>(deadline - now) : 0;
+		}
+
+		switch (Wait(data_event_, cancel_event, wait)) {
+		case WAIT_OBJECT_0:
+			break;
+
+		case WAIT_TIMEOUT:
+			return_size = 0;
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	std::size_t avail = static_cast<std::size_t>(write_count - read_count);
+	std::size_t ofs = static_cast<std::size_t>(read_count % size_);
+	std::uint8_t *p = static_cast<std::uint8_t *>(buf);
+
+	if (size > avail)
+		size = avail;
+
+	if (ofs + size <= size_) {
+		std::memcpy(p, data_ + ofs, size);
+	} else {
+		std::size_t tmp = size_ - ofs;
+
+		std::memcpy(p, data_ + ofs, tmp);
+		std::memcpy(p + tmp, data_, size - tmp);
+	}
+
+	header_->read_count.store(read_count + size, std::memory_order_release);
+	SetEvent(space_event_);
+
+	return_size = size;
+
+	return true;
+}
+
+} // namespace px4
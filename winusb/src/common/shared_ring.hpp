@@ -0,0 +1,71 @@
+// shared_ring.hpp
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+#include <windows.h>
+
+namespace px4 {
+
+// single producer (DriverHost_PX4), single consumer (BonDriver_PX4)
+class SharedRing final {
+public:
+	static const std::uint32_t VERSION = 1;
+
+#pragma pack(push, 8)
+	struct Header {
+		std::uint32_t version;
+		std::uint32_t size;		// size of the data area
+		std::atomic<std::uint32_t> closed;	// set by the producer
+		std::uint8_t reserved0[52];
+		std::atomic<std::uint64_t> write_count;	// owned by the producer
+		std::uint8_t reserved1[56];
+		std::atomic<std::uint64_t> read_count;	// owned by the consumer
+		std::uint8_t reserved2[56];
+	};
+#pragma pack(pop)
+
+	SharedRing() noexcept;
+	~SharedRing();
+
+	// cannot copy
+	SharedRing(const SharedRing &) = delete;
+	SharedRing& operator=(const SharedRing &) = delete;
+
+	// cannot move
+	SharedRing(SharedRing &&) = delete;
+	SharedRing& operator=(SharedRing &&) = delete;
+
+	bool Create(const std::wstring &name, std::size_t size) noexcept;	// consumer
+	bool Open(const std::wstring &name, std::size_t size) noexcept;	// producer
+	void Close() noexcept;
+	bool IsOpened() const noexcept { return !!header_; }
+
+	// producer
+	bool BeginWrite(void *&buf, std::size_t &size, HANDLE cancel_event) noexcept;
+	void EndWrite(std::size_t size) noexcept;
+	bool Write(const void *buf, std::size_t size, HANDLE cancel_event) noexcept;
+	void Shutdown() noexcept;
+
+	// consumer
+	bool Read(void *buf, std::size_t size, std::size_t &return_size, HANDLE cancel_event, DWORD timeout = INFINITE) noexcept;
+	void Purge() noexcept { purge_ = true; }
+
+private:
+	bool Map(bool create, const std::wstring &name, std::size_t size) noexcept;
+	DWORD Wait(HANDLE event, HANDLE cancel_event, DWORD timeout) noexcept;
+
+	HANDLE mapping_;
+	Header *header_;
+	std::uint8_t *data_;
+	std::size_t size_;
+	HANDLE data_event_;	// signaled by the producer
+	HANDLE space_event_;	// signaled by the consumer
+	std::atomic_bool purge_;
+};
+
+} // namespace px4
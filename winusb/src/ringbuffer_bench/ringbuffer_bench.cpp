@@ -0,0 +1,328 @@
+// ringbuffer_bench.cpp
+
+// Throughput of px4::RingBuffer (DriverHost_PX4/ringbuffer.cpp) against the
+// mutex/condvar ring it replaced, which is kept below as legacy::RingBuffer.
+// Each benchmark runs until it has taken at least min_time seconds and
+// reports in the style of Google Benchmark: time per operation and bytes per
+// second, where an operation is a Write() of the given size.
+//
+// ringbuffer_bench [min_time]
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+
+#include "ringbuffer.hpp"
+
+namespace legacy {
+
+// px4::RingBuffer before the SPSC rewrite, single consumer, Purge() waits for
+// Read() and Write() to leave the buffer
+class RingBuffer final {
+public:
+	explicit RingBuffer(std::size_t size)
+		: state_(0),
+		buf_(nullptr),
+		buf_size_(0),
+		actual_size_(0),
+		head_(0),
+		tail_(0),
+		wait_(false),
+		rw_count_(0)
+	{
+		buf_ = reinterpret_cast<std::uint8_t*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+		if (buf_)
+			buf_size_ = size;
+	}
+
+	~RingBuffer()
+	{
+		if (buf_)
+			VirtualFree(buf_, 0, MEM_RELEASE);
+	}
+
+	void Start() noexcept { state_ = 1; }
+
+	bool Read(void *buf, std::size_t &size) noexcept
+	{
+		if (wait_) {
+			size = 0;
+			return true;
+		}
+
+		++rw_count_;
+
+		std::size_t actual_size = actual_size_;
+		std::intptr_t head = head_;
+		std::size_t buf_size = buf_size_;
+		std::size_t read_size = (size <= actual_size) ? size : actual_size;
+
+		if (read_size) {
+			std::size_t tmp = (head + read_size <= buf_size) ? read_size : (buf_size - head);
+
+			std::memcpy(buf, buf_ + head, tmp);
+
+			if (tmp < read_size) {
+				std::memcpy(reinterpret_cast<std::uint8_t *>(buf) + tmp, buf_, read_size - tmp);
+				head = read_size - tmp;
+			} else {
+				head = (head + read_size == buf_size) ? 0 : (head + read_size);
+			}
+
+			head_ = head;
+			actual_size_ -= read_size;
+		}
+
+		if (!--rw_count_ && wait_)
+			wait_cond_.notify_all();
+
+		size = read_size;
+
+		return true;
+	}
+
+	bool Write(const void *buf, std::size_t &size) noexcept
+	{
+		if (!state_) {
+			size = 0;
+			return false;
+		}
+
+		if (wait_) {
+			size = 0;
+			return true;
+		}
+
+		++rw_count_;
+
+		std::size_t actual_size = actual_size_;
+		std::intptr_t tail = tail_;
+		std::size_t buf_size = buf_size_;
+		std::size_t write_size = (actual_size + size <= buf_size) ? size : (buf_size - actual_size);
+
+		if (write_size) {
+			std::size_t tmp = (tail + write_size <= buf_size) ? write_size : (buf_size - tail);
+
+			std::memcpy(buf_ + tail, buf, tmp);
+
+			if (tmp < write_size) {
+				std::memcpy(buf_, reinterpret_cast<const std::uint8_t *>(buf) + tmp, write_size - tmp);
+				tail = write_size - tmp;
+			} else {
+				tail = (tail + write_size == buf_size) ? 0 : (tail + write_size);
+			}
+
+			tail_ = tail;
+			actual_size_ += write_size;
+		}
+
+		if (!--rw_count_ && wait_)
+			wait_cond_.notify_all();
+
+		bool ret = (size == write_size);
+
+		size = write_size;
+		return ret;
+	}
+
+private:
+	std::atomic_int state_;
+	std::uint8_t *buf_;
+	std::size_t buf_size_;
+	std::atomic_size_t actual_size_;
+	std::atomic_intptr_t head_;
+	std::atomic_intptr_t tail_;
+	std::atomic_bool wait_;
+	std::atomic_intptr_t rw_count_;
+	std::mutex wait_lock_;
+	std::condition_variable wait_cond_;
+};
+
+} // namespace legacy
+
+namespace {
+
+// the same calls on both, the legacy ring has no cursors
+class CurrentRing final {
+public:
+	explicit CurrentRing(std::size_t size) : ringbuf_(size)
+	{
+		ringbuf_.Start();
+		ringbuf_.Attach(cursor_);
+	}
+
+	bool Read(void *buf, std::size_t &size) noexcept { return ringbuf_.Read(cursor_, buf, size); }
+	bool Write(const void *buf, std::size_t &size) noexcept { return ringbuf_.Write(buf, size); }
+
+private:
+	px4::RingBuffer ringbuf_;
+	px4::RingBuffer::Cursor cursor_;
+};
+
+class LegacyRing final {
+public:
+	explicit LegacyRing(std::size_t size) : ringbuf_(size) { ringbuf_.Start(); }
+
+	bool Read(void *buf, std::size_t &size) noexcept { return ringbuf_.Read(buf, size); }
+	bool Write(const void *buf, std::size_t &size) noexcept { return ringbuf_.Write(buf, size); }
+
+private:
+	legacy::RingBuffer ringbuf_;
+};
+
+constexpr std::size_t kPacketSize = 188;
+constexpr std::size_t kRingSize = kPacketSize * 16384;
+constexpr std::size_t kReadSize = kPacketSize * 1024;
+
+double min_time = 1.0;
+
+struct Result {
+	std::uint64_t iterations;
+	double secs;
+	std::uint64_t bytes;
+};
+
+void Report(const char *name, const Result &res, std::uint64_t lost)
+{
+	std::printf("%-36s %10llu %10.1f ns %10.1f MB/s",
+		name,
+		static_cast<unsigned long long>(res.iterations),
+		res.secs * 1e9 / res.iterations,
+		res.bytes / res.secs / 1e6);
+
+	if (lost)
+		std::printf(" (%llu bytes lost)", static_cast<unsigned long long>(lost));
+
+	std::printf("\n");
+}
+
+// writes of write_size, each read back right away on the same thread
+template <class Ring>
+void BM_WriteRead(const char *name, std::size_t write_size)
+{
+	Ring ring(kRingSize);
+	std::vector<std::uint8_t> src(write_size, 0x47), dst(kReadSize);
+	Result res = { 0, 0.0, 0 };
+
+	while (res.secs < min_time) {
+		auto start = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < 1024; i++) {
+			std::size_t size = write_size;
+
+			ring.Write(src.data(), size);
+			res.bytes += size;
+
+			do {
+				size = kReadSize;
+				ring.Read(dst.data(), size);
+			} while (size);
+		}
+
+		res.secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		res.iterations += 1024;
+	}
+
+	Report(name, res, 0);
+}
+
+// writes of write_size with a consumer thread reading as fast as it can
+// The current ring never makes the writer wait, it overwrites what has not been
+// read instead. The writer waits here for the room itself, as the legacy one
+// would, so that both move all of the data and nothing is lost.
+template <class Ring>
+void BM_ProducerConsumer(const char *name, std::size_t write_size)
+{
+	Ring ring(kRingSize);
+	std::vector<std::uint8_t> src(write_size, 0x47);
+	std::atomic_bool stop(false);
+	std::atomic<std::uint64_t> read_bytes(0);
+	Result res = { 0, 0.0, 0 };
+
+	std::thread consumer([&] {
+		std::vector<std::uint8_t> dst(kReadSize);
+
+		for (;;) {
+			std::size_t size = kReadSize;
+
+			ring.Read(dst.data(), size);
+			read_bytes.store(read_bytes.load(std::memory_order_relaxed) + size, std::memory_order_release);
+
+			if (!size) {
+				if (stop.load(std::memory_order_acquire))
+					break;
+
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (res.secs < min_time) {
+		for (int i = 0; i < 1024; i++) {
+			std::size_t left = write_size;
+
+			while (res.bytes + write_size - read_bytes.load(std::memory_order_acquire) > kRingSize)
+				std::this_thread::yield();
+
+			while (left) {
+				std::size_t size = left;
+
+				ring.Write(src.data() + (write_size - left), size);
+				left -= size;
+
+				if (left)
+					std::this_thread::yield();
+			}
+
+			res.bytes += write_size;
+		}
+
+		res.iterations += 1024;
+		res.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	stop.store(true, std::memory_order_release);
+	consumer.join();
+
+	Report(name, res, res.bytes - read_bytes);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	static const std::size_t sizes[] = { kPacketSize, kPacketSize * 8, kPacketSize * 816 };
+	char name[64];
+
+	if (argc > 1)
+		min_time = std::atof(argv[1]);
+
+	std::printf("%-36s %10s %13s %15s\n", "Benchmark", "Iterations", "Time", "Throughput");
+
+	for (std::size_t size : sizes) {
+		std::snprintf(name, sizeof(name), "BM_WriteRead<Legacy>/%zu", size);
+		BM_WriteRead<LegacyRing>(name, size);
+		std::snprintf(name, sizeof(name), "BM_WriteRead<Current>/%zu", size);
+		BM_WriteRead<CurrentRing>(name, size);
+	}
+
+	for (std::size_t size : sizes) {
+		std::snprintf(name, sizeof(name), "BM_ProducerConsumer<Legacy>/%zu", size);
+		BM_ProducerConsumer<LegacyRing>(name, size);
+		std::snprintf(name, sizeof(name), "BM_ProducerConsumer<Current>/%zu", size);
+		BM_ProducerConsumer<CurrentRing>(name, size);
+	}
+
+	return 0;
+}